@@ -6,8 +6,28 @@
 // Tianzheng Wang <tzwang@sfu.ca>
 
 #include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef PMDK
+#include <libpmemobj.h>
+#endif
 
 #include "bztree.h"
 
@@ -15,1711 +35,8828 @@ namespace bztree {
 
 #ifdef PMDK
 pmwcas::PMDKAllocator *Allocator::allocator_ = nullptr;
+std::atomic<uint64_t> Allocator::generation_{0};
 #endif
 
 uint64_t global_epoch = 0;
 
-void InternalNode::New(bztree::InternalNode **mem, uint32_t alloc_size) {
-#ifdef  PMDK
-  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  (*mem)->header.size = alloc_size;
-  *mem = Allocator::Get()->GetOffset(*mem);
-#else
-  pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  (*mem)->header.size = alloc_size;
-#endif  // PMDK
+// Counts of record operations on this thread (failed PMwCASs, descriptors),
+// which the leaves they work on can't pass on to their tree; they're added to
+// the stats of the tree the thread traverses next, normally the same one
+thread_local uint64_t pending_stats[BzTree::kStatCounters];
+thread_local bool has_pending_stats = false;
+
+static inline void CountPendingStat(BzTree::StatCounter counter) {
+#if ENABLE_STATS
+  ++pending_stats[counter];
+  has_pending_stats = true;
+#endif
 }
 
-// Create an internal node with a new key and associated child pointers inserted
-// based on an existing internal node
-void InternalNode::New(InternalNode *src_node,
-                       const char *key,
-                       uint32_t key_size,
-                       uint64_t left_child_addr,
-                       uint64_t right_child_addr,
-                       InternalNode **mem) {
-  uint32_t alloc_size = src_node->GetHeader()->size +
-      RecordMetadata::PadKeyLength(key_size) +
-      sizeof(right_child_addr) + sizeof(RecordMetadata);
+// Failed PMwCASs in a row on this thread, reset by each traversal
+thread_local uint32_t pmwcas_failure_streak = 0;
 
-#ifdef  PMDK
-  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  new(*mem) InternalNode(alloc_size, src_node, 0, src_node->header.sorted_count,
-                         key, key_size, left_child_addr, right_child_addr);
-  pmwcas::NVRAM::Flush(alloc_size, *mem);
-  *mem = Allocator::Get()->GetOffset(*mem);
-#else
-  pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  new(*mem) InternalNode(alloc_size, src_node, 0, src_node->header.sorted_count,
-                         key, key_size, left_child_addr, right_child_addr);
-#ifdef PMEM
-  pmwcas::NVRAM::Flush(alloc_size, *mem);
-#endif  // PMEM
-#endif  // PMDK
+// For record operations about to retry a failed PMwCAS
+static inline void RetryAfterPMwCASFailure() {
+  CountPendingStat(BzTree::kStatPMwCASFailures);
+  ContentionManager::Pause(++pmwcas_failure_streak);
 }
 
-// Create an internal node with a single separator key and two pointers
-void InternalNode::New(const char *key,
-                       uint32_t key_size,
-                       uint64_t left_child_addr,
-                       uint64_t right_child_addr,
-                       InternalNode **mem) {
-  uint32_t alloc_size = sizeof(InternalNode) +
-      RecordMetadata::PadKeyLength(key_size) +
-      sizeof(left_child_addr) +
-      sizeof(right_child_addr) +
-      sizeof(RecordMetadata) * 2;
-#ifdef PMDK
-  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  new(*mem) InternalNode(alloc_size, key, key_size, left_child_addr, right_child_addr);
-  pmwcas::NVRAM::Flush(alloc_size, *mem);
-  *mem = Allocator::Get()->GetOffset(*mem);
-#else
-  pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  new(*mem) InternalNode(alloc_size, key, key_size, left_child_addr, right_child_addr);
-#ifdef PMEM
-  pmwcas::NVRAM::Flush(alloc_size, *mem);
-#endif  // PMEM
-#endif  // PMDK
+// The reservation lane of this thread in leaves that have them, see
+// LeafNode::GetLane
+static inline uint32_t GetLaneIndex() {
+  static std::atomic<uint32_t> next_lane{0};
+  thread_local uint32_t lane = next_lane.fetch_add(1, std::memory_order_relaxed);
+  return lane;
 }
 
-// Create an internal node with keys and pointers in the provided range from an
-// existing source node
-void InternalNode::New(InternalNode *src_node,
-                       uint32_t begin_meta_idx, uint32_t nr_records,
-                       const char *key, uint32_t key_size,
-                       uint64_t left_child_addr, uint64_t right_child_addr,
-                       InternalNode **new_node,
-                       uint64_t left_most_child_addr) {
-  // Figure out how large the new node will be
-  uint32_t alloc_size = sizeof(InternalNode);
-  if (begin_meta_idx > 0) {
-    // Will not copy from the first element (dummy key), so add it here
-    alloc_size += src_node->record_metadata[0].GetTotalLength();
-    alloc_size += sizeof(RecordMetadata);
+// Spin a little, then yield: what's waited for is another thread getting
+// through a few steps, or out of an operation
+static inline void WaitBriefly(uint32_t attempt) {
+  static const uint32_t kYieldAfter =
+      1 + __builtin_ctz(ContentionManager::kMaxPauses / ContentionManager::kMinPauses);
+  if (attempt < kYieldAfter) {
+    ContentionManager::Pause(attempt + 1);
+  } else {
+    std::this_thread::yield();
   }
+}
 
-  assert(nr_records > 0);
-  for (uint32_t i = begin_meta_idx; i < begin_meta_idx + nr_records; ++i) {
-    RecordMetadata meta = src_node->record_metadata[i];
-    alloc_size += meta.GetTotalLength();
-    alloc_size += sizeof(RecordMetadata);
-  }
+// A single-word payload update (see BzTree::EnableSingleWordUpdate) can't
+// carry the status word along, so the updater announces the leaf in a slot of
+// its own and only then checks that the leaf isn't frozen, while whoever
+// copies the records of a frozen leaf first waits for the updates announced
+// on it (WaitForSingleWordUpdates). One of the two sees the other: the update
+// finds the leaf frozen and goes to its replacement, or the copy has the new
+// payload. Threads beyond kUpdateSlots update with the PMwCAS instead.
+static const uint32_t kUpdateSlots = 256;
+struct UpdateSlot {
+  std::atomic<LeafNode *> leaf;
+  char padding[64 - sizeof(std::atomic<LeafNode *>)];
+};
+static UpdateSlot update_slots[kUpdateSlots];
+static std::atomic<uint32_t> update_slots_used{0};
+
+// This thread's slot, nullptr if all are taken
+static inline std::atomic<LeafNode *> *GetUpdateSlot() {
+  thread_local uint32_t slot = update_slots_used.fetch_add(1, std::memory_order_relaxed);
+  return slot < kUpdateSlots ? &update_slots[slot].leaf : nullptr;
+}
 
-  // Add the new key, if provided
-  if (key) {
-    ALWAYS_ASSERT(key_size > 0);
-    alloc_size +=
-        (RecordMetadata::PadKeyLength(key_size) + sizeof(uint64_t) + sizeof(RecordMetadata));
+static void WaitForSingleWordUpdates(LeafNode *leaf) {
+  uint32_t used = std::min(update_slots_used.load(std::memory_order_seq_cst), kUpdateSlots);
+  for (uint32_t i = 0; i < used; ++i) {
+    for (uint32_t round = 0; update_slots[i].leaf.load(std::memory_order_seq_cst) == leaf;
+         ++round) {
+      WaitBriefly(round);
+    }
   }
+}
 
-#ifdef PMDK
-  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(new_node), alloc_size);
-  memset(*new_node, 0, alloc_size);
-  new(*new_node) InternalNode(alloc_size, src_node, begin_meta_idx, nr_records,
-                              key, key_size, left_child_addr, right_child_addr,
-                              left_most_child_addr);
-  pmwcas::NVRAM::Flush(alloc_size, new_node);
-  *new_node = Allocator::Get()->GetOffset(*new_node);
-#else
-  pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(new_node), alloc_size);
-  memset(*new_node, 0, alloc_size);
-  new(*new_node) InternalNode(alloc_size, src_node, begin_meta_idx, nr_records,
-                              key, key_size, left_child_addr, right_child_addr,
-                              left_most_child_addr);
-#ifdef PMEM
-  pmwcas::NVRAM::Flush(alloc_size, *new_node);
-#endif  // PMEM
-#endif  // PMDK
+std::atomic<uint8_t> contention_policy{ContentionManager::kBackoff};
+
+void ContentionManager::SetPolicy(Policy policy) {
+  contention_policy.store(policy, std::memory_order_relaxed);
 }
 
-InternalNode::InternalNode(uint32_t node_size,
-                           const char *key,
-                           const uint16_t key_size,
-                           uint64_t left_child_addr,
-                           uint64_t right_child_addr)
-    : BaseNode(false, node_size) {
-  // Initialize a new internal node with one key only
-  header.sorted_count = 2;  // Includes the null dummy key
-  header.size = node_size;
+ContentionManager::Policy ContentionManager::GetPolicy() {
+  return static_cast<Policy>(contention_policy.load(std::memory_order_relaxed));
+}
 
-  // Fill in left child address, with an empty key
-  uint64_t offset = node_size - sizeof(left_child_addr);
-  record_metadata[0].FinalizeForInsert(offset, 0, sizeof(left_child_addr));
-  char *ptr = reinterpret_cast<char *>(this) + offset;
-  memcpy(ptr, &left_child_addr, sizeof(left_child_addr));
+void ContentionManager::Pause(uint32_t attempt) {
+  if (attempt == 0 || GetPolicy() == kSpin) {
+    return;
+  }
+  uint32_t shift = std::min<uint32_t>(attempt - 1, __builtin_ctz(kMaxPauses / kMinPauses));
+  uint32_t limit = kMinPauses << shift;
+  // Somewhere between half and all of the limit, so that threads that failed
+  // together don't all retry together
+  thread_local uint32_t seed = static_cast<uint32_t>(
+      reinterpret_cast<uintptr_t>(&seed) >> 4);
+  seed = seed * 1103515245 + 12345;
+  uint32_t pauses = limit / 2 + (seed >> 16) % (limit / 2);
+  for (uint32_t i = 0; i < pauses; ++i) {
+#ifdef __SSE2__
+    _mm_pause();
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+  }
+}
 
-  // Fill in right child address, with the separator key
-  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
-  auto total_len = padded_key_size + sizeof(right_child_addr);
-  offset -= total_len;
-  record_metadata[1].FinalizeForInsert(offset, key_size, total_len);
-  ptr = reinterpret_cast<char *>(this) + offset;
-  memcpy(ptr, key, key_size);
-  memcpy(ptr + padded_key_size, &right_child_addr, sizeof(right_child_addr));
+const uint32_t ContentionManager::kMinPauses;
+const uint32_t ContentionManager::kMaxPauses;
+const uint32_t ContentionManager::kMaxWaits;
+
+// Ranges of cache lines, [first, last) line addresses, waiting to be drained
+struct PendingLines {
+  uintptr_t first[PersistBatch::kMaxRanges];
+  uintptr_t last[PersistBatch::kMaxRanges];
+  uint32_t count = 0;
+  // Non-temporal stores issued, which need the fence as well
+  bool streamed = false;
+};
+thread_local PendingLines pending_lines;
+
+void PersistBatch::Add(const void *addr, uint64_t size) {
+  if (size == 0) {
+    return;
+  }
+  auto first = reinterpret_cast<uintptr_t>(addr) & ~uintptr_t{kCacheLineSize - 1};
+  auto last = (reinterpret_cast<uintptr_t>(addr) + size + kCacheLineSize - 1) &
+      ~uintptr_t{kCacheLineSize - 1};
+  auto &pending = pending_lines;
+  for (uint32_t i = 0; i < pending.count; ++i) {
+    if (first <= pending.last[i] && last >= pending.first[i]) {
+      pending.first[i] = std::min(pending.first[i], first);
+      pending.last[i] = std::max(pending.last[i], last);
+      return;
+    }
+  }
+  if (pending.count == kMaxRanges) {
+    Drain();
+  }
+  pending.first[pending.count] = first;
+  pending.last[pending.count] = last;
+  ++pending.count;
+}
 
-  assert((uint64_t) ptr == (uint64_t) this + sizeof(*this) + 2 * sizeof(RecordMetadata));
+void PersistBatch::Stream(void *dst, const void *src, uint64_t size) {
+  auto *to = static_cast<char *>(dst);
+  auto *from = static_cast<const char *>(src);
+  // Bytes outside whole 16-byte words are stored and written back as usual
+  auto begin = (reinterpret_cast<uintptr_t>(to) + 15) & ~uintptr_t{15};
+  auto end = (reinterpret_cast<uintptr_t>(to) + size) & ~uintptr_t{15};
+  if (begin >= end) {
+    memcpy(to, from, size);
+    Add(to, size);
+    return;
+  }
+  uint64_t head = begin - reinterpret_cast<uintptr_t>(to);
+  uint64_t tail = reinterpret_cast<uintptr_t>(to) + size - end;
+  memcpy(to, from, head);
+  Add(to, head);
+  for (uint64_t i = head; i < size - tail; i += 16) {
+    _mm_stream_si128(reinterpret_cast<__m128i *>(to + i),
+                     _mm_loadu_si128(reinterpret_cast<const __m128i *>(from + i)));
+  }
+  memcpy(to + size - tail, from + size - tail, tail);
+  Add(to + size - tail, tail);
+  pending_lines.streamed = true;
 }
 
-InternalNode::InternalNode(uint32_t node_size,
-                           InternalNode *src_node,
-                           uint32_t begin_meta_idx,
-                           uint32_t nr_records,
-                           const char *key,
-                           const uint16_t key_size,
-                           uint64_t left_child_addr,
-                           uint64_t right_child_addr,
-                           uint64_t left_most_child_addr)
-    : BaseNode(false, node_size) {
-  ALWAYS_ASSERT(src_node);
-  __builtin_prefetch((const void *) (src_node), 0, 3);
-  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+void PersistBatch::Drain() {
+  auto &pending = pending_lines;
+  if (pending.count == 0 && !pending.streamed) {
+    return;
+  }
+  PERF_PHASE(kFlush);
+  for (uint32_t i = 0; i < pending.count; ++i) {
+#ifdef PMEMEMU
+    // Emulation models the cost of writing back in the flush itself
+    pmwcas::NVRAM::Flush(pending.last[i] - pending.first[i],
+                         reinterpret_cast<void *>(pending.first[i]));
+#else
+    for (uintptr_t line = pending.first[i]; line < pending.last[i]; line += kCacheLineSize) {
+#if defined(__CLWB__)
+      _mm_clwb(reinterpret_cast<void *>(line));
+#elif defined(__CLFLUSHOPT__)
+      _mm_clflushopt(reinterpret_cast<void *>(line));
+#else
+      _mm_clflush(reinterpret_cast<void *>(line));
+#endif
+    }
+#endif
+  }
+  _mm_sfence();
+  pending.count = 0;
+  pending.streamed = false;
+}
 
-  uint64_t offset = node_size;
-  bool need_insert_new = key;
-  uint32_t insert_idx = 0;
+uint64_t PersistBatch::GetPendingLines() {
+  uint64_t lines = 0;
+  for (uint32_t i = 0; i < pending_lines.count; ++i) {
+    lines += (pending_lines.last[i] - pending_lines.first[i]) / kCacheLineSize;
+  }
+  return lines;
+}
 
-  // See if we need a new left_most_child_addr, i.e., this must be the new node
-  // on the right
-  if (left_most_child_addr) {
-    offset -= sizeof(uint64_t);
-    record_metadata[0].FinalizeForInsert(offset, 0, sizeof(uint64_t));
-    memcpy(reinterpret_cast<char *>(this) + offset, &left_most_child_addr, sizeof(uint64_t));
-    ++insert_idx;
+const uint32_t PersistBatch::kCacheLineSize;
+const uint32_t PersistBatch::kMaxRanges;
+
+// New nodes are built in a DRAM image and then streamed to their place with
+// non-temporal stores: building them in place would read each line of the
+// new node into the cache first, only to write it back right after. Each
+// thread has kNodeImages images, enough for all nodes built at a time (both
+// halves of a split). Volatile and emulation builds build nodes in place.
+static const uint32_t kNodeImages = 4;
+struct NodeImages {
+  char *buffers[kNodeImages] = {};
+  uint32_t sizes[kNodeImages] = {};
+  uint32_t next = 0;
+  ~NodeImages() {
+    for (auto *buffer : buffers) {
+      free(buffer);
+    }
   }
+};
+thread_local NodeImages node_images;
 
-  assert(nr_records > 0);
+#ifdef PMDK
+// Chunks of the pool each thread reserved ahead (pmemobj_reserve), per node
+// size class, so that a new node is taken off a local list rather than
+// allocated in a transaction of its own. Taking one publishes its
+// reservation along with the store of its address to the word that is to
+// hold it (pmemobj_set_value), in one redo log: after a crash the node is
+// allocated if and only if the word points to it, as with the transaction,
+// so the recycle policies of the descriptor holding the word still free it.
+// Reservations are volatile: those left at a crash are free again once the
+// pool is opened anew, and a thread that exits cancels its own. A stash is
+// tied to the Allocator generation it was reserved in, not to the pool's
+// address, which a pool opened after the old one was closed may reuse.
+struct NodeReservations {
+  static const uint32_t kBatch = 8;
+  struct Stash {
+    PMEMobjpool *pool = nullptr;
+    uint64_t generation = 0;
+    uint32_t count = 0;
+    pobj_action actions[kBatch];
+    PMEMoid oids[kBatch];
+  };
+  Stash stashes[NodeAllocator::kSizeClasses];
+  ~NodeReservations() {
+    // Only if the pool they were reserved in is still open (see
+    // Allocator::Uninit); otherwise they went away with it
+    auto generation = Allocator::GetGeneration();
+    for (auto &stash : stashes) {
+      if (stash.count > 0 && stash.generation == generation) {
+        pmemobj_cancel(stash.pool, stash.actions, stash.count);
+      }
+    }
+  }
+};
+thread_local NodeReservations node_reservations;
+
+// Allocate [size] bytes in [*mem], a word in the pool, off the thread's
+// reservations of their size class; in a transaction if [*mem] is elsewhere
+// or the pool has no room left to reserve in
+static void AllocateReservedNode(void **mem, uint32_t size) {
+  auto *allocator = Allocator::Get();
+  auto *pool = reinterpret_cast<PMEMobjpool *>(allocator->GetPool());
+  uint32_t class_size = 0;
+  if (size > NodeAllocator::kMaxSlabNodeSize || pmemobj_pool_by_ptr(mem) != pool) {
+    allocator->AllocateDirect(mem, size);
+    return;
+  }
+  auto &stash = node_reservations.stashes[NodeAllocator::GetSizeClass(size, &class_size)];
+  auto generation = Allocator::GetGeneration();
+  if (stash.generation != generation) {
+    // Reserved in a pool closed since, they went away with it
+    stash.pool = pool;
+    stash.generation = generation;
+    stash.count = 0;
+  }
+  if (stash.count == 0) {
+    while (stash.count < NodeReservations::kBatch) {
+      auto oid = pmemobj_reserve(pool, &stash.actions[stash.count], class_size, 0);
+      if (OID_IS_NULL(oid)) {
+        break;
+      }
+      stash.oids[stash.count++] = oid;
+    }
+  }
+  if (stash.count == 0) {
+    allocator->AllocateDirect(mem, size);
+    return;
+  }
+  --stash.count;
+  pobj_action actions[2] = {stash.actions[stash.count]};
+  void *node = pmemobj_direct(stash.oids[stash.count]);
+  pmemobj_set_value(pool, &actions[1], reinterpret_cast<uint64_t *>(mem),
+                    reinterpret_cast<uint64_t>(node));
+  pmemobj_publish(pool, actions, 2);
+}
+#endif
 
-  for (uint32_t i = begin_meta_idx; i < begin_meta_idx + nr_records; ++i) {
-    RecordMetadata meta = src_node->record_metadata[i];
-    assert(meta.IsVisible());
-    uint64_t m_payload = 0;
-    char *m_key = nullptr;
-    char *m_data = nullptr;
-    src_node->GetRawRecord(meta, &m_data, &m_key, &m_payload);
-    auto m_key_size = meta.GetKeyLength();
+// Allocate a node of [size] bytes in [*mem], a direct pointer until
+// EndNodeImage, and return the zeroed memory to build it in; [internal] is
+// passed on to NodeAllocator::Allocate
+static char *BeginNodeImage(void **mem, uint32_t size, bool internal = false) {
+#ifdef PMDK
+  AllocateReservedNode(mem, size);
+#else
+  NodeAllocator::Allocate(mem, size, internal);
+#endif
+#if defined(PMEM) && !defined(PMEMEMU)
+  auto &images = node_images;
+  uint32_t slot = images.next++ % kNodeImages;
+  if (images.sizes[slot] < size) {
+    free(images.buffers[slot]);
+    images.sizes[slot] = (size + PersistBatch::kCacheLineSize - 1) &
+        ~(PersistBatch::kCacheLineSize - 1);
+    images.buffers[slot] = static_cast<char *>(
+        aligned_alloc(PersistBatch::kCacheLineSize, images.sizes[slot]));
+  }
+  char *image = images.buffers[slot];
+#else
+  char *image = static_cast<char *>(*mem);
+#endif
+  memset(image, 0, size);
+  return image;
+}
 
-    if (!need_insert_new) {
-      // New key already inserted, so directly insert the key from src node
-      assert(meta.GetTotalLength() >= sizeof(uint64_t));
-      offset -= (meta.GetTotalLength());
-      record_metadata[insert_idx].FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
-      memcpy(reinterpret_cast<char *>(this) + offset, m_data, meta.GetTotalLength());
-    } else {
-      // Compare the two keys to see which one to insert (first)
-      auto cmp = KeyCompare(m_key, m_key_size, key, key_size);
-      ALWAYS_ASSERT(!(cmp == 0 && key_size == m_key_size));
+// Put the node built in [image] in place; [*mem] becomes an offset under PMDK
+static void EndNodeImage(void **mem, const char *image, uint32_t size) {
+#if defined(PMEMEMU)
+  PersistBatch::Add(*mem, size);
+#elif defined(PMEM)
+  PersistBatch::Stream(*mem, image, size);
+#endif
+#ifdef PMDK
+  *mem = Allocator::Get()->GetOffset(*mem);
+#endif
+}
 
-      if (cmp > 0) {
-        assert(insert_idx >= 1);
+// Allocations taking longer than this many cycles (about 10 us) are counted
+// as slow. This only measures: the PMwCAS pool doesn't report when the
+// partition of a thread runs dry, so a slow allocation may as well be a
+// preemption, and nothing here caches or shards descriptors (one that was
+// aborted or executed can't be reused before the epoch recycles it)
+static const uint64_t kSlowDescriptorCycles = 20000;
 
-        // Modify the previous key's payload to left_child_addr
-        auto prev_meta = record_metadata[insert_idx - 1];
+static inline uint64_t ReadCycleCounter() {
+#if defined(__x86_64__)
+  return __builtin_ia32_rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
 
-        memcpy(reinterpret_cast<char *>(this) +
-                   prev_meta.GetOffset() + prev_meta.GetPaddedKeyLength(),
-               &left_child_addr, sizeof(left_child_addr));
+// All descriptors are allocated through here to count them; [for_nodes] gets
+// one that frees the new nodes in its reserved words through the node
+// allocator (see AllocateNodeDescriptor)
+static inline pmwcas::Descriptor *NewDescriptor(pmwcas::DescriptorPool *pool,
+                                                bool for_nodes = false) {
+#if ENABLE_STATS
+  auto start = ReadCycleCounter();
+#endif
+  auto *pd = for_nodes ? AllocateNodeDescriptor(pool) : pool->AllocateDescriptor();
+#if ENABLE_STATS
+  CountPendingStat(BzTree::kStatDescriptorAllocations);
+  if (ReadCycleCounter() - start > kSlowDescriptorCycles) {
+    CountPendingStat(BzTree::kStatSlowDescriptorAllocations);
+  }
+#endif
+  return pd;
+}
 
-        // Now the new separtor key itself
-        offset -= (padded_key_size + sizeof(right_child_addr));
-        record_metadata[insert_idx].FinalizeForInsert(
-            offset, key_size, padded_key_size + sizeof(left_child_addr));
+// Give up a descriptor before its PMwCAS, recycling it right away
+static inline void AbortDescriptor(pmwcas::Descriptor *pd) {
+  pd->Abort();
+  CountPendingStat(BzTree::kStatDescriptorAborts);
+}
 
-        ++insert_idx;
-        memcpy(reinterpret_cast<char *>(this) + offset, key, key_size);
-        memcpy(reinterpret_cast<char *>(this) + offset + padded_key_size,
-               &right_child_addr, sizeof(right_child_addr));
+// Splits, consolidations and merges (including backing off from one) this
+// thread went into, to tell the operations that did from the others
+thread_local uint64_t smo_attempts = 0;
+
+// The counts of each thread by stack of phases, outliving the thread. A stack
+// takes 4 bits a phase (phase + 1), the outermost one in the low bits, and
+// phases nested beyond 16 deep are charged to the 16th.
+struct PerfStacks {
+  std::mutex mutex;
+  std::unordered_map<uint64_t, std::array<uint64_t, PerfProfile::kCounters>> counts;
+};
+
+static std::mutex perf_threads_mutex;
+static std::vector<std::shared_ptr<PerfStacks>> perf_threads;
+
+// The counters of a thread, one perf_event_open group led by the task clock,
+// opened on the first phase
+struct PerfThread {
+  static const uint32_t kMaxDepth = 16;
+  bool opened = false;
+  int fds[PerfProfile::kCounters];
+  // Position of each counter in what a read of the group returns, or -1
+  int32_t index[PerfProfile::kCounters];
+  uint32_t open_counters = 0;
+  uint64_t last[PerfProfile::kCounters] = {};
+  uint64_t stack = 0;
+  uint32_t depth = 0;
+  std::shared_ptr<PerfStacks> stacks;
+
+  ~PerfThread() {
+    for (uint32_t i = 0; i < open_counters; ++i) {
+      close(fds[i]);
+    }
+  }
 
-        offset -= (meta.GetTotalLength());
-        assert(meta.GetTotalLength() >= sizeof(uint64_t));
-        record_metadata[insert_idx].FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
-        memcpy(reinterpret_cast<char *>(this) + offset, m_data, meta.GetTotalLength());
+  bool Open() {
+    if (opened) {
+      return open_counters > 0;
+    }
+    opened = true;
+    const char *raw = getenv("BZTREE_PERF_RAW");
+    struct { uint32_t type; uint64_t config; } events[PerfProfile::kCounters] = {
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_RAW, raw ? strtoull(raw, nullptr, 16) : 0},
+    };
+    for (uint32_t i = 0; i < PerfProfile::kCounters; ++i) {
+      index[i] = -1;
+      if (i == PerfProfile::kRaw && !raw) {
+        continue;
+      }
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = events[i].type;
+      attr.config = events[i].config;
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      int leader = open_counters ? fds[0] : -1;
+      int fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0));
+      if (fd < 0) {
+        // The group needs its leader, the others are optional
+        if (i == PerfProfile::kTaskClock) {
+          return false;
+        }
+        continue;
+      }
+      index[i] = open_counters;
+      fds[open_counters++] = fd;
+    }
+    stacks = std::make_shared<PerfStacks>();
+    std::lock_guard<std::mutex> lock(perf_threads_mutex);
+    perf_threads.emplace_back(stacks);
+    return true;
+  }
 
-        need_insert_new = false;
-      } else {
-        assert(meta.GetTotalLength() >= sizeof(uint64_t));
-        offset -= (meta.GetTotalLength());
-        record_metadata[insert_idx].FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
-        memcpy(reinterpret_cast<char *>(this) + offset, m_data, meta.GetTotalLength());
+  // Charge what the counters counted since the last call to the current stack
+  void Charge() {
+    uint64_t values[1 + PerfProfile::kCounters];
+    if (read(fds[0], values, sizeof(values)) < static_cast<ssize_t>(sizeof(uint64_t))) {
+      return;
+    }
+    uint64_t now[PerfProfile::kCounters] = {};
+    for (uint32_t i = 0; i < PerfProfile::kCounters; ++i) {
+      if (index[i] >= 0) {
+        now[i] = values[1 + index[i]];
       }
     }
-    ++insert_idx;
+    if (depth > 0) {
+      std::lock_guard<std::mutex> lock(stacks->mutex);
+      auto &counts = stacks->counts[stack];
+      for (uint32_t i = 0; i < PerfProfile::kCounters; ++i) {
+        counts[i] += now[i] - last[i];
+      }
+    }
+    memcpy(last, now, sizeof(last));
   }
+};
 
-  if (need_insert_new) {
-    // The new key-payload pair will be the right-most (largest key) element
-    uint32_t total_size = RecordMetadata::PadKeyLength(key_size) + sizeof(uint64_t);
-    offset -= total_size;
-    record_metadata[insert_idx].FinalizeForInsert(offset, key_size, total_size);
-    memcpy(reinterpret_cast<char *>(this) + offset, key, key_size);
-    memcpy(reinterpret_cast<char *>(this) + offset + RecordMetadata::PadKeyLength(key_size),
-           &right_child_addr, sizeof(right_child_addr));
+static thread_local PerfThread perf_thread;
 
-    // Modify the previous key's payload to left_child_addr
-    auto prev_meta = record_metadata[insert_idx - 1];
-    memcpy(reinterpret_cast<char *>(this) + prev_meta.GetOffset() + prev_meta.GetPaddedKeyLength(),
-           &left_child_addr, sizeof(left_child_addr));
+void PerfProfile::Enter(Phase phase) {
+  auto &thread = perf_thread;
+  if (!thread.Open()) {
+    return;
+  }
+  thread.Charge();
+  if (thread.depth < PerfThread::kMaxDepth) {
+    thread.stack |= static_cast<uint64_t>(phase + 1) << (thread.depth * 4);
+  }
+  ++thread.depth;
+}
 
-    ++insert_idx;
+void PerfProfile::Leave() {
+  auto &thread = perf_thread;
+  if (!thread.Open() || thread.depth == 0) {
+    return;
   }
+  thread.Charge();
+  --thread.depth;
+  if (thread.depth < PerfThread::kMaxDepth) {
+    thread.stack &= ~(static_cast<uint64_t>(0xf) << (thread.depth * 4));
+  }
+}
 
-  header.size = node_size;
-  header.sorted_count = insert_idx;
+void PerfProfile::DumpFolded(std::ostream &out, Counter counter) {
+  static const char *kPhaseNames[kPhases] = {
+      "traverse", "leaf_search", "pmwcas", "flush", "smo"};
+  std::map<uint64_t, uint64_t> totals;
+  {
+    std::lock_guard<std::mutex> lock(perf_threads_mutex);
+    for (auto &stacks : perf_threads) {
+      std::lock_guard<std::mutex> stacks_lock(stacks->mutex);
+      for (auto &stack : stacks->counts) {
+        totals[stack.first] += stack.second[counter];
+      }
+    }
+  }
+  for (auto &total : totals) {
+    if (total.second == 0) {
+      continue;
+    }
+    for (uint64_t stack = total.first; stack; stack >>= 4) {
+      out << kPhaseNames[(stack & 0xf) - 1] << (stack >> 4 ? ";" : " ");
+    }
+    out << total.second << std::endl;
+  }
 }
 
-// Insert record to this internal node. The node is frozen at this time.
-bool InternalNode::PrepareForSplit(Stack &stack,
-                                   uint32_t split_threshold,
-                                   const char *key,
-                                   uint32_t key_size,
-                                   uint64_t left_child_addr,   // [key]'s left child pointer
-                                   uint64_t right_child_addr,  // [key]'s right child pointer
-                                   InternalNode **new_node,
-                                   pmwcas::Descriptor *pd,
-                                   pmwcas::DescriptorPool *pool,
-                                   bool backoff) {
-  uint32_t data_size = header.size + key_size +
-      sizeof(right_child_addr) + sizeof(RecordMetadata);
-  uint32_t new_node_size = sizeof(InternalNode) + data_size;
-  if (new_node_size < split_threshold) {
-    // good boy
-    InternalNode::New(this, key, key_size, left_child_addr,
-                      right_child_addr, new_node);
-    return true;
+void PerfProfile::Reset() {
+  std::lock_guard<std::mutex> lock(perf_threads_mutex);
+  for (auto &stacks : perf_threads) {
+    std::lock_guard<std::mutex> stacks_lock(stacks->mutex);
+    stacks->counts.clear();
   }
+}
 
-  // After adding a key and pointers the new node would be too large. This
-  // means we are effectively 'moving up' the tree to do split
-  // So now we split the node and generate two new internal nodes
-  ALWAYS_ASSERT(header.sorted_count >= 2);
-  uint32_t n_left = header.sorted_count >> 1;
+const uint32_t LatencyHistogram::kSubBuckets;
+const uint32_t LatencyHistogram::kBuckets;
 
-  auto i_left = pd->ReserveAndAddEntry(
-      reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
-      reinterpret_cast<uint64_t>(nullptr),
-      pmwcas::Descriptor::kRecycleOnRecovery);
-  auto i_right = pd->ReserveAndAddEntry(
-      reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
-      reinterpret_cast<uint64_t>(nullptr),
-      pmwcas::Descriptor::kRecycleOnRecovery);
-  uint64_t *ptr_l = pd->GetNewValuePtr(i_left);
-  uint64_t *ptr_r = pd->GetNewValuePtr(i_right);
+LatencyHistogram &LatencyHistogram::operator=(const LatencyHistogram &other) {
+  for (uint32_t i = 0; i < kBuckets; ++i) {
+    counts[i].store(other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+  return *this;
+}
 
-  // Figure out where the new key will go
-  auto separator_meta = record_metadata[n_left];
-  char *separator_key = nullptr;
-  uint16_t separator_key_size = separator_meta.GetKeyLength();
-  uint64_t separator_payload = 0;
-  bool success = GetRawRecord(separator_meta, nullptr, &separator_key,
-                              &separator_payload);
-  ALWAYS_ASSERT(success);
+void LatencyHistogram::Merge(const LatencyHistogram &other) {
+  for (uint32_t i = 0; i < kBuckets; ++i) {
+    counts[i].fetch_add(other.counts[i].load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+  }
+}
 
-  int cmp = KeyCompare(key, key_size, separator_key, separator_key_size);
-  if (cmp == 0) {
-    cmp = key_size - separator_key_size;
+void LatencyHistogram::Reset() {
+  for (auto &count : counts) {
+    count.store(0, std::memory_order_relaxed);
   }
-  ALWAYS_ASSERT(cmp != 0);
-  if (cmp < 0) {
-    // Should go to left
-    InternalNode::New(this, 0, n_left, key, key_size,
-                      left_child_addr, right_child_addr,
-                      reinterpret_cast<InternalNode **>(ptr_l), 0);
-    InternalNode::New(this, n_left + 1, header.sorted_count - n_left - 1,
-                      nullptr, 0, 0, 0,
-                      reinterpret_cast<InternalNode **>(ptr_r), separator_payload);
-  } else {
-    InternalNode::New(this, 0, n_left, nullptr, 0, 0, 0,
-                      reinterpret_cast<InternalNode **>(ptr_l), 0);
-    InternalNode::New(this, n_left + 1, header.sorted_count - n_left - 1,
-                      key, key_size, left_child_addr, right_child_addr,
-                      reinterpret_cast<InternalNode **>(ptr_r), separator_payload);
+}
+
+uint64_t LatencyHistogram::GetCount() const {
+  uint64_t total = 0;
+  for (auto &count : counts) {
+    total += count.load(std::memory_order_relaxed);
   }
-  assert(*ptr_l);
-  assert(*ptr_r);
+  return total;
+}
 
-  // Pop here as if this were a leaf node so that when we get back to the
-  // original caller, we get stack top as the "parent"
-  stack.Pop();
+uint64_t LatencyHistogram::GetPercentile(double percentile) const {
+  uint64_t total = GetCount();
+  if (total == 0) {
+    return 0;
+  }
+  auto rank = static_cast<uint64_t>(std::ceil(percentile / 100 * static_cast<double>(total)));
+  rank = std::min(std::max<uint64_t>(rank, 1), total);
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < kBuckets; ++i) {
+    seen += counts[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return GetBucketUpperBound(i);
+    }
+  }
+  return GetBucketUpperBound(kBuckets - 1);
+}
 
-  // Now get this internal node's real parent
-  InternalNode *parent = stack.Top() ?
-                         stack.Top()->node : nullptr;
-  if (parent == nullptr) {
-    // Good!
-    InternalNode::New(separator_key, separator_key_size,
-                      (uint64_t) *ptr_l, (uint64_t) *ptr_r, new_node);
-    return true;
+uint64_t LatencyHistogram::GetBucketUpperBound(uint32_t bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
   }
-  __builtin_prefetch((const void *) (parent), 0, 2);
+  uint32_t exponent = bucket / kSubBuckets + 2;
+  uint64_t lower = uint64_t{kSubBuckets + bucket % kSubBuckets} << (exponent - 3);
+  return lower + (uint64_t{1} << (exponent - 3)) - 1;
+}
 
-  // Try to freeze the parent node first
-  bool frozen_by_me = false;
-  while (!parent->IsFrozen()) {
-    frozen_by_me = parent->Freeze(pool);
+// Times an operation of the tree into its latency histograms, if they're on.
+// Only the outermost one on a thread records, so that an Upsert turning into
+// an Insert shows as an Upsert only.
+class LatencyTimer {
+ public:
+  LatencyTimer(BzTree *tree, BzTree::LatencyOp op) : slots(nullptr) {
+    thread_local uint32_t depth = 0;
+    if (!tree->latency_enabled.load(std::memory_order_relaxed) || depth > 0) {
+      return;
+    }
+    slots = tree->latency_slots.load(std::memory_order_acquire);
+    this->op = op;
+    this->depth = &depth;
+    ++depth;
+    smo_before = smo_attempts;
+    start = std::chrono::steady_clock::now();
   }
 
-  // Someone else froze the parent node and we are told not to compete with
-  // others (for now)
-  if (!frozen_by_me && backoff) {
-    return false;
+  ~LatencyTimer() {
+    if (!slots) {
+      return;
+    }
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    auto &slot = slots[BzTree::GetStatsSlotIndex() % BzTree::kLatencySlots];
+    (smo_attempts == smo_before ? slot.fast : slot.smo)[op].Record(
+        static_cast<uint64_t>(nanos));
+    --*depth;
   }
 
-  return parent->PrepareForSplit(stack, split_threshold,
-                                 separator_key, separator_key_size,
-                                 (uint64_t) *ptr_l, (uint64_t) *ptr_r,
-                                 new_node, pd, pool, backoff);
+ private:
+  BzTree::LatencySnapshot *slots;
+  BzTree::LatencyOp op;
+  uint32_t *depth;
+  uint64_t smo_before;
+  std::chrono::steady_clock::time_point start;
+};
+
+namespace {
+// Not in every libc's headers (numaif.h comes with libnuma)
+static const int kMpolPreferred = 1;
+static const int kMpolInterleave = 3;
+static const unsigned kMpolMoveFlag = 1 << 1;
+
+// Threads look up their NUMA node again every kNumaNodeRefresh calls, in case
+// they were moved to another socket
+static const uint32_t kNumaNodeRefresh = 256;
+struct CurrentNumaNode {
+  uint32_t node = 0;
+  uint32_t calls = 0;
+};
+thread_local CurrentNumaNode current_numa_node;
+
+uint32_t ReadNumaNodeCount() {
+  // "0", or "0-1" with two sockets
+  int fd = open("/sys/devices/system/node/possible", O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  char text[64] = {};
+  auto bytes = read(fd, text, sizeof(text) - 1);
+  close(fd);
+  if (bytes <= 0) {
+    return 1;
+  }
+  const char *last = text;
+  for (const char *c = text; *c; ++c) {
+    if (*c == '-' || *c == ',') {
+      last = c + 1;
+    }
+  }
+  uint32_t count = static_cast<uint32_t>(strtoul(last, nullptr, 10)) + 1;
+  return std::min(std::max(count, 1u), NodeAllocator::kMaxNumaNodes);
 }
+}  // namespace
 
-void LeafNode::New(LeafNode **mem, uint32_t node_size) {
-#ifdef PMDK
-  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), node_size);
-  memset(*mem, 0, node_size);
-  new(*mem)LeafNode(node_size);
-  pmwcas::NVRAM::Flush(node_size, *mem);
-  *mem = Allocator::Get()->GetOffset(*mem);
-#else
-  pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(mem), node_size);
-  memset(*mem, 0, node_size);
-  new(*mem) LeafNode(node_size);
-#ifdef PMEM
-  pmwcas::NVRAM::Flush(node_size, *mem);
-#endif  // PMEM
-#endif  // PMDK
+const uint32_t NodeAllocator::kMaxNumaNodes;
+
+uint32_t NodeAllocator::GetNumaNodeCount() {
+  static uint32_t count = ReadNumaNodeCount();
+  return count;
 }
 
-void BaseNode::Dump(pmwcas::EpochManager *epoch) {
-  std::cout << "-----------------------------" << std::endl;
-  std::cout << " Dumping node: " << this << (is_leaf ? " (leaf)" : " (internal)") << std::endl;
-  std::cout << " Header:\n";
-  if (is_leaf) {
-    std::cout << " - free space: " << (reinterpret_cast<LeafNode *>(this))->GetFreeSpace()
-              << std::endl;
+uint32_t NodeAllocator::GetNumaNode() {
+  auto &current = current_numa_node;
+  if (current.calls++ % kNumaNodeRefresh == 0) {
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+      current.node = node % GetNumaNodeCount();
+    }
   }
-  std::cout << " - status: 0x" << std::hex << header.status.word << std::endl
-            << "   (control = 0x" << (header.status.word & NodeHeader::StatusWord::kControlMask)
-            << std::dec
-            << ", frozen = " << header.status.IsFrozen()
-            << ", block size = " << header.status.GetBlockSize()
-            << ", delete size = " << header.status.GetDeletedSize()
-            << ", record count = " << header.status.GetRecordCount() << ")\n"
-            << " - sorted_count: " << header.sorted_count
-            << std::endl;
-
-  std::cout << " - size: " << header.size << std::endl;
+  return current.node;
+}
 
-  std::cout << " Record Metadata Array:" << std::endl;
-  uint32_t n_meta = std::max<uint32_t>(header.status.GetRecordCount(), header.sorted_count);
-  for (uint32_t i = 0; i < n_meta; ++i) {
-    RecordMetadata meta = record_metadata[i];
-    std::cout << " - record " << i << ": meta = 0x" << std::hex << meta.meta << std::endl;
-    std::cout << std::hex;
-    std::cout << "   (control = 0x" << (meta.meta & RecordMetadata::kControlMask)
-              << std::dec
-              << ", visible = " << meta.IsVisible()
-              << ", offset = " << meta.GetOffset()
-              << ", key length = " << meta.GetKeyLength()
-              << ", total length = " << meta.GetTotalLength()
-              << std::endl;
+void NodeAllocator::BindToNumaNode(void *mem, uint64_t size, uint32_t numa_node) {
+  unsigned long mask = 0;
+  int mode = kMpolPreferred;
+  if (numa_node >= kMaxNumaNodes) {
+    mask = (1ul << GetNumaNodeCount()) - 1;
+    mode = kMpolInterleave;
+  } else {
+    mask = 1ul << numa_node;
   }
+  // Best effort: without NUMA support in the kernel, pages go wherever they go
+  syscall(SYS_mbind, mem, size, mode, &mask, sizeof(mask) * 8, kMpolMoveFlag);
 }
 
-void LeafNode::Dump(pmwcas::EpochManager *epoch) {
-  BaseNode::Dump(epoch);
-  std::cout << " Key-Payload Pairs:" << std::endl;
-  for (uint32_t i = 0; i < header.status.GetRecordCount(); ++i) {
-    RecordMetadata meta = record_metadata[i];
-    if (meta.IsVisible()) {
-      uint64_t payload = 0;
-      char *key = nullptr;
-      GetRawRecord(meta, &key, &payload, epoch);
-      assert(key);
-      std::string keystr(key, key + meta.GetKeyLength());
-      std::cout << " - record " << i << ": key = " << keystr
-                << ", payload = " << payload << std::endl;
-    }
-  }
+#ifndef PMDK
+namespace {
+// Room for 128 GB of slabs
+static const uint32_t kSlabTableSize = 1 << 16;
+
+// Free lists and slabs are kept apart by placement: one per NUMA node, and
+// one for slabs interleaved over all nodes (kNumaLocalLeaves). Without NUMA
+// placement everything is in the first.
+static const uint32_t kPlacements = NodeAllocator::kMaxNumaNodes + 1;
+static const uint32_t kInterleaved = NodeAllocator::kMaxNumaNodes;
+static const uint32_t kPlacementShift = 6;
+
+// Slabs are registered by their 2 MB-aligned base, ORed with their size class
+// and placement, in an insert-only hash table so that Free can find them
+// without locking
+struct SlabState {
+  std::mutex mutex;
+  std::atomic<bool> huge_pages{false};
+  std::atomic<NodeAllocator::NumaPlacement> numa_placement{NodeAllocator::kNumaFirstTouch};
+  std::atomic<uintptr_t> slabs[kSlabTableSize] = {};
+  uint32_t slab_count = 0;
+  char *free_list[kPlacements][NodeAllocator::kSizeClasses] = {};
+  char *bump[kPlacements][NodeAllocator::kSizeClasses] = {};
+  char *bump_end[kPlacements][NodeAllocator::kSizeClasses] = {};
+  uint64_t slab_bytes = 0;
+};
+
+SlabState &GetSlabState() {
+  static SlabState *state = new SlabState();
+  return *state;
+}
 
-  std::cout << "-----------------------------" << std::endl;
+inline uint32_t SlabHash(uintptr_t base) {
+  return static_cast<uint32_t>((base / NodeAllocator::kSlabSize) * 0x9E3779B1u) %
+      kSlabTableSize;
 }
 
-void InternalNode::Dump(pmwcas::EpochManager *epoch, bool dump_children) {
-  BaseNode::Dump(epoch);
-  std::cout << " Child pointers and separator keys:" << std::endl;
-  assert(header.status.GetRecordCount() == 0);
-  for (uint32_t i = 0; i < header.sorted_count; ++i) {
-    auto &meta = record_metadata[i];
-    assert((i == 0 && meta.GetKeyLength() == 0) || (i > 0 && meta.GetKeyLength() > 0));
-    uint64_t right_child_addr = 0;
-    char *key = nullptr;
-    GetRawRecord(meta, nullptr, &key, &right_child_addr);
-    if (key) {
-      std::string keystr(key, key + meta.GetKeyLength());
-      std::cout << " || " << keystr << " | ";
+// Size class of the slab [mem] belongs to, or -1 if it wasn't carved out of
+// one; its placement goes to [placement]
+int32_t FindSlab(void *mem, uint32_t *placement) {
+  auto &state = GetSlabState();
+  auto base = reinterpret_cast<uintptr_t>(mem) & ~(NodeAllocator::kSlabSize - 1);
+  for (uint32_t i = SlabHash(base);; i = (i + 1) % kSlabTableSize) {
+    auto entry = state.slabs[i].load(std::memory_order_acquire);
+    if (entry == 0) {
+      return -1;
     }
-    std::cout << std::hex << "0x" << right_child_addr << std::dec;
-  }
-  std::cout << std::endl;
-
-  if (dump_children) {
-    for (uint32_t i = 0; i < header.sorted_count; ++i) {
-      uint64_t node_addr = *GetPayloadPtr(record_metadata[i]);
-#ifdef  PMDK
-      BaseNode *node = Allocator::Get()->GetDirect(reinterpret_cast<BaseNode *>(node_addr));
-#else
-      BaseNode *node = reinterpret_cast<BaseNode *>(node_addr);
-#endif
-      if (node->IsLeaf()) {
-        (reinterpret_cast<LeafNode *>(node))->Dump(epoch);
-      } else {
-        (reinterpret_cast<InternalNode *>(node))->Dump(epoch, true);
-      }
+    if ((entry & ~(NodeAllocator::kSlabSize - 1)) == base) {
+      *placement = static_cast<uint32_t>(entry & (NodeAllocator::kSlabSize - 1)) >>
+          kPlacementShift;
+      return static_cast<int32_t>(entry & ((1 << kPlacementShift) - 1));
     }
   }
 }
 
-ReturnCode LeafNode::Insert(const char *key, uint16_t key_size, uint64_t payload,
-                            pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold) {
-  retry:
-  NodeHeader::StatusWord expected_status = header.GetStatus();
-
-  // If frozon then retry
-  if (expected_status.IsFrozen()) {
-    return ReturnCode::NodeFrozen();
+// Placement of a node allocated by this thread
+inline uint32_t GetPlacement(NodeAllocator::NumaPlacement numa_placement, bool internal) {
+  if (numa_placement == NodeAllocator::kNumaFirstTouch) {
+    return 0;
   }
+  if (internal && numa_placement == NodeAllocator::kNumaLocalLeaves) {
+    return kInterleaved;
+  }
+  return NodeAllocator::GetNumaNode();
+}
 
-  auto uniqueness = CheckUnique(key, key_size, pmwcas_pool->GetEpoch());
-  if (uniqueness == Duplicate) {
-    return ReturnCode::KeyExists();
+// A 2 MB-aligned, 2 MB anonymous mapping with transparent huge pages asked for
+char *MapSlab() {
+  auto size = NodeAllocator::kSlabSize;
+  void *mem = mmap(nullptr, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return nullptr;
+  }
+  auto addr = reinterpret_cast<uintptr_t>(mem);
+  auto base = (addr + size - 1) & ~(size - 1);
+  if (base > addr) {
+    munmap(mem, base - addr);
   }
+  munmap(reinterpret_cast<void *>(base + size), addr + size - base);
+#ifdef MADV_HUGEPAGE
+  madvise(reinterpret_cast<void *>(base), size, MADV_HUGEPAGE);
+#endif
+  return reinterpret_cast<char *>(base);
+}
 
-  // Check space to see if we need to split the node
-  auto new_size = LeafNode::GetUsedSpace(expected_status) + sizeof(RecordMetadata) +
-      RecordMetadata::PadKeyLength(key_size) + sizeof(payload);
-  if (new_size >= split_threshold) {
-    return ReturnCode::NotEnoughSpace();
+// Carve up to [count] nodes of size class [index] out of its current slab of
+// [placement], mapping a new one if it's used up; called with the state locked
+char *CarveNodes(uint32_t placement, uint32_t index, uint32_t class_size, uint32_t count,
+                 uint32_t *carved) {
+  auto &state = GetSlabState();
+  char *&bump = state.bump[placement][index];
+  char *&bump_end = state.bump_end[placement][index];
+  if (bump + class_size > bump_end) {
+    // Keep the table at most half full so that probes stay short
+    char *slab = state.slab_count < kSlabTableSize / 2 ? MapSlab() : nullptr;
+    if (!slab) {
+      *carved = 0;
+      return nullptr;
+    }
+    if (state.numa_placement.load(std::memory_order_relaxed) != NodeAllocator::kNumaFirstTouch) {
+      // Before any page is touched
+      NodeAllocator::BindToNumaNode(slab, NodeAllocator::kSlabSize, placement);
+    }
+    auto base = reinterpret_cast<uintptr_t>(slab);
+    uint32_t i = SlabHash(base);
+    while (state.slabs[i].load(std::memory_order_relaxed)) {
+      i = (i + 1) % kSlabTableSize;
+    }
+    state.slabs[i].store(base | (placement << kPlacementShift) | index,
+                         std::memory_order_release);
+    ++state.slab_count;
+    state.slab_bytes += NodeAllocator::kSlabSize;
+    bump = slab;
+    bump_end = slab + NodeAllocator::kSlabSize;
   }
+  auto available = static_cast<uint32_t>((bump_end - bump) / class_size);
+  *carved = std::min(count, available);
+  char *nodes = bump;
+  bump += *carved * class_size;
+  return nodes;
+}
 
-  // Now try to reserve space in the free space region using a PMwCAS. Two steps:
-  // Step 1. Incrementing the record count and block size fields in [status]
-  // Step 2. Flip the record metadata entry's high order bit and fill in global
-  // epoch
-  NodeHeader::StatusWord desired_status = expected_status;
+// Inverse of NodeAllocator::GetSizeClass
+inline uint32_t GetClassSize(uint32_t index) {
+  if (index == 0) {
+    return 64;
+  }
+  return (5 + (index - 1) % 4) << (4 + (index - 1) / 4);
+}
 
-  // Block size includes both key and payload sizes
-  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
-  auto total_size = padded_key_size + sizeof(payload);
-  desired_status.PrepareForInsert(total_size);
+inline char *&NextFree(char *node) {
+  return *reinterpret_cast<char **>(node);
+}
 
-  // Get the tentative metadata entry (again, make a local copy to work on it)
-  RecordMetadata *meta_ptr = &record_metadata[expected_status.GetRecordCount()];
-  RecordMetadata expected_meta = *meta_ptr;
-  if (!expected_meta.IsVacant()) {
-    goto retry;
+// Free nodes kept by each thread, so that most allocations and frees (including
+// those of nodes reclaimed by the epoch-protected garbage list, which run on the
+// thread that scavenges it) touch no shared state. Each class holds up to
+// kThreadCacheBytes worth of nodes and moves half of that at a time from or to
+// the global free lists; what's left goes back when the thread exits. Nodes
+// of each placement are cached apart, so a node freed by a thread on another
+// socket goes back to its own socket's list.
+struct ThreadCache {
+  static const uint32_t kThreadCacheBytes = 256 * 1024;
+  char *free_list[kPlacements][NodeAllocator::kSizeClasses] = {};
+  uint32_t count[kPlacements][NodeAllocator::kSizeClasses] = {};
+
+  static uint32_t GetBatchSize(uint32_t class_size) {
+    return std::max<uint32_t>(kThreadCacheBytes / class_size / 2, 1);
   }
 
-  RecordMetadata desired_meta;
-  desired_meta.PrepareForInsert();
+  // Move up to [batch] nodes of class [index] to the global free list
+  void Release(uint32_t placement, uint32_t index, uint32_t batch) {
+    auto &state = GetSlabState();
+    char *&local = free_list[placement][index];
+    char *&global = state.free_list[placement][index];
+    std::lock_guard<std::mutex> lock(state.mutex);
+    for (uint32_t i = 0; i < batch && local; ++i) {
+      char *node = local;
+      local = NextFree(node);
+      NextFree(node) = global;
+      global = node;
+      --count[placement][index];
+    }
+  }
 
-  // Now do the PMwCAS
-  pmwcas::Descriptor *pd = pmwcas_pool->AllocateDescriptor();
-  pd->AddEntry(&(&header.status)->word, expected_status.word, desired_status.word);
-  pd->AddEntry(&meta_ptr->meta, expected_meta.meta, desired_meta.meta);
-  if (!pd->MwCAS()) {
-    goto retry;
+  // Take a batch of nodes of class [index] from the global free list, or carve
+  // them out of a slab if it's empty
+  void Refill(uint32_t placement, uint32_t index, uint32_t class_size) {
+    auto &state = GetSlabState();
+    uint32_t batch = GetBatchSize(class_size);
+    char *&local = free_list[placement][index];
+    char *&global = state.free_list[placement][index];
+    uint32_t &local_count = count[placement][index];
+    std::lock_guard<std::mutex> lock(state.mutex);
+    while (local_count < batch && global) {
+      char *node = global;
+      global = NextFree(node);
+      NextFree(node) = local;
+      local = node;
+      ++local_count;
+    }
+    if (local_count > 0) {
+      return;
+    }
+    uint32_t carved = 0;
+    char *nodes = CarveNodes(placement, index, class_size, batch, &carved);
+    for (uint32_t i = carved; i > 0; --i) {
+      char *node = nodes + (i - 1) * class_size;
+      NextFree(node) = local;
+      local = node;
+    }
+    local_count = carved;
   }
 
-  // Reserved space! Now copy data
-  // The key size must be padded to 64bit
-  uint64_t offset = header.size - desired_status.GetBlockSize();
-  char *ptr = &(reinterpret_cast<char *>(this))[offset];
-  memcpy(ptr, key, key_size);
-  memcpy(ptr + padded_key_size, &payload, sizeof(payload));
-  // Flush the word
+  ~ThreadCache() {
+    for (uint32_t p = 0; p < kPlacements; ++p) {
+      for (uint32_t i = 0; i < NodeAllocator::kSizeClasses; ++i) {
+        if (count[p][i]) {
+          Release(p, i, count[p][i]);
+        }
+      }
+    }
+  }
+};
 
-#ifdef PMEM
-  pmwcas::NVRAM::Flush(total_size, ptr);
+ThreadCache &GetThreadCache() {
+  thread_local ThreadCache cache;
+  return cache;
+}
+}  // namespace
 #endif
 
+void NodeAllocator::UseHugePages(bool enable) {
+#ifndef PMDK
+  GetSlabState().huge_pages = enable;
+#endif
+}
+
+void NodeAllocator::SetNumaPlacement(NumaPlacement placement) {
+#ifndef PMDK
+  GetSlabState().numa_placement = placement;
+#endif
+}
+
+void NodeAllocator::Allocate(void **mem, uint32_t size, bool internal) {
+#ifndef PMDK
+  auto &state = GetSlabState();
+  if (state.huge_pages.load(std::memory_order_relaxed) && size <= kMaxSlabNodeSize) {
+    uint32_t class_size = 0;
+    uint32_t index = GetSizeClass(size, &class_size);
+    uint32_t placement =
+        GetPlacement(state.numa_placement.load(std::memory_order_relaxed), internal);
+    auto &cache = GetThreadCache();
+    char *&free_list = cache.free_list[placement][index];
+    if (!free_list) {
+      cache.Refill(placement, index, class_size);
+    }
+    if (free_list) {
+      *mem = free_list;
+      free_list = NextFree(free_list);
+      --cache.count[placement][index];
+      return;
+    }
+    // Out of mappings, fall back to the regular allocator
+  }
+#endif
+  pmwcas::Allocator::Get()->Allocate(mem, size);
+}
+
+void NodeAllocator::Free(void *mem) {
+  if (!mem) {
+    return;
+  }
+#ifndef PMDK
+  uint32_t placement = 0;
+  int32_t index = FindSlab(mem, &placement);
+  if (index >= 0) {
+    auto &cache = GetThreadCache();
+    NextFree(reinterpret_cast<char *>(mem)) = cache.free_list[placement][index];
+    cache.free_list[placement][index] = reinterpret_cast<char *>(mem);
+    uint32_t batch = ThreadCache::GetBatchSize(GetClassSize(index));
+    if (++cache.count[placement][index] > 2 * batch) {
+      cache.Release(placement, index, batch);
+    }
+    return;
+  }
+#endif
+  pmwcas::Allocator::Get()->Free(mem);
+}
+
+uint64_t NodeAllocator::GetSlabBytes() {
+#ifndef PMDK
+  auto &state = GetSlabState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return state.slab_bytes;
+#else
+  return 0;
+#endif
+}
+
+void InternalNode::New(bztree::InternalNode **mem, uint32_t alloc_size) {
+#ifdef  PMDK
+  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), alloc_size);
+  memset(*mem, 0, alloc_size);
+  (*mem)->header.size = alloc_size;
+  *mem = Allocator::Get()->GetOffset(*mem);
+#else
+  NodeAllocator::Allocate(reinterpret_cast<void **>(mem), alloc_size, true);
+  memset(*mem, 0, alloc_size);
+  (*mem)->header.size = alloc_size;
+#endif  // PMDK
+}
+
+// Create an internal node with a new key and associated child pointers inserted
+// based on an existing internal node
+void InternalNode::New(InternalNode *src_node,
+                       const char *key,
+                       uint32_t key_size,
+                       uint64_t left_child_addr,
+                       uint64_t right_child_addr,
+                       InternalNode **mem,
+                       uint32_t child_index) {
+  uint32_t alloc_size = src_node->GetHeader()->size +
+      RecordMetadata::PadKeyLength(key_size) +
+      sizeof(right_child_addr) + sizeof(RecordMetadata);
+
+  char *image = BeginNodeImage(reinterpret_cast<void **>(mem), alloc_size, true);
+  new(image) InternalNode(alloc_size, src_node, 0, src_node->header.sorted_count,
+                          key, key_size, left_child_addr, right_child_addr, 0, child_index);
+  EndNodeImage(reinterpret_cast<void **>(mem), image, alloc_size);
+}
+
+// Create an internal node with a single separator key and two pointers
+void InternalNode::New(const char *key,
+                       uint32_t key_size,
+                       uint64_t left_child_addr,
+                       uint64_t right_child_addr,
+                       InternalNode **mem) {
+  uint32_t alloc_size = sizeof(InternalNode) +
+      RecordMetadata::PadKeyLength(key_size) +
+      sizeof(left_child_addr) +
+      sizeof(right_child_addr) +
+      sizeof(RecordMetadata) * 2;
+  char *image = BeginNodeImage(reinterpret_cast<void **>(mem), alloc_size, true);
+  new(image) InternalNode(alloc_size, key, key_size, left_child_addr, right_child_addr);
+  EndNodeImage(reinterpret_cast<void **>(mem), image, alloc_size);
+}
+
+uint32_t InternalNode::GetNodeSize(const uint16_t *key_sizes, uint32_t count) {
+  uint32_t size = sizeof(InternalNode) + count * (sizeof(RecordMetadata) + sizeof(uint64_t));
+  for (uint32_t i = 1; i < count; ++i) {
+    size += RecordMetadata::PadKeyLength(key_sizes[i]);
+  }
+  return size;
+}
+
+void InternalNode::New(const char *const *keys, const uint16_t *key_sizes,
+                       const uint64_t *children, uint32_t count, InternalNode **mem) {
+  uint32_t alloc_size = GetNodeSize(key_sizes, count);
+  char *image = BeginNodeImage(reinterpret_cast<void **>(mem), alloc_size, true);
+  Build(keys, key_sizes, children, count, image);
+  EndNodeImage(reinterpret_cast<void **>(mem), image, alloc_size);
+}
+
+void InternalNode::Build(const char *const *keys, const uint16_t *key_sizes,
+                         const uint64_t *children, uint32_t count, char *image) {
+  uint32_t alloc_size = GetNodeSize(key_sizes, count);
+  auto *node = reinterpret_cast<InternalNode *>(image);
+  node->header.size = alloc_size;
+
+  uint32_t offset = alloc_size;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint16_t key_size = i == 0 ? 0 : key_sizes[i];
+    auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+    offset -= padded_key_size + sizeof(uint64_t);
+    node->record_metadata[i].FinalizeForInsert(offset, key_size,
+                                               padded_key_size + sizeof(uint64_t));
+    char *ptr = reinterpret_cast<char *>(node) + offset;
+    memcpy(ptr, keys[i], key_size);
+    memcpy(ptr + padded_key_size, &children[i], sizeof(uint64_t));
+  }
+  node->header.sorted_count = count;
+  assert(offset == sizeof(InternalNode) + count * sizeof(RecordMetadata));
+  node->FitSearchModel();
+}
+
+// Create an internal node with keys and pointers in the provided range from an
+// existing source node
+void InternalNode::New(InternalNode *src_node,
+                       uint32_t begin_meta_idx, uint32_t nr_records,
+                       const char *key, uint32_t key_size,
+                       uint64_t left_child_addr, uint64_t right_child_addr,
+                       InternalNode **new_node,
+                       uint64_t left_most_child_addr,
+                       uint32_t child_index) {
+  // Figure out how large the new node will be
+  uint32_t alloc_size = sizeof(InternalNode);
+  if (begin_meta_idx > 0) {
+    // Will not copy from the first element (dummy key), so add it here
+    alloc_size += src_node->record_metadata[0].GetTotalLength();
+    alloc_size += sizeof(RecordMetadata);
+  }
+
+  assert(nr_records > 0);
+  for (uint32_t i = begin_meta_idx; i < begin_meta_idx + nr_records; ++i) {
+    RecordMetadata meta = src_node->record_metadata[i];
+    alloc_size += meta.GetTotalLength();
+    alloc_size += sizeof(RecordMetadata);
+  }
+
+  // Add the new key, if provided
+  if (key) {
+    ALWAYS_ASSERT(key_size > 0);
+    alloc_size +=
+        (RecordMetadata::PadKeyLength(key_size) + sizeof(uint64_t) + sizeof(RecordMetadata));
+  }
+
+  char *image = BeginNodeImage(reinterpret_cast<void **>(new_node), alloc_size, true);
+  new(image) InternalNode(alloc_size, src_node, begin_meta_idx, nr_records,
+                          key, key_size, left_child_addr, right_child_addr,
+                          left_most_child_addr, child_index);
+  EndNodeImage(reinterpret_cast<void **>(new_node), image, alloc_size);
+}
+
+InternalNode::InternalNode(uint32_t node_size,
+                           const char *key,
+                           const uint16_t key_size,
+                           uint64_t left_child_addr,
+                           uint64_t right_child_addr)
+    : BaseNode(false, node_size) {
+  // Initialize a new internal node with one key only
+  header.sorted_count = 2;  // Includes the null dummy key
+  header.size = node_size;
+
+  // Fill in left child address, with an empty key
+  uint64_t offset = node_size - sizeof(left_child_addr);
+  record_metadata[0].FinalizeForInsert(offset, 0, sizeof(left_child_addr));
+  char *ptr = reinterpret_cast<char *>(this) + offset;
+  memcpy(ptr, &left_child_addr, sizeof(left_child_addr));
+
+  // Fill in right child address, with the separator key
+  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+  auto total_len = padded_key_size + sizeof(right_child_addr);
+  offset -= total_len;
+  record_metadata[1].FinalizeForInsert(offset, key_size, total_len);
+  ptr = reinterpret_cast<char *>(this) + offset;
+  memcpy(ptr, key, key_size);
+  memcpy(ptr + padded_key_size, &right_child_addr, sizeof(right_child_addr));
+
+  assert((uint64_t) ptr == (uint64_t) this + sizeof(*this) + 2 * sizeof(RecordMetadata));
+}
+
+InternalNode::InternalNode(uint32_t node_size,
+                           InternalNode *src_node,
+                           uint32_t begin_meta_idx,
+                           uint32_t nr_records,
+                           const char *key,
+                           const uint16_t key_size,
+                           uint64_t left_child_addr,
+                           uint64_t right_child_addr,
+                           uint64_t left_most_child_addr,
+                           uint32_t child_index)
+    : BaseNode(false, node_size) {
+  ALWAYS_ASSERT(src_node);
+  __builtin_prefetch((const void *) (src_node), 0, 3);
+  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+
+  uint64_t offset = node_size;
+  bool need_insert_new = key;
+  uint32_t insert_idx = 0;
+
+  // See if we need a new left_most_child_addr, i.e., this must be the new node
+  // on the right
+  if (left_most_child_addr) {
+    offset -= sizeof(uint64_t);
+    record_metadata[0].FinalizeForInsert(offset, 0, sizeof(uint64_t));
+    memcpy(reinterpret_cast<char *>(this) + offset, &left_most_child_addr, sizeof(uint64_t));
+    ++insert_idx;
+  }
+
+  assert(nr_records > 0);
+
+  for (uint32_t i = begin_meta_idx; i < begin_meta_idx + nr_records; ++i) {
+    RecordMetadata meta = src_node->record_metadata[i];
+    assert(meta.IsVisible());
+    uint64_t m_payload = 0;
+    char *m_key = nullptr;
+    char *m_data = nullptr;
+    src_node->GetRawRecord(meta, &m_data, &m_key, &m_payload);
+    auto m_key_size = meta.GetKeyLength();
+
+    if (!need_insert_new) {
+      // New key already inserted, so directly insert the key from src node
+      assert(meta.GetTotalLength() >= sizeof(uint64_t));
+      offset -= (meta.GetTotalLength());
+      record_metadata[insert_idx].FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
+      memcpy(reinterpret_cast<char *>(this) + offset, m_data, meta.GetTotalLength());
+    } else {
+      // Compare the two keys to see which one to insert (first), an equal
+      // separator goes right after the child that was split
+      auto cmp = KeyCompare(m_key, m_key_size, key, key_size);
+      if (cmp == 0 && key_size == m_key_size) {
+        cmp = i > child_index ? 1 : -1;
+      }
+
+      if (cmp > 0) {
+        assert(insert_idx >= 1);
+
+        // Modify the previous key's payload to left_child_addr
+        auto prev_meta = record_metadata[insert_idx - 1];
+
+        memcpy(reinterpret_cast<char *>(this) +
+                   prev_meta.GetOffset() + prev_meta.GetPaddedKeyLength(),
+               &left_child_addr, sizeof(left_child_addr));
+
+        // Now the new separtor key itself
+        offset -= (padded_key_size + sizeof(right_child_addr));
+        record_metadata[insert_idx].FinalizeForInsert(
+            offset, key_size, padded_key_size + sizeof(left_child_addr));
+
+        ++insert_idx;
+        memcpy(reinterpret_cast<char *>(this) + offset, key, key_size);
+        memcpy(reinterpret_cast<char *>(this) + offset + padded_key_size,
+               &right_child_addr, sizeof(right_child_addr));
+
+        offset -= (meta.GetTotalLength());
+        assert(meta.GetTotalLength() >= sizeof(uint64_t));
+        record_metadata[insert_idx].FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
+        memcpy(reinterpret_cast<char *>(this) + offset, m_data, meta.GetTotalLength());
+
+        need_insert_new = false;
+      } else {
+        assert(meta.GetTotalLength() >= sizeof(uint64_t));
+        offset -= (meta.GetTotalLength());
+        record_metadata[insert_idx].FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
+        memcpy(reinterpret_cast<char *>(this) + offset, m_data, meta.GetTotalLength());
+      }
+    }
+    ++insert_idx;
+  }
+
+  if (need_insert_new) {
+    // The new key-payload pair will be the right-most (largest key) element
+    uint32_t total_size = RecordMetadata::PadKeyLength(key_size) + sizeof(uint64_t);
+    offset -= total_size;
+    record_metadata[insert_idx].FinalizeForInsert(offset, key_size, total_size);
+    memcpy(reinterpret_cast<char *>(this) + offset, key, key_size);
+    memcpy(reinterpret_cast<char *>(this) + offset + RecordMetadata::PadKeyLength(key_size),
+           &right_child_addr, sizeof(right_child_addr));
+
+    // Modify the previous key's payload to left_child_addr
+    auto prev_meta = record_metadata[insert_idx - 1];
+    memcpy(reinterpret_cast<char *>(this) + prev_meta.GetOffset() + prev_meta.GetPaddedKeyLength(),
+           &left_child_addr, sizeof(left_child_addr));
+
+    ++insert_idx;
+  }
+
+  header.size = node_size;
+  header.sorted_count = insert_idx;
+  FitSearchModel();
+}
+
+// Insert record to this internal node. The node is frozen at this time.
+bool InternalNode::PrepareForSplit(Stack &stack,
+                                   uint32_t internal_node_size,
+                                   const char *key,
+                                   uint32_t key_size,
+                                   uint64_t left_child_addr,   // [key]'s left child pointer
+                                   uint64_t right_child_addr,  // [key]'s right child pointer
+                                   InternalNode **new_node,
+                                   pmwcas::Descriptor *pd,
+                                   pmwcas::DescriptorPool *pool,
+                                   bool backoff,
+                                   bool appending) {
+  uint32_t data_size = header.size + key_size +
+      sizeof(right_child_addr) + sizeof(RecordMetadata);
+  uint32_t new_node_size = sizeof(InternalNode) + data_size;
+  uint32_t child_index = stack.Top()->meta_index;
+  if (new_node_size < internal_node_size) {
+    // good boy
+    InternalNode::New(this, key, key_size, left_child_addr,
+                      right_child_addr, new_node, child_index);
+    return true;
+  }
+
+  // After adding a key and pointers the new node would be too large. This
+  // means we are effectively 'moving up' the tree to do split
+  // So now we split the node and generate two new internal nodes
+  ALWAYS_ASSERT(header.sorted_count >= 2);
+  uint32_t n_left = header.sorted_count >> 1;
+  if (appending && header.sorted_count > 2) {
+    // Keys past the last one will keep coming to the right node: leave it
+    // with the last record, plus the new key, and all others to the left one
+    auto last_meta = record_metadata[header.sorted_count - 1];
+    char *last_key = nullptr;
+    uint64_t last_payload = 0;
+    GetRawRecord(last_meta, nullptr, &last_key, &last_payload);
+    if (KeyCompare(key, key_size, last_key, last_meta.GetKeyLength()) > 0) {
+      n_left = header.sorted_count - 2;
+    }
+  }
+
+  auto i_left = pd->ReserveAndAddEntry(
+      reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+      reinterpret_cast<uint64_t>(nullptr),
+      pmwcas::Descriptor::kRecycleNewOnFailure);
+  auto i_right = pd->ReserveAndAddEntry(
+      reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+      reinterpret_cast<uint64_t>(nullptr),
+      pmwcas::Descriptor::kRecycleNewOnFailure);
+  uint64_t *ptr_l = pd->GetNewValuePtr(i_left);
+  uint64_t *ptr_r = pd->GetNewValuePtr(i_right);
+
+  // Figure out where the new key will go
+  auto separator_meta = record_metadata[n_left];
+  char *separator_key = nullptr;
+  uint16_t separator_key_size = separator_meta.GetKeyLength();
+  uint64_t separator_payload = 0;
+  bool success = GetRawRecord(separator_meta, nullptr, &separator_key,
+                              &separator_payload);
+  ALWAYS_ASSERT(success);
+
+  int cmp = KeyCompare(key, key_size, separator_key, separator_key_size);
+  if (cmp == 0) {
+    cmp = key_size - separator_key_size;
+  }
+  if (cmp == 0) {
+    // Same key as the separator: follow the child that was split
+    cmp = child_index < n_left ? -1 : 1;
+  }
+  if (cmp < 0) {
+    // Should go to left
+    InternalNode::New(this, 0, n_left, key, key_size,
+                      left_child_addr, right_child_addr,
+                      reinterpret_cast<InternalNode **>(ptr_l), 0, child_index);
+    InternalNode::New(this, n_left + 1, header.sorted_count - n_left - 1,
+                      nullptr, 0, 0, 0,
+                      reinterpret_cast<InternalNode **>(ptr_r), separator_payload);
+  } else {
+    InternalNode::New(this, 0, n_left, nullptr, 0, 0, 0,
+                      reinterpret_cast<InternalNode **>(ptr_l), 0);
+    InternalNode::New(this, n_left + 1, header.sorted_count - n_left - 1,
+                      key, key_size, left_child_addr, right_child_addr,
+                      reinterpret_cast<InternalNode **>(ptr_r), separator_payload, child_index);
+  }
+  assert(*ptr_l);
+  assert(*ptr_r);
+
+  // Pop here as if this were a leaf node so that when we get back to the
+  // original caller, we get stack top as the "parent"
+  stack.Pop();
+
+  // Now get this internal node's real parent
+  InternalNode *parent = stack.Top() ?
+                         stack.Top()->node : nullptr;
+  if (parent == nullptr) {
+    // Good!
+    InternalNode::New(separator_key, separator_key_size,
+                      (uint64_t) *ptr_l, (uint64_t) *ptr_r, new_node);
+    return true;
+  }
+  __builtin_prefetch((const void *) (parent), 0, 2);
+
+  // Try to freeze the parent node first
+#ifdef PMDK
+  uint64_t self_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(this));
+#else
+  uint64_t self_addr = reinterpret_cast<uint64_t>(this);
+#endif
+  uint32_t self_index = stack.Top()->meta_index;
+  bool frozen_by_me = false;
+  while (!parent->IsFrozen() && parent->HasChild(self_index, self_addr)) {
+    frozen_by_me = parent->FreezeIfChild(self_index, self_addr, pool);
+  }
+
+  // Someone else froze the parent node and we are told not to compete with
+  // others (for now), or this node was already replaced in the parent
+  if (!frozen_by_me && (backoff || !parent->HasChild(self_index, self_addr))) {
+    return false;
+  }
+
+  return parent->PrepareForSplit(stack, internal_node_size,
+                                 separator_key, separator_key_size,
+                                 (uint64_t) *ptr_l, (uint64_t) *ptr_r,
+                                 new_node, pd, pool, backoff, appending);
+}
+
+const uint32_t LeafNode::kMaxLanes;
+const uint32_t LeafNode::kLaneSize;
+
+void LeafNode::New(LeafNode **mem, uint32_t node_size, bool bloom_filter, uint32_t lanes) {
+#ifdef PMDK
+  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), node_size);
+  memset(*mem, 0, node_size);
+  new(*mem)LeafNode(node_size, bloom_filter, lanes);
+  PersistBatch::Add(*mem, node_size);
+  *mem = Allocator::Get()->GetOffset(*mem);
+#else
+  NodeAllocator::Allocate(reinterpret_cast<void **>(mem), node_size);
+  memset(*mem, 0, node_size);
+  new(*mem) LeafNode(node_size, bloom_filter, lanes);
+#ifdef PMEM
+  PersistBatch::Add(*mem, node_size);
+#endif  // PMEM
+#endif  // PMDK
+}
+
+void BaseNode::Dump(pmwcas::EpochManager *epoch) {
+  std::cout << "-----------------------------" << std::endl;
+  std::cout << " Dumping node: " << this << (is_leaf ? " (leaf)" : " (internal)") << std::endl;
+  std::cout << " Header:\n";
+  if (is_leaf) {
+    std::cout << " - free space: " << (reinterpret_cast<LeafNode *>(this))->GetFreeSpace()
+              << std::endl;
+  }
+  std::cout << " - status: 0x" << std::hex << header.status.word << std::endl
+            << "   (control = 0x" << (header.status.word & NodeHeader::StatusWord::kControlMask)
+            << std::dec
+            << ", frozen = " << header.status.IsFrozen()
+            << ", block size = " << header.status.GetBlockSize()
+            << ", delete size = " << header.status.GetDeletedSize()
+            << ", record count = " << header.status.GetRecordCount() << ")\n"
+            << " - sorted_count: " << header.sorted_count
+            << std::endl;
+
+  std::cout << " - size: " << header.size << std::endl;
+
+  std::cout << " Record Metadata Array:" << std::endl;
+  uint32_t n_meta = std::max<uint32_t>(header.status.GetRecordCount(), header.sorted_count);
+  for (uint32_t i = 0; i < n_meta; ++i) {
+    RecordMetadata meta = record_metadata[i];
+    std::cout << " - record " << i << ": meta = 0x" << std::hex << meta.meta << std::endl;
+    std::cout << std::hex;
+    std::cout << "   (control = 0x" << (meta.meta & RecordMetadata::kControlMask)
+              << std::dec
+              << ", visible = " << meta.IsVisible()
+              << ", offset = " << meta.GetOffset()
+              << ", var payload = " << meta.HasVarPayload()
+              << ", key length = " << meta.GetKeyLength()
+              << ", total length = " << meta.GetTotalLength()
+              << std::endl;
+  }
+}
+
+void LeafNode::Dump(pmwcas::EpochManager *epoch) {
+  BaseNode::Dump(epoch);
+  std::cout << " Key-Payload Pairs:" << std::endl;
+  for (uint32_t i = 0; i < header.status.GetRecordCount(); ++i) {
+    RecordMetadata meta = record_metadata[i];
+    if (meta.IsVisible()) {
+      uint64_t payload = 0;
+      char *key = nullptr;
+      GetRawRecord(meta, &key, meta.HasVarPayload() ? nullptr : &payload, epoch);
+      assert(key);
+      std::string keystr(GetPrefix(), GetPrefixSize());
+      keystr.append(key, meta.GetKeyLength());
+      std::cout << " - record " << i << ": key = " << keystr;
+      if (meta.HasVarPayload()) {
+        std::cout << ", payload = (" << meta.GetPayloadLength() << " bytes)" << std::endl;
+      } else {
+        std::cout << ", payload = " << payload << std::endl;
+      }
+    }
+  }
+
+  std::cout << "-----------------------------" << std::endl;
+}
+
+void InternalNode::Dump(pmwcas::EpochManager *epoch, bool dump_children) {
+  BaseNode::Dump(epoch);
+  std::cout << " Child pointers and separator keys:" << std::endl;
+  assert(header.status.GetRecordCount() == 0);
+  for (uint32_t i = 0; i < header.sorted_count; ++i) {
+    auto &meta = record_metadata[i];
+    assert((i == 0 && meta.GetKeyLength() == 0) || (i > 0 && meta.GetKeyLength() > 0));
+    uint64_t right_child_addr = 0;
+    char *key = nullptr;
+    GetRawRecord(meta, nullptr, &key, &right_child_addr);
+    if (key) {
+      std::string keystr(key, key + meta.GetKeyLength());
+      std::cout << " || " << keystr << " | ";
+    }
+    std::cout << std::hex << "0x" << right_child_addr << std::dec;
+  }
+  std::cout << std::endl;
+
+  if (dump_children) {
+    for (uint32_t i = 0; i < header.sorted_count; ++i) {
+      uint64_t node_addr = *GetPayloadPtr(record_metadata[i]);
+#ifdef  PMDK
+      BaseNode *node = Allocator::Get()->GetDirect(reinterpret_cast<BaseNode *>(node_addr));
+#else
+      BaseNode *node = reinterpret_cast<BaseNode *>(node_addr);
+#endif
+      if (node->IsLeaf()) {
+        (reinterpret_cast<LeafNode *>(node))->Dump(epoch);
+      } else {
+        (reinterpret_cast<InternalNode *>(node))->Dump(epoch, true);
+      }
+    }
+  }
+}
+
+ReturnCode LeafNode::Insert(const char *key, uint16_t key_size, uint64_t payload,
+                            pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                            VersionWriter *versions, bool unique) {
+  return InsertRecord(key, key_size, reinterpret_cast<char *>(&payload), sizeof(payload), false,
+                      pmwcas_pool, split_threshold, versions, unique);
+}
+
+ReturnCode LeafNode::Insert(const char *key, uint16_t key_size,
+                            const char *payload, uint32_t payload_size,
+                            pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                            VersionWriter *versions, bool unique) {
+  return InsertRecord(key, key_size, payload, payload_size, true,
+                      pmwcas_pool, split_threshold, versions, unique);
+}
+
+ReturnCode LeafNode::ReserveRecord(uint32_t total_size, uint32_t split_threshold,
+                                   pmwcas::DescriptorPool *pmwcas_pool,
+                                   RecordMetadata **meta_ptr, RecordMetadata *reserved_meta,
+                                   NodeHeader::StatusWord *reserved_status) {
+  NodeHeader::StatusWord expected_status = header.GetStatus();
+  if (expected_status.IsFrozen()) {
+    return ReturnCode::NodeFrozen();
+  }
+
+  // Check space to see if we need to split the node; a packed leaf fills up
+  // before it gets to the threshold
+  auto new_size = LeafNode::GetUsedSpace(expected_status) + sizeof(RecordMetadata) + total_size;
+  if (new_size >= split_threshold || new_size > header.size) {
+    return ReturnCode::NotEnoughSpace();
+  }
+
+  // Now try to reserve space in the free space region using a PMwCAS. Two steps:
+  // Step 1. Incrementing the record count and block size fields in [status]
+  // Step 2. Flip the record metadata entry's high order bit and fill in global
+  // epoch
+  NodeHeader::StatusWord desired_status = expected_status;
+
+  // Block size includes both key and payload sizes
+  desired_status.PrepareForInsert(total_size);
+
+  // Get the tentative metadata entry (again, make a local copy to work on it)
+  *meta_ptr = &record_metadata[expected_status.GetRecordCount()];
+  RecordMetadata expected_meta = **meta_ptr;
+  if (!expected_meta.IsVacant()) {
+    return ReturnCode::PMWCASFailure();
+  }
+
+  RecordMetadata desired_meta;
+  desired_meta.PrepareForInsert();
+
+  // Now do the PMwCAS
+  pmwcas::Descriptor *pd = NewDescriptor(pmwcas_pool);
+  pd->AddEntry(&(&header.status)->word, expected_status.word, desired_status.word);
+  pd->AddEntry(&(*meta_ptr)->meta, expected_meta.meta, desired_meta.meta);
+  if (!RunMwCAS(pd)) {
+    RetryAfterPMwCASFailure();
+    return ReturnCode::PMWCASFailure();
+  }
+  *reserved_meta = desired_meta;
+  *reserved_status = desired_status;
+  return ReturnCode::Ok();
+}
+
+char *LeafNode::FillRecord(NodeHeader::StatusWord status, const char *key, uint16_t key_size,
+                           const char *payload, uint32_t payload_size, bool flush) {
+  // Reserved space! Now copy data
+  // The key size must be padded to 64bit
+  uint64_t offset = header.size - status.GetBlockSize();
+  char *ptr = &(reinterpret_cast<char *>(this))[offset];
+  memcpy(ptr, key, key_size);
+  memcpy(ptr + RecordMetadata::PadKeyLength(key_size), payload, payload_size);
+
+  // The fingerprint must be in place before the record becomes visible
+  uint32_t index = status.GetRecordCount() - 1;
+  bool has_fingerprint = index < GetFingerprintCapacity(header.size);
+  if (has_fingerprint) {
+    GetFingerprints()[index] = KeyFingerprint(key, key_size);
+  }
+  // Flush the word
+
+#ifdef PMEM
+  if (flush) {
+    PersistBatch::Add(ptr, RecordMetadata::PadKeyLength(key_size) + payload_size);
+    if (has_fingerprint) {
+      PersistBatch::Add(GetFingerprints() + index, 1);
+    }
+    // The bits were set before the space was reserved
+    if (HasBloomFilter()) {
+      uint64_t hash = KeyHash(key, key_size);
+      for (uint32_t i = 0; i < kBloomFilterProbes; ++i) {
+        PersistBatch::Add(GetBloomFilter() + NextBloomFilterBit(&hash) / 64, sizeof(uint64_t));
+      }
+    }
+  }
+#endif
+  return ptr;
+}
+
+ReturnCode LeafNode::InsertRecord(const char *key, uint16_t key_size,
+                                  const char *payload, uint32_t payload_size, bool var_payload,
+                                  pmwcas::DescriptorPool *pmwcas_pool,
+                                  uint32_t split_threshold, VersionWriter *versions,
+                                  bool unique) {
+  // Keys get to a node through its bounds, which all keys sharing the node's
+  // prefix fall in
+  bool has_prefix = StripPrefix(&key, &key_size);
+  ALWAYS_ASSERT(has_prefix);
+  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+  auto total_size = padded_key_size + payload_size;
+  RecordMetadata *meta_ptr = nullptr;
+  RecordMetadata desired_meta;
+  NodeHeader::StatusWord desired_status;
+  Uniqueness uniqueness;
+  retry:
+  // If frozon then retry
+  if (header.GetStatus().IsFrozen()) {
+    return ReturnCode::NodeFrozen();
+  }
+
+  uniqueness = unique ? CheckUnique(key, key_size, pmwcas_pool->GetEpoch()) : IsUnique;
+  if (uniqueness == Duplicate) {
+    return ReturnCode::KeyExists();
+  }
+  AddToBloomFilter(key, key_size);
+
+  auto rc = ReserveRecord(RecordMetadata::PadLength(total_size), split_threshold, pmwcas_pool,
+                          &meta_ptr, &desired_meta, &desired_status);
+  if (rc.IsPMWCASFailure()) {
+    goto retry;
+  } else if (!rc.IsOk()) {
+    return rc;
+  }
+
+  char *ptr = FillRecord(desired_status, key, key_size, payload, payload_size);
+  uint64_t offset = ptr - reinterpret_cast<char *>(this);
+
+  retry_phase2:
+  // Re-check if the node is frozen
+  if (uniqueness == ReCheck) {
+    auto new_uniqueness = RecheckUnique(key, key_size, desired_status.GetRecordCount() - 1);
+    if (new_uniqueness == Duplicate) {
+      memset(ptr, 0, padded_key_size + payload_size);
+      offset = 0;
+    } else if (new_uniqueness == NodeFrozen) {
+      return ReturnCode::NodeFrozen();
+    }
+  }
+  // Final step: make the new record visible, a 2-word PMwCAS:
+  // 1. Metadata - set the visible bit and actual block offset
+  // 2. Status word - set to the initial value read above (s) to detect
+  // conflicting threads that are trying to set the frozen bit; or the lane of
+  // this thread, which only changes when they do
+  auto new_meta = desired_meta;
+  new_meta.FinalizeForInsert(offset, key_size, total_size, var_payload);
+
+  uint64_t *guard = &(&header.status)->word;
+  NodeHeader::StatusWord s;
+  if (GetLaneCount()) {
+    uint32_t lane = GetLaneIndex() % GetLaneCount();
+    guard = &GetLane(lane)->word;
+    s = GetLaneStatus(lane);
+  } else {
+    s = header.GetStatus();
+  }
+  if (s.IsFrozen()) {
+    return ReturnCode::NodeFrozen();
+  }
+  auto pd = NewDescriptor(pmwcas_pool);
+  pd->AddEntry(guard, s.word, s.word);
+  pd->AddEntry(&meta_ptr->meta, desired_meta.meta, new_meta.meta);
+  if (versions && offset != 0) {
+    versions->Save(this, key, key_size, RecordMetadata());
+  }
+  // The record has to be persistent before it's visible
+  PersistBatch::Drain();
+  bool visible = RunMwCAS(pd);
+  if (versions) {
+    versions->Finish(visible);
+  }
+  if (visible) {
+    return offset == 0 ? ReturnCode::KeyExists() : ReturnCode::Ok();
+  } else {
+    RetryAfterPMwCASFailure();
+    goto retry_phase2;
+  }
+}
+
+ReturnCode LeafNode::PrepareInsert(const char *key, uint16_t key_size, uint64_t payload,
+                                   pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                                   const PreparedWrite *earlier, uint32_t earlier_count,
+                                   PreparedWrite *write) {
+  // The same steps as InsertRecord, short of making the record visible
+  bool has_prefix = StripPrefix(&key, &key_size);
+  ALWAYS_ASSERT(has_prefix);
+  auto total_size = RecordMetadata::PadKeyLength(key_size) + sizeof(payload);
+  RecordMetadata desired_meta;
+  NodeHeader::StatusWord desired_status;
+  Uniqueness uniqueness;
+  while (true) {
+    if (header.GetStatus().IsFrozen()) {
+      return ReturnCode::NodeFrozen();
+    }
+    uniqueness = CheckUnique(key, key_size, pmwcas_pool->GetEpoch());
+    if (uniqueness == Duplicate) {
+      return ReturnCode::KeyExists();
+    }
+    AddToBloomFilter(key, key_size);
+    auto rc = ReserveRecord(RecordMetadata::PadLength(total_size), split_threshold, pmwcas_pool,
+                            &write->meta_ptr, &desired_meta, &desired_status);
+    if (rc.IsOk()) {
+      break;
+    } else if (!rc.IsPMWCASFailure()) {
+      return rc;
+    }
+  }
+
+  char *ptr = FillRecord(desired_status, key, key_size, reinterpret_cast<char *>(&payload),
+                         sizeof(payload));
+  auto new_meta = desired_meta;
+  new_meta.FinalizeForInsert(ptr - reinterpret_cast<char *>(this), key_size, total_size);
+  write->word = &write->meta_ptr->meta;
+  write->old_value = desired_meta.meta;
+  write->new_value = new_meta.meta;
+  write->meta = desired_meta;
+  write->insert = true;
+
+  // Waiting for another thread inserting the same key could deadlock: it
+  // might be waiting for a key of ours elsewhere, so back off instead
+  if (uniqueness == ReCheck) {
+    auto new_uniqueness = RecheckUnique(key, key_size, desired_status.GetRecordCount() - 1, false,
+                                        earlier, earlier_count);
+    if (new_uniqueness == NodeFrozen) {
+      return ReturnCode::NodeFrozen();
+    } else if (new_uniqueness != IsUnique) {
+      AbortInsert(*write, pmwcas_pool);
+      return new_uniqueness == Duplicate ? ReturnCode::KeyExists() : ReturnCode::PMWCASFailure();
+    }
+  }
+  return ReturnCode::Ok();
+}
+
+ReturnCode LeafNode::PrepareUpdate(const char *key, uint16_t key_size, uint64_t payload,
+                                   pmwcas::DescriptorPool *pmwcas_pool, PreparedWrite *write) {
+  if (!StripPrefix(&key, &key_size)) {
+    return ReturnCode::NotFound();
+  }
+  RecordMetadata metadata;
+  do {
+    if (header.GetStatus().IsFrozen()) {
+      return ReturnCode::NodeFrozen();
+    }
+    metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &write->meta_ptr);
+    if (metadata.IsVacant()) {
+      return ReturnCode::NotFound();
+    }
+  } while (metadata.IsInserting());
+  if (metadata.HasVarPayload()) {
+    return ReturnCode::NotEnoughSpace();
+  }
+
+  char *record_key = nullptr;
+  GetRawRecord(metadata, &record_key, &write->old_value, pmwcas_pool->GetEpoch());
+  write->word = reinterpret_cast<uint64_t *>(record_key + metadata.GetPaddedKeyLength());
+  write->new_value = payload;
+  write->meta = metadata;
+  write->insert = false;
+  return ReturnCode::Ok();
+}
+
+void LeafNode::AbortInsert(const PreparedWrite &write, pmwcas::DescriptorPool *pmwcas_pool) {
+  // Finalize it with a zero offset, like an insert that lost to a duplicate
+  RecordMetadata final_meta{write.new_value};
+  RecordMetadata aborted;
+  aborted.FinalizeForInsert(0, final_meta.GetKeyLength(), final_meta.GetTotalLength());
+  while (true) {
+    NodeHeader::StatusWord s = header.GetStatus();
+    if (s.IsFrozen()) {
+      // The new node is built without it
+      return;
+    }
+    auto pd = NewDescriptor(pmwcas_pool);
+    pd->AddEntry(&(&header.status)->word, s.word, s.word);
+    pd->AddEntry(write.word, write.old_value, aborted.meta);
+    if (RunMwCAS(pd)) {
+      return;
+    }
+    RetryAfterPMwCASFailure();
+  }
+}
+
+ReturnCode LeafNode::InsertBatch(const char *const *keys, const uint16_t *key_sizes,
+                                 const uint64_t *payloads, uint32_t count, ReturnCode *rcs,
+                                 uint32_t *done, pmwcas::DescriptorPool *pmwcas_pool,
+                                 uint32_t split_threshold, VersionWriter *versions,
+                                 bool unique) {
+  if (header.prefix_size) {
+    thread_local std::vector<const char *> suffixes;
+    thread_local std::vector<uint16_t> suffix_sizes;
+    suffixes.assign(keys, keys + count);
+    suffix_sizes.assign(key_sizes, key_sizes + count);
+    for (uint32_t i = 0; i < count; ++i) {
+      bool has_prefix = StripPrefix(&suffixes[i], &suffix_sizes[i]);
+      ALWAYS_ASSERT(has_prefix);
+    }
+    keys = suffixes.data();
+    key_sizes = suffix_sizes.data();
+  }
+  *done = 0;
+  while (*done < count) {
+    uint32_t round_done = 0;
+    auto rc = InsertRecords(keys + *done, key_sizes + *done, payloads + *done, count - *done,
+                            rcs + *done, &round_done, pmwcas_pool, split_threshold, versions,
+                            unique);
+    *done += round_done;
+    if (!rc.IsOk()) {
+      return rc;
+    }
+  }
+  return ReturnCode::Ok();
+}
+
+ReturnCode LeafNode::InsertRecords(const char *const *keys, const uint16_t *key_sizes,
+                                   const uint64_t *payloads, uint32_t count, ReturnCode *rcs,
+                                   uint32_t *done, pmwcas::DescriptorPool *pmwcas_pool,
+                                   uint32_t split_threshold, VersionWriter *versions,
+                                   bool unique) {
+  // One descriptor word for the status, the others for metadata entries
+  static const uint32_t kMaxRecords = DESC_CAP - 1;
+  Uniqueness uniqueness[kMaxRecords];
+  uint32_t index[kMaxRecords];  // Records (of [keys]) being inserted
+  uint64_t offsets[kMaxRecords];
+  RecordMetadata *meta_ptrs[kMaxRecords];
+  RecordMetadata reserved_meta;
+  uint32_t reserved = 0;
+  NodeHeader::StatusWord expected_status;
+  NodeHeader::StatusWord desired_status;
+  *done = 0;
+
+  retry:
+  expected_status = header.GetStatus();
+  if (expected_status.IsFrozen()) {
+    return ReturnCode::NodeFrozen();
+  }
+
+  // Skip existing keys and take as many records as fit in the node. The same
+  // checks as in InsertRecord, done for all records up front.
+  reserved = 0;
+  *done = 0;
+  desired_status = expected_status;
+  while (*done < count && reserved < kMaxRecords) {
+    uint32_t i = *done;
+    auto u = unique ? CheckUnique(keys[i], key_sizes[i], pmwcas_pool->GetEpoch()) : IsUnique;
+    if (u == Duplicate) {
+      rcs[i] = ReturnCode::KeyExists();
+      ++*done;
+      continue;
+    }
+    auto total_size = RecordMetadata::PadLength(
+        RecordMetadata::PadKeyLength(key_sizes[i]) + sizeof(uint64_t));
+    auto new_size = LeafNode::GetUsedSpace(desired_status) + sizeof(RecordMetadata) + total_size;
+    if (new_size >= split_threshold || new_size > header.size) {
+      break;
+    }
+    desired_status.PrepareForInsert(total_size);
+    AddToBloomFilter(keys[i], key_sizes[i]);
+    uniqueness[reserved] = u;
+    index[reserved++] = i;
+    ++*done;
+  }
+  if (reserved == 0) {
+    return *done == count ? ReturnCode::Ok() : ReturnCode::NotEnoughSpace();
+  }
+
+  // Reserve all the space and metadata entries with one PMwCAS
+  reserved_meta.PrepareForInsert();
+  auto first_index = expected_status.GetRecordCount();
+  for (uint32_t k = 0; k < reserved; ++k) {
+    meta_ptrs[k] = &record_metadata[first_index + k];
+    if (!meta_ptrs[k]->IsVacant()) {
+      goto retry;
+    }
+  }
+  auto *pd = NewDescriptor(pmwcas_pool);
+  pd->AddEntry(&(&header.status)->word, expected_status.word, desired_status.word);
+  for (uint32_t k = 0; k < reserved; ++k) {
+    pd->AddEntry(&meta_ptrs[k]->meta, 0, reserved_meta.meta);
+  }
+  if (!RunMwCAS(pd)) {
+    RetryAfterPMwCASFailure();
+    goto retry;
+  }
+
+  // The records are contiguous, fill them and flush them all at once
+  {
+    NodeHeader::StatusWord fill_status = expected_status;
+    for (uint32_t k = 0; k < reserved; ++k) {
+      uint32_t i = index[k];
+      fill_status.PrepareForInsert(RecordMetadata::PadLength(
+          RecordMetadata::PadKeyLength(key_sizes[i]) + sizeof(uint64_t)));
+      char *ptr = FillRecord(fill_status, keys[i], key_sizes[i],
+                             reinterpret_cast<const char *>(&payloads[i]), sizeof(uint64_t),
+                             false);
+      offsets[k] = ptr - reinterpret_cast<char *>(this);
+    }
+#ifdef PMEM
+    PersistBatch::Add(reinterpret_cast<char *>(this) + header.size - desired_status.GetBlockSize(),
+                      desired_status.GetBlockSize() - expected_status.GetBlockSize());
+    auto capacity = GetFingerprintCapacity(header.size);
+    if (first_index < capacity) {
+      PersistBatch::Add(GetFingerprints() + first_index,
+                        std::min(first_index + reserved, capacity) - first_index);
+    }
+    if (HasBloomFilter()) {
+      PersistBatch::Add(GetBloomFilter(), header.bloom_size);
+    }
+#endif
+  }
+
   retry_phase2:
-  // Re-check if the node is frozen
-  if (uniqueness == ReCheck) {
-    auto new_uniqueness = RecheckUnique(key, key_size,
-                                        expected_status.GetRecordCount());
-    if (new_uniqueness == Duplicate) {
-      memset(ptr, 0, key_size);
-      memset(ptr + padded_key_size, 0, sizeof(payload));
-      offset = 0;
-    } else if (new_uniqueness == NodeFrozen) {
+  for (uint32_t k = 0; k < reserved; ++k) {
+    if (uniqueness[k] == ReCheck && offsets[k] != 0) {
+      uint32_t i = index[k];
+      auto new_uniqueness = RecheckUnique(keys[i], key_sizes[i], first_index);
+      if (new_uniqueness == Duplicate) {
+        auto padded_key_size = RecordMetadata::PadKeyLength(key_sizes[i]);
+        memset(reinterpret_cast<char *>(this) + offsets[k], 0, padded_key_size + sizeof(uint64_t));
+        offsets[k] = 0;
+      } else if (new_uniqueness == NodeFrozen) {
+        *done = index[0];
+        return ReturnCode::NodeFrozen();
+      }
+    }
+  }
+
+  // Make them all visible, again with the status word to detect freezing
+  {
+    NodeHeader::StatusWord s = header.GetStatus();
+    if (s.IsFrozen()) {
+      *done = index[0];
+      return ReturnCode::NodeFrozen();
+    }
+    pd = NewDescriptor(pmwcas_pool);
+    pd->AddEntry(&(&header.status)->word, s.word, s.word);
+    for (uint32_t k = 0; k < reserved; ++k) {
+      uint32_t i = index[k];
+      auto new_meta = reserved_meta;
+      new_meta.FinalizeForInsert(offsets[k], key_sizes[i],
+                                 RecordMetadata::PadKeyLength(key_sizes[i]) + sizeof(uint64_t));
+      pd->AddEntry(&meta_ptrs[k]->meta, reserved_meta.meta, new_meta.meta);
+      if (versions && offsets[k] != 0) {
+        versions->Save(this, keys[i], key_sizes[i], RecordMetadata());
+      }
+    }
+    PersistBatch::Drain();
+    bool visible = RunMwCAS(pd);
+    if (versions) {
+      versions->Finish(visible);
+    }
+    if (!visible) {
+      RetryAfterPMwCASFailure();
+      goto retry_phase2;
+    }
+  }
+  for (uint32_t k = 0; k < reserved; ++k) {
+    rcs[index[k]] = offsets[k] == 0 ? ReturnCode::KeyExists() : ReturnCode::Ok();
+  }
+  return ReturnCode::Ok();
+}
+
+LeafNode::Uniqueness LeafNode::CheckUnique(const char *key,
+                                           uint32_t key_size,
+                                           pmwcas::EpochManager *epoch) {
+  if (!MayContain(key, key_size)) {
+    return IsUnique;
+  }
+  auto metadata = SearchRecordMeta(epoch, key, key_size, nullptr);
+  if (metadata.IsVacant()) {
+    return IsUnique;
+  }
+  // we need to perform a key compare again
+  // consider this case:
+  // a key is inserting when we "SearchRecordMeta"
+  // when get back, this meta may have finished inserting, so the following if will be false
+  // however, this key may not be duplicate, so we need to compare the key again
+  // even if this key is not duplicate, we need to return a "Recheck"
+  if (metadata.IsInserting()) {
+    return ReCheck;
+  }
+
+  ALWAYS_ASSERT(metadata.IsVisible());
+  if (KeyCompare(key, key_size, GetKey(metadata), metadata.GetKeyLength()) == 0) {
+    return Duplicate;
+  }
+  return ReCheck;
+}
+
+LeafNode::Uniqueness LeafNode::RecheckUnique(const char *key, uint32_t key_size, uint32_t end_pos,
+                                             bool wait, const PreparedWrite *skip,
+                                             uint32_t skip_count) {
+  auto current_status = GetHeader()->GetStatus();
+  if (current_status.IsFrozen()) {
+    return NodeFrozen;
+  }
+
+  // Linear search on unsorted field
+  uint32_t linear_end = std::min<uint32_t>(header.GetStatus().GetRecordCount(), end_pos);
+  thread_local std::vector<uint32_t> check_idx;
+  check_idx.clear();
+
+  auto capacity = GetFingerprintCapacity(header.size);
+  uint8_t fingerprint = KeyFingerprint(key, key_size);
+  auto check_metadata = [&](uint32_t i, bool push) -> LeafNode::Uniqueness {
+    RecordMetadata md = GetMetadata(i);
+    for (uint32_t k = 0; k < skip_count; ++k) {
+      if (skip[k].meta_ptr == &record_metadata[i]) {
+        return IsUnique;
+      }
+    }
+    if (md.IsInserting()) {
+      if (push) {
+        check_idx.push_back(i);
+      }
+      return ReCheck;
+    } else if (md.IsVacant() || !md.IsVisible()) {
+      return IsUnique;
+    } else {
+      ALWAYS_ASSERT(md.IsVisible());
+      auto len = md.GetKeyLength();
+      if (i < capacity && GetFingerprints()[i] != fingerprint) {
+        return IsUnique;
+      }
+      if (key_size == len && (KeyCompare(key, key_size, GetKey(md), len) == 0)) {
+        return Duplicate;
+      }
+      return IsUnique;
+    }
+  };
+
+  for (uint32_t i = header.sorted_count; i < linear_end; i++) {
+    if (check_metadata(i, true) == Duplicate) {
+      return Duplicate;
+    }
+  }
+
+  if (check_idx.empty()) {
+    return IsUnique;
+  } else if (!wait) {
+    return ReCheck;
+  }
+  CountPendingStat(BzTree::kStatUniqueWaits);
+  // Wait for the records still being inserted one by one, backing off while
+  // a record is in flight; they are inserted in parallel, so by the time the
+  // first one is done the others mostly are, too. Their keys are unknown to
+  // anyone but their inserters until they are visible, so there's nothing to
+  // help with. A record whose inserter found the node frozen stays in flight
+  // for good, so give up once the node is frozen.
+  for (uint32_t idx : check_idx) {
+    for (uint32_t round = 0;; ++round) {
+      auto result = check_metadata(idx, false);
+      if (result == Duplicate) {
+        return Duplicate;
+      } else if (result != ReCheck) {
+        break;
+      } else if (header.GetStatus().IsFrozen()) {
+        return NodeFrozen;
+      }
+      WaitBriefly(round);
+    }
+  }
+  return IsUnique;
+}
+
+ReturnCode LeafNode::Update(const char *key,
+                            uint16_t key_size,
+                            uint64_t payload,
+                            pmwcas::DescriptorPool *pmwcas_pool,
+                            uint32_t split_threshold,
+                            bool single_word,
+                            VersionWriter *versions) {
+  if (!StripPrefix(&key, &key_size)) {
+    return ReturnCode::NotFound();
+  }
+  retry:
+  auto old_status = header.GetStatus();
+  if (old_status.IsFrozen()) {
+    return ReturnCode::NodeFrozen();
+  }
+
+  RecordMetadata *meta_ptr = nullptr;
+  auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
+  if (metadata.IsVacant()) {
+    return ReturnCode::NotFound();
+  } else if (metadata.IsInserting()) {
+    goto retry;
+  }
+
+  if (metadata.HasVarPayload()) {
+    // Can't be updated in place, replace it with an 8-byte payload record
+    return ReplaceRecord(key, key_size, reinterpret_cast<char *>(&payload), sizeof(payload),
+                         false, meta_ptr, metadata, pmwcas_pool, split_threshold, versions);
+  }
+
+  char *record_key = nullptr;
+  uint64_t record_payload = 0;
+  GetRawRecord(metadata, &record_key, &record_payload, pmwcas_pool->GetEpoch());
+  if (payload == record_payload) {
+    return ReturnCode::Ok();
+  }
+
+  auto *slot = single_word ? GetUpdateSlot() : nullptr;
+  if (slot) {
+    // Announced before the frozen bit is checked, see UpdateSlot
+    slot->store(this, std::memory_order_seq_cst);
+    if (header.GetStatus().IsFrozen()) {
+      slot->store(nullptr, std::memory_order_release);
+      return ReturnCode::NodeFrozen();
+    }
+    auto *payload_ptr = reinterpret_cast<uint64_t *>(record_key + metadata.GetPaddedKeyLength());
+#ifdef PMEM
+    // Readers persist and clear the dirty bit if they see it before we do
+    uint64_t desired = payload | pmwcas::Descriptor::kDirtyFlag;
+#else
+    uint64_t desired = payload;
+#endif
+    if (versions) {
+      versions->Save(this, key, key_size, metadata);
+    }
+    bool swapped = __atomic_compare_exchange_n(payload_ptr, &record_payload, desired, false,
+                                               __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (versions) {
+      versions->Finish(swapped);
+    }
+#ifdef PMEM
+    if (swapped) {
+      {
+        PERF_PHASE(kFlush);
+        pmwcas::NVRAM::Flush(sizeof(uint64_t), payload_ptr);
+      }
+      __atomic_compare_exchange_n(payload_ptr, &desired, payload, false,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+#endif
+    slot->store(nullptr, std::memory_order_release);
+    if (!swapped) {
+      RetryAfterPMwCASFailure();
+      goto retry;
+    }
+    return ReturnCode::Ok();
+  }
+
+  // 1. Update the corresponding payload
+  // 2. Make sure meta data is not changed
+  // 3. Make sure status word is not changed
+  auto pd = NewDescriptor(pmwcas_pool);
+  pd->AddEntry(reinterpret_cast<uint64_t *>(record_key + metadata.GetPaddedKeyLength()),
+               record_payload, payload);
+  pd->AddEntry(&meta_ptr->meta, metadata.meta, metadata.meta);
+  pd->AddEntry(&(&header.status)->word, old_status.word, old_status.word);
+  if (versions) {
+    versions->Save(this, key, key_size, metadata);
+  }
+
+  bool updated = RunMwCAS(pd);
+  if (versions) {
+    versions->Finish(updated);
+  }
+  if (!updated) {
+    RetryAfterPMwCASFailure();
+    goto retry;
+  }
+  return ReturnCode::Ok();
+}
+
+ReturnCode LeafNode::Update(const char *key,
+                            uint16_t key_size,
+                            const char *payload,
+                            uint32_t payload_size,
+                            pmwcas::DescriptorPool *pmwcas_pool,
+                            uint32_t split_threshold,
+                            VersionWriter *versions) {
+  if (!StripPrefix(&key, &key_size)) {
+    return ReturnCode::NotFound();
+  }
+  RecordMetadata *meta_ptr = nullptr;
+  RecordMetadata metadata;
+  do {
+    if (header.GetStatus().IsFrozen()) {
+      return ReturnCode::NodeFrozen();
+    }
+    metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
+    if (metadata.IsVacant()) {
+      return ReturnCode::NotFound();
+    }
+  } while (metadata.IsInserting());
+
+  return ReplaceRecord(key, key_size, payload, payload_size, true,
+                       meta_ptr, metadata, pmwcas_pool, split_threshold, versions);
+}
+
+template <class Modify>
+ReturnCode LeafNode::ModifyPayload(const char *key, uint16_t key_size,
+                                   pmwcas::DescriptorPool *pmwcas_pool, VersionWriter *versions,
+                                   const Modify &modify) {
+  if (!StripPrefix(&key, &key_size)) {
+    return ReturnCode::NotFound();
+  }
+  while (true) {
+    auto old_status = header.GetStatus();
+    if (old_status.IsFrozen()) {
+      return ReturnCode::NodeFrozen();
+    }
+
+    RecordMetadata *meta_ptr = nullptr;
+    auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
+    if (metadata.IsVacant()) {
+      return ReturnCode::NotFound();
+    } else if (metadata.IsInserting()) {
+      continue;
+    } else if (metadata.HasVarPayload()) {
+      return ReturnCode::NotEnoughSpace();
+    }
+
+    char *record_key = nullptr;
+    uint64_t record_payload = 0;
+    GetRawRecord(metadata, &record_key, &record_payload, pmwcas_pool->GetEpoch());
+    uint64_t new_payload = record_payload;
+    auto rc = modify(record_payload, &new_payload);
+    if (!rc.IsOk() || new_payload == record_payload) {
+      return rc;
+    }
+
+    auto pd = NewDescriptor(pmwcas_pool);
+    pd->AddEntry(reinterpret_cast<uint64_t *>(record_key + metadata.GetPaddedKeyLength()),
+                 record_payload, new_payload);
+    pd->AddEntry(&meta_ptr->meta, metadata.meta, metadata.meta);
+    pd->AddEntry(&(&header.status)->word, old_status.word, old_status.word);
+    if (versions) {
+      versions->Save(this, key, key_size, metadata);
+    }
+    bool updated = RunMwCAS(pd);
+    if (versions) {
+      versions->Finish(updated);
+    }
+    if (updated) {
+      return ReturnCode::Ok();
+    }
+    RetryAfterPMwCASFailure();
+  }
+}
+
+ReturnCode LeafNode::CompareAndSwap(const char *key, uint16_t key_size, uint64_t *expected,
+                                    uint64_t desired, pmwcas::DescriptorPool *pmwcas_pool,
+                                    VersionWriter *versions) {
+  return ModifyPayload(key, key_size, pmwcas_pool, versions,
+                       [&](uint64_t current, uint64_t *new_payload) {
+    if (current != *expected) {
+      *expected = current;
+      return ReturnCode::ValueMismatch();
+    }
+    *new_payload = desired;
+    return ReturnCode::Ok();
+  });
+}
+
+ReturnCode LeafNode::FetchAdd(const char *key, uint16_t key_size, uint64_t delta,
+                              uint64_t *old_payload, pmwcas::DescriptorPool *pmwcas_pool,
+                              VersionWriter *versions) {
+  return ModifyPayload(key, key_size, pmwcas_pool, versions,
+                       [&](uint64_t current, uint64_t *new_payload) {
+    *old_payload = current;
+    *new_payload = current + delta;
+    return ReturnCode::Ok();
+  });
+}
+
+ReturnCode LeafNode::Upsert(const char *key, uint16_t key_size, uint64_t payload,
+                            pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                            bool single_word, VersionWriter *versions) {
+  while (true) {
+    auto rc = Update(key, key_size, payload, pmwcas_pool, split_threshold, single_word,
+                     versions);
+    if (!rc.IsNotFound()) {
+      return rc;
+    }
+    rc = Insert(key, key_size, payload, pmwcas_pool, split_threshold, versions);
+    if (!rc.IsKeyExists()) {
+      return rc;
+    }
+    // Inserted by someone else in the meantime, update that record
+  }
+}
+
+ReturnCode LeafNode::Upsert(const char *key, uint16_t key_size,
+                            const char *payload, uint32_t payload_size,
+                            pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                            VersionWriter *versions) {
+  while (true) {
+    auto rc = Update(key, key_size, payload, payload_size, pmwcas_pool, split_threshold,
+                     versions);
+    if (!rc.IsNotFound()) {
+      return rc;
+    }
+    rc = Insert(key, key_size, payload, payload_size, pmwcas_pool, split_threshold, versions);
+    if (!rc.IsKeyExists()) {
+      return rc;
+    }
+  }
+}
+
+ReturnCode LeafNode::ReplaceRecord(const char *key, uint16_t key_size,
+                                   const char *payload, uint32_t payload_size, bool var_payload,
+                                   RecordMetadata *old_meta_ptr, RecordMetadata old_meta,
+                                   pmwcas::DescriptorPool *pmwcas_pool,
+                                   uint32_t split_threshold, VersionWriter *versions) {
+  auto total_size = RecordMetadata::PadKeyLength(key_size) + payload_size;
+  RecordMetadata *meta_ptr = nullptr;
+  RecordMetadata desired_meta;
+  NodeHeader::StatusWord desired_status;
+  ReturnCode rc;
+  do {
+    rc = ReserveRecord(RecordMetadata::PadLength(total_size), split_threshold, pmwcas_pool,
+                       &meta_ptr, &desired_meta, &desired_status);
+  } while (rc.IsPMWCASFailure());
+  if (!rc.IsOk()) {
+    return rc;
+  }
+
+  // The new version is invisible to others until the final PMwCAS below
+  char *ptr = FillRecord(desired_status, key, key_size, payload, payload_size);
+  auto new_meta = desired_meta;
+  new_meta.FinalizeForInsert(ptr - reinterpret_cast<char *>(this), key_size, total_size,
+                             var_payload);
+
+  while (true) {
+    NodeHeader::StatusWord s = header.GetStatus();
+    if (s.IsFrozen()) {
       return ReturnCode::NodeFrozen();
     }
+
+    // A 3-word PMwCAS to make the new version visible, hide the old version
+    // and account for its space as deleted
+    auto hidden_meta = old_meta;
+    hidden_meta.SetVisible(false);
+    auto new_status = s;
+    new_status.SetDeleteSize(s.GetDeletedSize() + old_meta.GetPaddedTotalLength());
+
+    auto pd = NewDescriptor(pmwcas_pool);
+    pd->AddEntry(&(&header.status)->word, s.word, new_status.word);
+    pd->AddEntry(&old_meta_ptr->meta, old_meta.meta, hidden_meta.meta);
+    pd->AddEntry(&meta_ptr->meta, desired_meta.meta, new_meta.meta);
+    if (versions) {
+      versions->Save(this, key, key_size, old_meta);
+    }
+    PersistBatch::Drain();
+    bool replaced = RunMwCAS(pd);
+    if (versions) {
+      versions->Finish(replaced);
+    }
+    if (replaced) {
+      return ReturnCode::Ok();
+    }
+    RetryAfterPMwCASFailure();
+
+    // The old version was updated or deleted by someone else in the meantime
+    // (or the status word changed), find the latest version again; in-progress
+    // inserts, including ours, don't matter here
+    old_meta = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &old_meta_ptr,
+                                0, (uint32_t) -1, false);
+    if (old_meta.IsVacant()) {
+      // Deleted: give up the new version, like a duplicate insert
+      auto dead_meta = desired_meta;
+      dead_meta.FinalizeForInsert(0, key_size, total_size, var_payload);
+      do {
+        s = header.GetStatus();
+        if (s.IsFrozen()) {
+          return ReturnCode::NodeFrozen();
+        }
+        pd = NewDescriptor(pmwcas_pool);
+        pd->AddEntry(&(&header.status)->word, s.word, s.word);
+        pd->AddEntry(&meta_ptr->meta, desired_meta.meta, dead_meta.meta);
+      } while (!RunMwCAS(pd));
+      return ReturnCode::NotFound();
+    }
+  }
+}
+
+template <class KeyPolicy>
+uint32_t BaseNode::SearchSortedRegion(const char *key,
+                                      uint32_t key_size,
+                                      bool *exact,
+                                      bool protect_meta) {
+  // Deleted records in the sorted region only lose their visible bit; the key
+  // stays in place, so every entry in [0, sorted_count) has a valid key.
+  uint32_t left = 0, right = header.sorted_count;
+  *exact = false;
+  while (left < right) {
+    uint32_t mid = (left + right) / 2;
+    RecordMetadata meta = protect_meta ? GetMetadata(mid) : record_metadata[mid];
+    char *record_key = meta.GetKeyLength() == 0 ? nullptr :
+                       reinterpret_cast<char *>(this) + meta.GetOffset();
+    auto cmp = KeyPolicy::Compare(key, key_size, record_key, meta.GetKeyLength());
+    if (cmp == 0) {
+      *exact = true;
+      return mid;
+    } else if (cmp > 0) {
+      left = mid + 1;
+    } else {
+      right = mid;
+    }
+  }
+  return left;
+}
+
+template <class KeyPolicy>
+RecordMetadata BaseNode::SearchRecordMeta(pmwcas::EpochManager *epoch,
+                                          const char *key,
+                                          uint32_t key_size,
+                                          RecordMetadata **out_metadata_ptr,
+                                          uint32_t start_pos,
+                                          uint32_t end_pos,
+                                          bool check_concurrency) {
+  PERF_PHASE(kLeafSearch);
+  // Binary search on sorted field
+  bool exact = false;
+  uint32_t pos = SearchSortedRegion<KeyPolicy>(key, key_size, &exact);
+  if (exact) {
+    RecordMetadata current = GetMetadata(pos);
+    if (!current.IsVisible()) {
+      // Deleted from the sorted field, but the key might have other records
+      // next to it (see ParameterSet::duplicate_keys) or might have been
+      // re-inserted to the unsorted field
+      uint32_t i = pos;
+      while (i > 0 && SortedKeyEquals<KeyPolicy>(i - 1, key, key_size)) {
+        --i;
+      }
+      for (; i < header.sorted_count && SortedKeyEquals<KeyPolicy>(i, key, key_size); ++i) {
+        current = GetMetadata(i);
+        if (current.IsVisible()) {
+          pos = i;
+          break;
+        }
+      }
+    }
+    if (current.IsVisible()) {
+      if (out_metadata_ptr) {
+        *out_metadata_ptr = record_metadata + pos;
+      }
+      return current;
+    }
+  }
+  // Linear search on unsorted field, 16 entries at a time: only keys with a
+  // matching fingerprint are looked at, and unless in-progress inserts are of
+  // interest, only their metadata entries are
+//  uint32_t linear_end = std::min<uint32_t>(header.GetStatus().GetRecordCount(), end_pos);
+  uint32_t count = header.GetStatus().GetRecordCount();
+  uint8_t fingerprint = KeyFingerprint(key, key_size);
+  for (uint32_t i = header.sorted_count; i < count; i += 16) {
+    uint32_t n = std::min<uint32_t>(16, count - i);
+    uint32_t matches = MatchFingerprints(fingerprint, i, n);
+    uint32_t to_check = check_concurrency ? (uint32_t{1} << n) - 1 : matches;
+    while (to_check) {
+      uint32_t j = __builtin_ctz(to_check);
+      to_check &= to_check - 1;
+      RecordMetadata current = GetMetadata(i + j);
+
+      if (current.IsInserting()) {
+        if (check_concurrency) {
+          // Encountered an in-progress insert, recheck later
+          if (out_metadata_ptr) {
+            *out_metadata_ptr = record_metadata + i + j;
+          }
+          return current;
+        } else {
+          continue;
+        }
+      }
+
+      // The fingerprints were read before the entry, which might have only
+      // become visible since; it's in place by then, so read it again
+      if (current.IsVisible() &&
+          ((matches >> j & 1) || (check_concurrency && MatchFingerprints(fingerprint, i + j, 1)))) {
+        if (KeyPolicy::Equal(key, key_size, GetKey(current), current.GetKeyLength())) {
+          if (out_metadata_ptr) {
+            *out_metadata_ptr = record_metadata + i + j;
+          }
+          return current;
+        }
+      }
+    }
+  }
+  return RecordMetadata{0};
+}
+
+template uint32_t BaseNode::SearchSortedRegion<VarKeyPolicy>(const char *, uint32_t, bool *,
+                                                             bool);
+template uint32_t BaseNode::SearchSortedRegion<U64KeyPolicy>(const char *, uint32_t, bool *,
+                                                             bool);
+template RecordMetadata BaseNode::SearchRecordMeta<VarKeyPolicy>(
+    pmwcas::EpochManager *, const char *, uint32_t, RecordMetadata **, uint32_t, uint32_t, bool);
+template RecordMetadata BaseNode::SearchRecordMeta<U64KeyPolicy>(
+    pmwcas::EpochManager *, const char *, uint32_t, RecordMetadata **, uint32_t, uint32_t, bool);
+
+ReturnCode LeafNode::Delete(const char *key,
+                            uint16_t key_size,
+                            pmwcas::DescriptorPool *pmwcas_pool,
+                            VersionWriter *versions) {
+  if (!StripPrefix(&key, &key_size)) {
+    return ReturnCode::NotFound();
+  }
+  retry:
+  NodeHeader::StatusWord old_status = header.GetStatus();
+  if (old_status.IsFrozen()) {
+    return ReturnCode::NodeFrozen();
+  }
+
+  RecordMetadata *meta_ptr = nullptr;
+  auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
+  if (metadata.IsVacant()) {
+    return ReturnCode::NotFound();
+  } else if (metadata.IsInserting()) {
+    // FIXME(hao): not mentioned in the paper, should confirm later;
+    goto retry;
+  }
+
+  auto new_meta = metadata;
+  new_meta.SetVisible(false);
+
+  auto new_status = old_status;
+  auto old_delete_size = old_status.GetDeletedSize();
+  new_status.SetDeleteSize(old_delete_size + metadata.GetPaddedTotalLength());
+
+  pmwcas::Descriptor *pd = NewDescriptor(pmwcas_pool);
+  pd->AddEntry(&(&header.status)->word, old_status.word, new_status.word);
+  pd->AddEntry(&meta_ptr->meta, metadata.meta, new_meta.meta);
+  if (versions) {
+    versions->Save(this, key, key_size, metadata);
+  }
+  bool deleted = RunMwCAS(pd);
+  if (versions) {
+    versions->Finish(deleted);
+  }
+  if (!deleted) {
+    RetryAfterPMwCASFailure();
+    goto retry;
+  }
+  return ReturnCode::Ok();
+}
+template <class KeyPolicy>
+ReturnCode LeafNode::Read(const char *key, uint16_t key_size, uint64_t *payload,
+                          pmwcas::DescriptorPool *pmwcas_pool) {
+  if (header.prefix_size) {
+    // Policies other than the generic one expect whole keys
+    if (!std::is_same<KeyPolicy, VarKeyPolicy>::value) {
+      return Read<VarKeyPolicy>(key, key_size, payload, pmwcas_pool);
+    }
+    if (!StripPrefix(&key, &key_size)) {
+      return ReturnCode::NotFound();
+    }
+  }
+  if (!MayContain(key, key_size)) {
+    return ReturnCode::NotFound();
+  }
+  auto meta = SearchRecordMeta<KeyPolicy>(pmwcas_pool->GetEpoch(), key, key_size, nullptr,
+                                          0, (uint32_t) -1, false);
+  if (meta.IsVacant()) {
+    return ReturnCode::NotFound();
+  }
+
+  char *source_addr = (reinterpret_cast<char *>(this) + meta.GetOffset());
+  auto padded_key_len = KeyPolicy::GetPaddedKeyLength(meta);
+  if (meta.HasVarPayload()) {
+    if (meta.GetPayloadLength() > sizeof(uint64_t)) {
+      return ReturnCode::NotEnoughSpace();
+    }
+    *payload = 0;
+    memcpy(payload, source_addr + padded_key_len, meta.GetPayloadLength());
+    return ReturnCode::Ok();
+  }
+  *payload = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
+      source_addr + padded_key_len)->GetValueProtected();
+  return ReturnCode::Ok();
+}
+
+template ReturnCode LeafNode::Read<VarKeyPolicy>(const char *, uint16_t, uint64_t *,
+                                                 pmwcas::DescriptorPool *);
+template ReturnCode LeafNode::Read<U64KeyPolicy>(const char *, uint16_t, uint64_t *,
+                                                 pmwcas::DescriptorPool *);
+
+ReturnCode LeafNode::Read(const char *key, uint16_t key_size,
+                          char *payload, uint32_t *payload_size,
+                          pmwcas::DescriptorPool *pmwcas_pool) {
+  if (!StripPrefix(&key, &key_size) || !MayContain(key, key_size)) {
+    return ReturnCode::NotFound();
+  }
+  auto meta = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, nullptr,
+                               0, (uint32_t) -1, false);
+  if (meta.IsVacant()) {
+    return ReturnCode::NotFound();
+  }
+
+  uint32_t buffer_size = *payload_size;
+  *payload_size = meta.GetPayloadLength();
+  if (buffer_size < *payload_size) {
+    return ReturnCode::NotEnoughSpace();
+  }
+
+  char *source_addr = (reinterpret_cast<char *>(this) + meta.GetOffset());
+  if (meta.HasVarPayload()) {
+    memcpy(payload, source_addr + meta.GetPaddedKeyLength(), *payload_size);
+  } else {
+    auto word = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
+        source_addr + meta.GetPaddedKeyLength())->GetValueProtected();
+    memcpy(payload, &word, sizeof(word));
+  }
+  return ReturnCode::Ok();
+}
+ReturnCode LeafNode::RangeScanBySize(const char *key1,
+                                     uint32_t size1,
+                                     uint32_t to_scan,
+                                     std::list<std::unique_ptr<Record>> *result,
+                                     pmwcas::DescriptorPool *pmwcas_pool) {
+  // Enter a new epoch and copy data
+  EpochScope guard(pmwcas_pool->GetEpoch());
+
+  thread_local std::vector<RecordMetadata> meta_vec;
+  meta_vec.clear();
+  CollectRange(key1, size1, true, nullptr, 0, false, to_scan, &meta_vec);
+  for (auto meta : meta_vec) {
+    result->emplace_back(Record::New(meta, this));
+  }
+  return ReturnCode::Ok();
+}
+
+void LeafNode::CollectRange(const char *lo, uint32_t lo_size, bool lo_inclusive,
+                            const char *hi, uint32_t hi_size, bool hi_inclusive,
+                            uint32_t limit, std::vector<RecordMetadata> *result) {
+  // Bounds in terms of the keys as stored, i.e., without the node's prefix
+  if (lo) {
+    int pos = ClampToPrefix(&lo, &lo_size);
+    if (pos > 0) {
+      return;
+    } else if (pos < 0) {
+      lo = nullptr;
+    }
+  }
+  if (hi) {
+    int pos = ClampToPrefix(&hi, &hi_size);
+    if (pos < 0) {
+      return;
+    } else if (pos > 0) {
+      hi = nullptr;
+    }
+  }
+  auto above_lo = [&](RecordMetadata meta) {
+    if (!lo) {
+      return true;
+    }
+    int cmp = KeyCompare(lo, lo_size, GetKey(meta), meta.GetKeyLength());
+    return cmp < 0 || (cmp == 0 && lo_inclusive);
+  };
+  auto below_hi = [&](RecordMetadata meta) {
+    if (!hi) {
+      return true;
+    }
+    int cmp = KeyCompare(GetKey(meta), meta.GetKeyLength(), hi, hi_size);
+    return cmp < 0 || (cmp == 0 && hi_inclusive);
+  };
+  auto key_less = [this](RecordMetadata m1, RecordMetadata m2) -> bool {
+    return KeyCompare(GetKey(m1), m1.GetKeyLength(), GetKey(m2), m2.GetKeyLength()) < 0;
+  };
+
+  // Records in the sorted field are already in order, so only the unsorted
+  // field needs sorting; the two are then merged, stopping after [limit]
+  uint32_t sorted_pos = 0;
+  if (lo) {
+    bool exact = false;
+    sorted_pos = SearchSortedRegion(lo, lo_size, &exact);
+    // Past (or back to the first of) the records of the bound
+    if (exact && !lo_inclusive) {
+      do {
+        ++sorted_pos;
+      } while (sorted_pos < header.sorted_count && SortedKeyEquals(sorted_pos, lo, lo_size));
+    } else if (exact) {
+      while (sorted_pos > 0 && SortedKeyEquals(sorted_pos - 1, lo, lo_size)) {
+        --sorted_pos;
+      }
+    }
+  }
+
+  thread_local std::vector<RecordMetadata> unsorted;
+  unsorted.clear();
+  auto count = header.GetStatus().GetRecordCount();
+  for (uint32_t i = header.sorted_count; i < count; ++i) {
+    auto meta = GetMetadata(i);
+    if (meta.IsVisible() && above_lo(meta) && below_hi(meta)) {
+      unsorted.emplace_back(meta);
+    }
+  }
+  std::sort(unsorted.begin(), unsorted.end(), key_less);
+
+  auto unsorted_it = unsorted.begin();
+  RecordMetadata sorted_meta;
+  auto next_sorted = [&]() {
+    while (sorted_pos < header.sorted_count) {
+      sorted_meta = GetMetadata(sorted_pos++);
+      if (sorted_meta.IsVisible()) {
+        // Past the upper bound, so is the rest of the sorted field
+        return below_hi(sorted_meta);
+      }
+    }
+    return false;
+  };
+  bool has_sorted = next_sorted();
+  while (result->size() < limit) {
+    if (has_sorted && (unsorted_it == unsorted.end() || key_less(sorted_meta, *unsorted_it))) {
+      result->emplace_back(sorted_meta);
+      has_sorted = next_sorted();
+    } else if (unsorted_it != unsorted.end()) {
+      result->emplace_back(*unsorted_it++);
+    } else {
+      break;
+    }
+  }
+}
+
+ReturnCode LeafNode::RangeScanByKey(const char *lo, uint32_t lo_size, bool lo_inclusive,
+                                    const char *hi, uint32_t hi_size, bool hi_inclusive,
+                                    uint32_t to_scan,
+                                    ScanBuffer *result,
+                                    pmwcas::DescriptorPool *pmwcas_pool) {
+  EpochScope guard(pmwcas_pool->GetEpoch());
+
+  thread_local std::vector<RecordMetadata> meta_vec;
+  meta_vec.clear();
+  CollectRange(lo, lo_size, lo_inclusive, hi, hi_size, hi_inclusive, to_scan, &meta_vec);
+  for (auto meta : meta_vec) {
+    if (!result->Append(meta, this)) {
+      return ReturnCode::NotEnoughSpace();
+    }
+  }
+  return ReturnCode::Ok();
+}
+
+ReturnCode LeafNode::ReverseRangeScanByKey(const char *lo, uint32_t lo_size,
+                                           bool lo_inclusive,
+                                           const char *hi, uint32_t hi_size,
+                                           bool hi_inclusive,
+                                           uint32_t to_scan,
+                                           ScanBuffer *result,
+                                           pmwcas::DescriptorPool *pmwcas_pool) {
+  EpochScope guard(pmwcas_pool->GetEpoch());
+
+  // The largest keys are wanted, so collect the whole range (at most one
+  // node's worth of records) and take them from the back
+  thread_local std::vector<RecordMetadata> meta_vec;
+  meta_vec.clear();
+  CollectRange(lo, lo_size, lo_inclusive, hi, hi_size, hi_inclusive,
+               std::numeric_limits<uint32_t>::max(), &meta_vec);
+  uint32_t appended = 0;
+  for (auto it = meta_vec.rbegin(); it != meta_vec.rend() && appended < to_scan; ++it) {
+    if (!result->Append(*it, this)) {
+      return ReturnCode::NotEnoughSpace();
+    }
+    ++appended;
+  }
+  return ReturnCode::Ok();
+}
+
+uint32_t LeafNode::CountRange(const char *lo, uint32_t lo_size, const char *hi,
+                              uint32_t hi_size) {
+  thread_local std::vector<RecordMetadata> meta_vec;
+  meta_vec.clear();
+  CollectRange(lo, lo_size, true, hi, hi_size, false, std::numeric_limits<uint32_t>::max(),
+               &meta_vec);
+  return static_cast<uint32_t>(meta_vec.size());
+}
+
+ReturnCode LeafNode::RangeScanByKey(const char *key1,
+                                    uint32_t size1,
+                                    const char *key2,
+                                    uint32_t size2,
+                                    std::vector<Record *> *result,
+                                    pmwcas::DescriptorPool *pmwcas_pool) {
+  // entering a new epoch and copying the data
+  EpochScope guard(pmwcas_pool->GetEpoch());
+
+  thread_local std::vector<RecordMetadata> meta_vec;
+  meta_vec.clear();
+  CollectRange(key1, size1, true, key2, size2, true, std::numeric_limits<uint32_t>::max(),
+               &meta_vec);
+  for (auto meta : meta_vec) {
+    result->emplace_back(Record::New(meta, this));
+  }
+  return ReturnCode::Ok();
+}
+
+bool BaseNode::Freeze(pmwcas::DescriptorPool *pmwcas_pool) {
+  NodeHeader::StatusWord expected = header.GetStatus();
+  if (expected.IsFrozen()) {
+    return false;
+  }
+
+  pmwcas::Descriptor *pd = NewDescriptor(pmwcas_pool);
+  AddFreezeEntries(pd, expected);
+  return RunMwCAS(pd);
+}
+
+void BaseNode::AddFreezeEntries(pmwcas::Descriptor *pd, NodeHeader::StatusWord expected) {
+  pd->AddEntry(&(&header.status)->word, expected.word, expected.Freeze().word);
+  if (!is_leaf) {
+    return;
+  }
+  // Lanes only ever go from 0 to frozen
+  auto *leaf = reinterpret_cast<LeafNode *>(this);
+  for (uint32_t i = 0; i < leaf->GetLaneCount(); ++i) {
+    pd->AddEntry(&leaf->GetLane(i)->word, 0, NodeHeader::StatusWord().Freeze().word);
+  }
+}
+
+LeafNode *LeafNode::Consolidate(pmwcas::DescriptorPool *pmwcas_pool) {
+  // Freeze the node to prevent new modifications first
+  if (!Freeze(pmwcas_pool)) {
+    return nullptr;
+  }
+
+  LeafNode *new_leaf = nullptr;
+  PrepareForConsolidate(&new_leaf, pmwcas_pool->GetEpoch());
+#ifdef PMDK
+  return Allocator::Get()->GetDirect(new_leaf);
+#else
+  return new_leaf;
+#endif
+}
+
+void LeafNode::PrepareForConsolidate(LeafNode **new_node, pmwcas::EpochManager *epoch,
+                                     const char *prefix, uint16_t prefix_size,
+                                     const char *drop_lo, uint32_t drop_lo_size,
+                                     const char *drop_hi, uint32_t drop_hi_size,
+                                     uint32_t node_size, uint32_t lanes) {
+  thread_local std::vector<RecordMetadata> meta_vec;
+  meta_vec.clear();
+  SortMetadataByKey(meta_vec, true, epoch);
+  if (drop_hi) {
+    // The records to drop are a contiguous run of the sorted ones
+    auto bound = [&](const char *key, uint32_t key_size) {
+      int pos = ClampToPrefix(&key, &key_size);
+      if (pos != 0) {
+        return pos < 0 ? meta_vec.begin() : meta_vec.end();
+      }
+      return std::lower_bound(meta_vec.begin(), meta_vec.end(), key,
+                              [&](RecordMetadata meta, const char *k) {
+        return KeyCompare(GetKey(meta), meta.GetKeyLength(), k, key_size) < 0;
+      });
+    };
+    auto first = bound(drop_lo, drop_lo_size);
+    auto last = bound(drop_hi, drop_hi_size);
+    if (first < last) {
+      meta_vec.erase(first, last);
+    }
+  }
+
+  if (!prefix) {
+    prefix = GetPrefix();
+    prefix_size = header.prefix_size;
+  }
+  if (lanes == UINT32_MAX) {
+    lanes = GetLaneCount();
+  }
+  if (node_size == 0) {
+    node_size = this->header.size;
+  } else if (node_size == kPackedSize) {
+    lanes = 0;
+    // Keys lose (or gain) the difference between the two prefixes, as in
+    // CopyFrom; the fingerprint array grows with the node, so go until it fits
+    uint32_t records_size = sizeof(LeafNode) + RecordMetadata::PadKeyLength(prefix_size);
+    for (auto meta : meta_vec) {
+      uint32_t key_size = meta.GetKeyLength() + header.prefix_size - prefix_size;
+      records_size += sizeof(RecordMetadata) + RecordMetadata::PadLength(
+          RecordMetadata::PadKeyLength(key_size) + meta.GetPayloadLength());
+    }
+    node_size = records_size;
+    while (records_size + GetTrailerSize(node_size, HasBloomFilter(), 0) > node_size) {
+      node_size = records_size + GetTrailerSize(node_size, HasBloomFilter(), 0);
+    }
+  }
+
+  // Allocate and populate a new node
+  auto *new_leaf = reinterpret_cast<LeafNode *>(
+      BeginNodeImage(reinterpret_cast<void **>(new_node), node_size));
+  new(new_leaf) LeafNode(node_size, HasBloomFilter(), lanes);
+  new_leaf->SetPrefix(prefix, prefix_size);
+  new_leaf->CopyFrom(this, meta_vec.begin(), meta_vec.end(), epoch);
+  EndNodeImage(reinterpret_cast<void **>(new_node), reinterpret_cast<char *>(new_leaf),
+               node_size);
+}
+
+bool LeafNode::ShouldConsolidate(uint32_t consolidate_threshold) {
+  // Node is frozen at this point
+  auto status = header.GetStatus();
+  assert(status.IsFrozen());
+
+  // Deleted records give their key and payload back; this is a conservative
+  // estimate as their metadata entries would also go away.
+  uint32_t live_size = GetUsedSpace(status) - status.GetDeletedSize();
+  if (live_size <= consolidate_threshold) {
+    return true;
+  }
+
+  // Failed duplicate inserts in the unsorted field are invisible but not
+  // counted in the delete size. With a long unsorted field it is worth
+  // counting the live records precisely before giving up and splitting.
+  uint32_t record_count = status.GetRecordCount();
+  if ((record_count - header.sorted_count) * 4 < record_count) {
+    return false;
+  }
+  live_size = sizeof(LeafNode) + GetTrailerSize(header.size, HasBloomFilter(), GetLaneCount()) +
+      RecordMetadata::PadKeyLength(header.prefix_size);
+  for (uint32_t i = 0; i < record_count; ++i) {
+    auto meta = record_metadata[i];
+    if (meta.IsVisible()) {
+      live_size += meta.GetPaddedTotalLength() + sizeof(RecordMetadata);
+    }
+  }
+  return live_size <= consolidate_threshold;
+}
+
+uint32_t LeafNode::SortMetadataByKey(std::vector<RecordMetadata> &vec,
+                                     bool visible_only,
+                                     pmwcas::EpochManager *epoch) {
+  // Node is frozen at this point
+  // there should not be any on-going pmwcas
+  assert(header.status.IsFrozen());
+  uint32_t total_size = 0;
+  uint32_t count = header.GetStatus().GetRecordCount();
+  for (uint32_t i = 0; i < count; ++i) {
+    // TODO(tzwang): handle deletes
+    auto meta = record_metadata[i];
+    if (meta.IsVisible()) {
+      vec.emplace_back(meta);
+      total_size += (meta.GetPaddedTotalLength());
+      assert(meta.GetTotalLength());
+    }
+  }
+
+  // Lambda for comparing two keys
+  auto key_cmp = [this](RecordMetadata &m1, RecordMetadata &m2) -> bool {
+    auto l1 = m1.GetKeyLength();
+    auto l2 = m2.GetKeyLength();
+    char *k1 = GetKey(m1);
+    char *k2 = GetKey(m2);
+    return KeyCompare(k1, l1, k2, l2) < 0;
+  };
+
+  std::sort(vec.begin(), vec.end(), key_cmp);
+  return total_size;
+}
+
+void LeafNode::SetPrefix(const char *prefix, uint16_t prefix_size) {
+  assert(header.status.GetRecordCount() == 0);
+  header.prefix_size = prefix_size;
+  if (prefix_size) {
+    memcpy(GetPrefix(), prefix, prefix_size);
+  }
+  header.status.SetBlockSize(GetTrailerSize(header.size, HasBloomFilter(), GetLaneCount()) +
+                             RecordMetadata::PadKeyLength(prefix_size));
+}
+
+void LeafNode::CopyFrom(LeafNode *node,
+                        std::vector<RecordMetadata>::iterator begin_it,
+                        std::vector<RecordMetadata>::iterator end_it,
+                        pmwcas::EpochManager *epoch) {
+  // meta_vec is assumed to be in sorted order, insert records one by one
+  // after those already in the node, once none of their payloads can change
+  WaitForSingleWordUpdates(node);
+  uint32_t offset = this->header.size - header.status.GetBlockSize();
+  uint16_t nrecords = header.status.GetRecordCount();
+
+  // Keys lose what this node's prefix has on [node]'s, or gain what [node]'s
+  // prefix has on this node's
+  uint16_t prefix_size = header.prefix_size;
+  uint16_t src_prefix_size = node->header.prefix_size;
+  uint16_t skip = prefix_size > src_prefix_size ? prefix_size - src_prefix_size : 0;
+  uint16_t extra = src_prefix_size > prefix_size ? src_prefix_size - prefix_size : 0;
+  const char *extra_key = node->GetPrefix() + prefix_size;
+  for (auto it = begin_it; it != end_it; ++it) {
+    auto meta = *it;
+    uint64_t payload = 0;
+    char *key;
+    // Only an 8-byte payload is a PMwCAS word, the others are plain bytes
+    node->GetRawRecord(meta, &key, meta.HasVarPayload() ? nullptr : &payload, epoch);
+
+    uint32_t key_size = meta.GetKeyLength() + extra - skip;
+    uint32_t padded_key_size = RecordMetadata::PadKeyLength(key_size);
+    uint32_t total_len = padded_key_size + meta.GetPayloadLength();
+    uint32_t padded_total_len = RecordMetadata::PadLength(total_len);
+    assert(offset >= padded_total_len);
+    offset -= padded_total_len;
+    char *ptr = &(reinterpret_cast<char *>(this))[offset];
+    memcpy(ptr, extra_key, extra);
+    memcpy(ptr + extra, key + skip, meta.GetKeyLength() - skip);
+
+    // Copy data; an 8-byte payload might still hold a descriptor of an update
+    // that's doomed to fail by the freeze, take the value read above instead
+    if (meta.HasVarPayload()) {
+      memcpy(ptr + padded_key_size, key + meta.GetPaddedKeyLength(), meta.GetPayloadLength());
+    } else {
+      assert(meta.GetPayloadLength() == sizeof(uint64_t));
+      memcpy(ptr + padded_key_size, &payload, sizeof(payload));
+    }
+
+    // Setup new metadata
+    record_metadata[nrecords].FinalizeForInsert(offset, key_size, total_len,
+                                                meta.HasVarPayload());
+    AddToBloomFilter(ptr, key_size);
+    ++nrecords;
+  }
+  // Finalize header stats
+  header.status.SetBlockSize(this->header.size - offset);
+  header.status.SetRecordCount(nrecords);
+  header.sorted_count = nrecords;
+}
+
+bool LeafNode::AppendSorted(const char *key, uint16_t key_size, uint64_t payload,
+                            uint32_t fill_size) {
+  return AppendSorted(key, key_size, reinterpret_cast<const char *>(&payload), sizeof(payload),
+                      false, fill_size);
+}
+
+bool LeafNode::AppendSorted(const char *key, uint16_t key_size, const char *payload,
+                            uint32_t payload_size, bool var_payload, uint32_t fill_size) {
+  bool has_prefix = StripPrefix(&key, &key_size);
+  ALWAYS_ASSERT(has_prefix);
+  auto status = header.status;
+  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+  uint32_t total_size = RecordMetadata::PadLength(padded_key_size + payload_size);
+  if (LeafNode::GetUsedSpace(status) + sizeof(RecordMetadata) + total_size > fill_size) {
+    return false;
+  }
+  auto count = status.GetRecordCount();
+  uint32_t offset = header.size - status.GetBlockSize() - total_size;
+  char *ptr = reinterpret_cast<char *>(this) + offset;
+  memcpy(ptr, key, key_size);
+  memcpy(ptr + padded_key_size, payload, payload_size);
+  record_metadata[count].FinalizeForInsert(offset, key_size, padded_key_size + payload_size,
+                                           var_payload);
+  AddToBloomFilter(key, key_size);
+  status.PrepareForInsert(total_size);
+  header.status = status;
+  header.sorted_count = count + 1;
+  return true;
+}
+
+void InternalNode::DeleteRecord(uint32_t meta_to_update,
+                                uint64_t new_child_ptr,
+                                bztree::InternalNode **new_node,
+                                uint32_t count) {
+  uint32_t first_to_delete = meta_to_update + 1;
+  uint32_t end_to_delete = first_to_delete + count;
+  assert(end_to_delete <= header.sorted_count);
+  uint32_t offset = this->header.size;
+  for (uint32_t i = first_to_delete; i < end_to_delete; ++i) {
+    offset -= this->record_metadata[i].GetTotalLength() + sizeof(RecordMetadata);
+  }
+  auto *node = reinterpret_cast<InternalNode *>(
+      BeginNodeImage(reinterpret_cast<void **>(new_node), offset, true));
+  node->header.size = offset;
+
+  uint32_t insert_idx = 0;
+  for (uint32_t i = 0; i < this->header.sorted_count; i += 1) {
+    if (i >= first_to_delete && i < end_to_delete) {
+      continue;
+    }
+    RecordMetadata meta = record_metadata[i];
+    uint64_t m_payload = 0;
+    char *m_key = nullptr;
+    char *m_data = nullptr;
+    GetRawRecord(meta, &m_data, &m_key, &m_payload);
+    auto m_key_size = meta.GetKeyLength();
+    offset -= meta.GetTotalLength();
+    node->record_metadata[insert_idx].
+        FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
+    auto ptr = reinterpret_cast<char *>(node) + offset;
+    if (i == meta_to_update) {
+      memcpy(ptr, m_data, meta.GetKeyLength());
+      memcpy(ptr + meta.GetPaddedKeyLength(), &new_child_ptr, sizeof(uint64_t));
+    } else {
+      memcpy(ptr, m_data, meta.GetTotalLength());
+    }
+    insert_idx += 1;
+  }
+  node->header.sorted_count = insert_idx;
+  node->FitSearchModel();
+  EndNodeImage(reinterpret_cast<void **>(new_node), reinterpret_cast<char *>(node),
+               node->header.size);
+}
+
+ReturnCode BaseNode::CheckMerge(bztree::Stack *stack, const char *key,
+                                uint32_t key_size, bool backoff) {
+  uint32_t merge_threshold = stack->tree->parameters.merge_threshold;
+  auto pmwcas_pool = stack->tree->GetPMWCASPool();
+  auto epoch = pmwcas_pool->GetEpoch();
+  if (!IsLeaf() && GetHeader()->size > merge_threshold) {
+    // we're internal node, large enough, we are good
+    return ReturnCode::Ok();
+  } else {
+    // we're leaf node, large enough
+    auto old_status = GetHeader()->GetStatus();
+    auto valid_size = LeafNode::GetUsedSpace(old_status) - old_status.GetDeletedSize();
+    if (valid_size > merge_threshold) {
+      return ReturnCode::Ok();
+    }
+  }
+
+  // too small, trying to merge siblings
+  // start by checking parent node
+  auto parent_frame = stack->Pop();
+  if (!parent_frame) {
+    // we are root node, ok
+    return ReturnCode::Ok();
+  }
+
+  InternalNode *parent = parent_frame->node;
+  uint32_t sibling_index = 0;
+
+  auto should_merge = [&](uint32_t meta_index) -> bool {
+    if (meta_index < 0 || meta_index >= parent->GetHeader()->sorted_count) {
+      return false;
+    }
+    auto sibling = parent->GetChildByMetaIndex(meta_index, epoch);
+    if (sibling->IsLeaf()) {
+      auto status = sibling->GetHeader()->GetStatus();
+      auto valid_size = LeafNode::GetUsedSpace(status) - status.GetDeletedSize();
+      return valid_size < merge_threshold;
+    } else {
+      return sibling->GetHeader()->size < merge_threshold;
+    }
+  };
+
+  if (should_merge(parent_frame->meta_index - 1)) {
+    sibling_index = parent_frame->meta_index - 1;
+  } else if (should_merge(parent_frame->meta_index + 1)) {
+    sibling_index = parent_frame->meta_index + 1;
+  } else {
+    // Both left sibling and right sibling are good, we stay unchanged
+    // if (!backoff) {
+    // }
+    return ReturnCode::Ok();
+  }
+
+  // we found a suitable sibling
+  // do the real merge
+  ++smo_attempts;
+  BaseNode *sibling = parent->GetChildByMetaIndex(sibling_index, epoch);
+
+  // Phase 1: freeze both nodes, and their parent
+  auto node_status = this->GetHeader()->GetStatus();
+  auto sibling_status = sibling->GetHeader()->GetStatus();
+  auto parent_status = parent->GetHeader()->GetStatus();
+
+  if (backoff && (node_status.IsFrozen() ||
+      sibling_status.IsFrozen() || parent_status.IsFrozen())) {
+    return ReturnCode::NodeFrozen();
+  }
+
+  // Only while the parent still points to both nodes: a concurrent
+  // consolidation might have replaced either of them in the parent, in which
+  // case we'd be merging a stale copy, as in PrepareForSplit
+  auto child_addr = [](BaseNode *node) {
+#ifdef PMDK
+    return reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(node));
+#else
+    return reinterpret_cast<uint64_t>(node);
+#endif
+  };
+  auto *pd = NewDescriptor(pmwcas_pool);
+  this->AddFreezeEntries(pd, node_status);
+  sibling->AddFreezeEntries(pd, sibling_status);
+  pd->AddEntry(&(&parent->GetHeader()->status)->word,
+               parent_status.word, parent_status.Freeze().word);
+  for (auto child : {std::make_pair(parent_frame->meta_index, static_cast<BaseNode *>(this)),
+                     std::make_pair(sibling_index, sibling)}) {
+    uint64_t addr = child_addr(child.second);
+    pd->AddEntry(parent->GetPayloadPtr(parent->record_metadata[child.first]), addr, addr);
+  }
+  if (!RunMwCAS(pd)) {
+    return ReturnCode::PMWCASFailure();
+  }
+
+  // Phase 2: allocate parent and new node
+  pd = NewDescriptor(pmwcas_pool, true);
+  pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                         reinterpret_cast<uint64_t>(nullptr),
+                         pmwcas::Descriptor::kRecycleNewOnFailure);
+  pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                         reinterpret_cast<uint64_t>(nullptr),
+                         pmwcas::Descriptor::kRecycleNewOnFailure);
+  auto *new_parent = reinterpret_cast<InternalNode **>(pd->GetNewValuePtr(0));
+  auto *new_node = reinterpret_cast<BaseNode **>(pd->GetNewValuePtr(1));
+
+  // lambda wrapper for merge leaf nodes
+  auto merge_leaf_nodes = [&](uint32_t left_index, LeafNode *left_node, LeafNode *right_node) {
+    // Not the size of either of them, which might be packed
+    LeafNode::MergeNodes(left_node, right_node, stack->tree->parameters.leaf_node_size,
+                         reinterpret_cast<LeafNode **>(new_node));
+    parent->DeleteRecord(left_index,
+                         reinterpret_cast<uint64_t>(*new_node),
+                         new_parent);
+  };
+  // lambda wrapper for merge internal nodes
+  auto merge_internal_nodes = [&](uint32_t left_node_index,
+                                  InternalNode *left_node, InternalNode *right_node) {
+    // get the key for right node
+    RecordMetadata right_meta = parent->record_metadata[left_node_index + 1];
+    char *new_key = nullptr;
+    parent->GetRawRecord(right_meta, nullptr, &new_key, nullptr);
+    assert(right_meta.GetKeyLength() != 0);
+    InternalNode::MergeNodes(left_node, right_node, new_key, right_meta.GetKeyLength(),
+                             reinterpret_cast<InternalNode **> (new_node));
+    parent->DeleteRecord(left_node_index,
+                         reinterpret_cast<uint64_t>(*new_node),
+                         new_parent);
+  };
+
+  // Phase 3: merge and init nodes
+  if (sibling_index < parent_frame->meta_index) {
+    IsLeaf() ?
+    merge_leaf_nodes(sibling_index,
+                     reinterpret_cast<LeafNode *>(sibling),
+                     reinterpret_cast<LeafNode *>(this)) :
+    merge_internal_nodes(sibling_index,
+                         reinterpret_cast<InternalNode *>(sibling),
+                         reinterpret_cast<InternalNode *>(this));
+  } else {
+    IsLeaf() ?
+    merge_leaf_nodes(parent_frame->meta_index,
+                     reinterpret_cast<LeafNode *>(this),
+                     reinterpret_cast<LeafNode *>(sibling)) :
+    merge_internal_nodes(parent_frame->meta_index,
+                         reinterpret_cast<InternalNode *>(this),
+                         reinterpret_cast<InternalNode *>(sibling));
+  }
+
+  // Phase 4: install new nodes
+  auto grandpa_frame = stack->Top();
+  ReturnCode rc;
+  auto retire_merged = [&]() {
+    stack->tree->RetireNode(this);
+    stack->tree->RetireNode(sibling);
+    stack->tree->RetireNode(parent);
+    stack->tree->CountStat(BzTree::kStatMerges);
+  };
+  if (!grandpa_frame) {
+    rc = stack->tree->ChangeRoot(reinterpret_cast<uint64_t>(stack->GetRoot()),
+                                 reinterpret_cast<uint64_t>(*new_parent), pd) ?
+         ReturnCode::Ok() : ReturnCode::PMWCASFailure();
+    if (rc.IsOk()) {
+      retire_merged();
+    } else {
+      stack->tree->CountStat(BzTree::kStatSMOFailures);
+    }
+    return rc;
+  } else {
+    InternalNode *grandparent = grandpa_frame->node;
+    rc = grandparent->Update(grandparent->GetMetadata(grandpa_frame->meta_index),
+                             parent, *new_parent, pd, pmwcas_pool);
+    if (rc.IsNodeFrozen()) {
+      AbortDescriptor(pd);
+    }
+    if (!rc.IsOk()) {
+      stack->tree->CountStat(BzTree::kStatSMOFailures);
+      return rc;
+    }
+    retire_merged();
+
+    uint32_t freeze_retry = 0;
+    do {
+      // if previous merge succeeded, we move on to check new_parent
+      rc = (*new_parent)->CheckMerge(stack, key, key_size,
+                                     freeze_retry < MAX_FREEZE_RETRY);
+      if (rc.IsOk()) {
+        return rc;
+      }
+      freeze_retry += 1;
+      stack->Clear();
+      BaseNode *landed_on = stack->tree->TraverseToNode(stack, key, key_size, *new_parent);
+      if (landed_on != *new_parent) {
+        // we landed on a leaf node
+        // means the *new_parent has been swapped out
+        // either splitted or merged
+        assert(landed_on->IsLeaf());
+        return ReturnCode::Ok();
+      }
+    } while (rc.IsNodeFrozen() || rc.IsPMWCASFailure());
+    assert(false);
+  }
+  return rc;
+}
+
+ReturnCode InternalNode::Update(RecordMetadata meta,
+                                BaseNode *old_child,
+                                BaseNode *new_child,
+                                pmwcas::Descriptor *pd,
+                                pmwcas::DescriptorPool *pmwcas_pool,
+                                uint32_t recycle_policy) {
+  auto status = header.GetStatus();
+  if (status.IsFrozen()) {
+    return ReturnCode::NodeFrozen();
+  }
+
+  // Conduct a 2-word PMwCAS to swap in the new child pointer while ensuring the
+  // node isn't frozen by a concurrent thread
+  pd->AddEntry(&(&header.status)->word, status.word, status.word);
+  pd->AddEntry(GetPayloadPtr(meta),
+               reinterpret_cast<uint64_t>(old_child),
+               reinterpret_cast<uint64_t>(new_child),
+               recycle_policy);
+  // The new child, and whatever new nodes it points to, must be persistent
+  // before it's reachable
+  PersistBatch::Drain();
+  if (RunMwCAS(pd)) {
+    return ReturnCode::Ok();
+  } else {
+    return ReturnCode::PMWCASFailure();
+  }
+}
+
+BaseNode *InternalNode::LoadChild(uint32_t index, uint64_t word) {
+  auto *store = LeafStore::Get(word);
+  // Tiering has to be enabled again after recovery, before anything else
+  ALWAYS_ASSERT(store);
+  return store->GetTree()->LoadLeaf(store, this, index, word);
+}
+
+bool InternalNode::FreezeIfChild(uint32_t meta_index, uint64_t child_addr,
+                                 pmwcas::DescriptorPool *pmwcas_pool) {
+  NodeHeader::StatusWord expected = header.GetStatus();
+  if (expected.IsFrozen()) {
+    return false;
+  }
+
+  pmwcas::Descriptor *pd = NewDescriptor(pmwcas_pool);
+  pd->AddEntry(&(&header.status)->word, expected.word, expected.Freeze().word);
+  pd->AddEntry(GetPayloadPtr(record_metadata[meta_index]), child_addr, child_addr);
+  return RunMwCAS(pd);
+}
+
+template <class KeyPolicy>
+uint32_t InternalNode::GetChildIndex(const char *key,
+                                     uint16_t key_size,
+                                     bool get_le) {
+  // Keys in internal nodes are always sorted, visible, and the metadata never
+  // changes once the node is built, so no need to go through GetMetadata.
+  //
+  // [pos] is the first separator that is >= key. The dummy key at index 0 is
+  // smaller than any key, so pos >= 1 and the child covering [key] is the one
+  // right before it, unless we hit the separator exactly and were asked for
+  // the larger side.
+  if (header.dram_copy == kKeyHeads) {
+    return SearchKeyHeads(key, key_size, get_le);
+  }
+  if (header.search_error && key_size == sizeof(uint64_t)) {
+    return SearchModel(U64KeyPolicy::Load(key), get_le);
+  }
+  bool exact = false;
+  uint32_t pos = SearchSortedRegion<KeyPolicy>(key, key_size, &exact, false);
+  assert(pos > 0);
+  if (exact) {
+    return GetChildOfSeparator(pos, key, key_size, get_le);
+  }
+  return pos - 1;
+}
+
+uint32_t InternalNode::GetChildOfSeparator(uint32_t pos, const char *key, uint16_t key_size,
+                                           bool get_le) {
+  // Any of the separators equal to [key] might have been hit
+  auto equals = [&](uint32_t i) {
+    auto meta = record_metadata[i];
+    return KeyCompare(reinterpret_cast<char *>(this) + meta.GetOffset(), meta.GetKeyLength(),
+                      key, key_size) == 0;
+  };
+  if (get_le) {
+    while (pos > 1 && equals(pos - 1)) {
+      --pos;
+    }
+    return pos - 1;
+  }
+  while (pos + 1 < header.sorted_count && equals(pos + 1)) {
+    ++pos;
+  }
+  return pos;
+}
+
+template uint32_t InternalNode::GetChildIndex<VarKeyPolicy>(const char *, uint16_t, bool);
+
+template <>
+uint32_t InternalNode::GetChildIndex<U64KeyPolicy>(const char *key,
+                                                   uint16_t key_size,
+                                                   bool get_le) {
+  // Same as above over the separators [1, sorted_count), but the halving
+  // step is a conditional move rather than a branch: the loop runs the same
+  // number of times for any key, so there are no mispredictions, and the
+  // separators are loaded as integers without looking at key lengths.
+  assert(key_size == U64KeyPolicy::kKeySize);
+  if (header.dram_copy == kKeyHeads) {
+    return SearchKeyHeads(key, key_size, get_le);
+  }
+  uint64_t k = U64KeyPolicy::Load(key);
+  if (header.search_error) {
+    return SearchModel(k, get_le);
+  }
+  auto separator = [this](uint32_t i) {
+    return U64KeyPolicy::Load(reinterpret_cast<char *>(this) + record_metadata[i].GetOffset());
+  };
+  uint32_t count = header.sorted_count;
+  assert(count > 1);
+  uint32_t base = 1;
+  uint32_t n = count - 1;
+  while (n > 1) {
+    uint32_t half = n / 2;
+    base = separator(base + half - 1) < k ? base + half : base;
+    n -= half;
+  }
+  // [pos] is the first separator >= key, or [count] if there is none
+  uint32_t pos = base + (separator(base) < k);
+  if (!get_le && pos < count && separator(pos) == k) {
+    while (pos + 1 < count && separator(pos + 1) == k) {
+      ++pos;
+    }
+    return pos;
+  }
+  return pos - 1;
+}
+
+std::atomic<bool> InternalNode::search_models{true};
+
+void InternalNode::EnableSearchModels(bool enable) {
+  search_models.store(enable, std::memory_order_relaxed);
+}
+
+void InternalNode::FitSearchModel() {
+  header.search_error = 0;
+  uint32_t count = header.sorted_count;
+  if (!search_models.load(std::memory_order_relaxed) || count < kMinSearchModelKeys + 1) {
+    return;
+  }
+  for (uint32_t i = 1; i < count; ++i) {
+    if (record_metadata[i].GetKeyLength() != sizeof(uint64_t)) {
+      return;
+    }
+  }
+  uint64_t first = GetSeparatorWord(1);
+  uint64_t last = GetSeparatorWord(count - 1);
+  uint32_t error = 0;
+  for (uint32_t i = 1; i < count; ++i) {
+    uint32_t predicted = PredictPosition(GetSeparatorWord(i), first, last, count);
+    error = std::max(error, predicted > i ? predicted - i : i - predicted);
+    if (error > kMaxSearchError) {
+      return;
+    }
+  }
+  header.search_error = static_cast<uint16_t>(error + 1);
+}
+
+uint32_t InternalNode::SearchModel(uint64_t key, bool get_le) {
+  // [pos] is the first separator >= key, or [count] if there is none. For a
+  // key between separators j - 1 and j, the prediction is between theirs, so
+  // j is within [error] below it and [error] + 1 above.
+  uint32_t count = header.sorted_count;
+  uint64_t first = GetSeparatorWord(1);
+  uint64_t last = GetSeparatorWord(count - 1);
+  uint32_t pos;
+  if (key <= first) {
+    pos = 1;
+  } else if (key > last) {
+    pos = count;
+  } else {
+    uint32_t error = header.search_error - 1;
+    uint32_t predicted = PredictPosition(key, first, last, count);
+    pos = predicted > error ? predicted - error : 1;
+    uint32_t n = std::min(predicted + error + 1, count) - pos;
+    while (n > 0) {
+      uint32_t half = n / 2;
+      if (GetSeparatorWord(pos + half) < key) {
+        pos += half + 1;
+        n -= half + 1;
+      } else {
+        n = half;
+      }
+    }
+  }
+  if (!get_le && pos < count && GetSeparatorWord(pos) == key) {
+    while (pos + 1 < count && GetSeparatorWord(pos + 1) == key) {
+      ++pos;
+    }
+    return pos;
+  }
+  return pos - 1;
+}
+
+// Fill the Eytzinger subtree at [k] of [heads] and [indexes] with the heads
+// of the separators of [node] from [*next] on, in order, past [prefix_size]
+static void FillKeyHeads(InternalNode *node, uint32_t k, uint32_t count, uint32_t prefix_size,
+                         uint64_t *heads, uint16_t *indexes, uint32_t *next) {
+  if (k >= count) {
+    return;
+  }
+  FillKeyHeads(node, 2 * k, count, prefix_size, heads, indexes, next);
+  auto meta = node->GetMetadata(*next);
+  heads[k] = InternalNode::GetKeyHead(reinterpret_cast<char *>(node) + meta.GetOffset() +
+                                      prefix_size, meta.GetKeyLength() - prefix_size);
+  indexes[k] = static_cast<uint16_t>((*next)++);
+  FillKeyHeads(node, 2 * k + 1, count, prefix_size, heads, indexes, next);
+}
+
+void InternalNode::BuildKeyHeads() {
+  // Separators are sorted, so the prefix of the first and the last is that
+  // of all. The dummy key of slot 0 needs no head, which leaves that slot,
+  // unused in Eytzinger order, for the prefix length.
+  auto *heads = GetKeyHeads();
+  auto *indexes = reinterpret_cast<uint16_t *>(heads + header.sorted_count);
+  uint32_t count = header.sorted_count;
+  uint32_t prefix_size = 0;
+  if (count > 1) {
+    auto first = record_metadata[1];
+    auto last = record_metadata[count - 1];
+    prefix_size = CommonPrefixLength(reinterpret_cast<char *>(this) + first.GetOffset(),
+                                     first.GetKeyLength(),
+                                     reinterpret_cast<char *>(this) + last.GetOffset(),
+                                     last.GetKeyLength());
+  }
+  heads[0] = prefix_size;
+  uint32_t next = 1;
+  FillKeyHeads(this, 1, count, prefix_size, heads, indexes, &next);
+  assert(next == count);
+  header.dram_copy = kKeyHeads;
+}
+
+uint32_t InternalNode::SearchKeyHeads(const char *key, uint16_t key_size, bool get_le) {
+  auto *heads = GetKeyHeads();
+  auto *indexes = reinterpret_cast<uint16_t *>(heads + header.sorted_count);
+  uint32_t count = header.sorted_count;
+  if (count == 1) {
+    return 0;
+  }
+  // Keys apart from the shared prefix are below or above all separators
+  uint32_t prefix_size = static_cast<uint32_t>(heads[0]);
+  auto first = record_metadata[1];
+  int cmp = memcmp(key, reinterpret_cast<char *>(this) + first.GetOffset(),
+                   std::min<uint32_t>(key_size, prefix_size));
+  if (cmp < 0 || (cmp == 0 && key_size < prefix_size)) {
+    return 0;
+  } else if (cmp > 0) {
+    return count - 1;
+  }
+
+  // Descend to the first head >= the key's (> with [upper]): going right sets
+  // a bit, so the last left turn, where the search ends, is found by dropping
+  // the trailing ones and the zero above them. The loop runs the same number
+  // of times for any key, without branching on the comparisons.
+  uint64_t head = GetKeyHead(key + prefix_size, key_size - prefix_size);
+  auto descend = [&](bool upper) {
+    uint32_t k = 1;
+    while (k < count) {
+      k = 2 * k + (upper ? heads[k] <= head : heads[k] < head);
+    }
+    k >>= __builtin_ffs(~k);
+    return k ? static_cast<uint32_t>(indexes[k]) : count;
+  };
+  auto separator_head = [&](uint32_t pos) {
+    auto meta = record_metadata[pos];
+    return GetKeyHead(reinterpret_cast<char *>(this) + meta.GetOffset() + prefix_size,
+                      meta.GetKeyLength() - prefix_size);
+  };
+  uint32_t pos = descend(false);
+  if (pos == count || separator_head(pos) != head) {
+    return pos - 1;
+  }
+
+  // Separators whose head is the key's might still be smaller than the key:
+  // binary search whole keys among them
+  uint32_t end = descend(true);
+  bool exact = false;
+  while (pos < end) {
+    uint32_t mid = (pos + end) / 2;
+    auto meta = record_metadata[mid];
+    cmp = KeyCompare(reinterpret_cast<char *>(this) + meta.GetOffset(), meta.GetKeyLength(),
+                     key, key_size);
+    if (cmp == 0) {
+      exact = true;
+      pos = mid;
+      break;
+    } else if (cmp < 0) {
+      pos = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+  if (exact) {
+    return GetChildOfSeparator(pos, key, key_size, get_le);
+  }
+  return pos - 1;
+}
+
+bool InternalNode::MergeNodes(InternalNode *left_node,
+                              InternalNode *right_node,
+                              const char *key, uint32_t key_size,
+                              InternalNode **new_node) {
+  uint32_t padded_keysize = RecordMetadata::PadKeyLength(key_size);
+  uint32_t offset = left_node->header.size + right_node->header.size +
+      padded_keysize - sizeof(InternalNode);
+  auto *node = reinterpret_cast<InternalNode *>(
+      BeginNodeImage(reinterpret_cast<void **>(new_node), offset, true));
+  node->header.size = offset;
+  uint32_t cur_record = 0;
+
+  for (uint32_t i = 0; i < left_node->header.sorted_count; i += 1) {
+    RecordMetadata meta = left_node->record_metadata[i];
+    uint64_t payload;
+    char *data;
+    char *record_key;
+    left_node->GetRawRecord(meta, &data, &record_key, &payload);
+    assert(meta.GetTotalLength() >= sizeof(uint64_t));
+    uint64_t total_len = meta.GetTotalLength();
+    offset -= total_len;
+    memcpy(reinterpret_cast<char *>(node) + offset,
+           data, total_len);
+
+    node->record_metadata[cur_record].FinalizeForInsert(offset, meta.GetKeyLength(), total_len);
+    cur_record += 1;
+  }
+  for (uint32_t i = 0; i < right_node->header.sorted_count; i += 1) {
+    RecordMetadata meta = right_node->record_metadata[i];
+    uint64_t payload;
+    char *cur_key;
+    right_node->GetRawRecord(meta, nullptr, &cur_key, &payload);
+    if (i == 0) {
+      offset -= (padded_keysize + sizeof(uint64_t));
+      memcpy(reinterpret_cast<char *>(node) + offset,
+             key, key_size);
+      memcpy(reinterpret_cast<char *>(node) + offset + padded_keysize,
+             &payload, sizeof(uint64_t));
+      node->record_metadata[cur_record].
+          FinalizeForInsert(offset, key_size, padded_keysize + sizeof(uint64_t));
+    } else {
+      assert(meta.GetTotalLength() >= sizeof(uint64_t));
+      uint64_t total_len = meta.GetTotalLength();
+      offset -= total_len;
+      memcpy(reinterpret_cast<char *>(node) + offset,
+             cur_key, total_len);
+      node->record_metadata[cur_record].FinalizeForInsert(offset, meta.GetKeyLength(), total_len);
+    }
+    cur_record += 1;
+  }
+  node->header.sorted_count = cur_record;
+  node->FitSearchModel();
+  EndNodeImage(reinterpret_cast<void **>(new_node), reinterpret_cast<char *>(node),
+               node->header.size);
+  return true;
+}
+
+bool LeafNode::MergeNodes(LeafNode *left_node, LeafNode *right_node, uint32_t node_size,
+                          LeafNode **new_node) {
+  auto *node = reinterpret_cast<LeafNode *>(
+      BeginNodeImage(reinterpret_cast<void **>(new_node), node_size));
+  new(node) LeafNode(node_size, left_node->HasBloomFilter(), left_node->GetLaneCount());
+
+  // Both prefixes are prefixes of the separator between the two nodes, so the
+  // shorter one is shared by all records of both
+  auto *prefix_node = left_node->header.prefix_size <= right_node->header.prefix_size ?
+                      left_node : right_node;
+  node->SetPrefix(prefix_node->GetPrefix(), prefix_node->header.prefix_size);
+
+  // note: left half is always smaller than the right half
+  thread_local std::vector<RecordMetadata> meta_vec;
+  for (auto *src : {left_node, right_node}) {
+    meta_vec.clear();
+    src->SortMetadataByKey(meta_vec, true, nullptr);
+    node->CopyFrom(src, meta_vec.begin(), meta_vec.end(), nullptr);
+  }
+  EndNodeImage(reinterpret_cast<void **>(new_node), reinterpret_cast<char *>(node),
+               node->header.size);
+  return true;
+}
+
+bool LeafNode::PrepareForSplit(Stack &stack,
+                               uint32_t internal_node_size,
+                               pmwcas::Descriptor *pd,
+                               pmwcas::DescriptorPool *pmwcas_pool,
+                               LeafNode **left, LeafNode **right,
+                               InternalNode **new_parent,
+                               bool backoff,
+                               const char *lo, uint32_t lo_size,
+                               const char *hi, uint32_t hi_size,
+                               bool adaptive) {
+  ALWAYS_ASSERT(header.GetStatus().GetRecordCount() > 2);
+  PERF_PHASE(kSMO);
+
+  // Prepare new nodes: a parent node, a left leaf and a right leaf
+  auto *left_node = reinterpret_cast<LeafNode *>(
+      BeginNodeImage(reinterpret_cast<void **>(left), this->header.size));
+  auto *right_node = reinterpret_cast<LeafNode *>(
+      BeginNodeImage(reinterpret_cast<void **>(right), this->header.size));
+  new(left_node) LeafNode(this->header.size, HasBloomFilter(), GetLaneCount());
+  new(right_node) LeafNode(this->header.size, HasBloomFilter(), GetLaneCount());
+
+  thread_local std::vector<RecordMetadata> meta_vec;
+  meta_vec.clear();
+  uint32_t total_size = SortMetadataByKey(meta_vec, true, pmwcas_pool->GetEpoch());
+
+  int32_t left_size = total_size / 2;
+  uint32_t nleft = 0;
+  for (uint32_t i = 0; i < meta_vec.size(); ++i) {
+    auto &meta = meta_vec[i];
+    ++nleft;
+    left_size -= meta.GetPaddedTotalLength();
+    if (left_size <= 0) {
+      break;
+    }
+  }
+  // The right node keeps the last record, so that the separator stays below
+  // the upper bound of this node, which the largest key might be
+  bool appending = false;
+  if (adaptive) {
+    nleft = GetAdaptiveSplit(meta_vec, nleft, &appending);
+  } else if (IsAppending()) {
+    appending = true;
+    nleft = meta_vec.size() - 1;
+  }
+  if (meta_vec.size() > 1) {
+    nleft = std::min<uint32_t>(nleft, meta_vec.size() - 1);
+  }
+
+  // Records of one key (see BzTree::ParameterSet::duplicate_keys) are kept
+  // in one node where they can be: move to the closest point between two keys
+  // that leaves the right node a record. If there is none, the node is split
+  // within the key, which becomes the separator, and searches for the key go
+  // on from the left node to the right one (see BzTree::NextLeafOfKey).
+  auto same_key = [&](uint32_t i) {
+    return KeyCompare(GetKey(meta_vec[i - 1]), meta_vec[i - 1].GetKeyLength(),
+                      GetKey(meta_vec[i]), meta_vec[i].GetKeyLength()) == 0;
+  };
+  if (nleft < meta_vec.size() && same_key(nleft)) {
+    uint32_t below = nleft;
+    uint32_t above = nleft;
+    while (below > 1 && same_key(below)) {
+      --below;
+    }
+    while (above < meta_vec.size() && same_key(above)) {
+      ++above;
+    }
+    if (!same_key(below) && (above == meta_vec.size() || nleft - below <= above - nleft)) {
+      nleft = below;
+    } else if (above < meta_vec.size()) {
+      nleft = above;
+    }
+  }
+
+  assert(nleft > 0);
+
+  // Separator exists in the new left leaf node, i.e., when traversing the tree,
+  // we go left if <=, and go right if >.
+  RecordMetadata separator_meta = meta_vec[nleft - 1];
+
+  // The node is already frozen (by us), so we must be able to get a valid key.
+  // The parent only needs as much of it as tells it apart from the first key
+  // of the right node (suffix truncation), and takes it as a whole key.
+  const char *separator_key = GetKey(separator_meta);
+  uint32_t separator_size = separator_meta.GetKeyLength();
+  if (nleft < meta_vec.size()) {
+    auto right_meta = meta_vec[nleft];
+    GetShortestSeparator(separator_key, separator_size,
+                         GetKey(right_meta), right_meta.GetKeyLength(),
+                         &separator_key, &separator_size);
+  }
+  thread_local std::string separator;
+  separator.assign(GetPrefix(), header.prefix_size);
+  separator.append(separator_key, separator_size);
+  const char *key = separator.data();
+  uint32_t key_size = separator.size();
+
+  // TODO(tzwang): also put the new insert here to save some cycles
+  auto left_end_it = meta_vec.begin() + nleft;
+  left_node->SetPrefix(key, lo ? CommonPrefixLength(lo, lo_size, key, key_size) : 0);
+  right_node->SetPrefix(key, hi ? CommonPrefixLength(key, key_size, hi, hi_size) : 0);
+  left_node->CopyFrom(this, meta_vec.begin(), left_end_it, pmwcas_pool->GetEpoch());
+  right_node->CopyFrom(this, left_end_it, meta_vec.end(), pmwcas_pool->GetEpoch());
+  EndNodeImage(reinterpret_cast<void **>(left), reinterpret_cast<char *>(left_node),
+               this->header.size);
+  EndNodeImage(reinterpret_cast<void **>(right), reinterpret_cast<char *>(right_node),
+               this->header.size);
+
+  InternalNode *parent = stack.Top() ?
+                         stack.Top()->node : nullptr;
+  if (parent == nullptr) {
+    // Good boy!
+    InternalNode::New(key, key_size,
+                      reinterpret_cast<uint64_t>(*left),
+                      reinterpret_cast<uint64_t>(*right),
+                      new_parent);
+    return true;
+  }
+
+  // Freeze the parent only if it still points to this node: a concurrent
+  // consolidation might have replaced this node in the parent before we froze
+  // the parent, in which case we'd be splitting a stale copy.
+#ifdef PMDK
+  uint64_t self_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(this));
+#else
+  uint64_t self_addr = reinterpret_cast<uint64_t>(this);
+#endif
+  uint32_t self_index = stack.Top()->meta_index;
+  bool frozen_by_me = false;
+  while (!parent->IsFrozen() && parent->HasChild(self_index, self_addr)) {
+    frozen_by_me = parent->FreezeIfChild(self_index, self_addr, pmwcas_pool);
+  }
+
+  if (!frozen_by_me && (backoff || !parent->HasChild(self_index, self_addr))) {
+    return false;
+  } else {
+    // Has a parent node. PrepareForSplit will see if we need to split this
+    // parent node as well, and if so, return a new (possibly upper-level) parent
+    // node that needs to be installed to its parent
+    return parent->PrepareForSplit(stack, internal_node_size, key, key_size,
+                                   reinterpret_cast<uint64_t>(*left),
+                                   reinterpret_cast<uint64_t>(*right),
+                                   new_parent,
+                                   pd, pmwcas_pool,
+                                   backoff, appending);
+  }
+}
+
+bool LeafNode::IsAppending() {
+  assert(header.status.IsFrozen());
+  uint32_t count = header.GetStatus().GetRecordCount();
+  // The largest key so far, from the end of the sorted field on
+  RecordMetadata max_meta;
+  for (uint32_t i = header.sorted_count; i > 0; --i) {
+    if (record_metadata[i - 1].IsVisible()) {
+      max_meta = record_metadata[i - 1];
+      break;
+    }
+  }
+  uint32_t appends = 0;
+  uint32_t others = 0;
+  for (uint32_t i = header.sorted_count; i < count; ++i) {
+    auto meta = record_metadata[i];
+    if (!meta.IsVisible()) {
+      continue;
+    }
+    if (!max_meta.IsVisible() ||
+        KeyCompare(GetKey(meta), meta.GetKeyLength(),
+                   GetKey(max_meta), max_meta.GetKeyLength()) > 0) {
+      max_meta = meta;
+      ++appends;
+    } else {
+      ++others;
+    }
+  }
+  return appends >= kMinAppends && others * 8 <= appends;
+}
+
+uint32_t LeafNode::GetAdaptiveSplit(std::vector<RecordMetadata> &sorted, uint32_t even_split,
+                                    bool *appending) {
+  assert(header.status.IsFrozen());
+  // Records inserted since the node was built are told apart by offset. In
+  // the order they came, count those with the largest and smallest key yet.
+  thread_local std::vector<uint32_t> offsets;
+  offsets.clear();
+  uint32_t count = header.GetStatus().GetRecordCount();
+  RecordMetadata min_meta;
+  RecordMetadata max_meta;
+  uint32_t new_min = 0;
+  uint32_t new_max = 0;
+  for (uint32_t i = header.sorted_count; i < count; ++i) {
+    auto meta = record_metadata[i];
+    if (!meta.IsVisible()) {
+      continue;
+    }
+    offsets.push_back(meta.GetOffset());
+    if (offsets.size() == 1) {
+      min_meta = max_meta = meta;
+    } else if (KeyCompare(GetKey(meta), meta.GetKeyLength(),
+                          GetKey(max_meta), max_meta.GetKeyLength()) > 0) {
+      max_meta = meta;
+      ++new_max;
+    } else if (KeyCompare(GetKey(meta), meta.GetKeyLength(),
+                          GetKey(min_meta), min_meta.GetKeyLength()) < 0) {
+      min_meta = meta;
+      ++new_min;
+    }
+  }
+  uint32_t n = sorted.size();
+  uint32_t older = n - offsets.size();
+  if (offsets.size() < kMinAppends || older == 0) {
+    if (IsAppending()) {
+      *appending = true;
+      return n - 1;
+    }
+    return even_split;
+  }
+  std::sort(offsets.begin(), offsets.end());
+  thread_local std::vector<uint32_t> ranks;
+  ranks.clear();
+  for (uint32_t i = 0; i < n; ++i) {
+    if (std::binary_search(offsets.begin(), offsets.end(), sorted[i].GetOffset())) {
+      ranks.push_back(i);
+    }
+  }
+  uint32_t trim = ranks.size() / 8;
+  uint32_t lo = ranks[trim];
+  uint32_t hi = ranks[ranks.size() - 1 - trim];
+  // Older records before, within and after the range
+  uint32_t within = static_cast<uint32_t>(hi - lo + 1 - (ranks.size() - 2 * trim));
+  uint32_t before = static_cast<uint32_t>(lo - trim);
+  uint32_t after = older - before - within;
+  if (within * 4 > older) {
+    return even_split;
+  }
+  // Inserts going up leave the range to the left node, going down to the
+  // right one; all over the range, it goes whole with the smaller side
+  if (new_max * 2 > offsets.size()) {
+    *appending = after == 0;
+    return after == 0 ? n - 1 : hi + 1;
+  }
+  if (new_min * 2 > offsets.size()) {
+    return before == 0 ? 1 : lo;
+  }
+  return before >= after ? lo : hi + 1;
+}
+
+BaseNode *BzTree::TraverseToNode(bztree::Stack *stack,
+                                 const char *key, uint16_t key_size,
+                                 bztree::BaseNode *stop_at,
+                                 bool le_child) {
+  BaseNode *node = GetRootNodeSafe();
+  if (stack) {
+    stack->SetRoot(node);
+  }
+  InternalNode *parent = nullptr;
+  uint32_t meta_index = 0;
+  while (node != stop_at && !node->IsLeaf()) {
+    assert(!node->IsLeaf());
+    parent = reinterpret_cast<InternalNode *>(node);
+    meta_index = GetSearchNode(parent)->GetChildIndex(key, key_size, le_child);
+    node = parent->GetChildByMetaIndex(meta_index, GetPMWCASPool()->GetEpoch());
+    assert(node);
+    if (stack != nullptr) {
+      stack->Push(parent, meta_index);
+    }
+  }
+  return node;
+}
+
+bool BzTree::GetLeafUpperBound(Stack *stack, const char **key, uint32_t *key_size) {
+  // The leaf's upper bound is the separator right of it in the parent, or, if
+  // the leaf is the parent's last child, the parent's upper bound, and so on
+  for (uint32_t i = stack->num_frames; i > 0; --i) {
+    auto &frame = stack->frames[i - 1];
+    if (frame.meta_index + 1 < frame.node->GetHeader()->sorted_count) {
+      auto meta = frame.node->GetMetadata(frame.meta_index + 1);
+      *key = frame.node->GetKey(meta);
+      *key_size = meta.GetKeyLength();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BzTree::GetLeafLowerBound(Stack *stack, const char **key, uint32_t *key_size) {
+  // Mirrors GetLeafUpperBound: the separator of the leaf in its parent, unless
+  // it's the parent's first child (the dummy key), then the parent's, etc.
+  for (uint32_t i = stack->num_frames; i > 0; --i) {
+    auto &frame = stack->frames[i - 1];
+    if (frame.meta_index > 0) {
+      auto meta = frame.node->GetMetadata(frame.meta_index);
+      *key = frame.node->GetKey(meta);
+      *key_size = meta.GetKeyLength();
+      return true;
+    }
+  }
+  return false;
+}
+
+uint16_t BzTree::GetLeafPrefix(Stack *stack, const char **prefix) {
+  const char *lo = nullptr;
+  const char *hi = nullptr;
+  uint32_t lo_size = 0;
+  uint32_t hi_size = 0;
+  if (!GetLeafLowerBound(stack, &lo, &lo_size) || !GetLeafUpperBound(stack, &hi, &hi_size)) {
+    *prefix = "";
+    return 0;
+  }
+  *prefix = lo;
+  return BaseNode::CommonPrefixLength(lo, lo_size, hi, hi_size);
+}
+
+ReturnCode BzTree::RangeScanBySize(const char *key, uint16_t key_size, uint32_t to_scan,
+                                   ScanBuffer *result) {
+  LatencyTimer timer(this, BzTree::kOpScan);
+  thread_local Stack stack;
+  stack.tree = this;
+  result->Clear();
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+
+  // Continue from the upper bound of the last leaf (excluding it) rather than
+  // from the last key returned, so that (concurrently) emptied leaves don't
+  // end the scan early; all nodes stay valid as long as we hold the epoch.
+  const char *from = key;
+  uint32_t from_size = key_size;
+  bool include_from = true;
+  LeafNode *node = nullptr;
+  while (result->Count() < to_scan) {
+    if (!node) {
+      stack.Clear();
+      node = TraverseToLeaf(&stack, from, from_size, include_from);
+    }
+    auto rc = node->RangeScanByKey(from, from_size, include_from, nullptr, 0, false,
+                                   to_scan - result->Count(), result, GetPMWCASPool());
+    if (!rc.IsOk()) {
+      return rc;
+    }
+    if (!GetLeafUpperBound(&stack, &from, &from_size)) {
+      break;
+    }
+    include_from = false;
+    node = nullptr;
+    if (parameters.duplicate_keys) {
+      // The next leaf may go on with records of the bound, see NextLeafOfKey
+      node = TraverseToSibling(&stack, false, true);
+      include_from = true;
+    }
+  }
+  return ReturnCode::Ok();
+}
+
+std::unique_ptr<Record> Iterator::GetNext() {
+  if (remaining_size == 0) {
+    return nullptr;
+  }
+  if (cursor) {
+    cursor = batch.Next(cursor);
+  }
+  while (!cursor) {
+    if (exhausted) {
+      return nullptr;
+    }
+    Fill();
+    cursor = batch.First();
+  }
+  --remaining_size;
+  auto size = Record::GetSize(cursor->meta);
+  Record *r = reinterpret_cast<Record *>(malloc(size));
+  memcpy(r, cursor, size);
+  return std::unique_ptr<Record>(r);
+}
+
+ScanBuffer *Iterator::GetNextBatch() {
+  cursor = nullptr;
+  while (remaining_size > 0 && !exhausted) {
+    Fill();
+    if (batch.Count()) {
+      // Left at the maximum, the count doesn't run out on huge trees
+      if (remaining_size != std::numeric_limits<uint32_t>::max()) {
+        remaining_size -= batch.Count();
+      }
+      return &batch;
+    }
+  }
+  return nullptr;
+}
+
+void Iterator::Fill() {
+  LatencyTimer timer(tree, BzTree::kOpScan);
+  batch.Clear();
+  EpochScope guard(tree->GetPMWCASPool()->GetEpoch());
+  // Read before touching any cached node: if no internal node was retired
+  // since the path was last validated, none of its nodes have been freed
+  uint64_t version = tree->retired_internal_nodes.load();
+
+  const char *next = has_next ? next_key.data() : nullptr;
+  auto next_size = static_cast<uint32_t>(next_key.size());
+  const char *end = has_end ? end_key.data() : nullptr;
+  auto end_size = static_cast<uint32_t>(end_key.size());
+  const char *bound = nullptr;
+  uint32_t bound_size = 0;
+
+  bool duplicate_keys = tree->parameters.duplicate_keys;
+  if (reverse) {
+    // A leaf holds keys larger than its lower bound and up to (including) its
+    // upper bound, so the bound itself is where the previous leaf ends. A key
+    // that continues over several leaves ends in the last one.
+    LeafNode *node = GetNextLeaf(version, next, next_size, !duplicate_keys || !next_inclusive);
+    node->ReverseRangeScanByKey(end, end_size, end_inclusive, next, next_size, next_inclusive,
+                                remaining_size, &batch, tree->GetPMWCASPool());
+    int cmp = 0;
+    if (!BzTree::GetLeafLowerBound(&stack, &bound, &bound_size) ||
+        (has_end && ((cmp = BaseNode::KeyCompare(bound, bound_size, end, end_size)) < 0 ||
+                     (cmp == 0 && !end_inclusive)))) {
+      exhausted = true;
+      return;
+    }
+    next_inclusive = true;
+  } else {
+    LeafNode *node = GetNextLeaf(version, next, next_size, next_inclusive);
+    node->RangeScanByKey(next, next_size, next_inclusive, end, end_size, end_inclusive,
+                         remaining_size, &batch, tree->GetPMWCASPool());
+
+    // Keys in the next leaf are all larger than this leaf's upper bound, so
+    // there is nothing left to visit once the bound reaches the end of the
+    // range, unless the next leaf goes on with the bound (see NextLeafOfKey)
+    int cmp = 0;
+    if (!BzTree::GetLeafUpperBound(&stack, &bound, &bound_size) ||
+        (has_end && ((cmp = BaseNode::KeyCompare(bound, bound_size, end, end_size)) > 0 ||
+                     (cmp == 0 && (!duplicate_keys || !end_inclusive))))) {
+      exhausted = true;
+      return;
+    }
+    next_inclusive = duplicate_keys;
+  }
+  if (duplicate_keys) {
+    bool same = has_next && BaseNode::KeyCompare(bound, bound_size, next, next_size) == 0;
+    run_leaves = same ? run_leaves + 1 : 1;
+  }
+  next_key.assign(bound, bound_size);
+  has_next = true;
+
+  // Keep the path for the next leaf only if none of its nodes is frozen, so
+  // any that gets replaced from now on shows in retired_internal_nodes
+  stack_version = version;
+  for (uint32_t i = 0; i < stack.num_frames; ++i) {
+    if (stack.frames[i].node->IsFrozen()) {
+      stack.Clear();
+      break;
+    }
+  }
+}
+
+LeafNode *Iterator::GetNextLeaf(uint64_t version, const char *key, uint32_t key_size,
+                                bool le_child) {
+  if (stack.num_frames > 0 && version == stack_version) {
+    LeafNode *node = tree->TraverseToSibling(&stack, reverse);
+    if (node) {
+      return node;
+    }
+  }
+  if (run_leaves > 0) {
+    LeafNode *node = nullptr;
+    for (uint32_t attempt = 1; !node; ++attempt) {
+      node = tree->TraverseToRunLeaf(&stack, key, static_cast<uint16_t>(key_size), run_leaves,
+                                     reverse);
+      if (!node) {
+        ContentionManager::Pause(attempt);
+      }
+    }
+    return node;
+  }
+  stack.Clear();
+  return tree->TraverseToLeaf(&stack, key, static_cast<uint16_t>(key_size), le_child);
+}
+
+// Prefetch the cache lines of [size] bytes from [begin] on
+static inline void PrefetchLines(const void *begin, uint32_t size) {
+  static const uint32_t kCacheLineSize = 64;
+  auto addr = reinterpret_cast<uintptr_t>(begin) & ~static_cast<uintptr_t>(kCacheLineSize - 1);
+  auto end = reinterpret_cast<uintptr_t>(begin) + size;
+  for (; addr < end; addr += kCacheLineSize) {
+    __builtin_prefetch(reinterpret_cast<const void *>(addr), 0, 3);
+  }
+}
+
+// Prefetch all of [node], which may be a leaf or an internal node of any size.
+// The header line is needed first anyway to tell the two apart. If [narrow]
+// is set, only what a search starts from is prefetched: the metadata array
+// and, of leaves, the fingerprints of the unsorted field. The keys the search
+// compares against and the record it finds are read on demand.
+static inline void PrefetchNode(BaseNode *node, bool narrow = false) {
+  __builtin_prefetch((const void *) node, 0, 3);
+  auto *header = node->GetHeader();
+  if (!narrow) {
+    PrefetchLines(node, header->size);
+  } else if (node->IsLeaf()) {
+    uint32_t count = header->GetStatus().GetRecordCount();
+    PrefetchLines(node, sizeof(LeafNode) + count * sizeof(RecordMetadata));
+    if (count > header->sorted_count) {
+      auto capacity = LeafNode::GetFingerprintCapacity(header->size);
+      auto *fingerprints = reinterpret_cast<LeafNode *>(node)->GetFingerprints();
+      if (header->sorted_count < capacity) {
+        PrefetchLines(fingerprints + header->sorted_count,
+                      std::min(count, capacity) - header->sorted_count);
+      }
+    }
+    if (header->bloom_size) {
+      PrefetchLines(reinterpret_cast<LeafNode *>(node)->GetBloomFilter(), header->bloom_size);
+    }
+  } else {
+    PrefetchLines(node, sizeof(InternalNode) + header->sorted_count * sizeof(RecordMetadata));
+  }
+}
+
+uint32_t BzTree::GetStatsSlotIndex() {
+  static std::atomic<uint32_t> next_slot{0};
+  thread_local uint32_t slot = next_slot.fetch_add(1) % kStatsSlots;
+  return slot;
+}
+
+void BzTree::AllocateStats() {
+  stats_slots = reinterpret_cast<StatsSlot *>(
+      aligned_alloc(PersistBatch::kCacheLineSize, sizeof(StatsSlot) * kStatsSlots));
+  for (uint32_t i = 0; i < kStatsSlots; ++i) {
+    new(&stats_slots[i]) StatsSlot();
+  }
+  ResetStats();
+}
+
+void BzTree::ResetStats() {
+  for (uint32_t i = 0; i < kStatsSlots; ++i) {
+    for (auto &counter : stats_slots[i].counters) {
+      counter.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+void BzTree::CollectPendingStats() {
+#if ENABLE_STATS
+  if (!has_pending_stats) {
+    return;
+  }
+  auto &slot = stats_slots[GetStatsSlotIndex()];
+  for (uint32_t i = 0; i < kStatCounters; ++i) {
+    if (pending_stats[i]) {
+      slot.counters[i].fetch_add(pending_stats[i], std::memory_order_relaxed);
+      pending_stats[i] = 0;
+    }
+  }
+  has_pending_stats = false;
+#endif
+}
+
+struct MaintenanceWorkers {
+  struct Hint {
+    LeafNode *leaf;
+    std::string key;
+    bool merge;
+  };
+  std::mutex mutex;
+  std::condition_variable work;
+  std::condition_variable idle;
+  std::deque<Hint> hints;
+  // Leaves with a hint in the queue. Only compared, never dereferenced, so a
+  // leaf freed and reallocated at the same address costs a dropped hint.
+  std::unordered_set<LeafNode *> queued;
+  uint32_t busy = 0;
+  bool stop = false;
+  std::vector<std::thread> threads;
+};
+
+void BzTree::StartMaintenance(uint32_t threads, float soft_fill, uint32_t compaction_rate) {
+  StopMaintenance();
+  maintenance_threshold = static_cast<uint32_t>(parameters.split_threshold * soft_fill);
+  auto *workers = new MaintenanceWorkers;
+  for (uint32_t i = 0; i < threads; ++i) {
+    workers->threads.emplace_back(&BzTree::RunMaintenance, this, workers);
+  }
+  if (compaction_rate) {
+    workers->threads.emplace_back(&BzTree::RunCompaction, this, workers, compaction_rate);
+  }
+  maintenance = workers;
+}
+
+void BzTree::RunCompaction(MaintenanceWorkers *workers, uint32_t leaves_per_second) {
+  // Small batches with sleeps in between rather than bursts, so that it's
+  // never in the way of user threads for long
+  static const uint32_t kBatch = 16;
+  auto interval = std::chrono::microseconds(uint64_t{1000000} * kBatch / leaves_per_second);
+  std::string cursor;
+  std::unique_lock<std::mutex> lock(workers->mutex);
+  while (!workers->work.wait_for(lock, interval, [&] { return workers->stop; })) {
+    lock.unlock();
+    if (!Compact(&cursor, kBatch)) {
+      cursor.clear();
+    }
+    lock.lock();
+  }
+}
+
+bool BzTree::Compact(std::string *cursor, uint32_t max_leaves) {
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  Stack stack;
+  stack.tree = this;
+  CollapseRoot();
+  for (uint32_t visited = 0; visited < max_leaves; ++visited) {
+    auto *leaf = TraverseToCursor(&stack, *cursor);
+
+    // CheckMerge needs a key that leads to the leaf, its upper bound does;
+    // the last leaf is merged into its left sibling when that one's visited
+    const char *upper = nullptr;
+    uint32_t upper_size = 0;
+    if (!GetLeafUpperBound(&stack, &upper, &upper_size)) {
+      return false;
+    }
+    std::string next(upper, upper_size);
+    Stack merge_stack = stack;
+    auto rc = leaf->CheckMerge(&merge_stack, next.data(), next.size(), true);
+    if (rc.IsOk() && leaf->IsFrozen()) {
+      // Merged; see if the new leaf is still small
+      continue;
+    }
+    *cursor = next;
+  }
+  return true;
+}
+
+bool BzTree::PackColdLeaves(std::string *cursor, uint32_t max_leaves, uint64_t max_accesses,
+                            uint32_t *packed) {
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  Stack stack;
+  stack.tree = this;
+  for (uint32_t visited = 0; visited < max_leaves; ++visited) {
+    auto *leaf = TraverseToCursor(&stack, *cursor);
+    const char *upper = nullptr;
+    uint32_t upper_size = 0;
+    bool more = GetLeafUpperBound(&stack, &upper, &upper_size);
+    std::string next;
+    if (more) {
+      next.assign(upper, upper_size);
+    }
+
+    // Not worth a new node unless it gives back a quarter of this one
+    auto *header = leaf->GetHeader();
+    auto status = header->GetStatus();
+    uint32_t live_size = LeafNode::GetUsedSpace(status) - status.GetDeletedSize();
+    if (header->size >= parameters.leaf_node_size && live_size <= header->size / 4 * 3 &&
+        GetLeafHotness(leaf) <= max_accesses && leaf->Freeze(GetPMWCASPool())) {
+      if (!ConsolidateLeaf(&stack, leaf, nullptr, 0, nullptr, 0, LeafNode::kPackedSize)) {
+        ReplaceFrozenLeaf(&stack, leaf, *cursor);
+      } else if (packed) {
+        ++*packed;
+      }
+    }
+    if (!more) {
+      return false;
+    }
+    *cursor = next;
+  }
+  return true;
+}
+
+void BzTree::ReplaceFrozenLeaf(Stack *stack, LeafNode *leaf, const std::string &cursor) {
+  // Nobody else would until their freeze retries run out (see
+  // SplitOrConsolidate); the leaf may have moved to a new parent meanwhile
+  uint32_t attempt = 0;
+  while (!ConsolidateLeaf(stack, leaf)) {
+    ContentionManager::Pause(++attempt);
+    if (TraverseToCursor(stack, cursor) != leaf) {
+      return;
+    }
+  }
+}
+
+// Write [size] bytes at [offset], through short writes
+static bool WriteFully(int fd, const char *buf, uint64_t size, uint64_t offset) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, buf, size, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+std::atomic<LeafStore *> LeafStore::stores[LeafStore::kMaxStores];
+
+ReturnCode LeafStore::Open(BzTree *tree, const char *path, uint32_t page_size,
+                           LeafStore **store) {
+  *store = nullptr;
+#ifdef PMEM
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+#else
+  // Nothing in the file outlives the tree
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+  if (fd < 0) {
+    return ReturnCode::IOError();
+  }
+  auto fail = [fd]() {
+    close(fd);
+    return ReturnCode::IOError();
+  };
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return fail();
+  }
+  Header header;
+  uint64_t next_page = 1;
+  bool reopen = st.st_size > 0;
+  if (reopen) {
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != Header::kMagic || header.page_size != page_size ||
+        header.slot >= kMaxStores) {
+      return fail();
+    }
+    next_page = std::max<uint64_t>(1, (st.st_size + page_size - 1) / page_size);
+  } else {
+    header.magic = Header::kMagic;
+    header.page_size = page_size;
+  }
+
+  // The slot the file had, so that tags in the tree point to it, or any
+  auto *new_store = new LeafStore(tree, fd, page_size, 0, next_page);
+  for (uint32_t slot = reopen ? header.slot : 0; slot < kMaxStores; ++slot) {
+    LeafStore *expected = nullptr;
+    if (stores[slot].compare_exchange_strong(expected, new_store)) {
+      new_store->slot = slot;
+      *store = new_store;
+      break;
+    }
+    if (reopen) {
+      break;
+    }
+  }
+  if (!*store) {
+    new_store->fd = -1;
+    delete new_store;
+    return fail();
+  }
+  header.slot = new_store->slot;
+  if (!reopen && !(WriteFully(fd, reinterpret_cast<const char *>(&header), sizeof(header), 0) &&
+                   fdatasync(fd) == 0)) {
+    delete new_store;
+    *store = nullptr;
+    return ReturnCode::IOError();
+  }
+  return ReturnCode::Ok();
+}
+
+LeafStore::~LeafStore() {
+  if (fd >= 0) {
+    stores[slot].store(nullptr);
+    close(fd);
+  }
+}
+
+uint64_t LeafStore::AllocatePage() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (free_pages.empty()) {
+    return next_page++;
+  }
+  auto page = free_pages.back();
+  free_pages.pop_back();
+  return page;
+}
+
+void LeafStore::FreePage(uint64_t page) {
+  std::lock_guard<std::mutex> lock(mutex);
+  free_pages.push_back(page);
+}
+
+void LeafStore::FreePage(void *store, void *page) {
+  reinterpret_cast<LeafStore *>(store)->FreePage(reinterpret_cast<uint64_t>(page));
+}
+
+bool LeafStore::Write(uint64_t page, LeafNode *image) {
+  auto size = image->GetHeader()->size;
+  assert(size <= page_size);
+  if (!WriteFully(fd, reinterpret_cast<const char *>(image), size, page * page_size)) {
+    return false;
+  }
+#ifdef PMEM
+  // The tag that points to the page is persistent as soon as it's installed
+  return fdatasync(fd) == 0;
+#else
+  return true;
+#endif
+}
+
+void LeafStore::Prefetch(uint64_t page) {
+  posix_fadvise(fd, page * page_size, page_size, POSIX_FADV_WILLNEED);
+}
+
+bool LeafStore::Read(uint64_t page, char *image) {
+  uint64_t offset = page * page_size;
+  uint32_t done = 0;
+  while (done < page_size) {
+    ssize_t bytes = pread(fd, image + done, page_size - done, offset + done);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      // Leaves smaller than a page at the end of the file
+      break;
+    }
+    done += bytes;
+  }
+  return done >= sizeof(LeafNode) &&
+      done >= reinterpret_cast<LeafNode *>(image)->GetHeader()->size;
+}
+
+ReturnCode BzTree::EnableTiering(const char *path) {
+  if (leaf_store.load()) {
+    return ReturnCode::Ok();
+  }
+  LeafStore *store = nullptr;
+  auto rc = LeafStore::Open(this, path, parameters.leaf_node_size, &store);
+  if (!rc.IsOk()) {
+    return rc;
+  }
+  LeafStore *expected = nullptr;
+  if (!leaf_store.compare_exchange_strong(expected, store)) {
+    delete store;
+  }
+  return ReturnCode::Ok();
+}
+
+uint64_t BzTree::GetEvictedLeaves() {
+  auto *store = leaf_store.load(std::memory_order_relaxed);
+  return store ? store->GetEvicted() : 0;
+}
+
+bool BzTree::EvictColdLeaves(std::string *cursor, uint32_t max_leaves, uint64_t max_accesses,
+                             uint32_t *evicted) {
+  if (!leaf_store.load()) {
+    return false;
+  }
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  Stack stack;
+  stack.tree = this;
+  for (uint32_t visited = 0; visited < max_leaves; ++visited) {
+    auto *leaf = TraverseToCursor(&stack, *cursor);
+    const char *upper = nullptr;
+    uint32_t upper_size = 0;
+    bool more = GetLeafUpperBound(&stack, &upper, &upper_size);
+    std::string next;
+    if (more) {
+      next.assign(upper, upper_size);
+    }
+    if (stack.Top() && GetLeafHotness(leaf) <= max_accesses && leaf->Freeze(GetPMWCASPool())) {
+      if (!EvictLeaf(&stack, leaf)) {
+        ReplaceFrozenLeaf(&stack, leaf, *cursor);
+      } else if (evicted) {
+        ++*evicted;
+      }
+    }
+    if (!more) {
+      return false;
+    }
+    *cursor = next;
+  }
+  return true;
+}
+
+bool BzTree::EvictLeaf(Stack *stack, LeafNode *leaf) {
+  auto *store = leaf_store.load();
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  // Consolidated on the way out, records left by inserts that never finished
+  // would be taken for ones still in flight once the leaf is back
+  thread_local std::vector<uint64_t> buffer;
+  buffer.assign(store->GetPageSize() / sizeof(uint64_t), 0);
+  auto *image = reinterpret_cast<LeafNode *>(buffer.data());
+  new(image) LeafNode(leaf->GetHeader()->size, leaf->HasBloomFilter(), leaf->GetLaneCount());
+  image->SetPrefix(leaf->GetPrefix(), leaf->GetHeader()->prefix_size);
+  thread_local std::vector<RecordMetadata> meta_vec;
+  meta_vec.clear();
+  leaf->SortMetadataByKey(meta_vec, true, epoch);
+  image->CopyFrom(leaf, meta_vec.begin(), meta_vec.end(), epoch);
+
+  uint64_t page = store->AllocatePage();
+  if (!store->Write(page, image)) {
+    store->FreePage(page);
+    return false;
+  }
+#ifdef PMDK
+  auto *old_leaf = Allocator::Get()->GetOffset(leaf);
+#else
+  auto *old_leaf = leaf;
+#endif
+  // Neither word is a node to recycle after a crash
+  auto *top = stack->Top();
+  auto *pd = NewDescriptor(GetPMWCASPool());
+  auto result = top->node->Update(top->node->GetMetadata(top->meta_index), old_leaf,
+                                  reinterpret_cast<BaseNode *>(store->GetWord(page)), pd,
+                                  GetPMWCASPool(), pmwcas::Descriptor::kRecycleNever);
+  if (result.IsNodeFrozen()) {
+    AbortDescriptor(pd);
+  }
+  if (!result.IsOk()) {
+    store->FreePage(page);
+    CountStat(kStatSMOFailures);
+    return false;
+  }
+  RetireNode(leaf);
+  store->CountEvicted(1);
+  CountStat(kStatLeafEvictions);
+  return true;
+}
+
+BaseNode *BzTree::LoadLeaf(LeafStore *store, InternalNode *parent, uint32_t index,
+                           uint64_t word) {
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  thread_local std::vector<uint64_t> buffer;
+  buffer.resize(store->GetPageSize() / sizeof(uint64_t));
+  auto *image = reinterpret_cast<char *>(buffer.data());
+  while (true) {
+    // A leaf lost can't be served
+    ALWAYS_ASSERT(store->Read(LeafStore::GetPage(word), image));
+    uint32_t size = reinterpret_cast<LeafNode *>(image)->GetHeader()->size;
+    if (parent->IsFrozen()) {
+      LeafNode *copy = nullptr;
+      LeafNode::New(&copy, size);
+#ifdef PMDK
+      copy = Allocator::Get()->GetDirect(copy);
+#endif
+      memcpy(copy, image, size);
+      copy->GetHeader()->status.word = copy->GetHeader()->GetStatus().Freeze().word;
+      for (uint32_t i = 0; i < copy->GetLaneCount(); ++i) {
+        copy->GetLane(i)->word = copy->GetHeader()->status.word;
+      }
+      RetireNode(copy);
+      return copy;
+    }
+
+    auto *pd = NewDescriptor(GetPMWCASPool(), true);
+    pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                           reinterpret_cast<uint64_t>(nullptr),
+                           pmwcas::Descriptor::kRecycleNewOnFailure);
+    uint64_t *ptr_leaf = pd->GetNewValuePtr(0);
+    char *leaf = BeginNodeImage(reinterpret_cast<void **>(ptr_leaf), size);
+    memcpy(leaf, image, size);
+    EndNodeImage(reinterpret_cast<void **>(ptr_leaf), leaf, size);
+    auto result = parent->Update(parent->GetMetadata(index), reinterpret_cast<BaseNode *>(word),
+                                 reinterpret_cast<BaseNode *>(*ptr_leaf), pd, GetPMWCASPool(),
+                                 pmwcas::Descriptor::kRecycleNever);
+    if (result.IsNodeFrozen()) {
+      AbortDescriptor(pd);
+    }
+    if (result.IsOk()) {
+      // Someone might still be reading the page
+      garbage_list->Push(reinterpret_cast<void *>(LeafStore::GetPage(word)),
+                         LeafStore::FreePage, store);
+      store->CountEvicted(-1);
+      CountStat(kStatLeafLoads);
+#ifdef PMDK
+      return Allocator::Get()->GetDirect(reinterpret_cast<BaseNode *>(*ptr_leaf));
+#else
+      return reinterpret_cast<BaseNode *>(*ptr_leaf);
+#endif
+    }
+    // Loaded by another thread, or evicted again from there
+    uint64_t current = parent->GetChildWord(index, epoch);
+    if (!(current & InternalNode::kEvictedChild)) {
+      return parent->GetChildByMetaIndex(index, epoch);
+    }
+    word = current;
+  }
+}
+
+LeafNode *BzTree::TraverseToCursor(Stack *stack, const std::string &cursor) {
+  stack->Clear();
+  if (!cursor.empty()) {
+    // The cursor is a lower bound, its leaf is the one right of it
+    return TraverseToLeaf(stack, cursor.data(), static_cast<uint16_t>(cursor.size()), false);
+  }
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  BaseNode *node = GetRootNodeSafe();
+  stack->SetRoot(node);
+  while (!node->IsLeaf()) {
+    auto *parent = reinterpret_cast<InternalNode *>(node);
+    stack->Push(parent, 0);
+    node = parent->GetChildByMetaIndex(0, epoch);
+  }
+  return reinterpret_cast<LeafNode *>(node);
+}
+
+void BzTree::CollapseRoot() {
+  while (true) {
+    BaseNode *old_root = GetRootNodeSafe();
+    auto status = old_root->GetHeader()->GetStatus();
+    if (old_root->IsLeaf() || old_root->GetHeader()->sorted_count != 1 || status.IsFrozen()) {
+      return;
+    }
+    BaseNode *child = reinterpret_cast<InternalNode *>(old_root)->GetChildByMetaIndex(
+        0, GetPMWCASPool()->GetEpoch());
+    // Frozen as it goes, so that nothing gets installed in it any more
+    auto *pd = NewDescriptor(GetPMWCASPool());
+    pd->AddEntry(&(&old_root->GetHeader()->status)->word, status.word, status.Freeze().word);
+#ifdef PMDK
+    auto old_root_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(old_root));
+    auto child_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(child));
+#else
+    auto old_root_addr = reinterpret_cast<uint64_t>(old_root);
+    auto child_addr = reinterpret_cast<uint64_t>(child);
+#endif
+    if (!ChangeRoot(old_root_addr, child_addr, pd)) {
+      return;
+    }
+    RetireNode(old_root);
+  }
+}
+
+void BzTree::StopMaintenance() {
+  auto *workers = maintenance.exchange(nullptr);
+  if (!workers) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(workers->mutex);
+    workers->stop = true;
+  }
+  workers->work.notify_all();
+  for (auto &thread : workers->threads) {
+    thread.join();
+  }
+  delete workers;
+}
+
+void BzTree::WaitForMaintenance() {
+  auto *workers = maintenance.load();
+  if (!workers) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(workers->mutex);
+  workers->idle.wait(lock, [&] { return workers->hints.empty() && workers->busy == 0; });
+}
+
+void BzTree::AddMaintenanceHint(MaintenanceWorkers *workers, LeafNode *node, const char *key,
+                                uint16_t key_size, bool merge) {
+  // Someone else adding a hint is likely adding the same one, don't wait
+  std::unique_lock<std::mutex> lock(workers->mutex, std::try_to_lock);
+  if (!lock.owns_lock() || workers->stop || workers->hints.size() >= kMaxMaintenanceHints ||
+      !workers->queued.insert(node).second) {
+    return;
+  }
+  workers->hints.push_back({node, std::string(key, key_size), merge});
+  lock.unlock();
+  workers->work.notify_one();
+}
+
+void BzTree::RunMaintenance(MaintenanceWorkers *workers) {
+  Stack stack;
+  stack.tree = this;
+  std::unique_lock<std::mutex> lock(workers->mutex);
+  while (true) {
+    workers->work.wait(lock, [&] { return workers->stop || !workers->hints.empty(); });
+    if (workers->stop) {
+      return;
+    }
+    auto hint = std::move(workers->hints.front());
+    workers->hints.pop_front();
+    workers->queued.erase(hint.leaf);
+    ++workers->busy;
+    lock.unlock();
+
+    {
+      auto *key = hint.key.data();
+      auto key_size = static_cast<uint16_t>(hint.key.size());
+      EpochScope guard(GetPMWCASPool()->GetEpoch());
+      stack.Clear();
+      LeafNode *node = TraverseToLeaf(&stack, key, key_size);
+      if (hint.merge) {
+        node->CheckMerge(&stack, key, key_size, true);
+        CountStat(kStatBackgroundSMOs);
+      } else if (!node->IsFrozen() &&
+                 LeafNode::GetUsedSpace(node->GetHeader()->GetStatus()) >=
+                     maintenance_threshold) {
+        // Still needed, i.e., not split by a user thread in the meantime
+        uint64_t freeze_retry = 0;
+        SplitOrConsolidate(&stack, node, ReturnCode::NotEnoughSpace(), &freeze_retry);
+        CountStat(kStatBackgroundSMOs);
+      }
+    }
+
+    lock.lock();
+    if (--workers->busy == 0 && workers->hints.empty()) {
+      workers->idle.notify_all();
+    }
+  }
+}
+
+ChangeFeed::Ring::Ring(uint32_t size)
+    : cells(new Cell[size]), mask(size - 1), tail(0), head(0) {
+  for (uint32_t i = 0; i < size; ++i) {
+    cells[i].turn.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool ChangeFeed::Ring::Push(Change *change) {
+  uint64_t pos = tail.load(std::memory_order_relaxed);
+  Cell *cell;
+  while (true) {
+    cell = &cells[pos & mask];
+    auto diff = static_cast<int64_t>(cell->turn.load(std::memory_order_acquire) - pos);
+    if (diff == 0) {
+      if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Still holds the change from the lap before
+      return false;
+    } else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+  cell->change = std::move(*change);
+  cell->turn.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool ChangeFeed::Ring::Pop(Change *change) {
+  uint64_t pos = head.load(std::memory_order_relaxed);
+  Cell *cell;
+  while (true) {
+    cell = &cells[pos & mask];
+    auto diff = static_cast<int64_t>(cell->turn.load(std::memory_order_acquire) - (pos + 1));
+    if (diff == 0) {
+      if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = head.load(std::memory_order_relaxed);
+    }
+  }
+  *change = std::move(cell->change);
+  cell->turn.store(pos + mask + 1, std::memory_order_release);
+  return true;
+}
+
+ChangeFeed::ChangeFeed(uint32_t ring_size) : sequence(0), dropped(0) {
+  this->ring_size = 1;
+  while (this->ring_size < ring_size) {
+    this->ring_size <<= 1;
+  }
+  for (auto &ring : rings) {
+    ring.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+ChangeFeed::~ChangeFeed() {
+  for (auto &ring : rings) {
+    delete ring.load();
+  }
+}
+
+uint32_t ChangeFeed::GetRingIndex() {
+  static std::atomic<uint32_t> next_ring{0};
+  thread_local uint32_t ring = next_ring.fetch_add(1) % kRings;
+  return ring;
+}
+
+void ChangeFeed::Append(Op op, const char *key, uint16_t key_size, uint64_t payload,
+                        const char *value, uint32_t value_size) {
+  auto &slot = rings[GetRingIndex()];
+  Ring *ring = slot.load(std::memory_order_acquire);
+  if (!ring) {
+    auto *new_ring = new Ring(ring_size);
+    if (slot.compare_exchange_strong(ring, new_ring)) {
+      ring = new_ring;
+    } else {
+      delete new_ring;
+    }
+  }
+  Change change;
+  change.sequence = sequence.fetch_add(1, std::memory_order_relaxed);
+  change.op = op;
+  change.key.assign(key, key_size);
+  change.payload = payload;
+  if (value) {
+    change.value.assign(value, value_size);
+  }
+  if (!ring->Push(&change)) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+uint32_t ChangeFeed::Drain(std::vector<Change> *changes, uint32_t max) {
+  auto first = changes->size();
+  uint32_t drained = 0;
+  Change change;
+  for (auto &slot : rings) {
+    auto *ring = slot.load(std::memory_order_acquire);
+    while (ring && drained < max && ring->Pop(&change)) {
+      changes->emplace_back(std::move(change));
+      ++drained;
+    }
+  }
+  std::sort(changes->begin() + first, changes->end(),
+            [](const Change &a, const Change &b) { return a.sequence < b.sequence; });
+  return drained;
+}
+
+HotnessTable::HotnessTable() : samples(0), sampling(1) {
+  for (auto &entry : entries) {
+    entry.leaf.store(0, std::memory_order_relaxed);
+    entry.count.store(0, std::memory_order_relaxed);
+  }
+}
+
+void HotnessTable::Sample(const void *leaf) {
+  auto &entry = entries[GetIndex(leaf)];
+  auto addr = reinterpret_cast<uint64_t>(leaf);
+  if (entry.leaf.load(std::memory_order_relaxed) == addr) {
+    entry.count.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    uint64_t count = entry.count.load(std::memory_order_relaxed);
+    if (count == 0) {
+      entry.leaf.store(addr, std::memory_order_relaxed);
+      entry.count.store(1, std::memory_order_relaxed);
+    } else {
+      entry.count.compare_exchange_weak(count, count - 1, std::memory_order_relaxed);
+    }
+  }
+  if (samples.fetch_add(1, std::memory_order_relaxed) % kDecayPeriod == kDecayPeriod - 1) {
+    for (auto &decayed : entries) {
+      decayed.count.store(decayed.count.load(std::memory_order_relaxed) / 2,
+                          std::memory_order_relaxed);
+    }
+  }
+}
+
+uint64_t HotnessTable::Get(const void *leaf) {
+  auto &entry = entries[GetIndex(leaf)];
+  uint64_t count = entry.count.load(std::memory_order_relaxed);
+  return entry.leaf.load(std::memory_order_relaxed) == reinterpret_cast<uint64_t>(leaf) ?
+         count : 0;
+}
+
+void HotnessTable::Inherit(const void *leaf, const void *replacement, uint32_t shift) {
+  uint64_t count = Get(leaf) >> shift;
+  auto &entry = entries[GetIndex(replacement)];
+  if (count > entry.count.load(std::memory_order_relaxed)) {
+    entry.leaf.store(reinterpret_cast<uint64_t>(replacement), std::memory_order_relaxed);
+    entry.count.store(count, std::memory_order_relaxed);
+  }
+}
+
+void BzTree::EnableHotnessTracking(bool enable, uint32_t sample_shift) {
+  if (enable && !hotness.load()) {
+    auto *table = new HotnessTable();
+    HotnessTable *expected = nullptr;
+    if (!hotness.compare_exchange_strong(expected, table)) {
+      delete table;
+    }
+  }
+  if (enable) {
+    hotness.load()->SetSampling(1u << sample_shift);
+  }
+  hotness_sampling = enable ? 1u << sample_shift : 0;
+}
+
+uint64_t BzTree::GetLeafHotness(LeafNode *leaf) {
+  auto *table = hotness.load(std::memory_order_relaxed);
+  return table ? table->GetAccesses(leaf) : 0;
+}
+
+void BzTree::InheritHotness(LeafNode *leaf, uint64_t replacement, uint32_t shift) {
+  auto *table = hotness.load(std::memory_order_relaxed);
+  if (!table) {
+    return;
+  }
+#ifdef PMDK
+  auto *direct = Allocator::Get()->GetDirect(reinterpret_cast<LeafNode *>(replacement));
+#else
+  auto *direct = reinterpret_cast<LeafNode *>(replacement);
+#endif
+  table->Inherit(leaf, direct, shift);
+}
+
+void BzTree::EnableChangeFeed(uint32_t ring_size) {
+  if (change_feed.load()) {
+    return;
+  }
+  auto *feed = new ChangeFeed(ring_size);
+  ChangeFeed *expected = nullptr;
+  if (!change_feed.compare_exchange_strong(expected, feed)) {
+    delete feed;
+  }
+}
+
+void BzTree::DisableChangeFeed() {
+  auto *feed = change_feed.exchange(nullptr);
+  if (feed) {
+    // Writers publish inside their epoch
+    WaitForEpoch();
+    delete feed;
+  }
+}
+
+std::vector<BzTree::HotRange> BzTree::GetHotRanges(uint32_t k) {
+  std::vector<HotRange> ranges;
+  auto *table = hotness.load(std::memory_order_relaxed);
+  if (!table || k == 0) {
+    return ranges;
+  }
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  Stack stack;
+  stack.tree = this;
+  CollectHotRanges(GetRootNodeSafe(), &stack, table, &ranges);
+  auto hotter = [](const HotRange &a, const HotRange &b) { return a.accesses > b.accesses; };
+  if (ranges.size() > k) {
+    std::partial_sort(ranges.begin(), ranges.begin() + k, ranges.end(), hotter);
+    ranges.resize(k);
+  } else {
+    std::sort(ranges.begin(), ranges.end(), hotter);
+  }
+  return ranges;
+}
+
+void BzTree::CollectHotRanges(BaseNode *node, Stack *stack, HotnessTable *table,
+                              std::vector<HotRange> *ranges) {
+  if (!node->IsLeaf()) {
+    auto *internal = reinterpret_cast<InternalNode *>(node);
+    for (uint32_t i = 0; i < internal->GetHeader()->sorted_count; ++i) {
+      // Evicted leaves are cold by definition
+      if (internal->IsChildEvicted(i, GetPMWCASPool()->GetEpoch())) {
+        continue;
+      }
+      stack->Push(internal, i);
+      CollectHotRanges(internal->GetChildByMetaIndex(i, GetPMWCASPool()->GetEpoch()), stack,
+                       table, ranges);
+      stack->Pop();
+    }
+    return;
+  }
+  HotRange range;
+  range.accesses = table->GetAccesses(node);
+  if (range.accesses == 0) {
+    return;
+  }
+  const char *key = nullptr;
+  uint32_t key_size = 0;
+  if (GetLeafLowerBound(stack, &key, &key_size)) {
+    range.lo.assign(key, key_size);
+  }
+  if (GetLeafUpperBound(stack, &key, &key_size)) {
+    range.hi.assign(key, key_size);
+  }
+  ranges->emplace_back(std::move(range));
+}
+
+void BzTree::EnableLatencyHistograms(bool enable) {
+  if (enable && !latency_slots.load()) {
+    auto *slots = new LatencySnapshot[kLatencySlots];
+    LatencySnapshot *expected = nullptr;
+    if (!latency_slots.compare_exchange_strong(expected, slots)) {
+      delete[] slots;
+    }
+  }
+  latency_enabled = enable;
+}
+
+#ifdef PMEM
+BzTree::RecoveryTimes BzTree::Recovery(bool recover_pool) {
+  RecoveryTimes times;
+  auto start = std::chrono::steady_clock::now();
+  index_epoch += 1;
+  // avoid multiple increment if there are multiple bztrees
+  if (global_epoch != index_epoch) {
+    global_epoch = index_epoch;
+  }
+  pmwcas::DescriptorPool *pool = GetPMWCASPool();
+  if (recover_pool) {
+    pool->Recovery(false);
+  }
+  auto replayed = std::chrono::steady_clock::now();
+  times.descriptor_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(replayed - start).count();
+
+  // The garbage list is volatile and the old one is gone with the crash;
+  // nodes pending reclamation at crash time are leaked.
+  InitGarbageList();
+  retired_bytes = 0;
+  reclaimed_bytes = 0;
+  retired_internal_nodes = 0;
+  AllocateStats();
+  latency_slots = nullptr;
+  latency_enabled = false;
+  hotness = nullptr;
+  hotness_sampling = 0;
+  leaf_store = nullptr;
+  change_feed = nullptr;
+  single_word_update = false;
+  narrow_prefetch = false;
+  // The workers and snapshots went away with the crash, and so did the DRAM
+  // copies of internal nodes. Copy pointers made [kCopyTagMask] + 1 restarts
+  // ago would look current again from now on, so clear them all.
+  maintenance = nullptr;
+  internal_node_cache = false;
+  internal_node_replicas = false;
+  ResetSnapshots();
+  if ((index_epoch & kCopyTagMask) == 0) {
+    EpochScope guard(pool->GetEpoch());
+    BaseNode *root_node = GetRootNodeSafe();
+    if (!root_node->IsLeaf()) {
+      DropInternalNodeCopies(reinterpret_cast<InternalNode *>(root_node), false);
+    }
+  }
+  // Cached counts were adjusted without persisting them, so what's in PMEM
+  // may be off by writes of before the crash
+  if (parameters.record_counts) {
+    EpochScope guard(pool->GetEpoch());
+    BaseNode *root_node = GetRootNodeSafe();
+    if (!root_node->IsLeaf()) {
+      ClearRecordEstimates(reinterpret_cast<InternalNode *>(root_node));
+    }
+  }
+
+  pmwcas::NVRAM::Flush(sizeof(bztree::BzTree), this);
+  times.tree_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - replayed).count();
+  return times;
+}
+#endif
+
+// Read a byte of every [stride] bytes of [size] at [addr], to fault or cache
+// them in
+static void TouchBytes(uint64_t addr, uint64_t size, uint64_t stride) {
+  for (uint64_t offset = 0; offset < size; offset += stride) {
+    (void)*reinterpret_cast<volatile const char *>(addr + offset);
+  }
+}
+
+uint64_t BzTree::PrefaultMapping(uint64_t addr, uint32_t threads) {
+  // The pool may show as several mappings of the same file back to back
+  struct Mapping {
+    uint64_t lo;
+    uint64_t hi;
+    bool readable;
+    std::string path;
+  };
+  std::vector<Mapping> mappings;
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (!maps) {
+    return 0;
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), maps)) {
+    Mapping mapping;
+    char perms[8] = {};
+    int path_at = 0;
+    if (sscanf(line, "%lx-%lx %7s %*s %*s %*s %n", &mapping.lo, &mapping.hi, perms,
+               &path_at) < 3) {
+      continue;
+    }
+    mapping.readable = perms[0] == 'r';
+    mapping.path.assign(line + path_at);
+    mappings.emplace_back(std::move(mapping));
+  }
+  fclose(maps);
+  uint32_t first = 0;
+  while (first < mappings.size() && !(mappings[first].lo <= addr && addr < mappings[first].hi)) {
+    ++first;
+  }
+  if (first == mappings.size()) {
+    return 0;
+  }
+  uint32_t last = first;
+  auto same = [&](uint32_t a, uint32_t b) {
+    return mappings[a].hi == mappings[b].lo && mappings[a].path == mappings[b].path;
+  };
+  while (first > 0 && same(first - 1, first)) {
+    --first;
+  }
+  while (last + 1 < mappings.size() && same(last, last + 1)) {
+    ++last;
+  }
+
+  // Each thread reads a byte of every page in a slice of its own
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t bytes = 0;
+  for (uint32_t m = first; m <= last; ++m) {
+    auto &mapping = mappings[m];
+    if (!mapping.readable) {
+      continue;
+    }
+    uint64_t size = mapping.hi - mapping.lo;
+    bytes += size;
+    madvise(reinterpret_cast<void *>(mapping.lo), size, MADV_WILLNEED);
+    uint64_t pages = size / page;
+    auto touch = [&](uint32_t thread) {
+      uint64_t from = pages * thread / threads;
+      uint64_t to = pages * (thread + 1) / threads;
+      TouchBytes(mapping.lo + from * page, (to - from) * page, page);
+    };
+    std::vector<std::thread> workers;
+    for (uint32_t t = 1; t < threads; ++t) {
+      workers.emplace_back(touch, t);
+    }
+    touch(0);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+  return bytes;
+}
+
+BzTree::WarmUpStats BzTree::WarmUp(uint32_t threads, bool prefault, bool leaves) {
+  threads = std::max<uint32_t>(threads, 1);
+  WarmUpStats stats;
+  memset(&stats, 0, sizeof(stats));
+  auto start = std::chrono::steady_clock::now();
+  if (prefault && pmdk_addr) {
+    stats.prefaulted_bytes = PrefaultMapping(pmdk_addr, threads);
+  }
+  auto prefaulted = std::chrono::steady_clock::now();
+  stats.prefault_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(prefaulted - start).count();
+
+  // The nodes handed to the workers stay around as long as this thread
+  // holds its epoch
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  EpochScope guard(epoch);
+  std::vector<BaseNode *> level{GetRootNodeSafe()};
+  // Leaves are all as deep, the height is that of the leftmost one
+  uint32_t height = 1;
+  for (auto *node = level[0]; !node->IsLeaf(); ++height) {
+    auto *internal = reinterpret_cast<InternalNode *>(node);
+    if (internal->IsChildEvicted(0, epoch)) {
+      ++height;
+      break;
+    }
+    node = internal->GetChildByMetaIndex(0, epoch);
+  }
+
+  std::atomic<uint64_t> internal_nodes{0};
+  std::atomic<uint64_t> leaf_nodes{0};
+  std::vector<std::vector<BaseNode *>> next_level(threads);
+  for (uint32_t depth = 0; !level.empty(); ++depth) {
+    bool collect = leaves || depth + 2 < height;
+    std::atomic<size_t> next{0};
+    auto warm = [&](uint32_t thread) {
+      EpochScope worker_guard(epoch);
+      for (size_t n = next++; n < level.size(); n = next++) {
+        auto *node = level[n];
+        TouchBytes(reinterpret_cast<uint64_t>(node), node->GetHeader()->size,
+                   PersistBatch::kCacheLineSize);
+        if (node->IsLeaf()) {
+          ++leaf_nodes;
+          continue;
+        }
+        ++internal_nodes;
+        auto *internal = reinterpret_cast<InternalNode *>(node);
+        GetSearchNode(internal);
+        if (!collect) {
+          continue;
+        }
+        uint32_t count = internal->GetHeader()->sorted_count;
+        for (uint32_t i = 0; i < count; ++i) {
+          if (!internal->IsChildEvicted(i, epoch)) {
+            next_level[thread].emplace_back(internal->GetChildByMetaIndex(i, epoch));
+          }
+        }
+      }
+    };
+    std::vector<std::thread> workers;
+    for (uint32_t t = 1; t < threads; ++t) {
+      workers.emplace_back(warm, t);
+    }
+    warm(0);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    level.clear();
+    for (auto &nodes : next_level) {
+      level.insert(level.end(), nodes.begin(), nodes.end());
+      nodes.clear();
+    }
+  }
+  stats.internal_nodes = internal_nodes;
+  stats.leaves = leaf_nodes;
+  stats.walk_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - prefaulted).count();
+  return stats;
+}
+
+void BzTree::EnableInternalNodeCache(bool enable, bool per_socket) {
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  BaseNode *root_node = GetRootNodeSafe();
+  if (enable && internal_node_cache && internal_node_replicas != per_socket) {
+    // Copies of the other kind can't be told apart from their pointers
+    if (internal_node_cache.exchange(false) && !root_node->IsLeaf()) {
+      DropInternalNodeCopies(reinterpret_cast<InternalNode *>(root_node), true);
+    }
+  }
+  if (enable) {
+    internal_node_replicas = per_socket;
+    internal_node_cache = true;
+    // Copy the nodes already in the tree rather than on first use, one level
+    // at a time. All children of a node are of the same kind, so only the
+    // first one of each node on the lowest internal level is looked at.
+    std::vector<InternalNode *> nodes;
+    if (!root_node->IsLeaf()) {
+      nodes.push_back(reinterpret_cast<InternalNode *>(root_node));
+    }
+    while (!nodes.empty()) {
+      std::vector<InternalNode *> children;
+      for (auto *node : nodes) {
+        GetSearchNode(node);
+        if (node->GetChildByMetaIndex(0, GetPMWCASPool()->GetEpoch())->IsLeaf()) {
+          continue;
+        }
+        for (uint32_t i = 0; i < node->GetHeader()->sorted_count; ++i) {
+          children.push_back(reinterpret_cast<InternalNode *>(
+              node->GetChildByMetaIndex(i, GetPMWCASPool()->GetEpoch())));
+        }
+      }
+      nodes.swap(children);
+    }
+  } else if (internal_node_cache.exchange(false) && !root_node->IsLeaf()) {
+    DropInternalNodeCopies(reinterpret_cast<InternalNode *>(root_node), true);
+  }
+}
+
+InternalNode *BzTree::CopyInternalNode(InternalNode *node, uint64_t word) {
+  // DRAM even under PMDK, where the node allocator hands out PMEM. Child
+  // pointers in the copy are never read: they might be stale, or PMwCAS
+  // descriptors, by the time the copy is used.
+  uint32_t size = InternalNode::GetCopySize(node->GetHeader()->size,
+                                            node->GetHeader()->sorted_count);
+  bool replicas = internal_node_replicas.load(std::memory_order_relaxed);
+  InternalNode *copy = nullptr;
+  if (replicas) {
+    uint32_t stride = GetReplicaStride(size);
+    copy = reinterpret_cast<InternalNode *>(
+        aligned_alloc(kPageSize, stride * NodeAllocator::GetNumaNodeCount()));
+  } else {
+    copy = reinterpret_cast<InternalNode *>(
+        aligned_alloc(PersistBatch::kCacheLineSize, (size + PersistBatch::kCacheLineSize - 1) &
+                                                    ~(PersistBatch::kCacheLineSize - 1)));
+  }
+  if (reinterpret_cast<uint64_t>(copy) >> kCopyTagShift) {
+    // No room for the tag, search the node itself
+    free(copy);
+    return node;
+  }
+  for (uint32_t i = 0; i < (replicas ? NodeAllocator::GetNumaNodeCount() : 1); ++i) {
+    char *replica = reinterpret_cast<char *>(copy) + i * GetReplicaStride(size);
+    if (replicas) {
+      NodeAllocator::BindToNumaNode(replica, GetReplicaStride(size), i);
+    }
+    memcpy(replica, node, node->GetHeader()->size);
+    reinterpret_cast<InternalNode *>(replica)->BuildKeyHeads();
+  }
+  if (!reinterpret_cast<std::atomic<uint64_t> *>(&node->GetHeader()->dram_copy)
+           ->compare_exchange_strong(word, reinterpret_cast<uint64_t>(copy) | GetCopyTag())) {
+    free(copy);
+    auto *installed = GetInternalNodeCopy(word);
+    return installed ? installed : node;
+  }
+  CountStat(kStatInternalNodeCopies);
+  return copy;
+}
+
+void BzTree::DropInternalNodeCopies(InternalNode *node, bool free_copies) {
+  // Only leaves are evicted, and loading them might not be possible yet
+  // (during recovery)
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  if (!node->IsChildEvicted(0, epoch) && !node->GetChildByMetaIndex(0, epoch)->IsLeaf()) {
+    for (uint32_t i = 0; i < node->GetHeader()->sorted_count; ++i) {
+      DropInternalNodeCopies(reinterpret_cast<InternalNode *>(
+          node->GetChildByMetaIndex(i, GetPMWCASPool()->GetEpoch())), free_copies);
+    }
+  }
+  if (free_copies) {
+    free(GetInternalNodeCopy(node->GetHeader()->dram_copy));
+  }
+  node->GetHeader()->dram_copy = 0;
+}
+
+void BzTree::GetLatencyHistograms(LatencySnapshot *snapshot) {
+  auto *slots = latency_slots.load(std::memory_order_acquire);
+  if (!slots) {
+    return;
+  }
+  for (uint32_t i = 0; i < kLatencySlots; ++i) {
+    for (uint32_t op = 0; op < kLatencyOps; ++op) {
+      snapshot->fast[op].Merge(slots[i].fast[op]);
+      snapshot->smo[op].Merge(slots[i].smo[op]);
+    }
+  }
+}
+
+void BzTree::DumpLatencyHistograms() {
+  static const char *kOpNames[kLatencyOps] = {
+      "insert", "read", "update", "upsert", "delete", "scan"};
+  LatencySnapshot snapshot;
+  GetLatencyHistograms(&snapshot);
+  for (uint32_t op = 0; op < kLatencyOps; ++op) {
+    for (auto *histogram : {&snapshot.fast[op], &snapshot.smo[op]}) {
+      if (histogram->GetCount() == 0) {
+        continue;
+      }
+      std::cout << kOpNames[op] << (histogram == &snapshot.fast[op] ? " (fast)" : " (smo)")
+                << ": count = " << histogram->GetCount()
+                << ", p50 = " << histogram->GetPercentile(50)
+                << " ns, p90 = " << histogram->GetPercentile(90)
+                << " ns, p99 = " << histogram->GetPercentile(99)
+                << " ns, p99.9 = " << histogram->GetPercentile(99.9)
+                << " ns, max = " << histogram->GetPercentile(100) << " ns" << std::endl;
+    }
+  }
+}
+
+BzTree::Stats BzTree::GetStats() {
+  uint64_t totals[kStatCounters] = {};
+  for (uint32_t slot = 0; slot < kStatsSlots; ++slot) {
+    for (uint32_t i = 0; i < kStatCounters; ++i) {
+      totals[i] += stats_slots[slot].counters[i].load(std::memory_order_relaxed);
+    }
+  }
+  Stats stats;
+  stats.leaf_splits = totals[kStatLeafSplits];
+  stats.internal_splits = totals[kStatInternalSplits];
+  stats.consolidations = totals[kStatConsolidations];
+  stats.merges = totals[kStatMerges];
+  stats.smo_failures = totals[kStatSMOFailures];
+  stats.freeze_retries = totals[kStatFreezeRetries];
+  stats.pmwcas_failures = totals[kStatPMwCASFailures];
+  stats.unique_waits = totals[kStatUniqueWaits];
+  stats.smo_helps = totals[kStatSMOHelps];
+  stats.background_smos = totals[kStatBackgroundSMOs];
+  stats.dropped_leaves = totals[kStatDroppedLeaves];
+  stats.internal_node_copies = totals[kStatInternalNodeCopies];
+  stats.leaf_evictions = totals[kStatLeafEvictions];
+  stats.leaf_loads = totals[kStatLeafLoads];
+  stats.descriptor_allocations = totals[kStatDescriptorAllocations];
+  stats.slow_descriptor_allocations = totals[kStatSlowDescriptorAllocations];
+  stats.descriptor_aborts = totals[kStatDescriptorAborts];
+  return stats;
+}
+
+void BzTree::TraverseToLeaves(const char *const *keys, const uint16_t *key_sizes,
+                              uint32_t count, LeafNode **leaves) {
+  static const uint32_t kCacheLineSize = 64;
+  // The header and the first metadata entries, which the binary search starts
+  // from; leaves aren't prefetched whole as that would saturate the memory
+  // system with all keys in flight
+  static const uint32_t kPrefetchLines = 4;
+  BaseNode *root_node = GetRootNodeSafe();
+  CollectPendingStats();
+  pmwcas_failure_streak = 0;
+  auto **nodes = reinterpret_cast<BaseNode **>(leaves);
+  for (uint32_t i = 0; i < count; ++i) {
+    nodes[i] = root_node;
+  }
+
+  // Move all keys down one level per round. Keys that share a node (likely if
+  // they are sorted) only prefetch it once.
+  bool descended = !root_node->IsLeaf();
+  while (descended) {
+    descended = false;
+    BaseNode *last_child = nullptr;
+    for (uint32_t i = 0; i < count; ++i) {
+      if (nodes[i]->IsLeaf()) {
+        continue;
+      }
+      auto *parent = reinterpret_cast<InternalNode *>(nodes[i]);
+      auto meta_index = GetSearchNode(parent)->GetChildIndex(keys[i], key_sizes[i], true);
+      nodes[i] = parent->GetChildByMetaIndex(meta_index, GetPMWCASPool()->GetEpoch());
+      if (nodes[i] != last_child) {
+        last_child = nodes[i];
+        for (uint32_t j = 0; j < kPrefetchLines; ++j) {
+          __builtin_prefetch((const void *) ((char *) last_child + j * kCacheLineSize), 0, 3);
+        }
+      }
+      descended = true;
+    }
+  }
+}
+
+LeafNode *BzTree::TraverseToSibling(Stack *stack, bool left, bool frozen_ok) {
+  uint32_t level = stack->num_frames;
+  while (level > 0) {
+    auto &frame = stack->frames[level - 1];
+    if (left ? frame.meta_index > 0
+             : frame.meta_index + 1 < frame.node->GetHeader()->sorted_count) {
+      break;
+    }
+    --level;
+  }
+  if (level == 0 || (!frozen_ok && stack->frames[level - 1].node->IsFrozen())) {
+    return nullptr;
+  }
+
+  stack->num_frames = level;
+  auto &frame = stack->frames[level - 1];
+  frame.meta_index += left ? -1 : 1;
+  BaseNode *node = frame.node->GetChildByMetaIndex(frame.meta_index, GetPMWCASPool()->GetEpoch());
+  while (!node->IsLeaf()) {
+    auto *parent = reinterpret_cast<InternalNode *>(node);
+    uint32_t meta_index = left ? parent->GetHeader()->sorted_count - 1 : 0;
+    stack->Push(parent, meta_index);
+    node = parent->GetChildByMetaIndex(meta_index, GetPMWCASPool()->GetEpoch());
+  }
+  PrefetchNode(node);
+  return reinterpret_cast<LeafNode *>(node);
+}
+
+LeafNode *BzTree::NextLeafOfKey(Stack *stack, const char *key, uint16_t key_size) {
+  const char *upper = nullptr;
+  uint32_t upper_size = 0;
+  if (!parameters.duplicate_keys || !GetLeafUpperBound(stack, &upper, &upper_size) ||
+      BaseNode::KeyCompare(upper, upper_size, key, key_size) != 0) {
+    return nullptr;
+  }
+  return TraverseToSibling(stack, false, true);
+}
+
+LeafNode *BzTree::FindLeafOfKey(Stack *stack, const char *key, uint16_t key_size,
+                                LeafNode *node) {
+  uint64_t payload = 0;
+  while (parameters.duplicate_keys &&
+         node->Read(key, key_size, &payload, GetPMWCASPool()).IsNotFound()) {
+    LeafNode *next = NextLeafOfKey(stack, key, key_size);
+    if (!next) {
+      break;
+    }
+    node = next;
+  }
+  return node;
+}
+
+LeafNode *BzTree::TraverseToRunLeaf(Stack *stack, const char *key, uint16_t key_size,
+                                    uint32_t skip, bool left) {
+  stack->Clear();
+  LeafNode *node = TraverseToLeaf(stack, key, key_size, !left);
+  for (; node && skip > 0; --skip) {
+    const char *bound = nullptr;
+    uint32_t bound_size = 0;
+    if (!(left ? GetLeafLowerBound(stack, &bound, &bound_size)
+               : GetLeafUpperBound(stack, &bound, &bound_size)) ||
+        BaseNode::KeyCompare(bound, bound_size, key, key_size) != 0) {
+      break;
+    }
+    node = TraverseToSibling(stack, left);
+  }
+  return node;
+}
+
+template <class KeyPolicy>
+LeafNode *BzTree::TraverseToLeaf(Stack *stack, const char *key,
+                                 uint16_t key_size,
+                                 bool le_child) {
+  PERF_PHASE(kTraverse);
+  BaseNode *node = GetRootNodeSafe();
+  bool narrow = narrow_prefetch.load(std::memory_order_relaxed);
+  PrefetchNode(node, narrow);
+  CollectPendingStats();
+  pmwcas_failure_streak = 0;
+
+  if (stack) {
+    stack->SetRoot(node);
+  }
+  InternalNode *parent = nullptr;
+  uint32_t meta_index = 0;
+  assert(node);
+  while (!node->IsLeaf()) {
+    parent = reinterpret_cast<InternalNode *>(node);
+    meta_index = key ? GetSearchNode(parent)->GetChildIndex<KeyPolicy>(key, key_size, le_child)
+                     : parent->GetHeader()->sorted_count - 1;
+    node = parent->GetChildByMetaIndex(meta_index, GetPMWCASPool()->GetEpoch());
+    assert(node);
+    PrefetchNode(node, narrow);
+    if (stack != nullptr) {
+      stack->Push(parent, meta_index);
+    }
+  }
+  SampleLeafAccess(reinterpret_cast<LeafNode *>(node));
+  return reinterpret_cast<LeafNode *>(node);
+}
+
+template LeafNode *BzTree::TraverseToLeaf<VarKeyPolicy>(Stack *, const char *, uint16_t, bool);
+template LeafNode *BzTree::TraverseToLeaf<U64KeyPolicy>(Stack *, const char *, uint16_t, bool);
+
+ReturnCode BzTree::Insert(const char *key, uint16_t key_size, uint64_t payload) {
+  thread_local Stack stack;
+  stack.tree = this;
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  return InsertProtected(&stack, key, key_size, payload);
+}
+
+ReturnCode BzTree::Insert(Session *session, const char *key, uint16_t key_size,
+                          uint64_t payload) {
+  ++session->operations[kOpInsert];
+  return InsertProtected(&session->stack, key, key_size, payload, session);
+}
+
+ReturnCode BzTree::InsertProtected(Stack *stack, const char *key, uint16_t key_size,
+                                   uint64_t payload, Session *session) {
+  LatencyTimer timer(this, BzTree::kOpInsert);
+  uint64_t freeze_retry = 0;
+
+  while (true) {
+    LeafNode *node = TraverseFromFinger(stack, session, key, key_size);
+    VersionWriter versions(this);
+
+    // Try to insert to the leaf node
+    auto rc = node->Insert(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold,
+                           versions.Get(), !parameters.duplicate_keys);
+    if (rc.IsOk() || rc.IsKeyExists()) {
+      if (rc.IsOk()) {
+        PublishChange(ChangeFeed::kInsert, key, key_size, payload);
+      }
+      HintFullLeaf(node, key, key_size);
+      KeepLeafSorted(stack, node);
+      return rc;
+    }
+    SplitOrConsolidate(stack, node, rc, &freeze_retry);
+  }
+}
+
+LeafNode *BzTree::TraverseFromFinger(Stack *stack, Session *session, const char *key,
+                                     uint16_t key_size) {
+  if (session && session->finger_search && session->finger && !session->finger->IsFrozen()) {
+    // A leaf holds keys larger than its lower bound and up to its upper bound
+    const char *bound = nullptr;
+    uint32_t bound_size = 0;
+    auto *path = &session->finger_path;
+    if ((!GetLeafLowerBound(path, &bound, &bound_size) ||
+         BaseNode::KeyCompare(key, key_size, bound, bound_size) > 0) &&
+        (!GetLeafUpperBound(path, &bound, &bound_size) ||
+         BaseNode::KeyCompare(key, key_size, bound, bound_size) <= 0)) {
+      // What TraverseToLeaf does besides traversing
+      CollectPendingStats();
+      pmwcas_failure_streak = 0;
+      SampleLeafAccess(session->finger);
+      // The operation may change [stack], e.g., when splitting the leaf
+      stack->CopyFrom(*path);
+      ++session->finger_hits;
+      return session->finger;
+    }
+  }
+  stack->Clear();
+  LeafNode *node = TraverseToLeaf(stack, key, key_size);
+  if (session && session->finger_search) {
+    session->finger = node;
+    session->finger_path.CopyFrom(*stack);
+  }
+  return node;
+}
+
+ReturnCode BzTree::Insert(const char *key, uint16_t key_size, const char *payload,
+                          uint32_t payload_size) {
+  LatencyTimer timer(this, BzTree::kOpInsert);
+  if (RecordMetadata::PadKeyLength(key_size) + payload_size > GetMaxRecordSize()) {
+    return ReturnCode::NotEnoughSpace();
+  }
+  thread_local Stack stack;
+  stack.tree = this;
+  uint64_t freeze_retry = 0;
+
+  while (true) {
+    stack.Clear();
+    EpochScope guard(GetPMWCASPool()->GetEpoch());
+    LeafNode *node = TraverseToLeaf(&stack, key, key_size);
+    VersionWriter versions(this);
+
+    auto rc = node->Insert(key, key_size, payload, payload_size, GetPMWCASPool(),
+                           parameters.split_threshold, versions.Get(),
+                           !parameters.duplicate_keys);
+    if (rc.IsOk() || rc.IsKeyExists()) {
+      if (rc.IsOk()) {
+        PublishChange(ChangeFeed::kInsert, key, key_size, 0, payload, payload_size);
+      }
+      HintFullLeaf(node, key, key_size);
+      KeepLeafSorted(&stack, node);
+      return rc;
+    }
+    SplitOrConsolidate(&stack, node, rc, &freeze_retry);
+  }
+}
+
+bool BzTree::WaitForReplacement(Stack *stack, LeafNode *node) {
+  auto *top = stack->Top();
+#ifdef PMDK
+  uint64_t node_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(node));
+#else
+  uint64_t node_addr = reinterpret_cast<uint64_t>(node);
+#endif
+  // Past this round pauses are as long as they get
+  static const uint32_t kYieldAfter =
+      2 + __builtin_ctz(ContentionManager::kMaxPauses / ContentionManager::kMinPauses);
+  for (uint32_t round = 1; round <= ContentionManager::kMaxWaits; ++round) {
+    // Only reads, the lines stay shared until the new node goes in
+    bool replaced = top ? top->node->IsFrozen() || !top->node->HasChild(top->meta_index, node_addr)
+                        : GetRootNodeSafe() != node;
+    if (replaced) {
+      return true;
+    }
+    if (round < kYieldAfter) {
+      ContentionManager::Pause(round);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  return false;
+}
+
+void BzTree::SplitOrConsolidate(Stack *stack, LeafNode *node, ReturnCode rc,
+                                uint64_t *freeze_retry, bool wait) {
+  assert(rc.IsNotEnoughSpace() || rc.IsNodeFrozen());
+  ++smo_attempts;
+  bool frozen_by_me = false;
+  if (!rc.IsNodeFrozen()) {
+    uint32_t attempt = 0;
+    while (!node->IsFrozen()) {
+      frozen_by_me = node->Freeze(GetPMWCASPool());
+      if (!frozen_by_me && !node->IsFrozen()) {
+        ContentionManager::Pause(++attempt);
+      }
+    }
+  }
+
+  // Give whoever froze the node the chance to finish the job, unless helping
+  auto policy = ContentionManager::GetPolicy();
+  bool helping = (policy == ContentionManager::kHelp);
+  if (!frozen_by_me && !helping && ++*freeze_retry <= MAX_FREEZE_RETRY) {
+    CountStat(kStatFreezeRetries);
+    if (policy == ContentionManager::kSpin || !wait || WaitForReplacement(stack, node)) {
+      return;
+    }
+    // Taking too long, the freezer might not even be running
+    CountStat(kStatSMOHelps);
+    helping = true;
+  }
+
+  bool backoff = !helping && (*freeze_retry <= MAX_FREEZE_RETRY);
+
+  // A packed leaf (see PackColdLeaves) is written again, make it a full-sized
+  // one; it holds less than that anyway
+  if (node->GetHeader()->size < parameters.leaf_node_size) {
+    ConsolidateLeaf(stack, node, nullptr, 0, nullptr, 0, parameters.leaf_node_size);
+    return;
+  }
+
+  // See if it's enough to consolidate the node, i.e., most of the space is
+  // taken by deleted records: swap in a consolidated copy of the node and
+  // retry, no need to touch the nodes above the parent.
+  if (node->ShouldConsolidate(parameters.consolidate_threshold)) {
+    ConsolidateLeaf(stack, node);
+    return;
+  }
+
+  // Should split and we have three cases to handle:
+  // 1. Root node is a leaf node - install [parent] as the new root
+  // 2. We have a parent but no grandparent - install [parent] as the new
+  //    root
+  // 3. We have a grandparent - update the child pointer in the grandparent
+  //    to point to the new [parent] (might further cause splits up the tree)
+
+  // New nodes are allocated through the descriptor and freed by PMwCAS if
+  // the split is aborted or fails to install
+  auto *pd = NewDescriptor(GetPMWCASPool(), true);
+  pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                         reinterpret_cast<uint64_t>(nullptr),
+                         pmwcas::Descriptor::kRecycleNewOnFailure);
+  pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                         reinterpret_cast<uint64_t>(nullptr),
+                         pmwcas::Descriptor::kRecycleNewOnFailure);
+  pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                         reinterpret_cast<uint64_t>(nullptr),
+                         pmwcas::Descriptor::kRecycleNewOnFailure);
+  uint64_t *ptr_r = pd->GetNewValuePtr(0);
+  uint64_t *ptr_l = pd->GetNewValuePtr(1);
+  uint64_t *ptr_parent = pd->GetNewValuePtr(2);
+
+  // Note that when we split internal nodes (if needed), stack will get
+  // Pop()'ed recursively, leaving the grantparent as the top (if any) here.
+  // So we save the root node here in case we need to change root later.
+
+  // Now split the leaf node. PrepareForSplit will return the node that we
+  // need to install to the grandparent node (will be stack top, if any). If
+  // it turns out there is no such grandparent, we directly install the
+  // returned node as the new root.
+  //
+  // Note that in internal node's PrepareSplit if the internal node needs to
+  // split we will pop the stack along the way as the split propogates
+  // upward, such that by the time we come back here, the stack will contain
+  // on its top the "parent" node and the "grandparent" node (if any) that
+  // points to the parent node. As a result, we directly install a pointer to
+  // the new parent node returned by leaf.PrepareForSplit to the grandparent.
+  const char *lo = nullptr;
+  const char *hi = nullptr;
+  uint32_t lo_size = 0;
+  uint32_t hi_size = 0;
+  if (parameters.prefix_compression) {
+    GetLeafLowerBound(stack, &lo, &lo_size);
+    GetLeafUpperBound(stack, &hi, &hi_size);
+  }
+  uint32_t frames_before_split = stack->num_frames;
+  bool should_proceed = node->PrepareForSplit(*stack,
+                                              parameters.internal_node_size,
+                                              pd, GetPMWCASPool(),
+                                              reinterpret_cast<LeafNode **>(ptr_l),
+                                              reinterpret_cast<LeafNode **>(ptr_r),
+                                              reinterpret_cast<InternalNode **>(ptr_parent),
+                                              backoff, lo, lo_size, hi, hi_size,
+                                              parameters.adaptive_split);
+  if (!should_proceed) {
+    AbortDescriptor(pd);
+    CountStat(kStatSMOFailures);
+    return;
+  }
+
+  assert(*ptr_parent);
+
+  // Every internal node popped during split propagation was split, and the
+  // node left on the stack top (if any) is replaced by [ptr_parent].
+  uint32_t first_replaced = stack->num_frames > 0 ? stack->num_frames - 1 : 0;
+  uint32_t internal_splits = frames_before_split - stack->num_frames;
+
+  auto *top = stack->Pop();
+  InternalNode *old_parent = nullptr;
+  if (top) {
+    old_parent = top->node;
+  }
+
+  top = stack->Pop();
+  InternalNode *grand_parent = nullptr;
+  if (top) {
+    grand_parent = top->node;
+  }
+
+  bool installed = false;
+  if (grand_parent) {
+    assert(old_parent);
+    // There is a grand parent. We need to swap out the pointer to the old
+    // parent and install the pointer to the new parent.
+#ifdef PMDK
+    auto result = grand_parent->Update(
+        top->node->GetMetadata(top->meta_index),
+        Allocator::Get()->GetOffset(old_parent),
+        reinterpret_cast<InternalNode *>(*ptr_parent), pd, GetPMWCASPool());
+#else
+    auto result = grand_parent->Update(
+        top->node->GetMetadata(top->meta_index),
+        old_parent, reinterpret_cast<InternalNode *>(*ptr_parent), pd, GetPMWCASPool());
+#endif
+    if (result.IsNodeFrozen()) {
+      AbortDescriptor(pd);
+    }
+    installed = result.IsOk();
+  } else {
+    // No grand parent or already popped out by during split propagation
+    // In case of PMDK, ptr_parent is already in PMDK offset format (done by
+    // InternalNode::New).
+#ifdef PMDK
+    installed = ChangeRoot(
+        reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(stack->GetRoot())),
+        *ptr_parent, pd);
+#else
+    installed = ChangeRoot(reinterpret_cast<uint64_t>(stack->GetRoot()), *ptr_parent, pd);
+#endif
+  }
+
+  if (installed) {
+    InheritHotness(node, *ptr_l, 1);
+    InheritHotness(node, *ptr_r, 1);
+    if (parameters.record_counts && old_parent) {
+      // The new parent counts its records afresh; what the old one had cached
+      // was off by that much for the nodes above as well
+      uint32_t cached = reinterpret_cast<std::atomic<uint32_t> *>(
+          &old_parent->GetHeader()->record_estimate)->load(std::memory_order_relaxed);
+#ifdef PMDK
+      auto *new_parent = Allocator::Get()->GetDirect(reinterpret_cast<BaseNode *>(*ptr_parent));
+#else
+      auto *new_parent = reinterpret_cast<BaseNode *>(*ptr_parent);
+#endif
+      int64_t records = GetSubtreeRecords(new_parent, GetPMWCASPool()->GetEpoch());
+      if (cached) {
+        for (uint32_t i = 0; i < first_replaced; ++i) {
+          AdjustRecordEstimate(stack->frames[i].node, records - (cached - 1));
+        }
+      }
+    }
+    RetireNode(node);
+    for (uint32_t i = first_replaced; i < frames_before_split; ++i) {
+      RetireNode(stack->frames[i].node);
+    }
+    CountStat(kStatLeafSplits);
+    if (internal_splits) {
+      CountStat(kStatInternalSplits, internal_splits);
+    }
+  } else {
+    CountStat(kStatSMOFailures);
+  }
+}
+
+bool BzTree::ConsolidateLeaf(Stack *stack, LeafNode *node, const char *drop_lo,
+                             uint32_t drop_lo_size, const char *drop_hi, uint32_t drop_hi_size,
+                             uint32_t node_size) {
+  auto *pd = NewDescriptor(GetPMWCASPool(), true);
+  pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                         reinterpret_cast<uint64_t>(nullptr),
+                         pmwcas::Descriptor::kRecycleNewOnFailure);
+  uint64_t *ptr_leaf = pd->GetNewValuePtr(0);
+  const char *prefix = nullptr;
+  uint16_t prefix_size = 0;
+  if (parameters.prefix_compression || node_size == LeafNode::kPackedSize) {
+    prefix_size = GetLeafPrefix(stack, &prefix);
+  }
+  // A packed leaf copied back into a full-sized one gets the tree's lanes
+  // back, it had none
+  uint32_t lanes = node_size != LeafNode::kPackedSize && node_size > node->GetHeader()->size
+      ? parameters.leaf_lanes : UINT32_MAX;
+  node->PrepareForConsolidate(reinterpret_cast<LeafNode **>(ptr_leaf),
+                              GetPMWCASPool()->GetEpoch(), prefix, prefix_size,
+                              drop_lo, drop_lo_size, drop_hi, drop_hi_size, node_size, lanes);
+  // Records left out for DeleteRange are deleted as far as snapshots go; the
+  // node is frozen, so they are what it holds for good
+  VersionWriter versions(this);
+  if (drop_hi && versions.Get()) {
+    versions.Save(node, drop_lo, drop_lo_size, drop_hi, drop_hi_size);
+  }
+#ifdef PMDK
+  BaseNode *old_leaf = Allocator::Get()->GetOffset(node);
+#else
+  BaseNode *old_leaf = node;
+#endif
+  auto *top = stack->Top();
+  bool installed = false;
+  if (top) {
+    auto result = top->node->Update(top->node->GetMetadata(top->meta_index), old_leaf,
+                                    reinterpret_cast<BaseNode *>(*ptr_leaf),
+                                    pd, GetPMWCASPool());
+    if (result.IsNodeFrozen()) {
+      // Parent is being split/merged, the PMwCAS was never issued
+      AbortDescriptor(pd);
+    }
+    installed = result.IsOk();
+  } else {
+    installed = ChangeRoot(reinterpret_cast<uint64_t>(old_leaf), *ptr_leaf, pd);
+  }
+  versions.Finish(installed);
+  if (installed) {
+    InheritHotness(node, *ptr_leaf, 0);
+    RetireNode(node);
+    CountStat(kStatConsolidations);
+  } else {
+    CountStat(kStatSMOFailures);
+  }
+  return installed;
+}
+
+// The image of the evicted leaf [word] points to, read from its store into a
+// buffer of the thread's rather than loaded back into the tree, for counts
+// and drops; nullptr if the store isn't open (tiering not enabled again
+// after recovery)
+static LeafNode *ReadEvictedLeaf(uint64_t word) {
+  auto *store = LeafStore::Get(word);
+  if (!store) {
+    return nullptr;
+  }
+  thread_local std::vector<uint64_t> buffer;
+  buffer.resize(store->GetPageSize() / sizeof(uint64_t));
+  auto *image = reinterpret_cast<char *>(buffer.data());
+  if (!store->Read(LeafStore::GetPage(word), image)) {
+    return nullptr;
+  }
+  return reinterpret_cast<LeafNode *>(image);
+}
+
+ReturnCode BzTree::DropLeaves(Stack *stack, const char *hi, uint32_t hi_size,
+                              std::string *next) {
+  auto *frame = stack->Top();
+  InternalNode *parent = frame->node;
+  auto parent_status = parent->GetHeader()->GetStatus();
+  if (parent_status.IsFrozen()) {
+    return ReturnCode::NodeFrozen();
+  }
+  ++smo_attempts;
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+
+  // Phase 1: freeze the parent and the leaves, so that nothing lands in them
+  // once they're gone: anything that replaces one has to freeze it first,
+  // and anything installed in the parent (which keeps its status word as it
+  // is) has to find it unfrozen. The copy of the parent is made after that,
+  // from a parent that can't change any more.
+  auto *pd = NewDescriptor(GetPMWCASPool());
+  pd->AddEntry(&(&parent->GetHeader()->status)->word,
+               parent_status.word, parent_status.Freeze().word);
+  uint32_t first = frame->meta_index;
+  uint32_t end = first;
+  uint32_t words = 0;
+  while (end < parent->GetHeader()->sorted_count && words < kMaxDroppedLeaves) {
+    frame->meta_index = end;
+    const char *upper = nullptr;
+    uint32_t upper_size = 0;
+    if (!GetLeafUpperBound(stack, &upper, &upper_size) ||
+        BaseNode::KeyCompare(upper, upper_size, hi, hi_size) >= 0) {
+      break;
+    }
+    uint64_t word = parent->GetChildWord(end, epoch);
+    if (word & InternalNode::kEvictedChild) {
+      // Left in the store: making sure the parent still has its page is
+      // enough, a load back has to change the word in an unfrozen parent
+      if (words + 1 > kMaxDroppedLeaves) {
+        break;
+      }
+      pd->AddEntry(parent->GetPayloadPtr(parent->GetMetadata(end)), word, word);
+      ++words;
+    } else {
+      auto *leaf = parent->GetChildByMetaIndex(end, epoch);
+      auto status = leaf->GetHeader()->GetStatus();
+      if (status.IsFrozen() || words + leaf->GetFreezeWords() > kMaxDroppedLeaves) {
+        break;
+      }
+      leaf->AddFreezeEntries(pd, status);
+      words += leaf->GetFreezeWords();
+    }
+    next->assign(upper, upper_size);
+    ++end;
+  }
+  frame->meta_index = first;
+  if (end == first) {
+    AbortDescriptor(pd);
+    return ReturnCode::NodeFrozen();
+  }
+  // Where to find the parent again, should its own parent change meanwhile
+  std::string cursor;
+  const char *lower = nullptr;
+  uint32_t lower_size = 0;
+  if (GetLeafLowerBound(stack, &lower, &lower_size)) {
+    cursor.assign(lower, lower_size);
+  }
+  if (!RunMwCAS(pd)) {
+    CountStat(kStatSMOFailures);
+    return ReturnCode::PMWCASFailure();
+  }
+
+  // Phase 2: install a copy of the parent pointing to a single empty leaf
+  // instead. The frozen nodes are this thread's to replace, so keep at it
+  // until the copy is in or someone helping a split replaced the parent.
+  uint32_t attempt = 0;
+  while (true) {
+    pd = NewDescriptor(GetPMWCASPool(), true);
+    pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                           reinterpret_cast<uint64_t>(nullptr),
+                           pmwcas::Descriptor::kRecycleNewOnFailure);
+    pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                           reinterpret_cast<uint64_t>(nullptr),
+                           pmwcas::Descriptor::kRecycleNewOnFailure);
+    auto *new_parent = reinterpret_cast<InternalNode **>(pd->GetNewValuePtr(0));
+    auto *new_leaf = reinterpret_cast<LeafNode **>(pd->GetNewValuePtr(1));
+
+    // The new leaf covers the keys all of them did; it's empty so the parent's
+    // prefix is as good as any
+    LeafNode::New(new_leaf, parameters.leaf_node_size, parameters.bloom_filter,
+                  parameters.leaf_lanes);
+    parent->DeleteRecord(first, reinterpret_cast<uint64_t>(*new_leaf), new_parent,
+                         end - first - 1);
+
+    // All their records are deleted as far as snapshots go
+    VersionWriter versions(this);
+    if (versions.Get()) {
+      for (uint32_t i = first; i < end; ++i) {
+        uint64_t word = parent->GetChildWord(i, epoch);
+        auto *leaf = word & InternalNode::kEvictedChild
+            ? ReadEvictedLeaf(word)
+            : reinterpret_cast<LeafNode *>(parent->GetChildByMetaIndex(i, epoch));
+        if (leaf) {
+          versions.Save(leaf, nullptr, 0, nullptr, 0);
+        }
+      }
+    }
+
+    bool installed = false;
+    if (stack->num_frames > 1) {
+      auto &grand_frame = stack->frames[stack->num_frames - 2];
+#ifdef PMDK
+      BaseNode *old_parent = Allocator::Get()->GetOffset(parent);
+#else
+      BaseNode *old_parent = parent;
+#endif
+      auto result = grand_frame.node->Update(
+          grand_frame.node->GetMetadata(grand_frame.meta_index), old_parent,
+          reinterpret_cast<BaseNode *>(*new_parent), pd, GetPMWCASPool());
+      if (result.IsNodeFrozen()) {
+        AbortDescriptor(pd);
+      }
+      installed = result.IsOk();
+    } else {
+#ifdef PMDK
+      installed = ChangeRoot(reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(parent)),
+                             reinterpret_cast<uint64_t>(*new_parent), pd);
+#else
+      installed = ChangeRoot(reinterpret_cast<uint64_t>(parent),
+                             reinterpret_cast<uint64_t>(*new_parent), pd);
+#endif
+    }
+    versions.Finish(installed);
+    if (installed) {
+      break;
+    }
+    CountStat(kStatSMOFailures);
+    ContentionManager::Pause(++attempt);
+    stack->Clear();
+    TraverseToCursor(stack, cursor);
+    if (stack->num_frames == 0 || stack->Top()->node != parent ||
+        stack->Top()->meta_index != first) {
+      // Replaced by a copy that still points to the frozen leaves, which
+      // DeleteRange consolidates like any other frozen leaf
+      return ReturnCode::PMWCASFailure();
+    }
+  }
+  for (uint32_t i = first; i < end; ++i) {
+    uint64_t word = parent->GetChildWord(i, epoch);
+    if (!(word & InternalNode::kEvictedChild)) {
+      RetireNode(parent->GetChildByMetaIndex(i, epoch));
+    } else if (auto *store = LeafStore::Get(word)) {
+      // Someone might still be reading the page
+      garbage_list->Push(reinterpret_cast<void *>(LeafStore::GetPage(word)),
+                         LeafStore::FreePage, store);
+      store->CountEvicted(-1);
+    }
+  }
+  RetireNode(parent);
+  CountStat(kStatDroppedLeaves, end - first);
+  return ReturnCode::Ok();
+}
+
+void BzTree::RetireNode(BaseNode *node) {
+  retired_bytes.fetch_add(node->GetHeader()->size, std::memory_order_relaxed);
+  if (!node->IsLeaf()) {
+    retired_internal_nodes.fetch_add(1);
+  }
+  garbage_list->Push(node, BzTree::FreeNode, this);
+}
+
+void BzTree::FreeNode(void *context, void *node) {
+  auto *tree = reinterpret_cast<BzTree *>(context);
+  auto size = reinterpret_cast<BaseNode *>(node)->GetHeader()->size;
+  // Internal nodes never searched through the cache have none, leaves keep
+  // their lane count there
+  if (!reinterpret_cast<BaseNode *>(node)->IsLeaf()) {
+    free(tree->GetInternalNodeCopy(reinterpret_cast<BaseNode *>(node)->GetHeader()->dram_copy));
+  }
+#ifdef PMDK
+  Allocator::Get()->Free(node);
+#else
+  NodeAllocator::Free(node);
+#endif
+  tree->reclaimed_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+void BzTree::FreeAllNodes() {
+  StopMaintenance();
+  EnableInternalNodeCache(false);
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  std::vector<BaseNode *> nodes{GetRootNodeSafe()};
+  while (!nodes.empty()) {
+    BaseNode *node = nodes.back();
+    nodes.pop_back();
+    if (!node->IsLeaf()) {
+      auto *parent = reinterpret_cast<InternalNode *>(node);
+      auto *epoch = GetPMWCASPool()->GetEpoch();
+      for (uint32_t i = 0; i < parent->GetHeader()->sorted_count; ++i) {
+        // Evicted leaves only have their pages to give back
+        uint64_t word = parent->GetChildWord(i, epoch);
+        if (!(word & InternalNode::kEvictedChild)) {
+          nodes.push_back(parent->GetChildByMetaIndex(i, epoch));
+        } else if (auto *store = LeafStore::Get(word)) {
+          store->FreePage(LeafStore::GetPage(word));
+          store->CountEvicted(-1);
+        }
+      }
+    }
+    FreeNode(this, node);
+  }
+  root = nullptr;
+}
+
+bool BzTree::ChangeRoot(uint64_t expected_root_addr, uint64_t new_root_addr,
+                        pmwcas::Descriptor *pd) {
+  // Memory policy here is "Never" because the memory was allocated in
+  // PrepareForInsert/BzTree::Insert which uses a descriptor that specifies
+  // policy RecycleOnRecovery
+  pd->AddEntry(reinterpret_cast<uint64_t *>(&root), expected_root_addr, new_root_addr,
+               pmwcas::Descriptor::kRecycleNever);
+  PersistBatch::Drain();
+  return RunMwCAS(pd);
+}
+
+ReturnCode BzTree::Read(const char *key, uint16_t key_size, uint64_t *payload) {
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  return ReadProtected(key, key_size, payload);
+}
+
+ReturnCode BzTree::Read(Session *session, const char *key, uint16_t key_size,
+                        uint64_t *payload) {
+  ++session->operations[kOpRead];
+  return ReadProtected(key, key_size, payload, session);
+}
+
+ReturnCode BzTree::ReadProtected(const char *key, uint16_t key_size, uint64_t *payload,
+                                 Session *session) {
+  LatencyTimer timer(this, BzTree::kOpRead);
+  // Only finger search and duplicate keys need the path
+  thread_local Stack stack;
+  Stack *path = nullptr;
+  if (session && session->finger_search) {
+    path = &session->stack;
+  } else if (parameters.duplicate_keys) {
+    stack.tree = this;
+    stack.Clear();
+    path = &stack;
+  }
+  LeafNode *node = session && session->finger_search
+                       ? TraverseFromFinger(path, session, key, key_size)
+                       : TraverseToLeaf(path, key, key_size);
+  if (node == nullptr) {
+    return ReturnCode::NotFound();
+  }
+  uint64_t tmp_payload;
+  auto rc = node->Read(key, key_size, &tmp_payload, GetPMWCASPool());
+  while (rc.IsNotFound() && (node = NextLeafOfKey(path, key, key_size))) {
+    rc = node->Read(key, key_size, &tmp_payload, GetPMWCASPool());
+  }
+  if (rc.IsOk()) {
+    *payload = tmp_payload;
+  }
+  return rc;
+}
+
+ReturnCode BzTree::Read(const char *key, uint16_t key_size, char *payload,
+                        uint32_t *payload_size) {
+  LatencyTimer timer(this, BzTree::kOpRead);
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+
+  thread_local Stack stack;
+  stack.tree = this;
+  stack.Clear();
+  LeafNode *node = TraverseToLeaf(parameters.duplicate_keys ? &stack : nullptr, key, key_size);
+  if (node == nullptr) {
+    return ReturnCode::NotFound();
+  }
+  auto rc = node->Read(key, key_size, payload, payload_size, GetPMWCASPool());
+  while (rc.IsNotFound() && (node = NextLeafOfKey(&stack, key, key_size))) {
+    rc = node->Read(key, key_size, payload, payload_size, GetPMWCASPool());
+  }
+  return rc;
+}
+
+BzTree::SteppedOp::SteppedOp(Session *session)
+    : tree(session->stack.tree), session(session), kind(kRead), phase(kDone), key(nullptr),
+      key_size(0), payload(0), rc(ReturnCode::Ok()), node(nullptr), prefetched(false), steps(0),
+      yields(0), freeze_retry(0), include_key(true), to_scan(0), result(nullptr) {
+  stack.tree = tree;
+}
+
+void BzTree::SteppedOp::Start(Kind kind, const char *key, uint16_t key_size) {
+  assert(phase == kDone);
+  this->kind = kind;
+  this->key = key;
+  this->key_size = key_size;
+  phase = kRoot;
+  prefetched = false;
+  steps = 0;
+  yields = 0;
+  freeze_retry = 0;
+}
+
+void BzTree::SteppedOp::Read(const char *key, uint16_t key_size) {
+  ++session->operations[kOpRead];
+  Start(kRead, key, key_size);
+}
+
+void BzTree::SteppedOp::Insert(const char *key, uint16_t key_size, uint64_t payload) {
+  ++session->operations[kOpInsert];
+  Start(kInsert, key, key_size);
+  this->payload = payload;
+}
+
+void BzTree::SteppedOp::Scan(const char *key, uint16_t key_size, uint32_t to_scan,
+                             ScanBuffer *result) {
+  ++session->operations[kOpScan];
+  Start(kScan, key, key_size);
+  this->to_scan = to_scan;
+  this->result = result;
+  include_key = true;
+  result->Clear();
+}
+
+bool BzTree::SteppedOp::Step() {
+  if (phase == kDone) {
+    return true;
+  }
+  ++steps;
+  auto *epoch = tree->GetPMWCASPool()->GetEpoch();
+  if (phase == kRoot) {
+    // As TraverseToLeaf, one level per step
+    tree->CollectPendingStats();
+    pmwcas_failure_streak = 0;
+    stack.Clear();
+    node = tree->GetRootNodeSafe();
+    stack.SetRoot(node);
+    PrefetchNode(node, tree->narrow_prefetch.load(std::memory_order_relaxed));
+    phase = kDescend;
+    return false;
+  }
+  if (!node->IsLeaf()) {
+    auto *parent = reinterpret_cast<InternalNode *>(node);
+    bool le_child = kind != kScan || include_key;
+    auto meta_index = key ? tree->GetSearchNode(parent)->GetChildIndex(key, key_size, le_child)
+                          : parent->GetHeader()->sorted_count - 1;
+    if (!prefetched && parent->IsChildEvicted(meta_index, epoch)) {
+      uint64_t word = parent->GetChildWord(meta_index, epoch);
+      if (auto *store = LeafStore::Get(word)) {
+        store->Prefetch(LeafStore::GetPage(word));
+        prefetched = true;
+        return false;
+      }
+    }
+    prefetched = false;
+    node = parent->GetChildByMetaIndex(meta_index, epoch);
+    PrefetchNode(node, tree->narrow_prefetch.load(std::memory_order_relaxed));
+    stack.Push(parent, meta_index);
+    return false;
   }
-  // Final step: make the new record visible, a 2-word PMwCAS:
-  // 1. Metadata - set the visible bit and actual block offset
-  // 2. Status word - set to the initial value read above (s) to detect
-  // conflicting threads that are trying to set the frozen bit
-  auto new_meta = desired_meta;
-  new_meta.FinalizeForInsert(offset, key_size, total_size);
-  assert(new_meta.GetTotalLength() < 100);
+  auto *leaf = reinterpret_cast<LeafNode *>(node);
+  tree->SampleLeafAccess(leaf);
+  phase = kRoot;
+  if (AtLeaf(leaf)) {
+    phase = kDone;
+    return true;
+  }
+  return false;
+}
 
-  NodeHeader::StatusWord s = header.GetStatus();
-  if (s.IsFrozen()) {
-    return ReturnCode::NodeFrozen();
+bool BzTree::SteppedOp::AtLeaf(LeafNode *leaf) {
+  auto *pool = tree->GetPMWCASPool();
+  if (kind == kRead) {
+    rc = leaf->Read(key, key_size, &payload, pool);
+    while (rc.IsNotFound() && (leaf = tree->NextLeafOfKey(&stack, key, key_size))) {
+      rc = leaf->Read(key, key_size, &payload, pool);
+    }
+    return true;
   }
-  pd = pmwcas_pool->AllocateDescriptor();
-  pd->AddEntry(&(&header.status)->word, s.word, s.word);
-  pd->AddEntry(&meta_ptr->meta, desired_meta.meta, new_meta.meta);
-  if (pd->MwCAS()) {
-    return ReturnCode::Ok();
-  } else {
-    goto retry_phase2;
+  if (kind == kScan) {
+    rc = leaf->RangeScanByKey(key, key_size, include_key, nullptr, 0, false,
+                              to_scan - result->Count(), result, pool);
+    if (!rc.IsOk() || result->Count() >= to_scan) {
+      return true;
+    }
+    // The bound lives in a node the session's epoch keeps around
+    const char *upper = nullptr;
+    uint32_t upper_size = 0;
+    if (!tree->GetLeafUpperBound(&stack, &upper, &upper_size)) {
+      return true;
+    }
+    key = upper;
+    key_size = upper_size;
+    include_key = false;
+    if (tree->parameters.duplicate_keys) {
+      // The next leaf may go on with records of the bound, see NextLeafOfKey
+      node = tree->TraverseToSibling(&stack, false, true);
+      include_key = true;
+      phase = kDescend;
+    }
+    return false;
+  }
+
+  VersionWriter versions(tree);
+  rc = leaf->Insert(key, key_size, payload, pool, tree->parameters.split_threshold,
+                    versions.Get(), !tree->parameters.duplicate_keys);
+  if (rc.IsOk() || rc.IsKeyExists()) {
+    if (rc.IsOk()) {
+      tree->PublishChange(ChangeFeed::kInsert, key, key_size, payload);
+    }
+    tree->HintFullLeaf(leaf, key, key_size);
+    tree->KeepLeafSorted(&stack, leaf);
+    return true;
+  }
+  // Someone else's SMO; let it finish while the other operations go on, and
+  // help with it only after waiting as long as the blocking call would
+  if (rc.IsNodeFrozen() && ++yields <= ContentionManager::kMaxWaits) {
+    return false;
   }
+  tree->SplitOrConsolidate(&stack, leaf, rc, &freeze_retry, false);
+  return false;
 }
 
-LeafNode::Uniqueness LeafNode::CheckUnique(const char *key,
-                                           uint32_t key_size,
-                                           pmwcas::EpochManager *epoch) {
-  auto metadata = SearchRecordMeta(epoch, key, key_size, nullptr);
-  if (metadata.IsVacant()) {
-    return IsUnique;
+uint32_t BzTree::GetBulkFillSize(float fill_factor, uint32_t split_size) {
+  // Nodes at or above the split size would be split by the next insert
+  auto size = static_cast<uint32_t>(static_cast<float>(split_size) * fill_factor);
+  return std::max<uint32_t>(std::min(size, split_size - 1), sizeof(LeafNode) + 256);
+}
+
+void BzTree::BuildInternalLevel(std::vector<BulkNode>::const_iterator first,
+                                std::vector<BulkNode>::const_iterator last, uint32_t fill_size,
+                                std::vector<BulkNode> *parents) {
+  thread_local std::vector<const char *> keys;
+  thread_local std::vector<uint16_t> key_sizes;
+  thread_local std::vector<uint64_t> addrs;
+
+  const BulkNode *children = &*first;
+  auto child_count = static_cast<uint32_t>(last - first);
+  uint32_t begin = 0;
+  while (begin < child_count) {
+    // Take children while the node fits, at least two of them, and don't
+    // leave a single one behind for the last node
+    keys.clear();
+    key_sizes.clear();
+    addrs.clear();
+    uint32_t end = begin;
+    uint32_t node_size = sizeof(InternalNode);
+    while (end < child_count) {
+      uint16_t key_size = end == begin ? 0 : children[end - 1].last_key_size;
+      uint32_t child_size = sizeof(RecordMetadata) + sizeof(uint64_t) +
+          RecordMetadata::PadKeyLength(key_size);
+      if (end - begin >= 2 && node_size + child_size > fill_size) {
+        break;
+      }
+      node_size += child_size;
+      ++end;
+    }
+    if (child_count - end == 1) {
+      if (end - begin > 2) {
+        --end;
+      } else {
+        ++end;
+      }
+    }
+
+    for (uint32_t i = begin; i < end; ++i) {
+      keys.emplace_back(i == begin ? nullptr : children[i - 1].last_key);
+      key_sizes.emplace_back(i == begin ? 0 : children[i - 1].last_key_size);
+#ifdef PMDK
+      addrs.emplace_back(reinterpret_cast<uint64_t>(
+          Allocator::Get()->GetOffset(children[i].node)));
+#else
+      addrs.emplace_back(reinterpret_cast<uint64_t>(children[i].node));
+#endif
+    }
+    InternalNode *node = nullptr;
+    InternalNode::New(keys.data(), key_sizes.data(), addrs.data(), end - begin, &node);
+#ifdef PMDK
+    node = Allocator::Get()->GetDirect(node);
+#endif
+    parents->push_back({node, children[end - 1].last_key, children[end - 1].last_key_size});
+    begin = end;
   }
-  // we need to perform a key compare again
-  // consider this case:
-  // a key is inserting when we "SearchRecordMeta"
-  // when get back, this meta may have finished inserting, so the following if will be false
-  // however, this key may not be duplicate, so we need to compare the key again
-  // even if this key is not duplicate, we need to return a "Recheck"
-  if (metadata.IsInserting()) {
-    return ReCheck;
+}
+
+ReturnCode BzTree::BuildLeaves(const BulkLoadSource &next, uint32_t fill_size,
+                               std::vector<BulkNode> *leaves) {
+  auto new_leaf = [this, leaves]() {
+    LeafNode *leaf = nullptr;
+    LeafNode::New(&leaf, parameters.leaf_node_size, parameters.bloom_filter,
+                  parameters.leaf_lanes);
+#ifdef PMDK
+    leaf = Allocator::Get()->GetDirect(leaf);
+#endif
+    leaves->push_back({leaf, nullptr, 0});
+    return leaf;
+  };
+  auto seal_leaf = [this, leaves]() {
+    auto &last = leaves->back();
+    auto *leaf = reinterpret_cast<LeafNode *>(last.node);
+    auto count = leaf->GetHeader()->status.GetRecordCount();
+    if (count > 0) {
+      auto meta = leaf->GetMetadata(count - 1);
+      last.last_key = leaf->GetKey(meta);
+      last.last_key_size = static_cast<uint16_t>(meta.GetKeyLength());
+    }
+#ifdef PMDK
+    Allocator::Get()->PersistPtr(leaf, parameters.leaf_node_size);
+#elif defined(PMEM)
+    pmwcas::NVRAM::Flush(parameters.leaf_node_size, leaf);
+#endif
+  };
+
+  // Fill leaves one after another, each record goes to the last one
+  LeafNode *leaf = new_leaf();
+  const char *key = nullptr;
+  uint16_t key_size = 0;
+  uint64_t payload = 0;
+  const char *prev_key = nullptr;
+  uint16_t prev_key_size = 0;
+  while (next(&key, &key_size, &payload)) {
+    if (prev_key && BaseNode::KeyCompare(prev_key, prev_key_size, key, key_size) >= 0) {
+      return ReturnCode::KeyExists();
+    }
+    if (!leaf->AppendSorted(key, key_size, payload, fill_size)) {
+      seal_leaf();
+      leaf = new_leaf();
+      if (!leaf->AppendSorted(key, key_size, payload, fill_size)) {
+        return ReturnCode::NotEnoughSpace();
+      }
+      // The previous leaf's separator only needs to tell its last key apart
+      // from this one
+      auto &sealed = (*leaves)[leaves->size() - 2];
+      const char *separator = nullptr;
+      uint32_t separator_size = 0;
+      BaseNode::GetShortestSeparator(sealed.last_key, sealed.last_key_size,
+                                     leaf->GetKey(leaf->GetMetadata(0)), key_size,
+                                     &separator, &separator_size);
+      sealed.last_key = separator;
+      sealed.last_key_size = static_cast<uint16_t>(separator_size);
+    }
+    auto meta = leaf->GetMetadata(leaf->GetHeader()->status.GetRecordCount() - 1);
+    prev_key = leaf->GetKey(meta);
+    prev_key_size = key_size;
   }
+  seal_leaf();
+  return ReturnCode::Ok();
+}
 
-  ALWAYS_ASSERT(metadata.IsVisible());
-  if (KeyCompare(key, key_size, GetKey(metadata), metadata.GetKeyLength()) == 0) {
-    return Duplicate;
+ReturnCode BzTree::InstallBulkTree(BaseNode *old_root, std::vector<BulkNode> *level,
+                                   uint32_t fill_size, uint32_t threads) {
+  // Build the levels above the leaves up to a single root; a wide level is
+  // cut into one run of children per thread, each becoming a run of parents
+  std::vector<BulkNode> parents;
+  std::vector<std::vector<BulkNode>> partial(threads);
+  std::vector<std::thread> workers;
+  while (level->size() > 1) {
+    parents.clear();
+    uint64_t per_thread = level->size() / threads;
+    if (threads == 1 || per_thread < 64) {
+      BuildInternalLevel(level->begin(), level->end(), fill_size, &parents);
+    } else {
+      workers.clear();
+      for (uint32_t t = 0; t < threads; ++t) {
+        auto begin = level->begin() + t * per_thread;
+        auto end = t == threads - 1 ? level->end() : begin + per_thread;
+        partial[t].clear();
+        workers.emplace_back([this, begin, end, fill_size, &partial, t]() {
+          BuildInternalLevel(begin, end, fill_size, &partial[t]);
+        });
+      }
+      for (uint32_t t = 0; t < threads; ++t) {
+        workers[t].join();
+        parents.insert(parents.end(), partial[t].begin(), partial[t].end());
+      }
+    }
+    level->swap(parents);
   }
-  return ReCheck;
+
+#ifdef PMDK
+  auto old_root_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(old_root));
+  auto new_root_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset((*level)[0].node));
+#else
+  auto old_root_addr = reinterpret_cast<uint64_t>(old_root);
+  auto new_root_addr = reinterpret_cast<uint64_t>((*level)[0].node);
+#endif
+  auto *pd = NewDescriptor(GetPMWCASPool());
+  bool installed = ChangeRoot(old_root_addr, new_root_addr, pd);
+  ALWAYS_ASSERT(installed);
+  RetireNode(old_root);
+  return ReturnCode::Ok();
 }
 
-LeafNode::Uniqueness LeafNode::RecheckUnique(const char *key, uint32_t key_size, uint32_t end_pos) {
-  auto current_status = GetHeader()->GetStatus();
-  if (current_status.IsFrozen()) {
-    return NodeFrozen;
+bool BzTree::CanBulkLoad(BaseNode *root_node) {
+  // Snapshots would see the new records as if they had been there all along
+  return root_node->IsLeaf() && root_node->GetHeader()->GetStatus().GetRecordCount() == 0 &&
+      open_snapshots.load() == 0;
+}
+
+ReturnCode BzTree::BulkLoad(const BulkLoadSource &next, float fill_factor) {
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  BaseNode *old_root = GetRootNodeSafe();
+  if (!CanBulkLoad(old_root)) {
+    return ReturnCode::KeyExists();
   }
 
-  // Linear search on unsorted field
-  uint32_t linear_end = std::min<uint32_t>(header.GetStatus().GetRecordCount(), end_pos);
-  thread_local std::vector<uint32_t> check_idx;
-  check_idx.clear();
+  uint32_t fill_size = GetBulkFillSize(fill_factor, parameters.split_threshold);
+  std::vector<BulkNode> level;
+  auto rc = BuildLeaves(next, fill_size, &level);
+  if (!rc.IsOk()) {
+    // Nothing was published, but there's no harm in going through the garbage list
+    for (auto &n : level) {
+      RetireNode(n.node);
+    }
+    return rc;
+  }
+  return InstallBulkTree(old_root, &level,
+                         GetBulkFillSize(fill_factor, parameters.internal_node_size), 1);
+}
 
-  auto check_metadata = [key, key_size, this](uint32_t i, bool push) -> LeafNode::Uniqueness {
-    RecordMetadata md = GetMetadata(i);
-    if (md.IsInserting()) {
-      if (push) {
-        check_idx.push_back(i);
+ReturnCode BzTree::BulkLoad(const char *const *keys, const uint16_t *key_sizes,
+                            const uint64_t *payloads, uint64_t count, uint32_t threads,
+                            float fill_factor) {
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  BaseNode *old_root = GetRootNodeSafe();
+  if (!CanBulkLoad(old_root)) {
+    return ReturnCode::KeyExists();
+  }
+  threads = static_cast<uint32_t>(std::max<uint64_t>(1, std::min<uint64_t>(threads, count)));
+
+  // Each thread packs the leaves of a contiguous slice of the input; the
+  // slices are in order, so are the leaves once the runs are concatenated
+  uint32_t fill_size = GetBulkFillSize(fill_factor, parameters.split_threshold);
+  std::vector<std::vector<BulkNode>> runs(threads);
+  std::vector<ReturnCode> rcs(threads);
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads; ++t) {
+    uint64_t begin = count * t / threads;
+    uint64_t end = count * (t + 1) / threads;
+    if (begin > 0 && BaseNode::KeyCompare(keys[begin - 1], key_sizes[begin - 1],
+                                          keys[begin], key_sizes[begin]) >= 0) {
+      rcs[t] = ReturnCode::KeyExists();
+      continue;
+    }
+    workers.emplace_back([this, keys, key_sizes, payloads, begin, end, fill_size,
+                          &runs, &rcs, t]() {
+      uint64_t i = begin;
+      auto next = [&](const char **key, uint16_t *key_size, uint64_t *payload) {
+        if (i == end) {
+          return false;
+        }
+        *key = keys[i];
+        *key_size = key_sizes[i];
+        *payload = payloads[i++];
+        return true;
+      };
+      rcs[t] = BuildLeaves(next, fill_size, &runs[t]);
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  std::vector<BulkNode> level;
+  ReturnCode rc = ReturnCode::Ok();
+  for (uint32_t t = 0; t < threads; ++t) {
+    if (!rcs[t].IsOk()) {
+      rc = rcs[t];
+    } else if (!level.empty() && !runs[t].empty()) {
+      // Shorten the separator between the last leaf of a run and the next
+      auto *first = reinterpret_cast<LeafNode *>(runs[t][0].node);
+      auto meta = first->GetMetadata(0);
+      const char *separator = nullptr;
+      uint32_t separator_size = 0;
+      BaseNode::GetShortestSeparator(level.back().last_key, level.back().last_key_size,
+                                     first->GetKey(meta), meta.GetKeyLength(),
+                                     &separator, &separator_size);
+      level.back().last_key = separator;
+      level.back().last_key_size = static_cast<uint16_t>(separator_size);
+    }
+    level.insert(level.end(), runs[t].begin(), runs[t].end());
+  }
+  if (!rc.IsOk()) {
+    for (auto &n : level) {
+      RetireNode(n.node);
+    }
+    return rc;
+  }
+  return InstallBulkTree(old_root, &level,
+                         GetBulkFillSize(fill_factor, parameters.internal_node_size), threads);
+}
+
+// Make the data written so far durable, then the header saying so
+template <class Header>
+static bool SyncWithHeader(int fd, const Header &header) {
+  return fdatasync(fd) == 0 &&
+      WriteFully(fd, reinterpret_cast<const char *>(&header), sizeof(header), 0) &&
+      fdatasync(fd) == 0;
+}
+
+ReturnCode BzTree::Export(const char *path, uint64_t sync_bytes) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return ReturnCode::IOError();
+  }
+  auto fail = [fd]() {
+    close(fd);
+    return ReturnCode::IOError();
+  };
+
+  // Resume after the last record synced, or start over
+  ExportHeader header;
+  std::string from;
+  bool resume = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+      header.magic == ExportHeader::kMagic && !header.complete;
+  if (resume && header.record_count > 0) {
+    RecordMetadata meta;
+    uint64_t offset = sizeof(header) + header.last_record;
+    if (pread(fd, &meta, sizeof(meta), offset) != sizeof(meta)) {
+      return fail();
+    }
+    from.resize(meta.GetKeyLength());
+    if (pread(fd, &from[0], from.size(), offset + sizeof(meta)) !=
+        static_cast<ssize_t>(from.size())) {
+      return fail();
+    }
+  } else if (!resume) {
+    memset(&header, 0, sizeof(header));
+    header.magic = ExportHeader::kMagic;
+  }
+  if (ftruncate(fd, sizeof(header) + header.data_size) != 0 || !SyncWithHeader(fd, header)) {
+    return fail();
+  }
+
+  bool after_last = resume && header.record_count > 0;
+  Iterator iter(this, from.data(), static_cast<uint16_t>(from.size()), !after_last,
+                nullptr, 0, false);
+  uint64_t unsynced = 0;
+  while (auto *batch = iter.GetNextBatch()) {
+    // Keys go right after the metadata, wherever they were in the leaf
+    uint64_t offset = header.data_size;
+    for (auto *r = batch->First(); r; r = batch->Next(r)) {
+      auto &meta = r->meta;
+      header.var_payload_count += meta.HasVarPayload();
+      header.last_record = offset;
+      offset += Record::GetSize(meta);
+      meta.FinalizeForInsert(sizeof(RecordMetadata), meta.GetKeyLength(), meta.GetTotalLength(),
+                             meta.HasVarPayload());
+    }
+    if (!WriteFully(fd, batch->GetData(), batch->GetSize(),
+                    sizeof(header) + header.data_size)) {
+      return fail();
+    }
+    header.record_count += batch->Count();
+    header.data_size += batch->GetSize();
+    unsynced += batch->GetSize();
+    if (unsynced >= sync_bytes) {
+      if (!SyncWithHeader(fd, header)) {
+        return fail();
       }
-      return ReCheck;
-    } else if (md.IsVacant() || !md.IsVisible()) {
-      return IsUnique;
+      unsynced = 0;
+    }
+  }
+  header.complete = 1;
+  if (!SyncWithHeader(fd, header)) {
+    return fail();
+  }
+  close(fd);
+  return ReturnCode::Ok();
+}
+
+void BzTree::GetScanBounds(uint32_t count, std::vector<std::string> *bounds) {
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  bounds->clear();
+  std::vector<InternalNode *> level;
+  std::vector<InternalNode *> children;
+  std::vector<std::string> keys;
+  BaseNode *root = GetRootNodeSafe();
+  if (!root->IsLeaf()) {
+    level.push_back(reinterpret_cast<InternalNode *>(root));
+  }
+  while (!level.empty()) {
+    // A level's separators are those of its nodes, with those of the level
+    // above between them
+    keys.clear();
+    children.clear();
+    for (uint32_t j = 0; j < level.size(); ++j) {
+      if (j > 0) {
+        keys.emplace_back(std::move((*bounds)[j - 1]));
+      }
+      auto *node = level[j];
+      for (uint32_t i = 0; i < node->GetHeader()->sorted_count; ++i) {
+        if (i > 0) {
+          auto meta = node->GetMetadata(i);
+          keys.emplace_back(node->GetKey(meta), meta.GetKeyLength());
+        }
+        // Evicted children are leaves, and are left in the leaf store
+        if (!node->IsChildEvicted(i, epoch)) {
+          auto *child = node->GetChildByMetaIndex(i, epoch);
+          if (!child->IsLeaf()) {
+            children.push_back(reinterpret_cast<InternalNode *>(child));
+          }
+        }
+      }
+    }
+    bounds->swap(keys);
+    if (bounds->size() + 1 >= count) {
+      break;
+    }
+    level.swap(children);
+  }
+}
+
+ReturnCode BzTree::ParallelScan(uint32_t threads, const ParallelScanSink &sink) {
+  threads = std::max<uint32_t>(threads, 1);
+  std::vector<std::string> bounds;
+  GetScanBounds(threads * kScanRangesPerThread, &bounds);
+
+  // Range r holds the keys above bound r - 1 and up to bound r, as leaves do
+  std::atomic<uint32_t> next_range{0};
+  std::atomic<bool> stop{false};
+  auto scan = [&](uint32_t thread) {
+    for (uint32_t r = next_range++; r <= bounds.size() && !stop; r = next_range++) {
+      const char *lo = r > 0 ? bounds[r - 1].data() : nullptr;
+      auto lo_size = static_cast<uint16_t>(r > 0 ? bounds[r - 1].size() : 0);
+      const char *hi = r < bounds.size() ? bounds[r].data() : nullptr;
+      auto hi_size = static_cast<uint16_t>(r < bounds.size() ? bounds[r].size() : 0);
+      Iterator iter(this, lo, lo_size, false, hi, hi_size, true);
+      while (auto *batch = iter.GetNextBatch()) {
+        if (!sink(thread, batch)) {
+          stop = true;
+        }
+        if (stop) {
+          break;
+        }
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 1; t < threads; ++t) {
+    workers.emplace_back(scan, t);
+  }
+  scan(0);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  return ReturnCode::Ok();
+}
+
+uint64_t BzTree::Count(const char *lo, uint16_t lo_size, const char *hi, uint16_t hi_size) {
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  if (lo && hi && BaseNode::KeyCompare(lo, lo_size, hi, hi_size) >= 0) {
+    return 0;
+  }
+  return CountRecords(GetRootNodeSafe(), lo, lo_size, hi, hi_size, GetPMWCASPool()->GetEpoch());
+}
+
+uint64_t BzTree::CountRecords(BaseNode *node, const char *lo, uint32_t lo_size, const char *hi,
+                              uint32_t hi_size, pmwcas::EpochManager *epoch) {
+  if (node->IsLeaf()) {
+    return reinterpret_cast<LeafNode *>(node)->CountRange(lo, lo_size, hi, hi_size);
+  }
+  // Child i holds the keys above separator i (the dummy key for i = 0) and up
+  // to separator i + 1; a bound it's entirely on one side of is dropped, a
+  // child entirely outside the range is skipped
+  auto *internal = reinterpret_cast<InternalNode *>(node);
+  uint32_t count = internal->GetHeader()->sorted_count;
+  uint64_t records = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    const char *child_lo = lo;
+    const char *child_hi = hi;
+    if (i > 0) {
+      auto meta = internal->GetMetadata(i);
+      const char *sep = internal->GetKey(meta);
+      if (hi && BaseNode::KeyCompare(sep, meta.GetKeyLength(), hi, hi_size) >= 0) {
+        break;
+      }
+      if (lo && BaseNode::KeyCompare(sep, meta.GetKeyLength(), lo, lo_size) >= 0) {
+        child_lo = nullptr;
+      }
+    }
+    if (i + 1 < count) {
+      auto meta = internal->GetMetadata(i + 1);
+      const char *sep = internal->GetKey(meta);
+      if (lo && BaseNode::KeyCompare(sep, meta.GetKeyLength(), lo, lo_size) < 0) {
+        continue;
+      }
+      if (hi && BaseNode::KeyCompare(sep, meta.GetKeyLength(), hi, hi_size) < 0) {
+        child_hi = nullptr;
+      }
+    }
+    if (internal->IsChildEvicted(i, epoch)) {
+      // Evicted children are leaves, counted off their pages
+      if (auto *leaf = ReadEvictedLeaf(internal->GetChildWord(i, epoch))) {
+        records += !child_lo && !child_hi
+            ? leaf->GetRecordEstimate()
+            : leaf->CountRange(child_lo, lo_size, child_hi, hi_size);
+      }
+      continue;
+    }
+    auto *child = internal->GetChildByMetaIndex(i, epoch);
+    if (!child_lo && !child_hi) {
+      records += GetSubtreeRecords(child, epoch);
     } else {
-      ALWAYS_ASSERT(md.IsVisible());
-      auto len = md.GetKeyLength();
-      if (key_size == len && (KeyCompare(key, key_size, GetKey(md), len) == 0)) {
-        return Duplicate;
+      records += CountRecords(child, child_lo, lo_size, child_hi, hi_size, epoch);
+    }
+  }
+  return records;
+}
+
+uint64_t BzTree::GetSubtreeRecords(BaseNode *node, pmwcas::EpochManager *epoch) {
+  if (node->IsLeaf()) {
+    return reinterpret_cast<LeafNode *>(node)->GetRecordEstimate();
+  }
+  auto *internal = reinterpret_cast<InternalNode *>(node);
+  auto *estimate = reinterpret_cast<std::atomic<uint32_t> *>(
+      &internal->GetHeader()->record_estimate);
+  uint32_t cached = estimate->load(std::memory_order_relaxed);
+  if (cached) {
+    return cached - 1;
+  }
+  uint64_t records = 0;
+  for (uint32_t i = 0; i < internal->GetHeader()->sorted_count; ++i) {
+    uint64_t word = internal->GetChildWord(i, epoch);
+    if (word & InternalNode::kEvictedChild) {
+      auto *leaf = ReadEvictedLeaf(word);
+      records += leaf ? leaf->GetRecordEstimate() : 0;
+    } else {
+      records += GetSubtreeRecords(internal->GetChildByMetaIndex(i, epoch), epoch);
+    }
+  }
+  if (parameters.record_counts) {
+    // Some other thread may have got there first, or a split adjusted it
+    uint32_t unknown = 0;
+    estimate->compare_exchange_strong(
+        unknown, static_cast<uint32_t>(std::min<uint64_t>(records + 1, UINT32_MAX)),
+        std::memory_order_relaxed);
+  }
+  return records;
+}
+
+void BzTree::AdjustRecordEstimate(InternalNode *node, int64_t delta) {
+  auto *estimate = reinterpret_cast<std::atomic<uint32_t> *>(&node->GetHeader()->record_estimate);
+  uint32_t cached = estimate->load(std::memory_order_relaxed);
+  int64_t adjusted = 0;
+  do {
+    if (cached == 0 || cached == UINT32_MAX) {
+      return;
+    }
+    adjusted = std::min<int64_t>(std::max<int64_t>(int64_t{cached} + delta, 1), UINT32_MAX);
+  } while (!estimate->compare_exchange_weak(cached, static_cast<uint32_t>(adjusted),
+                                            std::memory_order_relaxed));
+}
+
+void BzTree::ClearRecordEstimates(InternalNode *node) {
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  if (!node->IsChildEvicted(0, epoch) && !node->GetChildByMetaIndex(0, epoch)->IsLeaf()) {
+    for (uint32_t i = 0; i < node->GetHeader()->sorted_count; ++i) {
+      ClearRecordEstimates(reinterpret_cast<InternalNode *>(node->GetChildByMetaIndex(i, epoch)));
+    }
+  }
+  node->GetHeader()->record_estimate = 0;
+}
+
+std::unique_ptr<ExportImage> ExportImage::Open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) >= sizeof(ExportHeader)) {
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return nullptr;
+  }
+  auto *header = reinterpret_cast<ExportHeader *>(map);
+  if (header->magic != ExportHeader::kMagic || !header->complete ||
+      sizeof(ExportHeader) + header->data_size > static_cast<uint64_t>(st.st_size)) {
+    munmap(map, st.st_size);
+    return nullptr;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  return std::unique_ptr<ExportImage>(new ExportImage(map, st.st_size));
+}
+
+ExportImage::~ExportImage() {
+  munmap(map, map_size);
+}
+
+ReturnCode ExportImage::Load(BzTree *tree, float fill_factor) {
+  Record *r = First();
+  if (header->var_payload_count == 0) {
+    return tree->BulkLoad([&](const char **key, uint16_t *key_size, uint64_t *payload) {
+      if (!r) {
+        return false;
       }
-      return IsUnique;
+      *key = r->GetKey();
+      *key_size = r->meta.GetKeyLength();
+      *payload = r->GetPayload();
+      r = Next(r);
+      return true;
+    }, fill_factor);
+  }
+  for (; r; r = Next(r)) {
+    auto rc = r->meta.HasVarPayload() ?
+        tree->Insert(r->GetKey(), r->meta.GetKeyLength(), r->GetPayloadData(),
+                     r->GetPayloadLength()) :
+        tree->Insert(r->GetKey(), r->meta.GetKeyLength(), r->GetPayload());
+    if (!rc.IsOk()) {
+      return rc;
     }
+  }
+  return ReturnCode::Ok();
+}
+
+ReturnCode FrozenTree::Write(BzTree *tree, const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return ReturnCode::IOError();
+  }
+  auto fail = [fd](ReturnCode rc) {
+    close(fd);
+    return rc;
   };
 
-  for (uint32_t i = header.sorted_count; i < linear_end; i++) {
-    if (check_metadata(i, true) == Duplicate) {
-      return Duplicate;
+  // Each node goes to the image once built; [separator] is what the parent
+  // keeps to the right of it
+  struct Child {
+    uint64_t offset;
+    std::string separator;
+  };
+  std::vector<Child> level;
+  FrozenTreeHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = FrozenTreeHeader::kMagic;
+  header.leaf_size = tree->parameters.leaf_node_size;
+
+  // Leaves, filled up one after another in key order
+  std::vector<uint64_t> buffer(header.leaf_size / sizeof(uint64_t) + 1);
+  auto *leaf = reinterpret_cast<LeafNode *>(buffer.data());
+  std::string last_key;
+  auto seal_leaf = [&](const char *separator, uint32_t separator_size) {
+    uint64_t offset = FrozenTreeHeader::kAlignment + level.size() * header.leaf_size;
+    level.push_back({offset, std::string(separator, separator_size)});
+    return WriteFully(fd, reinterpret_cast<char *>(leaf), header.leaf_size, offset);
+  };
+  memset(leaf, 0, header.leaf_size);
+  new(leaf) LeafNode(header.leaf_size);
+  Iterator iter(tree, nullptr, 0, true, nullptr, 0, false);
+  while (auto *batch = iter.GetNextBatch()) {
+    for (auto *r = batch->First(); r; r = batch->Next(r)) {
+      auto key_size = r->meta.GetKeyLength();
+      if (leaf->AppendSorted(r->GetKey(), key_size, r->GetPayloadData(), r->GetPayloadLength(),
+                             r->meta.HasVarPayload(), header.leaf_size)) {
+        last_key.assign(r->GetKey(), key_size);
+        continue;
+      }
+      const char *separator = nullptr;
+      uint32_t separator_size = 0;
+      BaseNode::GetShortestSeparator(last_key.data(), last_key.size(), r->GetKey(), key_size,
+                                     &separator, &separator_size);
+      if (!seal_leaf(separator, separator_size)) {
+        return fail(ReturnCode::IOError());
+      }
+      memset(leaf, 0, header.leaf_size);
+      new(leaf) LeafNode(header.leaf_size);
+      if (!leaf->AppendSorted(r->GetKey(), key_size, r->GetPayloadData(), r->GetPayloadLength(),
+                              r->meta.HasVarPayload(), header.leaf_size)) {
+        return fail(ReturnCode::NotEnoughSpace());
+      }
+      last_key.assign(r->GetKey(), key_size);
     }
+    header.record_count += batch->Count();
+  }
+  if (!seal_leaf(last_key.data(), last_key.size())) {
+    return fail(ReturnCode::IOError());
   }
+  header.leaf_count = level.size();
+
+  // Then the levels above, as BulkLoad builds them: as many children per
+  // node as fit, at least two, and no single one left for the last node
+  uint64_t offset = FrozenTreeHeader::kAlignment + level.size() * header.leaf_size;
+  header.size = offset;
+  uint32_t fill_size = tree->parameters.internal_node_size;
+  std::vector<Child> parents;
+  std::vector<const char *> keys;
+  std::vector<uint16_t> key_sizes;
+  std::vector<uint64_t> children;
+  while (level.size() > 1) {
+    parents.clear();
+    auto child_count = static_cast<uint32_t>(level.size());
+    uint32_t begin = 0;
+    while (begin < child_count) {
+      uint32_t end = begin;
+      uint32_t node_size = sizeof(InternalNode);
+      while (end < child_count) {
+        auto key_size = end == begin ? 0 : level[end - 1].separator.size();
+        uint32_t child_size = sizeof(RecordMetadata) + sizeof(uint64_t) +
+            RecordMetadata::PadKeyLength(key_size);
+        if (end - begin >= 2 && node_size + child_size > fill_size) {
+          break;
+        }
+        node_size += child_size;
+        ++end;
+      }
+      if (child_count - end == 1) {
+        if (end - begin > 2) {
+          --end;
+        } else {
+          ++end;
+        }
+      }
 
-  uint32_t need_check = check_idx.size();
-  while (need_check > 0) {
-    for (uint32_t i = 0; i < check_idx.size(); ++i) {
-      auto result = check_metadata(i, false);
-      if (result == Duplicate) {
-        return Duplicate;
-      } else if (result != ReCheck) {
-        --need_check;
+      keys.clear();
+      key_sizes.clear();
+      children.clear();
+      for (uint32_t i = begin; i < end; ++i) {
+        keys.emplace_back(i == begin ? nullptr : level[i - 1].separator.data());
+        key_sizes.emplace_back(i == begin ? 0 : level[i - 1].separator.size());
+        children.emplace_back(level[i].offset);
+      }
+      node_size = InternalNode::GetNodeSize(key_sizes.data(), end - begin);
+      buffer.assign(node_size / sizeof(uint64_t) + 1, 0);
+      InternalNode::Build(keys.data(), key_sizes.data(), children.data(), end - begin,
+                          reinterpret_cast<char *>(buffer.data()));
+      if (!WriteFully(fd, reinterpret_cast<char *>(buffer.data()), node_size, offset)) {
+        return fail(ReturnCode::IOError());
       }
+      parents.push_back({offset, level[end - 1].separator});
+      header.size = offset + node_size;
+      offset += (node_size + FrozenTreeHeader::kAlignment - 1) &
+          ~(FrozenTreeHeader::kAlignment - 1);
+      begin = end;
     }
+    level.swap(parents);
+    ++header.height;
+  }
+  header.root = level[0].offset;
+  if (!SyncWithHeader(fd, header)) {
+    return fail(ReturnCode::IOError());
+  }
+  close(fd);
+  return ReturnCode::Ok();
+}
+
+std::unique_ptr<FrozenTree> FrozenTree::Open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) >= sizeof(FrozenTreeHeader)) {
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return nullptr;
   }
-  return IsUnique;
+  auto *header = reinterpret_cast<FrozenTreeHeader *>(map);
+  if (header->magic != FrozenTreeHeader::kMagic ||
+      header->size > static_cast<uint64_t>(st.st_size)) {
+    munmap(map, st.st_size);
+    return nullptr;
+  }
+  return std::unique_ptr<FrozenTree>(new FrozenTree(map, st.st_size));
 }
 
-ReturnCode LeafNode::Update(const char *key,
-                            uint16_t key_size,
-                            uint64_t payload,
-                            pmwcas::DescriptorPool *pmwcas_pool) {
-  retry:
-  auto old_status = header.GetStatus();
-  if (old_status.IsFrozen()) {
-    return ReturnCode::NodeFrozen();
+FrozenTree::~FrozenTree() {
+  munmap(map, map_size);
+}
+
+uint64_t FrozenTree::FindLeaf(const char *key, uint16_t key_size) {
+  BaseNode *node = GetNode(header->root);
+  for (uint32_t level = 0; level < header->height; ++level) {
+    auto *internal = reinterpret_cast<InternalNode *>(node);
+    auto index = internal->GetChildIndex(key, key_size);
+    node = GetNode(*internal->GetPayloadPtr(internal->GetMetadata(index)));
   }
+  return (reinterpret_cast<char *>(node) - reinterpret_cast<char *>(GetLeaf(0))) /
+      header->leaf_size;
+}
 
-  RecordMetadata *meta_ptr = nullptr;
-  auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
-  if (metadata.IsVacant()) {
+RecordMetadata FrozenTree::Find(const char *key, uint16_t key_size, LeafNode **leaf) {
+  *leaf = GetLeaf(FindLeaf(key, key_size));
+  // All sorted, no epoch to check inserts against
+  return (*leaf)->SearchRecordMeta(nullptr, key, key_size, nullptr, 0, (uint32_t) -1, false);
+}
+
+ReturnCode FrozenTree::Read(const char *key, uint16_t key_size, uint64_t *payload) {
+  LeafNode *leaf = nullptr;
+  auto meta = Find(key, key_size, &leaf);
+  if (meta.IsVacant()) {
     return ReturnCode::NotFound();
-  } else if (metadata.IsInserting()) {
-    goto retry;
   }
-
-  char *record_key = nullptr;
-  uint64_t record_payload = 0;
-  GetRawRecord(metadata, &record_key, &record_payload, pmwcas_pool->GetEpoch());
-  if (payload == record_payload) {
-    return ReturnCode::Ok();
+  char *data = reinterpret_cast<char *>(leaf) + meta.GetOffset() + meta.GetPaddedKeyLength();
+  if (meta.HasVarPayload() && meta.GetPayloadLength() > sizeof(uint64_t)) {
+    return ReturnCode::NotEnoughSpace();
   }
+  *payload = 0;
+  memcpy(payload, data, meta.HasVarPayload() ? meta.GetPayloadLength() : sizeof(uint64_t));
+  return ReturnCode::Ok();
+}
 
-  // 1. Update the corresponding payload
-  // 2. Make sure meta data is not changed
-  // 3. Make sure status word is not changed
-  auto pd = pmwcas_pool->AllocateDescriptor();
-  pd->AddEntry(reinterpret_cast<uint64_t *>(record_key + metadata.GetPaddedKeyLength()),
-               record_payload, payload);
-  pd->AddEntry(&meta_ptr->meta, metadata.meta, metadata.meta);
-  pd->AddEntry(&(&header.status)->word, old_status.word, old_status.word);
-
-  if (!pd->MwCAS()) {
-    goto retry;
+ReturnCode FrozenTree::Read(const char *key, uint16_t key_size, char *payload,
+                            uint32_t *payload_size) {
+  LeafNode *leaf = nullptr;
+  auto meta = Find(key, key_size, &leaf);
+  if (meta.IsVacant()) {
+    return ReturnCode::NotFound();
+  }
+  uint32_t buffer_size = *payload_size;
+  *payload_size = meta.GetPayloadLength();
+  if (buffer_size < *payload_size) {
+    return ReturnCode::NotEnoughSpace();
   }
+  memcpy(payload, reinterpret_cast<char *>(leaf) + meta.GetOffset() + meta.GetPaddedKeyLength(),
+         *payload_size);
   return ReturnCode::Ok();
 }
 
-RecordMetadata BaseNode::SearchRecordMeta(pmwcas::EpochManager *epoch,
-                                          const char *key,
-                                          uint32_t key_size,
-                                          RecordMetadata **out_metadata_ptr,
-                                          uint32_t start_pos,
-                                          uint32_t end_pos,
-                                          bool check_concurrency) {
-  // Binary search on sorted field
-  for (uint32_t i = 0; i < header.sorted_count; i++) {
-    RecordMetadata current = GetMetadata(i);
-    char *current_key = GetKey(current);
-    assert(current_key || !is_leaf);
-    auto cmp_result = KeyCompare(key, key_size, current_key, current.GetKeyLength());
-    if (cmp_result == 0) {
-      if (!current.IsVisible()) {
-        break;
+ReturnCode FrozenTree::RangeScanByKey(const char *lo, uint16_t lo_size, bool lo_inclusive,
+                                      const char *hi, uint16_t hi_size, bool hi_inclusive,
+                                      uint32_t to_scan, ScanBuffer *result) {
+  result->Clear();
+  thread_local std::vector<RecordMetadata> meta_vec;
+  // Leaves are in key order, the next one is right after
+  for (uint64_t i = lo ? FindLeaf(lo, lo_size) : 0; i < header->leaf_count && to_scan > 0; ++i) {
+    LeafNode *leaf = GetLeaf(i);
+    meta_vec.clear();
+    leaf->CollectRange(lo, lo_size, lo_inclusive, hi, hi_size, hi_inclusive, to_scan, &meta_vec);
+    for (auto meta : meta_vec) {
+      if (!result->Append(meta, leaf)) {
+        return ReturnCode::NotEnoughSpace();
       }
-      if (out_metadata_ptr) {
-        *out_metadata_ptr = record_metadata + i;
+    }
+    to_scan -= meta_vec.size();
+    auto count = leaf->GetHeader()->sorted_count;
+    if (hi && count > 0) {
+      auto last = leaf->GetMetadata(count - 1);
+      if (BaseNode::KeyCompare(leaf->GetKey(last), last.GetKeyLength(), hi, hi_size) >= 0) {
+        break;
       }
-      return current;
     }
   }
-  // Linear search on unsorted field
-//  uint32_t linear_end = std::min<uint32_t>(header.GetStatus().GetRecordCount(), end_pos);
-  for (uint32_t i = header.sorted_count; i < header.GetStatus().GetRecordCount(); i++) {
-    RecordMetadata current = GetMetadata(i);
-
-    if (current.IsInserting()) {
-      if (check_concurrency) {
-        // Encountered an in-progress insert, recheck later
-        if (out_metadata_ptr) {
-          *out_metadata_ptr = record_metadata + i;
-        }
-        return current;
-      } else {
+  return ReturnCode::Ok();
+}
+
+void BzTree::InsertBatch(const char *const *keys, const uint16_t *key_sizes,
+                         const uint64_t *payloads, uint32_t count, ReturnCode *rcs) {
+  thread_local std::vector<uint32_t> order;
+  thread_local std::vector<const char *> run_keys;
+  thread_local std::vector<uint16_t> run_sizes;
+  thread_local std::vector<uint64_t> run_payloads;
+  thread_local std::vector<ReturnCode> run_rcs;
+  thread_local Stack stack;
+  stack.tree = this;
+
+  // Sort the keys, and drop repeated ones right away
+  order.resize(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return BaseNode::KeyCompare(keys[a], key_sizes[a], keys[b], key_sizes[b]) < 0;
+  });
+  uint32_t unique_count = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (unique_count > 0 && !parameters.duplicate_keys) {
+      auto prev = order[unique_count - 1];
+      if (BaseNode::KeyCompare(keys[prev], key_sizes[prev],
+                               keys[order[i]], key_sizes[order[i]]) == 0) {
+        rcs[order[i]] = ReturnCode::KeyExists();
         continue;
       }
     }
+    order[unique_count++] = order[i];
+  }
 
-    if (current.IsVisible()) {
-      auto current_size = current.GetKeyLength();
-      if (current_size == key_size &&
-          KeyCompare(key, key_size, GetKey(current), current_size) == 0) {
-        if (out_metadata_ptr) {
-          *out_metadata_ptr = record_metadata + i;
-        }
-        return current;
+  uint64_t freeze_retry = 0;
+  uint32_t next = 0;
+  while (next < unique_count) {
+    stack.Clear();
+    EpochScope guard(GetPMWCASPool()->GetEpoch());
+    auto first = order[next];
+    LeafNode *node = TraverseToLeaf(&stack, keys[first], key_sizes[first]);
+
+    // All following keys up to the leaf's upper bound go to this leaf
+    const char *bound = nullptr;
+    uint32_t bound_size = 0;
+    bool has_bound = GetLeafUpperBound(&stack, &bound, &bound_size);
+    run_keys.clear();
+    run_sizes.clear();
+    run_payloads.clear();
+    for (uint32_t i = next; i < unique_count; ++i) {
+      auto idx = order[i];
+      if (has_bound && BaseNode::KeyCompare(keys[idx], key_sizes[idx], bound, bound_size) > 0) {
+        break;
+      }
+      run_keys.emplace_back(keys[idx]);
+      run_sizes.emplace_back(key_sizes[idx]);
+      run_payloads.emplace_back(payloads[idx]);
+    }
+    run_rcs.resize(run_keys.size());
+
+    uint32_t done = 0;
+    VersionWriter versions(this);
+    auto rc = node->InsertBatch(run_keys.data(), run_sizes.data(), run_payloads.data(),
+                                static_cast<uint32_t>(run_keys.size()), run_rcs.data(), &done,
+                                GetPMWCASPool(), parameters.split_threshold, versions.Get(),
+                                !parameters.duplicate_keys);
+    for (uint32_t i = 0; i < done; ++i) {
+      rcs[order[next + i]] = run_rcs[i];
+      if (run_rcs[i].IsOk()) {
+        PublishChange(ChangeFeed::kInsert, run_keys[i], run_sizes[i], run_payloads[i]);
       }
     }
+    next += done;
+    if (done > 0) {
+      freeze_retry = 0;
+    }
+    if (!rc.IsOk()) {
+      SplitOrConsolidate(&stack, node, rc, &freeze_retry);
+    } else {
+      KeepLeafSorted(&stack, node);
+    }
   }
-  return RecordMetadata{0};
 }
 
-ReturnCode LeafNode::Delete(const char *key,
-                            uint16_t key_size,
-                            pmwcas::DescriptorPool *pmwcas_pool) {
-  retry:
-  NodeHeader::StatusWord old_status = header.GetStatus();
-  if (old_status.IsFrozen()) {
-    return ReturnCode::NodeFrozen();
+void BzTree::MultiRead(const char *const *keys, const uint16_t *key_sizes, uint32_t count,
+                       uint64_t *payloads, ReturnCode *rcs) {
+  thread_local std::vector<LeafNode *> leaves;
+  leaves.resize(count);
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  TraverseToLeaves(keys, key_sizes, count, leaves.data());
+  for (uint32_t i = 0; i < count; ++i) {
+    rcs[i] = leaves[i]->Read(keys[i], key_sizes[i], &payloads[i], GetPMWCASPool());
+    if (rcs[i].IsNotFound() && parameters.duplicate_keys) {
+      // The key's records might go on in later leaves
+      rcs[i] = ReadProtected(keys[i], key_sizes[i], &payloads[i]);
+    }
   }
+}
 
-  RecordMetadata *meta_ptr = nullptr;
-  auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
-  if (metadata.IsVacant()) {
-    return ReturnCode::NotFound();
-  } else if (metadata.IsInserting()) {
-    // FIXME(hao): not mentioned in the paper, should confirm later;
-    goto retry;
+void BzTree::MultiRead(const char *const *keys, const uint16_t *key_sizes, uint32_t count,
+                       char *const *payloads, uint32_t *payload_sizes, ReturnCode *rcs) {
+  thread_local std::vector<LeafNode *> leaves;
+  leaves.resize(count);
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  TraverseToLeaves(keys, key_sizes, count, leaves.data());
+  for (uint32_t i = 0; i < count; ++i) {
+    rcs[i] = leaves[i]->Read(keys[i], key_sizes[i], payloads[i], &payload_sizes[i],
+                             GetPMWCASPool());
+    if (rcs[i].IsNotFound() && parameters.duplicate_keys) {
+      rcs[i] = Read(keys[i], key_sizes[i], payloads[i], &payload_sizes[i]);
+    }
   }
+}
 
-  auto new_meta = metadata;
-  new_meta.SetVisible(false);
+ReturnCode BzTree::Update(const char *key, uint16_t key_size, uint64_t payload) {
+  thread_local Stack stack;
+  stack.tree = this;
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  return UpdateProtected(&stack, key, key_size, payload);
+}
 
-  auto new_status = old_status;
-  auto old_delete_size = old_status.GetDeletedSize();
-  new_status.SetDeleteSize(old_delete_size + metadata.GetTotalLength());
+ReturnCode BzTree::Update(Session *session, const char *key, uint16_t key_size,
+                          uint64_t payload) {
+  ++session->operations[kOpUpdate];
+  return UpdateProtected(&session->stack, key, key_size, payload, session);
+}
 
-  pmwcas::Descriptor *pd = pmwcas_pool->AllocateDescriptor();
-  pd->AddEntry(&(&header.status)->word, old_status.word, new_status.word);
-  pd->AddEntry(&meta_ptr->meta, metadata.meta, new_meta.meta);
-  if (!pd->MwCAS()) {
-    goto retry;
+ReturnCode BzTree::UpdateProtected(Stack *stack, const char *key, uint16_t key_size,
+                                   uint64_t payload, Session *session) {
+  LatencyTimer timer(this, BzTree::kOpUpdate);
+  uint64_t freeze_retry = 0;
+  ReturnCode rc;
+  VersionWriter versions(this);
+  while (true) {
+    LeafNode *node = TraverseFromFinger(stack, session, key, key_size);
+    if (node == nullptr) {
+      return ReturnCode::NotFound();
+    }
+    do {
+      rc = node->Update(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold,
+                        single_word_update.load(std::memory_order_relaxed), versions.Get());
+    } while (rc.IsNotFound() && (node = NextLeafOfKey(stack, key, key_size)));
+    if (rc.IsOk()) {
+      PublishChange(ChangeFeed::kUpdate, key, key_size, payload);
+    }
+    if (!rc.IsNotEnoughSpace() && !rc.IsNodeFrozen()) {
+      return rc;
+    }
+    SplitOrConsolidate(stack, node, rc, &freeze_retry);
   }
-  return ReturnCode::Ok();
 }
-ReturnCode LeafNode::Read(const char *key, uint16_t key_size, uint64_t *payload,
-                          pmwcas::DescriptorPool *pmwcas_pool) {
-  auto meta = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, nullptr,
-                               0, (uint32_t) -1, false);
-  if (meta.IsVacant()) {
-    return ReturnCode::NotFound();
+
+ReturnCode BzTree::Update(const char *key, uint16_t key_size, const char *payload,
+                          uint32_t payload_size) {
+  LatencyTimer timer(this, BzTree::kOpUpdate);
+  if (RecordMetadata::PadKeyLength(key_size) + payload_size > GetMaxRecordSize()) {
+    return ReturnCode::NotEnoughSpace();
+  }
+  thread_local Stack stack;
+  stack.tree = this;
+  uint64_t freeze_retry = 0;
+  ReturnCode rc;
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  VersionWriter versions(this);
+  while (true) {
+    stack.Clear();
+    LeafNode *node = TraverseToLeaf(&stack, key, key_size);
+    if (node == nullptr) {
+      return ReturnCode::NotFound();
+    }
+    do {
+      rc = node->Update(key, key_size, payload, payload_size, GetPMWCASPool(),
+                        parameters.split_threshold, versions.Get());
+    } while (rc.IsNotFound() && (node = NextLeafOfKey(&stack, key, key_size)));
+    if (rc.IsOk()) {
+      PublishChange(ChangeFeed::kUpdate, key, key_size, 0, payload, payload_size);
+    }
+    if (!rc.IsNotEnoughSpace() && !rc.IsNodeFrozen()) {
+      return rc;
+    }
+    SplitOrConsolidate(&stack, node, rc, &freeze_retry);
   }
+}
 
-  char *source_addr = (reinterpret_cast<char *>(this) + meta.GetOffset());
-  *payload = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
-      source_addr + meta.GetPaddedKeyLength())->GetValueProtected();
-  return ReturnCode::Ok();
+ReturnCode BzTree::Upsert(const char *key, uint16_t key_size, uint64_t payload) {
+  thread_local Stack stack;
+  stack.tree = this;
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  return UpsertProtected(&stack, key, key_size, payload);
 }
-ReturnCode LeafNode::RangeScanBySize(const char *key1,
-                                     uint32_t size1,
-                                     uint32_t to_scan,
-                                     std::list<std::unique_ptr<Record>> *result,
-                                     pmwcas::DescriptorPool *pmwcas_pool) {
-  thread_local std::vector<Record *> tmp_result;
-  tmp_result.clear();
 
-  if (to_scan == 0) {
-    return ReturnCode::Ok();
-  }
+ReturnCode BzTree::Upsert(Session *session, const char *key, uint16_t key_size,
+                          uint64_t payload) {
+  ++session->operations[kOpUpsert];
+  return UpsertProtected(&session->stack, key, key_size, payload, session);
+}
 
-  // Enter a new epoch and copy data
-  pmwcas::EpochGuard guard(pmwcas_pool->GetEpoch());
+ReturnCode BzTree::UpsertProtected(Stack *stack, const char *key, uint16_t key_size,
+                                   uint64_t payload, Session *session) {
+  LatencyTimer timer(this, BzTree::kOpUpsert);
+  uint64_t freeze_retry = 0;
+  VersionWriter versions(this);
+  while (true) {
+    LeafNode *node = FindLeafOfKey(stack, key, key_size,
+                                   TraverseFromFinger(stack, session, key, key_size));
+    auto rc = node->Upsert(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold,
+                           single_word_update.load(std::memory_order_relaxed), versions.Get());
+    if (!rc.IsNotEnoughSpace() && !rc.IsNodeFrozen()) {
+      if (rc.IsOk()) {
+        PublishChange(ChangeFeed::kUpsert, key, key_size, payload);
+      }
+      HintFullLeaf(node, key, key_size);
+      KeepLeafSorted(stack, node);
+      return rc;
+    }
+    SplitOrConsolidate(stack, node, rc, &freeze_retry);
+  }
+}
 
-  // Have to scan all keys
-  auto count = header.GetStatus().GetRecordCount();
-  for (uint32_t i = 0; i < count; ++i) {
-    auto curr_meta = GetMetadata(i);
-    if (curr_meta.IsVisible()) {
-      int cmp = KeyCompare(key1, size1, GetKey(curr_meta), curr_meta.GetKeyLength());
-      if (cmp <= 0) {
-        tmp_result.emplace_back(Record::New(curr_meta, this));
+ReturnCode BzTree::Upsert(const char *key, uint16_t key_size, const char *payload,
+                          uint32_t payload_size) {
+  LatencyTimer timer(this, BzTree::kOpUpsert);
+  if (RecordMetadata::PadKeyLength(key_size) + payload_size > GetMaxRecordSize()) {
+    return ReturnCode::NotEnoughSpace();
+  }
+  thread_local Stack stack;
+  stack.tree = this;
+  uint64_t freeze_retry = 0;
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  VersionWriter versions(this);
+  while (true) {
+    stack.Clear();
+    LeafNode *node = FindLeafOfKey(&stack, key, key_size, TraverseToLeaf(&stack, key, key_size));
+    auto rc = node->Upsert(key, key_size, payload, payload_size, GetPMWCASPool(),
+                           parameters.split_threshold, versions.Get());
+    if (!rc.IsNotEnoughSpace() && !rc.IsNodeFrozen()) {
+      if (rc.IsOk()) {
+        PublishChange(ChangeFeed::kUpsert, key, key_size, 0, payload, payload_size);
       }
+      HintFullLeaf(node, key, key_size);
+      KeepLeafSorted(&stack, node);
+      return rc;
+    }
+    SplitOrConsolidate(&stack, node, rc, &freeze_retry);
+  }
+}
+
+ReturnCode BzTree::CompareAndSwap(const char *key, uint16_t key_size, uint64_t *expected,
+                                  uint64_t desired) {
+  LatencyTimer timer(this, BzTree::kOpUpdate);
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  VersionWriter versions(this);
+  ReturnCode rc;
+  uint32_t attempt = 0;
+  thread_local Stack stack;
+  stack.tree = this;
+  while (true) {
+    stack.Clear();
+    LeafNode *node = TraverseToLeaf(parameters.duplicate_keys ? &stack : nullptr, key, key_size);
+    do {
+      rc = node->CompareAndSwap(key, key_size, expected, desired, GetPMWCASPool(),
+                                versions.Get());
+    } while (rc.IsNotFound() && (node = NextLeafOfKey(&stack, key, key_size)));
+    if (!rc.IsNodeFrozen()) {
+      break;
+    }
+    ContentionManager::Pause(++attempt);
+  }
+  if (rc.IsOk()) {
+    PublishChange(ChangeFeed::kUpdate, key, key_size, desired);
+  }
+  return rc;
+}
+
+ReturnCode BzTree::FetchAdd(const char *key, uint16_t key_size, uint64_t delta,
+                            uint64_t *old_payload) {
+  LatencyTimer timer(this, BzTree::kOpUpdate);
+  uint64_t old = 0;
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  VersionWriter versions(this);
+  ReturnCode rc;
+  uint32_t attempt = 0;
+  thread_local Stack stack;
+  stack.tree = this;
+  while (true) {
+    stack.Clear();
+    LeafNode *node = TraverseToLeaf(parameters.duplicate_keys ? &stack : nullptr, key, key_size);
+    do {
+      rc = node->FetchAdd(key, key_size, delta, &old, GetPMWCASPool(), versions.Get());
+    } while (rc.IsNotFound() && (node = NextLeafOfKey(&stack, key, key_size)));
+    if (!rc.IsNodeFrozen()) {
+      break;
+    }
+    ContentionManager::Pause(++attempt);
+  }
+  if (rc.IsOk()) {
+    PublishChange(ChangeFeed::kUpdate, key, key_size, old + delta);
+    if (old_payload) {
+      *old_payload = old;
     }
   }
+  return rc;
+}
 
-  std::sort(tmp_result.begin(), tmp_result.end(),
-            [this](Record *a, Record *b) -> bool {
-              auto cmp = KeyCompare(a->GetKey(), a->meta.GetKeyLength(),
-                                    b->GetKey(), b->meta.GetKeyLength());
-              return cmp < 0;
-            });
+ReturnCode BzTree::Delete(const char *key, uint16_t key_size) {
+  thread_local Stack stack;
+  stack.tree = this;
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  return DeleteProtected(&stack, key, key_size);
+}
+
+ReturnCode BzTree::Delete(Session *session, const char *key, uint16_t key_size) {
+  ++session->operations[kOpDelete];
+  return DeleteProtected(&session->stack, key, key_size, session);
+}
+
+ReturnCode BzTree::DeleteProtected(Stack *stack, const char *key, uint16_t key_size,
+                                   Session *session) {
+  LatencyTimer timer(this, BzTree::kOpDelete);
+  ReturnCode rc;
+  VersionWriter versions(this);
+  LeafNode *node;
+  uint32_t attempt = 0;
+  while (true) {
+    if (session && session->finger_search) {
+      node = TraverseFromFinger(stack, session, key, key_size);
+    } else {
+      stack->Clear();
+      node = TraverseToLeaf(parameters.duplicate_keys ? stack : nullptr, key, key_size);
+    }
+    if (node == nullptr) {
+      return ReturnCode::NotFound();
+    }
+    do {
+      rc = node->Delete(key, key_size, GetPMWCASPool(), versions.Get());
+    } while (rc.IsNotFound() && (node = NextLeafOfKey(stack, key, key_size)));
+    if (!rc.IsNodeFrozen()) {
+      break;
+    }
+    ContentionManager::Pause(++attempt);
+  }
 
-  for (auto item : tmp_result) {
-    result->emplace_back(item);
+  if (rc.IsOk()) {
+    PublishChange(ChangeFeed::kDelete, key, key_size, 0);
   }
-  return ReturnCode::Ok();
+  if (!rc.IsOk() || ENABLE_MERGE == 0) {
+    // delete failed
+    return rc;
+  }
+  if (auto *workers = maintenance.load(std::memory_order_relaxed)) {
+    AddMaintenanceHint(workers, node, key, key_size, true);
+    return rc;
+  }
+
+  // finished record delete, now check if we can merge siblings
+  uint32_t freeze_retry = 0;
+  do {
+    rc = node->CheckMerge(stack, key, key_size, freeze_retry < MAX_FREEZE_RETRY);
+    if (rc.IsOk()) {
+      return rc;
+    }
+    stack->Clear();
+    node = TraverseToLeaf(stack, key, key_size, GetPMWCASPool());
+    if (rc.IsNodeFrozen()) {
+      freeze_retry += 1;
+      ContentionManager::Pause(freeze_retry);
+    }
+  } while (rc.IsNodeFrozen() || rc.IsPMWCASFailure());
+  ALWAYS_ASSERT(false);
+  return rc;  // Just to silence the compiler
 }
 
-ReturnCode LeafNode::RangeScanByKey(const char *key1,
-                                    uint32_t size1,
-                                    const char *key2,
-                                    uint32_t size2,
-                                    std::vector<Record *> *result,
-                                    pmwcas::DescriptorPool *pmwcas_pool) {
-  // entering a new epoch and copying the data
-  pmwcas::EpochGuard guard(pmwcas_pool->GetEpoch());
+ReturnCode BzTree::DeleteRange(const char *lo, uint16_t lo_size,
+                               const char *hi, uint16_t hi_size) {
+  thread_local Stack stack;
+  stack.tree = this;
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  if (BaseNode::KeyCompare(lo, lo_size, hi, hi_size) >= 0) {
+    return ReturnCode::Ok();
+  }
 
-  // scan the sorted fields first
-  uint32_t i = 0;
-  auto count = header.GetStatus().GetRecordCount();
-  while (i < count) {
-    auto curr_meta = GetMetadata(i);
-    if (!curr_meta.IsVisible()) {
-      i += 1;
-      continue;
+  // Visit the leaves in key order: the one holding [lo], then each one right
+  // of the upper bound of the last one handled, until one reaches [hi]. With
+  // duplicate keys that's the one past the leaves of the bound's run handled
+  // so far ([skip]), see TraverseToRunLeaf.
+  std::string from(lo, lo_size);
+  bool include_from = true;
+  uint32_t skip = 0;
+  std::string next;
+  uint32_t attempt = 0;
+  while (true) {
+    LeafNode *node = nullptr;
+    if (include_from) {
+      node = TraverseToRunLeaf(&stack, from.data(), static_cast<uint16_t>(from.size()), skip);
+    } else {
+      stack.Clear();
+      node = TraverseToLeaf(&stack, from.data(), static_cast<uint16_t>(from.size()), false);
     }
-    char *curr_key;
-    GetRawRecord(curr_meta, &curr_key, nullptr, pmwcas_pool->GetEpoch());
-    auto range_code = KeyInRange(curr_key, curr_meta.GetKeyLength(), key1, size1, key2, size2);
-    if (range_code == 0) {
-      result->emplace_back(Record::New(curr_meta, this));
-    } else if (range_code == 1 && i < header.sorted_count) {
-      // current key is larger than upper bound
-      // jump to the unsorted field
-      i = header.sorted_count;
+    if (!node) {
+      ContentionManager::Pause(++attempt);
       continue;
     }
-    i += 1;
-  }
-  std::sort(result->begin(), result->end(),
-            [this](Record *a, Record *b) -> bool {
-              auto cmp = BaseNode::KeyCompare(a->GetKey(), a->meta.GetKeyLength(),
-                                              b->GetKey(), b->meta.GetKeyLength());
-              return cmp < 0;
-            });
-  return ReturnCode::Ok();
-}
-
-bool BaseNode::Freeze(pmwcas::DescriptorPool *pmwcas_pool) {
-  NodeHeader::StatusWord expected = header.GetStatus();
-  if (expected.IsFrozen()) {
-    return false;
+    const char *bound = nullptr;
+    uint32_t bound_size = 0;
+    bool covered = GetLeafLowerBound(&stack, &bound, &bound_size) ?
+        BaseNode::KeyCompare(bound, bound_size, lo, lo_size) >= 0 : lo_size == 0;
+    bool last = !GetLeafUpperBound(&stack, &bound, &bound_size) ||
+        BaseNode::KeyCompare(bound, bound_size, hi, hi_size) >= 0;
+    if (covered && !last && stack.num_frames > 0 && !node->IsFrozen()) {
+      auto rc = DropLeaves(&stack, hi, hi_size, &next);
+      if (!rc.IsOk()) {
+        ContentionManager::Pause(++attempt);
+        continue;
+      }
+    } else {
+      // Partly covered, or frozen: the copy replaces the node whoever froze it
+      if (!node->IsFrozen() && !node->Freeze(GetPMWCASPool())) {
+        ContentionManager::Pause(++attempt);
+        continue;
+      }
+      if (!ConsolidateLeaf(&stack, node, lo, lo_size, hi, hi_size)) {
+        ContentionManager::Pause(++attempt);
+        continue;
+      }
+      if (last) {
+        PublishChange(ChangeFeed::kDeleteRange, lo, lo_size, 0, hi, hi_size);
+        return ReturnCode::Ok();
+      }
+      next.assign(bound, bound_size);
+    }
+    // What's dropped is replaced by a single leaf, the last one of [next]
+    // handled so far
+    skip = from == next ? skip + 1 : 1;
+    from.swap(next);
+    include_from = parameters.duplicate_keys;
+    attempt = 0;
   }
-
-  pmwcas::Descriptor *pd = pmwcas_pool->AllocateDescriptor();
-  pd->AddEntry(&(&header.status)->word, expected.word, expected.Freeze().word);
-  return pd->MwCAS();
 }
 
-LeafNode *LeafNode::Consolidate(pmwcas::DescriptorPool *pmwcas_pool) {
-  // Freeze the node to prevent new modifications first
-  if (!Freeze(pmwcas_pool)) {
-    return nullptr;
-  }
-
-  thread_local std::vector<RecordMetadata> meta_vec;
-  meta_vec.clear();
-  SortMetadataByKey(meta_vec, true, pmwcas_pool->GetEpoch());
-
-  // Allocate and populate a new node
-  LeafNode *new_leaf = nullptr;
-  LeafNode::New(&new_leaf, this->header.size);
-  new_leaf->CopyFrom(this, meta_vec.begin(), meta_vec.end(), pmwcas_pool->GetEpoch());
-
+TreeCatalog::TreeCatalog(pmwcas::DescriptorPool *pool, uint64_t pmdk_addr)
+    : pmdk_addr(pmdk_addr) {
+#ifdef PMDK
+  pmwcas_pool = Allocator::Get()->GetOffset(pool);
+#else
+  pmwcas_pool = pool;
+#endif
+  memset(entries, 0, sizeof(entries));
 #ifdef PMEM
-  pmwcas::NVRAM::Flush(this->header.size, new_leaf);
+  PersistBatch::Add(this, sizeof(TreeCatalog));
+  PersistBatch::Drain();
 #endif
-
-  return new_leaf;
 }
 
-uint32_t LeafNode::SortMetadataByKey(std::vector<RecordMetadata> &vec,
-                                     bool visible_only,
-                                     pmwcas::EpochManager *epoch) {
-  // Node is frozen at this point
-  // there should not be any on-going pmwcas
-  assert(header.status.IsFrozen());
-  uint32_t total_size = 0;
-  uint32_t count = header.GetStatus().GetRecordCount();
-  for (uint32_t i = 0; i < count; ++i) {
-    // TODO(tzwang): handle deletes
-    auto meta = record_metadata[i];
-    if (meta.IsVisible()) {
-      vec.emplace_back(meta);
-      total_size += (meta.GetTotalLength());
-      assert(meta.GetTotalLength());
+TreeCatalog::~TreeCatalog() {
+  for (uint32_t i = 0; i < kMaxTrees; ++i) {
+    if (auto *entry = GetEntry(i)) {
+      entry->tree.~BzTree();
+#ifndef PMEM
+      pmwcas::Allocator::Get()->Free(entry);
+#endif
     }
   }
-
-  // Lambda for comparing two keys
-  auto key_cmp = [this](RecordMetadata &m1, RecordMetadata &m2) -> bool {
-    auto l1 = m1.GetKeyLength();
-    auto l2 = m2.GetKeyLength();
-    char *k1 = GetKey(m1);
-    char *k2 = GetKey(m2);
-    return KeyCompare(k1, l1, k2, l2) < 0;
-  };
-
-  std::sort(vec.begin(), vec.end(), key_cmp);
-  return total_size;
 }
 
-void LeafNode::CopyFrom(LeafNode *node,
-                        std::vector<RecordMetadata>::iterator begin_it,
-                        std::vector<RecordMetadata>::iterator end_it,
-                        pmwcas::EpochManager *epoch) {
-  // meta_vec is assumed to be in sorted order, insert records one by one
-  uint32_t offset = this->header.size;
-  uint16_t nrecords = 0;
-  for (auto it = begin_it; it != end_it; ++it) {
-    auto meta = *it;
-    uint64_t payload = 0;
-    char *key;
-    node->GetRawRecord(meta, &key, &payload, epoch);
-
-    // Copy data
-    assert(meta.GetTotalLength() >= sizeof(uint64_t));
-    uint64_t total_len = meta.GetTotalLength();
-    assert(offset >= total_len);
-    offset -= total_len;
-    char *ptr = &(reinterpret_cast<char *>(this))[offset];
-    memcpy(ptr, key, total_len);
-
-    // Setup new metadata
-    record_metadata[nrecords].FinalizeForInsert(offset, meta.GetKeyLength(), total_len);
-    ++nrecords;
-  }
-  // Finalize header stats
-  header.status.SetBlockSize(this->header.size - offset);
-  header.status.SetRecordCount(nrecords);
-  header.sorted_count = nrecords;
+TreeCatalog::Entry *TreeCatalog::GetEntry(uint32_t slot) {
+  auto *entry = reinterpret_cast<Entry *>(
+      reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(&entries[slot])->GetValueProtected());
 #ifdef PMDK
-  Allocator::Get()->PersistPtr(this, this->header.size);
+  return entry ? Allocator::Get()->GetDirect(entry) : nullptr;
+#else
+  return entry;
 #endif
 }
 
-void InternalNode::DeleteRecord(uint32_t meta_to_update,
-                                uint64_t new_child_ptr,
-                                bztree::InternalNode **new_node) {
-  uint32_t meta_to_delete = meta_to_update + 1;
-  uint32_t offset = this->header.size -
-      this->record_metadata[meta_to_delete].GetTotalLength() - sizeof(RecordMetadata);
-  InternalNode::New(new_node, offset);
-
-  uint32_t insert_idx = 0;
-  for (uint32_t i = 0; i < this->header.sorted_count; i += 1) {
-    if (i == meta_to_delete) {
-      continue;
-    }
-    RecordMetadata meta = record_metadata[i];
-    uint64_t m_payload = 0;
-    char *m_key = nullptr;
-    char *m_data = nullptr;
-    GetRawRecord(meta, &m_data, &m_key, &m_payload);
-    auto m_key_size = meta.GetKeyLength();
-    offset -= meta.GetTotalLength();
-    (*new_node)->record_metadata[insert_idx].
-        FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
-    auto ptr = reinterpret_cast<char *>(*new_node) + offset;
-    if (i == meta_to_update) {
-      memcpy(ptr, m_data, meta.GetKeyLength());
-      memcpy(ptr + meta.GetPaddedKeyLength(), &new_child_ptr, sizeof(uint64_t));
-    } else {
-      memcpy(ptr, m_data, meta.GetTotalLength());
+uint32_t TreeCatalog::Find(const char *name, uint32_t name_size) {
+  for (uint32_t i = 0; i < kMaxTrees; ++i) {
+    auto *entry = GetEntry(i);
+    if (entry && entry->name_size == name_size && memcmp(entry->name, name, name_size) == 0) {
+      return i;
     }
-    insert_idx += 1;
   }
-  (*new_node)->header.sorted_count = insert_idx;
-#ifdef PMEM
-  pmwcas::NVRAM::Flush((*new_node)->header.size, *new_node);
-#endif
+  return kMaxTrees;
 }
 
-ReturnCode BaseNode::CheckMerge(bztree::Stack *stack, const char *key,
-                                uint32_t key_size, bool backoff) {
-  uint32_t merge_threshold = stack->tree->parameters.merge_threshold;
-  auto pmwcas_pool = stack->tree->GetPMWCASPool();
-  auto epoch = pmwcas_pool->GetEpoch();
-  if (!IsLeaf() && GetHeader()->size > merge_threshold) {
-    // we're internal node, large enough, we are good
-    return ReturnCode::Ok();
-  } else {
-    // we're leaf node, large enough
-    auto old_status = GetHeader()->GetStatus();
-    auto valid_size = LeafNode::GetUsedSpace(old_status) - old_status.GetDeletedSize();
-    if (valid_size > merge_threshold) {
-      return ReturnCode::Ok();
+#ifdef PMEM
+BzTree::RecoveryTimes TreeCatalog::Recovery() {
+  new(&latch) std::mutex();
+  auto start = std::chrono::steady_clock::now();
+  GetPMWCASPool()->Recovery(false);
+  BzTree::RecoveryTimes times;
+  times.descriptor_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  times.tree_us = 0;
+
+  // Trees created at different times may have different epochs; move them
+  // all past the largest one so no tree has its records of before the crash
+  // taken as being inserted
+  uint64_t epoch = global_epoch;
+  for (uint32_t i = 0; i < kMaxTrees; ++i) {
+    if (auto *entry = GetEntry(i)) {
+      epoch = std::max(epoch, entry->tree.index_epoch);
     }
   }
-
-  // too small, trying to merge siblings
-  // start by checking parent node
-  auto parent_frame = stack->Pop();
-  if (!parent_frame) {
-    // we are root node, ok
-    return ReturnCode::Ok();
-  }
-
-  InternalNode *parent = parent_frame->node;
-  uint32_t sibling_index = 0;
-
-  auto should_merge = [&](uint32_t meta_index) -> bool {
-    if (meta_index < 0 || meta_index >= parent->GetHeader()->sorted_count) {
-      return false;
-    }
-    auto sibling = parent->GetChildByMetaIndex(meta_index, epoch);
-    if (sibling->IsLeaf()) {
-      auto status = sibling->GetHeader()->GetStatus();
-      auto valid_size = LeafNode::GetUsedSpace(status) - status.GetDeletedSize();
-      return valid_size < merge_threshold;
-    } else {
-      return sibling->GetHeader()->size < merge_threshold;
+  for (uint32_t i = 0; i < kMaxTrees; ++i) {
+    if (auto *entry = GetEntry(i)) {
+      entry->tree.index_epoch = epoch;
+      times.tree_us += entry->tree.Recovery(false).tree_us;
     }
-  };
-
-  if (should_merge(parent_frame->meta_index - 1)) {
-    sibling_index = parent_frame->meta_index - 1;
-  } else if (should_merge(parent_frame->meta_index + 1)) {
-    sibling_index = parent_frame->meta_index + 1;
-  } else {
-    // Both left sibling and right sibling are good, we stay unchanged
-    // if (!backoff) {
-    // }
-    return ReturnCode::Ok();
   }
+  global_epoch = epoch + 1;
+  return times;
+}
+#endif
 
-  // we found a suitable sibling
-  // do the real merge
-  BaseNode *sibling = parent->GetChildByMetaIndex(sibling_index, epoch);
-
-  // Phase 1: freeze both nodes, and their parent
-  auto node_status = this->GetHeader()->GetStatus();
-  auto sibling_status = sibling->GetHeader()->GetStatus();
-  auto parent_status = parent->GetHeader()->GetStatus();
-
-  if (backoff && (node_status.IsFrozen() ||
-      sibling_status.IsFrozen() || parent_status.IsFrozen())) {
-    return ReturnCode::NodeFrozen();
+ReturnCode TreeCatalog::Create(const char *name, const BzTree::ParameterSet &param,
+                               BzTree **tree) {
+  uint32_t name_size = strlen(name);
+  if (name_size > kMaxNameSize) {
+    return ReturnCode::NotEnoughSpace();
+  }
+  std::lock_guard<std::mutex> lock(latch);
+  if (Find(name, name_size) < kMaxTrees) {
+    return ReturnCode::KeyExists();
+  }
+  uint32_t slot = 0;
+  while (slot < kMaxTrees && GetEntry(slot)) {
+    ++slot;
+  }
+  if (slot == kMaxTrees) {
+    return ReturnCode::NotEnoughSpace();
   }
 
-  auto *pd = pmwcas_pool->AllocateDescriptor();
-  pd->AddEntry(&(&this->GetHeader()->status)->word,
-               node_status.word, node_status.Freeze().word);
-  pd->AddEntry(&(&sibling->GetHeader()->status)->word,
-               sibling_status.word, sibling_status.Freeze().word);
-  pd->AddEntry(&(&parent->GetHeader()->status)->word,
-               parent_status.word, parent_status.Freeze().word);
-  if (!pd->MwCAS()) {
-    return ReturnCode::PMWCASFailure();
+  // The entry is allocated into the descriptor, so that it's freed if the
+  // PMwCAS doesn't make it through a crash. The tree is built outside the
+  // epoch guard as its constructor takes one of its own.
+  auto *pool = GetPMWCASPool();
+  pmwcas::Descriptor *pd = nullptr;
+  Entry *entry = nullptr;
+  uint64_t *entry_ptr = nullptr;
+  {
+    EpochScope guard(pool->GetEpoch());
+    pd = pool->AllocateDescriptor();
+    auto index = pd->ReserveAndAddEntry(&entries[slot], 0,
+                                        pmwcas::Descriptor::kRecycleOnRecovery);
+    entry_ptr = pd->GetNewValuePtr(index);
+#ifdef PMDK
+    Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(entry_ptr), sizeof(Entry));
+#else
+    pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(entry_ptr), sizeof(Entry));
+#endif
+    entry = reinterpret_cast<Entry *>(*entry_ptr);
   }
+  memset(entry->name, 0, kMaxNameSize);
+  memcpy(entry->name, name, name_size);
+  entry->name_size = name_size;
+  new(&entry->tree) BzTree(param, pool, pmdk_addr);
+#ifdef PMEM
+  PersistBatch::Add(entry, sizeof(Entry));
+#endif
+#ifdef PMDK
+  *entry_ptr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(entry));
+#endif
 
-  // Phase 2: allocate parent and new node
-  pd = pmwcas_pool->AllocateDescriptor();
-  pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
-                         reinterpret_cast<uint64_t>(nullptr),
-                         pmwcas::Descriptor::kRecycleOnRecovery);
-  pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
-                         reinterpret_cast<uint64_t>(nullptr),
-                         pmwcas::Descriptor::kRecycleOnRecovery);
-  auto *new_parent = reinterpret_cast<InternalNode **>(pd->GetNewValuePtr(0));
-  auto *new_node = reinterpret_cast<BaseNode **>(pd->GetNewValuePtr(1));
+  EpochScope guard(pool->GetEpoch());
+  PersistBatch::Drain();
+  bool installed = RunMwCAS(pd);
+  ALWAYS_ASSERT(installed);  // The latch keeps other creates and drops away
+  *tree = &entry->tree;
+  return ReturnCode::Ok();
+}
 
-  // lambda wrapper for merge leaf nodes
-  auto merge_leaf_nodes = [&](uint32_t left_index, LeafNode *left_node, LeafNode *right_node) {
-    LeafNode::MergeNodes(left_node, right_node,
-                         reinterpret_cast<LeafNode **>(new_node));
-    parent->DeleteRecord(left_index,
-                         reinterpret_cast<uint64_t>(*new_node),
-                         new_parent);
-  };
-  // lambda wrapper for merge internal nodes
-  auto merge_internal_nodes = [&](uint32_t left_node_index,
-                                  InternalNode *left_node, InternalNode *right_node) {
-    // get the key for right node
-    RecordMetadata right_meta = parent->record_metadata[left_node_index + 1];
-    char *new_key = nullptr;
-    parent->GetRawRecord(right_meta, nullptr, &new_key, nullptr);
-    assert(right_meta.GetKeyLength() != 0);
-    InternalNode::MergeNodes(left_node, right_node, new_key, right_meta.GetKeyLength(),
-                             reinterpret_cast<InternalNode **> (new_node));
-    parent->DeleteRecord(left_node_index,
-                         reinterpret_cast<uint64_t>(*new_node),
-                         new_parent);
-  };
+BzTree *TreeCatalog::Open(const char *name) {
+  std::lock_guard<std::mutex> lock(latch);
+  uint32_t slot = Find(name, strlen(name));
+  return slot < kMaxTrees ? &GetEntry(slot)->tree : nullptr;
+}
 
-  // Phase 3: merge and init nodes
-  if (sibling_index < parent_frame->meta_index) {
-    IsLeaf() ?
-    merge_leaf_nodes(sibling_index,
-                     reinterpret_cast<LeafNode *>(sibling),
-                     reinterpret_cast<LeafNode *>(this)) :
-    merge_internal_nodes(sibling_index,
-                         reinterpret_cast<InternalNode *>(sibling),
-                         reinterpret_cast<InternalNode *>(this));
-  } else {
-    IsLeaf() ?
-    merge_leaf_nodes(parent_frame->meta_index,
-                     reinterpret_cast<LeafNode *>(this),
-                     reinterpret_cast<LeafNode *>(sibling)) :
-    merge_internal_nodes(parent_frame->meta_index,
-                         reinterpret_cast<InternalNode *>(this),
-                         reinterpret_cast<InternalNode *>(sibling));
+ReturnCode TreeCatalog::Drop(const char *name) {
+  std::lock_guard<std::mutex> lock(latch);
+  uint32_t slot = Find(name, strlen(name));
+  if (slot == kMaxTrees) {
+    return ReturnCode::NotFound();
+  }
+  // Take the entry out first: a crash while freeing the nodes then leaks
+  // what wasn't freed yet, but the catalog never points to a partial tree
+  auto *entry = GetEntry(slot);
+  auto *pool = GetPMWCASPool();
+  {
+    EpochScope guard(pool->GetEpoch());
+    auto *pd = pool->AllocateDescriptor();
+    pd->AddEntry(&entries[slot], entries[slot], 0, pmwcas::Descriptor::kRecycleNever);
+    bool removed = RunMwCAS(pd);
+    ALWAYS_ASSERT(removed);
   }
+  entry->tree.FreeAllNodes();
+  entry->tree.~BzTree();
+#ifdef PMDK
+  Allocator::Get()->Free(entry);
+#else
+  pmwcas::Allocator::Get()->Free(entry);
+#endif
+  return ReturnCode::Ok();
+}
 
-  // Phase 4: install new nodes
-  auto grandpa_frame = stack->Top();
-  ReturnCode rc;
-  if (!grandpa_frame) {
-    rc = stack->tree->ChangeRoot(reinterpret_cast<uint64_t>(stack->GetRoot()),
-                                 reinterpret_cast<uint64_t>(*new_parent), pd) ?
-         ReturnCode::Ok() : ReturnCode::PMWCASFailure();
-    return rc;
-  } else {
-    InternalNode *grandparent = grandpa_frame->node;
-    rc = grandparent->Update(grandparent->GetMetadata(grandpa_frame->meta_index),
-                             parent, *new_parent, pd, pmwcas_pool);
-    if (!rc.IsOk()) {
-      return rc;
+void TreeCatalog::List(std::vector<std::string> *names) {
+  std::lock_guard<std::mutex> lock(latch);
+  names->clear();
+  for (uint32_t i = 0; i < kMaxTrees; ++i) {
+    if (auto *entry = GetEntry(i)) {
+      names->emplace_back(entry->name, entry->name_size);
     }
-
-    uint32_t freeze_retry = 0;
-    do {
-      // if previous merge succeeded, we move on to check new_parent
-      rc = (*new_parent)->CheckMerge(stack, key, key_size,
-                                     freeze_retry < MAX_FREEZE_RETRY);
-      if (rc.IsOk()) {
-        return rc;
-      }
-      freeze_retry += 1;
-      stack->Clear();
-      BaseNode *landed_on = stack->tree->TraverseToNode(stack, key, key_size, *new_parent);
-      if (landed_on != *new_parent) {
-        // we landed on a leaf node
-        // means the *new_parent has been swapped out
-        // either splitted or merged
-        assert(landed_on->IsLeaf());
-        return ReturnCode::Ok();
-      }
-    } while (rc.IsNodeFrozen() || rc.IsPMWCASFailure());
-    assert(false);
   }
-  return rc;
 }
 
-ReturnCode InternalNode::Update(RecordMetadata meta,
-                                InternalNode *old_child,
-                                InternalNode *new_child,
-                                pmwcas::Descriptor *pd,
-                                pmwcas::DescriptorPool *pmwcas_pool) {
-  auto status = header.GetStatus();
-  if (status.IsFrozen()) {
-    return ReturnCode::NodeFrozen();
+ReturnCode MultiTreeWrite::Add(BzTree *tree, const char *key, uint16_t key_size,
+                               uint64_t payload, bool insert) {
+  uint32_t needed = insert ? 2 : 3;
+  if (words + needed > DESC_CAP) {
+    return ReturnCode::NotEnoughSpace();
+  }
+  // One descriptor for all, so one pool for all
+  ALWAYS_ASSERT(writes.empty() || writes[0].tree->GetPMWCASPool() == tree->GetPMWCASPool());
+  for (auto &write : writes) {
+    if (write.tree == tree && write.key.size() == key_size &&
+        memcmp(write.key.data(), key, key_size) == 0) {
+      return ReturnCode::KeyExists();
+    }
   }
+  writes.push_back(Write{tree, std::string(key, key_size), payload, insert});
+  words += needed;
+  return ReturnCode::Ok();
+}
 
-  // Conduct a 2-word PMwCAS to swap in the new child pointer while ensuring the
-  // node isn't frozen by a concurrent thread
-  pd->AddEntry(&(&header.status)->word, status.word, status.word);
-  pd->AddEntry(GetPayloadPtr(meta),
-               reinterpret_cast<uint64_t>(old_child),
-               reinterpret_cast<uint64_t>(new_child),
-               pmwcas::Descriptor::kRecycleOnRecovery);
-  if (pd->MwCAS()) {
+ReturnCode MultiTreeWrite::Insert(BzTree *tree, const char *key, uint16_t key_size,
+                                  uint64_t payload) {
+  return Add(tree, key, key_size, payload, true);
+}
+
+ReturnCode MultiTreeWrite::Update(BzTree *tree, const char *key, uint16_t key_size,
+                                  uint64_t payload) {
+  return Add(tree, key, key_size, payload, false);
+}
+
+ReturnCode MultiTreeWrite::Commit(uint32_t *failed) {
+  uint32_t count = writes.size();
+  if (count == 0) {
     return ReturnCode::Ok();
-  } else {
-    return ReturnCode::PMWCASFailure();
   }
-}
+  auto *pool = writes[0].tree->GetPMWCASPool();
+  LeafNode *leaves[DESC_CAP];
+  LeafNode::PreparedWrite prepared[DESC_CAP];
+  thread_local std::vector<VersionWriter> versions;
+  thread_local Stack stack;
+  uint64_t freeze_retry = 0;
+  // Not pmwcas_failure_streak: the traversals below reset it on every attempt
+  uint32_t attempt = 0;
 
-uint32_t InternalNode::GetChildIndex(const char *key,
-                                     uint16_t key_size,
-                                     bool get_le) {
-  // Keys in internal nodes are always sorted, visible
-  int32_t left = 0, right = header.sorted_count - 1, mid = 0;
   while (true) {
-    mid = (left + right) / 2;
-    auto meta = record_metadata[mid];
-    char *record_key = nullptr;
-    GetRawRecord(meta, nullptr, &record_key, nullptr, nullptr);
-    auto cmp = KeyCompare(key, key_size, record_key, meta.GetKeyLength());
-    if (cmp == 0) {
-      // Key exists
-      if (get_le) {
-        return static_cast<uint32_t>(mid - 1);
-      } else {
-        return static_cast<uint32_t>(mid);
+    EpochScope guard(pool->GetEpoch());
+    // Stage every write in its leaf
+    uint32_t i = 0;
+    ReturnCode rc = ReturnCode::Ok();
+    for (; i < count; ++i) {
+      auto &write = writes[i];
+      auto *tree = write.tree;
+      stack.tree = tree;
+      stack.Clear();
+      leaves[i] = tree->TraverseToLeaf(tree->parameters.duplicate_keys ? &stack : nullptr,
+                                       write.key.data(), write.key.size());
+      if (!write.insert) {
+        leaves[i] = tree->FindLeafOfKey(&stack, write.key.data(), write.key.size(), leaves[i]);
+      }
+      rc = write.insert
+          ? leaves[i]->PrepareInsert(write.key.data(), write.key.size(), write.payload, pool,
+                                     tree->parameters.split_threshold, prepared, i, &prepared[i])
+          : leaves[i]->PrepareUpdate(write.key.data(), write.key.size(), write.payload, pool,
+                                     &prepared[i]);
+      if (!rc.IsOk()) {
+        break;
       }
     }
-    if (left > right) {
-      if (cmp <= 0 && get_le) {
-        return static_cast<uint32_t>(mid - 1);
+
+    if (i == count) {
+      // All of them in one PMwCAS, with the status word of each leaf once
+      auto *pd = NewDescriptor(pool);
+      bool frozen = false;
+      for (uint32_t k = 0; k < count && !frozen; ++k) {
+        if (std::find(leaves, leaves + k, leaves[k]) == leaves + k) {
+          auto status = leaves[k]->GetHeader()->GetStatus();
+          frozen = status.IsFrozen();
+          pd->AddEntry(&leaves[k]->GetHeader()->status.word, status.word, status.word);
+        }
+      }
+      if (!frozen) {
+        for (uint32_t k = 0; k < count; ++k) {
+          pd->AddEntry(prepared[k].word, prepared[k].old_value, prepared[k].new_value);
+          if (!prepared[k].insert) {
+            pd->AddEntry(&prepared[k].meta_ptr->meta, prepared[k].meta.meta,
+                         prepared[k].meta.meta);
+          }
+        }
+        // Versions for the snapshots open on each tree
+        versions.clear();
+        for (uint32_t k = 0; k < count; ++k) {
+          versions.emplace_back(writes[k].tree);
+          if (auto *v = versions.back().Get()) {
+            auto &key = writes[k].key;
+            v->Save(key.data(), key.size(),
+                    prepared[k].insert ? nullptr : reinterpret_cast<char *>(&prepared[k].old_value),
+                    sizeof(uint64_t), false);
+          }
+        }
+        // The new records have to be persistent before they're visible
+        PersistBatch::Drain();
+        bool applied = RunMwCAS(pd);
+        for (auto &v : versions) {
+          v.Finish(applied);
+        }
+        if (applied) {
+          for (auto &write : writes) {
+            write.tree->PublishChange(write.insert ? ChangeFeed::kInsert : ChangeFeed::kUpdate,
+                                      write.key.data(), write.key.size(), write.payload);
+          }
+          return ReturnCode::Ok();
+        }
       } else {
-        return static_cast<uint32_t> (mid);
+        AbortDescriptor(pd);
+      }
+      rc = ReturnCode::PMWCASFailure();
+    }
+
+    // Give up the records reserved so far and see why
+    for (uint32_t k = 0; k < i; ++k) {
+      if (prepared[k].insert) {
+        leaves[k]->AbortInsert(prepared[k], pool);
+      }
+    }
+    auto &write = writes[std::min(i, count - 1)];
+    if (rc.IsKeyExists() || rc.IsNotFound() || (rc.IsNotEnoughSpace() && !write.insert)) {
+      if (failed) {
+        *failed = i;
       }
+      return rc;
+    } else if (rc.IsPMWCASFailure()) {
+      CountPendingStat(BzTree::kStatPMwCASFailures);
+      ContentionManager::Pause(++attempt);
     } else {
-      if (cmp > 0) {
-        left = mid + 1;
-      } else {
-        right = mid - 1;
+      // The leaf is full or frozen: split or consolidate it (or wait for
+      // whoever froze it), through a traversal that keeps the path this time
+      stack.Clear();
+      stack.tree = write.tree;
+      auto *leaf = write.tree->TraverseToLeaf(&stack, write.key.data(), write.key.size());
+      if (leaf == leaves[i]) {
+        write.tree->SplitOrConsolidate(&stack, leaf, rc, &freeze_retry);
       }
     }
   }
 }
 
-bool InternalNode::MergeNodes(InternalNode *left_node,
-                              InternalNode *right_node,
-                              const char *key, uint32_t key_size,
-                              InternalNode **new_node) {
-  uint32_t padded_keysize = RecordMetadata::PadKeyLength(key_size);
-  uint32_t offset = left_node->header.size + right_node->header.size +
-      padded_keysize - sizeof(InternalNode);
-  InternalNode::New(new_node, offset);
-  thread_local std::vector<RecordMetadata> meta_vec;
-  meta_vec.clear();
-  uint32_t cur_record = 0;
+void BzTree::WaitForEpoch() {
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  auto current = epoch->GetCurrentEpoch();
+  for (uint32_t attempt = 0;; ++attempt) {
+    epoch->BumpCurrentEpoch();
+    if (epoch->IsSafeToReclaim(current)) {
+      return;
+    }
+    WaitBriefly(attempt);
+  }
+}
 
-  InternalNode *node = *new_node;
+std::unique_ptr<Snapshot> BzTree::NewSnapshot() {
+  std::unique_ptr<Snapshot> snapshot(new Snapshot(this));
+  uint32_t slot = 0;
+  for (; slot < kMaxSnapshots; ++slot) {
+    Snapshot *expected = nullptr;
+    if (snapshots[slot].compare_exchange_strong(expected, snapshot.get())) {
+      break;
+    }
+  }
+  if (slot == kMaxSnapshots) {
+    // Nothing to undo in the destructor
+    snapshot->tree = nullptr;
+    return nullptr;
+  }
+  ++open_snapshots;
+  // A write that missed the snapshot set up its VersionWriter before this,
+  // so it's in an epoch that started before now. Once they are all done, the
+  // snapshot is the tree as of then, and whatever changes it later has saved
+  // the version it changed first.
+  WaitForEpoch();
+  return snapshot;
+}
 
-  for (uint32_t i = 0; i < left_node->header.sorted_count; i += 1) {
-    RecordMetadata meta = left_node->record_metadata[i];
-    uint64_t payload;
-    char *data;
-    char *record_key;
-    left_node->GetRawRecord(meta, &data, &record_key, &payload);
-    assert(meta.GetTotalLength() >= sizeof(uint64_t));
-    uint64_t total_len = meta.GetTotalLength();
-    offset -= total_len;
-    memcpy(reinterpret_cast<char *>(node) + offset,
-           data, total_len);
+Snapshot::~Snapshot() {
+  if (tree) {
+    for (auto &slot : tree->snapshots) {
+      Snapshot *expected = this;
+      if (slot.compare_exchange_strong(expected, nullptr)) {
+        break;
+      }
+    }
+    --tree->open_snapshots;
+    // Writers may be saving versions to it still
+    tree->WaitForEpoch();
+  }
+  for (auto &entry : versions) {
+    for (Version *version = entry.second; version;) {
+      Version *next = version->next;
+      delete version;
+      version = next;
+    }
+  }
+}
 
-    node->record_metadata[cur_record].FinalizeForInsert(offset, meta.GetKeyLength(), total_len);
-    cur_record += 1;
+Snapshot::Version *Snapshot::AddVersion(const char *key, uint32_t key_size, const char *payload,
+                                        uint32_t payload_size, bool var_payload) {
+  std::lock_guard<std::mutex> lock(latch);
+  auto &first = versions[std::string(key, key_size)];
+  Version **last = &first;
+  for (; *last; last = &(*last)->next) {
+    if ((*last)->state.load() == Version::kApplied) {
+      // Later versions wouldn't be looked at
+      return nullptr;
+    }
   }
-  for (uint32_t i = 0; i < right_node->header.sorted_count; i += 1) {
-    RecordMetadata meta = right_node->record_metadata[i];
-    uint64_t payload;
-    char *cur_key;
-    right_node->GetRawRecord(meta, nullptr, &cur_key, &payload);
-    if (i == 0) {
-      offset -= (padded_keysize + sizeof(uint64_t));
-      memcpy(reinterpret_cast<char *>(node) + offset,
-             key, key_size);
-      memcpy(reinterpret_cast<char *>(node) + offset + padded_keysize,
-             &payload, sizeof(uint64_t));
-      node->record_metadata[cur_record].
-          FinalizeForInsert(offset, key_size, padded_keysize + sizeof(uint64_t));
-    } else {
-      assert(meta.GetTotalLength() >= sizeof(uint64_t));
-      uint64_t total_len = meta.GetTotalLength();
-      offset -= total_len;
-      memcpy(reinterpret_cast<char *>(node) + offset,
-             cur_key, total_len);
-      node->record_metadata[cur_record].FinalizeForInsert(offset, meta.GetKeyLength(), total_len);
+  auto *version = new Version();
+  version->state = Version::kPending;
+  version->exists = payload != nullptr;
+  version->var_payload = var_payload;
+  if (payload) {
+    version->payload.assign(payload, payload_size);
+  }
+  version->next = nullptr;
+  *last = version;
+  ++version_count;
+  return version;
+}
+
+Snapshot::Version *Snapshot::GetVersion(const char *key, uint32_t key_size) {
+  std::string k(key, key_size);
+  while (true) {
+    Version *pending = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(latch);
+      auto it = versions.find(k);
+      if (it == versions.end()) {
+        return nullptr;
+      }
+      for (Version *version = it->second; version; version = version->next) {
+        auto state = version->state.load();
+        if (state == Version::kApplied) {
+          return version;
+        } else if (state == Version::kPending) {
+          pending = version;
+          break;
+        }
+      }
+    }
+    if (!pending) {
+      return nullptr;
+    }
+    // Its writer is about to issue the PMwCAS
+    for (uint32_t attempt = 0; pending->state.load() == Version::kPending; ++attempt) {
+      WaitBriefly(attempt);
     }
-    cur_record += 1;
   }
-  node->header.sorted_count = cur_record;
-#ifdef PMDK
-  Allocator::Get()->PersistPtr(node, node->header.size);
-#endif
-  return true;
 }
 
-bool LeafNode::MergeNodes(LeafNode *left_node, LeafNode *right_node, LeafNode **new_node) {
-  LeafNode::New(new_node, left_node->header.size);
-  thread_local std::vector<RecordMetadata> meta_vec;
-  meta_vec.clear();
-  auto copy_metadata = [](std::vector<RecordMetadata> *meta_vec, LeafNode *node) -> uint32_t {
-    uint32_t count = node->header.status.GetRecordCount();
-    uint32_t valid_count = 0;
-    for (uint32_t i = 0; i < count; i++) {
-      RecordMetadata meta = node->record_metadata[i];
-      if (meta.IsVisible()) {
-        meta_vec->emplace_back(meta);
-        valid_count += 1;
+void Snapshot::GetVersionKeys(const std::string &lo, bool lo_inclusive, const std::string *hi,
+                              bool hi_inclusive, std::vector<std::string> *keys) {
+  keys->clear();
+  std::lock_guard<std::mutex> lock(latch);
+  auto it = lo_inclusive ? versions.lower_bound(lo) : versions.upper_bound(lo);
+  for (; it != versions.end(); ++it) {
+    if (hi) {
+      int cmp = it->first.compare(*hi);
+      if (cmp > 0 || (cmp == 0 && !hi_inclusive)) {
+        break;
       }
     }
-    return valid_count;
-  };
-  uint32_t left_count = copy_metadata(&meta_vec, left_node);
-  uint32_t right_count = copy_metadata(&meta_vec, right_node);
+    keys->emplace_back(it->first);
+  }
+}
 
-  auto key_cmp = [](LeafNode *node) {
-    return [node](RecordMetadata &m1, RecordMetadata &m2) {
-      return KeyCompare(node->GetKey(m1), m1.GetKeyLength(),
-                        node->GetKey(m2), m2.GetKeyLength()) < 0;
-    };
-  };
-  // todo(hao): make sure these lambdas are zero-overhead
-  // note: left half is always smaller than the right half
-  std::sort(meta_vec.begin(), meta_vec.begin() + left_count, key_cmp(left_node));
-  std::sort(meta_vec.begin() + left_count,
-            meta_vec.begin() + left_count + right_count, key_cmp(right_node));
+Record *Snapshot::NewRecord(const std::string &key, Version *version) {
+  return Record::New(key.data(), static_cast<uint16_t>(key.size()), version->payload.data(),
+                     static_cast<uint32_t>(version->payload.size()), version->var_payload);
+}
 
-  LeafNode *node = *new_node;
-  uint32_t offset = node->header.size;
-  uint32_t cur_record = 0;
-  for (auto meta_iter = meta_vec.begin(); meta_iter < meta_vec.end(); meta_iter++) {
-    uint64_t payload;
-    char *key;
-    if (meta_iter < meta_vec.begin() + left_count) {
-      left_node->GetRawRecord(*meta_iter, &key, &payload);
-    } else {
-      right_node->GetRawRecord(*meta_iter, &key, &payload);
+uint64_t Snapshot::GetVersionCount() {
+  std::lock_guard<std::mutex> lock(latch);
+  return version_count;
+}
+
+ReturnCode Snapshot::Read(const char *key, uint16_t key_size, uint64_t *payload) {
+  // The tree first: a version saved after this read is for a change it
+  // didn't see
+  uint64_t current = 0;
+  auto rc = tree->Read(key, key_size, &current);
+  Version *version = GetVersion(key, key_size);
+  if (!version) {
+    if (rc.IsOk()) {
+      *payload = current;
     }
+    return rc;
+  }
+  if (!version->exists) {
+    return ReturnCode::NotFound();
+  } else if (version->payload.size() > sizeof(uint64_t)) {
+    return ReturnCode::NotEnoughSpace();
+  }
+  *payload = 0;
+  memcpy(payload, version->payload.data(), version->payload.size());
+  return ReturnCode::Ok();
+}
 
-    assert(meta_iter->GetTotalLength() >= sizeof(uint64_t));
-    uint64_t total_len = meta_iter->GetTotalLength();
-    offset -= total_len;
-    char *ptr = reinterpret_cast<char *>(node) + offset;
-    memcpy(ptr, key, total_len);
+ReturnCode Snapshot::Read(const char *key, uint16_t key_size, char *payload,
+                          uint32_t *payload_size) {
+  uint32_t buffer_size = *payload_size;
+  auto rc = tree->Read(key, key_size, payload, payload_size);
+  Version *version = GetVersion(key, key_size);
+  if (!version) {
+    return rc;
+  }
+  if (!version->exists) {
+    return ReturnCode::NotFound();
+  }
+  *payload_size = static_cast<uint32_t>(version->payload.size());
+  if (buffer_size < *payload_size) {
+    return ReturnCode::NotEnoughSpace();
+  }
+  memcpy(payload, version->payload.data(), *payload_size);
+  return ReturnCode::Ok();
+}
 
-    node->record_metadata[cur_record].
-        FinalizeForInsert(offset, meta_iter->GetKeyLength(), total_len);
-    cur_record += 1;
+std::unique_ptr<SnapshotIterator> Snapshot::RangeScanByKey(const char *lo, uint16_t lo_size,
+                                                           bool lo_inclusive,
+                                                           const char *hi, uint16_t hi_size,
+                                                           bool hi_inclusive) {
+  return std::make_unique<SnapshotIterator>(this, lo, lo_size, lo_inclusive,
+                                            hi, hi_size, hi_inclusive);
+}
+
+SnapshotIterator::SnapshotIterator(Snapshot *snapshot, const char *lo, uint16_t lo_size,
+                                   bool lo_inclusive, const char *hi, uint16_t hi_size,
+                                   bool hi_inclusive)
+    : snapshot(snapshot),
+      current(snapshot->tree->RangeScanByKey(lo, lo_size, lo_inclusive, hi, hi_size,
+                                             hi_inclusive)),
+      version_index(0), from(lo ? std::string(lo, lo_size) : std::string()),
+      from_inclusive(lo ? lo_inclusive : true), has_end(hi != nullptr),
+      end_inclusive(hi_inclusive), exhausted(false) {
+  if (hi) {
+    end_key.assign(hi, hi_size);
   }
-  node->header.status.SetBlockSize(node->header.size - offset);
-  node->header.status.SetRecordCount(cur_record);
-  node->header.sorted_count = cur_record;
-#ifdef PMDK
-  Allocator::Get()->PersistPtr(node, node->header.size);
-#endif
-  return true;
 }
 
-bool LeafNode::PrepareForSplit(Stack &stack,
-                               uint32_t split_threshold,
-                               pmwcas::Descriptor *pd,
-                               pmwcas::DescriptorPool *pmwcas_pool,
-                               LeafNode **left, LeafNode **right,
-                               InternalNode **new_parent,
-                               bool backoff) {
-  ALWAYS_ASSERT(header.GetStatus().GetRecordCount() > 2);
+std::unique_ptr<Record> SnapshotIterator::GetNext() {
+  while (true) {
+    // Keys before the tree's next record that only have versions: records
+    // deleted since the snapshot was opened, or inserted (and maybe deleted)
+    while (version_index < version_keys.size()) {
+      auto &key = version_keys[version_index++];
+      auto *version = snapshot->GetVersion(key.data(), static_cast<uint32_t>(key.size()));
+      if (version && version->exists) {
+        return std::unique_ptr<Record>(Snapshot::NewRecord(key, version));
+      }
+    }
+    if (next) {
+      auto record = std::move(next);
+      auto *version = snapshot->GetVersion(record->GetKey(), record->meta.GetKeyLength());
+      if (!version) {
+        return record;
+      } else if (version->exists) {
+        return std::unique_ptr<Record>(Snapshot::NewRecord(
+            std::string(record->GetKey(), record->meta.GetKeyLength()), version));
+      }
+      continue;
+    }
+    if (exhausted) {
+      return nullptr;
+    }
 
-  // Prepare new nodes: a parent node, a left leaf and a right leaf
-  LeafNode::New(left, this->header.size);
-  LeafNode::New(right, this->header.size);
+    // The versions are looked up after the tree's records in between are
+    // read, so a record missing from the tree shows up among them
+    next = current->GetNext();
+    version_index = 0;
+    if (next) {
+      std::string key(next->GetKey(), next->meta.GetKeyLength());
+      snapshot->GetVersionKeys(from, from_inclusive, &key, false, &version_keys);
+      from.swap(key);
+      from_inclusive = false;
+    } else {
+      snapshot->GetVersionKeys(from, from_inclusive, has_end ? &end_key : nullptr,
+                               end_inclusive, &version_keys);
+      exhausted = true;
+    }
+  }
+}
 
-  thread_local std::vector<RecordMetadata> meta_vec;
-  meta_vec.clear();
-  uint32_t total_size = SortMetadataByKey(meta_vec, true, pmwcas_pool->GetEpoch());
+VersionWriter::VersionWriter(BzTree *tree) : count(0) {
+  // Either this sees a snapshot being opened, or NewSnapshot sees the epoch
+  // this write is in as it waits (a store-load pair on each side)
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (tree->open_snapshots.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+  for (auto &slot : tree->snapshots) {
+    if (auto *snapshot = slot.load()) {
+      snapshots[count++] = snapshot;
+    }
+  }
+}
 
-  int32_t left_size = total_size / 2;
-  uint32_t nleft = 0;
-  for (uint32_t i = 0; i < meta_vec.size(); ++i) {
-    auto &meta = meta_vec[i];
-    ++nleft;
-    left_size -= meta.GetTotalLength();
-    if (left_size <= 0) {
-      break;
+void VersionWriter::Save(const char *key, uint32_t key_size, const char *payload,
+                         uint32_t payload_size, bool var_payload) {
+  for (uint32_t i = 0; i < count; ++i) {
+    if (auto *version = snapshots[i]->AddVersion(key, key_size, payload, payload_size,
+                                                 var_payload)) {
+      saved.emplace_back(version);
     }
   }
+}
+
+void VersionWriter::Save(BaseNode *node, const char *key, uint32_t key_size,
+                         RecordMetadata meta) {
+  thread_local std::string full_key;
+  full_key.assign(node->GetPrefix(), node->GetPrefixSize());
+  full_key.append(key, key_size);
+  if (meta.IsVacant()) {
+    Save(full_key.data(), full_key.size(), nullptr, 0, false);
+    return;
+  }
+  char *payload = reinterpret_cast<char *>(node) + meta.GetOffset() + meta.GetPaddedKeyLength();
+  if (meta.HasVarPayload()) {
+    Save(full_key.data(), full_key.size(), payload, meta.GetPayloadLength(), true);
+    return;
+  }
+  uint64_t word = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
+      payload)->GetValueProtected();
+  Save(full_key.data(), full_key.size(), reinterpret_cast<char *>(&word), sizeof(word), false);
+}
 
-  assert(nleft > 0);
+void VersionWriter::Save(LeafNode *node, const char *lo, uint32_t lo_size,
+                         const char *hi, uint32_t hi_size) {
+  // Not through RangeScanByKey, the writer is in an epoch already
+  thread_local std::vector<RecordMetadata> meta_vec;
+  meta_vec.clear();
+  node->CollectRange(lo, lo_size, true, hi, hi_size, false,
+                     std::numeric_limits<uint32_t>::max(), &meta_vec);
+  for (auto meta : meta_vec) {
+    Save(node, node->GetKey(meta), meta.GetKeyLength(), meta);
+  }
+}
 
-  // TODO(tzwang): also put the new insert here to save some cycles
-  auto left_end_it = meta_vec.begin() + nleft;
-#ifdef PMDK
-  (Allocator::Get()->GetDirect(*left))->CopyFrom(this, meta_vec.begin(),
-                                                 left_end_it, pmwcas_pool->GetEpoch());
-  (Allocator::Get()->GetDirect(*right))->CopyFrom(this, left_end_it,
-                                                  meta_vec.end(), pmwcas_pool->GetEpoch());
-#else
-  (*left)->CopyFrom(this, meta_vec.begin(), left_end_it, pmwcas_pool->GetEpoch());
-  (*right)->CopyFrom(this, left_end_it, meta_vec.end(), pmwcas_pool->GetEpoch());
-#endif
+void VersionWriter::Finish(bool applied) {
+  for (auto *version : saved) {
+    version->state = applied ? Snapshot::Version::kApplied : Snapshot::Version::kDiscarded;
+  }
+  saved.clear();
+}
 
-  // Separator exists in the new left leaf node, i.e., when traversing the tree,
-  // we go left if <=, and go right if >.
-  RecordMetadata separator_meta = meta_vec[nleft - 1];
+PartitionedTree::PartitionedTree(const std::vector<BzTree *> &trees)
+    : trees(trees), hashed(true) {
+  assert(!trees.empty());
+}
 
-  // The node is already frozen (by us), so we must be able to get a valid key
-  char *key = GetKey(separator_meta);
-  assert(key);
+PartitionedTree::PartitionedTree(const std::vector<BzTree *> &trees,
+                                 const std::vector<std::string> &split_keys)
+    : trees(trees), split_keys(split_keys), hashed(false) {
+  assert(split_keys.size() + 1 == trees.size());
+}
 
-  InternalNode *parent = stack.Top() ?
-                         stack.Top()->node : nullptr;
-  if (parent == nullptr) {
-    // Good boy!
-    InternalNode::New(key, separator_meta.GetKeyLength(),
-                      reinterpret_cast<uint64_t>(*left),
-                      reinterpret_cast<uint64_t>(*right),
-                      new_parent);
-    return true;
+uint32_t PartitionedTree::GetPartition(const char *key, uint16_t key_size) {
+  if (hashed) {
+    // Below the bits leaves take their fingerprints from
+    return static_cast<uint32_t>(BaseNode::KeyHash(key, key_size) >> 24) % trees.size();
   }
+  // Split keys up to [key]
+  auto it = std::upper_bound(split_keys.begin(), split_keys.end(), key,
+                             [key_size](const char *k, const std::string &split) {
+    return BaseNode::KeyCompare(k, key_size, split.data(), split.size()) < 0;
+  });
+  return static_cast<uint32_t>(it - split_keys.begin());
+}
 
-  bool frozen_by_me = false;
-  while (!parent->IsFrozen()) {
-    frozen_by_me = parent->Freeze(pmwcas_pool);
+ReturnCode PartitionedTree::DeleteRange(const char *lo, uint16_t lo_size, const char *hi,
+                                        uint16_t hi_size) {
+  uint32_t first = 0;
+  uint32_t last = GetPartitionCount() - 1;
+  if (!hashed) {
+    first = GetPartition(lo, lo_size);
+    last = GetPartition(hi, hi_size);
   }
-
-  if (!frozen_by_me && backoff) {
-    return false;
-  } else {
-    // Has a parent node. PrepareForSplit will see if we need to split this
-    // parent node as well, and if so, return a new (possibly upper-level) parent
-    // node that needs to be installed to its parent
-    return parent->PrepareForSplit(stack, split_threshold, key,
-                                   separator_meta.GetKeyLength(),
-                                   reinterpret_cast<uint64_t>(*left),
-                                   reinterpret_cast<uint64_t>(*right),
-                                   new_parent,
-                                   pd, pmwcas_pool,
-                                   backoff);
+  ReturnCode result = ReturnCode::Ok();
+  for (uint32_t i = first; i <= last; ++i) {
+    auto rc = trees[i]->DeleteRange(lo, lo_size, hi, hi_size);
+    if (result.IsOk() && !rc.IsOk()) {
+      result = rc;
+    }
   }
+  return result;
 }
 
-BaseNode *BzTree::TraverseToNode(bztree::Stack *stack,
-                                 const char *key, uint16_t key_size,
-                                 bztree::BaseNode *stop_at,
-                                 bool le_child) {
-  BaseNode *node = GetRootNodeSafe();
-  if (stack) {
-    stack->SetRoot(node);
+std::unique_ptr<PartitionedIterator> PartitionedTree::RangeScanByKey(
+    const char *lo, uint16_t lo_size, bool lo_inclusive, const char *hi, uint16_t hi_size,
+    bool hi_inclusive, uint32_t scan_size, bool reverse) {
+  return std::make_unique<PartitionedIterator>(this, lo, lo_size, lo_inclusive, hi, hi_size,
+                                               hi_inclusive, scan_size, reverse);
+}
+
+PartitionedIterator::PartitionedIterator(PartitionedTree *tree, const char *lo, uint16_t lo_size,
+                                         bool lo_inclusive, const char *hi, uint16_t hi_size,
+                                         bool hi_inclusive, uint32_t scan_size, bool reverse)
+    : tree(tree), has_lo(lo != nullptr), lo_inclusive(lo_inclusive), has_hi(hi != nullptr),
+      hi_inclusive(hi_inclusive), remaining_size(scan_size), reverse(reverse) {
+  if (lo) {
+    this->lo.assign(lo, lo_size);
   }
-  InternalNode *parent = nullptr;
-  uint32_t meta_index = 0;
-  while (node != stop_at && !node->IsLeaf()) {
-    assert(!node->IsLeaf());
-    parent = reinterpret_cast<InternalNode *>(node);
-    meta_index = parent->GetChildIndex(key, key_size, le_child);
-    node = parent->GetChildByMetaIndex(meta_index, GetPMWCASPool()->GetEpoch());
-    assert(node);
-    if (stack != nullptr) {
-      stack->Push(parent, meta_index);
+  if (hi) {
+    this->hi.assign(hi, hi_size);
+  }
+  uint32_t count = tree->GetPartitionCount();
+  iters.resize(count);
+  if (tree->IsHashed()) {
+    heads.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+      iters[i] = NewIterator(i);
+      heads[i] = iters[i]->GetNext();
     }
+    return;
   }
-  return node;
+  // Partitions from the one where the scan starts to the one where it ends
+  uint32_t lo_partition = lo ? tree->GetPartition(lo, lo_size) : 0;
+  uint32_t hi_partition = hi ? tree->GetPartition(hi, hi_size) : count - 1;
+  partition = reverse ? hi_partition : lo_partition;
+  last_partition = reverse ? lo_partition : hi_partition;
+  if (reverse ? last_partition > partition : last_partition < partition) {
+    // An empty range
+    last_partition = partition;
+  }
+  iters[partition] = NewIterator(partition);
 }
 
-LeafNode *BzTree::TraverseToLeaf(Stack *stack, const char *key,
-                                 uint16_t key_size,
-                                 bool le_child) {
-  static const uint32_t kCacheLineSize = 64;
-  BaseNode *node = GetRootNodeSafe();
-  __builtin_prefetch((const void *) (root), 0, 3);
+std::unique_ptr<Iterator> PartitionedIterator::NewIterator(uint32_t partition) {
+  return std::make_unique<Iterator>(tree->GetTree(partition),
+                                    has_lo ? lo.data() : nullptr, lo.size(), lo_inclusive,
+                                    has_hi ? hi.data() : nullptr, hi.size(), hi_inclusive,
+                                    remaining_size, reverse);
+}
 
-  if (stack) {
-    stack->SetRoot(node);
+std::unique_ptr<Record> PartitionedIterator::GetNext() {
+  if (remaining_size == 0) {
+    return nullptr;
   }
-  InternalNode *parent = nullptr;
-  uint32_t meta_index = 0;
-  assert(node);
-  while (!node->IsLeaf()) {
-    parent = reinterpret_cast<InternalNode *>(node);
-    meta_index = parent->GetChildIndex(key, key_size, le_child);
-    node = parent->GetChildByMetaIndex(meta_index, GetPMWCASPool()->GetEpoch());
-    for (uint32_t i = 0; i < parameters.leaf_node_size / kCacheLineSize; ++i) {
-      __builtin_prefetch((const void *) ((char *) node + i * kCacheLineSize), 0, 3);
+  std::unique_ptr<Record> record;
+  if (tree->IsHashed()) {
+    uint32_t next = heads.size();
+    for (uint32_t i = 0; i < heads.size(); ++i) {
+      if (!heads[i]) {
+        continue;
+      }
+      if (next == heads.size()) {
+        next = i;
+        continue;
+      }
+      int cmp = BaseNode::KeyCompare(heads[i]->GetKey(), heads[i]->meta.GetKeyLength(),
+                                     heads[next]->GetKey(), heads[next]->meta.GetKeyLength());
+      if (reverse ? cmp > 0 : cmp < 0) {
+        next = i;
+      }
     }
-    assert(node);
-    if (stack != nullptr) {
-      stack->Push(parent, meta_index);
+    if (next == heads.size()) {
+      return nullptr;
+    }
+    record = std::move(heads[next]);
+    heads[next] = iters[next]->GetNext();
+  } else {
+    while (iters[partition] && !(record = iters[partition]->GetNext())) {
+      iters[partition].reset();
+      if (partition != last_partition) {
+        partition = reverse ? partition - 1 : partition + 1;
+        iters[partition] = NewIterator(partition);
+      }
+    }
+    if (!record) {
+      return nullptr;
     }
   }
+  --remaining_size;
+  return record;
+}
 
-  for (uint32_t i = 0; i < parameters.leaf_node_size / kCacheLineSize; ++i) {
-    __builtin_prefetch((const void *) ((char *) node + i * kCacheLineSize), 0, 3);
+ReturnCode WriteBuffer::Open(BzTree *tree, uint32_t flush_records, const char *log_path,
+                             bool sync, std::unique_ptr<WriteBuffer> *buffer) {
+  std::unique_ptr<WriteBuffer> new_buffer(
+      new WriteBuffer(tree, std::max<uint32_t>(flush_records, 1), sync));
+  if (log_path) {
+    new_buffer->logging = true;
+    for (uint32_t i = 0; i < kShards; ++i) {
+      if (!new_buffer->RecoverShard(i, log_path)) {
+        return ReturnCode::IOError();
+      }
+    }
   }
-  return reinterpret_cast<LeafNode *>(node);
+  *buffer = std::move(new_buffer);
+  return ReturnCode::Ok();
 }
 
-ReturnCode BzTree::Insert(const char *key, uint16_t key_size, uint64_t payload) {
-  thread_local Stack stack;
-  stack.tree = this;
-  uint64_t freeze_retry = 0;
+WriteBuffer::~WriteBuffer() {
+  Flush();
+  for (auto &shard : shards) {
+    for (int fd : shard.log_fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+}
 
-  while (true) {
-    stack.Clear();
-    pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
-    LeafNode *node = TraverseToLeaf(&stack, key, key_size);
+// Hash of a log record past its check field
+static uint32_t GetLogCheck(const char *record, uint32_t size) {
+  return static_cast<uint32_t>(
+      BaseNode::KeyHash(record + sizeof(uint32_t), size - sizeof(uint32_t)) >> 32);
+}
 
-    // Try to insert to the leaf node
-    auto rc = node->Insert(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold);
-    if (rc.IsOk() || rc.IsKeyExists()) {
-      return rc;
+bool WriteBuffer::RecoverShard(uint32_t index, const std::string &log_path) {
+  auto &shard = shards[index];
+  LogHeader headers[2];
+  for (uint32_t f = 0; f < 2; ++f) {
+    auto path = log_path + "." + std::to_string(index) + "." + std::to_string(f);
+    shard.log_fds[f] = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (shard.log_fds[f] < 0) {
+      return false;
     }
+    if (pread(shard.log_fds[f], &headers[f], sizeof(LogHeader), 0) != sizeof(LogHeader) ||
+        headers[f].magic != LogHeader::kMagic) {
+      headers[f].magic = 0;
+      headers[f].sequence = 0;
+    }
+  }
 
-    assert(rc.IsNotEnoughSpace() || rc.IsNodeFrozen());
-    if (rc.IsNodeFrozen()) {
-      if (++freeze_retry <= MAX_FREEZE_RETRY) {
-        continue;
-      }
-    } else {
-      bool frozen_by_me = false;
-      while (!node->IsFrozen()) {
-        frozen_by_me = node->Freeze(GetPMWCASPool());
+  // The older file first, each record over what came before it
+  uint32_t first = headers[0].sequence <= headers[1].sequence ? 0 : 1;
+  for (uint32_t f : {first, 1 - first}) {
+    if (headers[f].magic != LogHeader::kMagic) {
+      continue;
+    }
+    struct stat st;
+    if (fstat(shard.log_fds[f], &st) != 0) {
+      return false;
+    }
+    std::string log(st.st_size, '\0');
+    if (pread(shard.log_fds[f], &log[0], log.size(), 0) != static_cast<ssize_t>(log.size())) {
+      return false;
+    }
+    uint64_t offset = sizeof(LogHeader);
+    while (offset + sizeof(LogRecord) <= log.size()) {
+      LogRecord record;
+      memcpy(&record, log.data() + offset, sizeof(record));
+      uint32_t size = sizeof(LogRecord) + record.key_size;
+      if (offset + size > log.size() || record.check != GetLogCheck(log.data() + offset, size)) {
+        break;
       }
-      if (!frozen_by_me && ++freeze_retry <= MAX_FREEZE_RETRY) {
-        continue;
+      const char *key = log.data() + offset + sizeof(LogRecord);
+      if (record.op == kLogPut) {
+        if (!tree->Upsert(key, record.key_size, record.payload).IsOk()) {
+          return false;
+        }
+      } else {
+        tree->Delete(key, record.key_size);
       }
+      offset += size;
     }
+  }
 
-    bool backoff = (freeze_retry <= MAX_FREEZE_RETRY);
+  // Everything is in the tree, start over
+  shard.sequence = std::max(headers[0].sequence, headers[1].sequence);
+  shard.log = 1;
+  return SwitchLog(shard) && ftruncate(shard.log_fds[1], 0) == 0;
+}
 
-    // Should split and we have three cases to handle:
-    // 1. Root node is a leaf node - install [parent] as the new root
-    // 2. We have a parent but no grandparent - install [parent] as the new
-    //    root
-    // 3. We have a grandparent - update the child pointer in the grandparent
-    //    to point to the new [parent] (might further cause splits up the tree)
+bool WriteBuffer::SwitchLog(Shard &shard) {
+  uint32_t next = 1 - shard.log;
+  int fd = shard.log_fds[next];
+  LogHeader header;
+  header.magic = LogHeader::kMagic;
+  header.sequence = shard.sequence + 1;
+  if (ftruncate(fd, 0) != 0 ||
+      !WriteFully(fd, reinterpret_cast<const char *>(&header), sizeof(header), 0) ||
+      fdatasync(fd) != 0) {
+    return false;
+  }
+  shard.log = next;
+  shard.sequence = header.sequence;
+  shard.log_size = sizeof(header);
+  return true;
+}
 
-    auto *pd = GetPMWCASPool()->AllocateDescriptor();
-    // TODO(hao): should implement a cascading memory recycle callback
-    pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
-                           reinterpret_cast<uint64_t>(nullptr),
-                           pmwcas::Descriptor::kRecycleOnRecovery);
-    pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
-                           reinterpret_cast<uint64_t>(nullptr),
-                           pmwcas::Descriptor::kRecycleOnRecovery);
-    pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
-                           reinterpret_cast<uint64_t>(nullptr),
-                           pmwcas::Descriptor::kRecycleOnRecovery);
-    uint64_t *ptr_r = pd->GetNewValuePtr(0);
-    uint64_t *ptr_l = pd->GetNewValuePtr(1);
-    uint64_t *ptr_parent = pd->GetNewValuePtr(2);
-
-    // Note that when we split internal nodes (if needed), stack will get
-    // Pop()'ed recursively, leaving the grantparent as the top (if any) here.
-    // So we save the root node here in case we need to change root later.
-
-    // Now split the leaf node. PrepareForSplit will return the node that we
-    // need to install to the grandparent node (will be stack top, if any). If
-    // it turns out there is no such grandparent, we directly install the
-    // returned node as the new root.
-    //
-    // Note that in internal node's PrepareSplit if the internal node needs to
-    // split we will pop the stack along the way as the split propogates
-    // upward, such that by the time we come back here, the stack will contain
-    // on its top the "parent" node and the "grandparent" node (if any) that
-    // points to the parent node. As a result, we directly install a pointer to
-    // the new parent node returned by leaf.PrepareForSplit to the grandparent.
-    bool should_proceed = node->PrepareForSplit(stack,
-                                                parameters.split_threshold,
-                                                pd, GetPMWCASPool(),
-                                                reinterpret_cast<LeafNode **>(ptr_l),
-                                                reinterpret_cast<LeafNode **>(ptr_r),
-                                                reinterpret_cast<InternalNode **>(ptr_parent),
-                                                backoff);
-    if (!should_proceed) {
-      pd->Abort();
-      // TODO(tzwang): free memory allocated in ptr_l, ptr_r, and ptr_parent
-      continue;
-    }
+bool WriteBuffer::AppendLog(Shard &shard, const std::string &key, uint64_t payload,
+                            bool deleted) {
+  if (!logging) {
+    return true;
+  }
+  thread_local std::string buffer;
+  LogRecord record;
+  record.check = 0;
+  record.key_size = static_cast<uint16_t>(key.size());
+  record.op = deleted ? kLogDelete : kLogPut;
+  record.unused = 0;
+  record.payload = payload;
+  buffer.assign(reinterpret_cast<const char *>(&record), sizeof(record));
+  buffer.append(key);
+  record.check = GetLogCheck(buffer.data(), static_cast<uint32_t>(buffer.size()));
+  memcpy(&buffer[0], &record.check, sizeof(record.check));
+
+  // A failed append is overwritten by the next one
+  int fd = shard.log_fds[shard.log];
+  if (!WriteFully(fd, buffer.data(), buffer.size(), shard.log_size) ||
+      (sync && fdatasync(fd) != 0)) {
+    return false;
+  }
+  shard.log_size += buffer.size();
+  return true;
+}
 
-    assert(*ptr_parent);
+WriteBuffer::Entry *WriteBuffer::Find(Shard &shard, const std::string &key) {
+  auto it = shard.entries.find(key);
+  if (it != shard.entries.end()) {
+    return &it->second;
+  }
+  it = shard.flushing.find(key);
+  return it != shard.flushing.end() ? &it->second : nullptr;
+}
 
-    auto *top = stack.Pop();
-    InternalNode *old_parent = nullptr;
-    if (top) {
-      old_parent = top->node;
-    }
+bool WriteBuffer::Exists(Shard &shard, const std::string &key) {
+  auto *entry = Find(shard, key);
+  if (entry) {
+    return !entry->deleted;
+  }
+  uint64_t payload = 0;
+  return tree->Read(key.data(), static_cast<uint16_t>(key.size()), &payload).IsOk();
+}
 
-    top = stack.Pop();
-    InternalNode *grand_parent = nullptr;
-    if (top) {
-      grand_parent = top->node;
-    }
+ReturnCode WriteBuffer::Put(Shard &shard, std::unique_lock<std::mutex> *lock, std::string &&key,
+                            uint64_t payload, bool deleted) {
+  if (!AppendLog(shard, key, payload, deleted)) {
+    return ReturnCode::IOError();
+  }
+  auto it = shard.entries.find(key);
+  if (it != shard.entries.end()) {
+    it->second = Entry{payload, deleted};
+    absorbed.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    shard.entries.emplace(std::move(key), Entry{payload, deleted});
+  }
+  bool full = shard.entries.size() >= flush_records;
+  lock->unlock();
+  if (full) {
+    // The write is in either way; keys that didn't make it into the tree stay
+    // in the buffer, and the next flush reports it if they fail again
+    FlushShard(shard, false);
+  }
+  return ReturnCode::Ok();
+}
 
-    if (grand_parent) {
-      assert(old_parent);
-      // There is a grand parent. We need to swap out the pointer to the old
-      // parent and install the pointer to the new parent.
-#ifdef PMDK
-      auto result = grand_parent->Update(
-          top->node->GetMetadata(top->meta_index),
-          Allocator::Get()->GetOffset(old_parent),
-          reinterpret_cast<InternalNode *>(*ptr_parent), pd, GetPMWCASPool());
-#else
-      auto result = grand_parent->Update(
-          top->node->GetMetadata(top->meta_index),
-          old_parent, reinterpret_cast<InternalNode *>(*ptr_parent), pd, GetPMWCASPool());
-#endif
-    } else {
-      // No grand parent or already popped out by during split propagation
-      // In case of PMDK, ptr_parent is already in PMDK offset format (done by
-      // InternalNode::New).
-#ifdef PMDK
-      ChangeRoot(reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(stack.GetRoot())),
-                 *ptr_parent, pd);
-#else
-      ChangeRoot(reinterpret_cast<uint64_t>(stack.GetRoot()), *ptr_parent, pd);
-#endif
+ReturnCode WriteBuffer::Insert(const char *key, uint16_t key_size, uint64_t payload) {
+  if (Bypasses(key_size)) {
+    return tree->Insert(key, key_size, payload);
+  }
+  auto &shard = GetShard(key, key_size);
+  std::string buffered(key, key_size);
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  if (Exists(shard, buffered)) {
+    return ReturnCode::KeyExists();
+  }
+  return Put(shard, &lock, std::move(buffered), payload, false);
+}
+
+ReturnCode WriteBuffer::Read(const char *key, uint16_t key_size, uint64_t *payload) {
+  if (!Bypasses(key_size)) {
+    auto &shard = GetShard(key, key_size);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto *entry = Find(shard, std::string(key, key_size));
+    if (entry) {
+      if (entry->deleted) {
+        return ReturnCode::NotFound();
+      }
+      *payload = entry->payload;
+      return ReturnCode::Ok();
     }
   }
+  // A key that's in neither map has its latest value in the tree
+  return tree->Read(key, key_size, payload);
 }
 
-bool BzTree::ChangeRoot(uint64_t expected_root_addr, uint64_t new_root_addr,
-                        pmwcas::Descriptor *pd) {
-  // Memory policy here is "Never" because the memory was allocated in
-  // PrepareForInsert/BzTree::Insert which uses a descriptor that specifies
-  // policy RecycleOnRecovery
-  pd->AddEntry(reinterpret_cast<uint64_t *>(&root), expected_root_addr, new_root_addr,
-               pmwcas::Descriptor::kRecycleNever);
-  return pd->MwCAS();
+ReturnCode WriteBuffer::Update(const char *key, uint16_t key_size, uint64_t payload) {
+  if (Bypasses(key_size)) {
+    return tree->Update(key, key_size, payload);
+  }
+  auto &shard = GetShard(key, key_size);
+  std::string buffered(key, key_size);
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  if (!Exists(shard, buffered)) {
+    return ReturnCode::NotFound();
+  }
+  return Put(shard, &lock, std::move(buffered), payload, false);
 }
 
-ReturnCode BzTree::Read(const char *key, uint16_t key_size, uint64_t *payload) {
-  pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
+ReturnCode WriteBuffer::Upsert(const char *key, uint16_t key_size, uint64_t payload) {
+  if (Bypasses(key_size)) {
+    return tree->Upsert(key, key_size, payload);
+  }
+  auto &shard = GetShard(key, key_size);
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  return Put(shard, &lock, std::string(key, key_size), payload, false);
+}
 
-  LeafNode *node = TraverseToLeaf(nullptr, key, key_size);
-  if (node == nullptr) {
-    return ReturnCode::NotFound();
+ReturnCode WriteBuffer::Delete(const char *key, uint16_t key_size) {
+  if (Bypasses(key_size)) {
+    return tree->Delete(key, key_size);
   }
-  uint64_t tmp_payload;
-  auto rc = node->Read(key, key_size, &tmp_payload, GetPMWCASPool());
-  if (rc.IsOk()) {
-    *payload = tmp_payload;
+  auto &shard = GetShard(key, key_size);
+  std::string buffered(key, key_size);
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  if (!Exists(shard, buffered)) {
+    return ReturnCode::NotFound();
   }
-  return rc;
+  return Put(shard, &lock, std::move(buffered), 0, true);
 }
 
-ReturnCode BzTree::Update(const char *key, uint16_t key_size, uint64_t payload) {
-  ReturnCode rc;
-  pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
-  do {
-    LeafNode *node = TraverseToLeaf(nullptr, key, key_size, GetPMWCASPool());
-    if (node == nullptr) {
-      return ReturnCode::NotFound();
+ReturnCode WriteBuffer::FlushShard(Shard &shard, bool wait) {
+  std::unique_lock<std::mutex> flush_lock(shard.flush_mutex, std::defer_lock);
+  if (wait) {
+    flush_lock.lock();
+  } else if (!flush_lock.try_lock()) {
+    return ReturnCode::Ok();
+  }
+  uint32_t old_log = shard.log;
+  {
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    if (shard.entries.empty()) {
+      return ReturnCode::Ok();
     }
-    rc = node->Update(key, key_size, payload, GetPMWCASPool());
-  } while (rc.IsPMWCASFailure());
-  return rc;
-}
+    // Keys put back by a failed flush that couldn't be logged again only
+    // have their records in the other log file, which switching would empty
+    if (shard.relog) {
+      for (auto &entry : shard.entries) {
+        if (!AppendLog(shard, entry.first, entry.second.payload, entry.second.deleted)) {
+          return ReturnCode::IOError();
+        }
+      }
+      shard.relog = false;
+    }
+    // Later writes go to the other log file, which the last flush emptied
+    if (logging && !SwitchLog(shard)) {
+      return ReturnCode::IOError();
+    }
+    shard.flushing.swap(shard.entries);
+  }
 
-ReturnCode BzTree::Upsert(const char *key, uint16_t key_size, uint64_t payload) {
-  pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
+  // Reads of these keys are still served from [flushing] meanwhile
+  std::vector<const char *> keys;
+  std::vector<uint16_t> key_sizes;
+  std::vector<uint64_t> payloads;
+  std::vector<const std::string *> failed;
+  ReturnCode result = ReturnCode::Ok();
+  for (auto &entry : shard.flushing) {
+    if (entry.second.deleted) {
+      auto rc = tree->Delete(entry.first.data(), static_cast<uint16_t>(entry.first.size()));
+      if (!rc.IsOk() && !rc.IsNotFound()) {
+        failed.push_back(&entry.first);
+        result = rc;
+      }
+    } else {
+      keys.push_back(entry.first.data());
+      key_sizes.push_back(static_cast<uint16_t>(entry.first.size()));
+      payloads.push_back(entry.second.payload);
+    }
+  }
+  std::vector<ReturnCode> rcs(keys.size());
+  tree->InsertBatch(keys.data(), key_sizes.data(), payloads.data(),
+                    static_cast<uint32_t>(keys.size()), rcs.data());
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    auto rc = rcs[i];
+    if (rc.IsKeyExists()) {
+      rc = tree->Upsert(keys[i], key_sizes[i], payloads[i]);
+    }
+    if (!rc.IsOk()) {
+      // Keys point into [flushing]
+      failed.push_back(&shard.flushing.find(std::string(keys[i], key_sizes[i]))->first);
+      if (result.IsOk()) {
+        result = rc;
+      }
+    }
+  }
+  flushed.fetch_add(shard.flushing.size() - failed.size(), std::memory_order_relaxed);
+  flushes.fetch_add(1, std::memory_order_relaxed);
 
-  LeafNode *node = TraverseToLeaf(nullptr, key, key_size, GetPMWCASPool());
-  // FIXME(tzwang): be more clever here to get the node this record would be
-  // landing in?
-  if (node == nullptr) {
-    return Insert(key, key_size, payload);
+  // The old log holds nothing the tree doesn't, unless something failed
+  if (result.IsOk() && logging && ftruncate(shard.log_fds[old_log], 0) != 0) {
+    result = ReturnCode::IOError();
   }
-  uint64_t tmp_payload;
-  auto rc = node->Read(key, key_size, &tmp_payload, GetPMWCASPool());
-  if (rc.IsNotFound()) {
-    return Insert(key, key_size, payload);
-  } else if (rc.IsOk()) {
-    if (tmp_payload == payload) {
-      return ReturnCode::Ok();
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  // What didn't make it is buffered again, under the writes that came since,
+  // and logged again before the next flush empties the old log
+  for (auto *key : failed) {
+    if (shard.entries.count(*key)) {
+      continue;
     }
-    return Update(key, key_size, payload);
-  } else {
-    return rc;
+    auto &entry = shard.flushing[*key];
+    if (!AppendLog(shard, *key, entry.payload, entry.deleted)) {
+      shard.relog = true;
+    }
+    shard.entries.emplace(*key, entry);
   }
+  shard.flushing.clear();
+  return result;
 }
 
-ReturnCode BzTree::Delete(const char *key, uint16_t key_size) {
-  thread_local Stack stack;
-  stack.tree = this;
-  ReturnCode rc;
-  auto *epoch = GetPMWCASPool()->GetEpoch();
-  pmwcas::EpochGuard guard(epoch);
-  LeafNode *node;
-  do {
-    stack.Clear();
-    node = TraverseToLeaf(nullptr, key, key_size, GetPMWCASPool());
-    if (node == nullptr) {
-      return ReturnCode::NotFound();
+ReturnCode WriteBuffer::Flush() {
+  ReturnCode result = ReturnCode::Ok();
+  for (auto &shard : shards) {
+    auto rc = FlushShard(shard, true);
+    if (!rc.IsOk() && result.IsOk()) {
+      result = rc;
     }
-    rc = node->Delete(key, key_size, GetPMWCASPool());
-  } while (rc.IsNodeFrozen());
+  }
+  return result;
+}
 
-  if (!rc.IsOk() || ENABLE_MERGE == 0) {
-    // delete failed
-    return rc;
+ReturnCode WriteBuffer::Sync() {
+  if (!logging) {
+    return ReturnCode::Ok();
+  }
+  for (auto &shard : shards) {
+    // Both files: the old one holds the writes of a flush in progress until
+    // they're in the tree
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    if (fdatasync(shard.log_fds[0]) != 0 || fdatasync(shard.log_fds[1]) != 0) {
+      return ReturnCode::IOError();
+    }
   }
+  return ReturnCode::Ok();
+}
 
-  // finished record delete, now check if we can merge siblings
-  uint32_t freeze_retry = 0;
-  do {
-    rc = node->CheckMerge(&stack, key, key_size, freeze_retry < MAX_FREEZE_RETRY);
-    if (rc.IsOk()) {
-      return rc;
+WriteBuffer::Stats WriteBuffer::GetStats() {
+  Stats stats;
+  stats.absorbed = absorbed.load(std::memory_order_relaxed);
+  stats.flushed = flushed.load(std::memory_order_relaxed);
+  stats.flushes = flushes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+BzTree::SpaceStats BzTree::GetSpaceStats() {
+  SpaceStats stats;
+  memset(&stats, 0, sizeof(stats));
+  EpochScope guard(GetPMWCASPool()->GetEpoch());
+  CollectSpaceStats(GetRootNodeSafe(), 0, &stats);
+  auto retired = GetRetiredBytes();
+  auto reclaimed = GetReclaimedBytes();
+  stats.unreclaimed_bytes = retired > reclaimed ? retired - reclaimed : 0;
+  return stats;
+}
+
+void BzTree::CollectSpaceStats(BaseNode *node, uint32_t depth, SpaceStats *stats) {
+  ALWAYS_ASSERT(depth < SpaceStats::kMaxLevels);
+  auto *header = node->GetHeader();
+  stats->levels = std::max(stats->levels, depth + 1);
+  ++stats->nodes[depth];
+  stats->node_bytes[depth] += header->size;
+  if (!node->IsLeaf()) {
+    auto *internal = reinterpret_cast<InternalNode *>(node);
+    stats->metadata_bytes += sizeof(InternalNode) + header->sorted_count * sizeof(RecordMetadata);
+    for (uint32_t i = 0; i < header->sorted_count; ++i) {
+      if (internal->IsChildEvicted(i, GetPMWCASPool()->GetEpoch())) {
+        ++stats->evicted_leaves;
+        continue;
+      }
+      CollectSpaceStats(internal->GetChildByMetaIndex(i, GetPMWCASPool()->GetEpoch()),
+                        depth + 1, stats);
     }
-    stack.Clear();
-    node = TraverseToLeaf(&stack, key, key_size, GetPMWCASPool());
-    if (rc.IsNodeFrozen()) {
-      freeze_retry += 1;
+    return;
+  }
+
+  auto *leaf = reinterpret_cast<LeafNode *>(node);
+  auto status = header->GetStatus();
+  uint32_t count = status.GetRecordCount();
+  uint32_t used = LeafNode::GetUsedSpace(status);
+  uint32_t overhead = LeafNode::GetTrailerSize(header->size, leaf->HasBloomFilter(),
+                                               leaf->GetLaneCount()) +
+                      RecordMetadata::PadKeyLength(header->prefix_size);
+  uint32_t bucket = static_cast<uint32_t>(uint64_t{used} * SpaceStats::kFillBuckets /
+                                          header->size);
+  ++stats->leaf_fill[std::min(bucket, SpaceStats::kFillBuckets - 1)];
+  uint32_t visible = 0;
+  uint64_t live = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    auto meta = leaf->GetMetadata(i);
+    if (meta.IsVisible()) {
+      ++visible;
+      live += meta.GetPaddedTotalLength();
+      if (i >= header->sorted_count) {
+        ++stats->unsorted_records;
+      }
     }
-  } while (rc.IsNodeFrozen() || rc.IsPMWCASFailure());
-  ALWAYS_ASSERT(false);
-  return rc;  // Just to silence the compiler
+  }
+  stats->records += visible;
+  stats->live_bytes += live;
+  stats->deleted_bytes += status.GetDeletedSize();
+  stats->metadata_bytes += sizeof(LeafNode) + count * sizeof(RecordMetadata) + overhead;
+  stats->free_bytes += header->size - std::min(used, header->size);
+  stats->frozen_leaves += status.IsFrozen();
+  stats->reclaimable_bytes += (count - visible) * sizeof(RecordMetadata) +
+                              (status.GetBlockSize() - overhead - live);
 }
 
 void BzTree::Dump() {
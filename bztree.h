@@ -7,30 +7,257 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <ostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <memory>
 #include <optional>
 
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 #include <pmwcas.h>
 #include <mwcas/mwcas.h>
+#include <common/garbage_list.h>
 
 #ifndef ALWAYS_ASSERT
 #define ALWAYS_ASSERT(expr) (expr) ? (void)0 : abort()
 #endif
 
+// Build with ENABLE_STATS=0 to compile out the counters behind BzTree::GetStats
+#ifndef ENABLE_STATS
+#define ENABLE_STATS 1
+#endif
+
+// Build with ENABLE_PERF_EVENTS=1 to count hardware events by phase, see
+// PerfProfile
+#ifndef ENABLE_PERF_EVENTS
+#define ENABLE_PERF_EVENTS 0
+#endif
+
 namespace bztree {
 
 #ifdef PMDK
 struct Allocator {
   static pmwcas::PMDKAllocator *allocator_;
+  // Bumped by each Init and Uninit, so that state kept for a pool a thread
+  // used before can tell it's gone even if the new pool is mapped at the same
+  // address
+  static std::atomic<uint64_t> generation_;
   static void Init(pmwcas::PMDKAllocator *allocator) {
     allocator_ = allocator;
+    generation_.fetch_add(1, std::memory_order_release);
+  }
+  // Required once the trees in the pool are no longer used, before the pool
+  // is closed or initialized again, so that threads that exit later leave its
+  // node reservations alone
+  static void Uninit() {
+    generation_.fetch_add(1, std::memory_order_release);
+    allocator_ = nullptr;
   }
   inline static pmwcas::PMDKAllocator *Get() {
     return allocator_;
   }
+  inline static uint64_t GetGeneration() {
+    return generation_.load(std::memory_order_acquire);
+  }
+};
+#endif
+
+// Hardware events (perf_event_open, user mode only) counted on each thread
+// and charged to the phase of tree operation it is in: traversals, searches
+// of leaves, PMwCASs, write-backs to PMEM and splits. Phases nest, and each
+// one is charged what happens in it but not in the phases nested in it; what
+// happens outside of any phase isn't counted. kTaskClock (CPU time in ns) is
+// a software event, always there; the hardware ones are left at zero where
+// the CPU or VM doesn't expose them, and kRaw counts the raw event given by
+// BZTREE_PERF_RAW (hex, e.g., a PMEM media read event of the CPU), if any.
+// Threads that can't open the counters (see perf_event_paranoid) count
+// nothing. Entering or leaving a phase reads the counters with a system call,
+// so phases are only marked when built with ENABLE_PERF_EVENTS=1.
+class PerfProfile {
+ public:
+  enum Phase { kTraverse, kLeafSearch, kPMwCAS, kFlush, kSMO, kPhases };
+  enum Counter {
+    kTaskClock, kCycles, kInstructions, kCacheMisses, kDTLBMisses, kRaw, kCounters
+  };
+
+  // Counts of [counter] summed over all threads, one line per stack of
+  // phases, e.g., "smo;pmwcas 1234", the folded format flamegraph.pl takes
+  static void DumpFolded(std::ostream &out, Counter counter);
+  static void Reset();
+
+  static void Enter(Phase phase);
+  static void Leave();
+};
+
+class PerfPhase {
+ public:
+  explicit PerfPhase(PerfProfile::Phase phase) { PerfProfile::Enter(phase); }
+  ~PerfPhase() { PerfProfile::Leave(); }
+};
+
+#if ENABLE_PERF_EVENTS
+#define PERF_PHASE(phase) PerfPhase perf_phase(PerfProfile::phase)
+#else
+#define PERF_PHASE(phase)
+#endif
+
+// A PMwCAS, as a phase of its own
+inline bool RunMwCAS(pmwcas::Descriptor *pd) {
+  PERF_PHASE(kPMwCAS);
+  return pd->MwCAS();
+}
+
+// Epoch protection for the length of a tree operation. A thread protected
+// already, by a ReadSession or an operation further up, is left as it is:
+// entering again would end the outer protection on the way out.
+class EpochScope {
+ public:
+  explicit EpochScope(pmwcas::EpochManager *epoch)
+      : epoch_(epoch->IsProtected() ? nullptr : epoch) {
+    if (epoch_) {
+      epoch_->Protect();
+    }
+  }
+  ~EpochScope() {
+    if (epoch_) {
+      epoch_->Unprotect();
+    }
+  }
+
+ private:
+  pmwcas::EpochManager *epoch_;
+};
+
+// Where nodes in DRAM (not PMDK) come from. By default that's the PMwCAS
+// allocator. With huge pages on, nodes of up to kMaxSlabNodeSize bytes are
+// instead carved out of 2 MB slabs backed by transparent huge pages, which
+// keeps TLB misses off the traversal path. Each slab serves one size class.
+// Threads cache free nodes of each class and only lock the shared free lists
+// to exchange them in batches, so the three allocations of a split and the
+// frees of reclaimed nodes rarely leave the thread. The setting is
+// process-wide since nodes are allocated by static New functions; Free knows
+// where a node came from, so it can be changed at any time.
+//
+// On machines with several NUMA nodes (sockets), slabs are by default placed
+// wherever the kernel puts the pages first touched, and freed nodes go to
+// whichever thread frees them, so over time a thread gets nodes from all
+// sockets. SetNumaPlacement binds each slab to a socket instead and keeps
+// free nodes apart by socket, in the thread caches too, so that kNumaLocal
+// hands out nodes on the socket the allocating thread runs on. kNumaLocalLeaves
+// does that for leaves only and interleaves the pages of internal nodes over
+// all sockets, as the upper levels are read by every thread (see also
+// BzTree::EnableInternalNodeCache for copies of them on each socket). PMEM
+// nodes (PMDK) are placed by the pool, i.e., where its file lives; those
+// built by splits and consolidations come off chunks each thread reserved in
+// the pool ahead, by size class, rather than out of a transaction each.
+class NodeAllocator {
+ public:
+  static const uint64_t kSlabSize = 2 * 1024 * 1024;
+  static const uint32_t kMaxSlabNodeSize = 64 * 1024;
+
+  static void UseHugePages(bool enable);
+  enum NumaPlacement { kNumaFirstTouch, kNumaLocal, kNumaLocalLeaves };
+  static void SetNumaPlacement(NumaPlacement placement);
+  // NUMA nodes of the machine (from 1 up to kMaxNumaNodes) and the one the
+  // calling thread runs on, as of its last few calls
+  static const uint32_t kMaxNumaNodes = 8;
+  static uint32_t GetNumaNodeCount();
+  static uint32_t GetNumaNode();
+  // Bind the pages of [mem] to NUMA node [numa_node], or interleave them over
+  // all nodes if it's kMaxNumaNodes, moving those already there; [mem] and
+  // [size] must be page-aligned. Does nothing where that isn't supported.
+  static void BindToNumaNode(void *mem, uint64_t size, uint32_t numa_node);
+
+  // [internal] is set for internal nodes, see kNumaLocalLeaves
+  static void Allocate(void **mem, uint32_t size, bool internal = false);
+  static void Free(void *mem);
+  // For descriptors whose reserved words hold new nodes
+  static void FreeCallback(void *context, void *mem) { Free(mem); }
+  // Bytes of slabs mapped so far
+  static uint64_t GetSlabBytes();
+
+  // Size classes: 64 bytes, then four per power of two up to kMaxSlabNodeSize
+  static const uint32_t kSizeClasses = 41;
+  static inline uint32_t GetSizeClass(uint32_t size, uint32_t *class_size) {
+    if (size <= 64) {
+      *class_size = 64;
+      return 0;
+    }
+    uint32_t shift = 31 - __builtin_clz(size - 1) - 2;
+    uint32_t steps = (size + (uint32_t{1} << shift) - 1) >> shift;
+    *class_size = steps << shift;
+    return 1 + (shift - 4) * 4 + (steps - 5);
+  }
+};
+
+// How threads that lose a race on a node retry. With kSpin they retry right
+// away. With kBackoff they pause for exponentially longer (randomized) spans
+// after each failed PMwCAS and before retrying on a node frozen by another
+// thread, so fewer threads pound on the same status word and metadata lines
+// at once. A thread finding a leaf frozen by another, i.e., split or
+// consolidated, watches the leaf's entry in the parent until the new node is
+// in, pausing and eventually yielding in between; if that takes longer than
+// kMaxWaits rounds, e.g., as the thread doing the split was preempted, it
+// does the split itself (and whoever gets the new node in first wins). kHelp
+// backs off from failed PMwCASs the same way, but goes right ahead with the
+// split of a node frozen by another. The policy is process-wide, like the
+// node allocator, as leaves don't know their tree; kBackoff is the default.
+class ContentionManager {
+ public:
+  enum Policy { kSpin, kBackoff, kHelp };
+  static void SetPolicy(Policy policy);
+  static Policy GetPolicy();
+
+  // Pause before retry number [attempt] (from 1) of something that failed
+  static void Pause(uint32_t attempt);
+
+  // Pauses double from kMinPauses up to kMaxPauses per retry
+  static const uint32_t kMinPauses = 4;
+  static const uint32_t kMaxPauses = 1024;
+  // Rounds of waiting for a frozen leaf to be replaced; those past the one
+  // reaching kMaxPauses yield the CPU instead
+  static const uint32_t kMaxWaits = 16;
+};
+
+// Write-back of new data to persistent memory, batched per thread. A flush
+// per range written (pmwcas::NVRAM::Flush) also costs a fence per range, and
+// writes back lines that were flushed already, e.g., a new node's lines once
+// when it's allocated and again when it's filled in. Instead, Add() collects
+// the ranges written, merging those that touch, and Drain() writes back each
+// of their cache lines once, followed by a single fence. Whatever publishes
+// the data, i.e., the PMwCAS making a record visible or installing a node,
+// has to drain first. Ranges that don't fit are drained right away.
+class PersistBatch {
+ public:
+  static const uint32_t kCacheLineSize = 64;
+  static const uint32_t kMaxRanges = 16;
+
+  static void Add(const void *addr, uint64_t size);
+  // Copy [size] bytes to [dst] with non-temporal stores, which need no
+  // write-back, only the fence of the next Drain()
+  static void Stream(void *dst, const void *src, uint64_t size);
+  static void Drain();
+  // Cache lines waiting for the next Drain()
+  static uint64_t GetPendingLines();
 };
+
+// Descriptor for a PMwCAS that installs new nodes held in its reserved words,
+// which are freed through the node allocator if the PMwCAS fails
+static inline pmwcas::Descriptor *AllocateNodeDescriptor(pmwcas::DescriptorPool *pool) {
+#ifdef PMDK
+  return pool->AllocateDescriptor();
+#else
+  return pool->AllocateDescriptor(nullptr, NodeAllocator::FreeCallback);
 #endif
+}
 
 extern uint64_t global_epoch;
 
@@ -42,7 +269,9 @@ struct ReturnCode {
     RetNotFound,
     RetNodeFrozen,
     RetPMWCASFail,
-    RetNotEnoughSpace
+    RetNotEnoughSpace,
+    RetValueMismatch,
+    RetIOError
   };
 
   uint8_t rc;
@@ -58,6 +287,8 @@ struct ReturnCode {
   constexpr bool inline IsNodeFrozen() const { return rc == RetNodeFrozen; }
   constexpr bool inline IsPMWCASFailure() const { return rc == RetPMWCASFail; }
   constexpr bool inline IsNotEnoughSpace() const { return rc == RetNotEnoughSpace; }
+  constexpr bool inline IsValueMismatch() const { return rc == RetValueMismatch; }
+  constexpr bool inline IsIOError() const { return rc == RetIOError; }
 
   static inline ReturnCode NodeFrozen() { return ReturnCode(RetNodeFrozen); }
   static inline ReturnCode KeyExists() { return ReturnCode(RetKeyExists); }
@@ -65,16 +296,34 @@ struct ReturnCode {
   static inline ReturnCode Ok() { return ReturnCode(RetOk); }
   static inline ReturnCode NotFound() { return ReturnCode(RetNotFound); }
   static inline ReturnCode NotEnoughSpace() { return ReturnCode(RetNotEnoughSpace); }
+  static inline ReturnCode ValueMismatch() { return ReturnCode(RetValueMismatch); }
+  static inline ReturnCode IOError() { return ReturnCode(RetIOError); }
 };
 
 struct NodeHeader {
   // Header:
-  // |-------64 bits-------|---32 bits---|---32 bits---|
-  // |     status word     |     size    | sorted count|
+  // |-------64 bits-------|---32 bits---|---32 bits---|---16 bits---|
+  // |     status word     |     size    | sorted count| prefix size |
   //
   // Sorted count is actually the index into the first metadata entry for
   // unsorted records. Following the header is a growing array of record metadata
   // entries.
+  //
+  // Prefix size is the length of the key prefix all records in the node share
+  // and that is left out of their keys (leaf nodes only, see LeafNode::SetPrefix).
+  // It is followed by the size of the leaf's Bloom filter, 0 if it has none (see
+  // LeafNode::MayContain), or in internal nodes by the error bound of their
+  // interpolation search plus one, 0 if they have none (see
+  // InternalNode::FitSearchModel).
+  //
+  // The header ends with a 64-bit pointer to a volatile DRAM copy of the node
+  // (internal nodes only, see BzTree::EnableInternalNodeCache), meaningless
+  // after a restart, or in leaf nodes by the number of their reservation
+  // lanes, 0 if they have none (see LeafNode::GetLane).
+  //
+  // The 32 bits after the size cache the number of records below an internal
+  // node plus one, 0 if not known yet (see BzTree::Count); just a hint, not
+  // kept in sync with the records nor persisted along with them.
 
   // 64-bit status word subdivided into five fields. Internal nodes only use the
   // first two (control and frozen) while leaf nodes use all the five.
@@ -114,9 +363,24 @@ struct NodeHeader {
   };
 
   uint32_t size;
+  // Of internal nodes, records below plus one, 0 if not known (see
+  // BzTree::GetSubtreeRecords); kept up to date in DRAM only, cleared upon
+  // recovery
+  uint32_t record_estimate;
   StatusWord status;
   uint32_t sorted_count;
-  NodeHeader() : size(0), sorted_count(0) {}
+  uint16_t prefix_size;
+  union {
+    uint16_t bloom_size;
+    uint16_t search_error;
+  };
+  union {
+    uint64_t dram_copy;
+    uint64_t lane_count;
+  };
+  NodeHeader()
+      : size(0), record_estimate(0), sorted_count(0), prefix_size(0), bloom_size(0),
+        dram_copy(0) {}
   inline StatusWord GetStatus() {
     auto status_val = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
         &this->status.word)->GetValueProtected();
@@ -132,7 +396,8 @@ struct RecordMetadata {
   static const uint64_t kControlMask = uint64_t{0x7} << 61;           // Bits 64-62
   static const uint64_t kVisibleMask = uint64_t{0x1} << 60;           // Bit 61
   static const uint64_t kOffsetMask = uint64_t{0xFFFFFFF} << 32;      // Bits 60-33
-  static const uint64_t kKeyLengthMask = uint64_t{0xFFFF} << 16;      // Bits 32-17
+  static const uint64_t kVarPayloadMask = uint64_t{0x1} << 31;        // Bit 32
+  static const uint64_t kKeyLengthMask = uint64_t{0x7FFF} << 16;      // Bits 31-17
   static const uint64_t kTotalLengthMask = uint64_t{0xFFFF};          // Bits 16-1
 
   static const uint64_t kAllocationEpochMask = uint64_t{0x7FFFFFF} << 32;  // Bit 59-33
@@ -150,6 +415,19 @@ struct RecordMetadata {
     return (key_length + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
   }
   inline uint16_t GetTotalLength() { return (uint16_t) (meta & kTotalLengthMask); }
+
+  // Space taken by the record in the node; records are 8-byte aligned so that
+  // 8-byte payloads can be PMwCAS targets
+  inline uint32_t GetPaddedTotalLength() { return PadLength(GetTotalLength()); }
+  static inline constexpr uint32_t PadLength(uint32_t length) {
+    return (length + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+  }
+  inline uint32_t GetPayloadLength() { return GetTotalLength() - GetPaddedKeyLength(); }
+
+  // A variable-length payload is an opaque byte string that is never changed
+  // in place (updates insert a new record), as opposed to the default 8-byte
+  // payload which is updated with PMwCAS and so must keep its 3 MSBs clear.
+  inline bool HasVarPayload() const { return (meta & kVarPayloadMask) > 0; }
   inline uint32_t GetOffset() { return (uint32_t) ((meta & kOffsetMask) >> 32); }
   inline bool OffsetIsEpoch() {
     return (GetOffset() >> 27) == 1;
@@ -178,7 +456,8 @@ struct RecordMetadata {
     meta = (uint64_t{1} << 59) | (global_epoch << 32);
     assert(IsInserting());
   }
-  inline void FinalizeForInsert(uint64_t offset, uint64_t key_len, uint64_t total_len) {
+  inline void FinalizeForInsert(uint64_t offset, uint64_t key_len, uint64_t total_len,
+                                bool var_payload = false) {
     // Set the actual offset, the visible bit, key/total length
     if (offset == 0) {
       // this record is duplicate inserted
@@ -187,6 +466,9 @@ struct RecordMetadata {
     } else {
       meta = (offset << 32) | kVisibleMask | (key_len << 16) | total_len;
     }
+    if (var_payload) {
+      meta |= kVarPayloadMask;
+    }
     assert(GetKeyLength() == key_len);
   }
   inline bool IsInserting() {
@@ -197,16 +479,54 @@ struct RecordMetadata {
   }
 };
 
-static const inline int my_memcmp(const char *key1, const char *key2, uint32_t size) {
-  for (uint32_t i = 0; i < size; i++) {
+// Compare [size] bytes of two keys as unsigned bytes, like memcmp, but
+// inlined and without the call overhead that dominates for short keys: 8 bytes
+// at a time as big-endian words, 16 or 32 at a time with SSE2/AVX2 when built
+// with them, and byte by byte for the last (up to 7) bytes.
+static inline int CompareKeyBytes(const char *key1, const char *key2, uint32_t size) {
+  uint32_t i = 0;
+#ifdef __AVX2__
+  for (; i + 32 <= size; i += 32) {
+    auto v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(key1 + i));
+    auto v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(key2 + i));
+    uint32_t ne = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, v2)));
+    if (ne) {
+      auto k = i + __builtin_ctz(ne);
+      return static_cast<int>(static_cast<uint8_t>(key1[k])) - static_cast<uint8_t>(key2[k]);
+    }
+  }
+#endif
+#ifdef __SSE2__
+  for (; i + 16 <= size; i += 16) {
+    auto v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key1 + i));
+    auto v2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key2 + i));
+    uint32_t ne = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2))) & 0xFFFF;
+    if (ne) {
+      auto k = i + __builtin_ctz(ne);
+      return static_cast<int>(static_cast<uint8_t>(key1[k])) - static_cast<uint8_t>(key2[k]);
+    }
+  }
+#endif
+  for (; i + 8 <= size; i += 8) {
+    uint64_t w1, w2;
+    memcpy(&w1, key1 + i, sizeof(w1));
+    memcpy(&w2, key2 + i, sizeof(w2));
+    if (w1 != w2) {
+      w1 = __builtin_bswap64(w1);
+      w2 = __builtin_bswap64(w2);
+      return w1 < w2 ? -1 : 1;
+    }
+  }
+  for (; i < size; ++i) {
     if (key1[i] != key2[i]) {
-      return key1[i] - key2[i];
+      return static_cast<int>(static_cast<uint8_t>(key1[i])) - static_cast<uint8_t>(key2[i]);
     }
   }
   return 0;
 }
 
 class Stack;
+struct VarKeyPolicy;
 class BaseNode {
  protected:
   bool is_leaf;
@@ -241,12 +561,7 @@ class BaseNode {
     } else if (!key2) {
       return 1;
     }
-    int cmp;
-    if (std::min(size1, size2) < 16) {
-      cmp = my_memcmp(key1, key2, std::min<uint32_t>(size1, size2));
-    } else {
-      cmp = memcmp(key1, key2, std::min<uint32_t>(size1, size2));
-    }
+    int cmp = CompareKeyBytes(key1, key2, std::min<uint32_t>(size1, size2));
     if (cmp == 0) {
       return size1 - size2;
     }
@@ -254,6 +569,13 @@ class BaseNode {
   }
   // Set the frozen bit to prevent future modifications to the node
   bool Freeze(pmwcas::DescriptorPool *pmwcas_pool);
+  // Add what freezes the node to [pd]: its status word, expected to be
+  // [expected], and the reservation lanes of a leaf that has them
+  void AddFreezeEntries(pmwcas::Descriptor *pd, NodeHeader::StatusWord expected);
+  // How many PMwCAS words AddFreezeEntries takes
+  inline uint32_t GetFreezeWords() {
+    return 1 + (is_leaf ? static_cast<uint32_t>(header.lane_count) : 0);
+  }
   inline RecordMetadata GetMetadata(uint32_t i) {
     // ensure the metadata is installed
     auto meta = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
@@ -266,9 +588,118 @@ class BaseNode {
   inline bool IsLeaf() { return is_leaf; }
   inline NodeHeader *GetHeader() { return &header; }
 
+  // The key prefix shared by all records, stored once at the end of the node
+  inline uint16_t GetPrefixSize() { return header.prefix_size; }
+  inline char *GetPrefix() {
+    return reinterpret_cast<char *>(this) + header.size -
+        RecordMetadata::PadKeyLength(header.prefix_size);
+  }
+  static inline uint32_t CommonPrefixLength(const char *key1, uint32_t size1,
+                                            const char *key2, uint32_t size2) {
+    uint32_t size = std::min(size1, size2);
+    uint32_t i = 0;
+    while (i < size && key1[i] == key2[i]) {
+      ++i;
+    }
+    return i;
+  }
+
+  // The shortest separator between two adjacent keys [left] < [right], i.e.,
+  // a key not smaller than [left] but smaller than [right]: the prefix of
+  // [right] one byte past their common prefix, or [left] itself if that
+  // prefix would be all of [right]. Keys take at least 8 bytes in a node, so
+  // separators aren't cut shorter than that (which also keeps them whole for
+  // U64KeyPolicy).
+  static inline void GetShortestSeparator(const char *left, uint32_t left_size,
+                                          const char *right, uint32_t right_size,
+                                          const char **separator, uint32_t *separator_size) {
+    uint32_t size = std::max<uint32_t>(CommonPrefixLength(left, left_size, right, right_size) + 1,
+                                       sizeof(uint64_t));
+    if (size < right_size) {
+      *separator = right;
+      *separator_size = size;
+    } else {
+      *separator = left;
+      *separator_size = left_size;
+    }
+  }
+
+  // Leaf nodes keep a 1-byte hash of the key of each record metadata entry in
+  // an array in front of the key prefix, so that searches of the unsorted
+  // field only look at the keys whose fingerprint matches. Entries past what
+  // the array covers (very short records) have no fingerprint.
+  static inline uint32_t GetFingerprintCapacity(uint32_t node_size) {
+    // Enough for records of 8-byte keys and payloads, in whole 16-byte blocks
+    auto records = (node_size - sizeof(BaseNode)) /
+        (sizeof(RecordMetadata) + 2 * sizeof(uint64_t));
+    return (records + 15) / 16 * 16;
+  }
+  inline uint8_t *GetFingerprints() {
+    return reinterpret_cast<uint8_t *>(GetPrefix()) - GetFingerprintCapacity(header.size);
+  }
+  static inline uint8_t KeyFingerprint(const char *key, uint32_t size) {
+    return static_cast<uint8_t>(KeyHash(key, size) >> 56);
+  }
+  // Multiplicative hash of [key], whose high bits are the best mixed
+  static inline uint64_t KeyHash(const char *key, uint32_t size) {
+    uint64_t hash = size;
+    uint32_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, key + i, sizeof(word));
+      hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+    }
+    if (i < size) {
+      uint64_t word = 0;
+      memcpy(&word, key + i, size - i);
+      hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+    }
+    return hash;
+  }
+  // One bit for each of the [count] (at most 16) entries from [begin] whose
+  // fingerprint is [fingerprint] or who have none
+  inline uint32_t MatchFingerprints(uint8_t fingerprint, uint32_t begin, uint32_t count) {
+    auto capacity = GetFingerprintCapacity(header.size);
+    auto *fingerprints = GetFingerprints();
+    uint32_t mask = (uint32_t{1} << count) - 1;
+#ifdef __SSE2__
+    if (begin + 16 <= capacity) {
+      auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(fingerprints + begin));
+      auto eq = _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(fingerprint)));
+      return static_cast<uint32_t>(_mm_movemask_epi8(eq)) & mask;
+    }
+#endif
+    uint32_t matches = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      if (begin + i >= capacity || fingerprints[begin + i] == fingerprint) {
+        matches |= uint32_t{1} << i;
+      }
+    }
+    return matches;
+  }
+
+  // Binary search on the sorted field, i.e., [0, sorted_count). Returns the
+  // index of the first record whose key is not less than [key]; [*exact] is
+  // set if that record holds exactly [key]. Deleted records are not skipped.
+  // [protect_meta] can be turned off for nodes whose metadata array is never a
+  // PMwCAS target (internal nodes). Keys are compared with [KeyPolicy].
+  template <class KeyPolicy = VarKeyPolicy>
+  uint32_t SearchSortedRegion(const char *key, uint32_t key_size, bool *exact,
+                              bool protect_meta = true);
+  // Whether the record at [pos] of the sorted field, deleted or not, holds
+  // [key]. With ParameterSet::duplicate_keys, the records of a key are found
+  // next to the one SearchSortedRegion gets to.
+  template <class KeyPolicy = VarKeyPolicy>
+  inline bool SortedKeyEquals(uint32_t pos, const char *key, uint32_t key_size) {
+    RecordMetadata meta = GetMetadata(pos);
+    return KeyPolicy::Compare(key, key_size, reinterpret_cast<char *>(this) + meta.GetOffset(),
+                              meta.GetKeyLength()) == 0;
+  }
+
   // Return a meta (not deleted) or nullptr (deleted or not exist)
   // It's user's responsibility to check IsInserting()
   // if check_concurrency is false, it will ignore all inserting record
+  template <class KeyPolicy = VarKeyPolicy>
   RecordMetadata SearchRecordMeta(pmwcas::EpochManager *epoch,
                                   const char *key, uint32_t key_size,
                                   RecordMetadata **out_metadata,
@@ -324,6 +755,290 @@ class BaseNode {
   ReturnCode CheckMerge(Stack *stack, const char *key, uint32_t key_size, bool backoff);
 };
 
+// Key policies tell the search code how the keys of a tree compare, so that
+// trees whose keys all have the same shape can skip the generic path. The
+// node layout is the same for all policies: a policy only assumes things
+// about the keys stored, it never changes how they are stored.
+//
+// Any key: byte strings compared as unsigned bytes, a prefix sorting first
+struct VarKeyPolicy {
+  struct KeyType {
+    const char *data;
+    uint16_t size;
+  };
+  typedef KeyType EncodedKey;
+  static inline EncodedKey Encode(const KeyType &key) { return key; }
+  static inline KeyType Decode(const char *key, uint16_t key_size) {
+    return KeyType{key, key_size};
+  }
+  static inline const char *GetData(const EncodedKey &key) { return key.data; }
+  static inline uint16_t GetSize(const EncodedKey &key) { return key.size; }
+
+  static inline int Compare(const char *key1, uint32_t size1, const char *key2, uint32_t size2) {
+    return BaseNode::KeyCompare(key1, size1, key2, size2);
+  }
+  static inline bool Equal(const char *key1, uint32_t size1, const char *key2, uint32_t size2) {
+    return size1 == size2 && CompareKeyBytes(key1, key2, size1) == 0;
+  }
+  static inline uint16_t GetPaddedKeyLength(RecordMetadata meta) {
+    return meta.GetPaddedKeyLength();
+  }
+};
+
+// 8-byte unsigned integers, stored big-endian so that their byte order is
+// their numeric order (and the rest of the tree, which only sees bytes, keeps
+// working). All keys in the tree must be encoded this way: key lengths are
+// not looked at, keys are loaded, byte-swapped and compared as integers.
+// Leaves with a key prefix (prefix_compression) are searched the generic way.
+struct U64KeyPolicy {
+  typedef uint64_t KeyType;
+  struct EncodedKey {
+    uint64_t word;
+  };
+  static const uint16_t kKeySize = sizeof(uint64_t);
+  static inline EncodedKey Encode(uint64_t key) { return EncodedKey{__builtin_bswap64(key)}; }
+  static inline uint64_t Decode(const char *key, uint16_t key_size = kKeySize) {
+    assert(key_size == kKeySize);
+    return Load(key);
+  }
+  static inline const char *GetData(const EncodedKey &key) {
+    return reinterpret_cast<const char *>(&key.word);
+  }
+  static inline uint16_t GetSize(const EncodedKey &) { return kKeySize; }
+
+  static inline uint64_t Load(const char *key) {
+    uint64_t word;
+    memcpy(&word, key, sizeof(word));
+    return __builtin_bswap64(word);
+  }
+  // A null key is the dummy key of internal nodes, smaller than any other
+  static inline int Compare(const char *key1, uint32_t, const char *key2, uint32_t) {
+    if (!key1) {
+      return -1;
+    } else if (!key2) {
+      return 1;
+    }
+    auto k1 = Load(key1);
+    auto k2 = Load(key2);
+    return static_cast<int>(k1 > k2) - static_cast<int>(k1 < k2);
+  }
+  static inline bool Equal(const char *key1, uint32_t, const char *key2, uint32_t) {
+    return memcmp(key1, key2, kKeySize) == 0;
+  }
+  static inline uint16_t GetPaddedKeyLength(RecordMetadata) { return kKeySize; }
+};
+
+// Order-preserving encodings of typed values into key bytes: encoded keys
+// compare (with KeyCompare, i.e., as unsigned bytes) the way the values do,
+// and fields encoded one after the other compare as tuples, field by field.
+// Each Encode writes to [out] and returns the end of what it wrote; each
+// Decode reads from [in] and returns the end of what it read, or nullptr if
+// [in] up to [end] doesn't hold a valid encoding.
+//  - Unsigned integers are stored big-endian (as U64KeyPolicy does), signed
+//    ones the same with the sign bit flipped, so negatives come first.
+//  - Floating point numbers have the sign bit flipped if positive and all
+//    bits flipped if negative: -inf < negatives < -0.0 < 0.0 < positives <
+//    inf, NaNs (with the sign bit clear) after inf.
+//  - Strings have each zero byte escaped as 0x00 0xFF and end with 0x00 0x01,
+//    so a string sorts before its extensions and the fields after it never
+//    get compared with its bytes; at most 2 * size + 2 bytes. The last field
+//    of a key can be stored as is instead (EncodeBytes), but only the last.
+struct KeyEncoding {
+  static const uint32_t kTerminatorSize = 2;
+  static inline uint32_t GetMaxStringSize(uint32_t size) { return 2 * size + kTerminatorSize; }
+
+  static inline char *EncodeU64(uint64_t value, char *out) {
+    value = __builtin_bswap64(value);
+    memcpy(out, &value, sizeof(value));
+    return out + sizeof(value);
+  }
+  static inline char *EncodeU32(uint32_t value, char *out) {
+    value = __builtin_bswap32(value);
+    memcpy(out, &value, sizeof(value));
+    return out + sizeof(value);
+  }
+  static inline char *EncodeI64(int64_t value, char *out) {
+    return EncodeU64(static_cast<uint64_t>(value) ^ kSign64, out);
+  }
+  static inline char *EncodeI32(int32_t value, char *out) {
+    return EncodeU32(static_cast<uint32_t>(value) ^ kSign32, out);
+  }
+  static inline char *EncodeDouble(double value, char *out) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return EncodeU64(bits & kSign64 ? ~bits : bits | kSign64, out);
+  }
+  static inline char *EncodeFloat(float value, char *out) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return EncodeU32(bits & kSign32 ? ~bits : bits | kSign32, out);
+  }
+  static inline char *EncodeString(const char *value, uint32_t size, char *out) {
+    for (uint32_t i = 0; i < size; ++i) {
+      *out++ = value[i];
+      if (value[i] == '\0') {
+        *out++ = '\xff';
+      }
+    }
+    *out++ = '\0';
+    *out++ = '\x01';
+    return out;
+  }
+  static inline char *EncodeBytes(const char *value, uint32_t size, char *out) {
+    memcpy(out, value, size);
+    return out + size;
+  }
+
+  static inline const char *DecodeU64(const char *in, const char *end, uint64_t *value) {
+    if (end - in < static_cast<ptrdiff_t>(sizeof(*value))) {
+      return nullptr;
+    }
+    memcpy(value, in, sizeof(*value));
+    *value = __builtin_bswap64(*value);
+    return in + sizeof(*value);
+  }
+  static inline const char *DecodeU32(const char *in, const char *end, uint32_t *value) {
+    if (end - in < static_cast<ptrdiff_t>(sizeof(*value))) {
+      return nullptr;
+    }
+    memcpy(value, in, sizeof(*value));
+    *value = __builtin_bswap32(*value);
+    return in + sizeof(*value);
+  }
+  static inline const char *DecodeI64(const char *in, const char *end, int64_t *value) {
+    uint64_t bits = 0;
+    in = DecodeU64(in, end, &bits);
+    *value = static_cast<int64_t>(bits ^ kSign64);
+    return in;
+  }
+  static inline const char *DecodeI32(const char *in, const char *end, int32_t *value) {
+    uint32_t bits = 0;
+    in = DecodeU32(in, end, &bits);
+    *value = static_cast<int32_t>(bits ^ kSign32);
+    return in;
+  }
+  static inline const char *DecodeDouble(const char *in, const char *end, double *value) {
+    uint64_t bits = 0;
+    in = DecodeU64(in, end, &bits);
+    bits = bits & kSign64 ? bits & ~kSign64 : ~bits;
+    memcpy(value, &bits, sizeof(bits));
+    return in;
+  }
+  static inline const char *DecodeFloat(const char *in, const char *end, float *value) {
+    uint32_t bits = 0;
+    in = DecodeU32(in, end, &bits);
+    bits = bits & kSign32 ? bits & ~kSign32 : ~bits;
+    memcpy(value, &bits, sizeof(bits));
+    return in;
+  }
+  static inline const char *DecodeString(const char *in, const char *end, std::string *value) {
+    value->clear();
+    while (in + 1 < end) {
+      if (*in != '\0') {
+        value->push_back(*in++);
+      } else if (in[1] == '\xff') {
+        value->push_back('\0');
+        in += 2;
+      } else {
+        return in[1] == '\x01' ? in + kTerminatorSize : nullptr;
+      }
+    }
+    return nullptr;
+  }
+
+ private:
+  static const uint64_t kSign64 = uint64_t{1} << 63;
+  static const uint32_t kSign32 = uint32_t{1} << 31;
+};
+
+// Builds a key of several fields with KeyEncoding, e.g., a (tenant,
+// timestamp, id) key as KeyBuilder().AddU32(tenant).AddI64(ts).AddU64(id)
+class KeyBuilder {
+ public:
+  inline KeyBuilder &AddU64(uint64_t value) {
+    return Add(sizeof(value), KeyEncoding::EncodeU64, value);
+  }
+  inline KeyBuilder &AddU32(uint32_t value) {
+    return Add(sizeof(value), KeyEncoding::EncodeU32, value);
+  }
+  inline KeyBuilder &AddI64(int64_t value) {
+    return Add(sizeof(value), KeyEncoding::EncodeI64, value);
+  }
+  inline KeyBuilder &AddI32(int32_t value) {
+    return Add(sizeof(value), KeyEncoding::EncodeI32, value);
+  }
+  inline KeyBuilder &AddDouble(double value) {
+    return Add(sizeof(value), KeyEncoding::EncodeDouble, value);
+  }
+  inline KeyBuilder &AddFloat(float value) {
+    return Add(sizeof(value), KeyEncoding::EncodeFloat, value);
+  }
+  inline KeyBuilder &AddString(const char *value, uint32_t size) {
+    auto used = key.size();
+    key.resize(used + KeyEncoding::GetMaxStringSize(size));
+    auto *end = KeyEncoding::EncodeString(value, size, &key[used]);
+    key.resize(end - key.data());
+    return *this;
+  }
+  inline KeyBuilder &AddString(const std::string &value) {
+    return AddString(value.data(), static_cast<uint32_t>(value.size()));
+  }
+  // Raw bytes, for the last field only
+  inline KeyBuilder &AddBytes(const char *value, uint32_t size) {
+    key.append(value, size);
+    return *this;
+  }
+
+  inline void Clear() { key.clear(); }
+  inline const char *GetData() const { return key.data(); }
+  inline uint16_t GetSize() const { return static_cast<uint16_t>(key.size()); }
+  inline const std::string &GetKey() const { return key; }
+
+ private:
+  template <class T>
+  inline KeyBuilder &Add(uint32_t size, char *(*encode)(T, char *), T value) {
+    auto used = key.size();
+    key.resize(used + size);
+    encode(value, &key[used]);
+    return *this;
+  }
+  std::string key;
+};
+
+// Reads the fields of a key built with KeyBuilder back, in the same order;
+// each Read returns false (and leaves the reader where it was) if what's left
+// of the key doesn't start with a valid encoding
+class KeyReader {
+ public:
+  KeyReader(const char *key, uint32_t key_size) : next(key), end(key + key_size) {}
+
+  inline bool ReadU64(uint64_t *value) { return Read(KeyEncoding::DecodeU64(next, end, value)); }
+  inline bool ReadU32(uint32_t *value) { return Read(KeyEncoding::DecodeU32(next, end, value)); }
+  inline bool ReadI64(int64_t *value) { return Read(KeyEncoding::DecodeI64(next, end, value)); }
+  inline bool ReadI32(int32_t *value) { return Read(KeyEncoding::DecodeI32(next, end, value)); }
+  inline bool ReadDouble(double *value) {
+    return Read(KeyEncoding::DecodeDouble(next, end, value));
+  }
+  inline bool ReadFloat(float *value) { return Read(KeyEncoding::DecodeFloat(next, end, value)); }
+  inline bool ReadString(std::string *value) {
+    return Read(KeyEncoding::DecodeString(next, end, value));
+  }
+  // What's left, e.g., a last field added with AddBytes
+  inline const char *GetRest() const { return next; }
+  inline uint32_t GetRestSize() const { return static_cast<uint32_t>(end - next); }
+
+ private:
+  inline bool Read(const char *after) {
+    if (!after) {
+      return false;
+    }
+    next = after;
+    return true;
+  }
+  const char *next;
+  const char *end;
+};
+
 // Internal node: immutable once created, no free space, keys are always sorted
 // operations that might mutate the InternalNode:
 //    a. create a new node, this will set the freeze bit in status
@@ -332,9 +1047,11 @@ class BaseNode {
 // thus we can safely dereference them without a wrapper.
 class InternalNode : public BaseNode {
  public:
+  // [child_index] is where [key]'s left child was in [src_node], which places
+  // [key] among separators equal to it (see ParameterSet::duplicate_keys)
   static void New(InternalNode *src_node, const char *key, uint32_t key_size,
                   uint64_t left_child_addr, uint64_t right_child_addr,
-                  InternalNode **mem);
+                  InternalNode **mem, uint32_t child_index);
   static void New(const char *key, uint32_t key_size,
                   uint64_t left_child_addr, uint64_t right_child_addr,
                   InternalNode **mem);
@@ -342,8 +1059,17 @@ class InternalNode : public BaseNode {
                   const char *key, uint32_t key_size,
                   uint64_t left_child_addr, uint64_t right_child_addr,
                   InternalNode **mem,
-                  uint64_t left_most_child_addr);
+                  uint64_t left_most_child_addr, uint32_t child_index = 0);
   static void New(InternalNode **mem, uint32_t node_size);
+  // Create an internal node with [count] children, [keys[i]] being the
+  // separator to the left of child i (keys[0] is ignored, it's the dummy key)
+  static void New(const char *const *keys, const uint16_t *key_sizes,
+                  const uint64_t *children, uint32_t count, InternalNode **mem);
+  // Size of the node the above would create
+  static uint32_t GetNodeSize(const uint16_t *key_sizes, uint32_t count);
+  // Lay out that node in the GetNodeSize() zeroed bytes at [image]
+  static void Build(const char *const *keys, const uint16_t *key_sizes,
+                    const uint64_t *children, uint32_t count, char *image);
 
   InternalNode(uint32_t node_size, const char *key, uint16_t key_size,
                uint64_t left_child_addr, uint64_t right_child_addr);
@@ -351,28 +1077,80 @@ class InternalNode : public BaseNode {
                uint32_t begin_meta_idx, uint32_t nr_records,
                const char *key, uint16_t key_size,
                uint64_t left_child_addr, uint64_t right_child_addr,
-               uint64_t left_most_child_addr = 0);
+               uint64_t left_most_child_addr = 0, uint32_t child_index = 0);
   ~InternalNode() = default;
 
-  bool PrepareForSplit(Stack &stack, uint32_t split_threshold,
+  bool PrepareForSplit(Stack &stack, uint32_t internal_node_size,
                        const char *key, uint32_t key_size,
                        uint64_t left_child_addr, uint64_t right_child_addr,
                        InternalNode **new_node, pmwcas::Descriptor *pd,
-                       pmwcas::DescriptorPool *pool, bool backoff);
+                       pmwcas::DescriptorPool *pool, bool backoff, bool appending = false);
 
   inline uint64_t *GetPayloadPtr(RecordMetadata meta) {
     char *ptr = reinterpret_cast<char *>(this) + meta.GetOffset() + meta.GetPaddedKeyLength();
     return reinterpret_cast<uint64_t *>(ptr);
   }
-  ReturnCode Update(RecordMetadata meta, InternalNode *old_child, InternalNode *new_child,
-                    pmwcas::Descriptor *pd, pmwcas::DescriptorPool *pmwcas_pool);
+  ReturnCode Update(RecordMetadata meta, BaseNode *old_child, BaseNode *new_child,
+                    pmwcas::Descriptor *pd, pmwcas::DescriptorPool *pmwcas_pool,
+                    uint32_t recycle_policy = pmwcas::Descriptor::kRecycleOnRecovery);
+  // Load the evicted child at [index], [word] in this node, back into memory
+  BaseNode *LoadChild(uint32_t index, uint64_t word);
+
+  // Child pointers are PMDK offsets under PMDK, raw pointers otherwise
+  inline bool HasChild(uint32_t meta_index, uint64_t child_addr) {
+    return reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
+        GetPayloadPtr(record_metadata[meta_index]))->GetValueProtected() == child_addr;
+  }
+
+  // Freeze the node, but only if [meta_index] still points to [child_addr].
+  // Used by SMOs on a child before replacing it: a concurrent consolidation
+  // might have swapped in a new copy of the child in the meantime.
+  bool FreezeIfChild(uint32_t meta_index, uint64_t child_addr,
+                     pmwcas::DescriptorPool *pmwcas_pool);
+  // Index of the child covering [key]; for a key equal to a separator, the
+  // child to its left if [get_le] is set, the one to its right otherwise. A
+  // key can be several separators in a row (see ParameterSet::duplicate_keys),
+  // then it's the child left of the first of them or right of the last.
+  template <class KeyPolicy = VarKeyPolicy>
   uint32_t GetChildIndex(const char *key, uint16_t key_size, bool get_le = true);
 
-  // epoch here is required: record ptr might be a desc due to UPDATE operation
-  // but record_metadata don't need a epoch
-  inline BaseNode *GetChildByMetaIndex(uint32_t index, pmwcas::EpochManager *epoch) {
+  // Nodes whose separators are all 8-byte keys, kMinSearchModelKeys or more,
+  // can be searched by interpolation: a key's position is predicted by the
+  // straight line through the first and the last separator (read as
+  // big-endian integers, i.e., in key order), which is off by at most the
+  // error bound kept in the header, so that a binary search of the
+  // 2 * error + 2 separators around the prediction finds it. The bound is
+  // worked out as the node is built, nodes it would exceed kMaxSearchError
+  // for get none and are searched as the others. Process-wide, as nodes are
+  // built by static New functions; on by default, it only applies to nodes
+  // built from then on.
+  static const uint32_t kMinSearchModelKeys = 8;
+  static const uint32_t kMaxSearchError = 16;
+  static void EnableSearchModels(bool enable);
+  // Work out the error bound of this node, fully built but for it
+  void FitSearchModel();
+  inline bool HasSearchModel() { return header.search_error > 0; }
+
+  // A leaf evicted to a LeafStore (see BzTree::EvictColdLeaves) is a tagged
+  // word in its parent rather than a pointer, with this bit set; child
+  // pointers are at least 8-byte aligned
+  static const uint64_t kEvictedChild = 1;
+  inline uint64_t GetChildWord(uint32_t index, pmwcas::EpochManager *epoch) {
     uint64_t child_addr;
     GetRawRecord(record_metadata[index], nullptr, nullptr, &child_addr, epoch);
+    return child_addr;
+  }
+  inline bool IsChildEvicted(uint32_t index, pmwcas::EpochManager *epoch) {
+    return GetChildWord(index, epoch) & kEvictedChild;
+  }
+
+  // epoch here is required: record ptr might be a desc due to UPDATE operation
+  // but record_metadata don't need a epoch. An evicted child is loaded back.
+  inline BaseNode *GetChildByMetaIndex(uint32_t index, pmwcas::EpochManager *epoch) {
+    uint64_t child_addr = GetChildWord(index, epoch);
+    if (child_addr & kEvictedChild) {
+      return LoadChild(index, child_addr);
+    }
 
 #ifdef PMDK
     return Allocator::Get()->GetDirect<BaseNode>(reinterpret_cast<BaseNode *> (child_addr));
@@ -386,14 +1164,65 @@ class InternalNode : public BaseNode {
   // | key0, val0 | key1, val1 | key2, val2 | key3, val3 |
   // ==>
   // | key0, val0 | key1, val1' | key3, val3 |
+  // or the [count] children right of [meta_to_update], if more than one
   void DeleteRecord(uint32_t meta_to_update,
                     uint64_t new_child_ptr,
-                    InternalNode **new_node);
+                    InternalNode **new_node,
+                    uint32_t count = 1);
 
   static bool MergeNodes(InternalNode *left_node, InternalNode *right_node,
                          const char *key, uint32_t key_size, InternalNode **new_node);
+
+  // DRAM copies of internal nodes (see BzTree::EnableInternalNodeCache) are
+  // followed by the heads of their separators: the 8 bytes of each past the
+  // prefix all of them share, zero-padded and read big-endian so that integer
+  // order follows key order, in Eytzinger (breadth-first) order, then the
+  // index of the separator each head came from. GetChildIndex walks those
+  // integers, three levels to a cache line, and compares whole keys only
+  // where heads tie. The copy pointer of such a copy is [kKeyHeads].
+  static const uint64_t kKeyHeads = 1;
+  // Size of a copy of a node of [node_size] bytes and [count] records
+  static inline uint32_t GetCopySize(uint32_t node_size, uint32_t count) {
+    return ((node_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1)) +
+           count * (sizeof(uint64_t) + sizeof(uint16_t));
+  }
+  // Lay out the key heads behind this copy of an internal node
+  void BuildKeyHeads();
+  static inline uint64_t GetKeyHead(const char *key, uint32_t key_size) {
+    uint64_t word = 0;
+    memcpy(&word, key, std::min<uint32_t>(key_size, sizeof(word)));
+    return __builtin_bswap64(word);
+  }
+
+ private:
+  inline uint64_t *GetKeyHeads() {
+    return reinterpret_cast<uint64_t *>(reinterpret_cast<char *>(this) +
+        ((header.size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1)));
+  }
+  uint32_t SearchKeyHeads(const char *key, uint16_t key_size, bool get_le);
+  // GetChildIndex once separator [pos] is found to be [key]
+  uint32_t GetChildOfSeparator(uint32_t pos, const char *key, uint16_t key_size, bool get_le);
+  inline uint64_t GetSeparatorWord(uint32_t index) {
+    return U64KeyPolicy::Load(reinterpret_cast<char *>(this) +
+                              record_metadata[index].GetOffset());
+  }
+  // Position of [key] on the line through [first] (at 1) and [last] (at
+  // [count] - 1), for [first] <= [key] <= [last]; monotonic in [key]
+  static inline uint32_t PredictPosition(uint64_t key, uint64_t first, uint64_t last,
+                                         uint32_t count) {
+    return 1 + static_cast<uint32_t>(static_cast<double>(key - first) * (count - 2) /
+                                     static_cast<double>(last - first));
+  }
+  // GetChildIndex for nodes with a search model and an 8-byte [key]
+  uint32_t SearchModel(uint64_t key, bool get_le);
+  static std::atomic<bool> search_models;
 };
 
+// Separators are all 8-byte integers: branchless binary search
+template <>
+uint32_t InternalNode::GetChildIndex<U64KeyPolicy>(const char *key, uint16_t key_size,
+                                                   bool get_le);
+
 class LeafNode;
 class BzTree;
 struct Stack {
@@ -427,53 +1256,296 @@ struct Stack {
   inline Frame *Top() { return num_frames == 0 ? nullptr : &frames[num_frames - 1]; }
   inline BaseNode *GetRoot() { return root; }
   inline void SetRoot(BaseNode *node) { root = node; }
+  inline void CopyFrom(const Stack &other) {
+    for (uint32_t i = 0; i < other.num_frames; ++i) {
+      frames[i] = other.frames[i];
+    }
+    num_frames = other.num_frames;
+    root = other.root;
+  }
 };
 
 struct Record;
+class ScanBuffer;
+class VersionWriter;
 
 class LeafNode : public BaseNode {
  public:
-  static void New(LeafNode **mem, uint32_t node_size);
+  static void New(LeafNode **mem, uint32_t node_size, bool bloom_filter = false,
+                  uint32_t lanes = 0);
 
   static inline uint32_t GetUsedSpace(NodeHeader::StatusWord status) {
     return sizeof(LeafNode) + status.GetBlockSize() +
         status.GetRecordCount() * sizeof(RecordMetadata);
   }
 
-  explicit LeafNode(uint32_t node_size = 4096) : BaseNode(true, node_size) {}
+  explicit LeafNode(uint32_t node_size = 4096, bool bloom_filter = false, uint32_t lanes = 0)
+      : BaseNode(true, node_size) {
+    ALWAYS_ASSERT(lanes <= kMaxLanes);
+    header.bloom_size = bloom_filter ? GetBloomFilterSize(node_size) : 0;
+    header.lane_count = lanes;
+    header.status.SetBlockSize(GetTrailerSize(node_size, bloom_filter, lanes));
+  }
   ~LeafNode() = default;
 
+  // Inserts reserve their space with a PMwCAS on the status word and, once
+  // the record is in place, make it visible with another one that carries the
+  // status word along unchanged, only to fail if the node got frozen. A leaf
+  // may instead carry that guard on one of up to kMaxLanes reservation lanes,
+  // words on cache lines of their own in front of the Bloom filter that are 0
+  // until the node is frozen, when they're frozen along with the status word
+  // (see AddFreezeEntries). Each thread sticks to one lane, so concurrent
+  // inserts only meet on the status word once, and the second PMwCAS no
+  // longer fails every time another insert reserved space meanwhile. Space
+  // and metadata entries are still reserved from the status word, in order,
+  // which the uniqueness checks rely on. New leaves take the lanes over from
+  // the nodes they are built from, see ParameterSet::leaf_lanes.
+  static const uint32_t kMaxLanes = 4;
+  static const uint32_t kLaneSize = 64;
+  static inline uint32_t GetLaneSpace(uint32_t lanes) {
+    // One line more, to align them
+    return lanes ? (lanes + 1) * kLaneSize : 0;
+  }
+  inline uint32_t GetLaneCount() { return static_cast<uint32_t>(header.lane_count); }
+  inline NodeHeader::StatusWord *GetLane(uint32_t lane) {
+    // Aligned relative to the node, so that copies of the node have them in
+    // the same place
+    uint64_t end = reinterpret_cast<char *>(GetFingerprints()) - header.bloom_size -
+        reinterpret_cast<char *>(this);
+    uint64_t offset = (end - GetLaneCount() * kLaneSize) & ~uint64_t{kLaneSize - 1};
+    return reinterpret_cast<NodeHeader::StatusWord *>(
+        reinterpret_cast<char *>(this) + offset + lane * kLaneSize);
+  }
+  inline NodeHeader::StatusWord GetLaneStatus(uint32_t lane) {
+    auto word = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
+        &GetLane(lane)->word)->GetValueProtected();
+    return NodeHeader::StatusWord{word};
+  }
+
+  // A leaf may keep a Bloom filter of the keys of all its records in front of
+  // the fingerprints, 8 bits for each record the fingerprints cover, so that
+  // lookups of absent keys (most of them) don't have to search the records at
+  // all. Bits are set before a record's space is reserved and never cleared,
+  // so a key the filter doesn't have is neither in the node nor being
+  // inserted; deleted keys stay until the node is rebuilt. New leaves take the
+  // filter over from the nodes they are built from, see
+  // ParameterSet::bloom_filter.
+  static inline uint32_t GetBloomFilterSize(uint32_t node_size) {
+    return GetFingerprintCapacity(node_size);
+  }
+  // What the fingerprints, the Bloom filter and the reservation lanes take at
+  // the end of the node
+  static inline uint32_t GetTrailerSize(uint32_t node_size, bool bloom_filter,
+                                        uint32_t lanes = 0) {
+    return GetFingerprintCapacity(node_size) * (bloom_filter ? 2 : 1) + GetLaneSpace(lanes);
+  }
+  inline bool HasBloomFilter() { return header.bloom_size > 0; }
+  inline uint64_t *GetBloomFilter() {
+    return reinterpret_cast<uint64_t *>(GetFingerprints() - header.bloom_size);
+  }
+  // Set the bits of [key] (without the node's prefix)
+  inline void AddToBloomFilter(const char *key, uint32_t key_size) {
+    if (!HasBloomFilter()) {
+      return;
+    }
+    auto *filter = GetBloomFilter();
+    uint64_t hash = KeyHash(key, key_size);
+    for (uint32_t i = 0; i < kBloomFilterProbes; ++i) {
+      uint32_t bit = NextBloomFilterBit(&hash);
+      uint64_t mask = uint64_t{1} << (bit % 64);
+      // Bits already set are left alone, not to dirty the line
+      if ((__atomic_load_n(&filter[bit / 64], __ATOMIC_RELAXED) & mask) == 0) {
+        __atomic_fetch_or(&filter[bit / 64], mask, __ATOMIC_SEQ_CST);
+      }
+    }
+  }
+  // False if [key] (without the node's prefix) is surely not in the node
+  inline bool MayContain(const char *key, uint32_t key_size) {
+    if (!HasBloomFilter()) {
+      return true;
+    }
+    auto *filter = GetBloomFilter();
+    uint64_t hash = KeyHash(key, key_size);
+    for (uint32_t i = 0; i < kBloomFilterProbes; ++i) {
+      uint32_t bit = NextBloomFilterBit(&hash);
+      if ((__atomic_load_n(&filter[bit / 64], __ATOMIC_ACQUIRE) >> (bit % 64) & 1) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Writes that change records take the VersionWriter of the tree's open
+  // snapshots, if any, see Snapshot. Inserts with [unique] off add the record
+  // whether or not the key has others, see ParameterSet::duplicate_keys.
   ReturnCode Insert(const char *key, uint16_t key_size, uint64_t payload,
-                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold);
-  bool PrepareForSplit(Stack &stack, uint32_t split_threshold,
+                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                    VersionWriter *versions = nullptr, bool unique = true);
+  // Insert a record with a variable-length payload of [payload_size] bytes
+  ReturnCode Insert(const char *key, uint16_t key_size,
+                    const char *payload, uint32_t payload_size,
+                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                    VersionWriter *versions = nullptr, bool unique = true);
+  // Insert [count] records with distinct keys and 8-byte payloads, reserving
+  // space for up to DESC_CAP - 1 of them with one PMwCAS and making them
+  // visible with another, instead of two per record. The result of record i
+  // goes to [rcs[i]] (Ok or KeyExists). Stops early with NotEnoughSpace or
+  // NodeFrozen, in which case only the first [*done] records were handled.
+  ReturnCode InsertBatch(const char *const *keys, const uint16_t *key_sizes,
+                         const uint64_t *payloads, uint32_t count, ReturnCode *rcs,
+                         uint32_t *done, pmwcas::DescriptorPool *pmwcas_pool,
+                         uint32_t split_threshold, VersionWriter *versions = nullptr,
+                         bool unique = true);
+  // Append a record with a key larger than all existing ones to a node that
+  // is being built, i.e., not yet reachable, so the node stays all sorted.
+  // Returns false if that would take the node to more than [fill_size] bytes.
+  bool AppendSorted(const char *key, uint16_t key_size, uint64_t payload, uint32_t fill_size);
+  bool AppendSorted(const char *key, uint16_t key_size, const char *payload,
+                    uint32_t payload_size, bool var_payload, uint32_t fill_size);
+  // Parents are split beyond [internal_node_size] bytes. If [lo] and [hi], the
+  // bounds of this node in its parent, are given, the new nodes only store
+  // what follows the common prefix of their own bounds. If records are being
+  // appended to the node (see IsAppending), the left node gets all of them
+  // but the last one, for the right one to take the appends that follow, and
+  // so on up through the parents whose last child is split, so appends in key
+  // order fill nodes up rather than leaving a trail of half-full ones. With
+  // [adaptive] set, the split point is GetAdaptiveSplit's.
+  bool PrepareForSplit(Stack &stack, uint32_t internal_node_size,
                        pmwcas::Descriptor *pd,
                        pmwcas::DescriptorPool *pmwcas_pool,
                        LeafNode **left, LeafNode **right,
-                       InternalNode **new_parent, bool backoff);
+                       InternalNode **new_parent, bool backoff,
+                       const char *lo = nullptr, uint32_t lo_size = 0,
+                       const char *hi = nullptr, uint32_t hi_size = 0,
+                       bool adaptive = false);
+
+  // Whether (frozen) records are added to the node in key order, e.g., for
+  // time-ordered keys: but for a few that came in out of order, e.g., from
+  // concurrent inserts, each record inserted since the node was built has
+  // the largest key so far; there have to be at least kMinAppends of them
+  static const uint32_t kMinAppends = 4;
+  bool IsAppending();
+  // Where to split the (frozen) node with [adaptive] splits on: the index in
+  // [sorted], its visible records in key order, of the first one to go to the
+  // right node, [even_split] if nothing better is known. The ranks of the
+  // records inserted since the node was built tell where inserts land. If,
+  // but for one in eight at either end, they fall in a range that holds no
+  // more than a quarter of the older records, more are likely to follow
+  // there. If they mostly came in ascending key order, the range and the
+  // records before it fill the left node, and the right one takes what
+  // follows: only the last record for appends past all older records (which
+  // set [*appending], see IsAppending). Descending ones fill the right node
+  // that way instead. Otherwise the range goes whole with the smaller side.
+  // Spread out inserts split evenly, and so do nodes without older records
+  // unless IsAppending.
+  uint32_t GetAdaptiveSplit(std::vector<RecordMetadata> &sorted, uint32_t even_split,
+                            bool *appending);
 
   // merge two nodes into a new one
   // copy the meta/data to the new node
-  static bool MergeNodes(LeafNode *left_node, LeafNode *right_node, LeafNode **new_node);
-
-  // Initialize new, empty node with a list of records; no concurrency control;
-  // only useful before any inserts to the node. For now the only users are split
-  // (when preparing a new node) and consolidation.
+  static bool MergeNodes(LeafNode *left_node, LeafNode *right_node, uint32_t node_size,
+                         LeafNode **new_node);
+
+  // Make a new, empty node leave [prefix] out of the keys of all records it
+  // will hold. Every key inserted to the node must start with [prefix], and
+  // none may be [prefix] itself, which is the case for the common prefix of
+  // the node's bounds (keys are larger than the lower bound).
+  void SetPrefix(const char *prefix, uint16_t prefix_size);
+
+  // Append a list of records to a node that's not in use yet (a new one, or
+  // one being built); no concurrency control. For now the only users are
+  // split, merge (when preparing a new node) and consolidation.
   //
   // The list of records to be inserted is specified through iterators of a
   // record metadata vector. Recods covered by [begin_it, end_it) will be
-  // inserted to the node. Note end_it is non-inclusive.
+  // inserted to the node. Note end_it is non-inclusive. Keys are re-encoded
+  // if [node] has a different prefix.
   void CopyFrom(LeafNode *node,
                 std::vector<RecordMetadata>::iterator begin_it,
                 std::vector<RecordMetadata>::iterator end_it,
                 pmwcas::EpochManager *epoch);
 
+  // 8-byte payloads are updated in place. Records with a variable-length
+  // payload are updated out of place: a new record is inserted to the unsorted
+  // field and swapped in for the old one, which needs [split_threshold] to
+  // check for space (NotEnoughSpace if there isn't enough).
+  //
+  // An in-place update is normally a 3-word PMwCAS that also checks that the
+  // record and the status word are unchanged. With [single_word] set it's a
+  // plain (persistent) CAS on the payload instead, made once the update is
+  // announced and the node found not frozen; copies of a frozen node wait for
+  // the updates announced on it, so they have the new payload (see
+  // UpdateSlot in bztree.cc). Falls back to the PMwCAS on threads that find
+  // no slot left to announce in.
   ReturnCode Update(const char *key, uint16_t key_size, uint64_t payload,
-                    pmwcas::DescriptorPool *pmwcas_pool);
-
-  ReturnCode Delete(const char *key, uint16_t key_size, pmwcas::DescriptorPool *pmwcas_pool);
-
+                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                    bool single_word = false, VersionWriter *versions = nullptr);
+  ReturnCode Update(const char *key, uint16_t key_size,
+                    const char *payload, uint32_t payload_size,
+                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                    VersionWriter *versions = nullptr);
+
+  // Swap in [desired] for an 8-byte payload equal to [*expected], using the
+  // same 3-word PMwCAS as Update; otherwise ValueMismatch, with the current
+  // payload in [*expected]. NotEnoughSpace if the record holds a longer one.
+  ReturnCode CompareAndSwap(const char *key, uint16_t key_size, uint64_t *expected,
+                            uint64_t desired, pmwcas::DescriptorPool *pmwcas_pool,
+                            VersionWriter *versions = nullptr);
+  // Add [delta] to an 8-byte payload, wrapping around, and return the old one
+  // in [*old_payload]; NotEnoughSpace if the record holds a longer one
+  ReturnCode FetchAdd(const char *key, uint16_t key_size, uint64_t delta, uint64_t *old_payload,
+                      pmwcas::DescriptorPool *pmwcas_pool, VersionWriter *versions = nullptr);
+
+  // A record write staged in this node by PrepareInsert or PrepareUpdate. It
+  // takes effect once [word] goes from [old_value] to [new_value] (with the
+  // record's metadata unchanged, for an update) in a PMwCAS that also checks
+  // the node's status word, see MultiTreeWrite.
+  struct PreparedWrite {
+    uint64_t *word;
+    uint64_t old_value;
+    uint64_t new_value;
+    RecordMetadata *meta_ptr;
+    RecordMetadata meta;
+    bool insert;
+  };
+  // Reserve and fill a record for [key] that stays invisible until the
+  // PMwCAS: KeyExists if there is one already, NotEnoughSpace or NodeFrozen
+  // if the node needs a split or consolidation first, and PMWCASFailure if
+  // another thread is inserting the same key, in which case the caller has
+  // to give up what it prepared and retry. [earlier] are the caller's other
+  // writes staged so far, which it can't wait for.
+  ReturnCode PrepareInsert(const char *key, uint16_t key_size, uint64_t payload,
+                           pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                           const PreparedWrite *earlier, uint32_t earlier_count,
+                           PreparedWrite *write);
+  // Find the record with [key] to set its 8-byte payload to [payload]:
+  // NotFound if there is none, NotEnoughSpace if it holds a longer payload
+  ReturnCode PrepareUpdate(const char *key, uint16_t key_size, uint64_t payload,
+                           pmwcas::DescriptorPool *pmwcas_pool, PreparedWrite *write);
+  // Give up the record reserved by PrepareInsert, leaving it invisible
+  void AbortInsert(const PreparedWrite &write, pmwcas::DescriptorPool *pmwcas_pool);
+
+  // Update the record if there is one, insert it otherwise, in this node
+  ReturnCode Upsert(const char *key, uint16_t key_size, uint64_t payload,
+                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                    bool single_word = false, VersionWriter *versions = nullptr);
+  ReturnCode Upsert(const char *key, uint16_t key_size,
+                    const char *payload, uint32_t payload_size,
+                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                    VersionWriter *versions = nullptr);
+
+  ReturnCode Delete(const char *key, uint16_t key_size, pmwcas::DescriptorPool *pmwcas_pool,
+                    VersionWriter *versions = nullptr);
+
+  // Read an 8-byte payload; NotEnoughSpace if the record holds a longer one
+  template <class KeyPolicy = VarKeyPolicy>
   ReturnCode Read(const char *key, uint16_t key_size, uint64_t *payload,
                   pmwcas::DescriptorPool *pmwcas_pool);
+  // Copy the payload to [payload], which can hold [*payload_size] bytes. The
+  // actual payload size is returned in [*payload_size]; if the buffer is too
+  // small nothing is copied and NotEnoughSpace is returned.
+  ReturnCode Read(const char *key, uint16_t key_size, char *payload, uint32_t *payload_size,
+                  pmwcas::DescriptorPool *pmwcas_pool);
 
   ReturnCode RangeScanByKey(const char *key1,
                             uint32_t size1,
@@ -488,9 +1560,63 @@ class LeafNode : public BaseNode {
                              std::list<std::unique_ptr<Record>> *result,
                              pmwcas::DescriptorPool *pmwcas_pool);
 
+  // Append (at most [to_scan]) records with keys between [lo] and [hi] to
+  // [result] in key order; each bound is inclusive or exclusive, a null bound
+  // means unbounded. Returns NotEnoughSpace if [result] is a caller-provided
+  // buffer and got full.
+  ReturnCode RangeScanByKey(const char *lo, uint32_t lo_size, bool lo_inclusive,
+                            const char *hi, uint32_t hi_size, bool hi_inclusive,
+                            uint32_t to_scan,
+                            ScanBuffer *result,
+                            pmwcas::DescriptorPool *pmwcas_pool);
+
+  // Same as above, but append the records in descending key order, i.e., the
+  // (at most [to_scan]) largest keys in the range, largest first
+  ReturnCode ReverseRangeScanByKey(const char *lo, uint32_t lo_size, bool lo_inclusive,
+                                   const char *hi, uint32_t hi_size, bool hi_inclusive,
+                                   uint32_t to_scan,
+                                   ScanBuffer *result,
+                                   pmwcas::DescriptorPool *pmwcas_pool);
+
+  // Number of visible records with keys in [[lo], [hi]), a null bound means
+  // unbounded; the caller holds an epoch
+  uint32_t CountRange(const char *lo, uint32_t lo_size, const char *hi, uint32_t hi_size);
+  // Estimated number of visible records, from the status word alone: deleted
+  // records are taken to be of the average size
+  inline uint32_t GetRecordEstimate() {
+    auto status = header.GetStatus();
+    uint64_t count = status.GetRecordCount();
+    auto block_size = status.GetBlockSize();
+    if (block_size == 0) {
+      return 0;
+    }
+    return static_cast<uint32_t>(
+        count - (count * status.GetDeletedSize() + block_size / 2) / block_size);
+  }
+
   // Consolidate all records in sorted order
   LeafNode *Consolidate(pmwcas::DescriptorPool *pmwcas_pool);
 
+  // Build a consolidated copy of this (frozen) node in [*new_node]. Under PMDK
+  // [*new_node] is an offset, so it can be directly installed by a PMwCAS.
+  // The copy keeps this node's key prefix, or uses [prefix] if given, and
+  // leaves out records with keys in [[drop_lo], [drop_hi]) if [drop_hi] is set.
+  // It is [node_size] bytes, as big as this node if 0, or just big enough for
+  // the records if kPackedSize (a packed leaf, full until copied back into a
+  // bigger node). It has [lanes] reservation lanes, as many as this node if
+  // UINT32_MAX; a packed leaf has none, as nothing is inserted into it.
+  static const uint32_t kPackedSize = ~0u;
+  void PrepareForConsolidate(LeafNode **new_node, pmwcas::EpochManager *epoch,
+                             const char *prefix = nullptr, uint16_t prefix_size = 0,
+                             const char *drop_lo = nullptr, uint32_t drop_lo_size = 0,
+                             const char *drop_hi = nullptr, uint32_t drop_hi_size = 0,
+                             uint32_t node_size = 0, uint32_t lanes = UINT32_MAX);
+
+  // Decide whether a full (frozen) node should be consolidated instead of
+  // split, i.e., whether its live records would fit in [consolidate_threshold]
+  // bytes once deleted and stale records are dropped.
+  bool ShouldConsolidate(uint32_t consolidate_threshold);
+
   // Specialized GetRawRecord for leaf node only (key can't be nullptr)
   inline bool GetRawRecord(RecordMetadata meta, char **key,
                            uint64_t *payload, pmwcas::EpochManager *epoch = nullptr) {
@@ -511,11 +1637,109 @@ class LeafNode : public BaseNode {
   void Dump(pmwcas::EpochManager *epoch);
 
  private:
+  friend class VersionWriter;
+  friend class FrozenTree;
+
+  // Bits of a key in the Bloom filter, each taken from the high bits of a
+  // fresh multiplicative hash of the key's
+  static const uint32_t kBloomFilterProbes = 3;
+  inline uint32_t NextBloomFilterBit(uint64_t *hash) {
+    uint32_t bit = static_cast<uint32_t>(((*hash >> 32) * (header.bloom_size * 8)) >> 32);
+    *hash *= 0x9E3779B97F4A7C15ull;
+    return bit;
+  }
+
+  // Collect (at most [limit]) visible records with keys between [lo] and [hi]
+  // in key order, see RangeScanByKey. The sorted field is only searched up to
+  // [hi] and just the matching part of the unsorted field is sorted.
+  void CollectRange(const char *lo, uint32_t lo_size, bool lo_inclusive,
+                    const char *hi, uint32_t hi_size, bool hi_inclusive,
+                    uint32_t limit, std::vector<RecordMetadata> *result);
+
+  // Point [*key] past the node's prefix; false if it doesn't start with it
+  inline bool StripPrefix(const char **key, uint16_t *key_size) {
+    auto prefix_size = header.prefix_size;
+    if (prefix_size == 0) {
+      return true;
+    }
+    if (*key_size < prefix_size || CompareKeyBytes(*key, GetPrefix(), prefix_size) != 0) {
+      return false;
+    }
+    *key += prefix_size;
+    *key_size -= prefix_size;
+    return true;
+  }
+  // Same for a range bound: 0 if stripped, -1 or 1 if [key] is smaller or
+  // larger than any key with the node's prefix
+  inline int ClampToPrefix(const char **key, uint32_t *key_size) {
+    auto prefix_size = header.prefix_size;
+    if (prefix_size == 0) {
+      return 0;
+    }
+    int cmp = CompareKeyBytes(*key, GetPrefix(), std::min<uint32_t>(*key_size, prefix_size));
+    if (cmp == 0 && *key_size < prefix_size) {
+      return -1;
+    } else if (cmp != 0) {
+      return cmp < 0 ? -1 : 1;
+    }
+    *key += prefix_size;
+    *key_size -= prefix_size;
+    return 0;
+  }
+
   enum Uniqueness { IsUnique, Duplicate, ReCheck, NodeFrozen };
+  ReturnCode InsertRecord(const char *key, uint16_t key_size,
+                          const char *payload, uint32_t payload_size, bool var_payload,
+                          pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                          VersionWriter *versions, bool unique);
+
+  // Reserve a metadata entry and [total_size] bytes of free space for a new
+  // record. On success [*meta_ptr] is the entry (in inserting state, i.e.,
+  // holding [*reserved_meta]) and [*reserved_status] the installed status
+  // word; PMWCASFailure means the caller should retry.
+  ReturnCode ReserveRecord(uint32_t total_size, uint32_t split_threshold,
+                           pmwcas::DescriptorPool *pmwcas_pool,
+                           RecordMetadata **meta_ptr, RecordMetadata *reserved_meta,
+                           NodeHeader::StatusWord *reserved_status);
+
+  // Copy key and payload to the space just reserved through [status] and add
+  // them to the PersistBatch, unless [flush] is not set and the caller does
+  char *FillRecord(NodeHeader::StatusWord status, const char *key, uint16_t key_size,
+                   const char *payload, uint32_t payload_size, bool flush = true);
+
+  // One round of InsertBatch: at most DESC_CAP - 1 records, sets [*done]
+  ReturnCode InsertRecords(const char *const *keys, const uint16_t *key_sizes,
+                           const uint64_t *payloads, uint32_t count, ReturnCode *rcs,
+                           uint32_t *done, pmwcas::DescriptorPool *pmwcas_pool,
+                           uint32_t split_threshold, VersionWriter *versions, bool unique);
+
+  // Replace the 8-byte payload of the record with [key] with what [modify]
+  // makes of it, with the same 3-word PMwCAS as Update and retrying if that
+  // fails. [modify] takes the current payload and the new one to fill in and
+  // returns Ok to go ahead or the code to give up with.
+  template <class Modify>
+  ReturnCode ModifyPayload(const char *key, uint16_t key_size,
+                           pmwcas::DescriptorPool *pmwcas_pool, VersionWriter *versions,
+                           const Modify &modify);
+
+  // Out-of-place update: insert a new version of the record [old_meta_ptr]
+  // points to and atomically make it visible while hiding the old one
+  ReturnCode ReplaceRecord(const char *key, uint16_t key_size,
+                           const char *payload, uint32_t payload_size, bool var_payload,
+                           RecordMetadata *old_meta_ptr, RecordMetadata old_meta,
+                           pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                           VersionWriter *versions);
+
   Uniqueness CheckUnique(const char *key, uint32_t key_size, pmwcas::EpochManager *epoch);
+  // Without [wait], ReCheck rather than waiting for records still being
+  // inserted, apart from the [skip_count] records of [skip], which are known
+  // to have other keys
   Uniqueness RecheckUnique(const char *key,
                            uint32_t key_size,
-                           uint32_t end_pos);
+                           uint32_t end_pos,
+                           bool wait = true,
+                           const PreparedWrite *skip = nullptr,
+                           uint32_t skip_count = 0);
 };
 
 struct Record {
@@ -528,24 +1752,80 @@ struct Record {
       return nullptr;
     }
 
-    Record *r = reinterpret_cast<Record *>(malloc(meta.GetTotalLength() + sizeof(meta)));
-    memset(r, 0, meta.GetTotalLength() + sizeof(Record));
-    new(r) Record(meta);
+    auto full_meta = GetFullMeta(meta, node);
+    Record *r = reinterpret_cast<Record *>(malloc(full_meta.GetTotalLength() + sizeof(meta)));
+    memset(r, 0, full_meta.GetTotalLength() + sizeof(Record));
+    return New(meta, node, r);
+  }
 
-    // Key will never be changed and it will not be a pmwcas descriptor
-    // but payload is fixed length 8-byte value, can be updated by pmwcas
-    memcpy(r->data, reinterpret_cast<char *>(node) + meta.GetOffset(), meta.GetPaddedKeyLength());
+  // Metadata of the record [meta] refers to in [node] once copied out, i.e.,
+  // with the node's key prefix put back in front of the key
+  static inline RecordMetadata GetFullMeta(RecordMetadata meta, BaseNode *node) {
+    auto prefix_size = node->GetPrefixSize();
+    if (prefix_size == 0) {
+      return meta;
+    }
+    RecordMetadata full_meta;
+    uint32_t key_size = meta.GetKeyLength() + prefix_size;
+    full_meta.FinalizeForInsert(meta.GetOffset(), key_size,
+                                RecordMetadata::PadKeyLength(key_size) + meta.GetPayloadLength(),
+                                meta.HasVarPayload());
+    return full_meta;
+  }
 
+  // Build the record in [mem], which holds at least GetSize(GetFullMeta(meta))
+  // bytes
+  static inline Record *New(RecordMetadata meta, BaseNode *node, void *mem) {
+    auto full_meta = GetFullMeta(meta, node);
+    Record *r = new(mem) Record(full_meta);
+
+    // Key will never be changed and it will not be a pmwcas descriptor, neither
+    // will a variable-length payload; but a fixed length 8-byte payload can be
+    // updated by pmwcas
     auto source_addr = (reinterpret_cast<char *>(node) + meta.GetOffset());
+    char *key = r->data;
+    if (node->GetPrefixSize()) {
+      memcpy(key, node->GetPrefix(), node->GetPrefixSize());
+      key += node->GetPrefixSize();
+    }
+    memcpy(key, source_addr, meta.GetKeyLength());
+    auto payload_addr = source_addr + meta.GetPaddedKeyLength();
+    if (meta.HasVarPayload()) {
+      memcpy(r->data + full_meta.GetPaddedKeyLength(), payload_addr, meta.GetPayloadLength());
+      return r;
+    }
+
     auto payload = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
-        source_addr + meta.GetPaddedKeyLength())->GetValueProtected();
-    memcpy(r->data + meta.GetPaddedKeyLength(), &payload, sizeof(payload));
+        payload_addr)->GetValueProtected();
+    memcpy(r->data + full_meta.GetPaddedKeyLength(), &payload, sizeof(payload));
+    return r;
+  }
+
+  // A record that isn't copied from a node, such as an old version kept by a
+  // Snapshot; [payload] is 8 bytes unless [var_payload] is set
+  static inline Record *New(const char *key, uint16_t key_size,
+                            const char *payload, uint32_t payload_size, bool var_payload) {
+    RecordMetadata meta;
+    meta.FinalizeForInsert(sizeof(RecordMetadata), key_size,
+                           RecordMetadata::PadKeyLength(key_size) + payload_size, var_payload);
+    Record *r = reinterpret_cast<Record *>(malloc(GetSize(meta)));
+    memset(r, 0, GetSize(meta));
+    new(r) Record(meta);
+    memcpy(r->data, key, key_size);
+    memcpy(r->data + meta.GetPaddedKeyLength(), payload, payload_size);
     return r;
   }
 
+  // The 8-byte payload, not for records with a variable-length payload
   inline const uint64_t GetPayload() {
+    assert(!meta.HasVarPayload());
     return *reinterpret_cast<uint64_t *>(data + meta.GetPaddedKeyLength());
   }
+  inline const char *GetPayloadData() { return data + meta.GetPaddedKeyLength(); }
+  inline uint32_t GetPayloadLength() { return meta.GetPayloadLength(); }
+  static inline uint32_t GetSize(RecordMetadata meta) {
+    return sizeof(Record) + meta.GetPaddedTotalLength();
+  }
   inline const char *GetKey() const { return data; }
   inline bool operator<(const Record &out) {
     int cmp = BaseNode::KeyCompare(this->GetKey(), this->meta.GetKeyLength(),
@@ -553,49 +1833,453 @@ struct Record {
     return cmp < 0;
   }
 };
-class Iterator;
-class BzTree {
+// Records copied out by a scan, laid out back to back as Records (metadata,
+// padded key, payload) so that a scan doesn't allocate per record. The buffer
+// is either owned, growing as needed and kept across scans (Clear() only
+// resets it), or provided by the caller, in which case scans stop when it's
+// full. Iterate with: for (auto *r = buf.First(); r; r = buf.Next(r)).
+class ScanBuffer {
  public:
-  struct ParameterSet {
-    const uint32_t split_threshold;
-    const uint32_t merge_threshold;
+  ScanBuffer() : data(nullptr), capacity(0), size(0), count(0), owned(true) {}
+  // [buffer] should be 8-byte aligned
+  ScanBuffer(char *buffer, uint32_t capacity)
+      : data(buffer), capacity(capacity), size(0), count(0), owned(false) {}
+  ~ScanBuffer() {
+    if (owned) {
+      free(data);
+    }
+  }
+  ScanBuffer(const ScanBuffer &) = delete;
+  ScanBuffer &operator=(const ScanBuffer &) = delete;
+
+  inline void Clear() {
+    size = 0;
+    count = 0;
+  }
+  inline uint32_t Count() { return count; }
+  // The records as laid out, [GetSize()] bytes
+  inline char *GetData() { return data; }
+  inline uint32_t GetSize() { return size; }
+  inline Record *First() { return count ? reinterpret_cast<Record *>(data) : nullptr; }
+  inline Record *Next(Record *r) {
+    char *next = reinterpret_cast<char *>(r) + Record::GetSize(r->meta);
+    return next < data + size ? reinterpret_cast<Record *>(next) : nullptr;
+  }
+
+  // Copy the record [meta] refers to in [node]; false if the buffer is full
+  // (or can't grow), in which case it keeps what it has
+  inline bool Append(RecordMetadata meta, BaseNode *node) {
+    uint32_t record_size = Record::GetSize(Record::GetFullMeta(meta, node));
+    if (size + record_size > capacity) {
+      if (!owned) {
+        return false;
+      }
+      uint32_t new_capacity = std::max<uint32_t>(capacity * 2, size + record_size);
+      auto *new_data = reinterpret_cast<char *>(realloc(data, new_capacity));
+      if (!new_data) {
+        return false;
+      }
+      data = new_data;
+      capacity = new_capacity;
+    }
+    Record::New(meta, node, data + size);
+    size += record_size;
+    ++count;
+    return true;
+  }
+
+ private:
+  char *data;
+  uint32_t capacity;
+  uint32_t size;
+  uint32_t count;
+  bool owned;
+};
+
+// Latencies in nanoseconds, bucketed in the style of HDR histograms: values
+// below 8 get a bucket each, larger ones one of 8 buckets per power of two,
+// so no bucket is wider than 1/8 of its lower bound. Recording is a single
+// relaxed atomic increment.
+class LatencyHistogram {
+ public:
+  static const uint32_t kSubBuckets = 8;
+  static const uint32_t kBuckets = (64 - 2) * kSubBuckets;
+
+  LatencyHistogram() { Reset(); }
+  LatencyHistogram(const LatencyHistogram &other) { *this = other; }
+  LatencyHistogram &operator=(const LatencyHistogram &other);
+
+  inline void Record(uint64_t nanos) {
+    counts[GetBucket(nanos)].fetch_add(1, std::memory_order_relaxed);
+  }
+  void Merge(const LatencyHistogram &other);
+  void Reset();
+
+  uint64_t GetCount() const;
+  // Upper bound of the bucket holding the [percentile]th (0 to 100) value, at
+  // most 12.5% above the actual value; 0 if nothing was recorded
+  uint64_t GetPercentile(double percentile) const;
+
+  static inline uint32_t GetBucket(uint64_t nanos) {
+    if (nanos < kSubBuckets) {
+      return static_cast<uint32_t>(nanos);
+    }
+    uint32_t exponent = 63 - __builtin_clzll(nanos);
+    uint32_t sub_bucket = (nanos >> (exponent - 3)) & (kSubBuckets - 1);
+    return (exponent - 2) * kSubBuckets + sub_bucket;
+  }
+  static uint64_t GetBucketUpperBound(uint32_t bucket);
+
+ private:
+  std::atomic<uint64_t> counts[kBuckets];
+};
+
+// Sampled accesses to leaves, in a volatile table indexed by a hash of their
+// address. An entry counts for one leaf at a time: a sample of another leaf
+// hashed to it takes one off instead, and takes it over once it gets to
+// zero, so heavily accessed leaves keep their entries while the others share
+// theirs. Counts are halved every kDecayPeriod samples, to follow shifts in
+// the workload. Races between threads may lose a sample or two.
+class HotnessTable {
+ public:
+  static const uint32_t kEntries = 4096;
+  static const uint64_t kDecayPeriod = kEntries * 64;
+
+  HotnessTable();
+  void Sample(const void *leaf);
+  // Samples of [leaf], 0 if it doesn't hold its entry
+  uint64_t Get(const void *leaf);
+  // Accesses a sample stands for, to estimate those of a leaf from its samples
+  inline void SetSampling(uint32_t sampling) {
+    this->sampling.store(sampling, std::memory_order_relaxed);
+  }
+  inline uint64_t GetAccesses(const void *leaf) {
+    return Get(leaf) * sampling.load(std::memory_order_relaxed);
+  }
+  // [leaf] was replaced by [replacement], which gets its count shifted right
+  // by [shift] (e.g., 1 for each half of a split)
+  void Inherit(const void *leaf, const void *replacement, uint32_t shift = 0);
+
+ private:
+  struct Entry {
+    std::atomic<uint64_t> leaf;
+    std::atomic<uint64_t> count;
+  };
+  static inline uint32_t GetIndex(const void *leaf) {
+    // Leaves are at least 64-byte aligned
+    auto addr = reinterpret_cast<uint64_t>(leaf) >> 6;
+    return static_cast<uint32_t>((addr * 0x9E3779B97F4A7C15ull) >> 52);
+  }
+  Entry entries[kEntries];
+  std::atomic<uint64_t> samples;
+  std::atomic<uint32_t> sampling;
+};
+
+// Leaves evicted from memory, in a file of pages of the leaf node size, the
+// first of which is a header. A parent keeps a tagged word in place of an
+// evicted child: InternalNode::kEvictedChild, the store's slot among those
+// open in the process, and the page. Pages given back by loads are reused
+// once no thread can still be reading them. Under PMEM the header keeps the
+// slot, so that the tags in the tree stay valid once the file is opened
+// again after a restart; pages freed before the restart are not reused.
+class LeafStore {
+ public:
+  static const uint32_t kSlotBits = 7;
+  static const uint32_t kMaxStores = 1 << kSlotBits;
+
+  // Open (or create) [path] for [tree]; IOError if it can't be used, holds
+  // pages of another size, or all slots (or the one it had) are taken
+  static ReturnCode Open(BzTree *tree, const char *path, uint32_t page_size, LeafStore **store);
+  ~LeafStore();
+
+  // The store a tagged word points to, nullptr if it's not open
+  static inline LeafStore *Get(uint64_t word) {
+    return stores[(word >> 1) & (kMaxStores - 1)].load(std::memory_order_acquire);
+  }
+  static inline uint64_t GetPage(uint64_t word) { return word >> (kSlotBits + 1); }
+  inline uint64_t GetWord(uint64_t page) {
+    return (page << (kSlotBits + 1)) | (slot << 1) | InternalNode::kEvictedChild;
+  }
+
+  uint64_t AllocatePage();
+  // Right away, for a page never pointed to, or as a garbage list callback
+  void FreePage(uint64_t page);
+  static void FreePage(void *store, void *page);
+  // [image] is a leaf, at most page_size bytes
+  bool Write(uint64_t page, LeafNode *image);
+  bool Read(uint64_t page, char *image);
+  // Start reading [page] into the page cache, for a load soon after
+  void Prefetch(uint64_t page);
+  // Leaves evicted and not loaded back since the store was opened
+  inline void CountEvicted(int64_t leaves) {
+    evicted.fetch_add(leaves, std::memory_order_relaxed);
+  }
+  inline uint64_t GetEvicted() { return evicted.load(std::memory_order_relaxed); }
+  inline uint32_t GetPageSize() { return page_size; }
+  inline BzTree *GetTree() { return tree; }
+
+ private:
+  struct Header {
+    static const uint64_t kMagic = 0x65726F74536642ull;
+    uint64_t magic;
+    uint32_t page_size;
+    uint32_t slot;
+  };
+  LeafStore(BzTree *tree, int fd, uint32_t page_size, uint32_t slot, uint64_t next_page)
+      : tree(tree), fd(fd), page_size(page_size), slot(slot), next_page(next_page),
+        evicted(0) {}
+  static std::atomic<LeafStore *> stores[kMaxStores];
+  BzTree *tree;
+  int fd;
+  uint32_t page_size;
+  uint64_t slot;
+  std::mutex mutex;
+  uint64_t next_page;
+  std::vector<uint64_t> free_pages;
+  std::atomic<uint64_t> evicted;
+};
+
+// Writes applied to a tree, for subscribers that follow it (e.g., to keep a
+// cache in step), in bounded lock-free rings, one per thread (until threads
+// outnumber kRings). A change gets its sequence number from a counter shared
+// by the rings once its write is applied, so two changes to a key from two
+// threads at about the same time may come in either order, even with respect
+// to the key's final state in the tree. The feed is thus only fit for
+// invalidation: a subscriber should take a change to mean "[key] (or the
+// range) changed" and re-read it from the tree, not apply the change's value
+// on top of an earlier one. Replication is not supported and won't be by this
+// class: it would need the order in which writes take effect, i.e. version
+// words bumped in the PMwCAS that finalizes each write, which leaves don't
+// have, rather than a counter taken afterwards. Sharding the counter wouldn't
+// fix the order either, and a single one keeps gaps visible across rings.
+// Only writes are published: splits, consolidations, merges and evictions move records
+// around without changing them. A change that finds its ring full is dropped
+// and counted, which shows as a gap in the sequence numbers.
+class ChangeFeed {
+ public:
+  static const uint32_t kRings = 64;
+
+  enum Op : uint8_t { kInsert, kUpdate, kUpsert, kDelete, kDeleteRange };
+  struct Change {
+    // Orders changes for gap detection and draining, not the writes to a key
+    // (see above)
+    uint64_t sequence;
+    Op op;
+    std::string key;
+    // 8-byte payloads; 0 for var-length ones, which are in [value] instead,
+    // as is the upper bound (exclusive) of a kDeleteRange from [key]
+    uint64_t payload;
+    std::string value;
+  };
+
+  // Rings of [ring_size] changes each, rounded up to a power of two
+  explicit ChangeFeed(uint32_t ring_size);
+  ~ChangeFeed();
+
+  void Append(Op op, const char *key, uint16_t key_size, uint64_t payload,
+              const char *value = nullptr, uint32_t value_size = 0);
+  // Move up to [max] published changes to the end of [changes], ordered by
+  // sequence number among themselves; returns how many. Safe to call from
+  // several threads, each gets changes the others don't.
+  uint32_t Drain(std::vector<Change> *changes, uint32_t max = UINT32_MAX);
+  // Changes dropped on full rings so far
+  inline uint64_t GetDropped() { return dropped.load(std::memory_order_relaxed); }
+
+ private:
+  // A bounded MPMC queue in the style of Vyukov's: a cell's turn tells which
+  // lap of the ring may write (turn == position) or read (turn == position +
+  // 1) it next, threads that share a ring claim cells with a CAS on the tail
+  struct Cell {
+    std::atomic<uint64_t> turn;
+    Change change;
+  };
+  struct Ring {
+    explicit Ring(uint32_t size);
+    bool Push(Change *change);
+    bool Pop(Change *change);
+    std::unique_ptr<Cell[]> cells;
+    uint64_t mask;
+    // Padded rather than aligned, so that a plain new (C++14) is enough to
+    // keep producers on the tail off the consumers' line
+    char padding0[64];
+    std::atomic<uint64_t> tail;
+    char padding1[64 - sizeof(uint64_t)];
+    std::atomic<uint64_t> head;
+    char padding2[64 - sizeof(uint64_t)];
+  };
+  static uint32_t GetRingIndex();
+  uint32_t ring_size;
+  // Allocated by the first thread to publish on each
+  std::atomic<Ring *> rings[kRings];
+  std::atomic<uint64_t> sequence;
+  std::atomic<uint64_t> dropped;
+};
+
+class Iterator;
+class Snapshot;
+struct MaintenanceWorkers;
+
+class BzTree {
+ public:
+  struct ParameterSet {
+    const uint32_t split_threshold;
+    const uint32_t merge_threshold;
     const uint32_t leaf_node_size;
-    ParameterSet() : split_threshold(3072), merge_threshold(1024), leaf_node_size(4096) {}
-    ParameterSet(uint32_t split_threshold, uint32_t merge_threshold, uint32_t leaf_node_size = 4096)
+    // Internal nodes that would grow beyond this many bytes are split;
+    // defaults to the split threshold
+    const uint32_t internal_node_size;
+    // A full leaf is consolidated rather than split if its live records take
+    // no more than this many bytes; defaults to 3/4 of the split threshold
+    const uint32_t consolidate_threshold;
+    // Leave the key prefix shared by all keys a leaf can hold (the common
+    // prefix of its bounds in the parent) out of its records when the leaf is
+    // consolidated, split or merged; pays off for long keys with long shared
+    // prefixes, such as URLs
+    const bool prefix_compression;
+    // Split leaves where the records inserted since they were built suggest,
+    // rather than in the middle, see LeafNode::GetAdaptiveSplit
+    const bool adaptive_split;
+    // Consolidate a leaf as soon as this many records are in its unsorted
+    // field, so that reads of read-mostly trees stay binary searches; 0
+    // leaves leaves alone until they fill up
+    const uint32_t sorted_insert_threshold;
+    // Give each leaf a Bloom filter of its keys, for reads and inserts of
+    // absent keys to tell they're absent without searching the records, see
+    // LeafNode::MayContain
+    const bool bloom_filter;
+    // Let keys have any number of records, e.g., for secondary indexes: inserts
+    // skip the uniqueness checks and never return KeyExists, and iterators
+    // return all the records of a key (in no particular order). The records of
+    // a key stay in one leaf while they fit, then go on over the leaves right
+    // of it, which all have the key for separator. Searches start from the
+    // first leaf whose upper bound is the key or above and go right as long as
+    // the key is the bound (see BzTree::NextLeafOfKey). Reads, updates and
+    // deletes go to one of the records of a key. Compact, PackColdLeaves and
+    // EvictColdLeaves step over the leaves within such runs. Bulk loads,
+    // snapshots and frozen trees expect unique keys.
+    const bool duplicate_keys;
+    // Keep the record counts internal nodes cache for Count up to date on
+    // splits, see BzTree::Count; without it nothing is cached and Count reads
+    // the header of every leaf in the range
+    const bool record_counts;
+    // Give each leaf this many reservation lanes (at most
+    // LeafNode::kMaxLanes, more are taken as that many), for inserts from many
+    // threads into the same leaves to contend less on its status word, see
+    // LeafNode::GetLane; 0 keeps leaves as they are. Lanes cost (lanes + 1) *
+    // 64 bytes of every leaf and one descriptor word each in every freeze.
+    const uint32_t leaf_lanes;
+    ParameterSet()
+        : split_threshold(3072), merge_threshold(1024), leaf_node_size(4096),
+          internal_node_size(split_threshold),
+          consolidate_threshold(split_threshold / 4 * 3), prefix_compression(false),
+          adaptive_split(false), sorted_insert_threshold(0), bloom_filter(false),
+          duplicate_keys(false), record_counts(false), leaf_lanes(0) {}
+    ParameterSet(uint32_t split_threshold, uint32_t merge_threshold, uint32_t leaf_node_size = 4096,
+                 uint32_t consolidate_threshold = 0, bool prefix_compression = false,
+                 uint32_t internal_node_size = 0, bool adaptive_split = false,
+                 uint32_t sorted_insert_threshold = 0, bool bloom_filter = false,
+                 bool duplicate_keys = false, bool record_counts = false,
+                 uint32_t leaf_lanes = 0)
         : split_threshold(split_threshold),
           merge_threshold(merge_threshold),
-          leaf_node_size(leaf_node_size) {}
+          leaf_node_size(leaf_node_size),
+          internal_node_size(internal_node_size ? internal_node_size : split_threshold),
+          consolidate_threshold(consolidate_threshold ?
+                                consolidate_threshold : split_threshold / 4 * 3),
+          prefix_compression(prefix_compression),
+          adaptive_split(adaptive_split),
+          sorted_insert_threshold(sorted_insert_threshold),
+          bloom_filter(bloom_filter),
+          duplicate_keys(duplicate_keys),
+          record_counts(record_counts),
+          leaf_lanes(std::min(leaf_lanes, LeafNode::kMaxLanes)) {}
     ~ParameterSet() {}
   };
 
   // init a new tree
   BzTree(const ParameterSet &param, pmwcas::DescriptorPool *pool, uint64_t pmdk_addr = 0)
-      : parameters(param), root(nullptr), pmdk_addr(pmdk_addr), index_epoch(0) {
-    global_epoch = index_epoch;
+      : parameters(param), root(nullptr), pmdk_addr(pmdk_addr), index_epoch(global_epoch),
+        retired_bytes(0), reclaimed_bytes(0), retired_internal_nodes(0) {
+    // Start in the current epoch rather than resetting it, which would make
+    // records being inserted into other trees look left over from a crash
+    AllocateStats();
+    latency_slots = nullptr;
+    latency_enabled = false;
+    hotness = nullptr;
+    hotness_sampling = 0;
+    leaf_store = nullptr;
+    change_feed = nullptr;
+    single_word_update = false;
+    narrow_prefetch = false;
+    internal_node_cache = false;
+    internal_node_replicas = false;
+    maintenance = nullptr;
+    ResetSnapshots();
     SetPMWCASPool(pool);
-    pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
+    EpochScope guard(GetPMWCASPool()->GetEpoch());
     auto *pd = pool->AllocateDescriptor();
     auto index = pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(&root),
                                         reinterpret_cast<uint64_t>(nullptr),
                                         pmwcas::Descriptor::kRecycleOnRecovery);
     auto root_ptr = pd->GetNewValuePtr(index);
-    LeafNode::New(reinterpret_cast<LeafNode **>(root_ptr), param.leaf_node_size);
-    pd->MwCAS();
+    LeafNode::New(reinterpret_cast<LeafNode **>(root_ptr), param.leaf_node_size,
+                  param.bloom_filter, param.leaf_lanes);
+    RunMwCAS(pd);
   }
 
+  // Wall-clock time spent by Recovery, in microseconds
+  struct RecoveryTimes {
+    // Rolling PMwCAS descriptors that were in flight at crash time forward
+    // or back (DescriptorPool::Recovery)
+    uint64_t descriptor_us;
+    // Resetting the volatile state of the tree
+    uint64_t tree_us;
+  };
+
 #ifdef PMEM
-  void Recovery() {
-    index_epoch += 1;
-    // avoid multiple increment if there are multiple bztrees
-    if (global_epoch != index_epoch) {
-      global_epoch = index_epoch;
-    }
-    pmwcas::DescriptorPool *pool = GetPMWCASPool();
-    pool->Recovery(false);
+  // Bring the tree back after a restart. Nothing is done per node: records
+  // that were being inserted at crash time carry an older allocation epoch,
+  // so they no longer count as IsInserting and stay invisible until the
+  // leaf's next consolidation drops them, and DRAM copy pointers of internal
+  // nodes are told stale by their epoch tag on first use (see
+  // GetInternalNodeCopy). The one exception is ParameterSet::record_counts,
+  // whose cached counts are cleared over all internal nodes (never leaves).
+  // Trees sharing a descriptor pool recover it only once, see
+  // TreeCatalog::Recovery.
+  RecoveryTimes Recovery(bool recover_pool = true);
+#endif
 
-    pmwcas::NVRAM::Flush(sizeof(bztree::BzTree), this);
+  // Wall-clock time spent by WarmUp, in microseconds, and what it went over
+  struct WarmUpStats {
+    // Faulting in the pages of the pool
+    uint64_t prefault_us;
+    uint64_t prefaulted_bytes;
+    // Reading the nodes in
+    uint64_t walk_us;
+    uint64_t internal_nodes;
+    uint64_t leaves;
+  };
+  // Warm up a tree just opened (e.g., right after Recovery) on [threads]
+  // threads, so that traffic doesn't start out with page faults and cache
+  // misses all over: with [prefault], fault in every page of the PMDK pool
+  // the tree lives in (the mapping holding GetPMDKAddr, nothing if it's 0) by
+  // reading a byte of each; then read every internal node into the cache
+  // (and into the internal node cache, if it's on), one level at a time,
+  // and, with [leaves], every leaf as well. Evicted leaves are left where
+  // they are. Nothing is written, so it may run along with other operations.
+  WarmUpStats WarmUp(uint32_t threads, bool prefault = true, bool leaves = false);
+
+  ~BzTree() {
+    StopMaintenance();
+    EnableInternalNodeCache(false);
+    garbage_list->Uninitialize();
+    delete garbage_list;
+    delete[] latency_slots.load();
+    free(stats_slots);
+    delete hotness.load();
+    delete leaf_store.load();
+    delete change_feed.load();
   }
-#endif
 
   void Dump();
 
@@ -609,17 +2293,176 @@ class BzTree {
   ReturnCode Insert(const char *key, uint16_t key_size, uint64_t payload);
   ReturnCode Read(const char *key, uint16_t key_size, uint64_t *payload);
   ReturnCode Update(const char *key, uint16_t key_size, uint64_t payload);
+  // Update the record if the key exists and insert it otherwise, both in the
+  // leaf found by a single traversal
   ReturnCode Upsert(const char *key, uint16_t key_size, uint64_t payload);
   ReturnCode Delete(const char *key, uint16_t key_size);
 
+  // What the operations above keep in thread-local storage or enter anew each
+  // time, held by the caller across many of them instead, see Session below
+  class Session;
+  // A Read, Insert or RangeScanBySize run a step at a time, see below
+  class SteppedOp;
+  ReturnCode Insert(Session *session, const char *key, uint16_t key_size, uint64_t payload);
+  ReturnCode Read(Session *session, const char *key, uint16_t key_size, uint64_t *payload);
+  ReturnCode Update(Session *session, const char *key, uint16_t key_size, uint64_t payload);
+  ReturnCode Upsert(Session *session, const char *key, uint16_t key_size, uint64_t payload);
+  ReturnCode Delete(Session *session, const char *key, uint16_t key_size);
+  // Delete all records with keys in [[lo], [hi]) without visiting them one by
+  // one: leaves that hold keys outside the range are swapped for consolidated
+  // copies without the covered records, and runs of up to kMaxDroppedLeaves
+  // leaves that are entirely covered are dropped by one PMwCAS that replaces
+  // their parent with a copy pointing to a single empty leaf instead. Not
+  // atomic as a whole, but each leaf is emptied atomically. See Compact for
+  // merging away the empty leaves left behind.
+  ReturnCode DeleteRange(const char *lo, uint16_t lo_size, const char *hi, uint16_t hi_size);
+  // Both new nodes, the parent's status, the grandparent's status and child
+  // pointer, and one status per leaf (plus its lanes, see
+  // BaseNode::GetFreezeWords)
+  static const uint32_t kMaxDroppedLeaves = DESC_CAP - 5;
+
+  // Atomic read-modify-write of an 8-byte payload in one traversal, see
+  // LeafNode::CompareAndSwap and LeafNode::FetchAdd
+  ReturnCode CompareAndSwap(const char *key, uint16_t key_size, uint64_t *expected,
+                            uint64_t desired);
+  ReturnCode FetchAdd(const char *key, uint16_t key_size, uint64_t delta,
+                      uint64_t *old_payload = nullptr);
+
+  // Variable-length payloads, stored inline in leaf records. Records can't be
+  // larger than GetMaxRecordSize() (NotEnoughSpace). Read takes the size of
+  // [payload] in [*payload_size] and returns the payload size in it.
+  ReturnCode Insert(const char *key, uint16_t key_size, const char *payload,
+                    uint32_t payload_size);
+  ReturnCode Read(const char *key, uint16_t key_size, char *payload, uint32_t *payload_size);
+  ReturnCode Update(const char *key, uint16_t key_size, const char *payload,
+                    uint32_t payload_size);
+  ReturnCode Upsert(const char *key, uint16_t key_size, const char *payload,
+                    uint32_t payload_size);
+
+  // Look up [count] keys at once under a single epoch, with the descents of
+  // all keys interleaved level by level so that the node prefetches issued
+  // for one key overlap with the work on the others. The result of key i goes
+  // to [rcs[i]] and, if found, [payloads[i]] (for the variable-length version
+  // [payload_sizes[i]] is in/out, as with Read).
+  void MultiRead(const char *const *keys, const uint16_t *key_sizes, uint32_t count,
+                 uint64_t *payloads, ReturnCode *rcs);
+  void MultiRead(const char *const *keys, const uint16_t *key_sizes, uint32_t count,
+                 char *const *payloads, uint32_t *payload_sizes, ReturnCode *rcs);
+
+  // Load an empty tree from a stream of records with strictly increasing keys,
+  // produced by [next] until it returns false, without going through Insert.
+  // Leaves are packed to [fill_factor] of the split threshold and fully
+  // sorted, internal levels are built on top of them, and the new root is
+  // installed with one PMwCAS. Nothing else may use the tree meanwhile.
+  // Returns KeyExists if the tree isn't empty or the keys aren't increasing,
+  // NotEnoughSpace if a record doesn't fit in a leaf at that fill factor; the
+  // tree is left as is then.
+  typedef std::function<bool(const char **key, uint16_t *key_size, uint64_t *payload)>
+      BulkLoadSource;
+  ReturnCode BulkLoad(const BulkLoadSource &next, float fill_factor = 0.8);
+  // Same, from [count] records in arrays, using [threads] threads: each packs
+  // the leaves of a slice of the input and later builds a share of each
+  // internal level, flushing the nodes it built
+  ReturnCode BulkLoad(const char *const *keys, const uint16_t *key_sizes,
+                      const uint64_t *payloads, uint64_t count, uint32_t threads,
+                      float fill_factor = 0.8);
+
+  // Write all records to the file at [path] in key order, see ExportHeader;
+  // if it holds an export that was cut short, carry on from where it got
+  // to. The file is synced every [sync_bytes] written. Returns IOError if it
+  // can't be opened or written.
+  ReturnCode Export(const char *path, uint64_t sync_bytes = 64 << 20);
+
+  // Visit every record with [threads] threads, the caller's included, e.g.,
+  // for aggregations. The key space is cut at the separators of the highest
+  // level of internal nodes that has kScanRangesPerThread children per thread
+  // (or of the parents of the leaves), and each thread scans one range after
+  // another with an Iterator, taking the next range not yet taken. [sink]
+  // gets the records leaf by leaf, a batch in key order valid until it
+  // returns, along with the number of the thread (0 to [threads] - 1); it
+  // runs on that thread and may return false to end the scan. Ranges are
+  // done in no particular order. Not a snapshot: each range is as consistent
+  // as an Iterator over it.
+  typedef std::function<bool(uint32_t thread, ScanBuffer *batch)> ParallelScanSink;
+  static const uint32_t kScanRangesPerThread = 8;
+  ReturnCode ParallelScan(uint32_t threads, const ParallelScanSink &sink);
+
+  // Number of records with keys in [[lo], [hi]), a null bound meaning
+  // unbounded, without visiting the records: the leaves at either end of the
+  // range are counted exactly, the subtrees in between by the record count
+  // their internal node caches, taken from the leaves' status words the first
+  // time it's needed. With ParameterSet::record_counts a split brings the
+  // counts of the nodes above the new parent up to date; cached counts miss
+  // what leaves gained or lost since, so the result is approximate, off by
+  // the inserts and deletes since the last split below. Without it nothing is
+  // cached, and the cost grows with the number of leaves in the range rather
+  // than the height of the tree. Evicted leaves are counted off their pages
+  // in the leaf store, without loading them back, and not at all if tiering
+  // isn't enabled. Not a snapshot under concurrent writes.
+  uint64_t Count(const char *lo, uint16_t lo_size, const char *hi, uint16_t hi_size);
+  // Approximate number of records with keys smaller than [key], i.e., its
+  // position in key order
+  inline uint64_t GetApproximateRank(const char *key, uint16_t key_size) {
+    return Count(nullptr, 0, key, key_size);
+  }
+
+  // Insert [count] records, the result of record i going to [rcs[i]] as with
+  // Insert. Keys are sorted and grouped by leaf, and each group is inserted
+  // with LeafNode::InsertBatch, using two PMwCASes per up to DESC_CAP - 1
+  // records. If a key appears more than once, the first one is inserted
+  // (all of them with ParameterSet::duplicate_keys).
+  void InsertBatch(const char *const *keys, const uint16_t *key_sizes, const uint64_t *payloads,
+                   uint32_t count, ReturnCode *rcs);
+
+  // Largest key plus payload size accepted, so that a full leaf always has
+  // enough records to be split
+  inline uint32_t GetMaxRecordSize() {
+    return std::min<uint32_t>(
+        (parameters.split_threshold - sizeof(LeafNode)) / 4 - sizeof(RecordMetadata),
+        RecordMetadata::kTotalLengthMask / sizeof(uint64_t) * sizeof(uint64_t));
+  }
+
   inline std::unique_ptr<Iterator> RangeScanBySize(const char *key1, uint16_t size1,
                                                    uint32_t scan_size) {
     return std::make_unique<Iterator>(this, key1, size1, scan_size);
   }
 
+  // Iterate over keys between [lo] and [hi], each bound inclusive or exclusive
+  inline std::unique_ptr<Iterator> RangeScanByKey(const char *lo, uint16_t lo_size,
+                                                  bool lo_inclusive,
+                                                  const char *hi, uint16_t hi_size,
+                                                  bool hi_inclusive) {
+    return std::make_unique<Iterator>(this, lo, lo_size, lo_inclusive,
+                                      hi, hi_size, hi_inclusive);
+  }
+
+  // Iterate over keys between [lo] and [hi] in descending order, starting
+  // from [hi], at most [scan_size] of them; a null bound means unbounded
+  inline std::unique_ptr<Iterator> ReverseRangeScanByKey(
+      const char *lo, uint16_t lo_size, bool lo_inclusive,
+      const char *hi, uint16_t hi_size, bool hi_inclusive,
+      uint32_t scan_size = std::numeric_limits<uint32_t>::max()) {
+    return std::make_unique<Iterator>(this, lo, lo_size, lo_inclusive,
+                                      hi, hi_size, hi_inclusive, scan_size, true);
+  }
+
+  // Copy up to [to_scan] records with keys from [key] on to [result], which is
+  // cleared first, in key order. NotEnoughSpace means [result] is a
+  // caller-provided buffer that filled up before [to_scan] records were found.
+  ReturnCode RangeScanBySize(const char *key, uint16_t key_size, uint32_t to_scan,
+                             ScanBuffer *result);
+
+  // Go down to the leaf that covers [key], or to the rightmost leaf if [key]
+  // is null
+  template <class KeyPolicy = VarKeyPolicy>
   LeafNode *TraverseToLeaf(Stack *stack, const char *key,
                            uint16_t key_size,
                            bool le_child = true);
+  // Find the leaves covering [keys] (no stack), one level at a time for all
+  // keys, prefetching each child before moving on to the next key; caller
+  // must hold an epoch
+  void TraverseToLeaves(const char *const *keys, const uint16_t *key_sizes, uint32_t count,
+                        LeafNode **leaves);
   BaseNode *TraverseToNode(bztree::Stack *stack,
                            const char *key, uint16_t key_size,
                            bztree::BaseNode *stop_at = nullptr,
@@ -631,8 +2474,279 @@ class BzTree {
 #else
     this->pmwcas_pool = pool;
 #endif
+    InitGarbageList();
+  }
+
+  // Hand a node that is no longer reachable from the tree (replaced by a
+  // split, merge or consolidation) to the garbage list; it's freed once no
+  // thread can be holding a reference to it, i.e., when its epoch is safe.
+  // [node] must be a direct pointer.
+  void RetireNode(BaseNode *node);
+
+  // Bytes of nodes handed to the garbage list and actually freed so far
+  inline uint64_t GetRetiredBytes() { return retired_bytes.load(std::memory_order_relaxed); }
+  inline uint64_t GetReclaimedBytes() { return reclaimed_bytes.load(std::memory_order_relaxed); }
+
+  // What the tree has been doing since it was created (or recovered), summed
+  // over all threads; all zero if built with ENABLE_STATS=0
+  struct Stats {
+    uint64_t leaf_splits;
+    uint64_t internal_splits;
+    uint64_t consolidations;
+    uint64_t merges;
+    // Installing a split, consolidation or merge failed, e.g., since a
+    // parent was frozen concurrently; the work is thrown away
+    uint64_t smo_failures;
+    // Inserts and updates that found a leaf frozen or full and backed off
+    // (up to MAX_FREEZE_RETRY times) to let another thread deal with it
+    uint64_t freeze_retries;
+    // Failed PMwCASs retried by record inserts, updates and deletes
+    uint64_t pmwcas_failures;
+    // Inserts that had to wait for a concurrent insert into the same leaf to
+    // finish to know whether their key is unique
+    uint64_t unique_waits;
+    // Leaves frozen by another thread that took too long to replace them, so
+    // this one split or consolidated them as well (see ContentionManager)
+    uint64_t smo_helps;
+    // Hints carried out by maintenance workers (see StartMaintenance)
+    uint64_t background_smos;
+    // Leaves dropped by DeleteRange as a whole, rather than consolidated
+    uint64_t dropped_leaves;
+    // DRAM copies of internal nodes made (see EnableInternalNodeCache)
+    uint64_t internal_node_copies;
+    // Leaves written out to the leaf store, and read back (see
+    // EvictColdLeaves)
+    uint64_t leaf_evictions;
+    uint64_t leaf_loads;
+    // PMwCAS descriptors taken from the pool, those that took long enough
+    // that the pool partition of the thread may have been exhausted (a timing
+    // guess, the pool doesn't report it), and those given back unused. For
+    // sizing the descriptor pool: it should hold enough for the descriptors
+    // allocated during an epoch (the PMwCAS library recycles a descriptor once
+    // no thread can still be reading it).
+    uint64_t descriptor_allocations;
+    uint64_t slow_descriptor_allocations;
+    uint64_t descriptor_aborts;
+  };
+  Stats GetStats();
+
+  // Where the bytes of the tree's nodes go, from a walk over all of them; not
+  // atomic, writes running meanwhile may or may not be seen
+  struct SpaceStats {
+    static const uint32_t kMaxLevels = Stack::kMaxFrames + 1;
+    static const uint32_t kFillBuckets = 10;
+    // Levels of the tree, [0] being the root, with their nodes and the bytes
+    // those take
+    uint32_t levels;
+    uint64_t nodes[kMaxLevels];
+    uint64_t node_bytes[kMaxLevels];
+    // Leaves by how much of them is taken (LeafNode::GetUsedSpace), in tenths
+    // of their size
+    uint64_t leaf_fill[kFillBuckets];
+    // Visible records of the leaves, those of them in unsorted fields, and the
+    // bytes of their keys and payloads
+    uint64_t records;
+    uint64_t unsorted_records;
+    uint64_t live_bytes;
+    // Records deleted or replaced, as counted in the leaves' status words
+    uint64_t deleted_bytes;
+    // Node headers, metadata arrays, fingerprints, Bloom filters and key
+    // prefixes of leaves; internal nodes count everything but their keys and
+    // child pointers
+    uint64_t metadata_bytes;
+    // Leaf space not taken yet, and leaves frozen (by SMOs in flight or left
+    // behind by a stalled thread)
+    uint64_t free_bytes;
+    uint64_t frozen_leaves;
+    // Leaves in the leaf store (see EvictColdLeaves), left out of the rest
+    uint64_t evicted_leaves;
+    // Replaced nodes not freed yet, see GetRetiredBytes
+    uint64_t unreclaimed_bytes;
+    // What consolidating every leaf would give back: invisible records (also
+    // failed inserts, which the delete size misses) and their metadata
+    uint64_t reclaimable_bytes;
+
+    // Node bytes, reclaimed or not, per byte of live keys and payloads
+    inline double GetSpaceAmplification() const {
+      uint64_t total = unreclaimed_bytes;
+      for (uint32_t i = 0; i < levels; ++i) {
+        total += node_bytes[i];
+      }
+      return live_bytes ? static_cast<double>(total) / static_cast<double>(live_bytes) : 0;
+    }
+  };
+  SpaceStats GetSpaceStats();
+
+  // Sample one in 2^[sample_shift] leaf accesses (traversals) into a hotness
+  // table (see HotnessTable); counts are carried over by consolidations and
+  // splits. Off by default and after recovery.
+  void EnableHotnessTracking(bool enable, uint32_t sample_shift = 6);
+  // Estimated accesses to [leaf] since it got its entry (decayed), 0 if it's
+  // not tracked; for policies that treat hot and cold leaves differently
+  uint64_t GetLeafHotness(LeafNode *leaf);
+  // The key range of a leaf, [lo] (exclusive) to [hi] (inclusive); empty for
+  // the leftmost leaf's lower bound and the rightmost leaf's upper bound
+  struct HotRange {
+    std::string lo;
+    std::string hi;
+    uint64_t accesses;
+  };
+  // The [k] leaves with the most estimated accesses, hottest first, from a
+  // walk over the tree
+  std::vector<HotRange> GetHotRanges(uint32_t k);
+
+  enum StatCounter {
+    kStatLeafSplits,
+    kStatInternalSplits,
+    kStatConsolidations,
+    kStatMerges,
+    kStatSMOFailures,
+    kStatFreezeRetries,
+    kStatPMwCASFailures,
+    kStatUniqueWaits,
+    kStatSMOHelps,
+    kStatBackgroundSMOs,
+    kStatDroppedLeaves,
+    kStatInternalNodeCopies,
+    kStatLeafEvictions,
+    kStatLeafLoads,
+    kStatDescriptorAllocations,
+    kStatSlowDescriptorAllocations,
+    kStatDescriptorAborts,
+    kStatCounters
+  };
+  inline void CountStat(StatCounter counter, uint64_t n = 1) {
+#if ENABLE_STATS
+    stats_slots[GetStatsSlotIndex()].counters[counter].fetch_add(n, std::memory_order_relaxed);
+#endif
+  }
+
+  // Latency distributions of single-record operations (and of scans, per
+  // ScanBuffer or Iterator batch), kept apart for operations that split,
+  // consolidated or merged a node, or backed off to let another thread do it,
+  // on the way. Off by default; turning them on allocates the histograms, one
+  // set per thread (until threads outnumber kLatencySlots).
+  enum LatencyOp { kOpInsert, kOpRead, kOpUpdate, kOpUpsert, kOpDelete, kOpScan, kLatencyOps };
+  struct LatencySnapshot {
+    LatencyHistogram fast[kLatencyOps];
+    LatencyHistogram smo[kLatencyOps];
+  };
+  void EnableLatencyHistograms(bool enable);
+  // Merge the histograms of all threads into [snapshot], which isn't cleared
+  // first, so snapshots of several trees can be summed up
+  void GetLatencyHistograms(LatencySnapshot *snapshot);
+  // Print the count and percentiles of each histogram that isn't empty
+  void DumpLatencyHistograms();
+
+  // Update 8-byte payloads in place with a single-word CAS rather than a
+  // 3-word PMwCAS (see LeafNode::Update), for Update and Upsert. Off by
+  // default and after recovery.
+  inline void EnableSingleWordUpdate(bool enable) {
+    single_word_update.store(enable, std::memory_order_relaxed);
+  }
+
+  // Prefetch only the header and metadata of each node on the way down to a
+  // leaf rather than the whole node, which point operations mostly don't
+  // read. Off by default and after recovery.
+  inline void EnableNarrowPrefetch(bool enable) {
+    narrow_prefetch.store(enable, std::memory_order_relaxed);
   }
 
+  // Search internal nodes through volatile DRAM copies of them, so that only
+  // leaves and the child pointers followed are read from PMEM on the way
+  // down. Keys and metadata of an internal node never change, so a copy is
+  // made once, upon turning the cache on for the nodes already in the tree
+  // and on first use for nodes built later, and freed along with the node.
+  // Copies are searched through the heads of their keys, see
+  // InternalNode::kKeyHeads. Child pointers keep being read from the node
+  // itself, they are the only part that changes (by PMwCAS). Off by default
+  // and after recovery, which drops the copies: turning it back on then
+  // rebuilds them. Turning it off frees the copies, so do that while no
+  // other thread is using the tree.
+  // With [per_socket] set, each node gets a copy on every NUMA node, bound to
+  // it, and threads search the one on their own socket; the copies are then
+  // padded to whole pages. Switching between the two frees the copies too.
+  void EnableInternalNodeCache(bool enable, bool per_socket = false);
+
+  // Open a read-only view of the tree as of now, which stays the same while
+  // writes go on, see Snapshot; null if kMaxSnapshots are open already. Waits
+  // for the writes in flight to finish (those that start later save what
+  // they change for the snapshot), as does closing it, so neither thread may
+  // hold an epoch then (an open ReadSession or Session included). The tree has
+  // to outlive its snapshots, which are volatile. BulkLoad fails with
+  // KeyExists while one is open.
+  static const uint32_t kMaxSnapshots = 16;
+  std::unique_ptr<Snapshot> NewSnapshot();
+
+  // Background maintenance: with [threads] workers running, inserts and
+  // upserts that fill a leaf past [soft_fill] of the split threshold, and
+  // deletes (with ENABLE_MERGE), leave a hint for the workers to split,
+  // consolidate or merge it, so that it's mostly done before the leaf is full
+  // and off the critical path of user operations. Leaves that do fill up are
+  // still split inline. Hints are dropped, not queued, if there are more than
+  // kMaxMaintenanceHints. Workers are volatile: stopped by the destructor and
+  // gone after recovery. Start and stop them while no other thread is using
+  // the tree. With [compaction_rate] set, another worker runs Compact over
+  // and over, looking at that many leaves per second.
+  static const uint32_t kMaxMaintenanceHints = 4096;
+  void StartMaintenance(uint32_t threads, float soft_fill = 0.9, uint32_t compaction_rate = 0);
+  // Stop the workers, dropping the hints they haven't got to
+  void StopMaintenance();
+  // Wait until the workers are done with all hints so far
+  void WaitForMaintenance();
+
+  // Incremental compaction of sparse regions, such as those left by deleting
+  // a range of keys: look at up to [max_leaves] leaves in key order, from the
+  // one holding [*cursor] (the first one if empty), and merge those below the
+  // merge threshold with a sibling, as a delete under ENABLE_MERGE would,
+  // then their parents if they got small in turn. A leaf is merged again for
+  // as long as it's small, so runs of small leaves end up merged into one.
+  // Also collapses a root left with a single child. Returns false once past
+  // the last leaf, otherwise [*cursor] is where to pick up next time.
+  bool Compact(std::string *cursor, uint32_t max_leaves);
+
+  // Pack cold leaves to save memory: look at up to [max_leaves] leaves in key
+  // order, from the one holding [*cursor] (the first one if empty), and copy
+  // those with at most [max_accesses] estimated accesses (all of them without
+  // hotness tracking) and a good deal of free space into packed leaves, just
+  // big enough for their records, with the longest key prefix their bounds
+  // allow. Reads search packed leaves as any other; the first write that
+  // doesn't fit copies the leaf back into a full-sized one. Leaves packed go to
+  // [*packed] if given. Returns false once past the last leaf, otherwise
+  // [*cursor] is where to pick up next time.
+  bool PackColdLeaves(std::string *cursor, uint32_t max_leaves, uint64_t max_accesses = 0,
+                      uint32_t *packed = nullptr);
+
+  // Keep cold leaves in [path], a page file meant for an SSD, created if it
+  // doesn't exist; see LeafStore. Once enabled it stays so, and after
+  // recovery it has to be enabled again, with the same file, before anything
+  // else is done with the tree. IOError if the file can't be used.
+  ReturnCode EnableTiering(const char *path);
+  // Evict cold leaves, picked as PackColdLeaves does but regardless of their
+  // free space, to the leaf store: each is written to a page and replaced in
+  // its parent by a tagged word. The first traversal to reach an evicted leaf
+  // reads it back (pread in the thread that got there) and swaps it in;
+  // operations don't change otherwise, but walks (GetSpaceStats aside) load
+  // every leaf they visit. The root is never evicted. Leaves evicted go to
+  // [*evicted] if given.
+  bool EvictColdLeaves(std::string *cursor, uint32_t max_leaves, uint64_t max_accesses = 0,
+                       uint32_t *evicted = nullptr);
+  // Leaves in the leaf store, as evicted since it was opened and not loaded
+  // back; 0 without one
+  uint64_t GetEvictedLeaves();
+
+  // Publish every write applied from now on to a change feed with rings of
+  // [ring_size] changes (see ChangeFeed); nothing if it's already on. Off by
+  // default and after recovery. Every write then bumps the feed's shared
+  // sequence counter, one cache line all writers contend on.
+  void EnableChangeFeed(uint32_t ring_size = 4096);
+  // Changes not drained yet are lost; subscribers have to be done with the
+  // feed first. Waits for the current epoch to end, so the caller must not
+  // hold one (an open ReadSession or Session included).
+  void DisableChangeFeed();
+  // nullptr if it's off
+  inline ChangeFeed *GetChangeFeed() { return change_feed.load(std::memory_order_acquire); }
+
   inline pmwcas::DescriptorPool *GetPMWCASPool() {
 #ifdef PMDK
     return Allocator::Get()->GetDirect(pmwcas_pool);
@@ -658,6 +2772,316 @@ class BzTree {
   uint64_t pmdk_addr;
   uint64_t index_epoch;
 
+  // Volatile, re-created upon recovery
+  pmwcas::GarbageList *garbage_list;
+  std::atomic<uint64_t> retired_bytes;
+  std::atomic<uint64_t> reclaimed_bytes;
+  // Bumped whenever an internal node is retired. Internal nodes on a path
+  // found not frozen are still live (and their child pointers usable, as leaf
+  // consolidations replace children in place) as long as this is unchanged.
+  std::atomic<uint64_t> retired_internal_nodes;
+
+  // Counters are striped over cache-line-sized slots, one per thread (until
+  // threads outnumber slots), so that counting doesn't bounce lines around.
+  // Volatile, allocated by the constructor and again upon recovery, off the
+  // tree as the tree may be the PMDK root object.
+  static const uint32_t kStatsSlots = 64;
+  struct StatsSlot {
+    std::atomic<uint64_t> counters[kStatCounters];
+    char padding[64 - kStatCounters * sizeof(uint64_t) % 64];
+  };
+  StatsSlot *stats_slots;
+  static uint32_t GetStatsSlotIndex();
+
+  // Volatile, allocated on first EnableLatencyHistograms and dropped upon
+  // recovery
+  static const uint32_t kLatencySlots = 16;
+  std::atomic<LatencySnapshot *> latency_slots;
+  std::atomic<bool> latency_enabled;
+  friend class LatencyTimer;
+  // Volatile, allocated on first EnableHotnessTracking; one in
+  // [hotness_sampling] traversals is sampled, none if 0
+  std::atomic<HotnessTable *> hotness;
+  std::atomic<uint32_t> hotness_sampling;
+  inline void SampleLeafAccess(LeafNode *leaf) {
+    uint32_t sampling = hotness_sampling.load(std::memory_order_relaxed);
+    if (!sampling) {
+      return;
+    }
+    thread_local uint32_t accesses = 0;
+    if (++accesses % sampling == 0) {
+      hotness.load(std::memory_order_relaxed)->Sample(leaf);
+    }
+  }
+  // [leaf] (a direct pointer) was replaced by [replacement] (PMDK offset
+  // under PMDK, as installed)
+  void InheritHotness(LeafNode *leaf, uint64_t replacement, uint32_t shift);
+  // Volatile, set by EnableTiering and dropped upon recovery
+  std::atomic<LeafStore *> leaf_store;
+  // Fault in the mapping holding [addr] on [threads] threads; bytes faulted in
+  static uint64_t PrefaultMapping(uint64_t addr, uint32_t threads);
+  // Volatile, set by EnableChangeFeed and dropped upon recovery
+  std::atomic<ChangeFeed *> change_feed;
+  inline void PublishChange(ChangeFeed::Op op, const char *key, uint16_t key_size,
+                            uint64_t payload, const char *value = nullptr,
+                            uint32_t value_size = 0) {
+    if (auto *feed = change_feed.load(std::memory_order_acquire)) {
+      feed->Append(op, key, key_size, payload, value, value_size);
+    }
+  }
+  friend class InternalNode;
+  // Read the leaf [word] in [parent] at [index] points to and swap it in. A
+  // parent frozen meanwhile gets nothing swapped in: the leaf read comes back
+  // frozen, to be thrown away, so that writers wait for the new parent.
+  BaseNode *LoadLeaf(LeafStore *store, InternalNode *parent, uint32_t index, uint64_t word);
+  // Evict [leaf], frozen by the caller, the child at the top of [stack]
+  bool EvictLeaf(Stack *stack, LeafNode *leaf);
+  std::atomic<bool> single_word_update;
+  // Volatile, see EnableNarrowPrefetch
+  std::atomic<bool> narrow_prefetch;
+  std::atomic<bool> internal_node_cache;
+  std::atomic<bool> internal_node_replicas;
+  // The node to search for the child to follow from [node]: its DRAM copy if
+  // the internal node cache is on (the one on the socket of this thread if
+  // there's one per socket), [node] itself otherwise
+  inline InternalNode *GetSearchNode(InternalNode *node) {
+    if (!internal_node_cache.load(std::memory_order_relaxed)) {
+      return node;
+    }
+    auto word = reinterpret_cast<std::atomic<uint64_t> *>(
+        &node->GetHeader()->dram_copy)->load(std::memory_order_acquire);
+    auto *copy = GetInternalNodeCopy(word);
+    if (!copy) {
+      copy = CopyInternalNode(node, word);
+      if (copy == node) {
+        return node;
+      }
+    }
+    if (!internal_node_replicas.load(std::memory_order_relaxed)) {
+      return copy;
+    }
+    return reinterpret_cast<InternalNode *>(reinterpret_cast<char *>(copy) +
+        NodeAllocator::GetNumaNode() * GetReplicaStride(InternalNode::GetCopySize(
+            node->GetHeader()->size, node->GetHeader()->sorted_count)));
+  }
+  // Replicas of a node of [size] bytes start on their own pages, so that each
+  // can be bound to its socket
+  static const uint32_t kPageSize = 4096;
+  static inline uint32_t GetReplicaStride(uint32_t size) {
+    return (size + kPageSize - 1) & ~(kPageSize - 1);
+  }
+  // Copy pointers carry the low bits of the index epoch they were made in
+  // above the address bits, so those left over from before a restart (the
+  // copies are gone) can be told apart without visiting every internal node
+  // at recovery. Recovery only does that once the tag wraps around.
+  static const uint32_t kCopyTagShift = 48;
+  static const uint64_t kCopyTagMask = (uint64_t{1} << (64 - kCopyTagShift)) - 1;
+  inline uint64_t GetCopyTag() { return (index_epoch & kCopyTagMask) << kCopyTagShift; }
+  // The copy [word], the copy pointer of an internal node, points to, or
+  // nullptr if there's none or it's stale
+  inline InternalNode *GetInternalNodeCopy(uint64_t word) {
+    if ((word & ~((uint64_t{1} << kCopyTagShift) - 1)) != GetCopyTag()) {
+      return nullptr;
+    }
+    return reinterpret_cast<InternalNode *>(word & ((uint64_t{1} << kCopyTagShift) - 1));
+  }
+  // Make and install a DRAM copy of [node] in place of [word], the (null or
+  // stale) copy pointer it had, unless another thread did first; returns the
+  // copy installed
+  InternalNode *CopyInternalNode(InternalNode *node, uint64_t word);
+  // Clear the copy pointers of internal node [node] and the internal nodes
+  // below it, after freeing the copies if [free_copies] is set; only one leaf
+  // per parent of leaves is looked at
+  void DropInternalNodeCopies(InternalNode *node, bool free_copies);
+
+  // Volatile, see StartMaintenance
+  std::atomic<MaintenanceWorkers *> maintenance;
+  uint32_t maintenance_threshold;
+  friend struct MaintenanceWorkers;
+  // The point operations on a thread protected in the epoch already, tracing
+  // the traversal in [stack], run through [session] if given
+  ReturnCode InsertProtected(Stack *stack, const char *key, uint16_t key_size, uint64_t payload,
+                             Session *session = nullptr);
+  ReturnCode ReadProtected(const char *key, uint16_t key_size, uint64_t *payload,
+                           Session *session = nullptr);
+  ReturnCode UpdateProtected(Stack *stack, const char *key, uint16_t key_size, uint64_t payload,
+                             Session *session = nullptr);
+  ReturnCode UpsertProtected(Stack *stack, const char *key, uint16_t key_size, uint64_t payload,
+                             Session *session = nullptr);
+  ReturnCode DeleteProtected(Stack *stack, const char *key, uint16_t key_size,
+                             Session *session = nullptr);
+  // The leaf for [key], with the path to it in [stack]: the last leaf an
+  // operation of [session] got to if the session does finger search and the
+  // leaf still covers [key], else the one a traversal from the root gets to
+  LeafNode *TraverseFromFinger(Stack *stack, Session *session, const char *key,
+                               uint16_t key_size);
+
+  // Hint a split or consolidation of [node], where [key] went, if it's filled
+  // past the soft threshold
+  inline void HintFullLeaf(LeafNode *node, const char *key, uint16_t key_size) {
+    auto *workers = maintenance.load(std::memory_order_acquire);
+    if (workers && LeafNode::GetUsedSpace(node->GetHeader()->GetStatus()) >=
+                   maintenance_threshold) {
+      AddMaintenanceHint(workers, node, key, key_size, false);
+    }
+  }
+  // Consolidate [node], the leaf below the top of [stack], if its unsorted
+  // field reached ParameterSet::sorted_insert_threshold records; left to
+  // whoever froze the node first, if someone did
+  inline void KeepLeafSorted(Stack *stack, LeafNode *node) {
+    auto threshold = parameters.sorted_insert_threshold;
+    auto *header = node->GetHeader();
+    if (threshold && header->GetStatus().GetRecordCount() >= header->sorted_count + threshold &&
+        node->Freeze(GetPMWCASPool())) {
+      ConsolidateLeaf(stack, node);
+    }
+  }
+  void AddMaintenanceHint(MaintenanceWorkers *workers, LeafNode *node, const char *key,
+                          uint16_t key_size, bool merge);
+  void RunMaintenance(MaintenanceWorkers *workers);
+  void RunCompaction(MaintenanceWorkers *workers, uint32_t leaves_per_second);
+  // Replace an internal root with a single child by that child
+  void CollapseRoot();
+  // The leaf holding [cursor], a lower bound as GetLeafUpperBound gives, or the
+  // first leaf if empty
+  LeafNode *TraverseToCursor(Stack *stack, const std::string &cursor);
+  void ResetStats();
+  // New zeroed stats_slots, whatever the old pointer was
+  void AllocateStats();
+  // Add [node], [depth] levels below the root, and the nodes below it
+  void CollectSpaceStats(BaseNode *node, uint32_t depth, SpaceStats *stats);
+  void CollectHotRanges(BaseNode *node, Stack *stack, HotnessTable *table,
+                        std::vector<HotRange> *ranges);
+  // Add what record operations on this thread counted so far
+  void CollectPendingStats();
+
+  inline void InitGarbageList() {
+    garbage_list = new pmwcas::GarbageList();
+    garbage_list->Initialize(GetPMWCASPool()->GetEpoch());
+  }
+  static void FreeNode(void *context, void *node);
+
+  // Wait for [node], a leaf frozen by another thread, to be replaced in its
+  // parent (the top of [stack]) or for the parent to be frozen as well; false
+  // if that didn't happen within ContentionManager::kMaxWaits rounds
+  bool WaitForReplacement(Stack *stack, LeafNode *node);
+
+  // [node], the leaf [stack] leads to, was found frozen or full ([rc]) by an
+  // insert or (out-of-place) update. Freeze it and make room by consolidating
+  // or splitting it, unless backing off (right away rather than waiting for
+  // the one that froze it if [wait] isn't set); the caller retries either way.
+  void SplitOrConsolidate(Stack *stack, LeafNode *node, ReturnCode rc, uint64_t *freeze_retry,
+                          bool wait = true);
+
+  // Install a consolidated copy of [node], a frozen leaf [stack] leads to,
+  // without records in [[drop_lo], [drop_hi]) if [drop_hi] is set and
+  // [node_size] bytes big (see LeafNode::PrepareForConsolidate); false if the
+  // parent (or root) changed meanwhile
+  bool ConsolidateLeaf(Stack *stack, LeafNode *node, const char *drop_lo = nullptr,
+                       uint32_t drop_lo_size = 0, const char *drop_hi = nullptr,
+                       uint32_t drop_hi_size = 0, uint32_t node_size = 0);
+  // Consolidate [leaf], frozen by this thread for a PackColdLeaves or
+  // EvictColdLeaves step that failed, so that it doesn't stay frozen; tries
+  // again as long as [cursor] (see TraverseToCursor) still leads to it
+  void ReplaceFrozenLeaf(Stack *stack, LeafNode *leaf, const std::string &cursor);
+
+  // Drop the leaf [stack] leads to, and the siblings right of it up to the
+  // last one below [hi] (at most kMaxDroppedLeaves), from their parent; the
+  // upper bound of the last one dropped goes to [*next]. NodeFrozen if one of
+  // the nodes involved is frozen, PMWCASFailure if they changed meanwhile.
+  ReturnCode DropLeaves(Stack *stack, const char *hi, uint32_t hi_size, std::string *next);
+
+  // Get the separator that bounds the leaf [stack] leads to from above, i.e.,
+  // the largest key the leaf can hold; false if it's the rightmost leaf
+  static bool GetLeafUpperBound(Stack *stack, const char **key, uint32_t *key_size);
+  // The separator that bounds the leaf from below, i.e., the largest key the
+  // leaf before it can hold; false if it's the leftmost leaf
+  static bool GetLeafLowerBound(Stack *stack, const char **key, uint32_t *key_size);
+  // The common prefix of both bounds of the leaf, which all keys it can hold
+  // share (nothing for the leftmost and rightmost leaves)
+  static uint16_t GetLeafPrefix(Stack *stack, const char **prefix);
+
+  // A node built by BulkLoad (direct pointer) and its separator from the
+  // next node: not smaller than the largest key under it, smaller than any
+  // key after it
+  struct BulkNode {
+    BaseNode *node;
+    const char *last_key;
+    uint16_t last_key_size;
+  };
+  // Append to [parents] nodes of at most [fill_size] bytes holding the
+  // (at least two) nodes in [first, last), in order
+  void BuildInternalLevel(std::vector<BulkNode>::const_iterator first,
+                          std::vector<BulkNode>::const_iterator last, uint32_t fill_size,
+                          std::vector<BulkNode> *parents);
+  // Pack the records from [next] into new leaves appended to [leaves]
+  ReturnCode BuildLeaves(const BulkLoadSource &next, uint32_t fill_size,
+                         std::vector<BulkNode> *leaves);
+  // Build the internal levels on top of [level] and swap in the root
+  ReturnCode InstallBulkTree(BaseNode *old_root, std::vector<BulkNode> *level,
+                             uint32_t fill_size, uint32_t threads);
+  // Byte budget for nodes built by BulkLoad that split beyond [split_size]
+  uint32_t GetBulkFillSize(float fill_factor, uint32_t split_size);
+  bool CanBulkLoad(BaseNode *root_node);
+
+  // Move [stack] from the leaf it leads to over to the leaf right (or left, if
+  // [left] is set) of it, by advancing the lowest frame that has a sibling
+  // and descending from there; only that frame's node is re-read. Returns
+  // nullptr if there's no such leaf or the node was frozen, i.e., is about to
+  // be replaced, in which case the caller should traverse from the root,
+  // unless [frozen_ok]: a node frozen since the traversal in the same epoch
+  // still leads to leaves that are valid to read, or frozen in turn.
+  LeafNode *TraverseToSibling(Stack *stack, bool left, bool frozen_ok = false);
+
+  // With ParameterSet::duplicate_keys, the records of a key can go on from
+  // the first leaf that may hold them, where searching for the key leads, to
+  // the leaves right of it as long as the key is their separator. The leaf
+  // right of the one [stack] leads to, if it may hold more records of [key].
+  LeafNode *NextLeafOfKey(Stack *stack, const char *key, uint16_t key_size);
+  // The first leaf of [key] from [node], the one [stack] leads to, on that
+  // holds a record of it, or the last one
+  LeafNode *FindLeafOfKey(Stack *stack, const char *key, uint16_t key_size, LeafNode *node);
+  // The leaf [skip] leaves right of the first one of [key] (left of the last
+  // one if [left] is set), or as far as the run goes: where a walk over the
+  // leaves that's done with [skip] leaves of the run goes on in another epoch,
+  // as searching for [key] can't tell them apart. nullptr if a node on the
+  // way was frozen.
+  LeafNode *TraverseToRunLeaf(Stack *stack, const char *key, uint16_t key_size, uint32_t skip,
+                              bool left = false);
+
+  friend class Iterator;
+  friend class TreeCatalog;
+  friend class MultiTreeWrite;
+  friend class Snapshot;
+  friend class VersionWriter;
+  // Volatile, see NewSnapshot; writes look at the slots only if
+  // [open_snapshots] is set
+  std::atomic<Snapshot *> snapshots[kMaxSnapshots];
+  std::atomic<uint32_t> open_snapshots;
+  inline void ResetSnapshots() {
+    for (auto &snapshot : snapshots) {
+      snapshot = nullptr;
+    }
+    open_snapshots = 0;
+  }
+  // The separators of the highest level of internal nodes with at least
+  // [count] children, or of the parents of the leaves, in key order
+  void GetScanBounds(uint32_t count, std::vector<std::string> *bounds);
+  // Records in [[lo], [hi]) under [node], see Count; a null bound means all of
+  // [node] is within the range on that side. Leaves are counted exactly.
+  uint64_t CountRecords(BaseNode *node, const char *lo, uint32_t lo_size, const char *hi,
+                        uint32_t hi_size, pmwcas::EpochManager *epoch);
+  // All records under [node], cached in internal nodes if record_counts is set
+  uint64_t GetSubtreeRecords(BaseNode *node, pmwcas::EpochManager *epoch);
+  // Add [delta] to the cached count of [node], if it has one
+  static void AdjustRecordEstimate(InternalNode *node, int64_t delta);
+  // Forget the cached counts of [node] and the internal nodes below it
+  void ClearRecordEstimates(InternalNode *node);
+  // Wait until every thread in an epoch now has left it
+  void WaitForEpoch();
+  // Free every node of the tree, which no other thread may be using
+  void FreeAllNodes();
+
   inline BaseNode *GetRootNodeSafe() {
     auto root_node = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
         &root)->GetValueProtected();
@@ -669,66 +3093,954 @@ class BzTree {
   }
 };
 
+// Iterates over a key range one leaf at a time: the records of a leaf that
+// fall in the range are copied to a ScanBuffer batch under an epoch, then
+// handed out. The next leaf is found through the upper bound of the current
+// one, and not visited at all if that bound is already past the range. A
+// reverse iterator goes the other way, starting from the upper end of the
+// range and moving to the previous leaf through the current one's lower bound.
 class Iterator {
  public:
-  explicit Iterator(BzTree *tree, const char *begin_key, uint16_t begin_size, uint32_t scan_size) :
-      key(begin_key), size(begin_size), tree(tree), remaining_size(scan_size) {
-    node = this->tree->TraverseToLeaf(nullptr, begin_key, begin_size);
-    node->RangeScanBySize(begin_key, begin_size, scan_size, &item_vec, tree->GetPMWCASPool());
+  // Records with keys from [begin_key] on, at most [scan_size] of them
+  explicit Iterator(BzTree *tree, const char *begin_key, uint16_t begin_size, uint32_t scan_size)
+      : tree(tree), next_key(begin_key, begin_size), has_next(true), next_inclusive(true),
+        has_end(false), end_inclusive(false), remaining_size(scan_size),
+        reverse(false), exhausted(false), cursor(nullptr), stack_version(0), run_leaves(0) {
+    stack.tree = tree;
+  }
+
+  // Records with keys between [lo] and [hi], each bound inclusive or exclusive,
+  // in ascending order or, if [reverse] is set, descending order. A null [hi]
+  // means no upper bound; a null [lo] means no lower bound for reverse scans.
+  Iterator(BzTree *tree, const char *lo, uint16_t lo_size, bool lo_inclusive,
+           const char *hi, uint16_t hi_size, bool hi_inclusive,
+           uint32_t scan_size = std::numeric_limits<uint32_t>::max(), bool reverse = false)
+      : tree(tree), remaining_size(scan_size), reverse(reverse), exhausted(false),
+        cursor(nullptr), stack_version(0), run_leaves(0) {
+    stack.tree = tree;
+    if (reverse) {
+      std::swap(lo, hi);
+      std::swap(lo_size, hi_size);
+      std::swap(lo_inclusive, hi_inclusive);
+    } else if (!lo) {
+      // The empty key sorts before all others
+      lo = "";
+      lo_size = 0;
+      lo_inclusive = true;
+    }
+    has_next = lo != nullptr;
+    next_inclusive = lo_inclusive;
+    if (lo) {
+      next_key.assign(lo, lo_size);
+    }
+    has_end = hi != nullptr;
+    end_inclusive = hi_inclusive;
+    if (hi) {
+      end_key.assign(hi, hi_size);
+    }
   }
 
   ~Iterator() = default;
 
-  inline std::unique_ptr<Record> GetNext() {
-    if (item_vec.empty() || remaining_size == 0) {
-      return nullptr;
-    }
+  std::unique_ptr<Record> GetNext();
+  // The records of the next leaf in range, in a batch that's valid until the
+  // next call; nullptr at the end. Not to be mixed with GetNext. A scan size
+  // left at the maximum doesn't limit the records handed out this way.
+  ScanBuffer *GetNextBatch();
 
-    remaining_size -= 1;
-    // we have more than one record
-    if (item_vec.size() > 1) {
-      auto front = std::move(item_vec.front());
-      item_vec.pop_front();
-      return front;
-    }
+ private:
+  // Load the records of the next leaf in range into [batch]
+  void Fill();
+  // Get to the next leaf through the cached path if it's still valid as of
+  // [version], otherwise traverse from the root to the leaf covering [key],
+  // or past the [run_leaves] leaves of it already visited
+  LeafNode *GetNextLeaf(uint64_t version, const char *key, uint32_t key_size, bool le_child);
 
-    // there's only one record in the vector
-    auto last_record = std::move(item_vec.front());
-    item_vec.pop_front();
+  BzTree *tree;
+  // Where the next leaf to visit starts (ends, for reverse iterators), and
+  // where the range ends (starts)
+  std::string next_key;
+  bool has_next;
+  bool next_inclusive;
+  std::string end_key;
+  bool has_end;
+  bool end_inclusive;
+  uint32_t remaining_size;
+  bool reverse;
+  bool exhausted;
+  ScanBuffer batch;
+  Record *cursor;
+  // Path to the last leaf visited, reused to get to its sibling while
+  // [stack_version] matches the tree's count of retired internal nodes
+  Stack stack;
+  uint64_t stack_version;
+  // With ParameterSet::duplicate_keys, how many leaves in a row visited last
+  // have [next_key] as their bound, see BzTree::TraverseToRunLeaf
+  uint32_t run_leaves;
+};
 
-    node = this->tree->TraverseToLeaf(nullptr,
-                                      last_record->GetKey(),
-                                      last_record->meta.GetKeyLength(),
-                                      false);
-    if (node == nullptr) {
-      return nullptr;
+// Keeps the calling thread in an epoch of [tree]'s PMwCAS pool from
+// construction to destruction, so that the operations in between don't each
+// enter and leave one (see EpochScope). Nodes retired meanwhile by any thread
+// can't be freed until the session ends or is refreshed, so long sessions
+// should call Refresh every so often, between operations: records and nodes
+// looked at before a Refresh are not safe to use after it. Sessions nest, only
+// the outermost one protects. Works for writes too, though what pays off is
+// many short reads. A session held and never refreshed also holds up every
+// call that waits for all threads to leave the current epoch (NewSnapshot,
+// ~Snapshot, DisableChangeFeed), which then waits as long as it's open; from
+// the thread that holds it, such a call never returns.
+class ReadSession {
+ public:
+  explicit ReadSession(BzTree *tree)
+      : epoch_(tree->GetPMWCASPool()->GetEpoch()), owner_(!epoch_->IsProtected()) {
+    if (owner_) {
+      epoch_->Protect();
     }
-    item_vec.clear();
-    const char *last_key = last_record->GetKey();
-    uint32_t last_len = last_record->meta.GetKeyLength();
-    node->RangeScanBySize(last_key, last_len, remaining_size, &item_vec, tree->GetPMWCASPool());
-
-    // FIXME(hao): this a temp workaround
-    // should fix traverse to leaf instead
-    // check if we hit the same record
-    if (!item_vec.empty()) {
-      auto new_front = item_vec.front().get();
-      if (BaseNode::KeyCompare(new_front->GetKey(), new_front->meta.GetKeyLength(),
-                               last_record->GetKey(), last_record->meta.GetKeyLength()) == 0) {
-        item_vec.clear();
-        return last_record;
-      }
+  }
+  ~ReadSession() {
+    if (owner_) {
+      epoch_->Unprotect();
     }
-    return last_record;
   }
+  ReadSession(const ReadSession &) = delete;
+  ReadSession &operator=(const ReadSession &) = delete;
+
+  // Move up to the current epoch
+  inline void Refresh() {
+    if (owner_) {
+      epoch_->Unprotect();
+      epoch_->Protect();
+    }
+  }
+
+ private:
+  pmwcas::EpochManager *epoch_;
+  bool owner_;
+};
+
+// Per-caller state for a run of point operations on one tree: the traversal
+// stack, which the plain operations look up in thread-local storage each time,
+// protection in the tree's epoch for the session's lifetime (see ReadSession,
+// Refresh included), and counts of the operations run through it. One thread
+// at a time, and only one open session per thread and tree is of use. As with
+// ReadSession, NewSnapshot, ~Snapshot and DisableChangeFeed wait for the
+// session to end or be refreshed, and deadlock if called on its thread.
+//
+// With [finger_search], the session keeps the last leaf an operation got to
+// and the path to it, and the next operation starts there instead of at the
+// root if its key is still within the leaf's bounds (the separators around it
+// on the path) and the leaf isn't frozen: anything that replaces a leaf, or
+// changes what keys it covers, freezes it first. Pays off for keys that come
+// roughly sorted or in clusters; otherwise it costs two key compares per
+// operation. The leaf is forgotten upon Refresh.
+class BzTree::Session {
+ public:
+  explicit Session(BzTree *tree, bool finger_search = false)
+      : epoch(tree), operations(), finger_search(finger_search), finger(nullptr),
+        finger_hits(0) {
+    stack.tree = tree;
+    finger_path.tree = tree;
+  }
+  ~Session() {}
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  inline void Refresh() {
+    epoch.Refresh();
+    finger = nullptr;
+  }
+  inline uint64_t GetOperationCount(LatencyOp op) { return operations[op]; }
+  // Operations that started at the last leaf rather than at the root
+  inline uint64_t GetFingerHits() { return finger_hits; }
 
  private:
+  friend class BzTree;
+  friend class BzTree::SteppedOp;
+  Stack stack;
+  ReadSession epoch;
+  uint64_t operations[kLatencyOps];
+  bool finger_search;
+  LeafNode *finger;
+  Stack finger_path;
+  uint64_t finger_hits;
+};
+
+// A Read, Insert or RangeScanBySize that runs a step at a time, so that one
+// thread can interleave many of them and hide the cache misses of each behind
+// the work of the others, e.g., as the body of C++20 awaitables that an
+// executor resumes round robin. A step goes down one level and prefetches the
+// node it got to, or, at the leaf, does what the operation does there; a leaf
+// in the leaf store is prefetched from the file and read a step later. Where
+// the blocking call would wait for another thread to replace a frozen leaf,
+// a step returns instead and the next one starts over from the root. Steps
+// run in the epoch of [session], so an operation has to run on the thread of
+// its session and be done before the session is refreshed. Keys (and the
+// scan buffer) are the caller's, and have to stay valid until then too.
+class BzTree::SteppedOp {
+ public:
+  explicit SteppedOp(Session *session);
+  SteppedOp(const SteppedOp &) = delete;
+  SteppedOp &operator=(const SteppedOp &) = delete;
+
+  // Start an operation, once the last one is done; results are as with the
+  // blocking calls
+  void Read(const char *key, uint16_t key_size);
+  void Insert(const char *key, uint16_t key_size, uint64_t payload);
+  void Scan(const char *key, uint16_t key_size, uint32_t to_scan, ScanBuffer *result);
+
+  // Run the next step; true once the operation is done
+  bool Step();
+  inline bool IsDone() { return phase == kDone; }
+  inline ReturnCode GetResult() { return rc; }
+  // What Read found
+  inline uint64_t GetPayload() { return payload; }
+  // Steps the last operation took
+  inline uint32_t GetSteps() { return steps; }
+
+ private:
+  enum Kind { kRead, kInsert, kScan };
+  enum Phase { kRoot, kDescend, kDone };
+  void Start(Kind kind, const char *key, uint16_t key_size);
+  // The leaf's part of the operation, true if done
+  bool AtLeaf(LeafNode *leaf);
+
+  BzTree *tree;
+  Session *session;
+  Stack stack;
+  Kind kind;
+  Phase phase;
   const char *key;
-  uint16_t size;
+  uint32_t key_size;
+  uint64_t payload;
+  ReturnCode rc;
+  BaseNode *node;
+  bool prefetched;
+  uint32_t steps;
+  // Retries of an insert that found its leaf frozen, see SplitOrConsolidate
+  uint32_t yields;
+  uint64_t freeze_retry;
+  // A scan goes on from [key] (the upper bound of the last leaf), exclusive
+  // once past the first leaf
+  bool include_key;
+  uint32_t to_scan;
+  ScanBuffer *result;
+};
+
+class SnapshotIterator;
+
+// A read-only view of a BzTree as of the time it was opened (see
+// BzTree::NewSnapshot), for long reads and scans that have to see one state
+// of the tree without holding up writers. Records aren't versioned in the
+// tree itself. Instead, while snapshots are open, each write saves the
+// version of the record it's about to change in every one of them, before
+// its PMwCAS (see VersionWriter): the payload, or that there was no record.
+// A saved version stays pending until the PMwCAS succeeds (applied) or
+// fails (discarded), and only the first applied version of a key counts, so
+// a snapshot stops saving versions of a key once it has one. A read takes
+// that version if there's one and the tree's current record otherwise,
+// after reading it; a scan also goes through keys that have versions but
+// are no longer in the tree. Reads wait for a pending version, that is, for
+// a write that's between saving it and issuing its PMwCAS.
+//
+// Versions are volatile and stay around until the snapshot is destroyed,
+// which waits for writers that might still be saving to it to leave their
+// epoch. A snapshot costs writers a lookup per record changed while it's
+// open, and memory for one version per changed key.
+class Snapshot {
+ public:
+  ~Snapshot();
+
+  // Read the payload of [key] as of the snapshot, like BzTree::Read
+  ReturnCode Read(const char *key, uint16_t key_size, uint64_t *payload);
+  ReturnCode Read(const char *key, uint16_t key_size, char *payload, uint32_t *payload_size);
+
+  // Iterate over keys between [lo] and [hi] as of the snapshot, each bound
+  // inclusive or exclusive, in ascending order; a null [hi] means no upper
+  // bound
+  std::unique_ptr<SnapshotIterator> RangeScanByKey(const char *lo, uint16_t lo_size,
+                                                   bool lo_inclusive,
+                                                   const char *hi, uint16_t hi_size,
+                                                   bool hi_inclusive);
+
+  // Versions saved so far, applied or not
+  uint64_t GetVersionCount();
+
+ private:
+  friend class BzTree;
+  friend class VersionWriter;
+  friend class SnapshotIterator;
+  struct Version {
+    static const uint32_t kPending = 0;
+    static const uint32_t kApplied = 1;
+    static const uint32_t kDiscarded = 2;
+    std::atomic<uint32_t> state;
+    // Whether there was a record, and its payload if so
+    bool exists;
+    bool var_payload;
+    std::string payload;
+    // The next version saved for the same key
+    Version *next;
+  };
+
+  explicit Snapshot(BzTree *tree) : tree(tree), version_count(0) {}
+  // Save a pending version of [key] unless there's an applied one already
+  Version *AddVersion(const char *key, uint32_t key_size, const char *payload,
+                      uint32_t payload_size, bool var_payload);
+  // The first applied version of [key], after waiting for pending ones before
+  // it; null if the key's record hasn't changed since the snapshot was opened
+  Version *GetVersion(const char *key, uint32_t key_size);
+  // Keys that have versions, between [lo] and [hi] (null: no upper bound)
+  void GetVersionKeys(const std::string &lo, bool lo_inclusive, const std::string *hi,
+                      bool hi_inclusive, std::vector<std::string> *keys);
+  static Record *NewRecord(const std::string &key, Version *version);
+
+  BzTree *tree;
+  std::mutex latch;
+  // The first version saved for each key, the others chained through next
+  std::map<std::string, Version *> versions;
+  uint64_t version_count;
+};
+
+// Merges the tree's current records, through an Iterator, with the versions
+// a Snapshot kept of the keys in range
+class SnapshotIterator {
+ public:
+  SnapshotIterator(Snapshot *snapshot, const char *lo, uint16_t lo_size, bool lo_inclusive,
+                   const char *hi, uint16_t hi_size, bool hi_inclusive);
+  ~SnapshotIterator() = default;
+
+  std::unique_ptr<Record> GetNext();
+
+ private:
+  Snapshot *snapshot;
+  std::unique_ptr<Iterator> current;
+  // The tree's next record in range, handed out after the keys before it
+  // that only have versions, [version_keys] from [version_index] on
+  std::unique_ptr<Record> next;
+  std::vector<std::string> version_keys;
+  uint32_t version_index;
+  // Keys up to here have been looked up among the versions
+  std::string from;
+  bool from_inclusive;
+  std::string end_key;
+  bool has_end;
+  bool end_inclusive;
+  bool exhausted;
+};
+
+// Saves versions for the snapshots open on a tree on behalf of one write:
+// Save the version of each record right before the PMwCAS that changes it,
+// then Finish with whether the PMwCAS succeeded. Set up under the write's
+// epoch, which NewSnapshot waits for if this missed the snapshot. Leaf
+// methods take Get(), null if there's no snapshot to save versions for.
+class VersionWriter {
+ public:
+  explicit VersionWriter(BzTree *tree);
+  VersionWriter() : count(0) {}
+
+  inline VersionWriter *Get() { return count ? this : nullptr; }
+
+  // A null [payload] means there is no record of [key]
+  void Save(const char *key, uint32_t key_size, const char *payload, uint32_t payload_size,
+            bool var_payload);
+  // The record [meta] refers to in [node] (none if [meta] is vacant); [key]
+  // comes without the node's prefix
+  void Save(BaseNode *node, const char *key, uint32_t key_size, RecordMetadata meta);
+  // The records of [node] with keys in [[lo], [hi]), a null bound meaning
+  // unbounded
+  void Save(LeafNode *node, const char *lo, uint32_t lo_size, const char *hi, uint32_t hi_size);
+  // The PMwCAS the saved versions were for is done
+  void Finish(bool applied);
+
+ private:
+  Snapshot *snapshots[BzTree::kMaxSnapshots];
+  uint32_t count;
+  std::vector<Snapshot::Version *> saved;
+};
+
+// A typed front end to a BzTree whose keys all follow [KeyPolicy]: keys are
+// taken as KeyPolicy::KeyType and encoded for the tree, and lookups search
+// internal and leaf nodes with the policy's comparisons. For U64KeyPolicy
+// that means integer compares and a branchless search of internal nodes
+// instead of the generic byte-string path. Writes go through the generic
+// BzTree code, which orders the encoded keys the same way. The BzTree is not
+// owned, and it can be used directly as long as its keys follow the policy.
+template <class KeyPolicy = VarKeyPolicy>
+class BzTreeT {
+ public:
+  typedef typename KeyPolicy::KeyType KeyType;
+
+  explicit BzTreeT(BzTree *tree) : tree(tree) {}
+
+  inline ReturnCode Insert(const KeyType &key, uint64_t payload) {
+    auto k = KeyPolicy::Encode(key);
+    return tree->Insert(KeyPolicy::GetData(k), KeyPolicy::GetSize(k), payload);
+  }
+
+  inline ReturnCode Read(const KeyType &key, uint64_t *payload) {
+    auto k = KeyPolicy::Encode(key);
+    EpochScope guard(tree->GetPMWCASPool()->GetEpoch());
+    LeafNode *node = tree->template TraverseToLeaf<KeyPolicy>(nullptr, KeyPolicy::GetData(k),
+                                                              KeyPolicy::GetSize(k));
+    auto rc = node->template Read<KeyPolicy>(KeyPolicy::GetData(k), KeyPolicy::GetSize(k),
+                                             payload, tree->GetPMWCASPool());
+    if (rc.IsNotFound() && tree->parameters.duplicate_keys) {
+      // The key's records might go on in later leaves
+      rc = tree->Read(KeyPolicy::GetData(k), KeyPolicy::GetSize(k), payload);
+    }
+    return rc;
+  }
+
+  inline ReturnCode Update(const KeyType &key, uint64_t payload) {
+    auto k = KeyPolicy::Encode(key);
+    return tree->Update(KeyPolicy::GetData(k), KeyPolicy::GetSize(k), payload);
+  }
+
+  inline ReturnCode Upsert(const KeyType &key, uint64_t payload) {
+    auto k = KeyPolicy::Encode(key);
+    return tree->Upsert(KeyPolicy::GetData(k), KeyPolicy::GetSize(k), payload);
+  }
+
+  inline ReturnCode Delete(const KeyType &key) {
+    auto k = KeyPolicy::Encode(key);
+    return tree->Delete(KeyPolicy::GetData(k), KeyPolicy::GetSize(k));
+  }
+
+  inline ReturnCode DeleteRange(const KeyType &lo, const KeyType &hi) {
+    auto l = KeyPolicy::Encode(lo);
+    auto h = KeyPolicy::Encode(hi);
+    return tree->DeleteRange(KeyPolicy::GetData(l), KeyPolicy::GetSize(l),
+                             KeyPolicy::GetData(h), KeyPolicy::GetSize(h));
+  }
+
+  inline ReturnCode CompareAndSwap(const KeyType &key, uint64_t *expected, uint64_t desired) {
+    auto k = KeyPolicy::Encode(key);
+    return tree->CompareAndSwap(KeyPolicy::GetData(k), KeyPolicy::GetSize(k), expected, desired);
+  }
+
+  inline ReturnCode FetchAdd(const KeyType &key, uint64_t delta, uint64_t *old_payload = nullptr) {
+    auto k = KeyPolicy::Encode(key);
+    return tree->FetchAdd(KeyPolicy::GetData(k), KeyPolicy::GetSize(k), delta, old_payload);
+  }
+
+  // Records with keys between [lo] and [hi]; KeyPolicy::Decode turns the keys
+  // of the records returned back into KeyType
+  inline std::unique_ptr<Iterator> RangeScanByKey(const KeyType &lo, bool lo_inclusive,
+                                                  const KeyType &hi, bool hi_inclusive) {
+    auto l = KeyPolicy::Encode(lo);
+    auto h = KeyPolicy::Encode(hi);
+    return tree->RangeScanByKey(KeyPolicy::GetData(l), KeyPolicy::GetSize(l), lo_inclusive,
+                                KeyPolicy::GetData(h), KeyPolicy::GetSize(h), hi_inclusive);
+  }
+
+  inline BzTree *GetTree() { return tree; }
+
+ private:
+  BzTree *tree;
+};
+
+// A fixed-size table of named trees sharing one PMwCAS descriptor pool (and
+// allocator), e.g., a primary index and its secondary indexes in one PMDK
+// pool. Under PMDK the catalog lives at the pool root in place of a single
+// BzTree, and it's all that needs to be found again after a restart. Each
+// tree is created with its entry by one PMwCAS, so a crash leaves either no
+// tree or a complete one. Create, Open and Drop serialize on a volatile
+// latch; the trees are used concurrently as usual.
+class TreeCatalog {
+ public:
+  static const uint32_t kMaxTrees = 64;
+  static const uint32_t kMaxNameSize = 48;
+
+  TreeCatalog(pmwcas::DescriptorPool *pool, uint64_t pmdk_addr = 0);
+  // Frees the volatile state of the trees, like ~BzTree does
+  ~TreeCatalog();
+
+  inline static TreeCatalog *New(pmwcas::DescriptorPool *pool) {
+    TreeCatalog *catalog;
+    pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(&catalog), sizeof(TreeCatalog));
+    new(catalog) TreeCatalog(pool);
+    return catalog;
+  }
+
+#ifdef PMEM
+  // Recover the descriptor pool once, then every tree, all in one new epoch
+  BzTree::RecoveryTimes Recovery();
+#endif
+
+  // Create an empty tree named [name] in [*tree]; KeyExists if there is one
+  // already, NotEnoughSpace if the name is longer than kMaxNameSize or the
+  // catalog is full
+  ReturnCode Create(const char *name, const BzTree::ParameterSet &param, BzTree **tree);
+  // The tree named [name], nullptr if there's none
+  BzTree *Open(const char *name);
+  // Remove the tree named [name] and free all its nodes; no other thread may
+  // be using it. NotFound if there's no such tree.
+  ReturnCode Drop(const char *name);
+  // Names of all trees, in no particular order
+  void List(std::vector<std::string> *names);
+
+  inline pmwcas::DescriptorPool *GetPMWCASPool() {
+#ifdef PMDK
+    return Allocator::Get()->GetDirect(pmwcas_pool);
+#else
+    return pmwcas_pool;
+#endif
+  }
+
+ private:
+  struct Entry {
+    char name[kMaxNameSize];
+    uint32_t name_size;
+    BzTree tree;
+  };
+
+  // Direct pointer to the entry in [slot], nullptr if it's free
+  Entry *GetEntry(uint32_t slot);
+  // Slot of the tree named [name], kMaxTrees if there's none
+  uint32_t Find(const char *name, uint32_t name_size);
+
+  pmwcas::DescriptorPool *pmwcas_pool;
+  uint64_t pmdk_addr;
+  // Entry pointers (PMDK offsets under PMDK), installed and removed by PMwCAS
+  uint64_t entries[kMaxTrees];
+  // Volatile, re-created upon recovery
+  std::mutex latch;
+};
+
+// Inserts and updates of 8-byte payloads on several trees sharing one
+// descriptor pool (e.g., a primary index and its secondary indexes in a
+// TreeCatalog) that take effect together: either all or none of them are
+// seen, also after a crash. Stage them with Insert and Update, then Commit:
+// records to insert are reserved and filled in their leaves, and one PMwCAS
+// makes them visible and swaps in the new payloads, checking the status word
+// of each leaf involved. That caps the writes at what fits in DESC_CAP words,
+// two per insert and three per update (less if they share leaves). A leaf
+// that needs a split or consolidation gets it from its tree as usual, after
+// which the commit starts over. Not thread-safe; use one per thread.
+class MultiTreeWrite {
+ public:
+  // Stage an insert or update of [key] in [tree]; NotEnoughSpace if it
+  // wouldn't fit in a descriptor with the writes staged so far, KeyExists if
+  // one of them is for the same key and tree. The key is copied.
+  ReturnCode Insert(BzTree *tree, const char *key, uint16_t key_size, uint64_t payload);
+  ReturnCode Update(BzTree *tree, const char *key, uint16_t key_size, uint64_t payload);
+
+  // Apply all staged writes at once. If one of them can't be done (KeyExists
+  // for an insert, NotFound for an update, NotEnoughSpace for an update of a
+  // variable-length payload) none is, and that code is returned with the
+  // index of the write in [*failed]. The staged writes are kept either way.
+  ReturnCode Commit(uint32_t *failed = nullptr);
+
+  inline void Clear() {
+    writes.clear();
+    words = 0;
+  }
+  inline uint32_t GetCount() { return writes.size(); }
+
+ private:
+  struct Write {
+    BzTree *tree;
+    std::string key;
+    uint64_t payload;
+    bool insert;
+  };
+  ReturnCode Add(BzTree *tree, const char *key, uint16_t key_size, uint64_t payload,
+                 bool insert);
+
+  std::vector<Write> writes;
+  // Descriptor words the staged writes take at most
+  uint32_t words = 0;
+};
+
+class PartitionedIterator;
+
+// A front end that spreads the records of one index over several BzTrees
+// (partitions), so that writes to different partitions meet neither on one
+// root word nor on the same leaves. With range partitioning, partition i holds
+// the keys from split key i - 1 (inclusive) up to split key i, and a scan
+// goes through the partitions in key order. With hash partitioning, a hash of
+// the key picks the partition, which spreads sequential keys (whose inserts
+// would otherwise all go to the rightmost leaf) evenly over all of them; a
+// scan then merges the records of every partition by key. The trees are not
+// owned and may share a descriptor pool, e.g., those of a TreeCatalog, which
+// finds them again after a restart (the split keys are up to the caller).
+class PartitionedTree {
+ public:
+  // Hash partitioning over [trees]
+  explicit PartitionedTree(const std::vector<BzTree *> &trees);
+  // Range partitioning over [trees], with one split key less than there are
+  // trees, in ascending order
+  PartitionedTree(const std::vector<BzTree *> &trees, const std::vector<std::string> &split_keys);
+
+  // Index of the partition that holds [key]
+  uint32_t GetPartition(const char *key, uint16_t key_size);
+  inline uint32_t GetPartitionCount() { return static_cast<uint32_t>(trees.size()); }
+  inline BzTree *GetTree(uint32_t partition) { return trees[partition]; }
+  inline bool IsHashed() { return hashed; }
+
+  inline ReturnCode Insert(const char *key, uint16_t key_size, uint64_t payload) {
+    return GetTreeFor(key, key_size)->Insert(key, key_size, payload);
+  }
+  inline ReturnCode Read(const char *key, uint16_t key_size, uint64_t *payload) {
+    return GetTreeFor(key, key_size)->Read(key, key_size, payload);
+  }
+  inline ReturnCode Update(const char *key, uint16_t key_size, uint64_t payload) {
+    return GetTreeFor(key, key_size)->Update(key, key_size, payload);
+  }
+  inline ReturnCode Upsert(const char *key, uint16_t key_size, uint64_t payload) {
+    return GetTreeFor(key, key_size)->Upsert(key, key_size, payload);
+  }
+  inline ReturnCode Delete(const char *key, uint16_t key_size) {
+    return GetTreeFor(key, key_size)->Delete(key, key_size);
+  }
+  inline ReturnCode CompareAndSwap(const char *key, uint16_t key_size, uint64_t *expected,
+                                   uint64_t desired) {
+    return GetTreeFor(key, key_size)->CompareAndSwap(key, key_size, expected, desired);
+  }
+  inline ReturnCode FetchAdd(const char *key, uint16_t key_size, uint64_t delta,
+                             uint64_t *old_payload = nullptr) {
+    return GetTreeFor(key, key_size)->FetchAdd(key, key_size, delta, old_payload);
+  }
+  inline ReturnCode Insert(const char *key, uint16_t key_size, const char *payload,
+                           uint32_t payload_size) {
+    return GetTreeFor(key, key_size)->Insert(key, key_size, payload, payload_size);
+  }
+  inline ReturnCode Read(const char *key, uint16_t key_size, char *payload,
+                         uint32_t *payload_size) {
+    return GetTreeFor(key, key_size)->Read(key, key_size, payload, payload_size);
+  }
+  inline ReturnCode Update(const char *key, uint16_t key_size, const char *payload,
+                           uint32_t payload_size) {
+    return GetTreeFor(key, key_size)->Update(key, key_size, payload, payload_size);
+  }
+  inline ReturnCode Upsert(const char *key, uint16_t key_size, const char *payload,
+                           uint32_t payload_size) {
+    return GetTreeFor(key, key_size)->Upsert(key, key_size, payload, payload_size);
+  }
+
+  // BzTree::DeleteRange on each partition that can hold keys in [[lo], [hi]);
+  // the first failure is returned after all of them are done
+  ReturnCode DeleteRange(const char *lo, uint16_t lo_size, const char *hi, uint16_t hi_size);
+
+  // Records with keys between [lo] and [hi] from all partitions, like
+  // BzTree::RangeScanByKey and ReverseRangeScanByKey
+  std::unique_ptr<PartitionedIterator> RangeScanByKey(
+      const char *lo, uint16_t lo_size, bool lo_inclusive,
+      const char *hi, uint16_t hi_size, bool hi_inclusive,
+      uint32_t scan_size = std::numeric_limits<uint32_t>::max(), bool reverse = false);
+  inline std::unique_ptr<PartitionedIterator> RangeScanBySize(const char *key, uint16_t key_size,
+                                                              uint32_t scan_size) {
+    return RangeScanByKey(key, key_size, true, nullptr, 0, false, scan_size);
+  }
+
+ private:
+  inline BzTree *GetTreeFor(const char *key, uint16_t key_size) {
+    return trees[GetPartition(key, key_size)];
+  }
+
+  std::vector<BzTree *> trees;
+  std::vector<std::string> split_keys;
+  bool hashed;
+};
+
+// Scan over the partitions of a PartitionedTree. A range-partitioned one has
+// an Iterator open on one partition at a time, in key order; a hash-
+// partitioned one keeps an Iterator and its next record for each partition
+// and hands out the smallest (largest, for reverse scans) of them.
+class PartitionedIterator {
+ public:
+  PartitionedIterator(PartitionedTree *tree, const char *lo, uint16_t lo_size, bool lo_inclusive,
+                      const char *hi, uint16_t hi_size, bool hi_inclusive, uint32_t scan_size,
+                      bool reverse);
+  ~PartitionedIterator() = default;
+
+  std::unique_ptr<Record> GetNext();
+
+ private:
+  std::unique_ptr<Iterator> NewIterator(uint32_t partition);
+
+  PartitionedTree *tree;
+  std::string lo;
+  bool has_lo;
+  bool lo_inclusive;
+  std::string hi;
+  bool has_hi;
+  bool hi_inclusive;
   uint32_t remaining_size;
+  bool reverse;
+  // Range partitioning: the partition being scanned and the last one to scan
+  uint32_t partition;
+  uint32_t last_partition;
+  std::vector<std::unique_ptr<Iterator>> iters;
+  // Hash partitioning: the next record of each partition
+  std::vector<std::unique_ptr<Record>> heads;
+};
+
+// A DRAM buffer in front of a tree that absorbs writes of 8-byte payloads,
+// so that a key written over and over reaches the leaves once per flush
+// rather than once per write, two PMwCASes and the flushes of a record each.
+// Keys are spread over kShards shards by hash, each a sorted map under a
+// mutex; reads look at the buffer before the tree. Once a shard holds
+// [flush_records] keys, the write that took it there merges them into the
+// tree: new keys with BzTree::InsertBatch, the others with Upsert or Delete.
+// Until they're in, the shard keeps serving reads of those keys from a second
+// map, and takes new writes meanwhile.
+//
+// With a [log_path], each write is appended to a log file of its shard
+// before it's applied, and a flush moves the shard on to its other log file,
+// emptying the old one once its keys are in the tree. Opening a buffer with
+// logs left over replays them into the tree. Appends survive the process
+// going down, and with [sync] the machine too: each is followed by an
+// fdatasync (otherwise only those before a Sync are).
+//
+// Only point operations go through the buffer; scans, Count and the like
+// see the tree, so Flush first. Records too big for a leaf go straight to
+// the tree. The tree is not owned, and is flushed to when the buffer is
+// destroyed.
+class WriteBuffer {
+ public:
+  static const uint32_t kShards = 16;
+
+  // IOError if the logs can't be opened, written or replayed
+  static ReturnCode Open(BzTree *tree, uint32_t flush_records, const char *log_path, bool sync,
+                         std::unique_ptr<WriteBuffer> *buffer);
+  ~WriteBuffer();
+
+  // Same results as the BzTree operations, or IOError if the log append
+  // failed, in which case nothing changed
+  ReturnCode Insert(const char *key, uint16_t key_size, uint64_t payload);
+  ReturnCode Read(const char *key, uint16_t key_size, uint64_t *payload);
+  ReturnCode Update(const char *key, uint16_t key_size, uint64_t payload);
+  ReturnCode Upsert(const char *key, uint16_t key_size, uint64_t payload);
+  ReturnCode Delete(const char *key, uint16_t key_size);
+
+  // Merge the keys of every shard into the tree. Keys that fail to go in
+  // stay in the buffer (and their log) for the next flush to retry.
+  ReturnCode Flush();
+  // Make the appends so far durable
+  ReturnCode Sync();
+
+  struct Stats {
+    // Writes to a key still in the buffer, which never reached the tree
+    uint64_t absorbed;
+    // Records merged into the tree, and the flushes that did it
+    uint64_t flushed;
+    uint64_t flushes;
+  };
+  Stats GetStats();
+
+ private:
+  struct Entry {
+    uint64_t payload;
+    bool deleted;
+  };
+  enum LogOp : uint8_t { kLogPut = 1, kLogDelete = 2 };
+  // A log file starts with its header and is followed by records, each the
+  // key right after a LogRecord; [check] is a hash of the rest of the record,
+  // so that a torn append ends the replay
+  struct LogHeader {
+    static const uint64_t kMagic = 0x31304c4257425a42;  // "BZWBL01"
+    uint64_t magic;
+    // The file written to later has the larger one
+    uint64_t sequence;
+  };
+  struct LogRecord {
+    uint32_t check;
+    uint16_t key_size;
+    uint8_t op;
+    uint8_t unused;
+    uint64_t payload;
+  };
+  struct Shard {
+    std::mutex mutex;
+    // Writes not in the tree yet, and those being merged into it
+    std::map<std::string, Entry> entries;
+    std::map<std::string, Entry> flushing;
+    // Held by the one flush of the shard at a time
+    std::mutex flush_mutex;
+    // The log file being appended to, out of two, its sequence number and
+    // where the next record goes
+    int log_fds[2];
+    uint32_t log;
+    uint64_t sequence;
+    uint64_t log_size;
+    // Keys a failed flush put back into [entries] couldn't be logged again
+    bool relog;
+    Shard() : log_fds{-1, -1}, log(0), sequence(0), log_size(0), relog(false) {}
+  };
+
+  WriteBuffer(BzTree *tree, uint32_t flush_records, bool sync)
+      : tree(tree), flush_records(flush_records), sync(sync), logging(false), absorbed(0),
+        flushed(0), flushes(0) {}
+  inline Shard &GetShard(const char *key, uint16_t key_size) {
+    return shards[(BaseNode::KeyHash(key, key_size) >> 32) % kShards];
+  }
+  inline bool Bypasses(uint16_t key_size) {
+    return key_size + sizeof(uint64_t) > tree->GetMaxRecordSize();
+  }
+  // The buffered entry of [key], nullptr if it's not in the buffer; the
+  // caller holds the shard's mutex
+  Entry *Find(Shard &shard, const std::string &key);
+  // Whether [key] has a record, in the buffer or else in the tree
+  bool Exists(Shard &shard, const std::string &key);
+  // Log and buffer a write to [key], with the shard's mutex held, and flush
+  // the shard if that took it to [flush_records] keys; unlocks [lock]
+  ReturnCode Put(Shard &shard, std::unique_lock<std::mutex> *lock, std::string &&key,
+                 uint64_t payload, bool deleted);
+  bool AppendLog(Shard &shard, const std::string &key, uint64_t payload, bool deleted);
+  // Start appending to the other log file of [shard], emptied and given the
+  // next sequence number
+  bool SwitchLog(Shard &shard);
+  // Merge the shard's keys into the tree, unless [wait] is false and another
+  // flush of it is running
+  ReturnCode FlushShard(Shard &shard, bool wait);
+  // Open both log files of [shard] and apply what's in them to the tree
+  bool RecoverShard(uint32_t index, const std::string &log_path);
+
   BzTree *tree;
-  LeafNode *node;
-  std::list<std::unique_ptr<Record>> item_vec;
+  uint32_t flush_records;
+  bool sync;
+  bool logging;
+  Shard shards[kShards];
+  std::atomic<uint64_t> absorbed;
+  std::atomic<uint64_t> flushed;
+  std::atomic<uint64_t> flushes;
+};
+
+// The records of a tree written out by BzTree::Export, for backups and for
+// loading other trees: a header followed by the records in key order, laid
+// out as in a ScanBuffer (metadata, padded key, payload), each with its key
+// right after its metadata. So a file can be mapped and its records used in
+// place, see ExportImage.
+//
+// Export copies one leaf's worth of records at a time, each under an epoch
+// of its own (Iterator::GetNextBatch), so it neither holds up reclamation
+// nor allocates per record. It's not a snapshot of the tree: a record that
+// changes meanwhile is in the file with either its old or its new value.
+// Each sync is followed by an update of the header to what it covers, and
+// an export that was cut short resumes after the last record synced, from
+// wherever in the tree that record is now.
+struct ExportHeader {
+  static const uint64_t kMagic = 0x31305850455a42;  // "BZEXP01"
+  uint64_t magic;
+  // Set once all records are in
+  uint64_t complete;
+  uint64_t record_count;
+  // Records with a variable-length payload, which BulkLoad doesn't take
+  uint64_t var_payload_count;
+  // Bytes of records, and where the last one starts, both from the end of
+  // the header
+  uint64_t data_size;
+  uint64_t last_record;
+};
+
+// A complete export mapped read-only
+class ExportImage {
+ public:
+  // Null if [path] can't be mapped or doesn't hold a complete export
+  static std::unique_ptr<ExportImage> Open(const char *path);
+  ~ExportImage();
+
+  inline uint64_t GetRecordCount() { return header->record_count; }
+  // Iterate with: for (auto *r = image->First(); r; r = image->Next(r))
+  inline Record *First() {
+    return header->record_count ? reinterpret_cast<Record *>(data) : nullptr;
+  }
+  inline Record *Next(Record *r) {
+    char *next = reinterpret_cast<char *>(r) + Record::GetSize(r->meta);
+    return next < data + header->data_size ? reinterpret_cast<Record *>(next) : nullptr;
+  }
+
+  // Load the records into [tree], which has to be empty: with BulkLoad if
+  // they all have 8-byte payloads, otherwise one Insert at a time
+  ReturnCode Load(BzTree *tree, float fill_factor = 0.8);
+
+ private:
+  ExportImage(void *map, uint64_t map_size)
+      : map(map), map_size(map_size), header(reinterpret_cast<ExportHeader *>(map)),
+        data(reinterpret_cast<char *>(map) + sizeof(ExportHeader)) {}
+
+  void *map;
+  uint64_t map_size;
+  ExportHeader *header;
+  char *data;
+};
+
+// A read-only tree in a file, written by FrozenTree::Write from a BzTree
+// that is built once and then only read: fully sorted leaves packed back to
+// back, then the internal levels above them, whose child pointers are
+// offsets into the image instead of addresses (as they are PMDK offsets
+// under PMDK). The nodes are plain LeafNodes and InternalNodes, so the image
+// is queried in place, through mmap, by the same search code as the tree,
+// but without a DescriptorPool, epochs or PMwCAS: nothing in it changes.
+// Opening one only maps it and checks the header.
+struct FrozenTreeHeader {
+  static const uint64_t kMagic = 0x31305a52465a42;  // "BZFRZ01"
+  // Nodes start at multiples of this many bytes from the start of the image
+  static const uint32_t kAlignment = 64;
+  uint64_t magic;
+  uint64_t record_count;
+  // Leaves start at kAlignment, each [leaf_size] bytes
+  uint64_t leaf_count;
+  uint32_t leaf_size;
+  // Levels of internal nodes
+  uint32_t height;
+  // Offset of the root node, and bytes in the image
+  uint64_t root;
+  uint64_t size;
+};
+
+class FrozenTree {
+ public:
+  // Write the records of [tree] to a new image at [path]; the tree can be
+  // changed meanwhile, but the image might miss some of the changes. Leaves
+  // are as large as the tree's and filled up. Returns IOError if the file
+  // can't be written.
+  static ReturnCode Write(BzTree *tree, const char *path);
+  // Null if [path] can't be mapped or isn't a complete image
+  static std::unique_ptr<FrozenTree> Open(const char *path);
+  ~FrozenTree();
+
+  // As with BzTree::Read
+  ReturnCode Read(const char *key, uint16_t key_size, uint64_t *payload);
+  ReturnCode Read(const char *key, uint16_t key_size, char *payload, uint32_t *payload_size);
+
+  // Copy (at most [to_scan]) records with keys between [lo] and [hi] to
+  // [result], which is cleared first, in key order; each bound is inclusive
+  // or exclusive, a null bound means unbounded. NotEnoughSpace means
+  // [result] is a caller-provided buffer that filled up.
+  ReturnCode RangeScanByKey(const char *lo, uint16_t lo_size, bool lo_inclusive,
+                            const char *hi, uint16_t hi_size, bool hi_inclusive,
+                            uint32_t to_scan, ScanBuffer *result);
+  // Up to [to_scan] records with keys from [key] on, see BzTree
+  inline ReturnCode RangeScanBySize(const char *key, uint16_t key_size, uint32_t to_scan,
+                                    ScanBuffer *result) {
+    return RangeScanByKey(key, key_size, true, nullptr, 0, false, to_scan, result);
+  }
+
+  inline uint64_t GetRecordCount() { return header->record_count; }
+  inline uint32_t GetHeight() { return header->height; }
+
+ private:
+  FrozenTree(void *map, uint64_t map_size)
+      : map(map), map_size(map_size), header(reinterpret_cast<FrozenTreeHeader *>(map)) {}
+
+  inline BaseNode *GetNode(uint64_t offset) {
+    return reinterpret_cast<BaseNode *>(reinterpret_cast<char *>(map) + offset);
+  }
+  inline LeafNode *GetLeaf(uint64_t index) {
+    return reinterpret_cast<LeafNode *>(
+        GetNode(FrozenTreeHeader::kAlignment + index * header->leaf_size));
+  }
+  // Index of the leaf that covers [key]
+  uint64_t FindLeaf(const char *key, uint16_t key_size);
+  // The record of [key] in that leaf, vacant if there is none
+  RecordMetadata Find(const char *key, uint16_t key_size, LeafNode **leaf);
+
+  void *map;
+  uint64_t map_size;
+  FrozenTreeHeader *header;
 };
 
 }  // namespace bztree
@@ -0,0 +1,820 @@
+// Copyright (c) Simon Fraser University. All rights reserved.
+// Licensed under the MIT license.
+//
+// Authors:
+// Xiangpeng Hao <xiangpeng_hao@sfu.ca>
+// Tianzheng Wang <tzwang@sfu.ca>
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../bztree.h"
+
+namespace {
+
+static const uint32_t kKeySize = 16;
+// Most threads any benchmark runs with, one descriptor partition each
+static const uint32_t kMaxThreads = 8;
+
+pmwcas::DescriptorPool *GetPool() {
+  static pmwcas::DescriptorPool *pool = [] {
+    pmwcas::InitLibrary(pmwcas::DefaultAllocator::Create,
+                        pmwcas::DefaultAllocator::Destroy,
+                        pmwcas::LinuxEnvironment::Create,
+                        pmwcas::LinuxEnvironment::Destroy);
+    return new pmwcas::DescriptorPool(100000, kMaxThreads, false);
+  }();
+  return pool;
+}
+
+// Fixed-size, zero-padded decimal keys so that they sort numerically
+std::string MakeKey(uint32_t i) {
+  std::string key = std::to_string(i);
+  return std::string(kKeySize - key.size(), '0') + key;
+}
+
+// Fill a leaf of [node_size] bytes with as many 16-byte keys as it takes. If
+// [sorted] is set, consolidate the leaf so all records are in the sorted field.
+bztree::LeafNode *BuildLeaf(uint32_t node_size, bool sorted, std::vector<std::string> *keys) {
+  auto *pool = GetPool();
+  bztree::LeafNode *node = nullptr;
+  bztree::LeafNode::New(&node, node_size);
+  for (uint32_t i = 0;; ++i) {
+    auto key = MakeKey(i);
+    if (!node->Insert(key.c_str(), kKeySize, i, pool, node_size).IsOk()) {
+      break;
+    }
+    keys->emplace_back(key);
+  }
+  if (sorted) {
+    node = node->Consolidate(pool);
+  }
+  return node;
+}
+
+void PointLookup(benchmark::State &state, bool sorted) {
+  auto *pool = GetPool();
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  std::vector<std::string> keys;
+  auto *node = BuildLeaf(static_cast<uint32_t>(state.range(0)), sorted, &keys);
+
+  std::mt19937 rng(42);
+  std::shuffle(keys.begin(), keys.end(), rng);
+  uint32_t i = 0;
+  uint64_t payload = 0;
+  for (auto _ : state) {
+    auto &key = keys[i++ % keys.size()];
+    benchmark::DoNotOptimize(node->Read(key.c_str(), kKeySize, &payload, pool));
+  }
+  state.counters["records"] = keys.size();
+}
+
+// Records in the sorted field (binary search)
+void BM_LeafReadSorted(benchmark::State &state) { PointLookup(state, true); }
+
+// Records in the unsorted field (linear search), for comparison
+void BM_LeafReadUnsorted(benchmark::State &state) { PointLookup(state, false); }
+
+// A tree of [kTreeKeys] 16-byte keys, shared by the tree-level benchmarks
+static const uint32_t kTreeKeys = 100000;
+bztree::BzTree *GetTree() {
+  static bztree::BzTree *tree = [] {
+    bztree::BzTree::ParameterSet param(3072, 0, 4096);
+    auto *tree = bztree::BzTree::New(param, GetPool());
+    for (uint32_t i = 0; i < kTreeKeys; ++i) {
+      auto key = MakeKey(i);
+      tree->Insert(key.c_str(), kKeySize, i);
+    }
+    return tree;
+  }();
+  return tree;
+}
+
+// Range scans of [state.range(0)] records through the Record-allocating
+// iterator and through a reused ScanBuffer
+void BM_ScanIterator(benchmark::State &state) {
+  auto *tree = GetTree();
+  uint32_t to_scan = static_cast<uint32_t>(state.range(0));
+  uint32_t i = 0;
+  for (auto _ : state) {
+    auto key = MakeKey((i++ * 7919) % (kTreeKeys - to_scan));
+    auto iter = tree->RangeScanBySize(key.c_str(), kKeySize, to_scan);
+    while (auto record = iter->GetNext()) {
+      benchmark::DoNotOptimize(record->GetPayload());
+    }
+  }
+}
+
+void BM_ScanBuffer(benchmark::State &state) {
+  auto *tree = GetTree();
+  uint32_t to_scan = static_cast<uint32_t>(state.range(0));
+  bztree::ScanBuffer buffer;
+  uint32_t i = 0;
+  for (auto _ : state) {
+    auto key = MakeKey((i++ * 7919) % (kTreeKeys - to_scan));
+    tree->RangeScanBySize(key.c_str(), kKeySize, to_scan, &buffer);
+    for (auto *record = buffer.First(); record; record = buffer.Next(record)) {
+      benchmark::DoNotOptimize(record->GetPayload());
+    }
+  }
+}
+
+// Summing the payloads of the whole tree with ParallelScan on
+// [state.range(0)] threads
+void BM_ParallelScan(benchmark::State &state) {
+  auto *tree = GetTree();
+  uint32_t threads = static_cast<uint32_t>(state.range(0));
+  // A cache line per thread
+  std::vector<std::array<uint64_t, 8>> sums(threads);
+  for (auto _ : state) {
+    tree->ParallelScan(threads, [&sums](uint32_t thread, bztree::ScanBuffer *batch) {
+      for (auto *r = batch->First(); r; r = batch->Next(r)) {
+        sums[thread][0] += r->GetPayload();
+      }
+      return true;
+    });
+  }
+  benchmark::DoNotOptimize(sums);
+  state.SetItemsProcessed(state.iterations() * kTreeKeys);
+}
+
+// Count over ranges of [state.range(0)] keys, on the shared tree or, if
+// [state.range(1)] is set, on a copy of it with ParameterSet::record_counts
+void BM_Count(benchmark::State &state) {
+  static bztree::BzTree *counted = [] {
+    bztree::BzTree::ParameterSet param(3072, 0, 4096, 0, false, 0, false, 0, false, false, true);
+    auto *tree = bztree::BzTree::New(param, GetPool());
+    for (uint32_t i = 0; i < kTreeKeys; ++i) {
+      auto key = MakeKey(i);
+      tree->Insert(key.c_str(), kKeySize, i);
+    }
+    return tree;
+  }();
+  auto *tree = state.range(1) ? counted : GetTree();
+  uint32_t span = static_cast<uint32_t>(state.range(0));
+  uint32_t i = 0;
+  uint64_t records = 0;
+  for (auto _ : state) {
+    uint32_t lo = (i++ * 7919) % (kTreeKeys - span);
+    auto lo_key = MakeKey(lo);
+    auto hi_key = MakeKey(lo + span);
+    records += tree->Count(lo_key.c_str(), kKeySize, hi_key.c_str(), kKeySize);
+  }
+  state.counters["error"] = static_cast<double>(records) / (state.iterations() * span) - 1;
+}
+
+// [state.range(0)] random lookups, one Read at a time or one MultiRead
+std::vector<std::string> RandomKeys(uint32_t count, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < count; ++i) {
+    keys.emplace_back(MakeKey(rng() % kTreeKeys));
+  }
+  return keys;
+}
+
+void BM_Read(benchmark::State &state) {
+  auto *tree = GetTree();
+  uint32_t batch = static_cast<uint32_t>(state.range(0));
+  uint32_t seed = 0;
+  uint64_t payload = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto keys = RandomKeys(batch, seed++);
+    state.ResumeTiming();
+    for (auto &key : keys) {
+      benchmark::DoNotOptimize(tree->Read(key.c_str(), kKeySize, &payload));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+// Same as BM_Read, in one read session per batch
+void BM_ReadSession(benchmark::State &state) {
+  auto *tree = GetTree();
+  uint32_t batch = static_cast<uint32_t>(state.range(0));
+  uint32_t seed = 0;
+  uint64_t payload = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto keys = RandomKeys(batch, seed++);
+    state.ResumeTiming();
+    bztree::ReadSession session(tree);
+    for (auto &key : keys) {
+      benchmark::DoNotOptimize(tree->Read(key.c_str(), kKeySize, &payload));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+// Reads of runs of [state.range(0)] consecutive keys from random places, in
+// one session per run, with finger search off and on ([state.range(1)])
+void BM_ReadClustered(benchmark::State &state) {
+  auto *tree = GetTree();
+  uint32_t run = static_cast<uint32_t>(state.range(0));
+  bool finger_search = state.range(1) != 0;
+  std::mt19937 rng(42);
+  uint64_t payload = 0;
+  uint64_t hits = 0;
+  for (auto _ : state) {
+    uint32_t first = rng() % (kTreeKeys - run);
+    bztree::BzTree::Session session(tree, finger_search);
+    for (uint32_t i = 0; i < run; ++i) {
+      auto key = MakeKey(first + i);
+      benchmark::DoNotOptimize(tree->Read(&session, key.c_str(), kKeySize, &payload));
+    }
+    hits += session.GetFingerHits();
+  }
+  state.SetItemsProcessed(state.iterations() * run);
+  state.counters["finger_hits"] =
+      benchmark::Counter(hits, benchmark::Counter::kAvgIterations);
+}
+
+void BM_MultiRead(benchmark::State &state) {
+  auto *tree = GetTree();
+  uint32_t batch = static_cast<uint32_t>(state.range(0));
+  std::vector<const char *> key_ptrs(batch);
+  std::vector<uint16_t> key_sizes(batch, kKeySize);
+  std::vector<uint64_t> payloads(batch);
+  std::vector<bztree::ReturnCode> rcs(batch);
+  uint32_t seed = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto keys = RandomKeys(batch, seed++);
+    for (uint32_t i = 0; i < batch; ++i) {
+      key_ptrs[i] = keys[i].c_str();
+    }
+    state.ResumeTiming();
+    tree->MultiRead(key_ptrs.data(), key_sizes.data(), batch, payloads.data(), rcs.data());
+    benchmark::DoNotOptimize(rcs.data());
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+// Same as BM_Read, with the batch's reads interleaved a step at a time in
+// groups of [state.range(1)] SteppedOps, see BzTree::SteppedOp
+void BM_ReadStepped(benchmark::State &state) {
+  auto *tree = GetTree();
+  uint32_t batch = static_cast<uint32_t>(state.range(0));
+  uint32_t group = static_cast<uint32_t>(state.range(1));
+  bztree::BzTree::Session session(tree);
+  std::vector<std::unique_ptr<bztree::BzTree::SteppedOp>> ops;
+  for (uint32_t i = 0; i < group; ++i) {
+    ops.emplace_back(new bztree::BzTree::SteppedOp(&session));
+  }
+  uint32_t seed = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto keys = RandomKeys(batch, seed++);
+    session.Refresh();
+    state.ResumeTiming();
+    for (uint32_t i = 0; i < batch; i += group) {
+      uint32_t n = std::min(group, batch - i);
+      for (uint32_t j = 0; j < n; ++j) {
+        ops[j]->Read(keys[i + j].c_str(), kKeySize);
+      }
+      bool done = false;
+      while (!done) {
+        done = true;
+        for (uint32_t j = 0; j < n; ++j) {
+          done &= ops[j]->Step();
+        }
+      }
+      for (uint32_t j = 0; j < n; ++j) {
+        benchmark::DoNotOptimize(ops[j]->GetPayload());
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+// Random lookups prefetching whole nodes on the way down (0) or only their
+// headers and metadata (1), see BzTree::EnableNarrowPrefetch; against PMEM
+// with a PMDK build
+void BM_ReadPrefetch(benchmark::State &state) {
+  auto *tree = GetTree();
+  tree->EnableNarrowPrefetch(state.range(0) != 0);
+  std::mt19937 rng(42);
+  uint64_t payload = 0;
+  for (auto _ : state) {
+    auto key = MakeKey(rng() % kTreeKeys);
+    benchmark::DoNotOptimize(tree->Read(key.c_str(), kKeySize, &payload));
+  }
+  tree->EnableNarrowPrefetch(false);
+}
+
+// Random lookups searching internal nodes themselves (0) or their DRAM
+// copies, laid out for search by key heads (1)
+void BM_ReadNodeCache(benchmark::State &state) {
+  auto *tree = GetTree();
+  tree->EnableInternalNodeCache(state.range(0) != 0);
+  std::mt19937 rng(42);
+  uint64_t payload = 0;
+  for (auto _ : state) {
+    auto key = MakeKey(rng() % kTreeKeys);
+    benchmark::DoNotOptimize(tree->Read(key.c_str(), kKeySize, &payload));
+  }
+  tree->EnableInternalNodeCache(false);
+}
+
+// Random lookups of 8-byte big-endian integer keys, through the generic
+// byte-string path and through BzTreeT<U64KeyPolicy>
+bztree::BzTree *GetU64Tree() {
+  static bztree::BzTree *tree = [] {
+    bztree::BzTree::ParameterSet param(3072, 0, 4096);
+    auto *tree = bztree::BzTree::New(param, GetPool());
+    bztree::BzTreeT<bztree::U64KeyPolicy> typed(tree);
+    for (uint64_t i = 0; i < kTreeKeys; ++i) {
+      typed.Insert(i * 7919, i);
+    }
+    return tree;
+  }();
+  return tree;
+}
+
+void BM_ReadU64Generic(benchmark::State &state) {
+  auto *tree = GetU64Tree();
+  std::mt19937 rng(42);
+  uint64_t payload = 0;
+  for (auto _ : state) {
+    auto key = bztree::U64KeyPolicy::Encode((rng() % kTreeKeys) * 7919);
+    benchmark::DoNotOptimize(tree->Read(bztree::U64KeyPolicy::GetData(key), 8, &payload));
+  }
+}
+
+void BM_ReadU64Policy(benchmark::State &state) {
+  bztree::BzTreeT<bztree::U64KeyPolicy> typed(GetU64Tree());
+  std::mt19937 rng(42);
+  uint64_t payload = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(typed.Read((rng() % kTreeKeys) * 7919, &payload));
+  }
+}
+
+// Same as BM_ReadU64Policy, over a tree whose internal nodes were built
+// without ([state.range(0)] = 0) or with search models
+void BM_ReadU64SearchModel(benchmark::State &state) {
+  static bztree::BzTree *trees[2] = {};
+  auto *&tree = trees[state.range(0)];
+  if (!tree) {
+    bztree::InternalNode::EnableSearchModels(state.range(0) != 0);
+    bztree::BzTree::ParameterSet param(3072, 0, 4096);
+    tree = bztree::BzTree::New(param, GetPool());
+    bztree::BzTreeT<bztree::U64KeyPolicy> typed(tree);
+    for (uint64_t i = 0; i < kTreeKeys; ++i) {
+      typed.Insert(i * 7919, i);
+    }
+    bztree::InternalNode::EnableSearchModels(true);
+  }
+  bztree::BzTreeT<bztree::U64KeyPolicy> typed(tree);
+  std::mt19937 rng(42);
+  uint64_t payload = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(typed.Read((rng() % kTreeKeys) * 7919, &payload));
+  }
+}
+
+// Upserts of random keys out of [state.range(0)], straight into a tree or,
+// if [state.range(1)] is set, through a WriteBuffer (without a log)
+void BM_UpsertHot(benchmark::State &state) {
+  bztree::BzTree::ParameterSet param(3072, 0, 4096);
+  std::unique_ptr<bztree::BzTree> tree(bztree::BzTree::New(param, GetPool()));
+  std::unique_ptr<bztree::WriteBuffer> buffer;
+  if (state.range(1)) {
+    bztree::WriteBuffer::Open(tree.get(), 4096, nullptr, false, &buffer);
+  }
+  uint32_t hot = static_cast<uint32_t>(state.range(0));
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < hot; ++i) {
+    keys.emplace_back(MakeKey(i));
+  }
+  std::mt19937 rng(42);
+  uint64_t i = 0;
+  for (auto _ : state) {
+    auto &key = keys[rng() % hot];
+    if (buffer) {
+      buffer->Upsert(key.c_str(), kKeySize, i++);
+    } else {
+      tree->Upsert(key.c_str(), kKeySize, i++);
+    }
+  }
+  // Records written to the tree per upsert
+  if (buffer) {
+    state.counters["tree_writes"] =
+        static_cast<double>(buffer->GetStats().flushed) / state.iterations();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Upserts of random keys out of 100000 with the change feed off or, if
+// [state.range(0)] is set, on and drained every 1024 upserts
+void BM_UpsertChangeFeed(benchmark::State &state) {
+  bztree::BzTree::ParameterSet param(3072, 0, 4096);
+  std::unique_ptr<bztree::BzTree> tree(bztree::BzTree::New(param, GetPool()));
+  if (state.range(0)) {
+    tree->EnableChangeFeed(4096);
+  }
+  static const uint32_t kKeys = 100000;
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    keys.emplace_back(MakeKey(i));
+  }
+  std::vector<bztree::ChangeFeed::Change> changes;
+  std::mt19937 rng(42);
+  uint64_t i = 0;
+  for (auto _ : state) {
+    tree->Upsert(keys[rng() % kKeys].c_str(), kKeySize, i);
+    if (++i % 1024 == 0 && tree->GetChangeFeed()) {
+      changes.clear();
+      tree->GetChangeFeed()->Drain(&changes);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Building a tree of [state.range(0)] sorted keys with Insert vs BulkLoad
+void BM_LoadInsert(benchmark::State &state) {
+  uint32_t count = static_cast<uint32_t>(state.range(0));
+  for (auto _ : state) {
+    bztree::BzTree::ParameterSet param(3072, 0, 4096);
+    std::unique_ptr<bztree::BzTree> tree(bztree::BzTree::New(param, GetPool()));
+    for (uint32_t i = 0; i < count; ++i) {
+      auto key = MakeKey(i);
+      tree->Insert(key.c_str(), kKeySize, i);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+
+// Same as BM_LoadInsert, through a session with finger search
+void BM_LoadInsertFinger(benchmark::State &state) {
+  uint32_t count = static_cast<uint32_t>(state.range(0));
+  for (auto _ : state) {
+    bztree::BzTree::ParameterSet param(3072, 0, 4096);
+    std::unique_ptr<bztree::BzTree> tree(bztree::BzTree::New(param, GetPool()));
+    bztree::BzTree::Session session(tree.get(), true);
+    for (uint32_t i = 0; i < count; ++i) {
+      auto key = MakeKey(i);
+      tree->Insert(&session, key.c_str(), kKeySize, i);
+      // Let retired nodes go every so often
+      if (i % 1024 == 0) {
+        session.Refresh();
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+
+void BM_LoadBulk(benchmark::State &state) {
+  uint32_t count = static_cast<uint32_t>(state.range(0));
+  for (auto _ : state) {
+    bztree::BzTree::ParameterSet param(3072, 0, 4096);
+    std::unique_ptr<bztree::BzTree> tree(bztree::BzTree::New(param, GetPool()));
+    uint32_t i = 0;
+    std::string key;
+    tree->BulkLoad([&](const char **k, uint16_t *k_size, uint64_t *payload) {
+      if (i == count) {
+        return false;
+      }
+      key = MakeKey(i);
+      *k = key.c_str();
+      *k_size = kKeySize;
+      *payload = i++;
+      return true;
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+
+void BM_LoadBulkParallel(benchmark::State &state) {
+  uint32_t count = 1000000;
+  std::vector<std::string> keys;
+  std::vector<const char *> key_ptrs;
+  std::vector<uint16_t> key_sizes(count, kKeySize);
+  std::vector<uint64_t> payloads(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    keys.emplace_back(MakeKey(i));
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    key_ptrs.emplace_back(keys[i].c_str());
+    payloads[i] = i;
+  }
+  for (auto _ : state) {
+    bztree::BzTree::ParameterSet param(3072, 0, 4096);
+    std::unique_ptr<bztree::BzTree> tree(bztree::BzTree::New(param, GetPool()));
+    tree->BulkLoad(key_ptrs.data(), key_sizes.data(), payloads.data(), count,
+                   static_cast<uint32_t>(state.range(0)));
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+
+// Node-level kernels, parameterized by node size, key size and, where it
+// matters, how full the node is (percent of the records it can take)
+std::string MakeKey(uint32_t i, uint32_t key_size) {
+  std::string key = std::to_string(i);
+  return std::string(key_size - key.size(), '0') + key;
+}
+
+// Build a leaf with [fill] percent of the [key_size]-byte keys it can hold,
+// inserted in random order, consolidated if [sorted] is set
+bztree::LeafNode *BuildLeaf(uint32_t node_size, uint32_t key_size, uint32_t fill, bool sorted,
+                            std::vector<std::string> *keys) {
+  auto *pool = GetPool();
+  bztree::LeafNode *node = nullptr;
+  bztree::LeafNode::New(&node, node_size);
+  uint32_t capacity = 0;
+  for (;; ++capacity) {
+    auto key = MakeKey(capacity, key_size);
+    if (!node->Insert(key.c_str(), key_size, capacity, pool, node_size).IsOk()) {
+      break;
+    }
+  }
+  bztree::NodeAllocator::Free(node);
+
+  std::vector<uint32_t> order(capacity * fill / 100);
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::mt19937 rng(42);
+  std::shuffle(order.begin(), order.end(), rng);
+  bztree::LeafNode::New(&node, node_size);
+  for (auto i : order) {
+    auto key = MakeKey(i, key_size);
+    node->Insert(key.c_str(), key_size, i, pool, node_size);
+    keys->emplace_back(key);
+  }
+  if (sorted) {
+    auto *sorted_node = node->Consolidate(pool);
+    bztree::NodeAllocator::Free(node);
+    node = sorted_node;
+  }
+  return node;
+}
+
+void NodeArgs(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"node", "key", "fill"});
+  for (int64_t node_size : {1024, 4096, 16384}) {
+    for (int64_t key_size : {8, 16, 64}) {
+      for (int64_t fill : {50, 100}) {
+        b->Args({node_size, key_size, fill});
+      }
+    }
+  }
+}
+
+void BM_KeyCompare(benchmark::State &state) {
+  uint32_t key_size = static_cast<uint32_t>(state.range(0));
+  // Keys that differ in the last byte only
+  auto key1 = MakeKey(10, key_size);
+  auto key2 = MakeKey(11, key_size);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        bztree::BaseNode::KeyCompare(key1.data(), key_size, key2.data(), key_size));
+    benchmark::ClobberMemory();
+  }
+}
+
+// Random lookups of existing keys in the sorted field of a leaf
+void BM_SearchRecordMeta(benchmark::State &state) {
+  auto *pool = GetPool();
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  uint32_t key_size = static_cast<uint32_t>(state.range(1));
+  std::vector<std::string> keys;
+  auto *node = BuildLeaf(static_cast<uint32_t>(state.range(0)), key_size,
+                         static_cast<uint32_t>(state.range(2)), true, &keys);
+  std::mt19937 rng(42);
+  std::shuffle(keys.begin(), keys.end(), rng);
+  uint32_t i = 0;
+  bztree::RecordMetadata *meta = nullptr;
+  for (auto _ : state) {
+    auto &key = keys[i++ % keys.size()];
+    benchmark::DoNotOptimize(
+        node->SearchRecordMeta(pool->GetEpoch(), key.c_str(), key_size, &meta));
+  }
+  state.counters["records"] = keys.size();
+  bztree::NodeAllocator::Free(node);
+}
+
+// Random lookups in an internal node of [node] bytes at most, holding the
+// [fill] percent of the separators it can take
+void BM_GetChildIndex(benchmark::State &state) {
+  uint32_t node_size = static_cast<uint32_t>(state.range(0));
+  uint32_t key_size = static_cast<uint32_t>(state.range(1));
+  std::vector<std::string> keys;
+  std::vector<const char *> key_ptrs;
+  std::vector<uint16_t> key_sizes;
+  std::vector<uint64_t> children;
+  for (uint32_t i = 0;; ++i) {
+    keys.emplace_back(MakeKey(i * 2, key_size));
+    key_sizes.emplace_back(key_size);
+    if (bztree::InternalNode::GetNodeSize(key_sizes.data(), key_sizes.size()) > node_size) {
+      keys.pop_back();
+      key_sizes.pop_back();
+      break;
+    }
+  }
+  uint32_t count = std::max<uint32_t>(2, keys.size() * state.range(2) / 100);
+  keys.resize(count);
+  key_sizes.resize(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    key_ptrs.emplace_back(keys[i].c_str());
+    children.emplace_back(i + 1);
+  }
+  bztree::InternalNode *node = nullptr;
+  bztree::InternalNode::New(key_ptrs.data(), key_sizes.data(), children.data(), count, &node);
+
+  // Keys in between the separators, so every level of search is taken
+  std::vector<std::string> lookups;
+  for (uint32_t i = 0; i < count * 2; ++i) {
+    lookups.emplace_back(MakeKey(i, key_size));
+  }
+  std::mt19937 rng(42);
+  std::shuffle(lookups.begin(), lookups.end(), rng);
+  uint32_t i = 0;
+  for (auto _ : state) {
+    auto &key = lookups[i++ % lookups.size()];
+    benchmark::DoNotOptimize(node->GetChildIndex(key.c_str(), key_size));
+  }
+  state.counters["separators"] = count;
+  bztree::NodeAllocator::Free(node);
+}
+
+// Inserts of distinct keys into a leaf of [node] bytes, swapped for an empty
+// one when full (the cost of which is amortized into the inserts). With
+// several threads, all of them insert into the same leaf and contend on its
+// status word, any insert that loses a race being retried; less so once the
+// leaf has [state.range(2)] reservation lanes.
+void BM_LeafInsert(benchmark::State &state) {
+  static std::atomic<bztree::LeafNode *> shared_leaf;
+  static std::mutex full_leaves_mutex;
+  static std::vector<bztree::LeafNode *> full_leaves;
+  auto *pool = GetPool();
+  uint32_t node_size = static_cast<uint32_t>(state.range(0));
+  uint32_t key_size = static_cast<uint32_t>(state.range(1));
+  uint32_t lanes = static_cast<uint32_t>(state.range(2));
+  if (state.thread_index == 0) {
+    bztree::LeafNode *node = nullptr;
+    bztree::LeafNode::New(&node, node_size, false, lanes);
+    shared_leaf = node;
+  }
+  // Each thread takes keys from its own range of what [key_size] can hold
+  uint32_t range = 10000000 / kMaxThreads;
+  uint32_t next = 0;
+  uint64_t retries = 0;
+  for (auto _ : state) {
+    pmwcas::EpochGuard guard(pool->GetEpoch());
+    auto key = MakeKey(state.thread_index * range + next++ % range, key_size);
+    while (true) {
+      auto *node = shared_leaf.load();
+      auto rc = node->Insert(key.c_str(), key_size, next, pool, node_size);
+      if (rc.IsOk() || rc.IsKeyExists()) {
+        break;
+      }
+      ++retries;
+      if (rc.IsNotEnoughSpace() || rc.IsNodeFrozen()) {
+        bztree::LeafNode *empty = nullptr;
+        bztree::LeafNode::New(&empty, node_size, false, lanes);
+        if (shared_leaf.compare_exchange_strong(node, empty)) {
+          std::lock_guard<std::mutex> lock(full_leaves_mutex);
+          full_leaves.emplace_back(node);
+        } else {
+          bztree::NodeAllocator::Free(empty);
+        }
+      }
+    }
+  }
+  state.counters["retries"] = benchmark::Counter(retries, benchmark::Counter::kAvgIterations);
+  if (state.thread_index == 0) {
+    full_leaves.emplace_back(shared_leaf.load());
+    for (auto *node : full_leaves) {
+      bztree::NodeAllocator::Free(node);
+    }
+    full_leaves.clear();
+  }
+}
+
+// Inserts into a tree with the keys of all threads interleaved, so that they
+// mostly go to the same leaf and find each other's records still in flight
+// when checking their keys are unique
+void BM_InsertContended(benchmark::State &state) {
+  static bztree::BzTree *tree;
+  if (state.thread_index == 0) {
+    bztree::BzTree::ParameterSet param(3072, 0, 4096);
+    tree = bztree::BzTree::New(param, GetPool());
+  }
+  uint32_t next = 0;
+  for (auto _ : state) {
+    auto key = MakeKey(next++ * state.threads + state.thread_index);
+    benchmark::DoNotOptimize(tree->Insert(key.c_str(), kKeySize, next));
+  }
+  if (state.thread_index == 0) {
+    auto stats = tree->GetStats();
+    state.counters["unique_waits"] =
+        benchmark::Counter(stats.unique_waits, benchmark::Counter::kAvgIterations);
+    state.counters["pmwcas_failures"] =
+        benchmark::Counter(stats.pmwcas_failures, benchmark::Counter::kAvgIterations);
+    delete tree;
+  }
+}
+
+void InsertArgs(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"node", "key", "lanes"});
+  for (int64_t node_size : {1024, 4096, 16384}) {
+    for (int64_t key_size : {8, 16, 64}) {
+      b->Args({node_size, key_size, 0});
+    }
+  }
+  b->Args({4096, 8, bztree::LeafNode::kMaxLanes});
+  b->Args({16384, 8, bztree::LeafNode::kMaxLanes});
+}
+
+// Run [kernel] on fresh copies of a leaf built with BuildLeaf (not sorted, so
+// that it has records to sort), so each iteration starts from the same node
+template <class Kernel>
+void OnLeafCopies(benchmark::State &state, Kernel kernel) {
+  auto *pool = GetPool();
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  uint32_t node_size = static_cast<uint32_t>(state.range(0));
+  std::vector<std::string> keys;
+  auto *node = BuildLeaf(node_size, static_cast<uint32_t>(state.range(1)),
+                         static_cast<uint32_t>(state.range(2)), false, &keys);
+  bztree::LeafNode *copy = nullptr;
+  bztree::LeafNode::New(&copy, node_size);
+  for (auto _ : state) {
+    state.PauseTiming();
+    memcpy(copy, node, node_size);
+    state.ResumeTiming();
+    kernel(copy);
+  }
+  state.counters["records"] = keys.size();
+  bztree::NodeAllocator::Free(copy);
+  bztree::NodeAllocator::Free(node);
+}
+
+void BM_Consolidate(benchmark::State &state) {
+  auto *pool = GetPool();
+  OnLeafCopies(state, [pool](bztree::LeafNode *node) {
+    bztree::NodeAllocator::Free(node->Consolidate(pool));
+  });
+}
+
+// Splitting a (frozen) root leaf: two new leaves and a new root
+void BM_PrepareForSplit(benchmark::State &state) {
+  auto *pool = GetPool();
+  OnLeafCopies(state, [pool, &state](bztree::LeafNode *node) {
+    state.PauseTiming();
+    node->Freeze(pool);
+    state.ResumeTiming();
+    bztree::Stack stack;
+    bztree::LeafNode *left = nullptr;
+    bztree::LeafNode *right = nullptr;
+    bztree::InternalNode *parent = nullptr;
+    node->PrepareForSplit(stack, 4096, nullptr, pool, &left, &right, &parent, true);
+    bztree::NodeAllocator::Free(left);
+    bztree::NodeAllocator::Free(right);
+    bztree::NodeAllocator::Free(parent);
+  });
+}
+
+}  // namespace
+
+BENCHMARK(BM_KeyCompare)->Arg(8)->Arg(16)->Arg(64);
+BENCHMARK(BM_SearchRecordMeta)->Apply(NodeArgs);
+BENCHMARK(BM_GetChildIndex)->Apply(NodeArgs);
+BENCHMARK(BM_LeafInsert)->Apply(InsertArgs)->ThreadRange(1, kMaxThreads)->UseRealTime();
+BENCHMARK(BM_InsertContended)->ThreadRange(1, kMaxThreads)->UseRealTime();
+BENCHMARK(BM_Consolidate)->Apply(NodeArgs);
+BENCHMARK(BM_PrepareForSplit)->Apply(NodeArgs);
+BENCHMARK(BM_LeafReadSorted)->RangeMultiplier(2)->Range(1024, 16384);
+BENCHMARK(BM_LeafReadUnsorted)->RangeMultiplier(2)->Range(1024, 16384);
+BENCHMARK(BM_ScanIterator)->RangeMultiplier(10)->Range(10, 1000);
+BENCHMARK(BM_ScanBuffer)->RangeMultiplier(10)->Range(10, 1000);
+BENCHMARK(BM_ParallelScan)->RangeMultiplier(2)->Range(1, kMaxThreads)->UseRealTime();
+BENCHMARK(BM_Count)->Args({1000, 0})->Args({1000, 1})->Args({90000, 0})->Args({90000, 1});
+BENCHMARK(BM_Read)->RangeMultiplier(4)->Range(32, 256);
+BENCHMARK(BM_ReadSession)->RangeMultiplier(4)->Range(32, 256);
+BENCHMARK(BM_ReadClustered)->Args({16, 0})->Args({16, 1})->Args({256, 0})->Args({256, 1});
+BENCHMARK(BM_MultiRead)->RangeMultiplier(4)->Range(32, 256);
+BENCHMARK(BM_ReadStepped)->Args({256, 1})->Args({256, 4})->Args({256, 8})->Args({256, 16});
+BENCHMARK(BM_ReadPrefetch)->Arg(0)->Arg(1);
+BENCHMARK(BM_ReadNodeCache)->Arg(0)->Arg(1);
+BENCHMARK(BM_ReadU64Generic);
+BENCHMARK(BM_ReadU64Policy);
+BENCHMARK(BM_ReadU64SearchModel)->Arg(0)->Arg(1);
+BENCHMARK(BM_UpsertHot)->Args({1000, 0})->Args({1000, 1})->Args({100000, 0})->Args({100000, 1});
+BENCHMARK(BM_UpsertChangeFeed)->Arg(0)->Arg(1);
+BENCHMARK(BM_LoadInsert)->Arg(1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoadInsertFinger)->Arg(1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoadBulk)->Arg(1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoadBulkParallel)->RangeMultiplier(2)->Range(1, 8)->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
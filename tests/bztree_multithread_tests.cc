@@ -189,6 +189,65 @@ GTEST_TEST(BztreeTest, MultiThreadInsertInternalSplitTest) {
   pmwcas::Thread::ClearRegistry(true);
 }
 
+// Inserts of the same keys from many threads into leaves with reservation
+// lanes: one of them wins for each key
+GTEST_TEST(BztreeTest, MultiThreadInsertLanesTest) {
+  uint32_t thread_count = 16;
+  uint32_t item_per_thread = 1000;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024, 0, false, 0, false, 0, false, false, false,
+                                     bztree::LeafNode::kMaxLanes);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadInsertTest t(item_per_thread, thread_count, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  auto iter = tree->RangeScanByKey("", 0, true, nullptr, 0, false);
+  uint32_t count = 0;
+  while (auto record = iter->GetNext()) {
+    ++count;
+  }
+  ASSERT_EQ(count, (thread_count + 1) * item_per_thread);
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+// Every policy for threads that lose races on leaves being split
+GTEST_TEST(BztreeTest, MultiThreadInsertContentionTest) {
+  uint32_t thread_count = 16;
+  uint32_t item_per_thread = 2000;
+  for (auto policy : {bztree::ContentionManager::kSpin, bztree::ContentionManager::kBackoff,
+                      bztree::ContentionManager::kHelp}) {
+    bztree::ContentionManager::SetPolicy(policy);
+    std::unique_ptr<pmwcas::DescriptorPool> pool(
+        new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+    );
+    bztree::BzTree::ParameterSet param(1024, 0, 1024);
+    std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+    MultiThreadInsertTest t(item_per_thread, thread_count, tree.get());
+    t.Run(thread_count);
+    t.SanityCheck();
+    pmwcas::Thread::ClearRegistry(true);
+  }
+  bztree::ContentionManager::SetPolicy(bztree::ContentionManager::kBackoff);
+}
+
+GTEST_TEST(BztreeTest, MultiThreadInsertMaintenanceTest) {
+  uint32_t thread_count = 16;
+  uint32_t item_per_thread = 2000;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count + 2, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  tree->StartMaintenance(2);
+  MultiThreadInsertTest t(item_per_thread, thread_count, tree.get());
+  t.Run(thread_count);
+  tree->StopMaintenance();
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
 GTEST_TEST(BztreeTest, MiltiUpsertTest) {
   uint32_t thread_count = 50;
   uint32_t item_per_thread = 1000;
@@ -202,6 +261,601 @@ GTEST_TEST(BztreeTest, MiltiUpsertTest) {
   t.SanityCheck();
   pmwcas::Thread::ClearRegistry(true);
 }
+
+GTEST_TEST(BztreeTest, MultiUpsertSingleWordTest) {
+  uint32_t thread_count = 50;
+  uint32_t item_per_thread = 1000;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  tree->EnableSingleWordUpdate(true);
+  MultiThreadUpsertTest t(item_per_thread, thread_count, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+// One thread counts a key up with single-word updates while others split and
+// consolidate the leaves around it and read it back: reads never go back to
+// a value the copy of a frozen leaf missed
+struct SingleWordUpdateSplitTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  uint32_t updates;
+  std::atomic<bool> done;
+  SingleWordUpdateSplitTest(uint32_t updates, bztree::BzTree *tree)
+      : tree(tree), updates(updates), done(false) {
+    tree->Insert("5000", 4, 0);
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    if (thread_index == 0) {
+      for (uint64_t v = 1; v <= updates; ++v) {
+        ASSERT_TRUE(tree->Update("5000", 4, v).IsOk());
+      }
+      done = true;
+    } else if (thread_index == 1) {
+      uint64_t last = 0;
+      while (!done) {
+        uint64_t payload = 0;
+        ASSERT_TRUE(tree->Read("5000", 4, &payload).IsOk());
+        ASSERT_GE(payload, last);
+        last = payload;
+      }
+    } else {
+      for (uint32_t i = 0; !done; ++i) {
+        auto key = "5000" + std::to_string(thread_index) + std::to_string(i);
+        tree->Insert(key.c_str(), key.length(), i);
+        if (i % 2) {
+          tree->Delete(key.c_str(), key.length());
+        }
+      }
+    }
+  }
+};
+
+GTEST_TEST(BztreeTest, SingleWordUpdateSplitTest) {
+  uint32_t thread_count = 4;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  tree->EnableSingleWordUpdate(true);
+  SingleWordUpdateSplitTest t(100000, tree.get());
+  t.Run(thread_count);
+  uint64_t payload = 0;
+  ASSERT_TRUE(tree->Read("5000", 4, &payload).IsOk());
+  ASSERT_EQ(payload, 100000);
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+struct MultiThreadCounterTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  uint32_t increments_per_thread;
+  uint32_t thread_count;
+  static const uint32_t kCounters = 100;
+  MultiThreadCounterTest(uint32_t increments_per_thread, uint32_t thread_count,
+                         bztree::BzTree *tree)
+      : tree(tree), increments_per_thread(increments_per_thread), thread_count(thread_count) {
+    // Half of the counters go through FetchAdd, the other half through a
+    // CompareAndSwap loop
+    for (uint32_t i = 0; i < 2 * kCounters; ++i) {
+      auto key = "counter" + std::to_string(i);
+      tree->Insert(key.c_str(), key.length(), 0);
+    }
+  }
+
+  void SanityCheck() {
+    for (uint32_t i = 0; i < 2 * kCounters; ++i) {
+      auto key = "counter" + std::to_string(i);
+      uint64_t payload;
+      ASSERT_TRUE(tree->Read(key.c_str(), key.length(), &payload).IsOk());
+      ASSERT_EQ(payload, thread_count * increments_per_thread / kCounters);
+    }
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    for (uint32_t i = 0; i < increments_per_thread; ++i) {
+      auto add_key = "counter" + std::to_string(i % kCounters);
+      ASSERT_TRUE(tree->FetchAdd(add_key.c_str(), add_key.length(), 1).IsOk());
+
+      auto cas_key = "counter" + std::to_string(kCounters + i % kCounters);
+      uint64_t expected = 0;
+      bztree::ReturnCode rc;
+      do {
+        rc = tree->CompareAndSwap(cas_key.c_str(), cas_key.length(), &expected, expected + 1);
+      } while (rc.IsValueMismatch());
+      ASSERT_TRUE(rc.IsOk());
+    }
+  }
+};
+
+GTEST_TEST(BztreeTest, MultiThreadCounterTest) {
+  uint32_t thread_count = 16;
+  uint32_t increments_per_thread = 2000;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadCounterTest t(increments_per_thread, thread_count, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+// One thread deletes the middle of each block of keys by range while the
+// others keep upserting keys all over: those outside all ranges must survive
+struct MultiThreadDeleteRangeTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  uint32_t blocks;
+  uint32_t rounds;
+  static const uint32_t kBlockSize = 1000;
+  MultiThreadDeleteRangeTest(uint32_t blocks, uint32_t rounds, bztree::BzTree *tree)
+      : tree(tree), blocks(blocks), rounds(rounds) {
+    for (uint32_t i = 0; i < blocks * kBlockSize; ++i) {
+      auto key = MakeKey(i);
+      tree->Insert(key.c_str(), key.length(), i);
+    }
+  }
+
+  static std::string MakeKey(uint32_t i) {
+    auto key = std::to_string(i);
+    return std::string(8 - key.size(), '0') + key;
+  }
+  static bool InRange(uint32_t i) {
+    return i % kBlockSize >= 100 && i % kBlockSize < 900;
+  }
+
+  void SanityCheck() {
+    for (uint32_t i = 0; i < blocks * kBlockSize; ++i) {
+      if (!InRange(i)) {
+        auto key = MakeKey(i);
+        uint64_t payload;
+        ASSERT_TRUE(tree->Read(key.c_str(), key.length(), &payload).IsOk());
+        ASSERT_EQ(payload, i);
+      }
+    }
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    if (thread_index == 0) {
+      for (uint32_t r = 0; r < rounds; ++r) {
+        for (uint32_t b = 0; b < blocks; ++b) {
+          auto lo = MakeKey(b * kBlockSize + 100);
+          auto hi = MakeKey(b * kBlockSize + 900);
+          ASSERT_TRUE(tree->DeleteRange(lo.c_str(), lo.length(), hi.c_str(), hi.length()).IsOk());
+        }
+      }
+      return;
+    }
+    for (uint32_t r = 0; r < rounds; ++r) {
+      for (uint32_t i = thread_index; i < blocks * kBlockSize; i += 7) {
+        auto key = MakeKey(i);
+        ASSERT_TRUE(tree->Upsert(key.c_str(), key.length(), i).IsOk());
+      }
+    }
+  }
+};
+
+GTEST_TEST(BztreeTest, MultiThreadDeleteRangeTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadDeleteRangeTest t(20, 5, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+// One thread evicts every leaf over and over while the others write and read
+// them back, so loads race with each other, with evictions and with SMOs
+struct MultiThreadTieringTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  uint32_t keys;
+  uint32_t rounds;
+  MultiThreadTieringTest(uint32_t keys, uint32_t rounds, bztree::BzTree *tree)
+      : tree(tree), keys(keys), rounds(rounds) {
+    for (uint32_t i = 0; i < keys; i += 2) {
+      auto key = MultiThreadDeleteRangeTest::MakeKey(i);
+      tree->Insert(key.c_str(), key.length(), i);
+    }
+  }
+
+  void SanityCheck() {
+    for (uint32_t i = 0; i < keys; ++i) {
+      auto key = MultiThreadDeleteRangeTest::MakeKey(i);
+      uint64_t payload;
+      ASSERT_TRUE(tree->Read(key.c_str(), key.length(), &payload).IsOk());
+      ASSERT_EQ(payload, i);
+    }
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    if (thread_index == 0) {
+      for (uint32_t r = 0; r < rounds * 4; ++r) {
+        std::string cursor;
+        while (tree->EvictColdLeaves(&cursor, 16)) {
+        }
+      }
+      return;
+    }
+    for (uint32_t r = 0; r < rounds; ++r) {
+      for (uint32_t i = thread_index; i < keys; i += 7) {
+        auto key = MultiThreadDeleteRangeTest::MakeKey(i);
+        uint64_t payload;
+        ASSERT_TRUE(tree->Upsert(key.c_str(), key.length(), i).IsOk());
+        ASSERT_TRUE(tree->Read(key.c_str(), key.length(), &payload).IsOk());
+        ASSERT_EQ(payload, i);
+      }
+    }
+  }
+};
+
+GTEST_TEST(BztreeTest, MultiThreadTieringTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  auto path = testing::TempDir() + "bztree_tiering_mt_test";
+  remove(path.c_str());
+  ASSERT_TRUE(tree->EnableTiering(path.c_str()).IsOk());
+  MultiThreadTieringTest t(20000, 5, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  tree.reset();
+  remove(path.c_str());
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+// Threads race to insert the same keys into a primary and a secondary tree
+// with one MultiTreeWrite each: every key must end up in both or neither,
+// and with the payload of the same thread in both
+struct MultiThreadMultiTreeWriteTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *primary;
+  bztree::BzTree *secondary;
+  uint32_t keys;
+  MultiThreadMultiTreeWriteTest(uint32_t keys, bztree::BzTree *primary,
+                                bztree::BzTree *secondary)
+      : primary(primary), secondary(secondary), keys(keys) {}
+
+  void SanityCheck() {
+    for (uint32_t i = 0; i < keys; ++i) {
+      auto key = std::to_string(i);
+      uint64_t payload = 0;
+      uint64_t secondary_payload = 0;
+      ASSERT_TRUE(primary->Read(key.c_str(), key.length(), &payload).IsOk());
+      ASSERT_TRUE(secondary->Read(key.c_str(), key.length(), &secondary_payload).IsOk());
+      ASSERT_EQ(payload, secondary_payload);
+    }
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    bztree::MultiTreeWrite write;
+    for (uint32_t i = 0; i < keys; ++i) {
+      auto key = std::to_string(thread_index % 2 ? i : keys - 1 - i);
+      write.Clear();
+      ASSERT_TRUE(write.Insert(primary, key.c_str(), key.length(), thread_index).IsOk());
+      ASSERT_TRUE(write.Insert(secondary, key.c_str(), key.length(), thread_index).IsOk());
+      auto rc = write.Commit();
+      ASSERT_TRUE(rc.IsOk() || rc.IsKeyExists());
+    }
+  }
+};
+
+GTEST_TEST(BztreeTest, MultiThreadMultiTreeWriteTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> primary = std::make_unique<bztree::BzTree>(param, pool.get());
+  std::unique_ptr<bztree::BzTree> secondary = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadMultiTreeWriteTest t(5000, primary.get(), secondary.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+// Threads append interleaved sequential keys to a hash-partitioned tree, which
+// a merged scan then has to hand back in order
+struct MultiThreadPartitionedTreeTest : public pmwcas::PerformanceTest {
+  bztree::PartitionedTree *tree;
+  uint32_t item_per_thread;
+  uint32_t thread_count;
+  MultiThreadPartitionedTreeTest(uint32_t item_per_thread, uint32_t thread_count,
+                                 bztree::PartitionedTree *tree)
+      : tree(tree), item_per_thread(item_per_thread), thread_count(thread_count) {}
+
+  static std::string MakeKey(uint32_t i) {
+    auto key = std::to_string(i);
+    return std::string(10 - key.size(), '0') + key;
+  }
+
+  void SanityCheck() {
+    uint32_t expected = 0;
+    auto iter = tree->RangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+    while (auto r = iter->GetNext()) {
+      ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), MakeKey(expected));
+      ASSERT_EQ(r->GetPayload(), expected);
+      ++expected;
+    }
+    ASSERT_EQ(expected, item_per_thread * thread_count);
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    for (uint32_t i = 0; i < item_per_thread; ++i) {
+      uint32_t k = i * thread_count + thread_index;
+      auto key = MakeKey(k);
+      ASSERT_TRUE(tree->Insert(key.c_str(), key.length(), k).IsOk());
+    }
+  }
+};
+
+GTEST_TEST(BztreeTest, MultiThreadPartitionedTreeTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::vector<std::unique_ptr<bztree::BzTree>> owned;
+  std::vector<bztree::BzTree *> trees;
+  for (uint32_t i = 0; i < 4; ++i) {
+    owned.push_back(std::make_unique<bztree::BzTree>(param, pool.get()));
+    trees.push_back(owned.back().get());
+  }
+  bztree::PartitionedTree tree(trees);
+  MultiThreadPartitionedTreeTest t(5000, thread_count, &tree);
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+// Each thread keeps overwriting a few keys of its own through a WriteBuffer
+// that flushes often, and checks it reads back what it wrote last
+struct MultiThreadWriteBufferTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  bztree::WriteBuffer *buffer;
+  uint32_t keys_per_thread;
+  uint32_t rounds;
+  uint32_t thread_count;
+  MultiThreadWriteBufferTest(uint32_t keys_per_thread, uint32_t rounds, uint32_t thread_count,
+                             bztree::BzTree *tree, bztree::WriteBuffer *buffer)
+      : tree(tree), buffer(buffer), keys_per_thread(keys_per_thread), rounds(rounds),
+        thread_count(thread_count) {}
+
+  void SanityCheck() {
+    ASSERT_TRUE(buffer->Flush().IsOk());
+    for (uint32_t k = 0; k < keys_per_thread * thread_count; ++k) {
+      auto key = std::to_string(k);
+      uint64_t payload = 0;
+      auto rc = tree->Read(key.c_str(), key.length(), &payload);
+      // Odd keys were deleted in the last round
+      if (k % 2) {
+        ASSERT_TRUE(rc.IsNotFound());
+      } else {
+        ASSERT_TRUE(rc.IsOk());
+        ASSERT_EQ(payload, uint64_t{rounds} * k);
+      }
+    }
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    for (uint32_t r = 1; r <= rounds; ++r) {
+      for (uint32_t i = 0; i < keys_per_thread; ++i) {
+        uint32_t k = i * thread_count + thread_index;
+        auto key = std::to_string(k);
+        uint64_t payload = 0;
+        if (r == rounds && k % 2) {
+          ASSERT_TRUE(buffer->Delete(key.c_str(), key.length()).IsOk());
+          ASSERT_TRUE(buffer->Read(key.c_str(), key.length(), &payload).IsNotFound());
+          continue;
+        }
+        ASSERT_TRUE(buffer->Upsert(key.c_str(), key.length(), uint64_t{r} * k).IsOk());
+        ASSERT_TRUE(buffer->Read(key.c_str(), key.length(), &payload).IsOk());
+        ASSERT_EQ(payload, uint64_t{r} * k);
+      }
+    }
+  }
+};
+
+GTEST_TEST(BztreeTest, MultiThreadWriteBufferTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  std::unique_ptr<bztree::WriteBuffer> buffer;
+  ASSERT_TRUE(bztree::WriteBuffer::Open(tree.get(), 32, nullptr, false, &buffer).IsOk());
+  MultiThreadWriteBufferTest t(200, 20, thread_count, tree.get(), buffer.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  ASSERT_GT(buffer->GetStats().flushes, 0);
+  buffer.reset();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+// Writers insert keys of their own while the first thread keeps draining the
+// change feed: every insert must come out once, with a sequence number of
+// its own, and the inserts of each writer in the order they were made
+struct MultiThreadChangeFeedTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  uint32_t keys_per_thread;
+  uint32_t thread_count;
+  std::atomic<uint32_t> writers_done;
+  std::vector<bztree::ChangeFeed::Change> changes;
+  MultiThreadChangeFeedTest(uint32_t keys_per_thread, uint32_t thread_count,
+                            bztree::BzTree *tree)
+      : tree(tree), keys_per_thread(keys_per_thread), thread_count(thread_count),
+        writers_done(0) {}
+
+  void SanityCheck() {
+    auto *feed = tree->GetChangeFeed();
+    feed->Drain(&changes);
+    ASSERT_EQ(feed->GetDropped(), 0);
+    ASSERT_EQ(changes.size(), uint64_t{keys_per_thread} * (thread_count - 1));
+    std::vector<bool> seen(changes.size());
+    std::vector<int64_t> last(thread_count, -1);
+    for (auto &change : changes) {
+      ASSERT_LT(change.sequence, seen.size());
+      ASSERT_FALSE(seen[change.sequence]);
+      seen[change.sequence] = true;
+      ASSERT_EQ(change.op, bztree::ChangeFeed::kInsert);
+      uint32_t k = std::stoul(change.key);
+      ASSERT_EQ(change.payload, k);
+      // Payloads of a writer only grow, and so do its sequence numbers
+      auto &prev = last[k % thread_count];
+      ASSERT_GT(static_cast<int64_t>(k), prev);
+      prev = k;
+    }
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    auto *feed = tree->GetChangeFeed();
+    if (thread_index == 0) {
+      while (writers_done.load() < thread_count - 1) {
+        feed->Drain(&changes, 64);
+      }
+      return;
+    }
+    for (uint32_t i = 0; i < keys_per_thread; ++i) {
+      uint32_t k = i * thread_count + static_cast<uint32_t>(thread_index);
+      auto key = std::to_string(k);
+      ASSERT_TRUE(tree->Insert(key.c_str(), key.length(), k).IsOk());
+    }
+    ++writers_done;
+  }
+};
+
+GTEST_TEST(BztreeTest, MultiThreadChangeFeedTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  tree->EnableChangeFeed(4096);
+  MultiThreadChangeFeedTest t(2000, thread_count, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+// Writers keep setting both keys of a pair to the same value with one
+// MultiTreeWrite, and one of them appends keys in order, while a reader
+// keeps opening snapshots: in each, both keys of every pair must match, and
+// the appended keys must be a prefix of those appended in the end
+struct MultiThreadSnapshotTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  uint32_t pairs;
+  uint32_t rounds;
+  std::atomic<uint32_t> writers_done;
+  uint32_t snapshots;
+  MultiThreadSnapshotTest(uint32_t pairs, uint32_t rounds, bztree::BzTree *tree)
+      : tree(tree), pairs(pairs), rounds(rounds), writers_done(0), snapshots(0) {
+    for (uint32_t i = 0; i < pairs; ++i) {
+      tree->Insert(PairKey(i, 'a').c_str(), PairKey(i, 'a').length(), 0);
+      tree->Insert(PairKey(i, 'b').c_str(), PairKey(i, 'b').length(), 0);
+    }
+  }
+
+  static std::string PairKey(uint32_t i, char half) {
+    auto key = std::to_string(i);
+    return "p" + std::string(6 - key.size(), '0') + key + half;
+  }
+  static std::string AppendKey(uint32_t i) {
+    auto key = std::to_string(i);
+    return "q" + std::string(8 - key.size(), '0') + key;
+  }
+
+  void CheckSnapshot(uint32_t *appended) {
+    auto snapshot = tree->NewSnapshot();
+    ASSERT_NE(snapshot, nullptr);
+    auto iter = snapshot->RangeScanByKey("p", 1, true, "q", 1, false);
+    uint32_t count = 0;
+    while (auto a = iter->GetNext()) {
+      auto b = iter->GetNext();
+      ASSERT_NE(b, nullptr);
+      ASSERT_EQ(a->GetPayload(), b->GetPayload());
+      ++count;
+    }
+    ASSERT_EQ(count, pairs);
+    uint64_t a_payload = 0;
+    uint64_t b_payload = 0;
+    auto a_key = PairKey(count / 2, 'a');
+    auto b_key = PairKey(count / 2, 'b');
+    ASSERT_TRUE(snapshot->Read(a_key.c_str(), a_key.length(), &a_payload).IsOk());
+    ASSERT_TRUE(snapshot->Read(b_key.c_str(), b_key.length(), &b_payload).IsOk());
+    ASSERT_EQ(a_payload, b_payload);
+
+    iter = snapshot->RangeScanByKey("q", 1, true, "r", 1, false);
+    uint32_t seen = 0;
+    while (auto record = iter->GetNext()) {
+      ASSERT_EQ(record->GetPayload(), seen++);
+    }
+    ASSERT_GE(seen, *appended);
+    *appended = seen;
+    ++snapshots;
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    if (thread_index == 0) {
+      uint32_t appended = 0;
+      do {
+        CheckSnapshot(&appended);
+      } while (writers_done.load() == 0);
+      return;
+    }
+    if (thread_index == 1) {
+      for (uint32_t i = 0; i < rounds * pairs; ++i) {
+        ASSERT_TRUE(tree->Insert(AppendKey(i).c_str(), AppendKey(i).length(), i).IsOk());
+      }
+    }
+    bztree::MultiTreeWrite write;
+    std::mt19937 rng(static_cast<uint32_t>(thread_index));
+    for (uint32_t r = 0; r < rounds * pairs; ++r) {
+      uint32_t i = rng() % pairs;
+      uint64_t value = (static_cast<uint64_t>(thread_index) << 32) | r;
+      write.Clear();
+      ASSERT_TRUE(write.Update(tree, PairKey(i, 'a').c_str(), PairKey(i, 'a').length(),
+                               value).IsOk());
+      ASSERT_TRUE(write.Update(tree, PairKey(i, 'b').c_str(), PairKey(i, 'b').length(),
+                               value).IsOk());
+      ASSERT_TRUE(write.Commit().IsOk());
+    }
+    ++writers_done;
+  }
+};
+
+GTEST_TEST(BztreeTest, MultiThreadSnapshotTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadSnapshotTest t(500, 10, tree.get());
+  t.Run(thread_count);
+  ASSERT_GT(t.snapshots, 0);
+  pmwcas::Thread::ClearRegistry(true);
+}
+
 struct MultiThreadDeleteTest : public pmwcas::PerformanceTest {
   bztree::BzTree *tree;
   uint32_t item_per_thread;
@@ -1,5 +1,10 @@
 #include "bztree_pibench_wrapper.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
 #define TEST_LAYOUT_NAME "bztree_layout"
 
 extern "C" tree_api *create_tree(const tree_options_t &opt) {
@@ -11,8 +16,24 @@ static bool FileExists(const char *pool_path) {
   return (stat(pool_path, &buffer) == 0);
 }
 
+// Descriptors in the PMwCAS pool, split evenly among the threads
+static uint32_t GetDescriptorPoolSize() {
+  const char *size = getenv("BZTREE_DESCRIPTOR_POOL_SIZE");
+  return size ? static_cast<uint32_t>(strtoul(size, nullptr, 10)) : 100000;
+}
+
 bztree::BzTree *create_new_tree(const tree_options_t &opt) {
-  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  // Split leaves where recent inserts went rather than in the middle
+  const char *adaptive = getenv("BZTREE_ADAPTIVE_SPLIT");
+  // Tell absent keys from a per-leaf Bloom filter
+  const char *bloom_filter = getenv("BZTREE_BLOOM_FILTER");
+  // Reservation lanes per leaf, for many threads inserting into few leaves
+  const char *lanes = getenv("BZTREE_LEAF_LANES");
+  uint32_t leaf_lanes = lanes ? static_cast<uint32_t>(strtoul(lanes, nullptr, 10)) : 0;
+  bztree::BzTree::ParameterSet param(1024, 512, 1024, 0, false, 0,
+                                     adaptive && strcmp(adaptive, "0") != 0, 0,
+                                     bloom_filter && strcmp(bloom_filter, "0") != 0,
+                                     false, false, leaf_lanes);
 
 #ifdef PMDK
   pmwcas::InitLibrary(
@@ -28,7 +49,7 @@ bztree::BzTree *create_new_tree(const tree_options_t &opt) {
       pmdk_allocator->GetRoot(sizeof(bztree::BzTree)));
   pmwcas::DescriptorPool *pool = nullptr;
   pmdk_allocator->Allocate((void **)&pool, sizeof(pmwcas::DescriptorPool));
-  new (pool) pmwcas::DescriptorPool(100000, opt.num_threads, false);
+  new (pool) pmwcas::DescriptorPool(GetDescriptorPoolSize(), opt.num_threads, false);
 
   new (bztree) bztree::BzTree(
       param, pool, reinterpret_cast<uint64_t>(pmdk_allocator->GetPool()));
@@ -41,7 +62,7 @@ bztree::BzTree *create_new_tree(const tree_options_t &opt) {
   pmwcas::InitLibrary(
       pmwcas::TlsAllocator::Create, pmwcas::TlsAllocator::Destroy,
       pmwcas::LinuxEnvironment::Create, pmwcas::LinuxEnvironment::Destroy);
-  auto pool = new pmwcas::DescriptorPool(100000, opt.num_threads, false);
+  auto pool = new pmwcas::DescriptorPool(GetDescriptorPoolSize(), opt.num_threads, false);
   auto *bztree = bztree::BzTree::New(param, pool);
 #endif
 
@@ -60,11 +81,23 @@ bztree::BzTree *recovery_from_pool(const tree_options_t &opt) {
 
   auto tree = reinterpret_cast<bztree::BzTree *>(
       pmdk_allocator->GetRoot(sizeof(bztree::BzTree)));
-  tree->Recovery();
+  // Descriptors are replayed on this thread: DescriptorPool::Recovery walks
+  // the whole pool itself and the PMwCAS library has no way to hand parts of
+  // it to other threads. It's bounded by the pool size, not the tree's.
+  auto times = tree->Recovery();
+  // Printed along with the latency histograms
+  const char *latency = getenv("BZTREE_LATENCY");
+  if (latency && strcmp(latency, "0") != 0) {
+    std::cout << "recovery: " << times.descriptor_us << " us replaying descriptors, "
+              << times.tree_us << " us resetting the tree." << std::endl;
+  }
   return tree;
 }
 
-bztree_wrapper::bztree_wrapper(const tree_options_t &opt) {
+bztree_wrapper::bztree_wrapper(const tree_options_t &opt) : value_size_(opt.value_size) {
+  // Keys used as given, rather than as PiBench integers, see EncodeKey
+  const char *raw_keys = getenv("BZTREE_RAW_KEYS");
+  raw_keys_ = raw_keys && strcmp(raw_keys, "0") != 0;
   if (FileExists(opt.pool_path.c_str())) {
     std::cout << "recovery from existing pool." << std::endl;
     tree_ = recovery_from_pool(opt);
@@ -72,69 +105,202 @@ bztree_wrapper::bztree_wrapper(const tree_options_t &opt) {
     std::cout << "creating new tree on pool." << std::endl;
     tree_ = create_new_tree(opt);
   }
+  // Per-operation latency histograms, printed when the benchmark is done
+  const char *latency = getenv("BZTREE_LATENCY");
+  if (latency && strcmp(latency, "0") != 0) {
+    tree_->EnableLatencyHistograms(true);
+  }
+  // How to retry after losing a race: spin, backoff (the default) or help
+  const char *contention = getenv("BZTREE_CONTENTION");
+  if (contention && strcmp(contention, "spin") == 0) {
+    bztree::ContentionManager::SetPolicy(bztree::ContentionManager::kSpin);
+  } else if (contention && strcmp(contention, "help") == 0) {
+    bztree::ContentionManager::SetPolicy(bztree::ContentionManager::kHelp);
+  }
+  // Single-word CAS instead of a 3-word PMwCAS for in-place updates
+  const char *single_word = getenv("BZTREE_SINGLE_WORD_UPDATE");
+  if (single_word && strcmp(single_word, "0") != 0) {
+    tree_->EnableSingleWordUpdate(true);
+  }
+  // Prefetch only node headers and metadata on the way down
+  const char *narrow_prefetch = getenv("BZTREE_NARROW_PREFETCH");
+  if (narrow_prefetch && strcmp(narrow_prefetch, "0") != 0) {
+    tree_->EnableNarrowPrefetch(true);
+  }
+  // Search DRAM copies of internal nodes, rebuilt here after a recovery; one
+  // copy per socket with "socket"
+  const char *node_cache = getenv("BZTREE_INTERNAL_NODE_CACHE");
+  if (node_cache && strcmp(node_cache, "0") != 0) {
+    tree_->EnableInternalNodeCache(true, strcmp(node_cache, "socket") == 0);
+  }
+  // Prefault the pool and read the internal nodes in on this many threads
+  // before the benchmark starts; leaves as well with BZTREE_WARM_UP_LEAVES
+  const char *warm_up = getenv("BZTREE_WARM_UP");
+  if (warm_up && strcmp(warm_up, "0") != 0) {
+    const char *warm_leaves = getenv("BZTREE_WARM_UP_LEAVES");
+    auto stats = tree_->WarmUp(static_cast<uint32_t>(strtoul(warm_up, nullptr, 10)), true,
+                               warm_leaves && strcmp(warm_leaves, "0") != 0);
+    std::cout << "warm-up: " << stats.prefault_us << " us prefaulting "
+              << stats.prefaulted_bytes << " bytes, " << stats.walk_us << " us reading "
+              << stats.internal_nodes << " internal nodes and " << stats.leaves << " leaves."
+              << std::endl;
+  }
+}
+
+bztree_wrapper::~bztree_wrapper() {
+  tree_->DumpLatencyHistograms();
+#ifdef PMDK
+  bztree::Allocator::Uninit();
+#endif
+  pmwcas::Thread::ClearRegistry();
+}
+
+// PiBench keys start with a little-endian integer: swap it to big-endian so
+// that keys sort by it, and leave any bytes that follow it as they are. With
+// BZTREE_RAW_KEYS, keys are byte strings used as given. Swapping twice gets
+// the original key back.
+const char *bztree_wrapper::EncodeKey(const char *key, size_t key_sz, char *buffer) {
+  if (raw_keys_ || key_sz < sizeof(uint64_t)) {
+    return key;
+  }
+  uint64_t k;
+  memcpy(&k, key, sizeof(k));
+  bztree::KeyEncoding::EncodeU64(k, buffer);
+  memcpy(buffer + sizeof(uint64_t), key + sizeof(uint64_t), key_sz - sizeof(uint64_t));
+  return buffer;
+}
+
+const char *bztree_wrapper::EncodeKey(const char *key, size_t key_sz) {
+  thread_local std::vector<char> buffer;
+  buffer.resize(key_sz);
+  return EncodeKey(key, key_sz, buffer.data());
 }
 
-bztree_wrapper::~bztree_wrapper() { pmwcas::Thread::ClearRegistry(); }
+// 8-byte values are kept in 8-byte payloads, as they were before payloads
+// could be longer, so that numbers stay comparable; those are updated with
+// PMwCAS and so have to keep their 3 MSBs clear
+static uint64_t ToPayload(const char *value) {
+  uint64_t payload;
+  memcpy(&payload, value, sizeof(payload));
+  return payload & 0x1FFFFFFFFFFFFFFFull;
+}
 
 bool bztree_wrapper::find(const char *key, size_t key_sz, char *value_out) {
-  // FIXME(tzwang): for now only support 8-byte values
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
-  return tree_
-      ->Read(reinterpret_cast<const char *>(&k), key_sz, (uint64_t *)value_out)
-      .IsOk();
+  uint32_t value_sz = value_size_;
+  return tree_->Read(EncodeKey(key, key_sz), key_sz, value_out, &value_sz).IsOk();
+}
+
+// Keys of a batch, encoded back to back, with pointers to each of them
+static void EncodeBatch(bztree_wrapper *wrapper, const char *keys, size_t key_sz, size_t count,
+                        std::vector<char> *encoded, std::vector<const char *> *key_ptrs) {
+  encoded->resize(key_sz * count);
+  key_ptrs->resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    (*key_ptrs)[i] = wrapper->EncodeKey(keys + i * key_sz, key_sz, encoded->data() + i * key_sz);
+  }
+}
+
+size_t bztree_wrapper::find_batch(const char *keys, size_t key_sz, size_t count,
+                                  char *values_out) {
+  thread_local std::vector<char> encoded;
+  thread_local std::vector<const char *> key_ptrs;
+  thread_local std::vector<uint16_t> key_sizes;
+  thread_local std::vector<char *> values;
+  thread_local std::vector<uint32_t> value_sizes;
+  thread_local std::vector<bztree::ReturnCode> rcs;
+  EncodeBatch(this, keys, key_sz, count, &encoded, &key_ptrs);
+  key_sizes.assign(count, key_sz);
+  values.resize(count);
+  value_sizes.assign(count, value_size_);
+  rcs.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    values[i] = values_out + i * value_size_;
+  }
+
+  tree_->MultiRead(key_ptrs.data(), key_sizes.data(), count, values.data(), value_sizes.data(),
+                   rcs.data());
+  size_t found = 0;
+  for (auto &rc : rcs) {
+    found += rc.IsOk();
+  }
+  return found;
+}
+
+size_t bztree_wrapper::insert_batch(const char *keys, size_t key_sz, size_t count,
+                                    const char *values, size_t value_sz) {
+  thread_local std::vector<char> encoded;
+  thread_local std::vector<const char *> key_ptrs;
+  EncodeBatch(this, keys, key_sz, count, &encoded, &key_ptrs);
+  size_t inserted = 0;
+  // Same records as insert makes
+  if (value_sz != sizeof(uint64_t)) {
+    for (size_t i = 0; i < count; ++i) {
+      inserted += tree_->Insert(key_ptrs[i], key_sz, values + i * value_sz, value_sz).IsOk();
+    }
+    return inserted;
+  }
+
+  thread_local std::vector<uint16_t> key_sizes;
+  thread_local std::vector<uint64_t> payloads;
+  thread_local std::vector<bztree::ReturnCode> rcs;
+  key_sizes.assign(count, key_sz);
+  payloads.resize(count);
+  rcs.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    payloads[i] = ToPayload(values + i * sizeof(uint64_t));
+  }
+  tree_->InsertBatch(key_ptrs.data(), key_sizes.data(), payloads.data(), count, rcs.data());
+  for (auto &rc : rcs) {
+    inserted += rc.IsOk();
+  }
+  return inserted;
 }
 
 bool bztree_wrapper::insert(const char *key, size_t key_sz, const char *value,
                             size_t value_sz) {
-  // FIXME(tzwang): for now only support 8-byte values
-  assert(value_sz == sizeof(uint64_t));
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
-  uint64_t v = *reinterpret_cast<uint64_t *>(const_cast<char *>(value));
-
-  // Mask out the 3 MSBs
-  v &= 0x1FFFFFFFFFFFFFFF;
-  return tree_->Insert(reinterpret_cast<const char *>(&k), key_sz, v).IsOk();
+  if (value_sz == sizeof(uint64_t)) {
+    return tree_->Insert(EncodeKey(key, key_sz), key_sz, ToPayload(value)).IsOk();
+  }
+  return tree_->Insert(EncodeKey(key, key_sz), key_sz, value, value_sz).IsOk();
 }
 
 bool bztree_wrapper::update(const char *key, size_t key_sz, const char *value,
                             size_t value_sz) {
-  // FIXME(tzwang): for now only support 8-byte values
-  assert(value_sz == sizeof(uint64_t));
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
-  uint64_t v = *reinterpret_cast<uint64_t *>(const_cast<char *>(value));
-
-  // Mask out the 3 MSBs
-  v &= 0x1FFFFFFFFFFFFFFF;
-  return tree_->Update(reinterpret_cast<const char *>(&k), key_sz, v).IsOk();
+  // 8-byte payloads, for BZTREE_SINGLE_WORD_UPDATE to apply
+  if (value_sz == sizeof(uint64_t)) {
+    return tree_->Update(EncodeKey(key, key_sz), key_sz, ToPayload(value)).IsOk();
+  }
+  return tree_->Update(EncodeKey(key, key_sz), key_sz, value, value_sz).IsOk();
 }
 
 bool bztree_wrapper::remove(const char *key, size_t key_sz) {
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
-  return tree_->Delete(reinterpret_cast<const char *>(&k), key_sz).IsOk();
+  return tree_->Delete(EncodeKey(key, key_sz), key_sz).IsOk();
 }
 
+// Records go to [values_out] as key followed by value, each as long as it is
+// in the tree
 int bztree_wrapper::scan(const char *key, size_t key_sz, int scan_sz,
                          char *&values_out) {
-  static thread_local std::array<char, (1 << 20)> results;
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
+  static thread_local std::vector<char> results;
+  static thread_local bztree::ScanBuffer records;
 
+  tree_->RangeScanBySize(EncodeKey(key, key_sz), key_sz, scan_sz, &records);
   int scanned = 0;
-  char *dst = results.data();
-
-  auto iter = tree_->RangeScanBySize(reinterpret_cast<const char *>(&k), key_sz,
-                                     scan_sz);
-  for (scanned = 0; (scanned < scan_sz); ++scanned) {
-    auto record = iter->GetNext();
-    if (record == nullptr) break;
-
-    uint64_t result_key = __builtin_bswap64(
-        *reinterpret_cast<const uint64_t *>(record->GetKey()));
-    memcpy(dst, &result_key, sizeof(uint64_t));
-    dst += sizeof(uint64_t);
-
-    auto payload = record->GetPayload();
-    memcpy(dst, &payload, sizeof(uint64_t));
-    dst += sizeof(uint64_t);
+  size_t size = 0;
+  for (auto *record = records.First(); record; record = records.Next(record)) {
+    uint32_t result_key_sz = record->meta.GetKeyLength();
+    uint32_t payload_sz = record->GetPayloadLength();
+    if (results.size() < size + result_key_sz + payload_sz) {
+      results.resize(std::max<size_t>(2 * results.size(), size + result_key_sz + payload_sz));
+    }
+    char *dst = results.data() + size;
+    const char *result_key = EncodeKey(record->GetKey(), result_key_sz, dst);
+    if (result_key != dst) {
+      memcpy(dst, result_key, result_key_sz);
+    }
+    memcpy(dst + result_key_sz, record->GetPayloadData(), payload_sz);
+    size += result_key_sz + payload_sz;
+    ++scanned;
   }
   values_out = results.data();
   return scanned;
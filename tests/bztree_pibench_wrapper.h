@@ -16,8 +16,27 @@ public:
     virtual bool remove(const char *key, size_t key_sz) override;
     virtual int scan(const char *key, size_t key_sz, int scan_sz, char *&values_out) override;
 
+    // Batched find of [count] keys laid out back to back in [keys] through
+    // BzTree::MultiRead; values go to [values_out] [value_size] bytes apart.
+    // Not part of tree_api, for drivers that issue lookups in batches.
+    // Returns the number of keys found.
+    size_t find_batch(const char *keys, size_t key_sz, size_t count, char *values_out);
+    // Batched insert, likewise, through BzTree::InsertBatch for 8-byte values
+    // and one Insert per key otherwise. Returns the number of keys inserted.
+    size_t insert_batch(const char *keys, size_t key_sz, size_t count, const char *values,
+                        size_t value_sz);
+
+    // [key] as stored in the tree, in [buffer] of [key_sz] bytes unless it's
+    // stored as given; also turns a stored key back into a PiBench one
+    const char *EncodeKey(const char *key, size_t key_sz, char *buffer);
+
     bool recovery(const tree_options_t &opt);
 
 private:
+    // In a thread-local buffer
+    const char *EncodeKey(const char *key, size_t key_sz);
+
     bztree::BzTree *tree_;
+    size_t value_size_;
+    bool raw_keys_;
 };
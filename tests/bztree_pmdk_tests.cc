@@ -27,6 +27,7 @@ class BzTreePMEMTest : public ::testing::Test {
   }
 
   void TearDown() override {
+    bztree::Allocator::Uninit();
     pmwcas::Thread::ClearRegistry(true);
   }
 };
@@ -137,6 +138,7 @@ GTEST_TEST(BztreePMEMTest, MiltiInsertTest) {
   MultiThreadUpsertTest t(item_per_thread, thread_count, bztree);
   t.Run(thread_count);
   t.SanityCheck();
+  bztree::Allocator::Uninit();
   pmwcas::Thread::ClearRegistry(true);
 }
 
@@ -153,6 +155,7 @@ GTEST_TEST(BztreePMEMTest, MultiThreadReadback) {
 
   MultiThreadUpsertTest t(item_per_thread, thread_count, tree);
   t.SanityCheck();
+  bztree::Allocator::Uninit();
   pmwcas::Thread::ClearRegistry(true);
 }
 
@@ -167,6 +170,7 @@ GTEST_TEST(BztreePMEMTest, TreeSanityCheck) {
   auto tree = reinterpret_cast<bztree::BzTree *>(pmdk_allocator->GetRoot(sizeof(bztree::BzTree)));
   tree->Recovery();
   tree->Dump();
+  bztree::Allocator::Uninit();
   pmwcas::Thread::ClearRegistry(true);
 }
 
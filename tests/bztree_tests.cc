@@ -5,11 +5,131 @@
 // Xiangpeng Hao <xiangpeng_hao@sfu.ca>
 // Tianzheng Wang <tzwang@sfu.ca>
 
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
 #include "../bztree.h"
 
+TEST(KeyCompareTest, UnsignedBytes) {
+  // Bytes above 0x7F sort after the others, as with memcmp
+  ASSERT_LT(bztree::BaseNode::KeyCompare("\x7f", 1, "\x80", 1), 0);
+  ASSERT_GT(bztree::BaseNode::KeyCompare("a\xff", 2, "a\x01", 2), 0);
+  ASSERT_LT(bztree::BaseNode::KeyCompare("ab", 2, "abc", 3), 0);
+  ASSERT_EQ(bztree::BaseNode::KeyCompare("abc", 3, "abc", 3), 0);
+
+  // Against memcmp, for all the lengths the word and vector paths cover, with
+  // the first difference anywhere
+  std::mt19937 rng(7);
+  char key1[100], key2[100];
+  for (uint32_t size = 1; size < sizeof(key1); ++size) {
+    for (uint32_t diff = 0; diff < size; ++diff) {
+      for (uint32_t i = 0; i < size; ++i) {
+        key1[i] = key2[i] = static_cast<char>(rng());
+      }
+      key2[diff] = static_cast<char>(rng());
+      auto expected = memcmp(key1, key2, size);
+      auto cmp = bztree::BaseNode::KeyCompare(key1, size, key2, size);
+      ASSERT_EQ(cmp < 0, expected < 0);
+      ASSERT_EQ(cmp > 0, expected > 0);
+    }
+  }
+}
+
+TEST(KeyEncodingTest, PreservesOrder) {
+  auto compare = [](const bztree::KeyBuilder &a, const bztree::KeyBuilder &b) {
+    return bztree::BaseNode::KeyCompare(a.GetData(), a.GetSize(), b.GetData(), b.GetSize());
+  };
+  // Values in ascending order, each pair of neighbours must encode in order
+  std::vector<double> doubles = {-std::numeric_limits<double>::infinity(), -1e300, -2.5, -1e-300,
+                                 -0.0, 0.0, 1e-300, 1, 2.5, 1e300,
+                                 std::numeric_limits<double>::infinity()};
+  std::vector<int64_t> ints = {std::numeric_limits<int64_t>::min(), -1000, -1, 0, 1, 255, 256,
+                               std::numeric_limits<int64_t>::max()};
+  std::vector<std::string> strings = {std::string(), std::string("\0", 1),
+                                      std::string("\0\0", 2), std::string("\0a", 2), "\x01", "a",
+                                      std::string("a\0", 2), std::string("a\0b", 3), "a\x01",
+                                      "ab", "b", "\xff"};
+  for (uint32_t i = 1; i < doubles.size(); ++i) {
+    ASSERT_LT(compare(bztree::KeyBuilder().AddDouble(doubles[i - 1]),
+                      bztree::KeyBuilder().AddDouble(doubles[i])), 0);
+    // Some of them round to the same float
+    ASSERT_LE(compare(bztree::KeyBuilder().AddFloat(static_cast<float>(doubles[i - 1])),
+                      bztree::KeyBuilder().AddFloat(static_cast<float>(doubles[i]))), 0);
+  }
+  for (uint32_t i = 1; i < ints.size(); ++i) {
+    ASSERT_LT(compare(bztree::KeyBuilder().AddI64(ints[i - 1]),
+                      bztree::KeyBuilder().AddI64(ints[i])), 0);
+    auto lo = static_cast<int32_t>(std::max<int64_t>(ints[i - 1], INT32_MIN));
+    auto hi = static_cast<int32_t>(std::min<int64_t>(ints[i], INT32_MAX));
+    ASSERT_LE(compare(bztree::KeyBuilder().AddI32(lo), bztree::KeyBuilder().AddI32(hi)), 0);
+  }
+  // Strings followed by another field still sort by the string first
+  for (uint32_t i = 1; i < strings.size(); ++i) {
+    ASSERT_LT(compare(bztree::KeyBuilder().AddString(strings[i - 1]).AddU32(UINT32_MAX),
+                      bztree::KeyBuilder().AddString(strings[i]).AddU32(0)), 0);
+  }
+
+  // Random (tenant, timestamp, name) tuples sort as std::tuple does
+  std::mt19937_64 rng(11);
+  typedef std::tuple<uint32_t, int64_t, std::string> Tuple;
+  std::vector<std::pair<Tuple, std::string>> keys;
+  for (uint32_t i = 0; i < 2000; ++i) {
+    Tuple t(rng() % 4, static_cast<int64_t>(rng() % 64) - 32, std::string(rng() % 3, 'a'));
+    std::get<2>(t) += std::string(1, static_cast<char>(rng() % 3));
+    bztree::KeyBuilder builder;
+    builder.AddU32(std::get<0>(t)).AddI64(std::get<1>(t)).AddString(std::get<2>(t));
+    keys.emplace_back(t, builder.GetKey());
+  }
+  std::sort(keys.begin(), keys.end(), [](const std::pair<Tuple, std::string> &a,
+                                          const std::pair<Tuple, std::string> &b) {
+    return bztree::BaseNode::KeyCompare(a.second.data(), a.second.size(), b.second.data(),
+                                        b.second.size()) < 0;
+  });
+  for (uint32_t i = 1; i < keys.size(); ++i) {
+    ASSERT_LE(keys[i - 1].first, keys[i].first);
+  }
+
+  // And decode back
+  for (auto &key : keys) {
+    bztree::KeyReader reader(key.second.data(), key.second.size());
+    uint32_t tenant = 0;
+    int64_t timestamp = 0;
+    std::string name;
+    ASSERT_TRUE(reader.ReadU32(&tenant));
+    ASSERT_TRUE(reader.ReadI64(&timestamp));
+    ASSERT_TRUE(reader.ReadString(&name));
+    ASSERT_EQ(Tuple(tenant, timestamp, name), key.first);
+    ASSERT_EQ(reader.GetRestSize(), 0);
+    uint64_t more = 0;
+    ASSERT_FALSE(reader.ReadU64(&more));
+  }
+  double d = 0;
+  float f = 0;
+  bztree::KeyBuilder builder;
+  builder.AddDouble(-2.5).AddFloat(0.75f).AddBytes("xyz", 3);
+  bztree::KeyReader reader(builder.GetData(), builder.GetSize());
+  ASSERT_TRUE(reader.ReadDouble(&d));
+  ASSERT_TRUE(reader.ReadFloat(&f));
+  ASSERT_EQ(d, -2.5);
+  ASSERT_EQ(f, 0.75f);
+  ASSERT_EQ(std::string(reader.GetRest(), reader.GetRestSize()), "xyz");
+  // An unterminated string isn't one
+  std::string name;
+  ASSERT_FALSE(reader.ReadString(&name));
+}
+
 class LeafNodeFixtures : public ::testing::Test {
  public:
   const uint32_t node_size = 4096;
@@ -109,6 +229,61 @@ TEST_F(LeafNodeFixtures, DuplicateInsert) {
   ASSERT_READ(new_node, "201", 3, 201);
 }
 
+TEST_F(LeafNodeFixtures, InsertBatch) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+
+  // More records than fit in one descriptor, "250" and "30" already exist
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < 40; ++i) {
+    keys.emplace_back(std::to_string(500 + i));
+  }
+  keys[10] = "250";
+  keys[25] = "30";
+  std::vector<const char *> key_ptrs;
+  std::vector<uint16_t> key_sizes;
+  std::vector<uint64_t> payloads;
+  for (auto &key : keys) {
+    key_ptrs.emplace_back(key.c_str());
+    key_sizes.emplace_back(static_cast<uint16_t>(key.length()));
+    payloads.emplace_back(std::stoul(key) + 1);
+  }
+  std::vector<bztree::ReturnCode> rcs(keys.size());
+  uint32_t done = 0;
+  ASSERT_TRUE(node->InsertBatch(key_ptrs.data(), key_sizes.data(), payloads.data(),
+                                keys.size(), rcs.data(), &done, pool, node_size).IsOk());
+  ASSERT_EQ(done, keys.size());
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    if (i == 10 || i == 25) {
+      ASSERT_TRUE(rcs[i].IsKeyExists());
+      ASSERT_READ(node, key_ptrs[i], key_sizes[i], payloads[i] - 1);
+    } else {
+      ASSERT_TRUE(rcs[i].IsOk());
+      ASSERT_READ(node, key_ptrs[i], key_sizes[i], payloads[i]);
+    }
+  }
+
+  // Stops when the node is full
+  keys.clear();
+  for (uint32_t i = 0; i < 1000; ++i) {
+    keys.emplace_back(std::to_string(10000 + i));
+  }
+  key_ptrs.clear();
+  key_sizes.clear();
+  payloads.assign(keys.size(), 0);
+  for (auto &key : keys) {
+    key_ptrs.emplace_back(key.c_str());
+    key_sizes.emplace_back(static_cast<uint16_t>(key.length()));
+  }
+  rcs.resize(keys.size());
+  ASSERT_TRUE(node->InsertBatch(key_ptrs.data(), key_sizes.data(), payloads.data(),
+                                keys.size(), rcs.data(), &done, pool, node_size)
+                  .IsNotEnoughSpace());
+  ASSERT_GT(done, 0);
+  ASSERT_LT(done, keys.size());
+  ASSERT_READ(node, key_ptrs[done - 1], key_sizes[done - 1], 0);
+}
+
 TEST_F(LeafNodeFixtures, Delete) {
   pmwcas::EpochGuard guard(pool->GetEpoch());
   InsertDummy();
@@ -124,6 +299,33 @@ TEST_F(LeafNodeFixtures, Delete) {
   ASSERT_TRUE(new_node->Read("200", 3, &payload, pool).IsNotFound());
 }
 
+TEST_F(LeafNodeFixtures, SearchSortedField) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+  uint64_t payload;
+
+  // Every key in the sorted field must be found by the binary search
+  for (uint32_t i = 0; i < 100; i += 10) {
+    auto str = std::to_string(i);
+    ASSERT_READ(node, str.c_str(), (uint16_t) str.length(), i);
+  }
+  ASSERT_TRUE(node->Read("5", 1, &payload, pool).IsNotFound());
+  ASSERT_TRUE(node->Read("99", 2, &payload, pool).IsNotFound());
+  ASSERT_TRUE(node->Read("", 0, &payload, pool).IsNotFound());
+
+  // Deleted keys in the sorted field don't hide a re-inserted copy
+  ASSERT_TRUE(node->Delete("0", 1, pool).IsOk());
+  ASSERT_TRUE(node->Delete("50", 2, pool).IsOk());
+  ASSERT_TRUE(node->Read("50", 2, &payload, pool).IsNotFound());
+  ASSERT_READ(node, "40", 2, 40);
+  ASSERT_READ(node, "60", 2, 60);
+  ASSERT_TRUE(node->Insert("50", 2, 55, pool, node_size).IsOk());
+  ASSERT_READ(node, "50", 2, 55);
+  ASSERT_TRUE(node->Insert("0", 1, 1, pool, node_size).IsOk());
+  ASSERT_READ(node, "0", 1, 1);
+  ASSERT_TRUE(node->Insert("50", 2, 56, pool, node_size).IsKeyExists());
+}
+
 TEST_F(LeafNodeFixtures, SplitPrep) {
   pmwcas::EpochGuard guard(pool->GetEpoch());
   InsertDummy();
@@ -151,12 +353,230 @@ TEST_F(LeafNodeFixtures, Update) {
   pmwcas::EpochGuard guard(pool->GetEpoch());
   InsertDummy();
   ASSERT_READ(node, "10", 2, 10);
-  ASSERT_TRUE(node->Update("10", 2, 11, pool).IsOk());
+  ASSERT_TRUE(node->Update("10", 2, 11, pool, node_size).IsOk());
   ASSERT_READ(node, "10", 2, 11);
 
   ASSERT_READ(node, "200", 3, 200);
-  ASSERT_TRUE(node->Update("200", 3, 201, pool).IsOk());
+  ASSERT_TRUE(node->Update("200", 3, 201, pool, node_size).IsOk());
+  ASSERT_READ(node, "200", 3, 201);
+}
+
+TEST_F(LeafNodeFixtures, SingleWordUpdate) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+  ASSERT_TRUE(node->Update("10", 2, 11, pool, node_size, true).IsOk());
+  ASSERT_READ(node, "10", 2, 11);
+  ASSERT_TRUE(node->Update("200", 3, 201, pool, node_size, true).IsOk());
   ASSERT_READ(node, "200", 3, 201);
+  ASSERT_TRUE(node->Update("abc", 3, 1, pool, node_size, true).IsNotFound());
+
+  // A frozen node is left alone
+  node->Freeze(pool);
+  ASSERT_TRUE(node->Update("10", 2, 12, pool, node_size, true).IsNodeFrozen());
+  ASSERT_READ(node, "10", 2, 11);
+}
+
+TEST_F(LeafNodeFixtures, VarPayload) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  std::string long_value(100, 'x');
+  ASSERT_TRUE(node->Insert("a", 1, long_value.c_str(), long_value.size(), pool, node_size).IsOk());
+  ASSERT_TRUE(node->Insert("b", 1, "abc", 3, pool, node_size).IsOk());
+  ASSERT_TRUE(node->Insert("c", 1, 42, pool, node_size).IsOk());
+  ASSERT_TRUE(node->Insert("a", 1, "abc", 3, pool, node_size).IsKeyExists());
+
+  char buffer[128];
+  uint32_t size = sizeof(buffer);
+  ASSERT_TRUE(node->Read("a", 1, buffer, &size, pool).IsOk());
+  ASSERT_EQ(std::string(buffer, size), long_value);
+  size = 8;
+  ASSERT_TRUE(node->Read("a", 1, buffer, &size, pool).IsNotEnoughSpace());
+  ASSERT_EQ(size, long_value.size());
+  uint64_t payload = 0;
+  ASSERT_TRUE(node->Read("a", 1, &payload, pool).IsNotEnoughSpace());
+  size = sizeof(buffer);
+  ASSERT_TRUE(node->Read("c", 1, buffer, &size, pool).IsOk());
+  ASSERT_EQ(size, sizeof(uint64_t));
+  ASSERT_EQ(*reinterpret_cast<uint64_t *>(buffer), 42);
+
+  // Out-of-place updates: the old version counts as deleted space
+  auto deleted_size = node->GetHeader()->GetStatus().GetDeletedSize();
+  ASSERT_TRUE(node->Update("a", 1, "short", 5, pool, node_size).IsOk());
+  ASSERT_GT(node->GetHeader()->GetStatus().GetDeletedSize(), deleted_size);
+  size = sizeof(buffer);
+  ASSERT_TRUE(node->Read("a", 1, buffer, &size, pool).IsOk());
+  ASSERT_EQ(std::string(buffer, size), "short");
+  ASSERT_TRUE(node->Update("b", 1, 7, pool, node_size).IsOk());
+  ASSERT_READ(node, "b", 1, 7);
+  ASSERT_TRUE(node->Update("c", 1, long_value.c_str(), long_value.size(),
+                           pool, node_size).IsOk());
+  ASSERT_TRUE(node->Update("d", 1, "abc", 3, pool, node_size).IsNotFound());
+
+  auto *new_node = node->Consolidate(pool);
+  delete node;
+  node = new_node;
+  size = sizeof(buffer);
+  ASSERT_TRUE(node->Read("a", 1, buffer, &size, pool).IsOk());
+  ASSERT_EQ(std::string(buffer, size), "short");
+  ASSERT_READ(node, "b", 1, 7);
+  size = sizeof(buffer);
+  ASSERT_TRUE(node->Read("c", 1, buffer, &size, pool).IsOk());
+  ASSERT_EQ(std::string(buffer, size), long_value);
+  ASSERT_EQ(node->GetHeader()->GetStatus().GetRecordCount(), 3);
+}
+
+TEST_F(LeafNodeFixtures, Fingerprints) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  // Two keys with the same fingerprint, both in the unsorted field
+  std::string first = "key0";
+  std::string second;
+  for (uint32_t i = 1; second.empty(); ++i) {
+    auto key = "key" + std::to_string(i);
+    if (bztree::BaseNode::KeyFingerprint(key.c_str(), key.length()) ==
+        bztree::BaseNode::KeyFingerprint(first.c_str(), first.length())) {
+      second = key;
+    }
+  }
+  ASSERT_TRUE(node->Insert(first.c_str(), first.length(), 1, pool, node_size).IsOk());
+  ASSERT_TRUE(node->Insert(second.c_str(), second.length(), 2, pool, node_size).IsOk());
+  ASSERT_TRUE(node->Insert(second.c_str(), second.length(), 3, pool, node_size).IsKeyExists());
+  ASSERT_READ(node, first.c_str(), first.length(), 1);
+  ASSERT_READ(node, second.c_str(), second.length(), 2);
+  ASSERT_EQ(node->GetFingerprints()[1],
+            bztree::BaseNode::KeyFingerprint(second.c_str(), second.length()));
+
+  // Records small enough to outnumber the fingerprints are still found
+  auto capacity = bztree::BaseNode::GetFingerprintCapacity(node_size);
+  std::vector<std::string> keys;
+  for (uint32_t i = 0;; ++i) {
+    auto key = std::to_string(i);
+    if (!node->Insert(key.c_str(), key.length(), "", 0, pool, node_size).IsOk()) {
+      break;
+    }
+    keys.emplace_back(key);
+  }
+  ASSERT_GT(node->GetHeader()->GetStatus().GetRecordCount(), capacity);
+  char buffer[8];
+  for (auto &key : keys) {
+    uint32_t size = sizeof(buffer);
+    ASSERT_TRUE(node->Read(key.c_str(), key.length(), buffer, &size, pool).IsOk());
+    ASSERT_EQ(size, 0);
+    ASSERT_TRUE(node->Insert(key.c_str(), key.length(), 1, pool, node_size).IsKeyExists());
+  }
+  uint64_t payload = 0;
+  ASSERT_TRUE(node->Read("x", 1, &payload, pool).IsNotFound());
+}
+
+TEST_F(LeafNodeFixtures, BloomFilter) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  static const uint32_t kKeys = 140;
+  bztree::LeafNode *leaf = nullptr;
+  bztree::LeafNode::New(&leaf, node_size, true);
+  ASSERT_TRUE(leaf->HasBloomFilter());
+  for (uint32_t i = 0; i < kKeys; i += 2) {
+    auto key = "key" + std::to_string(i);
+    ASSERT_TRUE(leaf->Insert(key.c_str(), key.length(), i, pool, node_size).IsOk());
+  }
+
+  // Absent keys are mostly told apart by the filter, present ones never
+  auto count_false_positives = [&](bztree::LeafNode *node, uint32_t present_step) {
+    uint32_t false_positives = 0;
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      auto key = "key" + std::to_string(i);
+      uint64_t payload = 0;
+      if (i % present_step == 0) {
+        EXPECT_TRUE(node->MayContain(key.c_str(), key.length()));
+        EXPECT_TRUE(node->Read(key.c_str(), key.length(), &payload, pool).IsOk());
+        EXPECT_EQ(payload, i);
+        EXPECT_TRUE(node->Insert(key.c_str(), key.length(), 1, pool, node_size).IsKeyExists());
+      } else {
+        EXPECT_TRUE(node->Read(key.c_str(), key.length(), &payload, pool).IsNotFound());
+      }
+    }
+    for (uint32_t i = 0; i < 1000; ++i) {
+      auto key = "absent" + std::to_string(i);
+      false_positives += node->MayContain(key.c_str(), key.length());
+    }
+    return false_positives;
+  };
+  ASSERT_LT(count_false_positives(leaf, 2), 50);
+
+  // Rebuilt nodes keep the filter (of the records left)
+  for (uint32_t i = kKeys / 2; i < kKeys; i += 2) {
+    auto key = "key" + std::to_string(i);
+    ASSERT_TRUE(leaf->Delete(key.c_str(), key.length(), pool).IsOk());
+  }
+  auto *consolidated = leaf->Consolidate(pool);
+  ASSERT_TRUE(consolidated->HasBloomFilter());
+  for (uint32_t i = 1; i < kKeys; i += 2) {
+    auto key = "key" + std::to_string(i);
+    ASSERT_TRUE(consolidated->Insert(key.c_str(), key.length(), i, pool, node_size).IsOk());
+  }
+  for (uint32_t i = kKeys / 2; i < kKeys; i += 2) {
+    auto key = "key" + std::to_string(i);
+    ASSERT_TRUE(consolidated->Insert(key.c_str(), key.length(), i, pool, node_size).IsOk());
+  }
+  ASSERT_LT(count_false_positives(consolidated, 1), 50);
+  delete consolidated;
+  delete leaf;
+}
+
+TEST_F(LeafNodeFixtures, ReservationLanes) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  bztree::LeafNode *leaf = nullptr;
+  bztree::LeafNode::New(&leaf, node_size, true, bztree::LeafNode::kMaxLanes);
+  ASSERT_EQ(leaf->GetLaneCount(), bztree::LeafNode::kMaxLanes);
+
+  // Lanes are on lines of their own, in front of the Bloom filter
+  auto check_lanes = [&](bztree::LeafNode *node, bool frozen) {
+    auto *filter = reinterpret_cast<char *>(node->GetBloomFilter());
+    for (uint32_t i = 0; i < node->GetLaneCount(); ++i) {
+      auto offset = reinterpret_cast<char *>(node->GetLane(i)) - reinterpret_cast<char *>(node);
+      EXPECT_EQ(offset % bztree::LeafNode::kLaneSize, 0);
+      EXPECT_LE(reinterpret_cast<char *>(node->GetLane(i)) + bztree::LeafNode::kLaneSize, filter);
+      EXPECT_EQ(node->GetLaneStatus(i).IsFrozen(), frozen);
+    }
+  };
+  check_lanes(leaf, false);
+
+  // Records never get into them, however full the node gets
+  uint32_t inserted = 0;
+  for (;; ++inserted) {
+    auto key = "key" + std::to_string(inserted);
+    auto rc = leaf->Insert(key.c_str(), key.length(), inserted, pool, node_size);
+    if (rc.IsNotEnoughSpace()) {
+      break;
+    }
+    ASSERT_TRUE(rc.IsOk());
+  }
+  ASSERT_GT(inserted, 100);
+  auto first = leaf->GetMetadata(0);
+  ASSERT_LE(leaf->GetKey(first) + first.GetPaddedTotalLength(),
+            reinterpret_cast<char *>(leaf->GetLane(0)));
+  check_lanes(leaf, false);
+  for (uint32_t i = 0; i < inserted; ++i) {
+    auto key = "key" + std::to_string(i);
+    ASSERT_READ(leaf, key.c_str(), key.length(), i);
+    ASSERT_TRUE(leaf->Insert(key.c_str(), key.length(), 0, pool, node_size).IsKeyExists());
+  }
+
+  // Frozen along with the node, and new nodes get lanes of their own
+  for (uint32_t i = 0; i < inserted; i += 2) {
+    auto key = "key" + std::to_string(i);
+    ASSERT_TRUE(leaf->Delete(key.c_str(), key.length(), pool).IsOk());
+  }
+  auto *consolidated = leaf->Consolidate(pool);
+  check_lanes(leaf, true);
+  ASSERT_TRUE(leaf->Insert("new", 3, 1, pool, node_size).IsNodeFrozen());
+  ASSERT_EQ(consolidated->GetLaneCount(), bztree::LeafNode::kMaxLanes);
+  check_lanes(consolidated, false);
+  ASSERT_TRUE(consolidated->Insert("new", 3, 1, pool, node_size).IsOk());
+  ASSERT_READ(consolidated, "new", 3, 1);
+  for (uint32_t i = 1; i < inserted; i += 2) {
+    auto key = "key" + std::to_string(i);
+    ASSERT_READ(consolidated, key.c_str(), key.length(), i);
+  }
+  delete consolidated;
+  delete leaf;
 }
 
 TEST_F(LeafNodeFixtures, RangeScanByKey) {
@@ -177,6 +597,104 @@ TEST_F(LeafNodeFixtures, RangeScanByKey) {
   pool->GetEpoch()->Unprotect();
 }
 
+TEST_F(LeafNodeFixtures, RangeScanIntoBuffer) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+  ASSERT_TRUE(node->Delete("30", 2, pool).IsOk());
+  ASSERT_TRUE(node->Delete("220", 3, pool).IsOk());
+
+  bztree::ScanBuffer buffer;
+  ASSERT_TRUE(node->RangeScanByKey("20", 2, true, nullptr, 0, false, 5, &buffer, pool).IsOk());
+  ASSERT_EQ(buffer.Count(), 5);
+  const char *expected[] = {"20", "200", "210", "230", "240"};
+  uint32_t i = 0;
+  for (auto *r = buffer.First(); r; r = buffer.Next(r)) {
+    ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), expected[i]);
+    ASSERT_EQ(r->GetPayload(), std::stoul(expected[i]));
+    ++i;
+  }
+  ASSERT_EQ(i, 5);
+
+  // Exclusive start key, appended to what's already in the buffer
+  ASSERT_TRUE(node->RangeScanByKey("80", 2, false, nullptr, 0, false, 100, &buffer, pool).IsOk());
+  ASSERT_EQ(buffer.Count(), 6);
+
+  // A caller-provided buffer that only has room for two records
+  alignas(8) char small[2 * (sizeof(bztree::Record) + 16)];
+  bztree::ScanBuffer small_buffer(small, sizeof(small));
+  ASSERT_TRUE(node->RangeScanByKey("0", 1, true, nullptr, 0, false, 10, &small_buffer, pool)
+                  .IsNotEnoughSpace());
+  ASSERT_EQ(small_buffer.Count(), 2);
+
+  // Upper bounds: "20", "200", "210" and the (deleted) "220" sort before "230"
+  buffer.Clear();
+  ASSERT_TRUE(node->RangeScanByKey("20", 2, true, "210", 3, true, 100, &buffer, pool).IsOk());
+  ASSERT_EQ(buffer.Count(), 3);
+  buffer.Clear();
+  ASSERT_TRUE(node->RangeScanByKey("20", 2, false, "210", 3, false, 100, &buffer, pool).IsOk());
+  ASSERT_EQ(buffer.Count(), 1);
+  ASSERT_EQ(std::string(buffer.First()->GetKey(), 3), "200");
+
+  // The largest keys in the range, in descending order
+  buffer.Clear();
+  ASSERT_TRUE(node->ReverseRangeScanByKey("20", 2, true, "240", 3, true, 3, &buffer, pool)
+                  .IsOk());
+  const char *reversed[] = {"240", "230", "210"};
+  i = 0;
+  for (auto *r = buffer.First(); r; r = buffer.Next(r)) {
+    ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), reversed[i++]);
+  }
+  ASSERT_EQ(i, 3);
+}
+
+TEST_F(LeafNodeFixtures, KeyPrefix) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  node->SetPrefix("user:", 5);
+  for (uint32_t i = 0; i < 100; i += 10) {
+    auto key = "user:" + std::to_string(i);
+    ASSERT_TRUE(node->Insert(key.c_str(), (uint16_t) key.length(), i, pool, node_size).IsOk());
+  }
+  ASSERT_EQ(node->GetPrefixSize(), 5);
+  ASSERT_READ(node, "user:10", 7, 10);
+  uint64_t payload = 0;
+  ASSERT_TRUE(node->Read("user:15", 7, &payload, pool).IsNotFound());
+  ASSERT_TRUE(node->Read("uses:10", 7, &payload, pool).IsNotFound());
+  ASSERT_TRUE(node->Read("user", 4, &payload, pool).IsNotFound());
+  ASSERT_TRUE(node->Update("user:20", 7, 21, pool, node_size).IsOk());
+  ASSERT_TRUE(node->Delete("user:30", 7, pool).IsOk());
+  ASSERT_TRUE(node->Update("other", 5, 0, pool, node_size).IsNotFound());
+
+  // The copy keeps the prefix, records come out with their whole keys
+  auto *new_node = node->Consolidate(pool);
+  delete node;
+  node = new_node;
+  ASSERT_EQ(node->GetPrefixSize(), 5);
+  ASSERT_READ(node, "user:20", 7, 21);
+  bztree::ScanBuffer buffer;
+  ASSERT_TRUE(node->RangeScanByKey("user:20", 7, true, "user:50", 7, false, 100, &buffer, pool)
+                  .IsOk());
+  const char *expected[] = {"user:20", "user:40"};
+  uint32_t i = 0;
+  for (auto *r = buffer.First(); r; r = buffer.Next(r)) {
+    ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), expected[i++]);
+  }
+  ASSERT_EQ(i, 2);
+
+  // Bounds that don't start with the prefix
+  buffer.Clear();
+  ASSERT_TRUE(node->RangeScanByKey("a", 1, true, "user:10", 7, true, 100, &buffer, pool).IsOk());
+  ASSERT_EQ(buffer.Count(), 2);
+  buffer.Clear();
+  ASSERT_TRUE(node->RangeScanByKey("user:8", 6, true, "z", 1, true, 100, &buffer, pool).IsOk());
+  ASSERT_EQ(buffer.Count(), 2);
+  buffer.Clear();
+  ASSERT_TRUE(node->RangeScanByKey("z", 1, true, nullptr, 0, false, 100, &buffer, pool).IsOk());
+  ASSERT_EQ(buffer.Count(), 0);
+  buffer.Clear();
+  ASSERT_TRUE(node->RangeScanByKey("a", 1, true, "user", 4, true, 100, &buffer, pool).IsOk());
+  ASSERT_EQ(buffer.Count(), 0);
+}
+
 class BzTreeTest : public ::testing::Test {
  protected:
   pmwcas::DescriptorPool *pool;
@@ -220,6 +738,10 @@ TEST_F(BzTreeTest, Insert) {
     ASSERT_TRUE(payload == i);
   }
 
+  // Nodes replaced by splits are handed to the garbage list
+  ASSERT_GT(tree->GetRetiredBytes(), 0);
+  ASSERT_LE(tree->GetReclaimedBytes(), tree->GetRetiredBytes());
+
   tree->Dump();
   // Read everything back
   for (uint32_t i = 0; i < kMaxKey; ++i) {
@@ -255,6 +777,625 @@ TEST_F(BzTreeTest, Update) {
   ASSERT_EQ(payload, 21);
 }
 
+TEST_F(BzTreeTest, SingleWordUpdate) {
+  uint64_t payload;
+  InsertDummy();
+  tree->EnableSingleWordUpdate(true);
+  ASSERT_TRUE(tree->Update("20", 2, 21).IsOk());
+  ASSERT_TRUE(tree->Read("20", 2, &payload).IsOk());
+  ASSERT_EQ(payload, 21);
+  ASSERT_TRUE(tree->Update("abc", 3, 1).IsNotFound());
+
+  // Variable-length payloads are still replaced out of place
+  ASSERT_TRUE(tree->Insert("var", 3, "0123456789", 10).IsOk());
+  ASSERT_TRUE(tree->Update("var", 3, 7).IsOk());
+  ASSERT_TRUE(tree->Read("var", 3, &payload).IsOk());
+  ASSERT_EQ(payload, 7);
+
+  // Upserts through splits
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  t->EnableSingleWordUpdate(true);
+  static const uint32_t kKeys = 2000;
+  for (uint32_t round = 0; round < 3; ++round) {
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      auto key = std::to_string(100000 + (i * 7919) % kKeys);
+      ASSERT_TRUE(t->Upsert(key.c_str(), key.length(), round * kKeys + i).IsOk());
+    }
+  }
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, 2 * kKeys + i);
+  }
+}
+
+TEST_F(BzTreeTest, NarrowPrefetch) {
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  t->EnableNarrowPrefetch(true);
+  static const uint32_t kKeys = 2000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+  }
+  ASSERT_TRUE(t->Read("99999", 5, &payload).IsNotFound());
+}
+
+TEST_F(BzTreeTest, ReadSession) {
+  auto *epoch = pool->GetEpoch();
+  InsertDummy();
+  uint64_t payload = 0;
+  {
+    bztree::ReadSession session(tree);
+    ASSERT_TRUE(epoch->IsProtected());
+    ASSERT_TRUE(tree->Read("20", 2, &payload).IsOk());
+    ASSERT_EQ(payload, 20);
+    // Operations inside leave the session's protection alone, and so do
+    // nested sessions
+    ASSERT_TRUE(epoch->IsProtected());
+    {
+      bztree::ReadSession inner(tree);
+      ASSERT_TRUE(tree->Insert("abc", 3, 42).IsOk());
+    }
+    ASSERT_TRUE(epoch->IsProtected());
+    session.Refresh();
+    ASSERT_TRUE(tree->Read("abc", 3, &payload).IsOk());
+    ASSERT_EQ(payload, 42);
+    auto iter = tree->RangeScanBySize("abc", 3, 10);
+    ASSERT_NE(iter->GetNext(), nullptr);
+  }
+  ASSERT_FALSE(epoch->IsProtected());
+}
+
+TEST_F(BzTreeTest, Session) {
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 2000;
+  bztree::BzTree::Session session(t.get());
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Insert(&session, key.c_str(), key.length(), i).IsOk());
+  }
+  ASSERT_TRUE(t->Insert(&session, "100000", 6, 1).IsKeyExists());
+  session.Refresh();
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Read(&session, key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+    if (i % 2) {
+      ASSERT_TRUE(t->Delete(&session, key.c_str(), key.length()).IsOk());
+    } else {
+      ASSERT_TRUE(t->Update(&session, key.c_str(), key.length(), i + 1).IsOk());
+    }
+  }
+  ASSERT_TRUE(t->Upsert(&session, "100000", 6, 7).IsOk());
+  ASSERT_TRUE(t->Upsert(&session, "200000", 6, 8).IsOk());
+  ASSERT_TRUE(t->Update(&session, "300000", 6, 9).IsNotFound());
+
+  // The plain operations see the same tree
+  ASSERT_TRUE(t->Read("200000", 6, &payload).IsOk());
+  ASSERT_EQ(payload, 8);
+  auto key = std::to_string(100000 + 7919 % kKeys);
+  ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsNotFound());
+  ASSERT_EQ(session.GetOperationCount(bztree::BzTree::kOpInsert), kKeys + 1);
+  ASSERT_EQ(session.GetOperationCount(bztree::BzTree::kOpRead), kKeys);
+  ASSERT_EQ(session.GetOperationCount(bztree::BzTree::kOpDelete), kKeys / 2);
+  ASSERT_EQ(session.GetOperationCount(bztree::BzTree::kOpUpdate), kKeys / 2 + 1);
+  ASSERT_EQ(session.GetOperationCount(bztree::BzTree::kOpUpsert), 2);
+}
+
+TEST_F(BzTreeTest, FingerSearch) {
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 2000;
+  bztree::BzTree::Session session(t.get(), true);
+  // Sorted inserts through the session, with inserts that split the leaves
+  // behind its back in between
+  std::set<uint32_t> odd;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + 2 * i);
+    ASSERT_TRUE(t->Insert(&session, key.c_str(), key.length(), i).IsOk());
+    if (i % 10 == 0) {
+      odd.insert(i * 7919 % kKeys);
+      key = std::to_string(100000 + 2 * (i * 7919 % kKeys) + 1);
+      ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+    }
+  }
+  uint64_t hits = session.GetFingerHits();
+  ASSERT_GT(hits, kKeys / 2);
+
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + 2 * i);
+    ASSERT_TRUE(t->Read(&session, key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+    if (i % 2) {
+      ASSERT_TRUE(t->Delete(&session, key.c_str(), key.length()).IsOk());
+    } else {
+      ASSERT_TRUE(t->Upsert(&session, key.c_str(), key.length(), i + 1).IsOk());
+    }
+    key = std::to_string(100000 + 2 * i + 1);
+    ASSERT_EQ(t->Read(&session, key.c_str(), key.length(), &payload).IsOk(), odd.count(i) > 0);
+  }
+  ASSERT_GT(session.GetFingerHits(), hits + kKeys);
+  // Keys outside the leaf go through the root
+  session.Refresh();
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + 2 * i);
+    ASSERT_EQ(t->Read(&session, key.c_str(), key.length(), &payload).IsOk(), i % 2 == 0);
+    key = std::to_string(100000 + 2 * (kKeys - 1 - i));
+    ASSERT_EQ(t->Update(&session, key.c_str(), key.length(), i).IsOk(), i % 2 == 1);
+  }
+}
+
+TEST_F(BzTreeTest, SteppedOps) {
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 2000;
+  static const uint32_t kOps = 8;
+  bztree::BzTree::Session session(t.get());
+  std::vector<std::unique_ptr<bztree::BzTree::SteppedOp>> ops;
+  for (uint32_t i = 0; i < kOps; ++i) {
+    ops.emplace_back(new bztree::BzTree::SteppedOp(&session));
+  }
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    keys.push_back(std::to_string(100000 + (i * 7919) % kKeys));
+  }
+
+  // Round robin over a group of operations at a time, as an executor would
+  auto run = [&](uint32_t group, const std::function<void(uint32_t, uint32_t)> &start,
+                 const std::function<void(uint32_t, uint32_t)> &check) {
+    for (uint32_t i = 0; i < kKeys; i += group) {
+      for (uint32_t j = 0; j < group; ++j) {
+        start(j, i + j);
+      }
+      bool done = false;
+      while (!done) {
+        done = true;
+        for (uint32_t j = 0; j < group; ++j) {
+          done &= ops[j]->Step();
+        }
+      }
+      for (uint32_t j = 0; j < group; ++j) {
+        check(j, i + j);
+      }
+    }
+  };
+  run(kOps, [&](uint32_t j, uint32_t i) {
+    ops[j]->Insert(keys[i].c_str(), keys[i].length(), i);
+  }, [&](uint32_t j, uint32_t i) {
+    ASSERT_TRUE(ops[j]->GetResult().IsOk());
+  });
+  ops[0]->Insert(keys[0].c_str(), keys[0].length(), 0);
+  while (!ops[0]->Step()) {
+  }
+  ASSERT_TRUE(ops[0]->GetResult().IsKeyExists());
+
+  // One step per level, and one at the leaf
+  auto stats = t->GetSpaceStats();
+  run(kOps, [&](uint32_t j, uint32_t i) {
+    ops[j]->Read(keys[i].c_str(), keys[i].length());
+  }, [&](uint32_t j, uint32_t i) {
+    ASSERT_TRUE(ops[j]->GetResult().IsOk());
+    ASSERT_EQ(ops[j]->GetPayload(), i);
+    ASSERT_EQ(ops[j]->GetSteps(), stats.levels + 1);
+  });
+  ops[0]->Read("200000", 6);
+  while (!ops[0]->Step()) {
+  }
+  ASSERT_TRUE(ops[0]->GetResult().IsNotFound());
+
+  // Scans go from leaf to leaf
+  bztree::ScanBuffer buffers[kOps];
+  run(4, [&](uint32_t j, uint32_t i) {
+    ops[j]->Scan(keys[i].c_str(), keys[i].length(), 100, &buffers[j]);
+  }, [&](uint32_t j, uint32_t i) {
+    ASSERT_TRUE(ops[j]->GetResult().IsOk());
+    uint32_t first = std::stoul(keys[i]) - 100000;
+    ASSERT_EQ(buffers[j].Count(), std::min(100u, kKeys - first));
+    uint32_t expected = first;
+    for (auto *r = buffers[j].First(); r; r = buffers[j].Next(r)) {
+      ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()),
+                std::to_string(100000 + expected++));
+    }
+  });
+  ASSERT_EQ(session.GetOperationCount(bztree::BzTree::kOpInsert), kKeys + 1);
+  ASSERT_EQ(session.GetOperationCount(bztree::BzTree::kOpRead), kKeys + 1);
+  ASSERT_EQ(session.GetOperationCount(bztree::BzTree::kOpScan), kKeys);
+}
+
+TEST_F(BzTreeTest, SpaceStats) {
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 2000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  auto stats = t->GetSpaceStats();
+  ASSERT_GT(stats.levels, 1);
+  ASSERT_EQ(stats.nodes[0], 1);
+  uint64_t leaves = 0;
+  for (auto count : stats.leaf_fill) {
+    leaves += count;
+  }
+  ASSERT_EQ(leaves, stats.nodes[stats.levels - 1]);
+  ASSERT_EQ(stats.records, kKeys);
+  // 6-byte keys padded to 8, and 8-byte payloads
+  ASSERT_EQ(stats.live_bytes, kKeys * 16);
+  ASSERT_EQ(stats.frozen_leaves, 0);
+  ASSERT_GT(stats.GetSpaceAmplification(), 1);
+
+  // Deleted records stay in place until their leaves are consolidated
+  for (uint32_t i = 0; i < kKeys; i += 2) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Delete(key.c_str(), key.length()).IsOk());
+  }
+  auto after = t->GetSpaceStats();
+  ASSERT_EQ(after.records, kKeys / 2);
+  ASSERT_EQ(after.live_bytes, kKeys / 2 * 16);
+  ASSERT_EQ(after.deleted_bytes, stats.deleted_bytes + kKeys / 2 * 16);
+  ASSERT_GE(after.reclaimable_bytes, stats.reclaimable_bytes + kKeys / 2 * 24);
+  ASSERT_GT(after.GetSpaceAmplification(), stats.GetSpaceAmplification());
+}
+
+#if ENABLE_PERF_EVENTS
+TEST_F(BzTreeTest, PerfProfile) {
+  bztree::PerfProfile::Reset();
+  for (uint32_t i = 0; i < 1000; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(tree->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  std::ostringstream folded;
+  bztree::PerfProfile::DumpFolded(folded, bztree::PerfProfile::kTaskClock);
+  if (folded.str().empty()) {
+    // No counters to open here
+    return;
+  }
+  // Inserts traverse, search leaves for duplicates and PMwCAS; some split
+  std::string dump = folded.str();
+  ASSERT_NE(dump.find("traverse "), std::string::npos);
+  ASSERT_NE(dump.find("leaf_search "), std::string::npos);
+  ASSERT_NE(dump.find("pmwcas "), std::string::npos);
+  ASSERT_NE(dump.find("smo"), std::string::npos);
+}
+#endif
+
+TEST_F(BzTreeTest, HotRanges) {
+  static const uint32_t kKeys = 2000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(tree->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  ASSERT_TRUE(tree->GetHotRanges(10).empty());
+
+  // One key read far more than the others, sampling every access
+  tree->EnableHotnessTracking(true, 0);
+  std::string hot_key = std::to_string(100000 + kKeys / 2);
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < 10000; ++i) {
+    auto key = std::to_string(100000 + i % kKeys);
+    ASSERT_TRUE(tree->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_TRUE(tree->Read(hot_key.c_str(), hot_key.length(), &payload).IsOk());
+  }
+  auto ranges = tree->GetHotRanges(3);
+  ASSERT_EQ(ranges.size(), 3);
+  ASSERT_LT(ranges[0].lo, hot_key);
+  ASSERT_GE(ranges[0].hi, hot_key);
+  ASSERT_GE(ranges[0].accesses, 10000);
+  ASSERT_GE(ranges[0].accesses, ranges[1].accesses);
+  ASSERT_GE(ranges[1].accesses, ranges[2].accesses);
+  ASSERT_LT(ranges[1].accesses, ranges[0].accesses / 2);
+
+  // Splits pass the counts on to the new leaves; these keys go right before
+  // the hot one
+  auto prefix = std::to_string(100000 + kKeys / 2 - 1);
+  for (uint32_t i = 0; i < 100; ++i) {
+    auto key = prefix + std::to_string(i);
+    ASSERT_TRUE(tree->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  ranges = tree->GetHotRanges(1);
+  ASSERT_EQ(ranges.size(), 1);
+  ASSERT_GE(ranges[0].accesses, 1000);
+
+  tree->EnableHotnessTracking(false);
+  auto before = tree->GetHotRanges(1)[0].accesses;
+  for (uint32_t i = 0; i < 100; ++i) {
+    ASSERT_TRUE(tree->Read(hot_key.c_str(), hot_key.length(), &payload).IsOk());
+  }
+  ASSERT_EQ(tree->GetHotRanges(1)[0].accesses, before);
+}
+
+TEST_F(BzTreeTest, PackColdLeaves) {
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 3000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), (i * 7919) % kKeys).IsOk());
+  }
+  // Leaves that went cold after most of their records were deleted
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    if (i % 3 != 0) {
+      auto key = std::to_string(100000 + i);
+      ASSERT_TRUE(t->Delete(key.c_str(), key.length()).IsOk());
+    }
+  }
+  auto stats = t->GetSpaceStats();
+
+  // Only the leaves that aren't read keep their size
+  t->EnableHotnessTracking(true, 0);
+  std::string hot_key = std::to_string(100000 + kKeys / 2);
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < 100; ++i) {
+    ASSERT_TRUE(t->Read(hot_key.c_str(), hot_key.length(), &payload).IsOk());
+  }
+  std::string cursor;
+  uint32_t packed = 0;
+  while (t->PackColdLeaves(&cursor, 10, 10, &packed)) {
+  }
+  auto leaves = stats.nodes[stats.levels - 1];
+  ASSERT_GT(packed, leaves * 9 / 10);
+  ASSERT_LT(packed, leaves);
+  // The old leaves are still around (unreclaimed), compare the tree itself:
+  // leaves about 60% full had two thirds of their records deleted, so what's
+  // left takes a fifth of them, a quarter with headers and the hot leaf
+  auto after = t->GetSpaceStats();
+  ASSERT_EQ(after.records, kKeys / 3);
+  auto leaf_bytes = [](const bztree::BzTree::SpaceStats &s) {
+    return s.node_bytes[s.levels - 1];
+  };
+  ASSERT_LT(leaf_bytes(after) * 7 / 2, leaf_bytes(stats));
+  ASSERT_GT(leaf_bytes(after) * 9 / 2, leaf_bytes(stats));
+  ASSERT_LT(after.free_bytes, stats.free_bytes / 10);
+
+  // Packed leaves are searched as they are, and nothing is left to pack
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    auto rc = t->Read(key.c_str(), key.length(), &payload);
+    ASSERT_EQ(rc.IsOk(), i % 3 == 0);
+    ASSERT_TRUE(rc.IsOk() ? payload == i : rc.IsNotFound());
+  }
+  cursor.clear();
+  t->EnableHotnessTracking(false);
+  uint32_t repacked = 0;
+  while (t->PackColdLeaves(&cursor, 10, 0, &repacked)) {
+  }
+  ASSERT_LE(repacked, leaves - packed);
+
+  // Writes get full-sized leaves back
+  for (uint32_t i = 0; i < kKeys; i += 3) {
+    auto key = std::to_string(100000 + i) + "0";
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+    key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Update(key.c_str(), key.length(), i).IsOk());
+  }
+  for (uint32_t i = 0; i < kKeys; i += 3) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+    key += "0";
+    ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+  }
+  ASSERT_EQ(t->GetSpaceStats().records, 2 * kKeys / 3);
+}
+
+TEST_F(BzTreeTest, Tiering) {
+  auto path = testing::TempDir() + "bztree_tiering_test";
+  remove(path.c_str());
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 2000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  std::string cursor;
+  ASSERT_FALSE(t->EvictColdLeaves(&cursor, 10));
+  ASSERT_TRUE(t->EnableTiering("/nonexistent/bztree_tiering_test").IsIOError());
+  ASSERT_TRUE(t->EnableTiering(path.c_str()).IsOk());
+
+  // Everything is cold without hotness tracking
+  auto stats = t->GetSpaceStats();
+  auto leaves = stats.nodes[stats.levels - 1];
+  uint32_t evicted = 0;
+  while (t->EvictColdLeaves(&cursor, 10, 0, &evicted)) {
+  }
+  ASSERT_EQ(evicted, leaves);
+  ASSERT_EQ(t->GetEvictedLeaves(), leaves);
+  auto after = t->GetSpaceStats();
+  ASSERT_EQ(after.evicted_leaves, leaves);
+  ASSERT_EQ(after.records, 0);
+
+  // Counted off the pages, without loading them back
+  ASSERT_EQ(t->Count(nullptr, 0, nullptr, 0), kKeys);
+  auto lo = std::to_string(100000 + 100);
+  auto hi = std::to_string(100000 + 300);
+  ASSERT_EQ(t->Count(lo.c_str(), lo.length(), hi.c_str(), hi.length()), 200);
+  ASSERT_EQ(t->GetEvictedLeaves(), leaves);
+
+  // Loaded back by reads, writes and scans alike
+  uint64_t payload = 0;
+  auto key = std::to_string(100000 + kKeys / 2);
+  ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+  ASSERT_EQ(payload, kKeys / 2);
+  ASSERT_EQ(t->GetEvictedLeaves(), leaves - 1);
+  {
+    // Stepped, a step prefetches the page before the next one reads it
+    bztree::BzTree::Session session(t.get());
+    bztree::BzTree::SteppedOp op(&session);
+    key = std::to_string(100000);
+    op.Read(key.c_str(), key.length());
+    while (!op.Step()) {
+    }
+    ASSERT_TRUE(op.GetResult().IsOk());
+    ASSERT_EQ(op.GetPayload(), 0);
+    ASSERT_EQ(op.GetSteps(), stats.levels + 2);
+    ASSERT_EQ(t->GetEvictedLeaves(), leaves - 2);
+  }
+  for (uint32_t i = 0; i < kKeys; i += 2) {
+    key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Update(key.c_str(), key.length(), i + 1).IsOk());
+    key += "0";
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  cursor.clear();
+  while (t->EvictColdLeaves(&cursor, 10)) {
+  }
+  auto iter = t->RangeScanBySize("", 0, kKeys * 2);
+  uint32_t count = 0;
+  while (auto r = iter->GetNext()) {
+    ++count;
+  }
+  ASSERT_EQ(count, kKeys + kKeys / 2);
+  ASSERT_EQ(t->GetEvictedLeaves(), 0);
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i % 2 ? i : i + 1);
+  }
+  ASSERT_EQ(t->GetSpaceStats().records, kKeys + kKeys / 2);
+
+  // Leaves dropped by a range delete give their pages back without loading
+  cursor.clear();
+  while (t->EvictColdLeaves(&cursor, 10)) {
+  }
+  auto evicted_before = t->GetEvictedLeaves();
+  auto loads_before = t->GetStats().leaf_loads;
+  ASSERT_TRUE(t->DeleteRange("100200", 6, "101800", 6).IsOk());
+  auto gone = evicted_before - t->GetEvictedLeaves();
+  ASSERT_GT(gone, 2);
+#if ENABLE_STATS
+  // Only the leaves traversals reach are loaded: the ones at the ends of the
+  // range and the first of each parent's run
+  ASSERT_LT((t->GetStats().leaf_loads - loads_before) * 4, gone);
+#endif
+  ASSERT_GT(t->GetEvictedLeaves(), 0);
+  for (uint32_t i = 0; i < kKeys; i += 100) {
+    key = std::to_string(100000 + i);
+    auto rc = t->Read(key.c_str(), key.length(), &payload);
+    ASSERT_EQ(rc.IsOk(), i < 200 || i >= 1800);
+  }
+  t.reset();
+  remove(path.c_str());
+}
+
+TEST_F(BzTreeTest, DuplicateKeys) {
+  bztree::BzTree::ParameterSet param(1024, 512, 1024, 0, false, 0, false, 0, false, true);
+  std::unique_ptr<bztree::BzTree> index(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 100;
+  static const uint32_t kValues = 10;
+  for (uint32_t v = 0; v < kValues; ++v) {
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      auto key = std::to_string(1000 + i);
+      ASSERT_TRUE(index->Insert(key.c_str(), key.length(), i * kValues + v).IsOk());
+    }
+  }
+  // With more in one batch
+  std::string batch_key = std::to_string(1000 + kKeys);
+  const char *keys[] = {batch_key.c_str(), batch_key.c_str()};
+  const uint16_t key_sizes[] = {4, 4};
+  const uint64_t payloads[] = {kKeys * kValues, kKeys * kValues + 1};
+  bztree::ReturnCode rcs[2];
+  index->InsertBatch(keys, key_sizes, payloads, 2, rcs);
+  ASSERT_TRUE(rcs[0].IsOk());
+  ASSERT_TRUE(rcs[1].IsOk());
+
+  // Leaves were split without separating the records of a key
+  std::vector<std::set<uint64_t>> values(kKeys + 1);
+  auto iter = index->RangeScanByKey(nullptr, 0, true, nullptr, 0, false);
+  std::string last;
+  while (auto r = iter->GetNext()) {
+    std::string key(r->GetKey(), r->meta.GetKeyLength());
+    ASSERT_LE(last, key);
+    last = key;
+    auto i = std::stoul(key) - 1000;
+    ASSERT_EQ(r->GetPayload() / kValues, i);
+    ASSERT_TRUE(values[i].insert(r->GetPayload()).second);
+  }
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    ASSERT_EQ(values[i].size(), kValues);
+    auto key = std::to_string(1000 + i);
+    uint64_t payload = 0;
+    ASSERT_TRUE(index->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload / kValues, i);
+  }
+  ASSERT_EQ(values[kKeys].size(), 2);
+
+  // A key's records go on over as many leaves as they take, between keys
+  // on either side, and all of them are found wherever they ended up
+  static const uint32_t kHotValues = 3000;
+  ASSERT_TRUE(index->Insert("4999", 4, 0).IsOk());
+  ASSERT_TRUE(index->Insert("5001", 4, 0).IsOk());
+  for (uint32_t v = 0; v < kHotValues; ++v) {
+    ASSERT_TRUE(index->Insert("5000", 4, v).IsOk());
+  }
+  bztree::Stack stack;
+  stack.tree = index.get();
+  auto *first_leaf = index->TraverseToLeaf(&stack, "5000", 4);
+  stack.Clear();
+  ASSERT_NE(first_leaf, index->TraverseToLeaf(&stack, "5001", 4));
+  auto scan = [&](bool reverse, bool inclusive) {
+    std::set<uint64_t> found;
+    auto iter = reverse ? index->ReverseRangeScanByKey("4999", 4, inclusive, "5000", 4, true)
+                        : index->RangeScanByKey("5000", 4, true, "5001", 4, inclusive);
+    while (auto r = iter->GetNext()) {
+      std::string key(r->GetKey(), r->meta.GetKeyLength());
+      if (key == "5000") {
+        EXPECT_TRUE(found.insert(r->GetPayload()).second);
+      } else {
+        EXPECT_EQ(key, reverse ? "4999" : "5001");
+        EXPECT_TRUE(inclusive);
+      }
+    }
+    return found.size();
+  };
+  ASSERT_EQ(scan(false, false), kHotValues);
+  ASSERT_EQ(scan(false, true), kHotValues);
+  ASSERT_EQ(scan(true, false), kHotValues);
+  ASSERT_EQ(scan(true, true), kHotValues);
+  auto after = index->RangeScanByKey("5000", 4, false, nullptr, 0, false);
+  auto next = after->GetNext();
+  ASSERT_TRUE(next);
+  ASSERT_EQ(std::string(next->GetKey(), next->meta.GetKeyLength()), "5001");
+  bztree::ScanBuffer buffer;
+  ASSERT_TRUE(index->RangeScanBySize("5000", 4, kHotValues + 1, &buffer).IsOk());
+  ASSERT_EQ(buffer.Count(), kHotValues + 1);
+  ASSERT_EQ(index->Count("5000", 4, "5001", 4), kHotValues);
+
+  // Reads, updates and deletes get to the records left in later leaves once
+  // those in the first ones are gone
+  uint64_t payload = 0;
+  ASSERT_TRUE(index->Update("5000", 4, kHotValues).IsOk());
+  for (uint32_t v = 0; v < kHotValues; ++v) {
+    ASSERT_TRUE(index->Read("5000", 4, &payload).IsOk());
+    ASSERT_TRUE(index->Delete("5000", 4).IsOk());
+  }
+  ASSERT_TRUE(index->Read("5000", 4, &payload).IsNotFound());
+  ASSERT_TRUE(index->Delete("5000", 4).IsNotFound());
+  ASSERT_TRUE(index->Read("5001", 4, &payload).IsOk());
+
+  // Same for a range delete across the run
+  for (uint32_t v = 0; v < kHotValues; ++v) {
+    ASSERT_TRUE(index->Insert("6000", 4, v).IsOk());
+  }
+  ASSERT_TRUE(index->Upsert("6000", 4, kHotValues).IsOk());
+  ASSERT_EQ(index->Count("6000", 4, "6001", 4), kHotValues);
+  ASSERT_TRUE(index->DeleteRange("5001", 4, "6001", 4).IsOk());
+  ASSERT_EQ(index->Count("5001", 4, nullptr, 0), 0);
+  ASSERT_TRUE(index->Read("4999", 4, &payload).IsOk());
+}
+
 TEST_F(BzTreeTest, Upsert) {
   uint64_t payload;
   InsertDummy();
@@ -266,6 +1407,73 @@ TEST_F(BzTreeTest, Upsert) {
   ASSERT_TRUE(tree->Upsert("20", 2, 21).IsOk());
   ASSERT_TRUE(tree->Read("20", 2, &payload).IsOk());
   ASSERT_EQ(payload, 21);
+
+  // Enough new keys to split leaves on the way, then overwrite them all,
+  // switching between 8-byte and variable-length payloads
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 2000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Upsert(key.c_str(), key.length(), i).IsOk());
+  }
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    auto value = "v" + std::to_string(i);
+    ASSERT_TRUE(i % 2 ? t->Upsert(key.c_str(), key.length(), value.c_str(), value.length()).IsOk()
+                      : t->Upsert(key.c_str(), key.length(), i + 1).IsOk());
+  }
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    char value[16];
+    uint32_t value_size = sizeof(value);
+    if (i % 2) {
+      ASSERT_TRUE(t->Read(key.c_str(), key.length(), value, &value_size).IsOk());
+      ASSERT_EQ(std::string(value, value_size), "v" + std::to_string(i));
+    } else {
+      ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+      ASSERT_EQ(payload, i + 1);
+    }
+  }
+  auto iter = t->RangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+  uint32_t count = 0;
+  while (iter->GetNext()) {
+    ++count;
+  }
+  ASSERT_EQ(count, kKeys);
+}
+
+TEST_F(BzTreeTest, CompareAndSwap) {
+  InsertDummy();
+  uint64_t payload = 0;
+  uint64_t expected = 7;
+  ASSERT_TRUE(tree->CompareAndSwap("20", 2, &expected, 100).IsValueMismatch());
+  ASSERT_EQ(expected, 20);
+  ASSERT_TRUE(tree->CompareAndSwap("20", 2, &expected, 100).IsOk());
+  ASSERT_TRUE(tree->Read("20", 2, &payload).IsOk());
+  ASSERT_EQ(payload, 100);
+  ASSERT_TRUE(tree->CompareAndSwap("abc", 3, &expected, 1).IsNotFound());
+
+  ASSERT_TRUE(tree->FetchAdd("20", 2, 5, &payload).IsOk());
+  ASSERT_EQ(payload, 100);
+  ASSERT_TRUE(tree->FetchAdd("20", 2, static_cast<uint64_t>(-6)).IsOk());
+  ASSERT_TRUE(tree->Read("20", 2, &payload).IsOk());
+  ASSERT_EQ(payload, 99);
+  ASSERT_TRUE(tree->FetchAdd("abc", 3, 1).IsNotFound());
+
+  // Only 8-byte payloads can be modified in place
+  ASSERT_TRUE(tree->Insert("var", 3, "0123456789", 10).IsOk());
+  ASSERT_TRUE(tree->FetchAdd("var", 3, 1).IsNotEnoughSpace());
+  ASSERT_TRUE(tree->CompareAndSwap("var", 3, &expected, 1).IsNotEnoughSpace());
+
+  bztree::BzTreeT<bztree::U64KeyPolicy> typed(tree);
+  ASSERT_TRUE(typed.Insert(12345, 1).IsOk());
+  ASSERT_TRUE(typed.FetchAdd(12345, 2, &payload).IsOk());
+  ASSERT_EQ(payload, 1);
+  expected = 3;
+  ASSERT_TRUE(typed.CompareAndSwap(12345, &expected, 10).IsOk());
+  ASSERT_TRUE(typed.Read(12345, &payload).IsOk());
+  ASSERT_EQ(payload, 10);
 }
 
 TEST_F(BzTreeTest, Delete) {
@@ -288,26 +1496,709 @@ TEST_F(BzTreeTest, Delete) {
   tree->Dump();
 }
 
-
-TEST_F(BzTreeTest, RangeScanBySize) {
-  static const uint32_t kMaxKey = 9999;
-  for (uint32_t i = 1000; i <= kMaxKey; i++) {
-    auto key = std::to_string(i);
-    tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i);
-  }
-
-  auto iter = tree->RangeScanBySize("9000", 4, 100);
-  int count = 0;
-  while (true) {
-    auto r = iter->GetNext();
-    if (!r) {
-      break;
+TEST_F(BzTreeTest, ConsolidateInsteadOfSplit) {
+  // Fill the root leaf, delete everything and fill it up again: the deleted
+  // space should be reclaimed by consolidation instead of splitting the leaf
+  for (uint32_t round = 0; round < 5; ++round) {
+    for (uint32_t i = 0; i < 8; ++i) {
+      std::string key = std::to_string(round * 10 + i);
+      ASSERT_TRUE(tree->Insert(key.c_str(), key.length(), i).IsOk());
+    }
+    for (uint32_t i = 0; i < 8; ++i) {
+      std::string key = std::to_string(round * 10 + i);
+      ASSERT_TRUE(tree->Delete(key.c_str(), key.length()).IsOk());
     }
-    ++count;
-    std::string key_str(r->GetKey(), 4);
-//    LOG(INFO) << count << " key=" << key_str << std::endl;
   }
-  ASSERT_EQ(count, 100);
+  std::string key = std::to_string(42);
+  ASSERT_TRUE(tree->Insert(key.c_str(), key.length(), 42).IsOk());
+
+  bztree::Stack stack;
+  tree->TraverseToLeaf(&stack, key.c_str(), key.length());
+  ASSERT_TRUE(stack.IsEmpty());
+
+  uint64_t payload = 0;
+  ASSERT_TRUE(tree->Read(key.c_str(), key.length(), &payload).IsOk());
+  ASSERT_EQ(payload, 42);
+  ASSERT_TRUE(tree->Read("40", 2, &payload).IsNotFound());
+
+#if ENABLE_STATS
+  auto stats = tree->GetStats();
+  ASSERT_GT(stats.consolidations, 0);
+  ASSERT_EQ(stats.leaf_splits, 0);
+#endif
+}
+
+TEST_F(BzTreeTest, Stats) {
+  bztree::BzTree::ParameterSet param(1024, 0, 1024, 0, false, 256);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  auto stats = t->GetStats();
+  ASSERT_EQ(stats.leaf_splits + stats.internal_splits + stats.consolidations + stats.merges +
+            stats.smo_failures + stats.freeze_retries + stats.pmwcas_failures, 0);
+
+  static const uint32_t kKeys = 5000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  stats = t->GetStats();
+#if ENABLE_STATS
+  // Each split adds one leaf to the single root leaf, and the tree grew at
+  // least two levels of internal nodes
+  bztree::Stack stack;
+  stack.tree = t.get();
+  t->TraverseToLeaf(&stack, "100000", 6);
+  ASSERT_GE(stack.num_frames, 2);
+  ASSERT_GT(stats.leaf_splits, kKeys / 64);
+  ASSERT_GT(stats.internal_splits, 0);
+  ASSERT_LT(stats.internal_splits, stats.leaf_splits);
+  ASSERT_EQ(stats.smo_failures, 0);
+  ASSERT_EQ(stats.pmwcas_failures, 0);
+
+  // Two descriptors per insert (reserve and finalize), plus those of the
+  // splits; the last insert's are counted with the next traversal
+  ASSERT_GE(stats.descriptor_allocations, 2 * (kKeys - 1) + stats.leaf_splits);
+  ASSERT_LE(stats.slow_descriptor_allocations, stats.descriptor_allocations);
+  ASSERT_EQ(stats.descriptor_aborts, 0);
+#else
+  ASSERT_EQ(stats.leaf_splits, 0);
+#endif
+}
+
+TEST_F(BzTreeTest, AppendSplits) {
+  // The same keys inserted in order and shuffled: appends leave full leaves
+  // and internal nodes behind, random inserts leave them about 70% full (even
+  // splits of appends, half full)
+  bztree::BzTree::ParameterSet param(1024, 0, 1024, 0, false, 256);
+  std::unique_ptr<bztree::BzTree> appended(bztree::BzTree::New(param, pool));
+  std::unique_ptr<bztree::BzTree> shuffled(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 20000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(appended->Insert(key.c_str(), key.length(), i).IsOk());
+    auto k = (i * 7919) % kKeys;
+    key = std::to_string(100000 + k);
+    ASSERT_TRUE(shuffled->Insert(key.c_str(), key.length(), k).IsOk());
+  }
+  for (auto *t : {appended.get(), shuffled.get()}) {
+    uint32_t count = 0;
+    auto iter = t->RangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+    while (auto r = iter->GetNext()) {
+      ASSERT_EQ(r->GetPayload(), count++);
+    }
+    ASSERT_EQ(count, kKeys);
+  }
+
+  // A key out of order splits the full leaf it goes to evenly
+  ASSERT_TRUE(appended->Delete("100500", 6).IsOk());
+  ASSERT_TRUE(appended->Insert("100500", 6, 500).IsOk());
+  for (uint32_t i = 0; i < 10; ++i) {
+    auto key = std::to_string(100500) + std::to_string(i);
+    ASSERT_TRUE(appended->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  uint64_t payload = 0;
+  ASSERT_TRUE(appended->Read("100500", 6, &payload).IsOk());
+  ASSERT_EQ(payload, 500);
+#if ENABLE_STATS
+  auto append_stats = appended->GetStats();
+  auto shuffle_stats = shuffled->GetStats();
+  ASSERT_LT(append_stats.leaf_splits * 10, shuffle_stats.leaf_splits * 8);
+  ASSERT_LT(append_stats.internal_splits, shuffle_stats.internal_splits);
+#endif
+}
+
+TEST_F(BzTreeTest, AdaptiveSplits) {
+  // Keys inserted in descending order, and in ascending order in the middle
+  // of existing ones, with even and with adaptive splits
+  static const uint32_t kKeys = 10000;
+  static const uint32_t kOlder = 1000;
+  auto load = [&](bool adaptive, bool descending) {
+    bztree::BzTree::ParameterSet param(1024, 0, 1024, 0, false, 256, adaptive);
+    std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+    std::vector<std::string> keys;
+    if (!descending) {
+      for (uint32_t i = 0; i < kOlder; ++i) {
+        auto key = std::to_string(1000 + (i * 7919) % kOlder) + "0000";
+        keys.push_back(key);
+        EXPECT_TRUE(t->Insert(key.c_str(), key.length(), 0).IsOk());
+      }
+    }
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      auto key = descending ? std::to_string(2000000 - i) : "1500" + std::to_string(10000 + i);
+      keys.push_back(key);
+      EXPECT_TRUE(t->Insert(key.c_str(), key.length(), 0).IsOk());
+    }
+    std::sort(keys.begin(), keys.end());
+    uint32_t count = 0;
+    auto iter = t->RangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+    while (auto r = iter->GetNext()) {
+      EXPECT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), keys[count++]);
+    }
+    EXPECT_EQ(count, keys.size());
+    return t->GetStats().leaf_splits;
+  };
+  for (bool descending : {true, false}) {
+    auto even = load(false, descending);
+    auto adaptive = load(true, descending);
+#if ENABLE_STATS
+    ASSERT_LT(adaptive * 10, even * 8);
+#endif
+  }
+}
+
+// With a sorted insert threshold, no leaf is left with that many records in
+// its unsorted field
+TEST_F(BzTreeTest, SortedInserts) {
+  static const uint32_t kThreshold = 8;
+  bztree::BzTree::ParameterSet param(1024, 0, 1024, 0, false, 0, false, kThreshold);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < 2000; ++i) {
+    keys.push_back(std::to_string(100000 + (i * 7919) % 2000));
+    ASSERT_TRUE(t->Insert(keys.back().c_str(), keys.back().length(), i).IsOk());
+  }
+  bztree::Stack stack;
+  stack.tree = t.get();
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    uint64_t payload = 0;
+    ASSERT_TRUE(t->Read(keys[i].c_str(), keys[i].length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+    stack.Clear();
+    auto *header = t->TraverseToLeaf(&stack, keys[i].c_str(), keys[i].length())->GetHeader();
+    ASSERT_LT(header->GetStatus().GetRecordCount() - header->sorted_count, kThreshold);
+  }
+  std::sort(keys.begin(), keys.end());
+  uint32_t count = 0;
+  auto iter = t->RangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+  while (auto r = iter->GetNext()) {
+    ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), keys[count++]);
+  }
+  ASSERT_EQ(count, keys.size());
+}
+
+// A leaf left frozen, as by a thread preempted in the middle of a split, is
+// split by the next thread that needs it after a while
+TEST_F(BzTreeTest, HelpStalledSplit) {
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  for (auto policy : {bztree::ContentionManager::kBackoff, bztree::ContentionManager::kHelp}) {
+    bztree::ContentionManager::SetPolicy(policy);
+    std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+    for (uint32_t i = 0; i < 200; ++i) {
+      auto key = std::to_string(100000 + i);
+      ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+    }
+    bztree::Stack stack;
+    stack.tree = t.get();
+    auto *leaf = t->TraverseToLeaf(&stack, "100000", 6);
+    ASSERT_FALSE(stack.IsEmpty());
+    ASSERT_TRUE(leaf->Freeze(pool));
+
+    auto before = t->GetStats();
+    ASSERT_TRUE(t->Insert("1000000", 7, 1).IsOk());
+    uint64_t payload = 0;
+    ASSERT_TRUE(t->Read("100000", 6, &payload).IsOk());
+    ASSERT_EQ(payload, 0);
+#if ENABLE_STATS
+    auto after = t->GetStats();
+    if (policy == bztree::ContentionManager::kBackoff) {
+      ASSERT_EQ(after.smo_helps, before.smo_helps + 1);
+    } else {
+      ASSERT_EQ(after.smo_helps, before.smo_helps);
+      ASSERT_EQ(after.freeze_retries, before.freeze_retries);
+    }
+    ASSERT_EQ(after.consolidations + after.leaf_splits,
+              before.consolidations + before.leaf_splits + 1);
+#endif
+  }
+  bztree::ContentionManager::SetPolicy(bztree::ContentionManager::kBackoff);
+}
+
+TEST_F(BzTreeTest, BackgroundMaintenance) {
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  t->StartMaintenance(2);
+  // Leaves are split in the background before they fill up
+  static const uint32_t kKeys = 3000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+    t->WaitForMaintenance();
+  }
+#if ENABLE_STATS
+  auto stats = t->GetStats();
+  ASSERT_GT(stats.leaf_splits, 0);
+  ASSERT_EQ(stats.background_smos, stats.leaf_splits + stats.consolidations);
+#endif
+
+  // And without waiting for them
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(200000 + i);
+    ASSERT_TRUE(t->Upsert(key.c_str(), key.length(), i).IsOk());
+  }
+  t->StopMaintenance();
+  t->StopMaintenance();
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    uint64_t payload = 0;
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+    key = std::to_string(200000 + i);
+    ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+  }
+}
+
+TEST_F(BzTreeTest, Compact) {
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 5000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  auto depth = [&]() {
+    bztree::Stack stack;
+    stack.tree = t.get();
+    t->TraverseToLeaf(&stack, "100000", 6);
+    return stack.num_frames;
+  };
+  auto before = depth();
+  ASSERT_GE(before, 2);
+
+  // Leave every 100th key of the first half and nothing of the second
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    if (i >= kKeys / 2 || i % 100) {
+      auto key = std::to_string(100000 + i);
+      ASSERT_TRUE(t->Delete(key.c_str(), key.length()).IsOk());
+    }
+  }
+  std::string cursor;
+  uint32_t steps = 0;
+  for (uint32_t pass = 0; pass < 5; ++pass) {
+    while (t->Compact(&cursor, 8)) {
+      ++steps;
+    }
+    cursor.clear();
+  }
+  ASSERT_GT(steps, 1);
+#if ENABLE_STATS
+  ASSERT_GT(t->GetStats().merges, 0);
+#endif
+  ASSERT_LT(depth(), before);
+
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    uint64_t payload = 0;
+    auto key = std::to_string(100000 + i);
+    auto rc = t->Read(key.c_str(), key.length(), &payload);
+    ASSERT_EQ(rc.IsOk(), i < kKeys / 2 && i % 100 == 0);
+  }
+  // In the background
+  std::unique_ptr<bztree::BzTree> t2(bztree::BzTree::New(param, pool));
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t2->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t2->Delete(key.c_str(), key.length()).IsOk());
+  }
+  t2->StartMaintenance(0, 0.9, 1000000);
+#if ENABLE_STATS
+  for (uint32_t i = 0; i < 1000 && t2->GetStats().merges == 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  ASSERT_GT(t2->GetStats().merges, 0);
+#endif
+  t2->StopMaintenance();
+
+  // Still takes new keys everywhere
+  for (uint32_t i = 0; i < kKeys; i += 7) {
+    auto key = std::to_string(100000 + i);
+    t->Upsert(key.c_str(), key.length(), i);
+  }
+  for (uint32_t i = 0; i < kKeys; i += 7) {
+    uint64_t payload = 0;
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+  }
+}
+
+TEST_F(BzTreeTest, DeleteRange) {
+  for (bool prefix_compression : {false, true}) {
+    bztree::BzTree::ParameterSet param(1024, 512, 1024, 0, prefix_compression);
+    std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+    static const uint32_t kKeys = 20000;
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      auto key = std::to_string(100000 + (i * 7919) % kKeys);
+      ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+    }
+    auto in_range = [](uint32_t i) {
+      return (i >= 1234 && i < 15678) || (i >= 17000 && i < 17010);
+    };
+    ASSERT_TRUE(t->DeleteRange("101234", 6, "115678", 6).IsOk());
+    ASSERT_TRUE(t->DeleteRange("117000", 6, "117010", 6).IsOk());
+    // Empty ranges and ranges past all keys
+    ASSERT_TRUE(t->DeleteRange("101000", 6, "101000", 6).IsOk());
+    ASSERT_TRUE(t->DeleteRange("9", 1, "1", 1).IsOk());
+    ASSERT_TRUE(t->DeleteRange("200000", 6, "300000", 6).IsOk());
+#if ENABLE_STATS
+    auto stats = t->GetStats();
+    ASSERT_GT(stats.dropped_leaves, 0);
+    ASSERT_GT(stats.consolidations, 0);
+#endif
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      uint64_t payload = 0;
+      auto key = std::to_string(100000 + i);
+      auto rc = t->Read(key.c_str(), key.length(), &payload);
+      ASSERT_EQ(rc.IsOk(), !in_range(i));
+    }
+    auto iter = t->RangeScanByKey("100000", 6, true, "200000", 6, false);
+    uint32_t count = 0;
+    while (auto record = iter->GetNext()) {
+      ++count;
+    }
+    ASSERT_EQ(count, kKeys - (15678 - 1234) - 10);
+
+    // The empty leaves left behind take keys and merge away
+    for (uint32_t i = 2000; i < 3000; ++i) {
+      auto key = std::to_string(100000 + i);
+      ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+    }
+    std::string cursor;
+    while (t->Compact(&cursor, 64)) {
+    }
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      uint64_t payload = 0;
+      auto key = std::to_string(100000 + i);
+      auto rc = t->Read(key.c_str(), key.length(), &payload);
+      ASSERT_EQ(rc.IsOk(), !in_range(i) || (i >= 2000 && i < 3000));
+    }
+
+    // Everything, down to an empty tree
+    ASSERT_TRUE(t->DeleteRange("", 0, "2", 1).IsOk());
+    iter = t->RangeScanByKey("", 0, true, "9", 1, false);
+    ASSERT_EQ(iter->GetNext(), nullptr);
+    ASSERT_TRUE(t->Insert("100000", 6, 1).IsOk());
+  }
+}
+
+TEST_F(BzTreeTest, ReservationLanes) {
+  bztree::BzTree::ParameterSet param(1024, 512, 1024, 0, false, 0, false, 0, false, false, false,
+                                     bztree::LeafNode::kMaxLanes);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 5000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsKeyExists());
+  }
+  // Leaves built by splits and consolidations keep their lanes
+  for (uint32_t i = 0; i < kKeys; i += 97) {
+    bztree::Stack stack;
+    auto key = std::to_string(100000 + i);
+    auto *leaf = t->TraverseToLeaf(&stack, key.c_str(), key.length());
+    ASSERT_FALSE(stack.IsEmpty());
+    ASSERT_EQ(leaf->GetLaneCount(), bztree::LeafNode::kMaxLanes);
+    for (uint32_t lane = 0; lane < leaf->GetLaneCount(); ++lane) {
+      ASSERT_FALSE(leaf->GetLaneStatus(lane).IsFrozen());
+    }
+  }
+
+  // Dropping leaves freezes their lanes too, in as many PMwCASs as it takes
+  ASSERT_TRUE(t->DeleteRange("101000", 6, "104000", 6).IsOk());
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    uint64_t payload = 0;
+    auto key = std::to_string(100000 + i);
+    ASSERT_EQ(t->Read(key.c_str(), key.length(), &payload).IsOk(), i < 1000 || i >= 4000);
+  }
+  for (uint32_t i = 1000; i < 4000; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Upsert(key.c_str(), key.length(), i).IsOk());
+  }
+  auto iter = t->RangeScanByKey("100000", 6, true, "200000", 6, false);
+  uint32_t count = 0;
+  while (auto record = iter->GetNext()) {
+    ++count;
+  }
+  ASSERT_EQ(count, kKeys);
+
+  // Packed leaves have none, and get them back with the first write
+  std::string cursor;
+  while (t->PackColdLeaves(&cursor, 10)) {
+  }
+  auto lanes = [&](const std::string &key) {
+    bztree::Stack stack;
+    return t->TraverseToLeaf(&stack, key.c_str(), key.length())->GetLaneCount();
+  };
+  std::string key = "100500";
+  ASSERT_EQ(lanes(key), 0);
+  for (uint32_t i = 0; i < 100; ++i) {
+    auto new_key = key + std::to_string(i);
+    ASSERT_TRUE(t->Insert(new_key.c_str(), new_key.length(), i).IsOk());
+  }
+  ASSERT_EQ(lanes(key), bztree::LeafNode::kMaxLanes);
+
+  // More than there can be are taken as that many
+  bztree::BzTree::ParameterSet many(1024, 512, 1024, 0, false, 0, false, 0, false, false,
+                                    false, bztree::LeafNode::kMaxLanes + 1);
+  ASSERT_EQ(many.leaf_lanes, bztree::LeafNode::kMaxLanes);
+}
+
+TEST_F(BzTreeTest, InternalNodeCache) {
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 20000;
+  auto insert = [&](uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; ++i) {
+      auto key = std::to_string(100000 + (i * 7919) % kKeys);
+      ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+    }
+  };
+  auto read_all = [&](uint32_t end) {
+    for (uint32_t i = 0; i < end; ++i) {
+      uint64_t payload = 0;
+      auto key = std::to_string(100000 + (i * 7919) % kKeys);
+      ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+      ASSERT_EQ(payload, i);
+    }
+  };
+  insert(0, kKeys / 2);
+  t->EnableInternalNodeCache(true);
+#if ENABLE_STATS
+  auto copies = t->GetStats().internal_node_copies;
+  ASSERT_GT(copies, 0);
+#endif
+  read_all(kKeys / 2);
+
+  // Nodes built by splits while the cache is on are copied on first use, and
+  // the copies of replaced nodes go with them
+  insert(kKeys / 2, kKeys);
+  read_all(kKeys);
+#if ENABLE_STATS
+  ASSERT_GT(t->GetStats().internal_node_copies, copies);
+#endif
+  ASSERT_TRUE(t->DeleteRange("101000", 6, "119000", 6).IsOk());
+  uint64_t payload = 0;
+  ASSERT_TRUE(t->Read("100999", 6, &payload).IsOk());
+  ASSERT_TRUE(t->Read("101000", 6, &payload).IsNotFound());
+  ASSERT_TRUE(t->Read("119000", 6, &payload).IsOk());
+
+  t->EnableInternalNodeCache(false);
+  ASSERT_TRUE(t->Read("100999", 6, &payload).IsOk());
+  ASSERT_TRUE(t->Read("118999", 6, &payload).IsNotFound());
+  t->EnableInternalNodeCache(true);
+}
+
+// Searches of a copy through its key heads find the same children as searches
+// of the node, also among keys that tie on their heads and past the prefix
+// all separators share
+TEST_F(BzTreeTest, InternalNodeKeyHeads) {
+  std::vector<std::string> suffixes = {"a", std::string("a\0", 2), "abcdefgh", "abcdefgh1",
+                                       "abcdefgh2", "abcdefgi", "b", "bcdefghijklm", "c"};
+  for (std::string prefix : {"", "user"}) {
+    std::vector<std::string> keys = {""};
+    for (auto &suffix : suffixes) {
+      keys.push_back(prefix + suffix);
+    }
+    std::vector<const char *> key_ptrs;
+    std::vector<uint16_t> key_sizes;
+    std::vector<uint64_t> children;
+    for (auto &key : keys) {
+      key_ptrs.push_back(key.data());
+      key_sizes.push_back(static_cast<uint16_t>(key.size()));
+      children.push_back(children.size());
+    }
+    uint32_t count = static_cast<uint32_t>(keys.size());
+    uint32_t size = bztree::InternalNode::GetNodeSize(key_sizes.data(), count);
+    std::vector<uint64_t> image(size / sizeof(uint64_t) + 1);
+    bztree::InternalNode::Build(key_ptrs.data(), key_sizes.data(), children.data(), count,
+                                reinterpret_cast<char *>(image.data()));
+    std::vector<uint64_t> copy_image(bztree::InternalNode::GetCopySize(size, count) / 8 + 1);
+    memcpy(copy_image.data(), image.data(), size);
+    auto *node = reinterpret_cast<bztree::InternalNode *>(image.data());
+    auto *copy = reinterpret_cast<bztree::InternalNode *>(copy_image.data());
+    copy->BuildKeyHeads();
+
+    std::vector<std::string> probes = {"", std::string("\0", 1), "0", "z", "use", "usez",
+                                       prefix + "abcdefgh0", prefix + "abcdefg"};
+    for (uint32_t i = 1; i < count; ++i) {
+      probes.push_back(keys[i]);
+      probes.push_back(keys[i] + std::string("\0", 1));
+      probes.push_back(keys[i].substr(0, keys[i].size() - 1));
+    }
+    for (auto &probe : probes) {
+      for (bool get_le : {true, false}) {
+        ASSERT_EQ(copy->GetChildIndex(probe.data(), probe.size(), get_le),
+                  node->GetChildIndex(probe.data(), probe.size(), get_le));
+      }
+    }
+  }
+}
+
+// Searches of nodes with a search model find the same children as binary
+// searches of the node built without one; nodes of skewed separators get none
+TEST_F(BzTreeTest, InternalNodeSearchModel) {
+  std::mt19937_64 rng(11);
+  for (uint32_t round = 0; round < 40; ++round) {
+    // Evenly spread with some jitter, or all close together but for the last
+    bool skewed = round % 4 == 3;
+    uint32_t count = 40 + rng() % 90;
+    std::vector<bztree::U64KeyPolicy::EncodedKey> keys(count);
+    std::vector<uint64_t> words(count);
+    uint64_t step = uint64_t{1} << (8 + rng() % 40);
+    for (uint32_t i = 1; i < count; ++i) {
+      words[i] = skewed ? (i + 1 < count ? i : step * count) : i * step + rng() % (step / 2);
+      keys[i] = bztree::U64KeyPolicy::Encode(words[i]);
+    }
+    std::vector<const char *> key_ptrs;
+    std::vector<uint16_t> key_sizes;
+    std::vector<uint64_t> children;
+    for (uint32_t i = 0; i < count; ++i) {
+      key_ptrs.push_back(bztree::U64KeyPolicy::GetData(keys[i]));
+      key_sizes.push_back(i ? 8 : 0);
+      children.push_back(i);
+    }
+    uint32_t size = bztree::InternalNode::GetNodeSize(key_sizes.data(), count);
+    std::vector<uint64_t> image(size / sizeof(uint64_t) + 1);
+    std::vector<uint64_t> plain_image(size / sizeof(uint64_t) + 1);
+    bztree::InternalNode::Build(key_ptrs.data(), key_sizes.data(), children.data(), count,
+                                reinterpret_cast<char *>(image.data()));
+    bztree::InternalNode::EnableSearchModels(false);
+    bztree::InternalNode::Build(key_ptrs.data(), key_sizes.data(), children.data(), count,
+                                reinterpret_cast<char *>(plain_image.data()));
+    bztree::InternalNode::EnableSearchModels(true);
+    auto *node = reinterpret_cast<bztree::InternalNode *>(image.data());
+    auto *plain = reinterpret_cast<bztree::InternalNode *>(plain_image.data());
+    ASSERT_EQ(node->HasSearchModel(), !skewed);
+    ASSERT_FALSE(plain->HasSearchModel());
+
+    std::vector<uint64_t> probes = {0, 1, words[count - 1] + 1,
+                                    std::numeric_limits<uint64_t>::max()};
+    for (uint32_t i = 1; i < count; ++i) {
+      probes.push_back(words[i]);
+      probes.push_back(words[i] - 1);
+      probes.push_back(words[i] + 1);
+      probes.push_back(words[i - 1] + rng() % (words[i] - words[i - 1]));
+    }
+    for (auto probe : probes) {
+      auto encoded = bztree::U64KeyPolicy::Encode(probe);
+      auto *k = bztree::U64KeyPolicy::GetData(encoded);
+      for (bool get_le : {true, false}) {
+        auto expected = plain->GetChildIndex(k, 8, get_le);
+        ASSERT_EQ(node->GetChildIndex(k, 8, get_le), expected);
+        ASSERT_EQ(node->GetChildIndex<bztree::U64KeyPolicy>(k, 8, get_le), expected);
+        ASSERT_EQ(plain->GetChildIndex<bztree::U64KeyPolicy>(k, 8, get_le), expected);
+      }
+    }
+  }
+}
+
+#ifdef PMEM
+TEST_F(BzTreeTest, RecoveryDropsInternalNodeCache) {
+  static const uint32_t kKeys = 2000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(10000 + i);
+    ASSERT_TRUE(tree->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  tree->EnableInternalNodeCache(true);
+
+  // As if restarted: the copies (leaked here) are as good as gone, and their
+  // pointers are told stale without being cleared
+  tree->Recovery();
+  auto check = [&]() {
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      uint64_t payload = 0;
+      auto key = std::to_string(10000 + i);
+      ASSERT_TRUE(tree->Read(key.c_str(), key.length(), &payload).IsOk());
+      ASSERT_EQ(payload, i);
+    }
+  };
+  check();
+  tree->EnableInternalNodeCache(true);
+#if ENABLE_STATS
+  ASSERT_GT(tree->GetStats().internal_node_copies, 0);
+#endif
+  check();
+}
+
+TEST_F(BzTreeTest, RecoveryClearsRecordEstimates) {
+  static const uint32_t kKeys = 20000;
+  bztree::BzTree::ParameterSet param(1024, 512, 1024, 0, false, 0, false, 0, false, false, true);
+  std::unique_ptr<bztree::BzTree> counted(bztree::BzTree::New(param, pool));
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(counted->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i).IsOk());
+  }
+  ASSERT_NEAR(static_cast<double>(counted->Count(nullptr, 0, nullptr, 0)), kKeys, kKeys * 0.1);
+
+  // The cached counts miss the deletes, as they would writes lost to a crash
+  for (uint32_t i = 0; i < kKeys / 2; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(counted->Delete(key.c_str(), static_cast<uint16_t>(key.length())).IsOk());
+  }
+  ASSERT_GT(counted->Count(nullptr, 0, nullptr, 0), kKeys * 3 / 4);
+  counted->Recovery(false);
+  ASSERT_NEAR(static_cast<double>(counted->Count(nullptr, 0, nullptr, 0)), kKeys / 2,
+              kKeys * 0.05);
+}
+#endif
+
+TEST_F(BzTreeTest, VarPayload) {
+  bztree::BzTree::ParameterSet param(3072, 1024, 4096);
+  std::unique_ptr<bztree::BzTree> var_tree(bztree::BzTree::New(param, pool));
+  auto value_of = [](uint32_t i, uint32_t round) {
+    return std::string(64 + (i * 7 + round * 13) % 449, static_cast<char>('a' + (i + round) % 26));
+  };
+
+  static const uint32_t kMaxKey = 2000;
+  for (uint32_t i = 0; i < kMaxKey; ++i) {
+    std::string key = std::to_string(i);
+    auto value = value_of(i, 0);
+    ASSERT_TRUE(var_tree->Insert(key.c_str(), key.length(), value.c_str(), value.size()).IsOk());
+  }
+  // Change the size of half of the values, which splits more leaves
+  for (uint32_t i = 0; i < kMaxKey; i += 2) {
+    std::string key = std::to_string(i);
+    auto value = value_of(i, 1);
+    ASSERT_TRUE(var_tree->Update(key.c_str(), key.length(), value.c_str(), value.size()).IsOk());
+  }
+
+  char buffer[512];
+  for (uint32_t i = 0; i < kMaxKey; ++i) {
+    std::string key = std::to_string(i);
+    uint32_t size = sizeof(buffer);
+    ASSERT_TRUE(var_tree->Read(key.c_str(), key.length(), buffer, &size).IsOk());
+    ASSERT_EQ(std::string(buffer, size), value_of(i, i % 2 == 0));
+  }
+
+  auto iter = var_tree->RangeScanBySize("1000", 4, 10);
+  auto record = iter->GetNext();
+  ASSERT_NE(record, nullptr);
+  ASSERT_EQ(std::string(record->GetPayloadData(), record->GetPayloadLength()),
+            value_of(1000, 1));
+
+  std::string too_long(var_tree->GetMaxRecordSize(), 'x');
+  ASSERT_TRUE(var_tree->Insert("x", 1, too_long.c_str(), too_long.size()).IsNotEnoughSpace());
+}
+
+TEST_F(BzTreeTest, RangeScanBySize) {
+  static const uint32_t kMaxKey = 9999;
+  for (uint32_t i = 1000; i <= kMaxKey; i++) {
+    auto key = std::to_string(i);
+    tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i);
+  }
+
+  auto iter = tree->RangeScanBySize("9000", 4, 100);
+  int count = 0;
+  while (true) {
+    auto r = iter->GetNext();
+    if (!r) {
+      break;
+    }
+    ++count;
+    std::string key_str(r->GetKey(), 4);
+//    LOG(INFO) << count << " key=" << key_str << std::endl;
+  }
+  ASSERT_EQ(count, 100);
 
   iter = tree->RangeScanBySize("9000", 4, 2000);
   count = 0;
@@ -322,6 +2213,1584 @@ TEST_F(BzTreeTest, RangeScanBySize) {
   ASSERT_EQ(count, 1000);
 }
 
+TEST_F(BzTreeTest, RangeScanIntoBuffer) {
+  static const uint32_t kMaxKey = 9999;
+  for (uint32_t i = 1000; i <= kMaxKey; i++) {
+    auto key = std::to_string(i);
+    tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i);
+  }
+  // Empty out a few leaves in the middle, the scan should go past them
+  for (uint32_t i = 9100; i < 9200; i++) {
+    auto key = std::to_string(i);
+    ASSERT_TRUE(tree->Delete(key.c_str(), static_cast<uint16_t>(key.length())).IsOk());
+  }
+
+  bztree::ScanBuffer buffer;
+  ASSERT_TRUE(tree->RangeScanBySize("9000", 4, 200, &buffer).IsOk());
+  ASSERT_EQ(buffer.Count(), 200);
+  uint32_t expected = 9000;
+  for (auto *r = buffer.First(); r; r = buffer.Next(r)) {
+    if (expected == 9100) {
+      expected = 9200;
+    }
+    ASSERT_EQ(r->GetPayload(), expected);
+    ++expected;
+  }
+
+  ASSERT_TRUE(tree->RangeScanBySize("9000", 4, 2000, &buffer).IsOk());
+  ASSERT_EQ(buffer.Count(), 900);
+}
+
+TEST_F(BzTreeTest, RangeScanByKey) {
+  static const uint32_t kMaxKey = 9999;
+  for (uint32_t i = 1000; i <= kMaxKey; i++) {
+    auto key = std::to_string(i);
+    tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i);
+  }
+  auto scan = [this](const char *lo, bool lo_inclusive, const char *hi, bool hi_inclusive,
+                     std::vector<uint64_t> *payloads) {
+    payloads->clear();
+    auto iter = tree->RangeScanByKey(lo, 4, lo_inclusive, hi, hi ? 4 : 0, hi_inclusive);
+    while (auto r = iter->GetNext()) {
+      payloads->emplace_back(r->GetPayload());
+    }
+  };
+
+  std::vector<uint64_t> payloads;
+  scan("9000", true, "9100", false, &payloads);
+  ASSERT_EQ(payloads.size(), 100);
+  ASSERT_EQ(payloads.front(), 9000);
+  ASSERT_EQ(payloads.back(), 9099);
+
+  scan("9000", false, "9100", true, &payloads);
+  ASSERT_EQ(payloads.size(), 100);
+  ASSERT_EQ(payloads.front(), 9001);
+  ASSERT_EQ(payloads.back(), 9100);
+
+  scan("9990", true, nullptr, false, &payloads);
+  ASSERT_EQ(payloads.size(), 10);
+
+  scan("5000", false, "5000", true, &payloads);
+  ASSERT_TRUE(payloads.empty());
+
+  // Across leaves emptied in the middle of the range
+  for (uint32_t i = 5100; i < 5300; i++) {
+    auto key = std::to_string(i);
+    ASSERT_TRUE(tree->Delete(key.c_str(), static_cast<uint16_t>(key.length())).IsOk());
+  }
+  scan("5000", true, "5400", true, &payloads);
+  ASSERT_EQ(payloads.size(), 201);
+  for (uint32_t i = 1; i < payloads.size(); ++i) {
+    ASSERT_LT(payloads[i - 1], payloads[i]);
+  }
+}
+
+TEST_F(BzTreeTest, ReverseRangeScan) {
+  static const uint32_t kMaxKey = 9999;
+  for (uint32_t i = 1000; i <= kMaxKey; i++) {
+    auto key = std::to_string(i);
+    tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i);
+  }
+  auto scan = [this](const char *lo, bool lo_inclusive, const char *hi, bool hi_inclusive,
+                     uint32_t scan_size, std::vector<uint64_t> *payloads) {
+    payloads->clear();
+    auto iter = tree->ReverseRangeScanByKey(lo, lo ? 4 : 0, lo_inclusive, hi, hi ? 4 : 0,
+                                            hi_inclusive, scan_size);
+    while (auto r = iter->GetNext()) {
+      payloads->emplace_back(r->GetPayload());
+    }
+  };
+
+  // The latest 50 before 5000
+  std::vector<uint64_t> payloads;
+  scan(nullptr, false, "5000", false, 50, &payloads);
+  ASSERT_EQ(payloads.size(), 50);
+  for (uint32_t i = 0; i < payloads.size(); ++i) {
+    ASSERT_EQ(payloads[i], 4999 - i);
+  }
+
+  scan("9000", false, "9100", true, 1000, &payloads);
+  ASSERT_EQ(payloads.size(), 100);
+  ASSERT_EQ(payloads.front(), 9100);
+  ASSERT_EQ(payloads.back(), 9001);
+
+  // Whole tree, from the rightmost leaf to the leftmost
+  scan(nullptr, false, nullptr, false, std::numeric_limits<uint32_t>::max(), &payloads);
+  ASSERT_EQ(payloads.size(), kMaxKey - 1000 + 1);
+  for (uint32_t i = 0; i < payloads.size(); ++i) {
+    ASSERT_EQ(payloads[i], kMaxKey - i);
+  }
+
+  // Across emptied leaves
+  for (uint32_t i = 5100; i < 5300; i++) {
+    auto key = std::to_string(i);
+    ASSERT_TRUE(tree->Delete(key.c_str(), static_cast<uint16_t>(key.length())).IsOk());
+  }
+  scan("5000", true, "5400", true, 1000, &payloads);
+  ASSERT_EQ(payloads.size(), 201);
+  ASSERT_EQ(payloads.front(), 5400);
+  ASSERT_EQ(payloads.back(), 5000);
+}
+
+TEST_F(BzTreeTest, RangeScanAcrossSplits) {
+  for (uint32_t i = 1000; i < 5000; i += 2) {
+    auto key = std::to_string(i);
+    tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i);
+  }
+
+  // Leaves and their parents split under the iterator, so it can't keep
+  // walking the path it came from
+  auto iter = tree->RangeScanByKey("1000", 4, true, "4999", 4, true);
+  uint64_t last = 0;
+  uint32_t count = 0;
+  while (auto r = iter->GetNext()) {
+    ASSERT_GT(r->GetPayload(), last);
+    last = r->GetPayload();
+    ++count;
+    if (count % 100 == 0) {
+      for (uint32_t i = 1; i < 200; i += 2) {
+        auto key = std::to_string((last + 1000 + i) % 4000 + 1000);
+        tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), std::stoul(key));
+      }
+    }
+  }
+  ASSERT_EQ(last, 4999);
+  ASSERT_GE(count, 2000);
+}
+
+TEST_F(BzTreeTest, ParallelScan) {
+  static const uint32_t kKeys = 20000;
+  static const uint32_t kThreads = 4;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i).IsOk());
+  }
+  // Each record once, batches in key order, each thread on its own vector
+  std::vector<std::vector<uint64_t>> seen(kThreads);
+  std::vector<uint32_t> unsorted(kThreads);
+  ASSERT_TRUE(tree->ParallelScan(kThreads, [&](uint32_t thread, bztree::ScanBuffer *batch) {
+    uint64_t last = 0;
+    for (auto *r = batch->First(); r; r = batch->Next(r)) {
+      unsorted[thread] += r != batch->First() && r->GetPayload() <= last;
+      last = r->GetPayload();
+      seen[thread].push_back(last);
+      unsorted[thread] +=
+          std::string(r->GetKey(), r->meta.GetKeyLength()) != std::to_string(100000 + last);
+    }
+    return true;
+  }).IsOk());
+  std::vector<uint64_t> all;
+  for (uint32_t t = 0; t < kThreads; ++t) {
+    ASSERT_EQ(unsorted[t], 0);
+    all.insert(all.end(), seen[t].begin(), seen[t].end());
+  }
+  std::sort(all.begin(), all.end());
+  ASSERT_EQ(all.size(), kKeys);
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    ASSERT_EQ(all[i], i);
+  }
+
+  // Stopped by the sink, each thread stops at its next batch
+  std::atomic<uint32_t> batches{0};
+  ASSERT_TRUE(tree->ParallelScan(kThreads, [&](uint32_t, bztree::ScanBuffer *) {
+    ++batches;
+    return false;
+  }).IsOk());
+  ASSERT_LE(batches.load(), kThreads);
+}
+
+TEST_F(BzTreeTest, Count) {
+  static const uint32_t kKeys = 20000;
+  bztree::BzTree::ParameterSet param(1024, 512, 1024, 0, false, 0, false, 0, false, false, true);
+  std::unique_ptr<bztree::BzTree> counted(bztree::BzTree::New(param, pool));
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i).IsOk());
+    ASSERT_TRUE(counted->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i).IsOk());
+  }
+  // Cached counts don't know about deletes until the next split below, so
+  // delete every other key of the second half from the tree that has none
+  for (uint32_t i = kKeys / 2; i < kKeys; i += 2) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(tree->Delete(key.c_str(), static_cast<uint16_t>(key.length())).IsOk());
+  }
+  auto count = [](bztree::BzTree *t, uint32_t lo, uint32_t hi) {
+    auto lo_key = std::to_string(100000 + lo);
+    auto hi_key = std::to_string(100000 + hi);
+    return t->Count(lo_key.c_str(), static_cast<uint16_t>(lo_key.length()), hi_key.c_str(),
+                    static_cast<uint16_t>(hi_key.length()));
+  };
+  auto expected = [&](bztree::BzTree *t, uint32_t lo, uint32_t hi) {
+    uint64_t records = 0;
+    for (uint32_t i = lo; i < hi; ++i) {
+      records += t == counted.get() || i < kKeys / 2 || i % 2 == 1;
+    }
+    return records;
+  };
+
+  // Within a leaf the count is exact; leaves in between are estimated from
+  // their status words, and cached counts miss the latest inserts
+  for (auto *t : {tree, counted.get()}) {
+    ASSERT_EQ(count(t, 0, 1), 1);
+    ASSERT_EQ(count(t, 12345, 12346), 1);
+    ASSERT_EQ(count(t, 12344, 12345), t == counted.get());
+    ASSERT_EQ(count(t, 500, 500), 0);
+    ASSERT_EQ(count(t, 600, 500), 0);
+    uint32_t ranges[][2] = {{5, 17}, {100, 3000}, {9990, 10010}, {8000, 16000}, {0, kKeys}};
+    for (auto &range : ranges) {
+      double records = expected(t, range[0], range[1]);
+      ASSERT_NEAR(static_cast<double>(count(t, range[0], range[1])), records,
+                  records * 0.1 + 2);
+    }
+    ASSERT_NEAR(static_cast<double>(t->Count(nullptr, 0, nullptr, 0)), expected(t, 0, kKeys),
+                expected(t, 0, kKeys) * 0.1);
+    auto key = std::to_string(100000 + kKeys / 4);
+    ASSERT_NEAR(static_cast<double>(t->GetApproximateRank(
+        key.c_str(), static_cast<uint16_t>(key.length()))), kKeys / 4, kKeys / 40);
+  }
+}
+
+TEST_F(BzTreeTest, MultiRead) {
+  static const uint32_t kMaxKey = 9999;
+  for (uint32_t i = 1000; i <= kMaxKey; i += 2) {
+    auto key = std::to_string(i);
+    tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i);
+  }
+
+  // Every other key is missing, keys are unsorted and some repeat
+  static const uint32_t kBatch = 256;
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < kBatch; ++i) {
+    keys.emplace_back(std::to_string(1000 + (i * 7919) % 9000));
+  }
+  std::vector<const char *> key_ptrs;
+  std::vector<uint16_t> key_sizes;
+  for (auto &key : keys) {
+    key_ptrs.emplace_back(key.c_str());
+    key_sizes.emplace_back(static_cast<uint16_t>(key.length()));
+  }
+  std::vector<uint64_t> payloads(kBatch);
+  std::vector<bztree::ReturnCode> rcs(kBatch);
+  tree->MultiRead(key_ptrs.data(), key_sizes.data(), kBatch, payloads.data(), rcs.data());
+  for (uint32_t i = 0; i < kBatch; ++i) {
+    auto expected = std::stoul(keys[i]);
+    if (expected % 2 == 0) {
+      ASSERT_TRUE(rcs[i].IsOk());
+      ASSERT_EQ(payloads[i], expected);
+    } else {
+      ASSERT_TRUE(rcs[i].IsNotFound());
+    }
+  }
+
+  // Variable-length version, with a buffer too small for the payload
+  alignas(8) char buffers[2][8];
+  char *buffer_ptrs[] = {buffers[0], buffers[1]};
+  uint32_t buffer_sizes[] = {8, 4};
+  const char *two_keys[] = {"2000", "2002"};
+  uint16_t two_sizes[] = {4, 4};
+  tree->MultiRead(two_keys, two_sizes, 2, buffer_ptrs, buffer_sizes, rcs.data());
+  ASSERT_TRUE(rcs[0].IsOk());
+  ASSERT_EQ(*reinterpret_cast<uint64_t *>(buffers[0]), 2000);
+  ASSERT_TRUE(rcs[1].IsNotEnoughSpace());
+}
+
+TEST_F(BzTreeTest, InsertBatch) {
+  // Existing keys, repeated keys and enough keys to split leaves many times
+  static const uint32_t kBatch = 5000;
+  for (uint32_t i = 0; i < 100; ++i) {
+    auto key = std::to_string(100000 + i * 37);
+    tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), 1);
+  }
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < kBatch; ++i) {
+    keys.emplace_back(std::to_string(100000 + (i * 7919) % 4000));
+  }
+  std::vector<const char *> key_ptrs;
+  std::vector<uint16_t> key_sizes;
+  std::vector<uint64_t> payloads;
+  for (auto &key : keys) {
+    key_ptrs.emplace_back(key.c_str());
+    key_sizes.emplace_back(static_cast<uint16_t>(key.length()));
+    payloads.emplace_back(std::stoul(key));
+  }
+  std::vector<bztree::ReturnCode> rcs(kBatch);
+  tree->InsertBatch(key_ptrs.data(), key_sizes.data(), payloads.data(), kBatch, rcs.data());
+
+  std::set<std::string> inserted;
+  for (uint32_t i = 0; i < kBatch; ++i) {
+    auto k = std::stoul(keys[i]) - 100000;
+    bool existed = k % 37 == 0 && k / 37 < 100;
+    if (existed || inserted.count(keys[i])) {
+      ASSERT_TRUE(rcs[i].IsKeyExists());
+    } else {
+      ASSERT_TRUE(rcs[i].IsOk());
+      inserted.insert(keys[i]);
+    }
+    uint64_t payload = 0;
+    ASSERT_TRUE(tree->Read(key_ptrs[i], key_sizes[i], &payload).IsOk());
+    ASSERT_EQ(payload, existed ? 1 : payloads[i]);
+  }
+  ASSERT_EQ(inserted.size(), 4000 - 100);
+}
+
+TEST_F(BzTreeTest, SeparatorTruncation) {
+  // 64-byte keys that differ early on: separators only need the first bytes
+  auto make_key = [](uint32_t i) {
+    auto key = std::to_string(100000 + i);
+    return key + std::string(64 - key.length(), 'x');
+  };
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> inserted(bztree::BzTree::New(param, pool));
+  std::unique_ptr<bztree::BzTree> loaded(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 5000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = make_key((i * 7919) % kKeys);
+    ASSERT_TRUE(inserted->Insert(key.c_str(), key.length(), 1).IsOk());
+  }
+  uint32_t i = 0;
+  std::string key;
+  ASSERT_TRUE(loaded->BulkLoad([&](const char **k, uint16_t *k_size, uint64_t *payload) {
+    if (i == kKeys) {
+      return false;
+    }
+    key = make_key(i++);
+    *k = key.c_str();
+    *k_size = key.length();
+    *payload = 1;
+    return true;
+  }).IsOk());
+
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  for (auto *t : {inserted.get(), loaded.get()}) {
+    // Separators in the internal nodes on the way are much shorter than the keys
+    bztree::Stack stack;
+    stack.tree = t;
+    auto middle = make_key(kKeys / 2);
+    t->TraverseToLeaf(&stack, middle.c_str(), middle.length());
+    ASSERT_GT(stack.num_frames, 0);
+    for (uint32_t f = 0; f < stack.num_frames; ++f) {
+      auto *node = stack.frames[f].node;
+      for (uint32_t m = 1; m < node->GetHeader()->sorted_count; ++m) {
+        ASSERT_LE(node->GetMetadata(m).GetKeyLength(), 8);
+      }
+    }
+    for (uint32_t k = 0; k < kKeys; ++k) {
+      auto key = make_key(k);
+      uint64_t payload = 0;
+      ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+    }
+    auto absent = make_key(kKeys / 2).substr(0, 6);
+    uint64_t payload = 0;
+    ASSERT_TRUE(t->Read(absent.c_str(), absent.length(), &payload).IsNotFound());
+    auto iter = t->RangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+    uint32_t count = 0;
+    while (auto r = iter->GetNext()) {
+      ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), make_key(count++));
+    }
+    ASSERT_EQ(count, kKeys);
+  }
+}
+
+TEST(TreeCatalogTest, CreateOpenDrop) {
+  pmwcas::InitLibrary(pmwcas::DefaultAllocator::Create,
+                      pmwcas::DefaultAllocator::Destroy,
+                      pmwcas::LinuxEnvironment::Create,
+                      pmwcas::LinuxEnvironment::Destroy);
+  std::unique_ptr<pmwcas::DescriptorPool> pool(new pmwcas::DescriptorPool(2000, 1, false));
+  std::unique_ptr<bztree::TreeCatalog> catalog(bztree::TreeCatalog::New(pool.get()));
+  bztree::BzTree::ParameterSet param(256, 128, 256);
+
+  // Trees are independent of each other, under one descriptor pool
+  bztree::BzTree *trees[3];
+  const char *names[3] = {"primary", "by_name", "by_date"};
+  for (uint32_t i = 0; i < 3; ++i) {
+    ASSERT_TRUE(catalog->Create(names[i], param, &trees[i]).IsOk());
+    ASSERT_EQ(trees[i]->GetPMWCASPool(), pool.get());
+  }
+  bztree::BzTree *tree = nullptr;
+  ASSERT_TRUE(catalog->Create("primary", param, &tree).IsKeyExists());
+  std::string long_name(bztree::TreeCatalog::kMaxNameSize + 1, 'x');
+  ASSERT_TRUE(catalog->Create(long_name.c_str(), param, &tree).IsNotEnoughSpace());
+  for (uint32_t i = 0; i < 3; ++i) {
+    for (uint64_t k = 0; k < 500; ++k) {
+      auto key = std::to_string(k);
+      ASSERT_TRUE(trees[i]->Insert(key.c_str(), key.length(), k * 10 + i).IsOk());
+    }
+  }
+  for (uint32_t i = 0; i < 3; ++i) {
+    ASSERT_EQ(catalog->Open(names[i]), trees[i]);
+    uint64_t payload = 0;
+    ASSERT_TRUE(trees[i]->Read("123", 3, &payload).IsOk());
+    ASSERT_EQ(payload, 1230 + i);
+  }
+  ASSERT_EQ(catalog->Open("missing"), nullptr);
+
+  ASSERT_TRUE(catalog->Drop("by_name").IsOk());
+  ASSERT_TRUE(catalog->Drop("by_name").IsNotFound());
+  ASSERT_EQ(catalog->Open("by_name"), nullptr);
+  std::vector<std::string> list;
+  catalog->List(&list);
+  std::sort(list.begin(), list.end());
+  ASSERT_EQ(list, std::vector<std::string>({"by_date", "primary"}));
+
+  // The name can be taken again, for an empty tree
+  ASSERT_TRUE(catalog->Create("by_name", param, &tree).IsOk());
+  uint64_t payload = 0;
+  ASSERT_TRUE(tree->Read("123", 3, &payload).IsNotFound());
+
+#ifdef PMEM
+  catalog->Recovery();
+  for (uint32_t i = 0; i < 3; i += 2) {
+    ASSERT_TRUE(catalog->Open(names[i])->Read("123", 3, &payload).IsOk());
+    ASSERT_EQ(payload, 1230 + i);
+  }
+#endif
+  catalog.reset();
+  pmwcas::Thread::ClearRegistry();
+}
+
+TEST_F(BzTreeTest, MultiTreeWrite) {
+  std::unique_ptr<bztree::BzTree> other(bztree::BzTree::New(
+      bztree::BzTree::ParameterSet(256, 128, 256), pool));
+  uint64_t payload = 0;
+
+  // Both or neither: the second insert finds its key taken
+  ASSERT_TRUE(other->Insert("b", 1, 1).IsOk());
+  bztree::MultiTreeWrite write;
+  ASSERT_TRUE(write.Insert(tree, "a", 1, 10).IsOk());
+  ASSERT_TRUE(write.Insert(other.get(), "b", 1, 20).IsOk());
+  ASSERT_TRUE(write.Insert(tree, "a", 1, 30).IsKeyExists());
+  uint32_t failed = 0;
+  ASSERT_TRUE(write.Commit(&failed).IsKeyExists());
+  ASSERT_EQ(failed, 1);
+  ASSERT_TRUE(tree->Read("a", 1, &payload).IsNotFound());
+  ASSERT_TRUE(tree->Insert("a", 1, 11).IsOk());
+
+  write.Clear();
+  ASSERT_TRUE(write.Update(tree, "a", 1, 12).IsOk());
+  ASSERT_TRUE(write.Update(other.get(), "b", 1, 21).IsOk());
+  ASSERT_TRUE(write.Insert(other.get(), "c", 1, 30).IsOk());
+  ASSERT_TRUE(write.Commit().IsOk());
+  ASSERT_TRUE(tree->Read("a", 1, &payload).IsOk());
+  ASSERT_EQ(payload, 12);
+  ASSERT_TRUE(other->Read("b", 1, &payload).IsOk());
+  ASSERT_EQ(payload, 21);
+  ASSERT_TRUE(other->Read("c", 1, &payload).IsOk());
+  ASSERT_EQ(payload, 30);
+
+  write.Clear();
+  ASSERT_TRUE(write.Update(tree, "a", 1, 13).IsOk());
+  ASSERT_TRUE(write.Update(tree, "z", 1, 1).IsOk());
+  ASSERT_TRUE(write.Commit().IsNotFound());
+  ASSERT_TRUE(tree->Read("a", 1, &payload).IsOk());
+  ASSERT_EQ(payload, 12);
+
+  // As many writes as fit in a descriptor
+  write.Clear();
+  uint32_t staged = 0;
+  while (true) {
+    auto key = std::to_string(staged);
+    if (!write.Insert(tree, key.c_str(), key.length(), staged).IsOk()) {
+      break;
+    }
+    ++staged;
+  }
+  ASSERT_EQ(staged, DESC_CAP / 2);
+
+  // Through splits of both trees
+  for (uint32_t i = 0; i < 2000; ++i) {
+    auto key = std::to_string(100000 + i);
+    write.Clear();
+    ASSERT_TRUE(write.Insert(tree, key.c_str(), key.length(), i).IsOk());
+    ASSERT_TRUE(write.Insert(other.get(), key.c_str(), key.length(), i + 1).IsOk());
+    ASSERT_TRUE(write.Commit().IsOk());
+  }
+  for (uint32_t i = 0; i < 2000; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(tree->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+    ASSERT_TRUE(other->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i + 1);
+  }
+}
+
+TEST_F(BzTreeTest, PartitionedTree) {
+  std::vector<std::unique_ptr<bztree::BzTree>> owned;
+  std::vector<bztree::BzTree *> trees;
+  for (uint32_t i = 0; i < 4; ++i) {
+    owned.emplace_back(bztree::BzTree::New(bztree::BzTree::ParameterSet(1024, 512, 1024), pool));
+    trees.push_back(owned.back().get());
+  }
+  bztree::PartitionedTree ranged(trees, {"10250", "10500", "10750"});
+  bztree::PartitionedTree hashed(trees);
+  ASSERT_EQ(ranged.GetPartition("10249", 5), 0);
+  ASSERT_EQ(ranged.GetPartition("10250", 5), 1);
+  ASSERT_EQ(ranged.GetPartition("99", 2), 3);
+
+  static const uint32_t kKeys = 1000;
+  auto check_scans = [&](bztree::PartitionedTree *t, uint32_t step) {
+    // Across all partitions, from the middle of one, and backwards
+    uint32_t expected = 0;
+    auto iter = t->RangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+    while (auto r = iter->GetNext()) {
+      ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()),
+                std::to_string(10000 + expected));
+      ASSERT_EQ(r->GetPayload(), expected);
+      expected += step;
+    }
+    ASSERT_EQ(expected, kKeys);
+    iter = t->RangeScanBySize("10200", 5, 100);
+    expected = 200;
+    while (auto r = iter->GetNext()) {
+      ASSERT_EQ(r->GetPayload(), expected);
+      expected += step;
+    }
+    ASSERT_EQ(expected, 200 + 100 * step);
+    iter = t->RangeScanByKey("10240", 5, false, "10760", 5, true, kKeys, true);
+    expected = 760;
+    while (auto r = iter->GetNext()) {
+      ASSERT_EQ(r->GetPayload(), expected);
+      expected -= step;
+    }
+    ASSERT_EQ(expected, 240);
+  };
+
+  for (auto *t : {&ranged, &hashed}) {
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      auto key = std::to_string(10000 + i);
+      ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+    }
+    for (auto *partition : trees) {
+      ASSERT_TRUE(partition->RangeScanBySize("", 0, 1)->GetNext() != nullptr);
+    }
+    uint64_t payload = 0;
+    ASSERT_TRUE(t->Read("10500", 5, &payload).IsOk());
+    ASSERT_EQ(payload, 500);
+    ASSERT_TRUE(t->Insert("10500", 5, 1).IsKeyExists());
+    check_scans(t, 1);
+
+    // Every other key, straddling the partition boundaries
+    for (uint32_t i = 1; i < kKeys; i += 2) {
+      auto key = std::to_string(10000 + i);
+      ASSERT_TRUE(t->Delete(key.c_str(), key.length()).IsOk());
+    }
+    check_scans(t, 2);
+    ASSERT_TRUE(t->DeleteRange("10000", 5, "11000", 5).IsOk());
+    ASSERT_FALSE(t->RangeScanByKey(nullptr, 0, true, nullptr, 0, true)->GetNext());
+  }
+}
+
+TEST_F(BzTreeTest, WriteBuffer) {
+  auto path = testing::TempDir() + "bztree_write_buffer_test";
+  static const uint32_t kKeys = 1000;
+  static const uint32_t kFlushRecords = 64;
+  auto read = [](bztree::WriteBuffer *b, uint32_t i, uint64_t *payload) {
+    auto key = std::to_string(10000 + i);
+    return b->Read(key.c_str(), static_cast<uint16_t>(key.length()), payload);
+  };
+  {
+    std::unique_ptr<bztree::WriteBuffer> buffer;
+    ASSERT_TRUE(bztree::WriteBuffer::Open(tree, kFlushRecords, path.c_str(), false,
+                                          &buffer).IsOk());
+    ASSERT_TRUE(buffer->Insert("10000", 5, 1).IsOk());
+    ASSERT_TRUE(buffer->Insert("10000", 5, 2).IsKeyExists());
+    ASSERT_TRUE(buffer->Update("10001", 5, 1).IsNotFound());
+    ASSERT_TRUE(buffer->Delete("10001", 5).IsNotFound());
+    ASSERT_TRUE(buffer->Delete("10000", 5).IsOk());
+    ASSERT_TRUE(buffer->Delete("10000", 5).IsNotFound());
+    uint64_t payload = 0;
+    ASSERT_TRUE(buffer->Read("10000", 5, &payload).IsNotFound());
+
+    // Each key written ten times, most of which never reach the tree
+    for (uint32_t round = 0; round < 10; ++round) {
+      for (uint32_t i = 0; i < kKeys; ++i) {
+        auto key = std::to_string(10000 + i);
+        ASSERT_TRUE(buffer->Upsert(key.c_str(), static_cast<uint16_t>(key.length()),
+                                   round * kKeys + i).IsOk());
+        if (i % 100 == 0) {
+          ASSERT_TRUE(read(buffer.get(), i, &payload).IsOk());
+          ASSERT_EQ(payload, round * kKeys + i);
+        }
+      }
+    }
+    auto stats = buffer->GetStats();
+    ASSERT_GT(stats.flushes, 0);
+    ASSERT_GT(stats.absorbed, 0);
+    ASSERT_TRUE(buffer->Flush().IsOk());
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      auto key = std::to_string(10000 + i);
+      ASSERT_TRUE(tree->Read(key.c_str(), static_cast<uint16_t>(key.length()), &payload).IsOk());
+      ASSERT_EQ(payload, 9 * kKeys + i);
+    }
+
+    // Records bigger than a leaf holds bypass the buffer
+    std::string big(tree->GetMaxRecordSize(), 'x');
+    ASSERT_TRUE(buffer->Insert(big.c_str(), static_cast<uint16_t>(big.size()), 1).IsOk());
+    ASSERT_TRUE(tree->Read(big.c_str(), static_cast<uint16_t>(big.size()), &payload).IsOk());
+    ASSERT_TRUE(buffer->Delete(big.c_str(), static_cast<uint16_t>(big.size())).IsOk());
+  }
+
+  // Writes still in the buffer are in its logs, and replayed into the tree
+  // by the next buffer: a copy of the logs as a crash would have left them,
+  // and a tree standing in for the one recovered
+  auto log_file = [](const std::string &prefix, uint32_t shard, uint32_t file) {
+    return prefix + "." + std::to_string(shard) + "." + std::to_string(file);
+  };
+  auto copy = path + "_copy";
+  {
+    std::unique_ptr<bztree::WriteBuffer> buffer;
+    ASSERT_TRUE(bztree::WriteBuffer::Open(tree, kKeys * 2, path.c_str(), true,
+                                          &buffer).IsOk());
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      auto key = std::to_string(10000 + i);
+      auto size = static_cast<uint16_t>(key.length());
+      ASSERT_TRUE((i % 2 ? buffer->Update(key.c_str(), size, i + 1)
+                         : buffer->Delete(key.c_str(), size)).IsOk());
+    }
+    ASSERT_EQ(buffer->GetStats().flushes, 0);
+    for (uint32_t s = 0; s < bztree::WriteBuffer::kShards; ++s) {
+      for (uint32_t f = 0; f < 2; ++f) {
+        std::ifstream in(log_file(path, s, f), std::ios::binary);
+        std::ofstream out(log_file(copy, s, f), std::ios::binary);
+        out << in.rdbuf();
+      }
+    }
+  }
+  std::unique_ptr<bztree::BzTree> recovered(
+      bztree::BzTree::New(bztree::BzTree::ParameterSet(256, 128, 256), pool));
+  std::unique_ptr<bztree::WriteBuffer> replayed;
+  ASSERT_TRUE(bztree::WriteBuffer::Open(recovered.get(), kKeys, copy.c_str(), false,
+                                        &replayed).IsOk());
+  for (auto *t : {tree, recovered.get()}) {
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      uint64_t payload = 0;
+      auto key = std::to_string(10000 + i);
+      auto rc = t->Read(key.c_str(), static_cast<uint16_t>(key.length()), &payload);
+      ASSERT_EQ(rc.IsOk(), i % 2 == 1);
+      ASSERT_TRUE(!rc.IsOk() || payload == i + 1);
+    }
+  }
+  replayed.reset();
+  for (uint32_t s = 0; s < bztree::WriteBuffer::kShards; ++s) {
+    for (uint32_t f = 0; f < 2; ++f) {
+      remove(log_file(path, s, f).c_str());
+      remove(log_file(copy, s, f).c_str());
+    }
+  }
+}
+
+TEST_F(BzTreeTest, ChangeFeed) {
+  static const uint32_t kKeys = 2000;
+  ASSERT_EQ(tree->GetChangeFeed(), nullptr);
+  ASSERT_TRUE(tree->Insert("before", 6, 1).IsOk());
+  tree->EnableChangeFeed();
+  auto *feed = tree->GetChangeFeed();
+  ASSERT_NE(feed, nullptr);
+
+  // Enough inserts to split leaves, none of which shows in the feed
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(10000 + i);
+    ASSERT_TRUE(tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i).IsOk());
+  }
+  ASSERT_TRUE(tree->Insert("10000", 5, 7).IsKeyExists());
+  ASSERT_TRUE(tree->Update("10001", 5, 8).IsOk());
+  ASSERT_TRUE(tree->Update("missing", 7, 8).IsNotFound());
+  ASSERT_TRUE(tree->Upsert("10002", 5, 9).IsOk());
+  uint64_t expected = 3;
+  ASSERT_TRUE(tree->CompareAndSwap("10003", 5, &expected, 10).IsOk());
+  ASSERT_TRUE(tree->FetchAdd("10004", 5, 5).IsOk());
+  ASSERT_TRUE(tree->Delete("before", 6).IsOk());
+  ASSERT_TRUE(tree->Delete("before", 6).IsNotFound());
+  ASSERT_TRUE(tree->DeleteRange("10100", 5, "10200", 5).IsOk());
+
+  std::vector<bztree::ChangeFeed::Change> changes;
+  ASSERT_EQ(feed->Drain(&changes, 10), 10);
+  ASSERT_EQ(feed->Drain(&changes), kKeys + 6 - 10);
+  ASSERT_EQ(feed->Drain(&changes), 0);
+  ASSERT_EQ(feed->GetDropped(), 0);
+  for (uint32_t i = 0; i < changes.size(); ++i) {
+    ASSERT_EQ(changes[i].sequence, i);
+  }
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    ASSERT_EQ(changes[i].op, bztree::ChangeFeed::kInsert);
+    ASSERT_EQ(changes[i].key, std::to_string(10000 + i));
+    ASSERT_EQ(changes[i].payload, i);
+  }
+  auto *c = &changes[kKeys];
+  ASSERT_TRUE(c[0].op == bztree::ChangeFeed::kUpdate && c[0].key == "10001" &&
+              c[0].payload == 8);
+  ASSERT_TRUE(c[1].op == bztree::ChangeFeed::kUpsert && c[1].key == "10002" &&
+              c[1].payload == 9);
+  ASSERT_TRUE(c[2].op == bztree::ChangeFeed::kUpdate && c[2].key == "10003" &&
+              c[2].payload == 10);
+  ASSERT_TRUE(c[3].op == bztree::ChangeFeed::kUpdate && c[3].key == "10004" &&
+              c[3].payload == 9);
+  ASSERT_TRUE(c[4].op == bztree::ChangeFeed::kDelete && c[4].key == "before");
+  ASSERT_TRUE(c[5].op == bztree::ChangeFeed::kDeleteRange && c[5].key == "10100" &&
+              c[5].value == "10200");
+
+  // A full ring drops what doesn't fit
+  tree->DisableChangeFeed();
+  ASSERT_EQ(tree->GetChangeFeed(), nullptr);
+  ASSERT_TRUE(tree->Upsert("10005", 5, 1).IsOk());
+  tree->EnableChangeFeed(6);
+  feed = tree->GetChangeFeed();
+  for (uint64_t i = 0; i < 20; ++i) {
+    ASSERT_TRUE(tree->Upsert("10005", 5, i).IsOk());
+  }
+  changes.clear();
+  ASSERT_EQ(feed->Drain(&changes), 8);
+  ASSERT_EQ(feed->GetDropped(), 12);
+  ASSERT_EQ(changes.back().payload, 7);
+  ASSERT_TRUE(tree->Upsert("10005", 5, 20).IsOk());
+  ASSERT_EQ(feed->Drain(&changes), 1);
+  ASSERT_EQ(changes.back().sequence, 20);
+}
+
+TEST_F(BzTreeTest, WarmUp) {
+  // A stand-in for the PMDK pool the tree would live in, a file of its own
+  // like the pool: anonymous memory may be merged with the heap around it
+  static const uint64_t kPoolSize = 64 * 4096;
+  auto path = testing::TempDir() + "bztree_warm_up_test";
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(ftruncate(fd, kPoolSize), 0);
+  void *region = mmap(nullptr, kPoolSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  remove(path.c_str());
+  ASSERT_NE(region, MAP_FAILED);
+  bztree::BzTree::ParameterSet param(256, 128, 256);
+  std::unique_ptr<bztree::BzTree> t(
+      new bztree::BzTree(param, pool, reinterpret_cast<uint64_t>(region)));
+  for (uint32_t i = 0; i < 5000; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i).IsOk());
+  }
+  auto space = t->GetSpaceStats();
+  ASSERT_GT(space.levels, 2);
+  uint64_t internal_nodes = 0;
+  for (uint32_t i = 0; i + 1 < space.levels; ++i) {
+    internal_nodes += space.nodes[i];
+  }
+
+  auto stats = t->WarmUp(3);
+  ASSERT_GE(stats.prefaulted_bytes, kPoolSize);
+  ASSERT_EQ(stats.internal_nodes, internal_nodes);
+  ASSERT_EQ(stats.leaves, 0);
+  stats = t->WarmUp(2, false, true);
+  ASSERT_EQ(stats.prefaulted_bytes, 0);
+  ASSERT_EQ(stats.internal_nodes, internal_nodes);
+  ASSERT_EQ(stats.leaves, space.nodes[space.levels - 1]);
+
+  // Nothing to prefault for a tree in DRAM
+  stats = tree->WarmUp(1);
+  ASSERT_EQ(stats.prefaulted_bytes, 0);
+  ASSERT_EQ(stats.internal_nodes, 0);
+  t.reset();
+  munmap(region, kPoolSize);
+}
+
+TEST_F(BzTreeTest, Snapshot) {
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 4000;
+  for (uint32_t i = 0; i < kKeys; i += 2) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  ASSERT_TRUE(t->Insert("v", 1, "old", 3).IsOk());
+  auto snapshot = t->NewSnapshot();
+  ASSERT_NE(snapshot, nullptr);
+  ASSERT_TRUE(t->BulkLoad([](const char **, uint16_t *, uint64_t *) {
+    return false;
+  }).IsKeyExists());
+
+  // Odd keys are inserted, every fourth updated, the rest through splits and
+  // a DeleteRange deleted
+  for (uint32_t i = 1; i < kKeys; i += 2) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  for (uint32_t i = 0; i < kKeys; i += 4) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Update(key.c_str(), key.length(), i + 1).IsOk());
+  }
+  for (uint32_t i = 2; i < 1000; i += 4) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Delete(key.c_str(), key.length()).IsOk());
+  }
+  ASSERT_TRUE(t->DeleteRange("102000", 6, "103000", 6).IsOk());
+  ASSERT_TRUE(t->Update("v", 1, "a much longer value", 19).IsOk());
+  bztree::MultiTreeWrite write;
+  ASSERT_TRUE(write.Update(t.get(), "100004", 6, 7).IsOk());
+  ASSERT_TRUE(write.Insert(t.get(), "w", 1, 8).IsOk());
+  ASSERT_TRUE(write.Commit().IsOk());
+  ASSERT_GT(snapshot->GetVersionCount(), 0);
+
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    auto rc = snapshot->Read(key.c_str(), key.length(), &payload);
+    ASSERT_EQ(rc.IsOk(), i % 2 == 0);
+    if (rc.IsOk()) {
+      ASSERT_EQ(payload, i);
+    }
+  }
+  ASSERT_TRUE(snapshot->Read("w", 1, &payload).IsNotFound());
+  char buffer[32];
+  uint32_t size = 2;
+  ASSERT_TRUE(snapshot->Read("v", 1, buffer, &size).IsNotEnoughSpace());
+  size = sizeof(buffer);
+  ASSERT_TRUE(snapshot->Read("v", 1, buffer, &size).IsOk());
+  ASSERT_EQ(std::string(buffer, size), "old");
+
+  auto iter = snapshot->RangeScanByKey("101000", 6, false, "103500", 6, true);
+  uint32_t expected = 1002;
+  while (auto record = iter->GetNext()) {
+    ASSERT_EQ(std::string(record->GetKey(), record->meta.GetKeyLength()),
+              std::to_string(100000 + expected));
+    ASSERT_EQ(record->GetPayload(), expected);
+    expected += 2;
+  }
+  ASSERT_EQ(expected, 3502);
+  iter = snapshot->RangeScanByKey(nullptr, 0, true, nullptr, 0, false);
+  uint32_t count = 0;
+  while (auto record = iter->GetNext()) {
+    ++count;
+  }
+  ASSERT_EQ(count, kKeys / 2 + 1);
+
+  // Once it's closed only the tree is left
+  snapshot.reset();
+  ASSERT_TRUE(t->Read("100004", 6, &payload).IsOk());
+  ASSERT_EQ(payload, 7);
+  ASSERT_TRUE(t->Read("102002", 6, &payload).IsNotFound());
+
+  std::vector<std::unique_ptr<bztree::Snapshot>> snapshots;
+  for (uint32_t i = 0; i < bztree::BzTree::kMaxSnapshots; ++i) {
+    snapshots.emplace_back(t->NewSnapshot());
+    ASSERT_NE(snapshots.back(), nullptr);
+  }
+  ASSERT_EQ(t->NewSnapshot(), nullptr);
+}
+
+TEST(LatencyHistogramTest, Percentiles) {
+  // Small values are exact, larger ones fall into buckets at most 1/8 wide
+  for (uint64_t v : {0ull, 7ull, 8ull, 15ull, 16ull, 1000ull, 123456789ull, ~0ull}) {
+    auto bucket = bztree::LatencyHistogram::GetBucket(v);
+    ASSERT_LT(bucket, bztree::LatencyHistogram::kBuckets);
+    auto upper = bztree::LatencyHistogram::GetBucketUpperBound(bucket);
+    ASSERT_GE(upper, v);
+    ASSERT_LE(upper - v, v / 8);
+    if (bucket > 0) {
+      ASSERT_LT(bztree::LatencyHistogram::GetBucketUpperBound(bucket - 1), v);
+    }
+  }
+
+  bztree::LatencyHistogram histogram;
+  ASSERT_EQ(histogram.GetPercentile(50), 0);
+  for (uint64_t v = 1; v <= 1000; ++v) {
+    histogram.Record(v);
+  }
+  ASSERT_EQ(histogram.GetCount(), 1000);
+  auto p50 = histogram.GetPercentile(50);
+  ASSERT_GE(p50, 500);
+  ASSERT_LE(p50, 500 + 500 / 8);
+  ASSERT_GE(histogram.GetPercentile(100), 1000);
+  ASSERT_LE(histogram.GetPercentile(0), 1);
+
+  bztree::LatencyHistogram other;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    other.Record(1000000);
+  }
+  histogram.Merge(other);
+  ASSERT_EQ(histogram.GetCount(), 2000);
+  ASSERT_GE(histogram.GetPercentile(50), 1000);
+  ASSERT_LE(histogram.GetPercentile(50), 1000 + 1000 / 8);
+  ASSERT_GE(histogram.GetPercentile(51), 1000000);
+}
+
+TEST_F(BzTreeTest, LatencyHistograms) {
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 2000;
+  auto make_key = [](uint32_t i) { return std::to_string(100000 + i); };
+  // Nothing is recorded until the histograms are on
+  t->Insert("0", 1, 0);
+  t->EnableLatencyHistograms(true);
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = make_key(i);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = make_key(i);
+    ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+  }
+  // New keys through Upsert only count as upserts
+  for (uint32_t i = kKeys; i < kKeys + 10; ++i) {
+    auto key = make_key(i);
+    ASSERT_TRUE(t->Upsert(key.c_str(), key.length(), i).IsOk());
+  }
+  bztree::ScanBuffer buffer;
+  ASSERT_TRUE(t->RangeScanBySize("1", 1, 100, &buffer).IsOk());
+
+  bztree::BzTree::LatencySnapshot snapshot;
+  t->GetLatencyHistograms(&snapshot);
+  auto &fast = snapshot.fast;
+  auto &smo = snapshot.smo;
+  ASSERT_EQ(fast[bztree::BzTree::kOpInsert].GetCount() +
+            smo[bztree::BzTree::kOpInsert].GetCount(), kKeys);
+  ASSERT_GT(smo[bztree::BzTree::kOpInsert].GetCount(), 0);
+  ASSERT_GT(fast[bztree::BzTree::kOpInsert].GetCount(),
+            smo[bztree::BzTree::kOpInsert].GetCount());
+  ASSERT_EQ(fast[bztree::BzTree::kOpRead].GetCount(), kKeys);
+  ASSERT_EQ(smo[bztree::BzTree::kOpRead].GetCount(), 0);
+  ASSERT_EQ(fast[bztree::BzTree::kOpUpsert].GetCount() +
+            smo[bztree::BzTree::kOpUpsert].GetCount(), 10);
+  ASSERT_EQ(fast[bztree::BzTree::kOpScan].GetCount(), 1);
+  ASSERT_GT(fast[bztree::BzTree::kOpRead].GetPercentile(50), 0);
+
+  // Snapshots add up, and turning the histograms off stops recording
+  t->GetLatencyHistograms(&snapshot);
+  ASSERT_EQ(snapshot.fast[bztree::BzTree::kOpRead].GetCount(), 2 * kKeys);
+  t->EnableLatencyHistograms(false);
+  t->Read("0", 1, &payload);
+  bztree::BzTree::LatencySnapshot after;
+  t->GetLatencyHistograms(&after);
+  ASSERT_EQ(after.fast[bztree::BzTree::kOpRead].GetCount(), kKeys);
+}
+
+TEST_F(BzTreeTest, HugePageNodes) {
+  uint32_t class_size = 0;
+  ASSERT_EQ(bztree::NodeAllocator::GetSizeClass(64, &class_size), 0);
+  ASSERT_EQ(bztree::NodeAllocator::GetSizeClass(4096, &class_size), 24);
+  ASSERT_EQ(class_size, 4096);
+  ASSERT_EQ(bztree::NodeAllocator::GetSizeClass(4097, &class_size), 25);
+  ASSERT_EQ(class_size, 5120);
+  ASSERT_EQ(bztree::NodeAllocator::GetSizeClass(bztree::NodeAllocator::kMaxSlabNodeSize,
+                                                &class_size),
+            bztree::NodeAllocator::kSizeClasses - 1);
+
+  // Slab-allocated 4 KB leaves under internal nodes of less than 512 bytes
+  bztree::NodeAllocator::UseHugePages(true);
+  bztree::BzTree::ParameterSet param(3072, 0, 4096, 0, false, 512);
+  std::unique_ptr<bztree::BzTree> inserted(bztree::BzTree::New(param, pool));
+  std::unique_ptr<bztree::BzTree> loaded(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 20000;
+  auto make_key = [](uint32_t i) { return std::to_string(100000 + i); };
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = make_key((i * 7919) % kKeys);
+    ASSERT_TRUE(inserted->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  uint32_t i = 0;
+  std::string key;
+  ASSERT_TRUE(loaded->BulkLoad([&](const char **k, uint16_t *k_size, uint64_t *payload) {
+    if (i == kKeys) {
+      return false;
+    }
+    key = make_key(i++);
+    *k = key.c_str();
+    *k_size = key.length();
+    *payload = i;
+    return true;
+  }).IsOk());
+  for (uint32_t k = 0; k < kKeys; k += 3) {
+    key = make_key(k);
+    ASSERT_TRUE(inserted->Delete(key.c_str(), key.length()).IsOk());
+    ASSERT_TRUE(loaded->Delete(key.c_str(), key.length()).IsOk());
+  }
+  ASSERT_GT(bztree::NodeAllocator::GetSlabBytes(), 0);
+
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  for (auto *t : {inserted.get(), loaded.get()}) {
+    bztree::Stack stack;
+    stack.tree = t;
+    auto middle = make_key(kKeys / 2);
+    t->TraverseToLeaf(&stack, middle.c_str(), middle.length());
+    ASSERT_GT(stack.num_frames, 1);
+    for (uint32_t f = 0; f < stack.num_frames; ++f) {
+      ASSERT_LT(stack.frames[f].node->GetHeader()->size, 512);
+    }
+    for (uint32_t k = 0; k < kKeys; ++k) {
+      key = make_key(k);
+      uint64_t payload = 0;
+      auto rc = t->Read(key.c_str(), key.length(), &payload);
+      ASSERT_TRUE(k % 3 == 0 ? rc.IsNotFound() : rc.IsOk());
+    }
+    auto iter = t->RangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+    uint32_t count = 0;
+    while (auto r = iter->GetNext()) {
+      ++count;
+    }
+    ASSERT_EQ(count, kKeys - (kKeys + 2) / 3);
+  }
+  // Fixtures delete their nodes themselves
+  bztree::NodeAllocator::UseHugePages(false);
+}
+
+TEST(ContentionManagerTest, Pause) {
+  ASSERT_EQ(bztree::ContentionManager::GetPolicy(), bztree::ContentionManager::kBackoff);
+  // Pauses are capped however many retries there were
+  for (uint32_t attempt = 0; attempt < 100; ++attempt) {
+    bztree::ContentionManager::Pause(attempt);
+  }
+  bztree::ContentionManager::Pause(std::numeric_limits<uint32_t>::max());
+
+  bztree::ContentionManager::SetPolicy(bztree::ContentionManager::kHelp);
+  ASSERT_EQ(bztree::ContentionManager::GetPolicy(), bztree::ContentionManager::kHelp);
+  bztree::ContentionManager::SetPolicy(bztree::ContentionManager::kBackoff);
+}
+
+TEST(PersistBatchTest, Coalesce) {
+  using bztree::PersistBatch;
+  alignas(64) static char buffer[64 * 1024];
+  PersistBatch::Drain();
+  ASSERT_EQ(PersistBatch::GetPendingLines(), 0);
+
+  // Ranges touching the same lines are written back once
+  PersistBatch::Add(buffer + 10, 100);
+  PersistBatch::Add(buffer + 64, 64);
+  PersistBatch::Add(buffer + 120, 8);
+  ASSERT_EQ(PersistBatch::GetPendingLines(), 2);
+  PersistBatch::Add(buffer + 128, 1);
+  ASSERT_EQ(PersistBatch::GetPendingLines(), 3);
+  PersistBatch::Add(buffer + 4096, 4096);
+  PersistBatch::Add(buffer, 0);
+  ASSERT_EQ(PersistBatch::GetPendingLines(), 3 + 64);
+  PersistBatch::Drain();
+  ASSERT_EQ(PersistBatch::GetPendingLines(), 0);
+
+  // Too many ranges to keep drain the earlier ones
+  for (uint32_t i = 0; i <= PersistBatch::kMaxRanges; ++i) {
+    PersistBatch::Add(buffer + i * 256, 1);
+  }
+  ASSERT_EQ(PersistBatch::GetPendingLines(), 1);
+  PersistBatch::Drain();
+}
+
+TEST(PersistBatchTest, Stream) {
+  using bztree::PersistBatch;
+  alignas(64) static char src[8192];
+  alignas(64) static char dst[8192];
+  for (uint32_t i = 0; i < sizeof(src); ++i) {
+    src[i] = static_cast<char>(i * 31);
+  }
+  PersistBatch::Drain();
+  // Whole 16-byte words are streamed, only the lines at the ends are left
+  // to write back
+  for (uint32_t offset : {0, 8, 24}) {
+    for (uint32_t size : {8, 16, 40, 4096, 4104}) {
+      memset(dst, 0, sizeof(dst));
+      PersistBatch::Stream(dst + offset, src, size);
+      ASSERT_EQ(memcmp(dst + offset, src, size), 0);
+      ASSERT_EQ(dst[offset + size], 0);
+      ASSERT_LE(PersistBatch::GetPendingLines(), 2);
+      PersistBatch::Drain();
+    }
+  }
+}
+
+TEST(NodeAllocatorTest, ThreadCaches) {
+  bztree::NodeAllocator::UseHugePages(true);
+  static const uint32_t kThreads = 4;
+  static const uint32_t kNodes = 2000;
+  auto run = [](std::vector<char *> *nodes) {
+    for (uint32_t i = 0; i < kNodes; ++i) {
+      void *mem = nullptr;
+      bztree::NodeAllocator::Allocate(&mem, 4096);
+      memset(mem, static_cast<int>(i), 4096);
+      nodes->push_back(static_cast<char *>(mem));
+    }
+    // A few nodes freed by a thread are what it gets back next
+    std::set<char *> freed;
+    for (uint32_t i = 0; i < 32; i += 2) {
+      freed.insert((*nodes)[i]);
+      bztree::NodeAllocator::Free((*nodes)[i]);
+    }
+    for (uint32_t i = 0; i < 32; i += 2) {
+      void *mem = nullptr;
+      bztree::NodeAllocator::Allocate(&mem, 4096);
+      ASSERT_EQ(freed.count(static_cast<char *>(mem)), 1);
+      (*nodes)[i] = static_cast<char *>(mem);
+      memset(mem, static_cast<int>(i), 4096);
+    }
+    for (uint32_t i = 0; i < kNodes; ++i) {
+      ASSERT_EQ((*nodes)[i][4095], static_cast<char>(i));
+    }
+  };
+
+  std::vector<std::vector<char *>> nodes(kThreads);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < kThreads; ++t) {
+    threads.emplace_back(run, &nodes[t]);
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  std::set<char *> all;
+  for (auto &n : nodes) {
+    all.insert(n.begin(), n.end());
+  }
+  ASSERT_EQ(all.size(), kThreads * kNodes);
+
+  // Nodes outlive the threads that allocated them; once freed (by a thread
+  // that exits, leaving nothing cached) they are reused without new slabs
+  std::thread([&all] {
+    for (auto *node : all) {
+      bztree::NodeAllocator::Free(node);
+    }
+  }).join();
+  auto slab_bytes = bztree::NodeAllocator::GetSlabBytes();
+  std::vector<std::thread> again;
+  for (uint32_t t = 0; t < kThreads; ++t) {
+    nodes[t].clear();
+    again.emplace_back(run, &nodes[t]);
+  }
+  for (auto &t : again) {
+    t.join();
+  }
+  ASSERT_EQ(bztree::NodeAllocator::GetSlabBytes(), slab_bytes);
+  for (auto &n : nodes) {
+    for (auto *node : n) {
+      bztree::NodeAllocator::Free(node);
+    }
+  }
+  bztree::NodeAllocator::UseHugePages(false);
+}
+
+TEST_F(BzTreeTest, NumaPlacement) {
+  auto numa_nodes = bztree::NodeAllocator::GetNumaNodeCount();
+  ASSERT_GE(numa_nodes, 1);
+  ASSERT_LE(numa_nodes, bztree::NodeAllocator::kMaxNumaNodes);
+  ASSERT_LT(bztree::NodeAllocator::GetNumaNode(), numa_nodes);
+
+  // Local leaves and interleaved internal nodes come from slabs of their own,
+  // and freed nodes go back to the slabs of their placement
+  bztree::NodeAllocator::UseHugePages(true);
+  bztree::NodeAllocator::SetNumaPlacement(bztree::NodeAllocator::kNumaLocalLeaves);
+  void *leaf = nullptr;
+  void *internal = nullptr;
+  bztree::NodeAllocator::Allocate(&leaf, 4096);
+  bztree::NodeAllocator::Allocate(&internal, 4096, true);
+  ASSERT_NE(reinterpret_cast<uintptr_t>(leaf) / bztree::NodeAllocator::kSlabSize,
+            reinterpret_cast<uintptr_t>(internal) / bztree::NodeAllocator::kSlabSize);
+  bztree::NodeAllocator::Free(internal);
+  void *mem = nullptr;
+  bztree::NodeAllocator::Allocate(&mem, 4096);
+  ASSERT_NE(mem, internal);
+  bztree::NodeAllocator::Free(mem);
+  bztree::NodeAllocator::Allocate(&mem, 4096, true);
+  ASSERT_EQ(mem, internal);
+  bztree::NodeAllocator::Free(mem);
+  bztree::NodeAllocator::Free(leaf);
+
+  bztree::BzTree::ParameterSet param(3072, 0, 4096);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 20000;
+  auto read_all = [&]() {
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      uint64_t payload = 0;
+      auto key = std::to_string(100000 + i);
+      ASSERT_TRUE(t->Read(key.c_str(), key.length(), &payload).IsOk());
+      ASSERT_EQ(payload, i);
+    }
+  };
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + (i * 7919) % kKeys);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), (i * 7919) % kKeys).IsOk());
+  }
+  read_all();
+
+  // Copies of internal nodes on each socket, and back to one copy per node
+  t->EnableInternalNodeCache(true, true);
+  read_all();
+  for (uint32_t i = 0; i < kKeys; i += 2) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Update(key.c_str(), key.length(), i).IsOk());
+  }
+  read_all();
+  t->EnableInternalNodeCache(true);
+  read_all();
+  t->EnableInternalNodeCache(false);
+  t.reset();
+  bztree::NodeAllocator::SetNumaPlacement(bztree::NodeAllocator::kNumaFirstTouch);
+  bztree::NodeAllocator::UseHugePages(false);
+}
+
+TEST_F(BzTreeTest, BulkLoad) {
+  // A separate tree, the fixture's one isn't empty
+  bztree::BzTree::ParameterSet param(3072, 0, 4096);
+  std::unique_ptr<bztree::BzTree> loaded(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 100000;
+  uint32_t i = 0;
+  std::string key;
+  auto next = [&](const char **k, uint16_t *k_size, uint64_t *payload) {
+    if (i == kKeys) {
+      return false;
+    }
+    key = std::to_string(1000000 + i);
+    *k = key.c_str();
+    *k_size = static_cast<uint16_t>(key.length());
+    *payload = i++;
+    return true;
+  };
+  ASSERT_TRUE(loaded->BulkLoad(next, 0.7).IsOk());
+
+  for (uint32_t j = 0; j < kKeys; ++j) {
+    auto k = std::to_string(1000000 + j);
+    uint64_t payload = 0;
+    ASSERT_TRUE(loaded->Read(k.c_str(), static_cast<uint16_t>(k.length()), &payload).IsOk());
+    ASSERT_EQ(payload, j);
+  }
+  auto iter = loaded->RangeScanByKey("1000000", 7, true, nullptr, 0, false);
+  uint64_t expected = 0;
+  while (auto r = iter->GetNext()) {
+    ASSERT_EQ(r->GetPayload(), expected++);
+  }
+  ASSERT_EQ(expected, kKeys);
+
+  // The loaded tree takes regular inserts, splits and all
+  for (uint32_t j = 0; j < 20000; ++j) {
+    auto k = std::to_string(1000000 + j) + "5";
+    ASSERT_TRUE(loaded->Insert(k.c_str(), static_cast<uint16_t>(k.length()), j).IsOk());
+  }
+  uint64_t payload = 0;
+  ASSERT_TRUE(loaded->Read("10199995", 8, &payload).IsOk());
+  ASSERT_EQ(payload, 19999);
+
+  // Only empty trees, and only increasing keys
+  i = 0;
+  ASSERT_TRUE(loaded->BulkLoad(next).IsKeyExists());
+  std::unique_ptr<bztree::BzTree> unsorted(bztree::BzTree::New(param, pool));
+  uint32_t calls = 0;
+  auto bad_next = [&](const char **k, uint16_t *k_size, uint64_t *payload) {
+    static const char *keys[] = {"a", "c", "b"};
+    if (calls == 3) {
+      return false;
+    }
+    *k = keys[calls++];
+    *k_size = 1;
+    *payload = calls;
+    return true;
+  };
+  ASSERT_TRUE(unsorted->BulkLoad(bad_next).IsKeyExists());
+  ASSERT_TRUE(unsorted->Read("a", 1, &payload).IsNotFound());
+}
+
+TEST_F(BzTreeTest, ParallelBulkLoad) {
+  bztree::BzTree::ParameterSet param(3072, 0, 4096);
+  std::unique_ptr<bztree::BzTree> loaded(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 200000;
+  std::vector<std::string> keys;
+  std::vector<const char *> key_ptrs;
+  std::vector<uint16_t> key_sizes;
+  std::vector<uint64_t> payloads;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    keys.emplace_back(std::to_string(1000000 + i));
+  }
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    key_ptrs.emplace_back(keys[i].c_str());
+    key_sizes.emplace_back(static_cast<uint16_t>(keys[i].length()));
+    payloads.emplace_back(i);
+  }
+
+  // Out of order right at a slice boundary
+  std::swap(key_ptrs[kKeys / 2 - 1], key_ptrs[kKeys / 2]);
+  ASSERT_TRUE(loaded->BulkLoad(key_ptrs.data(), key_sizes.data(), payloads.data(), kKeys, 4)
+                  .IsKeyExists());
+  std::swap(key_ptrs[kKeys / 2 - 1], key_ptrs[kKeys / 2]);
+
+  ASSERT_TRUE(loaded->BulkLoad(key_ptrs.data(), key_sizes.data(), payloads.data(), kKeys, 4)
+                  .IsOk());
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    uint64_t payload = 0;
+    ASSERT_TRUE(loaded->Read(key_ptrs[i], key_sizes[i], &payload).IsOk());
+    ASSERT_EQ(payload, i);
+  }
+  auto iter = loaded->ReverseRangeScanByKey(nullptr, 0, false, nullptr, 0, false);
+  uint64_t expected = kKeys;
+  while (auto r = iter->GetNext()) {
+    ASSERT_EQ(r->GetPayload(), --expected);
+  }
+  ASSERT_EQ(expected, 0);
+}
+
+TEST_F(BzTreeTest, Export) {
+  auto path = testing::TempDir() + "bztree_export_test";
+  bztree::BzTree::ParameterSet param(1024, 512, 1024, 0, true);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 20000;
+  for (uint32_t i = 0; i < kKeys / 2; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  remove(path.c_str());
+  ASSERT_TRUE(t->Export(path.c_str(), 4096).IsOk());
+  auto image = bztree::ExportImage::Open(path.c_str());
+  ASSERT_NE(image, nullptr);
+  ASSERT_EQ(image->GetRecordCount(), kKeys / 2);
+  image.reset();
+
+  // Cut short where the first half ends: the rest is added on resuming
+  bztree::ExportHeader header;
+  FILE *file = fopen(path.c_str(), "r+");
+  ASSERT_EQ(fread(&header, sizeof(header), 1, file), 1);
+  header.complete = 0;
+  rewind(file);
+  ASSERT_EQ(fwrite(&header, sizeof(header), 1, file), 1);
+  fclose(file);
+  ASSERT_EQ(bztree::ExportImage::Open(path.c_str()), nullptr);
+  for (uint32_t i = kKeys / 2; i < kKeys; ++i) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  ASSERT_TRUE(t->Export(path.c_str(), 4096).IsOk());
+
+  image = bztree::ExportImage::Open(path.c_str());
+  ASSERT_NE(image, nullptr);
+  ASSERT_EQ(image->GetRecordCount(), kKeys);
+  uint32_t expected = 0;
+  for (auto *r = image->First(); r; r = image->Next(r)) {
+    ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), std::to_string(100000 + expected));
+    ASSERT_EQ(r->GetPayload(), expected++);
+  }
+  ASSERT_EQ(expected, kKeys);
+  std::unique_ptr<bztree::BzTree> loaded(bztree::BzTree::New(param, pool));
+  ASSERT_TRUE(image->Load(loaded.get()).IsOk());
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    uint64_t payload = 0;
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(loaded->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+  }
+
+  // Variable-length payloads are inserted instead
+  ASSERT_TRUE(t->Insert("v", 1, "payload", 7).IsOk());
+  ASSERT_TRUE(t->Export(path.c_str()).IsOk());
+  image = bztree::ExportImage::Open(path.c_str());
+  ASSERT_EQ(image->GetRecordCount(), kKeys + 1);
+  loaded.reset(bztree::BzTree::New(param, pool));
+  ASSERT_TRUE(image->Load(loaded.get()).IsOk());
+  char buffer[16];
+  uint32_t size = sizeof(buffer);
+  ASSERT_TRUE(loaded->Read("v", 1, buffer, &size).IsOk());
+  ASSERT_EQ(std::string(buffer, size), "payload");
+  ASSERT_TRUE(image->Load(loaded.get()).IsKeyExists());
+  image.reset();
+  remove(path.c_str());
+
+  ASSERT_TRUE(t->Export("/nonexistent/bztree_export_test").IsIOError());
+}
+
+TEST_F(BzTreeTest, FrozenTree) {
+  auto path = testing::TempDir() + "bztree_frozen_test";
+  bztree::BzTree::ParameterSet param(1024, 512, 1024, 0, true);
+  std::unique_ptr<bztree::BzTree> t(bztree::BzTree::New(param, pool));
+  static const uint32_t kKeys = 20000;
+  for (uint32_t i = 0; i < kKeys; i += 2) {
+    auto key = std::to_string(100000 + i);
+    ASSERT_TRUE(t->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  ASSERT_TRUE(t->Insert("v", 1, "a variable-length payload", 25).IsOk());
+  ASSERT_TRUE(bztree::FrozenTree::Write(t.get(), path.c_str()).IsOk());
+  t.reset();
+
+  auto frozen = bztree::FrozenTree::Open(path.c_str());
+  ASSERT_NE(frozen, nullptr);
+  ASSERT_EQ(frozen->GetRecordCount(), kKeys / 2 + 1);
+  ASSERT_GT(frozen->GetHeight(), 1);
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    uint64_t payload = 0;
+    auto key = std::to_string(100000 + i);
+    auto rc = frozen->Read(key.c_str(), key.length(), &payload);
+    ASSERT_EQ(rc.IsOk(), i % 2 == 0);
+    if (rc.IsOk()) {
+      ASSERT_EQ(payload, i);
+    }
+  }
+  char buffer[32];
+  uint32_t size = sizeof(buffer);
+  ASSERT_TRUE(frozen->Read("v", 1, buffer, &size).IsOk());
+  ASSERT_EQ(std::string(buffer, size), "a variable-length payload");
+  uint64_t payload = 0;
+  ASSERT_TRUE(frozen->Read("v", 1, &payload).IsNotEnoughSpace());
+  ASSERT_TRUE(frozen->Read("0", 1, &payload).IsNotFound());
+  ASSERT_TRUE(frozen->Read("w", 1, &payload).IsNotFound());
+
+  // Across leaves, with each kind of bound
+  bztree::ScanBuffer records;
+  ASSERT_TRUE(frozen->RangeScanByKey("101000", 6, false, "107000", 6, true, 10000,
+                                     &records).IsOk());
+  uint32_t expected = 1002;
+  for (auto *r = records.First(); r; r = records.Next(r)) {
+    ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), std::to_string(100000 + expected));
+    ASSERT_EQ(r->GetPayload(), expected);
+    expected += 2;
+  }
+  ASSERT_EQ(expected, 7002);
+  ASSERT_TRUE(frozen->RangeScanBySize("119990", 6, 100, &records).IsOk());
+  ASSERT_EQ(records.Count(), 6);
+  ASSERT_TRUE(frozen->RangeScanByKey(nullptr, 0, true, nullptr, 0, false, 300, &records).IsOk());
+  ASSERT_EQ(records.Count(), 300);
+  frozen.reset();
+
+  // An empty tree is a single empty leaf
+  t.reset(bztree::BzTree::New(param, pool));
+  ASSERT_TRUE(bztree::FrozenTree::Write(t.get(), path.c_str()).IsOk());
+  frozen = bztree::FrozenTree::Open(path.c_str());
+  ASSERT_NE(frozen, nullptr);
+  ASSERT_EQ(frozen->GetHeight(), 0);
+  ASSERT_TRUE(frozen->Read("100000", 6, &payload).IsNotFound());
+  ASSERT_TRUE(frozen->RangeScanBySize("", 0, 10, &records).IsOk());
+  ASSERT_EQ(records.Count(), 0);
+  frozen.reset();
+  remove(path.c_str());
+}
+
+TEST_F(BzTreeTest, U64Keys) {
+  bztree::BzTreeT<bztree::U64KeyPolicy> typed(tree);
+  std::mt19937_64 rng(7);
+  std::set<uint64_t> keys = {0, 1, 255, 256, std::numeric_limits<uint64_t>::max()};
+  while (keys.size() < 2000) {
+    // Some keys only differ in their low bytes
+    keys.insert(keys.size() % 2 ? rng() : rng() % 4096);
+  }
+  // Payloads keep clear of the top three bits, which PMwCAS takes for itself
+  for (auto key : keys) {
+    ASSERT_TRUE(typed.Insert(key, key >> 3).IsOk());
+  }
+  ASSERT_TRUE(typed.Insert(255, 0).IsKeyExists());
+
+  // The integer path must end up in the same leaf as the generic one, for keys
+  // that are there and keys that are not, on either side of a separator
+  for (uint32_t i = 0; i < 4000; ++i) {
+    uint64_t key = i < 2000 ? *std::next(keys.begin(), i) : rng() % 8192;
+    uint64_t payload = 0;
+    auto rc = typed.Read(key, &payload);
+    ASSERT_EQ(rc.IsOk(), keys.count(key) == 1);
+    if (rc.IsOk()) {
+      ASSERT_EQ(payload, key >> 3);
+    }
+    auto encoded = bztree::U64KeyPolicy::Encode(key);
+    auto *k = bztree::U64KeyPolicy::GetData(encoded);
+    for (bool le : {true, false}) {
+      ASSERT_EQ(tree->TraverseToLeaf<bztree::U64KeyPolicy>(nullptr, k, 8, le),
+                tree->TraverseToLeaf(nullptr, k, 8, le));
+    }
+  }
+
+  ASSERT_TRUE(typed.Update(256, 1).IsOk());
+  ASSERT_TRUE(typed.Delete(255).IsOk());
+  uint64_t payload = 0;
+  ASSERT_TRUE(typed.Read(256, &payload).IsOk());
+  ASSERT_EQ(payload, 1);
+  ASSERT_TRUE(typed.Read(255, &payload).IsNotFound());
+
+  // Keys come back in numeric order
+  auto iter = typed.RangeScanByKey(0, true, std::numeric_limits<uint64_t>::max(), true);
+  keys.erase(255);
+  auto expected = keys.begin();
+  while (auto r = iter->GetNext()) {
+    ASSERT_EQ(bztree::U64KeyPolicy::Decode(r->GetKey(), r->meta.GetKeyLength()), *expected++);
+  }
+  ASSERT_TRUE(expected == keys.end());
+}
+
+TEST_F(BzTreeTest, PrefixCompression) {
+  bztree::BzTree::ParameterSet param(1024, 0, 1024, 0, true);
+  std::unique_ptr<bztree::BzTree> compressed(bztree::BzTree::New(param, pool));
+  auto make_key = [](uint32_t i) {
+    return "https://example.com/users/" + std::to_string(i % 10) + "/items/" + std::to_string(i);
+  };
+
+  static const uint32_t kMaxKey = 5000;
+  std::mt19937 rng(7);
+  std::vector<uint32_t> order(kMaxKey);
+  for (uint32_t i = 0; i < kMaxKey; ++i) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), rng);
+  for (auto i : order) {
+    auto key = make_key(i);
+    if (i % 3) {
+      ASSERT_TRUE(compressed->Insert(key.c_str(), key.length(), i).IsOk());
+    } else {
+      ASSERT_TRUE(compressed->Insert(key.c_str(), key.length(), key.c_str(), key.length()).IsOk());
+    }
+  }
+
+  // Leaves in the middle leave the shared part out
+  auto middle = make_key(kMaxKey / 2);
+  auto *leaf = compressed->TraverseToLeaf(nullptr, middle.c_str(), middle.length());
+  ASSERT_GE(leaf->GetPrefixSize(), strlen("https://example.com/users/"));
+
+  for (uint32_t i = 0; i < kMaxKey; i += 2) {
+    auto key = make_key(i);
+    if (i % 4) {
+      ASSERT_TRUE(compressed->Delete(key.c_str(), key.length()).IsOk());
+    } else {
+      ASSERT_TRUE(compressed->Update(key.c_str(), key.length(), i + 1).IsOk());
+    }
+  }
+  for (uint32_t i = 0; i < kMaxKey; ++i) {
+    auto key = make_key(i);
+    uint64_t payload = 0;
+    auto rc = compressed->Read(key.c_str(), key.length(), &payload);
+    if (i % 4 == 2) {
+      ASSERT_TRUE(rc.IsNotFound());
+    } else if (i % 2 == 0) {
+      ASSERT_TRUE(rc.IsOk());
+      ASSERT_EQ(payload, i + 1);
+    } else if (i % 3) {
+      ASSERT_TRUE(rc.IsOk());
+      ASSERT_EQ(payload, i);
+    } else {
+      std::string value(key.length(), 0);
+      uint32_t value_size = value.size();
+      ASSERT_TRUE(compressed->Read(key.c_str(), key.length(), &value[0], &value_size).IsOk());
+      ASSERT_EQ(value, key);
+    }
+  }
+  auto absent = std::string("https://example.com/users/1/items/");
+  uint64_t payload = 0;
+  ASSERT_TRUE(compressed->Read(absent.c_str(), absent.length(), &payload).IsNotFound());
+
+  // Scans see whole keys in order, across leaves with different prefixes
+  std::set<std::string> expected;
+  for (uint32_t i = 0; i < kMaxKey; ++i) {
+    if (i % 4 != 2) {
+      expected.insert(make_key(i));
+    }
+  }
+  auto iter = compressed->RangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+  auto it = expected.begin();
+  while (auto r = iter->GetNext()) {
+    ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), *it++);
+  }
+  ASSERT_TRUE(it == expected.end());
+  auto riter = compressed->ReverseRangeScanByKey(nullptr, 0, true, nullptr, 0, true);
+  auto rit = expected.rbegin();
+  while (auto r = riter->GetNext()) {
+    ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), *rit++);
+  }
+  ASSERT_TRUE(rit == expected.rend());
+
+  // Integer keys share their high bytes, those reads take the generic path
+  std::unique_ptr<bztree::BzTree> integers(bztree::BzTree::New(param, pool));
+  bztree::BzTreeT<bztree::U64KeyPolicy> typed(integers.get());
+  for (uint64_t i = 0; i < kMaxKey; ++i) {
+    ASSERT_TRUE(typed.Insert(i * 3, i).IsOk());
+  }
+  for (uint64_t i = 0; i < kMaxKey * 3; ++i) {
+    auto rc = typed.Read(i, &payload);
+    ASSERT_EQ(rc.IsOk(), i % 3 == 0);
+    if (rc.IsOk()) {
+      ASSERT_EQ(payload, i / 3);
+    }
+  }
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
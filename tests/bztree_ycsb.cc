@@ -0,0 +1,389 @@
+// Copyright (c) Simon Fraser University. All rights reserved.
+// Licensed under the MIT license.
+//
+// A YCSB-style workload driver: loads [records] keys with [threads] threads,
+// then runs [operations] operations of a read/update/insert/scan/delete mix
+// over keys drawn from a uniform, zipfian or latest distribution, and prints
+// the throughput, the tree's latency histograms and its counters. Options are
+// given as --name=value, see Options below.
+//
+// Keys are 8-byte ids, hashed so that loading them inserts in random key
+// order as YCSB does, and stored big-endian so they sort by value
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../bztree.h"
+
+namespace {
+
+struct Options {
+  uint64_t records = 1000000;
+  uint64_t operations = 1000000;
+  uint32_t threads = 1;
+  // Percent of the operations of each kind, summing up to 100
+  uint32_t read = 50;
+  uint32_t update = 50;
+  uint32_t insert = 0;
+  uint32_t scan = 0;
+  uint32_t remove = 0;
+  uint32_t scan_size = 100;
+  std::string distribution = "zipfian";
+  double theta = 0.99;
+  // Pin thread i to core i (modulo the number of cores)
+  bool pin = true;
+  uint32_t node_size = 1024;
+  uint32_t descriptor_pool_size = 100000;
+  // PMDK builds only: pool file, which must not exist, and its size
+  std::string pool_path = "bztree_ycsb_pool";
+  uint64_t pool_size = 4ull * 1024 * 1024 * 1024;
+  // Builds with ENABLE_PERF_EVENTS=1: write the run's bztree::PerfProfile to
+  // <perf_folded>.<counter>.folded, one file per counter
+  std::string perf_folded;
+};
+
+bool ParseOption(const char *arg, Options *opt) {
+  const char *eq = strchr(arg, '=');
+  if (strncmp(arg, "--", 2) != 0 || !eq) {
+    return false;
+  }
+  std::string name(arg + 2, eq - arg - 2);
+  const char *value = eq + 1;
+  if (name == "records") {
+    opt->records = strtoull(value, nullptr, 10);
+  } else if (name == "operations") {
+    opt->operations = strtoull(value, nullptr, 10);
+  } else if (name == "threads") {
+    opt->threads = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  } else if (name == "read") {
+    opt->read = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  } else if (name == "update") {
+    opt->update = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  } else if (name == "insert") {
+    opt->insert = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  } else if (name == "scan") {
+    opt->scan = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  } else if (name == "delete") {
+    opt->remove = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  } else if (name == "scan_size") {
+    opt->scan_size = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  } else if (name == "distribution") {
+    opt->distribution = value;
+  } else if (name == "theta") {
+    opt->theta = strtod(value, nullptr);
+  } else if (name == "pin") {
+    opt->pin = strcmp(value, "0") != 0;
+  } else if (name == "node_size") {
+    opt->node_size = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  } else if (name == "descriptor_pool_size") {
+    opt->descriptor_pool_size = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  } else if (name == "pool_path") {
+    opt->pool_path = value;
+  } else if (name == "pool_size") {
+    opt->pool_size = strtoull(value, nullptr, 10);
+  } else if (name == "perf_folded") {
+    opt->perf_folded = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// YCSB's zipfian generator (Gray et al., "Quickly generating billion-record
+// synthetic databases"): item 0 is the most popular one
+class ZipfianGenerator {
+ public:
+  ZipfianGenerator(uint64_t items, double theta) : items_(items), theta_(theta) {
+    zetan_ = Zeta(items, theta);
+    alpha_ = 1.0 / (1.0 - theta);
+    eta_ = (1 - std::pow(2.0 / items, 1 - theta)) / (1 - Zeta(2, theta) / zetan_);
+  }
+
+  uint64_t Next(std::mt19937_64 &rng) {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetan_;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < 1.0 + std::pow(0.5, theta_)) {
+      return 1;
+    }
+    auto item = static_cast<uint64_t>(items_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+    return std::min<uint64_t>(items_ - 1, item);
+  }
+
+ private:
+  static double Zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; ++i) {
+      sum += 1.0 / std::pow(static_cast<double>(i), theta);
+    }
+    return sum;
+  }
+
+  uint64_t items_;
+  double theta_;
+  double zetan_;
+  double alpha_;
+  double eta_;
+};
+
+// FNV-1a of the id, so that consecutive ids land all over the key space
+inline uint64_t HashId(uint64_t id) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (uint32_t i = 0; i < 8; ++i) {
+    hash = (hash ^ ((id >> (i * 8)) & 0xff)) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+struct Key {
+  explicit Key(uint64_t id) : encoded(bztree::U64KeyPolicy::Encode(HashId(id))) {}
+  const char *data() const { return bztree::U64KeyPolicy::GetData(encoded); }
+  bztree::U64KeyPolicy::EncodedKey encoded;
+};
+
+enum Op { kRead, kUpdate, kInsert, kScan, kDelete, kOps };
+const char *kOpNames[kOps] = {"read", "update", "insert", "scan", "delete"};
+
+// Operations done and those that didn't find (or, for inserts, found) their key
+struct Counts {
+  uint64_t done[kOps] = {};
+  uint64_t failed[kOps] = {};
+};
+
+class Workload {
+ public:
+  Workload(const Options &opt, bztree::BzTree *tree)
+      : opt_(opt), tree_(tree), inserted_(opt.records),
+        zipfian_(opt.records, opt.theta) {}
+
+  void Load(uint32_t thread_id) {
+    for (uint64_t id = thread_id; id < opt_.records; id += opt_.threads) {
+      Key key(id);
+      tree_->Insert(key.data(), sizeof(uint64_t), id);
+    }
+  }
+
+  // Counts on the stack, stored to [counts] once done: the threads' slots are
+  // next to each other
+  void Run(uint32_t thread_id, Counts *counts) {
+    Counts local;
+    std::mt19937_64 rng(thread_id + 1);
+    bztree::ScanBuffer buffer;
+    uint64_t operations = opt_.operations / opt_.threads +
+                          (thread_id < opt_.operations % opt_.threads);
+    for (uint64_t i = 0; i < operations; ++i) {
+      uint32_t dice = rng() % 100;
+      Op op = kDelete;
+      uint32_t bound = 0;
+      for (uint32_t candidate = kRead; candidate < kDelete; ++candidate) {
+        bound += mix_[candidate];
+        if (dice < bound) {
+          op = static_cast<Op>(candidate);
+          break;
+        }
+      }
+      bool ok = true;
+      if (op == kInsert) {
+        uint64_t id = inserted_.fetch_add(1);
+        Key key(id);
+        ok = tree_->Insert(key.data(), sizeof(uint64_t), id).IsOk();
+      } else {
+        Key key(NextId(rng));
+        if (op == kRead) {
+          uint64_t payload = 0;
+          ok = tree_->Read(key.data(), sizeof(uint64_t), &payload).IsOk();
+        } else if (op == kUpdate) {
+          ok = tree_->Update(key.data(), sizeof(uint64_t), i).IsOk();
+        } else if (op == kScan) {
+          ok = tree_->RangeScanBySize(key.data(), sizeof(uint64_t), opt_.scan_size,
+                                      &buffer).IsOk();
+        } else {
+          ok = tree_->Delete(key.data(), sizeof(uint64_t)).IsOk();
+        }
+      }
+      ++local.done[op];
+      local.failed[op] += !ok;
+    }
+    *counts = local;
+  }
+
+ private:
+  // An id that was loaded or inserted by now
+  uint64_t NextId(std::mt19937_64 &rng) {
+    uint64_t count = inserted_.load(std::memory_order_relaxed);
+    if (opt_.distribution == "uniform") {
+      return rng() % count;
+    } else if (opt_.distribution == "latest") {
+      // Most popular are the latest inserts; ranks beyond the initial
+      // records are clamped
+      return count - 1 - std::min(zipfian_.Next(rng), count - 1);
+    }
+    // Scrambled, so the popular ids aren't next to each other
+    return HashId(zipfian_.Next(rng)) % count;
+  }
+
+  const Options &opt_;
+  bztree::BzTree *tree_;
+  const uint32_t mix_[kOps] = {opt_.read, opt_.update, opt_.insert, opt_.scan, opt_.remove};
+  // Ids are [0, inserted_), though some might be deleted or not there yet
+  std::atomic<uint64_t> inserted_;
+  ZipfianGenerator zipfian_;
+};
+
+void PinThread(uint32_t thread_id) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(thread_id % std::thread::hardware_concurrency(), &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+// Run [body(thread_id)] on [opt.threads] threads, return the seconds taken
+template <class Body>
+double RunThreads(const Options &opt, Body body) {
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < opt.threads; ++i) {
+    threads.emplace_back([&, i] {
+      if (opt.pin) {
+        PinThread(i);
+      }
+      body(i);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bztree::BzTree *CreateTree(const Options &opt) {
+  bztree::BzTree::ParameterSet param(opt.node_size, opt.node_size / 2, opt.node_size);
+#ifdef PMDK
+  struct stat buffer;
+  if (stat(opt.pool_path.c_str(), &buffer) == 0) {
+    std::cerr << opt.pool_path << " exists, remove it first" << std::endl;
+    exit(1);
+  }
+  pmwcas::InitLibrary(pmwcas::PMDKAllocator::Create(opt.pool_path.c_str(), "bztree_layout",
+                                                    opt.pool_size),
+                      pmwcas::PMDKAllocator::Destroy, pmwcas::LinuxEnvironment::Create,
+                      pmwcas::LinuxEnvironment::Destroy);
+  auto pmdk_allocator = reinterpret_cast<pmwcas::PMDKAllocator *>(pmwcas::Allocator::Get());
+  bztree::Allocator::Init(pmdk_allocator);
+
+  auto *tree = reinterpret_cast<bztree::BzTree *>(
+      pmdk_allocator->GetRoot(sizeof(bztree::BzTree)));
+  pmwcas::DescriptorPool *pool = nullptr;
+  pmdk_allocator->Allocate(reinterpret_cast<void **>(&pool), sizeof(pmwcas::DescriptorPool));
+  new (pool) pmwcas::DescriptorPool(opt.descriptor_pool_size, opt.threads, false);
+  new (tree) bztree::BzTree(param, pool, reinterpret_cast<uint64_t>(pmdk_allocator->GetPool()));
+  pmdk_allocator->PersistPtr(tree, sizeof(bztree::BzTree));
+  pmdk_allocator->PersistPtr(pool, sizeof(pmwcas::DescriptorPool));
+  return tree;
+#else
+  pmwcas::InitLibrary(pmwcas::TlsAllocator::Create, pmwcas::TlsAllocator::Destroy,
+                      pmwcas::LinuxEnvironment::Create, pmwcas::LinuxEnvironment::Destroy);
+  auto *pool = new pmwcas::DescriptorPool(opt.descriptor_pool_size, opt.threads, false);
+  return bztree::BzTree::New(param, pool);
+#endif
+}
+
+void PrintStats(bztree::BzTree *tree) {
+  auto stats = tree->GetStats();
+  std::cout << "leaf splits = " << stats.leaf_splits
+            << ", internal splits = " << stats.internal_splits
+            << ", consolidations = " << stats.consolidations
+            << ", merges = " << stats.merges
+            << ", smo failures = " << stats.smo_failures << std::endl
+            << "freeze retries = " << stats.freeze_retries
+            << ", pmwcas failures = " << stats.pmwcas_failures
+            << ", smo helps = " << stats.smo_helps << std::endl
+            << "descriptor allocations = " << stats.descriptor_allocations
+            << ", slow = " << stats.slow_descriptor_allocations
+            << ", aborts = " << stats.descriptor_aborts << std::endl;
+  auto space = tree->GetSpaceStats();
+  std::cout << "levels = " << space.levels << ", records = " << space.records
+            << ", space amplification = " << space.GetSpaceAmplification() << std::endl;
+}
+
+void DumpPerfProfile(const std::string &prefix) {
+  static const char *kCounterNames[bztree::PerfProfile::kCounters] = {
+      "task_clock", "cycles", "instructions", "cache_misses", "dtlb_misses", "raw"};
+  for (uint32_t i = 0; i < bztree::PerfProfile::kCounters; ++i) {
+    std::ostringstream folded;
+    bztree::PerfProfile::DumpFolded(folded, static_cast<bztree::PerfProfile::Counter>(i));
+    if (!folded.str().empty()) {
+      std::ofstream(prefix + "." + kCounterNames[i] + ".folded") << folded.str();
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options opt;
+  for (int i = 1; i < argc; ++i) {
+    if (!ParseOption(argv[i], &opt)) {
+      std::cerr << "unknown option " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+  if (opt.read + opt.update + opt.insert + opt.scan + opt.remove != 100 || opt.threads == 0 ||
+      opt.records < 2 || (opt.distribution != "uniform" && opt.distribution != "zipfian" &&
+                          opt.distribution != "latest") ||
+      !(opt.theta > 0 && opt.theta < 1)) {
+    // The zipfian generator divides by 1 - theta
+    std::cerr << "the mix must sum up to 100, with at least one thread and two records, a"
+              << " uniform, zipfian or latest distribution, and a theta in (0, 1)" << std::endl;
+    return 1;
+  }
+
+  auto *tree = CreateTree(opt);
+  Workload workload(opt, tree);
+  double seconds = RunThreads(opt, [&](uint32_t i) { workload.Load(i); });
+  std::cout << "load: " << opt.records << " records in " << seconds << " s, "
+            << opt.records / seconds / 1e6 << " Mops/s" << std::endl;
+
+  tree->EnableLatencyHistograms(true);
+  bztree::PerfProfile::Reset();
+  std::vector<Counts> counts(opt.threads);
+  seconds = RunThreads(opt, [&](uint32_t i) { workload.Run(i, &counts[i]); });
+  std::cout << "run: " << opt.operations << " operations in " << seconds << " s, "
+            << opt.operations / seconds / 1e6 << " Mops/s" << std::endl;
+  for (uint32_t op = kRead; op < kOps; ++op) {
+    Counts total;
+    for (auto &thread_counts : counts) {
+      total.done[op] += thread_counts.done[op];
+      total.failed[op] += thread_counts.failed[op];
+    }
+    if (total.done[op]) {
+      std::cout << kOpNames[op] << ": " << total.done[op] << " (" << total.failed[op]
+                << (op == kInsert ? " found the key)" : " missed the key)") << std::endl;
+    }
+  }
+  tree->DumpLatencyHistograms();
+  PrintStats(tree);
+  if (!opt.perf_folded.empty()) {
+    DumpPerfProfile(opt.perf_folded);
+  }
+#ifdef PMDK
+  bztree::Allocator::Uninit();
+#endif
+  pmwcas::Thread::ClearRegistry();
+  return 0;
+}